@@ -34,10 +34,10 @@
 #include <kj/exception.h>
 #include <kj/vector.h>
 #include <kj/units.h>
+#include <kj/map.h>
 #include "common.h"
 #include "message.h"
 #include "layout.h"
-#include <unordered_map>
 
 #if !CAPNP_LITE
 #include "capability.h"
@@ -241,7 +241,7 @@ private:
   // Optimize for single-segment messages so that small messages are handled quickly.
   SegmentReader segment0;
 
-  typedef std::unordered_map<uint, kj::Own<SegmentReader>> SegmentMap;
+  typedef kj::HashMap<uint, kj::Own<SegmentReader>> SegmentMap;
   kj::MutexGuarded<kj::Maybe<kj::Own<SegmentMap>>> moreSegments;
   // We need to mutex-guard the segment map because we lazily initialize segments when they are
   // first requested, but a Reader is allowed to be used concurrently in multiple threads.  Luckily
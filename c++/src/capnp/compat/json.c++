@@ -23,25 +23,22 @@
 #include <math.h>    // for HUGEVAL to check for overflow in strtod
 #include <stdlib.h>  // strtod
 #include <errno.h>   // for strtod errors
-#include <unordered_map>
 #include <capnp/orphan.h>
 #include <kj/debug.h>
 #include <kj/function.h>
 #include <kj/vector.h>
+#include <kj/map.h>
 
 namespace capnp {
 
 namespace {
 
-struct TypeHash {
-  size_t operator()(const Type& type) const {
-    return type.hashCode();
+struct FieldHashCallbacks {
+  inline uint hashCode(const StructSchema::Field& field) const {
+    return kj::hashCode(field.getIndex(), field.getContainingStruct().getProto().getId());
   }
-};
-
-struct FieldHash {
-  size_t operator()(const StructSchema::Field& field) const {
-    return field.getIndex() ^ field.getContainingStruct().getProto().getId();
+  inline bool matches(const StructSchema::Field& a, const StructSchema::Field& b) const {
+    return a == b;
   }
 };
 
@@ -52,8 +49,8 @@ struct JsonCodec::Impl {
   HasMode hasMode = HasMode::NON_NULL;
   size_t maxNestingDepth = 64;
 
-  std::unordered_map<Type, HandlerBase*, TypeHash> typeHandlers;
-  std::unordered_map<StructSchema::Field, HandlerBase*, FieldHash> fieldHandlers;
+  kj::HashMap<Type, HandlerBase*> typeHandlers;
+  kj::HashMap<StructSchema::Field, HandlerBase*, FieldHashCallbacks> fieldHandlers;
 
   kj::StringTree encodeRaw(JsonValue::Reader value, uint indent, bool& multiline,
                            bool hasPrefix) const {
@@ -229,9 +226,8 @@ void JsonCodec::encode(DynamicValue::Reader input, Type type, JsonValue::Builder
   // TODO(soon): For interfaces, check for handlers on superclasses, per documentation...
   // TODO(soon): For branded types, should we check for handlers on the generic?
   // TODO(someday): Allow registering handlers for "all structs", "all lists", etc?
-  auto iter = impl->typeHandlers.find(type);
-  if (iter != impl->typeHandlers.end()) {
-    iter->second->encodeBase(*this, input, output);
+  KJ_IF_MAYBE(handler, impl->typeHandlers.find(type)) {
+    (*handler)->encodeBase(*this, input, output);
     return;
   }
 
@@ -377,9 +373,8 @@ void JsonCodec::encode(DynamicValue::Reader input, Type type, JsonValue::Builder
 
 void JsonCodec::encodeField(StructSchema::Field field, DynamicValue::Reader input,
                             JsonValue::Builder output) const {
-  auto iter = impl->fieldHandlers.find(field);
-  if (iter != impl->fieldHandlers.end()) {
-    iter->second->encodeBase(*this, input, output);
+  KJ_IF_MAYBE(handler, impl->fieldHandlers.find(field)) {
+    (*handler)->encodeBase(*this, input, output);
     return;
   }
 
@@ -922,13 +917,13 @@ void JsonCodec::HandlerBase::decodeStructBase(
 }
 
 void JsonCodec::addTypeHandlerImpl(Type type, HandlerBase& handler) {
-  impl->typeHandlers[type] = &handler;
+  impl->typeHandlers.upsert(type, &handler);
 }
 
 void JsonCodec::addFieldHandlerImpl(StructSchema::Field field, Type type, HandlerBase& handler) {
   KJ_REQUIRE(type == field.getType(),
       "handler type did not match field type for addFieldHandler()");
-  impl->fieldHandlers[field] = &handler;
+  impl->fieldHandlers.upsert(field, &handler);
 }
 
 } // namespace capnp
@@ -284,7 +284,12 @@ public:
            .addOption({"no-standard-import"}, KJ_BIND_METHOD(*this, noStandardImport),
                       "Do not add any default import paths; use only those specified by -I.  "
                       "Otherwise, typically /usr/include and /usr/local/include are added by "
-                      "default.");
+                      "default.")
+           .addOptionWithArg({"cache-dir"}, KJ_BIND_METHOD(*this, setCacheDir), "<dir>",
+                             "Cache parsed schema files in <dir>, creating it if needed. Later "
+                             "runs using the same cache skip lexing and parsing of any file "
+                             "whose content is unchanged. The cache may be shared between "
+                             "source trees and concurrent runs.");
   }
 
   void addCompileOptions(kj::MainBuilder& builder) {
@@ -318,6 +323,18 @@ public:
     }
   }
 
+  kj::MainBuilder::Validity setCacheDir(kj::StringPtr path) {
+    auto parsed = disk->getCurrentPath().evalNative(path);
+    KJ_IF_MAYBE(dir, disk->getRoot().tryOpenSubdir(parsed,
+        kj::WriteMode::CREATE | kj::WriteMode::MODIFY | kj::WriteMode::CREATE_PARENT)) {
+      cacheDir = kj::mv(*dir);
+      loader.setParseCache(*cacheDir);
+      return true;
+    } else {
+      return "couldn't open directory";
+    }
+  }
+
   kj::MainBuilder::Validity noStandardImport() {
     addStandardImportPaths = false;
     return true;
@@ -1746,6 +1763,7 @@ public:
 private:
   kj::ProcessContext& context;
   kj::Own<kj::Filesystem> disk;
+  kj::Own<const kj::Directory> cacheDir;
   ModuleLoader loader;
   kj::SpaceFor<Compiler> compilerSpace;
   bool compilerConstructed = false;
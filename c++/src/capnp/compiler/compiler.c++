@@ -1319,7 +1319,9 @@ void Compiler::Impl::loadFinal(const SchemaLoader& loader, uint64_t id) {
 
 Compiler::Compiler(AnnotationFlag annotationFlag)
     : impl(kj::heap<Impl>(annotationFlag)),
-      loader(*this) {}
+      loader(*this) {
+  impl.setProfilingName("capnp::compiler::Compiler");
+}
 Compiler::~Compiler() noexcept(false) {}
 
 uint64_t Compiler::add(Module& module) const {
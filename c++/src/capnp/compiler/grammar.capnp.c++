@@ -2760,6 +2760,87 @@ const ::capnp::_::RawSchema s_84e4f3f5a807605c = {
   1, 1, i_84e4f3f5a807605c, nullptr, nullptr, { &s_84e4f3f5a807605c, nullptr, nullptr, 0, 0, nullptr }
 };
 #endif  // !CAPNP_LITE
+static const ::capnp::_::AlignedData<67> b_df29a35ab986b929 = {
+  {   0,   0,   0,   0,   5,   0,   6,   0,
+     41, 185, 134, 185,  90, 163,  41, 223,
+     29,   0,   0,   0,   1,   0,   1,   0,
+    198, 195, 187, 220, 104, 225, 107, 197,
+      2,   0,   7,   0,   0,   0,   0,   0,
+      0,   0,   0,   0,   0,   0,   0,   0,
+     21,   0,   0,   0, 146,   1,   0,   0,
+     45,   0,   0,   0,   7,   0,   0,   0,
+      0,   0,   0,   0,   0,   0,   0,   0,
+     41,   0,   0,   0, 175,   0,   0,   0,
+      0,   0,   0,   0,   0,   0,   0,   0,
+      0,   0,   0,   0,   0,   0,   0,   0,
+     99,  97, 112, 110, 112,  47,  99, 111,
+    109, 112, 105, 108, 101, 114,  47, 103,
+    114,  97, 109, 109,  97, 114,  46,  99,
+     97, 112, 110, 112,  58,  80,  97, 114,
+    115, 101, 100,  70, 105, 108, 101,  67,
+     97,  99, 104, 101,  69, 110, 116, 114,
+    121,   0,   0,   0,   0,   0,   0,   0,
+      0,   0,   0,   0,   1,   0,   1,   0,
+     12,   0,   0,   0,   3,   0,   4,   0,
+      0,   0,   0,   0,   0,   0,   0,   0,
+      0,   0,   1,   0,   0,   0,   0,   0,
+      0,   0,   0,   0,   0,   0,   0,   0,
+     69,   0,   0,   0, 130,   0,   0,   0,
+      0,   0,   0,   0,   0,   0,   0,   0,
+     68,   0,   0,   0,   3,   0,   1,   0,
+     80,   0,   0,   0,   2,   0,   1,   0,
+      1,   0,   0,   0,   0,   0,   0,   0,
+      0,   0,   1,   0,   1,   0,   0,   0,
+      0,   0,   0,   0,   0,   0,   0,   0,
+     77,   0,   0,   0,  58,   0,   0,   0,
+      0,   0,   0,   0,   0,   0,   0,   0,
+     72,   0,   0,   0,   3,   0,   1,   0,
+     84,   0,   0,   0,   2,   0,   1,   0,
+      2,   0,   0,   0,   1,   0,   0,   0,
+      0,   0,   1,   0,   2,   0,   0,   0,
+      0,   0,   0,   0,   0,   0,   0,   0,
+     81,   0,   0,   0,  58,   0,   0,   0,
+      0,   0,   0,   0,   0,   0,   0,   0,
+     76,   0,   0,   0,   3,   0,   1,   0,
+     88,   0,   0,   0,   2,   0,   1,   0,
+     99, 111, 109, 112, 105, 108, 101, 114,
+     86, 101, 114, 115, 105, 111, 110,   0,
+      8,   0,   0,   0,   0,   0,   0,   0,
+      0,   0,   0,   0,   0,   0,   0,   0,
+      0,   0,   0,   0,   0,   0,   0,   0,
+      0,   0,   0,   0,   0,   0,   0,   0,
+      8,   0,   0,   0,   0,   0,   0,   0,
+      0,   0,   0,   0,   0,   0,   0,   0,
+      0,   0,   0,   0,   0,   0,   0,   0,
+    115, 111, 117, 114,  99, 101,   0,   0,
+     13,   0,   0,   0,   0,   0,   0,   0,
+      0,   0,   0,   0,   0,   0,   0,   0,
+      0,   0,   0,   0,   0,   0,   0,   0,
+      0,   0,   0,   0,   0,   0,   0,   0,
+     13,   0,   0,   0,   0,   0,   0,   0,
+      0,   0,   0,   0,   0,   0,   0,   0,
+      0,   0,   0,   0,   0,   0,   0,   0,
+    112,  97, 114, 115, 101, 100,   0,   0,
+     16,   0,   0,   0,   0,   0,   0,   0,
+     92,  96,   7, 168, 245, 243, 228, 132,
+      0,   0,   0,   0,   0,   0,   0,   0,
+      0,   0,   0,   0,   0,   0,   0,   0,
+     16,   0,   0,   0,   0,   0,   0,   0,
+      0,   0,   0,   0,   0,   0,   0,   0,
+      0,   0,   0,   0,   0,   0,   0,   0, }
+};
+::capnp::word const* const bp_df29a35ab986b929 = b_df29a35ab986b929.words;
+#if !CAPNP_LITE
+static const ::capnp::_::RawSchema* const d_df29a35ab986b929[] = {
+  &s_84e4f3f5a807605c,
+};
+static const uint16_t m_df29a35ab986b929[] = {0, 2, 1};
+static const uint16_t i_df29a35ab986b929[] = {0, 1, 2};
+const ::capnp::_::RawSchema s_df29a35ab986b929 = {
+  0xdf29a35ab986b929, b_df29a35ab986b929.words, 67, d_df29a35ab986b929, m_df29a35ab986b929,
+  1, 3, i_df29a35ab986b929, nullptr, nullptr, { &s_df29a35ab986b929, nullptr, nullptr, 0, 0, nullptr }
+};
+#endif  // !CAPNP_LITE
 }  // namespace schemas
 }  // namespace capnp
 
@@ -2960,6 +3041,14 @@ constexpr ::capnp::Kind ParsedFile::_capnpPrivate::kind;
 constexpr ::capnp::_::RawSchema const* ParsedFile::_capnpPrivate::schema;
 #endif  // !CAPNP_LITE
 
+// ParsedFileCacheEntry
+constexpr uint16_t ParsedFileCacheEntry::_capnpPrivate::dataWordSize;
+constexpr uint16_t ParsedFileCacheEntry::_capnpPrivate::pointerCount;
+#if !CAPNP_LITE
+constexpr ::capnp::Kind ParsedFileCacheEntry::_capnpPrivate::kind;
+constexpr ::capnp::_::RawSchema const* ParsedFileCacheEntry::_capnpPrivate::schema;
+#endif  // !CAPNP_LITE
+
 
 }  // namespace
 }  // namespace
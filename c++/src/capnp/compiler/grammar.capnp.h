@@ -38,6 +38,7 @@ CAPNP_DECLARE_SCHEMA(eb971847d617c0b9);
 CAPNP_DECLARE_SCHEMA(c6238c7d62d65173);
 CAPNP_DECLARE_SCHEMA(9cb9e86e3198037f);
 CAPNP_DECLARE_SCHEMA(84e4f3f5a807605c);
+CAPNP_DECLARE_SCHEMA(df29a35ab986b929);
 
 }  // namespace schemas
 }  // namespace capnp
@@ -504,6 +505,21 @@ struct ParsedFile {
   };
 };
 
+struct ParsedFileCacheEntry {
+  ParsedFileCacheEntry() = delete;
+
+  class Reader;
+  class Builder;
+  class Pipeline;
+
+  struct _capnpPrivate {
+    CAPNP_DECLARE_STRUCT_HEADER(df29a35ab986b929, 1, 2)
+    #if !CAPNP_LITE
+    static constexpr ::capnp::_::RawBrandedSchema const* brand() { return &schema->defaultBrand; }
+    #endif  // !CAPNP_LITE
+  };
+};
+
 // =======================================================================================
 
 class LocatedText::Reader {
@@ -3199,6 +3215,103 @@ private:
 };
 #endif  // !CAPNP_LITE
 
+class ParsedFileCacheEntry::Reader {
+public:
+  typedef ParsedFileCacheEntry Reads;
+
+  Reader() = default;
+  inline explicit Reader(::capnp::_::StructReader base): _reader(base) {}
+
+  inline ::capnp::MessageSize totalSize() const {
+    return _reader.totalSize().asPublic();
+  }
+
+#if !CAPNP_LITE
+  inline ::kj::StringTree toString() const {
+    return ::capnp::_::structString(_reader, *_capnpPrivate::brand());
+  }
+#endif  // !CAPNP_LITE
+
+  inline  ::uint32_t getCompilerVersion() const;
+
+  inline bool hasSource() const;
+  inline  ::capnp::Data::Reader getSource() const;
+
+  inline bool hasParsed() const;
+  inline  ::capnp::compiler::ParsedFile::Reader getParsed() const;
+
+private:
+  ::capnp::_::StructReader _reader;
+  template <typename, ::capnp::Kind>
+  friend struct ::capnp::ToDynamic_;
+  template <typename, ::capnp::Kind>
+  friend struct ::capnp::_::PointerHelpers;
+  template <typename, ::capnp::Kind>
+  friend struct ::capnp::List;
+  friend class ::capnp::MessageBuilder;
+  friend class ::capnp::Orphanage;
+};
+
+class ParsedFileCacheEntry::Builder {
+public:
+  typedef ParsedFileCacheEntry Builds;
+
+  Builder() = delete;  // Deleted to discourage incorrect usage.
+                       // You can explicitly initialize to nullptr instead.
+  inline Builder(decltype(nullptr)) {}
+  inline explicit Builder(::capnp::_::StructBuilder base): _builder(base) {}
+  inline operator Reader() const { return Reader(_builder.asReader()); }
+  inline Reader asReader() const { return *this; }
+
+  inline ::capnp::MessageSize totalSize() const { return asReader().totalSize(); }
+#if !CAPNP_LITE
+  inline ::kj::StringTree toString() const { return asReader().toString(); }
+#endif  // !CAPNP_LITE
+
+  inline  ::uint32_t getCompilerVersion();
+  inline void setCompilerVersion( ::uint32_t value);
+
+  inline bool hasSource();
+  inline  ::capnp::Data::Builder getSource();
+  inline void setSource( ::capnp::Data::Reader value);
+  inline  ::capnp::Data::Builder initSource(unsigned int size);
+  inline void adoptSource(::capnp::Orphan< ::capnp::Data>&& value);
+  inline ::capnp::Orphan< ::capnp::Data> disownSource();
+
+  inline bool hasParsed();
+  inline  ::capnp::compiler::ParsedFile::Builder getParsed();
+  inline void setParsed( ::capnp::compiler::ParsedFile::Reader value);
+  inline  ::capnp::compiler::ParsedFile::Builder initParsed();
+  inline void adoptParsed(::capnp::Orphan< ::capnp::compiler::ParsedFile>&& value);
+  inline ::capnp::Orphan< ::capnp::compiler::ParsedFile> disownParsed();
+
+private:
+  ::capnp::_::StructBuilder _builder;
+  template <typename, ::capnp::Kind>
+  friend struct ::capnp::ToDynamic_;
+  friend class ::capnp::Orphanage;
+  template <typename, ::capnp::Kind>
+  friend struct ::capnp::_::PointerHelpers;
+};
+
+#if !CAPNP_LITE
+class ParsedFileCacheEntry::Pipeline {
+public:
+  typedef ParsedFileCacheEntry Pipelines;
+
+  inline Pipeline(decltype(nullptr)): _typeless(nullptr) {}
+  inline explicit Pipeline(::capnp::AnyPointer::Pipeline&& typeless)
+      : _typeless(kj::mv(typeless)) {}
+
+  inline  ::capnp::compiler::ParsedFile::Pipeline getParsed();
+private:
+  ::capnp::AnyPointer::Pipeline _typeless;
+  friend class ::capnp::PipelineHook;
+  template <typename, ::capnp::Kind>
+  friend struct ::capnp::ToDynamic_;
+};
+#endif  // !CAPNP_LITE
+
 // =======================================================================================
 
 inline bool LocatedText::Reader::hasValue() const {
@@ -6830,6 +6943,93 @@ inline ::capnp::Orphan< ::capnp::compiler::Declaration> ParsedFile::Builder::dis
       ::capnp::bounded<0>() * ::capnp::POINTERS));
 }
 
+inline  ::uint32_t ParsedFileCacheEntry::Reader::getCompilerVersion() const {
+  return _reader.getDataField< ::uint32_t>(
+      ::capnp::bounded<0>() * ::capnp::ELEMENTS);
+}
+
+inline  ::uint32_t ParsedFileCacheEntry::Builder::getCompilerVersion() {
+  return _builder.getDataField< ::uint32_t>(
+      ::capnp::bounded<0>() * ::capnp::ELEMENTS);
+}
+inline void ParsedFileCacheEntry::Builder::setCompilerVersion( ::uint32_t value) {
+  _builder.setDataField< ::uint32_t>(
+      ::capnp::bounded<0>() * ::capnp::ELEMENTS, value);
+}
+
+inline bool ParsedFileCacheEntry::Reader::hasSource() const {
+  return !_reader.getPointerField(
+      ::capnp::bounded<0>() * ::capnp::POINTERS).isNull();
+}
+inline bool ParsedFileCacheEntry::Builder::hasSource() {
+  return !_builder.getPointerField(
+      ::capnp::bounded<0>() * ::capnp::POINTERS).isNull();
+}
+inline  ::capnp::Data::Reader ParsedFileCacheEntry::Reader::getSource() const {
+  return ::capnp::_::PointerHelpers< ::capnp::Data>::get(_reader.getPointerField(
+      ::capnp::bounded<0>() * ::capnp::POINTERS));
+}
+inline  ::capnp::Data::Builder ParsedFileCacheEntry::Builder::getSource() {
+  return ::capnp::_::PointerHelpers< ::capnp::Data>::get(_builder.getPointerField(
+      ::capnp::bounded<0>() * ::capnp::POINTERS));
+}
+inline void ParsedFileCacheEntry::Builder::setSource( ::capnp::Data::Reader value) {
+  ::capnp::_::PointerHelpers< ::capnp::Data>::set(_builder.getPointerField(
+      ::capnp::bounded<0>() * ::capnp::POINTERS), value);
+}
+inline  ::capnp::Data::Builder ParsedFileCacheEntry::Builder::initSource(unsigned int size) {
+  return ::capnp::_::PointerHelpers< ::capnp::Data>::init(_builder.getPointerField(
+      ::capnp::bounded<0>() * ::capnp::POINTERS), size);
+}
+inline void ParsedFileCacheEntry::Builder::adoptSource(
+    ::capnp::Orphan< ::capnp::Data>&& value) {
+  ::capnp::_::PointerHelpers< ::capnp::Data>::adopt(_builder.getPointerField(
+      ::capnp::bounded<0>() * ::capnp::POINTERS), kj::mv(value));
+}
+inline ::capnp::Orphan< ::capnp::Data> ParsedFileCacheEntry::Builder::disownSource() {
+  return ::capnp::_::PointerHelpers< ::capnp::Data>::disown(_builder.getPointerField(
+      ::capnp::bounded<0>() * ::capnp::POINTERS));
+}
+
+inline bool ParsedFileCacheEntry::Reader::hasParsed() const {
+  return !_reader.getPointerField(
+      ::capnp::bounded<1>() * ::capnp::POINTERS).isNull();
+}
+inline bool ParsedFileCacheEntry::Builder::hasParsed() {
+  return !_builder.getPointerField(
+      ::capnp::bounded<1>() * ::capnp::POINTERS).isNull();
+}
+inline  ::capnp::compiler::ParsedFile::Reader ParsedFileCacheEntry::Reader::getParsed() const {
+  return ::capnp::_::PointerHelpers< ::capnp::compiler::ParsedFile>::get(_reader.getPointerField(
+      ::capnp::bounded<1>() * ::capnp::POINTERS));
+}
+inline  ::capnp::compiler::ParsedFile::Builder ParsedFileCacheEntry::Builder::getParsed() {
+  return ::capnp::_::PointerHelpers< ::capnp::compiler::ParsedFile>::get(_builder.getPointerField(
+      ::capnp::bounded<1>() * ::capnp::POINTERS));
+}
+#if !CAPNP_LITE
+inline  ::capnp::compiler::ParsedFile::Pipeline ParsedFileCacheEntry::Pipeline::getParsed() {
+  return  ::capnp::compiler::ParsedFile::Pipeline(_typeless.getPointerField(1));
+}
+#endif  // !CAPNP_LITE
+inline void ParsedFileCacheEntry::Builder::setParsed( ::capnp::compiler::ParsedFile::Reader value) {
+  ::capnp::_::PointerHelpers< ::capnp::compiler::ParsedFile>::set(_builder.getPointerField(
+      ::capnp::bounded<1>() * ::capnp::POINTERS), value);
+}
+inline  ::capnp::compiler::ParsedFile::Builder ParsedFileCacheEntry::Builder::initParsed() {
+  return ::capnp::_::PointerHelpers< ::capnp::compiler::ParsedFile>::init(_builder.getPointerField(
+      ::capnp::bounded<1>() * ::capnp::POINTERS));
+}
+inline void ParsedFileCacheEntry::Builder::adoptParsed(
+    ::capnp::Orphan< ::capnp::compiler::ParsedFile>&& value) {
+  ::capnp::_::PointerHelpers< ::capnp::compiler::ParsedFile>::adopt(_builder.getPointerField(
+      ::capnp::bounded<1>() * ::capnp::POINTERS), kj::mv(value));
+}
+inline ::capnp::Orphan< ::capnp::compiler::ParsedFile> ParsedFileCacheEntry::Builder::disownParsed() {
+  return ::capnp::_::PointerHelpers< ::capnp::compiler::ParsedFile>::disown(_builder.getPointerField(
+      ::capnp::bounded<1>() * ::capnp::POINTERS));
+}
+
 }  // namespace
 }  // namespace
 
@@ -20,8 +20,7 @@
 // THE SOFTWARE.
 
 #include "module-loader.h"
-#include "lexer.h"
-#include "parser.h"
+#include "parse-cache.h"
 #include <kj/vector.h>
 #include <kj/mutex.h>
 #include <kj/debug.h>
@@ -131,14 +130,26 @@ public:
     searchPath.add(&dir);
   }
 
+  void setParseCache(const kj::Directory& dir) {
+    parseCache.emplace(dir);
+  }
+
   kj::Maybe<Module&> loadModule(const kj::ReadableDirectory& dir, kj::PathPtr path);
   kj::Maybe<Module&> loadModuleFromSearchPath(kj::PathPtr path);
   kj::Maybe<kj::Array<const byte>> readEmbed(const kj::ReadableDirectory& dir, kj::PathPtr path);
   kj::Maybe<kj::Array<const byte>> readEmbedFromSearchPath(kj::PathPtr path);
   GlobalErrorReporter& getErrorReporter() { return errorReporter; }
+  kj::Maybe<const ParseCache&> getParseCache() {
+    KJ_IF_MAYBE(cache, parseCache) {
+      return *cache;
+    } else {
+      return nullptr;
+    }
+  }
 
 private:
   GlobalErrorReporter& errorReporter;
+  kj::Maybe<ParseCache> parseCache;
   kj::Vector<const kj::ReadableDirectory*> searchPath;
   std::unordered_map<FileKey, kj::Own<Module>, FileKeyHash> modules;
 };
@@ -166,13 +177,11 @@ public:
     lineBreaks = nullptr;  // In case loadContent() is called multiple times.
     lineBreaks = lineBreaksSpace.construct(content);
 
-    MallocMessageBuilder lexedBuilder;
-    auto statements = lexedBuilder.initRoot<LexedStatements>();
-    lex(content, statements, *this);
-
-    auto parsed = orphanage.newOrphan<ParsedFile>();
-    parseFile(statements.getStatements(), parsed.get(), *this);
-    return parsed;
+    KJ_IF_MAYBE(cache, loader.getParseCache()) {
+      return cache->lexAndParse(content, orphanage, *this);
+    } else {
+      return lexAndParse(content, orphanage, *this);
+    }
   }
 
   kj::Maybe<Module&> importRelative(kj::StringPtr importPath) override {
@@ -278,6 +287,10 @@ void ModuleLoader::addImportPath(const kj::ReadableDirectory& dir) {
   impl->addImportPath(dir);
 }
 
+void ModuleLoader::setParseCache(const kj::Directory& dir) {
+  impl->setParseCache(dir);
+}
+
 kj::Maybe<Module&> ModuleLoader::loadModule(const kj::ReadableDirectory& dir, kj::PathPtr path) {
   return impl->loadModule(dir, path);
 }
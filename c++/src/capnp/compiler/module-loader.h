@@ -47,6 +47,10 @@ public:
   void addImportPath(const kj::ReadableDirectory& dir);
   // Add a directory to the list of paths that is searched for imports that start with a '/'.
 
+  void setParseCache(const kj::Directory& dir);
+  // Cache parse results in the given directory, so that unchanged files need not be lexed and
+  // parsed again by later runs. See ParseCache in parse-cache.h.
+
   kj::Maybe<Module&> loadModule(const kj::ReadableDirectory& dir, kj::PathPtr path);
   // Tries to load a module with the given path inside the given directory. Returns nullptr if the
   // file doesn't exist.
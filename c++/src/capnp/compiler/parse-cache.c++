@@ -0,0 +1,129 @@
+// Copyright (c) 2017 Sandstorm Development Group, Inc. and contributors
+// Licensed under the MIT License:
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+#include "parse-cache.h"
+#include "lexer.h"
+#include "parser.h"
+#include <capnp/message.h>
+#include <capnp/serialize.h>
+#include <kj/debug.h>
+#include <string.h>
+
+namespace capnp {
+namespace compiler {
+
+namespace {
+
+uint64_t hashContent(kj::ArrayPtr<const char> content) {
+  // 64-bit FNV-1a.  Collisions are harmless since entries are verified against the full content,
+  // so this need only be fast and reasonably well-distributed.  It is 64 bits wide so that
+  // distinct files rarely evict each other's cache entries.
+  uint64_t result = 14695981039346656037ull;
+  for (char c: content) {
+    result = (result ^ static_cast<byte>(c)) * 1099511628211ull;
+  }
+  return result;
+}
+
+}  // namespace
+
+Orphan<ParsedFile> lexAndParse(kj::ArrayPtr<const char> content, Orphanage orphanage,
+                               ErrorReporter& errorReporter) {
+  MallocMessageBuilder lexedBuilder;
+  auto statements = lexedBuilder.initRoot<LexedStatements>();
+  lex(content, statements, errorReporter);
+
+  auto parsed = orphanage.newOrphan<ParsedFile>();
+  parseFile(statements.getStatements(), parsed.get(), errorReporter);
+  return parsed;
+}
+
+ParseCache::ParseCache(const kj::Directory& dir): dir(dir) {}
+
+Orphan<ParsedFile> ParseCache::lexAndParse(
+    kj::ArrayPtr<const char> content, Orphanage orphanage, ErrorReporter& errorReporter) const {
+  auto path = kj::Path(kj::str(CAPNP_VERSION, '-', kj::hex(hashContent(content)), ".bin"));
+
+  KJ_IF_MAYBE(cached, tryRead(path, content, orphanage)) {
+    return kj::mv(*cached);
+  }
+
+  auto parsed = compiler::lexAndParse(content, orphanage, errorReporter);
+  if (!errorReporter.hadErrors()) {
+    write(path, content, parsed.getReader());
+  }
+  return parsed;
+}
+
+kj::Maybe<Orphan<ParsedFile>> ParseCache::tryRead(
+    kj::PathPtr path, kj::ArrayPtr<const char> content, Orphanage orphanage) const {
+  kj::Maybe<Orphan<ParsedFile>> result;
+
+  KJ_IF_MAYBE(exception, kj::runCatchingExceptions([&]() {
+    KJ_IF_MAYBE(file, dir.tryOpenFile(path)) {
+      auto size = file->get()->stat().size;
+      if (size % sizeof(word) != 0) return;
+
+      // mmap() is page-aligned, hence word-aligned, so we can read the message in-place.
+      auto mapping = file->get()->mmap(0, size);
+      ReaderOptions options;
+      options.traversalLimitInWords = kj::maxValue;
+      FlatArrayMessageReader reader(kj::arrayPtr(
+          reinterpret_cast<const word*>(mapping.begin()), size / sizeof(word)), options);
+      auto entry = reader.getRoot<ParsedFileCacheEntry>();
+
+      if (entry.getCompilerVersion() != CAPNP_VERSION) return;
+      auto source = entry.getSource();
+      if (source.size() != content.size() ||
+          memcmp(source.begin(), content.begin(), content.size()) != 0) {
+        // Hash collision.  The entry will be overwritten by the caller.
+        return;
+      }
+
+      result = orphanage.newOrphanCopy(entry.getParsed());
+    }
+  })) {
+    KJ_LOG(WARNING, "ignoring unreadable schema parse cache entry", path, *exception);
+  }
+
+  return kj::mv(result);
+}
+
+void ParseCache::write(kj::PathPtr path, kj::ArrayPtr<const char> content,
+                       ParsedFile::Reader parsed) const {
+  KJ_IF_MAYBE(exception, kj::runCatchingExceptions([&]() {
+    MallocMessageBuilder builder(parsed.totalSize().wordCount + content.size() / sizeof(word) + 8);
+    auto entry = builder.initRoot<ParsedFileCacheEntry>();
+    entry.setCompilerVersion(CAPNP_VERSION);
+    entry.setSource(content.asBytes());
+    entry.setParsed(parsed);
+
+    auto words = messageToFlatArray(builder);
+    auto replacer = dir.replaceFile(path, kj::WriteMode::CREATE | kj::WriteMode::MODIFY);
+    replacer->get().writeAll(words.asBytes());
+    replacer->commit();
+  })) {
+    KJ_LOG(WARNING, "couldn't write schema parse cache entry", path, *exception);
+  }
+}
+
+}  // namespace compiler
+}  // namespace capnp
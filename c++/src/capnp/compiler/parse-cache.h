@@ -0,0 +1,78 @@
+// Copyright (c) 2017 Sandstorm Development Group, Inc. and contributors
+// Licensed under the MIT License:
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+#pragma once
+
+#if defined(__GNUC__) && !defined(CAPNP_HEADER_WARNINGS)
+#pragma GCC system_header
+#endif
+
+#include <capnp/compiler/grammar.capnp.h>
+#include <capnp/orphan.h>
+#include <kj/filesystem.h>
+#include "error-reporter.h"
+
+namespace capnp {
+namespace compiler {
+
+Orphan<ParsedFile> lexAndParse(kj::ArrayPtr<const char> content, Orphanage orphanage,
+                               ErrorReporter& errorReporter);
+// Lex and parse the given source text, producing a ParsedFile.  This is what Module
+// implementations typically do in `loadContent()`.
+
+class ParseCache {
+  // A persistent cache of parse results, stored in a directory.
+  //
+  // Entries are keyed by a hash of the source text plus the compiler version, so one cache
+  // directory can be shared by any number of source trees, compiler invocations, and processes.
+  // Each entry is a single flat message which is mmap()ed and copied out on a hit, so a warm load
+  // skips lexing and parsing entirely.
+  //
+  // Only the lexing and parsing stages are cached.  Translating a file to schema nodes depends on
+  // the content of everything it imports, so that still happens on every load; however, lexing
+  // and parsing account for most of the time spent loading a typical schema file.
+  //
+  // Entries are written with `Directory::replaceFile()`, so concurrent readers never observe a
+  // partially-written entry.  Failures to read or write the cache are never fatal; the cache is
+  // simply bypassed.
+  //
+  // This class is thread-safe.
+
+public:
+  explicit ParseCache(const kj::Directory& dir);
+  // `dir` must outlive the ParseCache.
+
+  Orphan<ParsedFile> lexAndParse(kj::ArrayPtr<const char> content, Orphanage orphanage,
+                                 ErrorReporter& errorReporter) const;
+  // Like the free function `lexAndParse()`, but returns a cached result if one exists.  On a miss,
+  // the result is written to the cache unless errors were reported.
+
+private:
+  const kj::Directory& dir;
+
+  kj::Maybe<Orphan<ParsedFile>> tryRead(kj::PathPtr path, kj::ArrayPtr<const char> content,
+                                        Orphanage orphanage) const;
+  void write(kj::PathPtr path, kj::ArrayPtr<const char> content,
+             ParsedFile::Reader parsed) const;
+};
+
+}  // namespace compiler
+}  // namespace capnp
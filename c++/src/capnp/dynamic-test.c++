@@ -492,6 +492,79 @@ TEST(DynamicApi, BuilderAssign) {
   listValue.set(0, 123);
 }
 
+TEST(DynamicApi, Accessor) {
+  MallocMessageBuilder builder;
+  auto root = builder.initRoot<TestAllTypes>();
+  initTestMessage(root);
+  auto schema = Schema::from<TestAllTypes>();
+  auto reader = toDynamic(root.asReader());
+
+  EXPECT_EQ(-12345678, KJ_ASSERT_NONNULL(
+      DynamicAccessor(schema, "int32Field").get(reader)).as<int32_t>());
+  EXPECT_EQ("foo", KJ_ASSERT_NONNULL(
+      DynamicAccessor(schema, "textField").get(reader)).as<Text>());
+  EXPECT_EQ("nested", KJ_ASSERT_NONNULL(
+      DynamicAccessor(schema, "structField.structField.textField").get(reader)).as<Text>());
+  EXPECT_EQ("x structlist 2", KJ_ASSERT_NONNULL(
+      DynamicAccessor(schema, "structField.structList[1].textField").get(reader)).as<Text>());
+  EXPECT_EQ(-111111111, KJ_ASSERT_NONNULL(
+      DynamicAccessor(schema, "int32List[1]").get(reader)).as<int32_t>());
+  EXPECT_TRUE(DynamicAccessor(schema, "int32List[2]").get(reader) == nullptr);
+  EXPECT_EQ(3u, KJ_ASSERT_NONNULL(
+      DynamicAccessor(schema, "structList").get(reader)).as<DynamicList>().size());
+
+  {
+    DynamicAccessor accessor(schema, "enumField");
+    EXPECT_TRUE(accessor.getType().isEnum());
+    EXPECT_TRUE(KJ_ASSERT_NONNULL(accessor.get(reader)).as<TestEnum>() == TestEnum::CORGE);
+  }
+
+  // Defaults, including defaults nested inside default pointers.
+  {
+    MallocMessageBuilder builder2;
+    auto defaults = toDynamic(builder2.initRoot<TestDefaults>().asReader());
+    auto schema2 = Schema::from<TestDefaults>();
+    EXPECT_EQ(-12345678, KJ_ASSERT_NONNULL(
+        DynamicAccessor(schema2, "int32Field").get(defaults)).as<int32_t>());
+    EXPECT_EQ("foo", KJ_ASSERT_NONNULL(
+        DynamicAccessor(schema2, "textField").get(defaults)).as<Text>());
+    EXPECT_EQ("really nested", KJ_ASSERT_NONNULL(
+        DynamicAccessor(schema2, "structField.structField.structField.textField")
+            .get(defaults)).as<Text>());
+
+    auto lists = toDynamic(builder2.initRoot<TestListDefaults>().asReader());
+    auto schema3 = Schema::from<TestListDefaults>();
+    EXPECT_EQ(4, KJ_ASSERT_NONNULL(
+        DynamicAccessor(schema3, "lists.int32ListList[1][0]").get(lists)).as<int32_t>());
+    EXPECT_EQ(456, KJ_ASSERT_NONNULL(
+        DynamicAccessor(schema3, "lists.structListList[0][1].int32Field").get(lists))
+            .as<int32_t>());
+    EXPECT_TRUE(DynamicAccessor(schema3, "lists.structListList[1][1].int32Field")
+        .get(lists) == nullptr);
+  }
+
+  // Unions and groups.
+  {
+    MallocMessageBuilder builder2;
+    auto unionRoot = builder2.initRoot<TestUnion>();
+    unionRoot.getUnion0().setU0f1s32(1234567);
+    auto unionReader = toDynamic(unionRoot.asReader());
+    auto schema2 = Schema::from<TestUnion>();
+
+    EXPECT_EQ(1234567, KJ_ASSERT_NONNULL(
+        DynamicAccessor(schema2, "union0.u0f1s32").get(unionReader)).as<int32_t>());
+    EXPECT_TRUE(DynamicAccessor(schema2, "union0.u0f0s32").get(unionReader) == nullptr);
+    EXPECT_TRUE(KJ_ASSERT_NONNULL(DynamicAccessor(schema2, "union0").get(unionReader))
+        .getType() == DynamicValue::STRUCT);
+  }
+
+  EXPECT_ANY_THROW(DynamicAccessor(schema, "noSuchField"));
+  EXPECT_ANY_THROW(DynamicAccessor(schema, "int32Field.foo"));
+  EXPECT_ANY_THROW(DynamicAccessor(schema, "int32Field[0]"));
+  EXPECT_ANY_THROW(DynamicAccessor(schema, "int32List[0"));
+  EXPECT_ANY_THROW(DynamicAccessor(schema, "structField..textField"));
+}
+
 }  // namespace
 }  // namespace _ (private)
 }  // namespace capnp
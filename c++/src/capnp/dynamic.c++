@@ -1426,6 +1426,272 @@ DynamicList::Reader DynamicList::Builder::asReader() const {
 
 // =======================================================================================
 
+DynamicAccessor::DynamicAccessor(StructSchema schema, kj::StringPtr path)
+    : schema(schema), type(schema) {
+  kj::Vector<Step> stepsBuilder;
+
+  auto setElementSize = [](Step& step) {
+    if (step.type.isList()) {
+      step.elementSize = elementSizeFor(step.type.asList().whichElementType());
+    }
+  };
+
+  const char* pos = path.begin();
+  for (;;) {
+    KJ_REQUIRE(type.isStruct(), "path applies a field name to a non-struct value", path);
+    auto parent = type.asStruct();
+
+    const char* nameEnd = pos;
+    while (*nameEnd != '\0' && *nameEnd != '.' && *nameEnd != '[') ++nameEnd;
+    KJ_REQUIRE(nameEnd > pos, "path has empty field name", path);
+    auto name = kj::heapString(pos, nameEnd - pos);
+    pos = nameEnd;
+
+    KJ_IF_MAYBE(field, parent.findFieldByName(name)) {
+      auto proto = field->getProto();
+      auto& step = stepsBuilder.add();
+      step.type = field->getType();
+
+      if (hasDiscriminantValue(proto)) {
+        step.hasDiscriminant = true;
+        step.discriminantValue = proto.getDiscriminantValue();
+        step.discriminantOffset = parent.getProto().getStruct().getDiscriminantOffset();
+      }
+
+      switch (proto.which()) {
+        case schema::Field::SLOT: {
+          auto slot = proto.getSlot();
+          auto dval = slot.getDefaultValue();
+          step.kind = Step::FIELD;
+          step.offset = slot.getOffset();
+          setElementSize(step);
+
+          // As in DynamicStruct::Reader::get(), the default value may be "anyPointer" when the
+          // field's type is a bound generic parameter.
+          switch (step.type.which()) {
+            case schema::Type::VOID:
+              break;
+
+#define HANDLE_TYPE(discrim, titleCase, type) \
+            case schema::Type::discrim: \
+              step.defaultBits = bitCast<_::Mask<type>>(dval.get##titleCase()); \
+              break;
+
+            HANDLE_TYPE(BOOL, Bool, bool)
+            HANDLE_TYPE(INT8, Int8, int8_t)
+            HANDLE_TYPE(INT16, Int16, int16_t)
+            HANDLE_TYPE(INT32, Int32, int32_t)
+            HANDLE_TYPE(INT64, Int64, int64_t)
+            HANDLE_TYPE(UINT8, Uint8, uint8_t)
+            HANDLE_TYPE(UINT16, Uint16, uint16_t)
+            HANDLE_TYPE(UINT32, Uint32, uint32_t)
+            HANDLE_TYPE(UINT64, Uint64, uint64_t)
+            HANDLE_TYPE(FLOAT32, Float32, float)
+            HANDLE_TYPE(FLOAT64, Float64, double)
+            HANDLE_TYPE(ENUM, Enum, uint16_t)
+
+#undef HANDLE_TYPE
+
+            case schema::Type::TEXT:
+              if (!dval.isAnyPointer()) {
+                auto text = dval.getText();
+                step.defaultPointer = text.begin();
+                step.defaultSize = text.size();
+              }
+              break;
+
+            case schema::Type::DATA:
+              if (!dval.isAnyPointer()) {
+                auto data = dval.getData();
+                step.defaultPointer = data.begin();
+                step.defaultSize = data.size();
+              }
+              break;
+
+            case schema::Type::LIST:
+              if (!dval.isAnyPointer()) {
+                step.defaultPointer = dval.getList().getAs<_::UncheckedMessage>();
+              }
+              break;
+
+            case schema::Type::STRUCT:
+              if (!dval.isAnyPointer()) {
+                step.defaultPointer = dval.getStruct().getAs<_::UncheckedMessage>();
+              }
+              break;
+
+            case schema::Type::ANY_POINTER:
+            case schema::Type::INTERFACE:
+              break;
+          }
+          break;
+        }
+
+        case schema::Field::GROUP:
+          step.kind = Step::GROUP;
+          break;
+      }
+    } else {
+      KJ_FAIL_REQUIRE("path names a field that doesn't exist", path, name,
+                      parent.getProto().getDisplayName());
+    }
+    type = stepsBuilder.back().type;
+
+    while (*pos == '[') {
+      KJ_REQUIRE(type.isList(), "path indexes a non-list value", path);
+      ++pos;
+      uint64_t index = 0;
+      const char* digitsBegin = pos;
+      while (*pos >= '0' && *pos <= '9') {
+        index = index * 10 + (*pos++ - '0');
+        KJ_REQUIRE(index <= kj::maxValueForBits<LIST_ELEMENT_COUNT_BITS>(),
+                   "path list index too large", path);
+      }
+      KJ_REQUIRE(pos > digitsBegin && *pos == ']', "path has malformed list index", path);
+      ++pos;
+
+      auto& step = stepsBuilder.add();
+      step.kind = Step::ELEMENT;
+      step.offset = index;
+      step.type = type.asList().getElementType();
+      setElementSize(step);
+      type = step.type;
+    }
+
+    if (*pos == '\0') break;
+    KJ_REQUIRE(*pos == '.', "path has unexpected character", path, pos - path.begin());
+    ++pos;
+  }
+
+  for (auto i: kj::range<size_t>(0, stepsBuilder.size() - 1)) {
+    auto& step = stepsBuilder[i];
+    KJ_REQUIRE(step.type.isStruct() || step.type.isList(),
+               "path continues past a value that is not a struct or list", path);
+  }
+
+  steps = stepsBuilder.releaseAsArray();
+}
+
+kj::Maybe<DynamicValue::Reader> DynamicAccessor::get(DynamicStruct::Reader reader) const {
+  KJ_REQUIRE(reader.schema == schema, "DynamicAccessor applied to struct of the wrong type.");
+
+  _::StructReader structReader = reader.reader;
+  _::ListReader listReader(ElementSize::VOID);
+
+  auto lastStep = steps.end() - 1;
+  for (const Step* step = steps.begin(); step != lastStep; ++step) {
+    switch (step->kind) {
+      case Step::FIELD:
+      case Step::GROUP:
+        if (step->hasDiscriminant &&
+            structReader.getDataField<uint16_t>(assumeDataOffset(step->discriminantOffset)) !=
+                step->discriminantValue) {
+          return nullptr;
+        }
+        if (step->kind == Step::GROUP) break;
+
+        if (step->type.isStruct()) {
+          structReader = structReader.getPointerField(assumePointerOffset(step->offset))
+              .getStruct(reinterpret_cast<const word*>(step->defaultPointer));
+        } else {
+          listReader = structReader.getPointerField(assumePointerOffset(step->offset))
+              .getList(step->elementSize, reinterpret_cast<const word*>(step->defaultPointer));
+        }
+        break;
+
+      case Step::ELEMENT:
+        if (step->offset >= unbound(listReader.size() / ELEMENTS)) return nullptr;
+
+        if (step->type.isStruct()) {
+          structReader = listReader.getStructElement(bounded(step->offset) * ELEMENTS);
+        } else {
+          listReader = listReader.getPointerElement(bounded(step->offset) * ELEMENTS)
+              .getList(step->elementSize, nullptr);
+        }
+        break;
+    }
+  }
+
+  auto step = lastStep;
+
+  if (step->kind == Step::ELEMENT) {
+    if (step->offset >= unbound(listReader.size() / ELEMENTS)) return nullptr;
+    return DynamicList::Reader((step - 1)->type.asList(), listReader)[step->offset];
+  }
+
+  if (step->hasDiscriminant &&
+      structReader.getDataField<uint16_t>(assumeDataOffset(step->discriminantOffset)) !=
+          step->discriminantValue) {
+    return nullptr;
+  }
+
+  if (step->kind == Step::GROUP) {
+    return DynamicValue::Reader(DynamicStruct::Reader(step->type.asStruct(), structReader));
+  }
+
+  switch (step->type.which()) {
+    case schema::Type::VOID:
+      return DynamicValue::Reader(
+          structReader.getDataField<Void>(assumeDataOffset(step->offset)));
+
+#define HANDLE_TYPE(discrim, type) \
+    case schema::Type::discrim: \
+      return DynamicValue::Reader(structReader.getDataField<type>( \
+          assumeDataOffset(step->offset), static_cast<_::Mask<type>>(step->defaultBits)));
+
+    HANDLE_TYPE(BOOL, bool)
+    HANDLE_TYPE(INT8, int8_t)
+    HANDLE_TYPE(INT16, int16_t)
+    HANDLE_TYPE(INT32, int32_t)
+    HANDLE_TYPE(INT64, int64_t)
+    HANDLE_TYPE(UINT8, uint8_t)
+    HANDLE_TYPE(UINT16, uint16_t)
+    HANDLE_TYPE(UINT32, uint32_t)
+    HANDLE_TYPE(UINT64, uint64_t)
+    HANDLE_TYPE(FLOAT32, float)
+    HANDLE_TYPE(FLOAT64, double)
+
+#undef HANDLE_TYPE
+
+    case schema::Type::ENUM:
+      return DynamicValue::Reader(DynamicEnum(step->type.asEnum(),
+          structReader.getDataField<uint16_t>(assumeDataOffset(step->offset),
+              static_cast<uint16_t>(step->defaultBits))));
+
+    case schema::Type::TEXT:
+      return DynamicValue::Reader(structReader.getPointerField(assumePointerOffset(step->offset))
+          .getBlob<Text>(step->defaultPointer,
+                         assumeMax<MAX_TEXT_SIZE>(step->defaultSize) * BYTES));
+
+    case schema::Type::DATA:
+      return DynamicValue::Reader(structReader.getPointerField(assumePointerOffset(step->offset))
+          .getBlob<Data>(step->defaultPointer,
+                         assumeBits<BLOB_SIZE_BITS>(step->defaultSize) * BYTES));
+
+    case schema::Type::LIST:
+      return DynamicValue::Reader(DynamicList::Reader(step->type.asList(),
+          structReader.getPointerField(assumePointerOffset(step->offset))
+              .getList(step->elementSize, reinterpret_cast<const word*>(step->defaultPointer))));
+
+    case schema::Type::STRUCT:
+      return DynamicValue::Reader(DynamicStruct::Reader(step->type.asStruct(),
+          structReader.getPointerField(assumePointerOffset(step->offset))
+              .getStruct(reinterpret_cast<const word*>(step->defaultPointer))));
+
+    case schema::Type::ANY_POINTER:
+      return DynamicValue::Reader(AnyPointer::Reader(
+          structReader.getPointerField(assumePointerOffset(step->offset))));
+
+    case schema::Type::INTERFACE:
+      return DynamicValue::Reader(DynamicCapability::Client(step->type.asInterface(),
+          structReader.getPointerField(assumePointerOffset(step->offset)).getCapability()));
+  }
+
+  KJ_UNREACHABLE;
+}
+
+// =======================================================================================
+
 DynamicValue::Reader::Reader(ConstSchema constant): type(VOID) {
   auto type = constant.getType();
   auto value = constant.getProto().getConst().getValue();
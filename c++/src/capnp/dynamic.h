@@ -249,6 +249,7 @@ private:
   friend class Orphan<DynamicValue>;
   friend class Orphan<AnyPointer>;
   friend class AnyStruct::Reader;
+  friend class DynamicAccessor;
 };
 
 class DynamicStruct::Builder {
@@ -408,6 +409,7 @@ private:
   friend struct _::PointerHelpers;
   friend struct DynamicStruct;
   friend class DynamicList::Builder;
+  friend class DynamicAccessor;
   template <typename T, ::capnp::Kind k>
   friend struct ::capnp::ToDynamic_;
   friend class Orphanage;
@@ -514,6 +516,7 @@ private:
   friend struct DynamicStruct;
   friend struct DynamicList;
   friend struct DynamicValue;
+  friend class DynamicAccessor;
   friend class Orphan<DynamicCapability>;
   friend class Orphan<DynamicValue>;
   friend class Orphan<AnyPointer>;
@@ -816,6 +819,74 @@ private:
   // specialization.  Has a method apply() which does the work.
 };
 
+// -------------------------------------------------------------------
+
+class DynamicAccessor {
+  // A precompiled path to a value nested inside some struct type, such as "foo.bar[3].baz". Using
+  // an accessor to read the same value out of many messages is much faster than walking the path
+  // with DynamicStruct::Reader::get() each time: field lookups, union discriminant checks, slot
+  // offsets, and default values are all resolved once, when the accessor is constructed.
+  //
+  // A path is a list of field names separated by '.', where each name may be followed by any
+  // number of list indexes in square brackets. Members of groups and unions are named the same
+  // way as any other field.
+  //
+  // An accessor points into its schema's data, so must not outlive the schema.
+
+public:
+  DynamicAccessor(StructSchema schema, kj::StringPtr path);
+  // Compiles `path` against `schema`. Throws if the path is malformed or does not name a value
+  // within `schema`.
+
+  inline StructSchema getSchema() const { return schema; }
+  // The struct type this accessor applies to.
+
+  inline Type getType() const { return type; }
+  // The type of the value at the end of the path.
+
+  kj::Maybe<DynamicValue::Reader> get(DynamicStruct::Reader reader) const;
+  // Reads the value at the path within `reader`, which must be of type `getSchema()`. Returns
+  // null if the path passes through a union member that isn't the one currently set, or through
+  // a list index that is out-of-bounds. Otherwise, the result is the same as calling
+  // DynamicStruct::Reader::get() and DynamicList::Reader::operator[] along the path.
+
+private:
+  struct Step {
+    enum Kind: uint8_t {
+      FIELD,    // A non-group field.
+      GROUP,    // A group field; the struct pointer doesn't move.
+      ELEMENT   // An element of the list produced by the previous step.
+    };
+    Kind kind = FIELD;
+
+    bool hasDiscriminant = false;
+    uint16_t discriminantValue = 0;
+    uint32_t discriminantOffset = 0;
+    // For FIELD and GROUP, the union discriminant that must be set for the field to be present.
+
+    uint32_t offset = 0;
+    // For FIELD, the slot offset. For ELEMENT, the list index.
+
+    Type type;
+    // Type of the value this step produces.
+
+    ElementSize elementSize = ElementSize::VOID;
+    // If `type` is a list, the encoding of its elements.
+
+    uint64_t defaultBits = 0;
+    // For primitive FIELDs, the default value's bits (XORed into the stored value).
+
+    const void* defaultPointer = nullptr;
+    uint32_t defaultSize = 0;
+    // For pointer FIELDs, the default value, or null. For TEXT and DATA, this points at the
+    // content and `defaultSize` is the byte size; otherwise it points at an unchecked message.
+  };
+
+  StructSchema schema;
+  Type type;
+  kj::Array<Step> steps;
+};
+
 kj::StringTree KJ_STRINGIFY(const DynamicValue::Reader& value);
 kj::StringTree KJ_STRINGIFY(const DynamicValue::Builder& value);
 kj::StringTree KJ_STRINGIFY(DynamicEnum value);
@@ -0,0 +1,213 @@
+// Copyright (c) 2017 Sandstorm Development Group, Inc. and contributors
+// Licensed under the MIT License:
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+#if !_WIN32
+
+#define CAPNP_TESTING_CAPNP 1
+
+#include "rpc-shm.h"
+#include "test-util.h"
+#include <kj/debug.h>
+#include <kj/io.h>
+#include <kj/compat/gtest.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+namespace capnp {
+namespace _ {
+namespace {
+
+struct ShmTestContext {
+  kj::AsyncIoContext ioContext;
+  kj::CapabilityPipe pipe;
+  int callCount = 0;
+
+  SharedMemoryVatNetwork clientNetwork;
+  SharedMemoryVatNetwork serverNetwork;
+  RpcSystem<rpc::twoparty::VatId> rpcClient;
+  RpcSystem<rpc::twoparty::VatId> rpcServer;
+
+  explicit ShmTestContext(size_t bufferSize = SharedMemoryVatNetwork::DEFAULT_BUFFER_SIZE)
+      : ioContext(kj::setupAsyncIo()),
+        pipe(ioContext.provider->newCapabilityPipe()),
+        clientNetwork(*pipe.ends[0], rpc::twoparty::Side::CLIENT, ReaderOptions(), bufferSize),
+        serverNetwork(*pipe.ends[1], rpc::twoparty::Side::SERVER),
+        rpcClient(makeRpcClient(clientNetwork)),
+        rpcServer(makeRpcServer(serverNetwork, kj::heap<TestInterfaceImpl>(callCount))) {}
+
+  test::TestInterface::Client bootstrap() {
+    MallocMessageBuilder vatIdMessage(8);
+    vatIdMessage.initRoot<rpc::twoparty::VatId>().setSide(rpc::twoparty::Side::SERVER);
+    return rpcClient.bootstrap(vatIdMessage.getRoot<rpc::twoparty::VatId>())
+        .castAs<test::TestInterface>();
+  }
+};
+
+TEST(SharedMemoryNetwork, Basic) {
+  ShmTestContext context;
+  auto& waitScope = context.ioContext.waitScope;
+  auto client = context.bootstrap();
+
+  auto request1 = client.fooRequest();
+  request1.setI(123);
+  request1.setJ(true);
+  auto promise1 = request1.send();
+
+  auto request2 = client.bazRequest();
+  initTestMessage(request2.initS());
+  auto promise2 = request2.send();
+
+  bool barFailed = false;
+  auto promise3 = client.barRequest().send().then(
+      [](Response<test::TestInterface::BarResults>&& response) {
+        ADD_FAILURE() << "Expected bar() call to fail.";
+      }, [&](kj::Exception&& e) {
+        barFailed = true;
+      });
+
+  EXPECT_EQ(0, context.callCount);
+
+  EXPECT_EQ("foo", promise1.wait(waitScope).getX());
+  promise2.wait(waitScope);
+  promise3.wait(waitScope);
+
+  EXPECT_EQ(2, context.callCount);
+  EXPECT_TRUE(barFailed);
+}
+
+TEST(SharedMemoryNetwork, FullRing) {
+  // Each baz() call carries a full TestAllTypes, so a burst of them overflows a minimum-size
+  // ring many times over, and the client must repeatedly wait for the server to drain it.
+  ShmTestContext context(4096);
+  auto& waitScope = context.ioContext.waitScope;
+  auto client = context.bootstrap();
+
+  kj::Vector<kj::Promise<void>> promises;
+  for (uint i = 0; i < 64; i++) {
+    auto request = client.bazRequest();
+    initTestMessage(request.initS());
+    promises.add(request.send().then([](auto&&) {}));
+  }
+
+  kj::joinPromises(promises.releaseAsArray()).wait(waitScope);
+  EXPECT_EQ(64, context.callCount);
+}
+
+TEST(SharedMemoryNetwork, MessageTooLarge) {
+  ShmTestContext context(4096);
+  auto& waitScope = context.ioContext.waitScope;
+  auto client = context.bootstrap();
+
+  auto request = client.bazRequest();
+  auto s = request.initS();
+  initTestMessage(s);
+  s.initDataField(8192);
+  EXPECT_ANY_THROW(request.send().wait(waitScope));
+
+  // The connection is still usable.
+  auto request2 = client.fooRequest();
+  request2.setI(123);
+  request2.setJ(true);
+  EXPECT_EQ("foo", request2.send().wait(waitScope).getX());
+}
+
+TEST(SharedMemoryNetwork, Disconnect) {
+  ShmTestContext context;
+  auto& waitScope = context.ioContext.waitScope;
+
+  bool serverDisconnected = false;
+  auto disconnectPromise = context.serverNetwork.onDisconnect()
+      .then([&]() { serverDisconnected = true; });
+
+  {
+    auto client = context.bootstrap();
+    auto request = client.fooRequest();
+    request.setI(123);
+    request.setJ(true);
+    EXPECT_EQ("foo", request.send().wait(waitScope).getX());
+  }
+
+  EXPECT_FALSE(serverDisconnected);
+  context.pipe.ends[0]->shutdownWrite();
+  disconnectPromise.wait(waitScope);
+  EXPECT_TRUE(serverDisconnected);
+}
+
+TEST(SharedMemoryNetwork, TwoProcesses) {
+  // The same as Basic, but with the server in a child process, so that the region really is
+  // shared between two address spaces.
+  int fds[2];
+  KJ_SYSCALL(socketpair(AF_UNIX, SOCK_STREAM, 0, fds));
+  kj::AutoCloseFd clientFd(fds[0]);
+  kj::AutoCloseFd serverFd(fds[1]);
+
+  pid_t child;
+  KJ_SYSCALL(child = fork());
+  if (child == 0) {
+    // Serve until the parent disconnects, then report through the exit status whether the
+    // parent's call arrived.
+    clientFd = nullptr;
+    int exitCode = 1;
+    kj::runCatchingExceptions([&]() {
+      auto ioContext = kj::setupAsyncIo();
+      auto stream = ioContext.lowLevelProvider->wrapUnixSocketFd(serverFd);
+      int callCount = 0;
+      SharedMemoryVatNetwork network(*stream, rpc::twoparty::Side::SERVER);
+      auto rpcServer = makeRpcServer(network, kj::heap<TestInterfaceImpl>(callCount));
+      network.onDisconnect().wait(ioContext.waitScope);
+      exitCode = callCount == 1 ? 0 : 2;
+    });
+    _exit(exitCode);
+  }
+  serverFd = nullptr;
+
+  {
+    auto ioContext = kj::setupAsyncIo();
+    auto stream = ioContext.lowLevelProvider->wrapUnixSocketFd(clientFd);
+    SharedMemoryVatNetwork network(*stream, rpc::twoparty::Side::CLIENT);
+    auto rpcClient = makeRpcClient(network);
+
+    MallocMessageBuilder vatIdMessage(8);
+    vatIdMessage.initRoot<rpc::twoparty::VatId>().setSide(rpc::twoparty::Side::SERVER);
+    auto client = rpcClient.bootstrap(vatIdMessage.getRoot<rpc::twoparty::VatId>())
+        .castAs<test::TestInterface>();
+
+    auto request = client.fooRequest();
+    request.setI(123);
+    request.setJ(true);
+    EXPECT_EQ("foo", request.send().wait(ioContext.waitScope).getX());
+
+    stream->shutdownWrite();
+  }
+  clientFd = nullptr;
+
+  int status;
+  KJ_SYSCALL(waitpid(child, &status, 0));
+  EXPECT_TRUE(WIFEXITED(status));
+  EXPECT_EQ(0, WEXITSTATUS(status));
+}
+
+}  // namespace
+}  // namespace _ (private)
+}  // namespace capnp
+
+#endif  // !_WIN32
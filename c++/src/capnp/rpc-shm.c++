@@ -0,0 +1,544 @@
+// Copyright (c) 2017 Sandstorm Development Group, Inc. and contributors
+// Licensed under the MIT License:
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+#if !_WIN32
+
+#include "rpc-shm.h"
+#include "serialize.h"
+#include <kj/debug.h>
+#include <kj/filesystem.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+namespace capnp {
+
+namespace {
+
+// Layout of the shared memory region:  a header page, followed by the client-to-server ring,
+// followed by the server-to-client ring.  Each ring holds a sequence of records, each of which
+// is a 64-bit byte count followed by a message in the standard stream framing.  Records are
+// word-aligned and may wrap around the end of the ring.
+//
+// `head` and `tail` are free-running byte counters; the ring offset is the counter modulo the
+// ring size.  Only the producer writes `head` and only the consumer writes `tail`.  A side which
+// goes to sleep sets its "waiting" flag first and re-checks the ring; the other side clears the
+// flag after publishing and, if it was set, writes a wakeup byte to the socket.
+
+constexpr uint64_t REGION_MAGIC = 0x3130686d73706e63ull;  // "cnpshm01"
+constexpr size_t REGION_HEADER_SIZE = 4096;
+constexpr size_t MIN_BUFFER_SIZE = 4096;
+constexpr byte DOORBELL = 0;
+
+struct RingHeader {
+  alignas(64) uint64_t head;
+  uint32_t readerWaiting;
+  alignas(64) uint64_t tail;
+  uint32_t writerWaiting;
+};
+
+struct RegionHeader {
+  uint64_t magic;
+  uint64_t bufferSize;
+  RingHeader rings[2];
+};
+
+static_assert(sizeof(RegionHeader) <= REGION_HEADER_SIZE, "RegionHeader too big");
+
+template <typename T>
+inline T atomicLoad(const T& value) {
+  return __atomic_load_n(&value, __ATOMIC_SEQ_CST);
+}
+
+template <typename T>
+inline void atomicStore(T& value, T newValue) {
+  __atomic_store_n(&value, newValue, __ATOMIC_SEQ_CST);
+}
+
+template <typename T>
+inline T atomicExchange(T& value, T newValue) {
+  return __atomic_exchange_n(&value, newValue, __ATOMIC_SEQ_CST);
+}
+
+inline bool isValidBufferSize(uint64_t size) {
+  return size >= MIN_BUFFER_SIZE && (size & (size - 1)) == 0 && size <= (uint64_t(1) << 40);
+}
+
+}  // namespace
+
+struct SharedMemoryVatNetwork::Ring {
+  RingHeader& header;
+  byte* data;
+  size_t capacity;
+
+  Ring(RingHeader& header, byte* data, size_t capacity)
+      : header(header), data(data), capacity(capacity) {}
+
+  void copyIn(uint64_t pos, const void* src, size_t size) {
+    size_t offset = pos & (capacity - 1);
+    size_t first = kj::min(size, capacity - offset);
+    memcpy(data + offset, src, first);
+    memcpy(data, reinterpret_cast<const byte*>(src) + first, size - first);
+  }
+
+  void copyOut(uint64_t pos, void* dst, size_t size) {
+    size_t offset = pos & (capacity - 1);
+    size_t first = kj::min(size, capacity - offset);
+    memcpy(dst, data + offset, first);
+    memcpy(reinterpret_cast<byte*>(dst) + first, data, size - first);
+  }
+};
+
+// =======================================================================================
+
+class SharedMemoryVatNetwork::OutgoingMessageImpl final
+    : public OutgoingRpcMessage, public kj::Refcounted {
+public:
+  OutgoingMessageImpl(SharedMemoryVatNetwork& network, uint firstSegmentWordSize)
+      : network(network),
+        message(firstSegmentWordSize == 0 ? SUGGESTED_FIRST_SEGMENT_WORDS : firstSegmentWordSize) {}
+
+  AnyPointer::Builder getBody() override {
+    return message.getRoot<AnyPointer>();
+  }
+
+  void send() override {
+    auto segments = message.getSegmentsForOutput();
+    size_t size = 0;
+    for (auto& segment: segments) {
+      size += segment.size();
+    }
+    KJ_REQUIRE(size < network.receiveOptions.traversalLimitInWords, size,
+               "Trying to send Cap'n Proto message larger than our single-message size limit. The "
+               "other side probably won't accept it (assuming its traversalLimitInWords matches "
+               "ours) and would abort the connection, so I won't send it.") {
+      return;
+    }
+
+    recordSize = sizeof(uint64_t) + ((segments.size() + 2) & ~size_t(1)) * sizeof(uint32_t) +
+                 size * sizeof(word);
+
+    if (network.outgoing.get() != nullptr) {
+      KJ_REQUIRE(recordSize <= network.outgoing->capacity, recordSize, network.outgoing->capacity,
+                 "Trying to send Cap'n Proto message larger than the shared memory ring.") {
+        return;
+      }
+    }
+
+    network.queueSend(kj::addRef(*this));
+  }
+
+  size_t getRecordSize() { return recordSize; }
+  // Number of ring bytes needed by this message.  Valid after send().
+
+  void copyTo(Ring& ring, uint64_t pos) {
+    auto segments = message.getSegmentsForOutput();
+
+    uint64_t messageSize = recordSize - sizeof(uint64_t);
+    ring.copyIn(pos, &messageSize, sizeof(messageSize));
+    pos += sizeof(messageSize);
+
+    // Same framing as writeMessage().
+    KJ_STACK_ARRAY(_::WireValue<uint32_t>, table, (segments.size() + 2) & ~size_t(1), 16, 64);
+    table[0].set(segments.size() - 1);
+    for (uint i = 0; i < segments.size(); i++) {
+      table[i + 1].set(segments[i].size());
+    }
+    if (segments.size() % 2 == 0) {
+      // Set padding byte.
+      table[segments.size() + 1].set(0);
+    }
+    ring.copyIn(pos, table.begin(), table.asBytes().size());
+    pos += table.asBytes().size();
+
+    for (auto& segment: segments) {
+      ring.copyIn(pos, segment.begin(), segment.asBytes().size());
+      pos += segment.asBytes().size();
+    }
+  }
+
+private:
+  SharedMemoryVatNetwork& network;
+  MallocMessageBuilder message;
+  size_t recordSize = 0;
+};
+
+class SharedMemoryVatNetwork::IncomingMessageImpl final: public IncomingRpcMessage {
+public:
+  IncomingMessageImpl(kj::Array<word> words, ReaderOptions options)
+      : words(kj::mv(words)), message(this->words, options) {}
+
+  AnyPointer::Reader getBody() override {
+    return message.getRoot<AnyPointer>();
+  }
+
+private:
+  kj::Array<word> words;
+  FlatArrayMessageReader message;
+};
+
+// =======================================================================================
+
+SharedMemoryVatNetwork::SharedMemoryVatNetwork(
+    kj::AsyncCapabilityStream& stream, rpc::twoparty::Side side,
+    ReaderOptions receiveOptions, size_t bufferSize)
+    : stream(stream), side(side), peerVatId(4), receiveOptions(receiveOptions) {
+  peerVatId.initRoot<rpc::twoparty::VatId>().setSide(
+      side == rpc::twoparty::Side::CLIENT ? rpc::twoparty::Side::SERVER
+                                          : rpc::twoparty::Side::CLIENT);
+
+  kj::Promise<void> setup = side == rpc::twoparty::Side::CLIENT
+      ? setupClient(bufferSize) : setupServer();
+  setupPromise = setup.then([this]() {
+    doorbellTask = readDoorbells().eagerlyEvaluate([this](kj::Exception&& e) {
+      // We treat a socket error the same as a disconnect.  As with TwoPartyVatNetwork, the RPC
+      // system will notice when it next tries to receive.
+      peerDisconnected = true;
+      wakeDoorbellWaiters();
+    });
+  }).fork();
+  previousDoorbell = setupPromise.addBranch();
+
+  auto paf = kj::newPromiseAndFulfiller<void>();
+  disconnectPromise = paf.promise.fork();
+  disconnectFulfiller.fulfiller = kj::mv(paf.fulfiller);
+}
+
+SharedMemoryVatNetwork::~SharedMemoryVatNetwork() noexcept(false) {}
+
+kj::Promise<void> SharedMemoryVatNetwork::setupClient(size_t bufferSize) {
+  KJ_REQUIRE(isValidBufferSize(bufferSize), bufferSize,
+             "bufferSize must be a power of two and at least 4096");
+  uint64_t totalSize = REGION_HEADER_SIZE + 2 * bufferSize;
+
+  int fd;
+#if __linux__
+  KJ_SYSCALL(fd = memfd_create("capnp-rpc-shm", MFD_CLOEXEC | MFD_ALLOW_SEALING));
+#else
+  {
+    static uint counter = 0;
+    auto name = kj::str("/capnp-rpc-shm-", getpid(), '-', __atomic_fetch_add(&counter, 1,
+                                                                             __ATOMIC_RELAXED));
+    KJ_SYSCALL(fd = shm_open(name.cStr(), O_RDWR | O_CREAT | O_EXCL, 0600), name);
+    KJ_SYSCALL(shm_unlink(name.cStr()), name);
+  }
+#endif
+  auto file = kj::newDiskFile(kj::AutoCloseFd(fd));
+  file->truncate(totalSize);
+#if __linux__
+  // Make sure the server can trust the size of the region:  if we could shrink it later, the
+  // server would crash with SIGBUS when touching the missing pages.
+  KJ_SYSCALL(fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL));
+#endif
+
+  mapping = file->mmapWritable(0, totalSize);
+  auto region = mapping->get();
+  auto& header = *reinterpret_cast<RegionHeader*>(region.begin());
+  header.magic = REGION_MAGIC;
+  header.bufferSize = bufferSize;
+  initRings(region, bufferSize);
+
+  return stream.sendFd(fd).attach(kj::mv(file));
+}
+
+kj::Promise<void> SharedMemoryVatNetwork::setupServer() {
+  return stream.receiveFd().then([this](kj::AutoCloseFd&& fd) {
+#if __linux__
+    int seals;
+    KJ_SYSCALL(seals = fcntl(fd, F_GET_SEALS));
+    KJ_REQUIRE((seals & F_SEAL_SHRINK) != 0, "peer's shared memory region is not sealed");
+#endif
+
+    auto file = kj::newDiskFile(kj::mv(fd));
+    uint64_t totalSize = file->stat().size;
+    KJ_REQUIRE(totalSize >= REGION_HEADER_SIZE, "peer's shared memory region is too small");
+
+    mapping = file->mmapWritable(0, totalSize);
+    auto region = mapping->get();
+    auto& header = *reinterpret_cast<RegionHeader*>(region.begin());
+    uint64_t bufferSize = atomicLoad(header.bufferSize);
+    KJ_REQUIRE(atomicLoad(header.magic) == REGION_MAGIC,
+               "peer is not using SharedMemoryVatNetwork");
+    KJ_REQUIRE(isValidBufferSize(bufferSize) &&
+               REGION_HEADER_SIZE + 2 * bufferSize <= totalSize,
+               "peer's shared memory region is malformed", bufferSize, totalSize);
+    initRings(region, bufferSize);
+  });
+}
+
+void SharedMemoryVatNetwork::initRings(kj::ArrayPtr<byte> region, size_t bufferSize) {
+  auto& header = *reinterpret_cast<RegionHeader*>(region.begin());
+  byte* data = region.begin() + REGION_HEADER_SIZE;
+
+  auto clientToServer = kj::heap<Ring>(header.rings[0], data, bufferSize);
+  auto serverToClient = kj::heap<Ring>(header.rings[1], data + bufferSize, bufferSize);
+  if (side == rpc::twoparty::Side::CLIENT) {
+    outgoing = kj::mv(clientToServer);
+    incoming = kj::mv(serverToClient);
+  } else {
+    outgoing = kj::mv(serverToClient);
+    incoming = kj::mv(clientToServer);
+  }
+}
+
+void SharedMemoryVatNetwork::FulfillerDisposer::disposeImpl(void* pointer) const {
+  if (--refcount == 0) {
+    fulfiller->fulfill();
+  }
+}
+
+kj::Own<TwoPartyVatNetworkBase::Connection> SharedMemoryVatNetwork::asConnection() {
+  ++disconnectFulfiller.refcount;
+  return kj::Own<TwoPartyVatNetworkBase::Connection>(this, disconnectFulfiller);
+}
+
+kj::Maybe<kj::Own<TwoPartyVatNetworkBase::Connection>> SharedMemoryVatNetwork::connect(
+    rpc::twoparty::VatId::Reader ref) {
+  if (ref.getSide() == side) {
+    return nullptr;
+  } else {
+    return asConnection();
+  }
+}
+
+kj::Promise<kj::Own<TwoPartyVatNetworkBase::Connection>> SharedMemoryVatNetwork::accept() {
+  if (side == rpc::twoparty::Side::SERVER && !accepted) {
+    accepted = true;
+    return asConnection();
+  } else {
+    // Create a promise that will never be fulfilled.
+    auto paf = kj::newPromiseAndFulfiller<kj::Own<TwoPartyVatNetworkBase::Connection>>();
+    acceptFulfiller = kj::mv(paf.fulfiller);
+    return kj::mv(paf.promise);
+  }
+}
+
+// ---------------------------------------------------------------------------------------
+// Wakeups
+
+kj::Promise<void> SharedMemoryVatNetwork::readDoorbells() {
+  return stream.tryRead(doorbellBuffer, 1, sizeof(doorbellBuffer))
+      .then([this](size_t n) -> kj::Promise<void> {
+    if (n == 0) {
+      peerDisconnected = true;
+      wakeDoorbellWaiters();
+      return kj::READY_NOW;
+    }
+
+    // Any number of wakeup bytes means the same thing:  go look at the rings.
+    wakeDoorbellWaiters();
+    return readDoorbells();
+  });
+}
+
+kj::Promise<void> SharedMemoryVatNetwork::waitForDoorbell() {
+  if (peerDisconnected) {
+    return kj::READY_NOW;
+  }
+
+  auto paf = kj::newPromiseAndFulfiller<void>();
+  doorbellWaiters.add(kj::mv(paf.fulfiller));
+  return kj::mv(paf.promise);
+}
+
+void SharedMemoryVatNetwork::wakeDoorbellWaiters() {
+  auto waiters = doorbellWaiters.releaseAsArray();
+  for (auto& waiter: waiters) {
+    waiter->fulfill();
+  }
+}
+
+void SharedMemoryVatNetwork::ringDoorbell() {
+  KJ_IF_MAYBE(previous, previousDoorbell) {
+    *previous = previous->then([this]() {
+      return stream.write(&DOORBELL, 1);
+    }).eagerlyEvaluate(nullptr);
+  } else {
+    // We've shut down; the peer will get EOF instead, which wakes it just the same.
+  }
+}
+
+// ---------------------------------------------------------------------------------------
+// Sending
+
+bool SharedMemoryVatNetwork::hasRoomFor(OutgoingMessageImpl& message) {
+  auto& ring = *outgoing;
+  uint64_t used = ring.header.head - atomicLoad(ring.header.tail);
+  KJ_REQUIRE(used <= ring.capacity, "shared memory ring is corrupt");
+  return ring.capacity - used >= message.getRecordSize();
+}
+
+bool SharedMemoryVatNetwork::tryWrite(OutgoingMessageImpl& message) {
+  if (!hasRoomFor(message)) {
+    return false;
+  }
+
+  auto& ring = *outgoing;
+  uint64_t head = ring.header.head;
+  message.copyTo(ring, head);
+  atomicStore(ring.header.head, head + message.getRecordSize());
+
+  if (atomicExchange(ring.header.readerWaiting, uint32_t(0)) != 0) {
+    ringDoorbell();
+  }
+  return true;
+}
+
+void SharedMemoryVatNetwork::queueSend(kj::Own<OutgoingMessageImpl> message) {
+  if (!flushing && outgoing.get() != nullptr) {
+    if (tryWrite(*message)) {
+      return;
+    }
+  }
+
+  pendingSends.add(kj::mv(message));
+  if (!flushing) {
+    flushing = true;
+    flushPromise = setupPromise.addBranch().then([this]() {
+      return flushPendingSends();
+    }).fork();
+  }
+}
+
+kj::Promise<void> SharedMemoryVatNetwork::flushPendingSends() {
+  auto& ring = *outgoing;
+
+  while (pendingSendsStart < pendingSends.size()) {
+    auto& message = *pendingSends[pendingSendsStart];
+    if (message.getRecordSize() > ring.capacity) {
+      // Only possible on the server side, if the message was sent before we learned the ring
+      // size.
+      KJ_LOG(ERROR, "dropping Cap'n Proto message larger than the shared memory ring",
+                    message.getRecordSize(), ring.capacity);
+    } else if (!tryWrite(message)) {
+      break;
+    }
+    pendingSends[pendingSendsStart++] = nullptr;
+  }
+
+  if (pendingSendsStart == pendingSends.size() || peerDisconnected) {
+    pendingSends.clear();
+    pendingSendsStart = 0;
+    flushing = false;
+    return kj::READY_NOW;
+  }
+
+  // The ring is full.  Ask the reader to wake us, then check once more in case it drained the
+  // ring before seeing the flag.
+  atomicStore(ring.header.writerWaiting, uint32_t(1));
+  if (hasRoomFor(*pendingSends[pendingSendsStart])) {
+    return flushPendingSends();
+  }
+  return waitForDoorbell().then([this]() { return flushPendingSends(); });
+}
+
+// ---------------------------------------------------------------------------------------
+// Receiving
+
+kj::Maybe<kj::Own<IncomingRpcMessage>> SharedMemoryVatNetwork::tryRead() {
+  auto& ring = *incoming;
+
+  // The peer can write to the ring header at any time, so each field is read exactly once and
+  // validated before use.
+  uint64_t tail = ring.header.tail;
+  uint64_t head = atomicLoad(ring.header.head);
+  if (head == tail) {
+    return nullptr;
+  }
+
+  uint64_t available = head - tail;
+  KJ_REQUIRE(available >= sizeof(uint64_t) && available <= ring.capacity,
+             "shared memory ring is corrupt", head, tail);
+
+  uint64_t size;
+  ring.copyOut(tail, &size, sizeof(size));
+  KJ_REQUIRE(size > 0 && size % sizeof(word) == 0 && size <= available - sizeof(uint64_t),
+             "shared memory ring is corrupt", size, available);
+  KJ_REQUIRE(size / sizeof(word) <= receiveOptions.traversalLimitInWords,
+             "Message is too large.  To increase the limit on the receiving end, see "
+             "capnp::ReaderOptions.");
+
+  auto words = kj::heapArray<word>(size / sizeof(word));
+  ring.copyOut(tail + sizeof(uint64_t), words.begin(), size);
+
+  atomicStore(ring.header.tail, tail + sizeof(uint64_t) + size);
+  if (atomicExchange(ring.header.writerWaiting, uint32_t(0)) != 0) {
+    ringDoorbell();
+  }
+
+  return kj::Own<IncomingRpcMessage>(kj::heap<IncomingMessageImpl>(kj::mv(words), receiveOptions));
+}
+
+kj::Promise<kj::Maybe<kj::Own<IncomingRpcMessage>>> SharedMemoryVatNetwork::receiveLoop() {
+  KJ_IF_MAYBE(message, tryRead()) {
+    return kj::Maybe<kj::Own<IncomingRpcMessage>>(kj::mv(*message));
+  }
+
+  if (peerDisconnected) {
+    // The peer published everything it sent before closing the socket, so an empty ring means
+    // there's nothing more coming.
+    return kj::Maybe<kj::Own<IncomingRpcMessage>>(nullptr);
+  }
+
+  // Ask the writer to wake us, then check once more in case it wrote before seeing the flag.
+  atomicStore(incoming->header.readerWaiting, uint32_t(1));
+  KJ_IF_MAYBE(message, tryRead()) {
+    return kj::Maybe<kj::Own<IncomingRpcMessage>>(kj::mv(*message));
+  }
+
+  return waitForDoorbell().then([this]() { return receiveLoop(); });
+}
+
+// ---------------------------------------------------------------------------------------
+
+rpc::twoparty::VatId::Reader SharedMemoryVatNetwork::getPeerVatId() {
+  return peerVatId.getRoot<rpc::twoparty::VatId>();
+}
+
+kj::Own<OutgoingRpcMessage> SharedMemoryVatNetwork::newOutgoingMessage(
+    uint firstSegmentWordSize) {
+  return kj::refcounted<OutgoingMessageImpl>(*this, firstSegmentWordSize);
+}
+
+kj::Promise<kj::Maybe<kj::Own<IncomingRpcMessage>>>
+    SharedMemoryVatNetwork::receiveIncomingMessage() {
+  return setupPromise.addBranch().then([this]() {
+    return receiveLoop();
+  });
+}
+
+kj::Promise<void> SharedMemoryVatNetwork::shutdown() {
+  kj::Promise<void> drained = flushing ? flushPromise.addBranch() : kj::READY_NOW;
+  return drained.then([this]() {
+    kj::Promise<void> result = KJ_ASSERT_NONNULL(previousDoorbell, "already shut down")
+        .then([this]() {
+      stream.shutdownWrite();
+    });
+    previousDoorbell = nullptr;
+    return kj::mv(result);
+  });
+}
+
+}  // namespace capnp
+
+#endif  // !_WIN32
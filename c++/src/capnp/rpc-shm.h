@@ -0,0 +1,165 @@
+// Copyright (c) 2017 Sandstorm Development Group, Inc. and contributors
+// Licensed under the MIT License:
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+#pragma once
+
+#if defined(__GNUC__) && !defined(CAPNP_HEADER_WARNINGS)
+#pragma GCC system_header
+#endif
+
+#include "rpc-twoparty.h"
+#include <kj/vector.h>
+
+namespace kj {
+  class WritableFileMapping;
+}
+
+namespace capnp {
+
+class SharedMemoryVatNetwork: public TwoPartyVatNetworkBase,
+                              private TwoPartyVatNetworkBase::Connection {
+  // A two-party `VatNetwork`, like `TwoPartyVatNetwork`, for the case where both parties run on
+  // the same machine.  Messages are passed through a pair of ring buffers in a shared memory
+  // region instead of being written to the socket, so a message costs two memcpy()s (one into
+  // the ring, one out of it) and no system calls while both sides are busy.
+  //
+  // The socket is still needed, for two things:  the client side creates the shared memory
+  // region and passes its file descriptor to the server through the socket, and afterwards each
+  // side writes a single byte to the socket to wake the other when the other has gone to sleep
+  // waiting for messages (or for space in a full ring).  Disconnects are detected via the socket
+  // as usual.
+  //
+  // Both sides must use SharedMemoryVatNetwork; it does not interoperate with
+  // TwoPartyVatNetwork.  Only available on Unix, since it depends on file descriptor passing.
+  //
+  // The peer has write access to the shared memory at all times, so incoming messages are copied
+  // out of the ring before being parsed and all ring metadata is validated; a misbehaving peer
+  // can cause the connection to fail but cannot corrupt our own memory.
+  //
+  // On Linux the region is a sealed memfd, so neither side can resize it once it is set up, and
+  // the server refuses a region that is not sealed.  Other platforms have no equivalent of
+  // sealing:  there, a peer that truncates the region can make our next access to it fault with
+  // SIGBUS, killing the process.  Only use SharedMemoryVatNetwork with a trusted peer on such
+  // platforms.
+
+public:
+  static constexpr size_t DEFAULT_BUFFER_SIZE = 1 << 20;
+
+  SharedMemoryVatNetwork(kj::AsyncCapabilityStream& stream, rpc::twoparty::Side side,
+                         ReaderOptions receiveOptions = ReaderOptions(),
+                         size_t bufferSize = DEFAULT_BUFFER_SIZE);
+  // `bufferSize` is the size of each direction's ring, which bounds the size of a single message.
+  // It must be a power of two and at least 4096.  It is chosen by the client side; the server
+  // side's value is ignored.
+
+  ~SharedMemoryVatNetwork() noexcept(false);
+  KJ_DISALLOW_COPY(SharedMemoryVatNetwork);
+
+  kj::Promise<void> onDisconnect() { return disconnectPromise.addBranch(); }
+  // Returns a promise that resolves when the peer disconnects.
+
+  rpc::twoparty::Side getSide() { return side; }
+
+  // implements VatNetwork -----------------------------------------------------
+
+  kj::Maybe<kj::Own<TwoPartyVatNetworkBase::Connection>> connect(
+      rpc::twoparty::VatId::Reader ref) override;
+  kj::Promise<kj::Own<TwoPartyVatNetworkBase::Connection>> accept() override;
+
+private:
+  class OutgoingMessageImpl;
+  class IncomingMessageImpl;
+  struct Ring;
+
+  kj::AsyncCapabilityStream& stream;
+  rpc::twoparty::Side side;
+  MallocMessageBuilder peerVatId;
+  ReaderOptions receiveOptions;
+  bool accepted = false;
+
+  kj::Own<const kj::WritableFileMapping> mapping;
+  kj::Own<Ring> outgoing;
+  kj::Own<Ring> incoming;
+  // Null until the shared memory region has been set up.
+
+  kj::ForkedPromise<void> setupPromise = nullptr;
+  // Resolves once the shared memory region is mapped on this side.
+
+  kj::Promise<void> doorbellTask = nullptr;
+  byte doorbellBuffer[64];
+  // Reads wakeup bytes from the socket for as long as the connection lasts.
+
+  bool peerDisconnected = false;
+  kj::Vector<kj::Own<kj::PromiseFulfiller<void>>> doorbellWaiters;
+
+  kj::Maybe<kj::Promise<void>> previousDoorbell;
+  // Write queue for wakeup bytes.  Becomes null when shutdown() is called.
+
+  kj::Vector<kj::Own<OutgoingMessageImpl>> pendingSends;
+  size_t pendingSendsStart = 0;
+  // Messages waiting for the ring to have room (or for setup to finish), oldest first.
+
+  kj::ForkedPromise<void> flushPromise = nullptr;
+  bool flushing = false;
+  // `flushPromise` resolves when `pendingSends` has been drained; only meaningful if `flushing`.
+
+  kj::ForkedPromise<void> disconnectPromise = nullptr;
+  kj::Own<kj::PromiseFulfiller<kj::Own<TwoPartyVatNetworkBase::Connection>>> acceptFulfiller;
+  // Never fulfilled; see TwoPartyVatNetwork.
+
+  class FulfillerDisposer: public kj::Disposer {
+    // See the identically-named class in TwoPartyVatNetwork.
+
+  public:
+    mutable kj::Own<kj::PromiseFulfiller<void>> fulfiller;
+    mutable uint refcount = 0;
+
+    void disposeImpl(void* pointer) const override;
+  };
+  FulfillerDisposer disconnectFulfiller;
+
+  kj::Own<TwoPartyVatNetworkBase::Connection> asConnection();
+
+  kj::Promise<void> setupClient(size_t bufferSize);
+  kj::Promise<void> setupServer();
+  void initRings(kj::ArrayPtr<byte> region, size_t bufferSize);
+
+  kj::Promise<void> readDoorbells();
+  kj::Promise<void> waitForDoorbell();
+  void wakeDoorbellWaiters();
+  void ringDoorbell();
+
+  bool hasRoomFor(OutgoingMessageImpl& message);
+  bool tryWrite(OutgoingMessageImpl& message);
+  kj::Maybe<kj::Own<IncomingRpcMessage>> tryRead();
+  void queueSend(kj::Own<OutgoingMessageImpl> message);
+  kj::Promise<void> flushPendingSends();
+  kj::Promise<kj::Maybe<kj::Own<IncomingRpcMessage>>> receiveLoop();
+
+  // implements Connection -----------------------------------------------------
+
+  rpc::twoparty::VatId::Reader getPeerVatId() override;
+  kj::Own<OutgoingRpcMessage> newOutgoingMessage(uint firstSegmentWordSize) override;
+  kj::Promise<kj::Maybe<kj::Own<IncomingRpcMessage>>> receiveIncomingMessage() override;
+  kj::Promise<void> shutdown() override;
+};
+
+}  // namespace capnp
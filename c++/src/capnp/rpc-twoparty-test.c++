@@ -225,6 +225,71 @@ TEST(TwoPartyNetwork, Pipelining) {
   }
 }
 
+class WriteCountingStream final: public kj::AsyncIoStream {
+  // Forwards to another stream, keeping track of how writes are issued.
+
+public:
+  explicit WriteCountingStream(kj::AsyncIoStream& inner): inner(inner) {}
+
+  uint writeCount = 0;
+  size_t maxPiecesPerWrite = 0;
+
+  kj::Promise<size_t> tryRead(void* buffer, size_t minBytes, size_t maxBytes) override {
+    return inner.tryRead(buffer, minBytes, maxBytes);
+  }
+  kj::Promise<void> write(const void* buffer, size_t size) override {
+    ++writeCount;
+    maxPiecesPerWrite = kj::max(maxPiecesPerWrite, size_t(1));
+    return inner.write(buffer, size);
+  }
+  kj::Promise<void> write(kj::ArrayPtr<const kj::ArrayPtr<const byte>> pieces) override {
+    ++writeCount;
+    maxPiecesPerWrite = kj::max(maxPiecesPerWrite, pieces.size());
+    return inner.write(pieces);
+  }
+  void shutdownWrite() override {
+    inner.shutdownWrite();
+  }
+
+private:
+  kj::AsyncIoStream& inner;
+};
+
+TEST(TwoPartyNetwork, BatchedWrites) {
+  auto ioContext = kj::setupAsyncIo();
+  int callCount = 0;
+  int handleCount = 0;
+
+  auto serverThread = runServer(*ioContext.provider, callCount, handleCount);
+  WriteCountingStream stream(*serverThread.pipe);
+  TwoPartyVatNetwork network(stream, rpc::twoparty::Side::CLIENT);
+  auto rpcClient = makeRpcClient(network);
+
+  auto client = getPersistentCap(rpcClient, rpc::twoparty::Side::SERVER,
+      test::TestSturdyRefObjectId::Tag::TEST_INTERFACE).castAs<test::TestInterface>();
+
+  // Calls made during one turn are flushed together.
+  kj::Vector<kj::Promise<void>> promises;
+  for (uint i = 0; i < 100; i++) {
+    auto request = client.fooRequest();
+    request.setI(123);
+    request.setJ(true);
+    promises.add(request.send().then([](Response<test::TestInterface::FooResults>&& response) {
+      EXPECT_EQ("foo", response.getX());
+    }));
+  }
+  EXPECT_EQ(0u, stream.writeCount);
+
+  kj::joinPromises(promises.releaseAsArray()).wait(ioContext.waitScope);
+
+  EXPECT_EQ(100, callCount);
+
+  // Each single-segment message contributes two pieces (segment table and segment), so all 100
+  // calls (plus the bootstrap) must have gone out in one write.
+  EXPECT_LE(202u, stream.maxPiecesPerWrite);
+  EXPECT_GT(50u, stream.writeCount);
+}
+
 TEST(TwoPartyNetwork, Release) {
   auto ioContext = kj::setupAsyncIo();
   int callCount = 0;
@@ -337,6 +402,59 @@ TEST(TwoPartyNetwork, ConvenienceClasses) {
   EXPECT_EQ(1, callCount);
 }
 
+class FailingWriteStream final: public kj::AsyncIoStream {
+  // Reads never complete; writes fail.
+
+public:
+  uint writeCount = 0;
+
+  kj::Promise<size_t> tryRead(void* buffer, size_t minBytes, size_t maxBytes) override {
+    return kj::NEVER_DONE;
+  }
+  kj::Promise<void> write(const void* buffer, size_t size) override {
+    ++writeCount;
+    return KJ_EXCEPTION(DISCONNECTED, "test write failure");
+  }
+  kj::Promise<void> write(kj::ArrayPtr<const kj::ArrayPtr<const byte>> pieces) override {
+    ++writeCount;
+    return KJ_EXCEPTION(DISCONNECTED, "test write failure");
+  }
+  void shutdownWrite() override {}
+};
+
+TEST(TwoPartyNetwork, SendAfterWriteFailure) {
+  kj::EventLoop loop;
+  kj::WaitScope waitScope(loop);
+
+  FailingWriteStream stream;
+  TwoPartyVatNetwork network(stream, rpc::twoparty::Side::CLIENT);
+
+  MallocMessageBuilder vatIdMessage;
+  auto vatId = vatIdMessage.initRoot<rpc::twoparty::VatId>();
+  vatId.setSide(rpc::twoparty::Side::SERVER);
+  auto connection = KJ_ASSERT_NONNULL(network.connect(vatId));
+
+  auto send = [&]() {
+    auto message = connection->newOutgoingMessage(0);
+    message->getBody().setAs<Text>("foo");
+    message->send();
+  };
+
+  send();
+  send();
+  kj::evalLater([]() {}).wait(waitScope);
+  kj::evalLater([]() {}).wait(waitScope);
+  EXPECT_EQ(1u, stream.writeCount);
+
+  // Once a write has failed, sends fail immediately rather than queueing forever.
+  for (uint i = 0; i < 3; i++) {
+    KJ_EXPECT_THROW_RECOVERABLE_MESSAGE("test write failure", send());
+  }
+  EXPECT_EQ(1u, stream.writeCount);
+
+  KJ_EXPECT_THROW_MESSAGE("test write failure", connection->shutdown().wait(waitScope));
+}
+
 TEST(TwoPartyNetwork, HugeMessage) {
   auto ioContext = kj::setupAsyncIo();
   int callCount = 0;
@@ -22,13 +22,56 @@
 #include "rpc-twoparty.h"
 #include "serialize-async.h"
 #include <kj/debug.h>
+#include <string.h>
 
 namespace capnp {
 
+class TwoPartyVatNetwork::BufferedInput final: public kj::AsyncInputStream {
+  // Read-ahead buffer in front of the connection.  Reads which can be satisfied from the buffer
+  // complete without touching the underlying stream; reads which can't are topped up with one
+  // large read.  Reads that are larger than the buffer bypass it.
+
+public:
+  explicit BufferedInput(kj::AsyncInputStream& inner): inner(inner) {}
+
+  kj::Promise<size_t> tryRead(void* buffer, size_t minBytes, size_t maxBytes) override {
+    byte* out = reinterpret_cast<byte*>(buffer);
+    size_t n = kj::min(maxBytes, buffered.size());
+    memcpy(out, buffered.begin(), n);
+    buffered = buffered.slice(n, buffered.size());
+    if (n >= minBytes) {
+      return n;
+    }
+
+    out += n;
+    minBytes -= n;
+    maxBytes -= n;
+
+    if (maxBytes >= sizeof(storage)) {
+      return inner.tryRead(out, minBytes, maxBytes)
+          .then([n](size_t actual) { return n + actual; });
+    }
+
+    return inner.tryRead(storage, minBytes, sizeof(storage))
+        .then([this,out,n,maxBytes](size_t actual) {
+      size_t m = kj::min(actual, maxBytes);
+      memcpy(out, storage, m);
+      buffered = kj::arrayPtr(storage + m, actual - m);
+      return n + m;
+    });
+  }
+
+private:
+  kj::AsyncInputStream& inner;
+  byte storage[8192];
+  kj::ArrayPtr<byte> buffered;
+};
+
 TwoPartyVatNetwork::TwoPartyVatNetwork(kj::AsyncIoStream& stream, rpc::twoparty::Side side,
                                        ReaderOptions receiveOptions)
     : stream(stream), side(side), peerVatId(4),
-      receiveOptions(receiveOptions), previousWrite(kj::READY_NOW) {
+      receiveOptions(receiveOptions), bufferedInput(kj::heap<BufferedInput>(stream)),
+      previousWrite(kj::READY_NOW) {
   peerVatId.initRoot<rpc::twoparty::VatId>().setSide(
       side == rpc::twoparty::Side::CLIENT ? rpc::twoparty::Side::SERVER
                                           : rpc::twoparty::Side::CLIENT);
@@ -93,17 +136,7 @@ public:
       return;
     }
 
-    network.previousWrite = KJ_ASSERT_NONNULL(network.previousWrite, "already shut down")
-        .then([&]() {
-      // Note that if the write fails, all further writes will be skipped due to the exception.
-      // We never actually handle this exception because we assume the read end will fail as well
-      // and it's cleaner to handle the failure there.
-      return writeMessage(network.stream, message);
-    }).attach(kj::addRef(*this))
-      // Note that it's important that the eagerlyEvaluate() come *after* the attach() because
-      // otherwise the message (and any capabilities in it) will not be released until a new
-      // message is written! (Kenton once spent all afternoon tracking this down...)
-      .eagerlyEvaluate(nullptr);
+    network.queueWrite(message.getSegmentsForOutput(), kj::addRef(*this));
   }
 
 private:
@@ -131,9 +164,54 @@ kj::Own<OutgoingRpcMessage> TwoPartyVatNetwork::newOutgoingMessage(uint firstSeg
   return kj::refcounted<OutgoingMessageImpl>(*this, firstSegmentWordSize);
 }
 
+void TwoPartyVatNetwork::queueWrite(kj::ArrayPtr<const kj::ArrayPtr<const word>> segments,
+                                    kj::Own<OutgoingRpcMessage> message) {
+  auto& writeQueue = KJ_ASSERT_NONNULL(previousWrite, "already shut down");
+
+  KJ_IF_MAYBE(exception, writeFailure) {
+    // Nothing queued now could ever be written, so fail instead of accumulating messages.
+    kj::throwRecoverableException(kj::cp(*exception));
+    return;
+  }
+
+  queuedSegments.add(segments);
+  queuedMessages.add(kj::mv(message));
+
+  if (queuedMessages.size() == 1) {
+    // First message since the last flush started.  Schedule a flush for after the previous write
+    // completes; since then() continuations never run synchronously, anything else sent during
+    // this turn will be picked up by the same flush.
+    previousWrite = writeQueue.then([this]() {
+      // Note that if the write fails, all further writes will be skipped due to the exception.
+      // We never actually handle this exception because we assume the read end will fail as well
+      // and it's cleaner to handle the failure there.  We do remember it, though, so that
+      // further sends fail immediately.
+      return flushQueuedWrites();
+    }).eagerlyEvaluate(nullptr);
+  }
+}
+
+kj::Promise<void> TwoPartyVatNetwork::flushQueuedWrites() {
+  auto segments = queuedSegments.releaseAsArray();
+  auto messages = queuedMessages.releaseAsArray();
+
+  // Note that it's important that the messages are attached to the write promise, and that this
+  // promise is eagerly evaluated, because otherwise the messages (and any capabilities in them)
+  // would not be released until a new message is written!
+  return kj::evalNow([&]() { return writeMessages(stream, segments); })
+      .attach(kj::mv(segments), kj::mv(messages))
+      .catch_([this](kj::Exception&& exception) -> kj::Promise<void> {
+    // Messages queued behind the failed write will never be flushed; release them now.
+    queuedSegments.clear();
+    queuedMessages.clear();
+    writeFailure = kj::cp(exception);
+    return kj::mv(exception);
+  });
+}
+
 kj::Promise<kj::Maybe<kj::Own<IncomingRpcMessage>>> TwoPartyVatNetwork::receiveIncomingMessage() {
   return kj::evalLater([&]() {
-    return tryReadMessage(stream, receiveOptions)
+    return tryReadMessage(*bufferedInput, receiveOptions)
         .then([&](kj::Maybe<kj::Own<MessageReader>>&& message)
               -> kj::Maybe<kj::Own<IncomingRpcMessage>> {
       KJ_IF_MAYBE(m, message) {
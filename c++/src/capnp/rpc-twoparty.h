@@ -28,6 +28,7 @@
 #include "rpc.h"
 #include "message.h"
 #include <kj/async-io.h>
+#include <kj/vector.h>
 #include <capnp/rpc-twoparty.capnp.h>
 
 namespace capnp {
@@ -69,6 +70,7 @@ public:
 private:
   class OutgoingMessageImpl;
   class IncomingMessageImpl;
+  class BufferedInput;
 
   kj::AsyncIoStream& stream;
   rpc::twoparty::Side side;
@@ -76,10 +78,24 @@ private:
   ReaderOptions receiveOptions;
   bool accepted = false;
 
+  kj::Own<kj::AsyncInputStream> bufferedInput;
+  // Wraps `stream` with a read-ahead buffer so that a burst of small messages sent together by
+  // the peer can be received with one read rather than two per message.
+
   kj::Maybe<kj::Promise<void>> previousWrite;
   // Resolves when the previous write completes.  This effectively serves as the write queue.
   // Becomes null when shutdown() is called.
 
+  kj::Vector<kj::ArrayPtr<const kj::ArrayPtr<const word>>> queuedSegments;
+  kj::Vector<kj::Own<OutgoingRpcMessage>> queuedMessages;
+  // Messages sent since the last flush began.  All messages sent during one event loop turn (or
+  // while a previous write is still in progress) are flushed together in a single write, so a
+  // burst of calls -- e.g. issuing many requests on a capability in a loop -- shares one system
+  // call.  Each message is still a separate RPC message on the wire.
+
+  kj::Maybe<kj::Exception> writeFailure;
+  // Set once a write has failed.  Later sends throw this rather than queueing.
+
   kj::Own<kj::PromiseFulfiller<kj::Own<TwoPartyVatNetworkBase::Connection>>> acceptFulfiller;
   // Fulfiller for the promise returned by acceptConnectionAsRefHost() on the client side, or the
   // second call on the server side.  Never fulfilled, because there is only one connection.
@@ -110,6 +126,10 @@ private:
   kj::Own<OutgoingRpcMessage> newOutgoingMessage(uint firstSegmentWordSize) override;
   kj::Promise<kj::Maybe<kj::Own<IncomingRpcMessage>>> receiveIncomingMessage() override;
   kj::Promise<void> shutdown() override;
+
+  void queueWrite(kj::ArrayPtr<const kj::ArrayPtr<const word>> segments,
+                  kj::Own<OutgoingRpcMessage> message);
+  kj::Promise<void> flushQueuedWrites();
 };
 
 class TwoPartyServer: private kj::TaskSet::ErrorHandler {
@@ -26,6 +26,7 @@
 #include <kj/async.h>
 #include <kj/one-of.h>
 #include <kj/function.h>
+#include <kj/map.h>
 #include <functional>  // std::greater
 #include <unordered_map>
 #include <map>
@@ -203,13 +204,18 @@ private:
 template <typename Id, typename T>
 class ImportTable {
   // Table mapping integers to T, where the integers are chosen remotely.
+  //
+  // References returned by operator[] and find() stay valid until that entry is erased, even as
+  // other entries come and go.
 
 public:
   T& operator[](Id id) {
     if (id < kj::size(low)) {
       return low[id];
     } else {
-      return high[id];
+      return *high.findOrCreate(id, [&]() {
+        return typename kj::HashMap<Id, kj::Own<T>>::Entry { id, kj::heap<T>() };
+      });
     }
   }
 
@@ -217,11 +223,10 @@ public:
     if (id < kj::size(low)) {
       return low[id];
     } else {
-      auto iter = high.find(id);
-      if (iter == high.end()) {
-        return nullptr;
+      KJ_IF_MAYBE(value, high.find(id)) {
+        return **value;
       } else {
-        return iter->second;
+        return nullptr;
       }
     }
   }
@@ -234,8 +239,11 @@ public:
       low[id] = T();
       return toRelease;
     } else {
-      T toRelease = kj::mv(high[id]);
-      high.erase(id);
+      T toRelease;
+      KJ_IF_MAYBE(value, high.find(id)) {
+        toRelease = kj::mv(**value);
+        high.erase(id);
+      }
       return toRelease;
     }
   }
@@ -246,13 +254,15 @@ public:
       func(i, low[i]);
     }
     for (auto& entry: high) {
-      func(entry.first, entry.second);
+      func(entry.key, *entry.value);
     }
   }
 
 private:
   T low[16];
-  std::unordered_map<Id, T> high;
+  kj::HashMap<Id, kj::Own<T>> high;
+  // Entries move within a HashMap when others are inserted or erased, and callers hold references
+  // across calls that can do either, so each entry is allocated separately.
 };
 
 // =======================================================================================
@@ -551,7 +561,7 @@ private:
   // The Four Tables!
   // The order of the tables is important for correct destruction.
 
-  std::unordered_map<ClientHook*, ExportId> exportsByCap;
+  kj::HashMap<ClientHook*, ExportId> exportsByCap;
   // Maps already-exported ClientHook objects to their ID in the export table.
 
   ExportTable<EmbargoId, Embargo> embargoes;
@@ -1065,18 +1075,17 @@ private:
     if (inner->getBrand() == this) {
       return kj::downcast<RpcClient>(*inner).writeDescriptor(descriptor);
     } else {
-      auto iter = exportsByCap.find(inner);
-      if (iter != exportsByCap.end()) {
+      KJ_IF_MAYBE(id, exportsByCap.find(inner)) {
         // We've already seen and exported this capability before.  Just up the refcount.
-        auto& exp = KJ_ASSERT_NONNULL(exports.find(iter->second));
+        auto& exp = KJ_ASSERT_NONNULL(exports.find(*id));
         ++exp.refcount;
-        descriptor.setSenderHosted(iter->second);
-        return iter->second;
+        descriptor.setSenderHosted(*id);
+        return *id;
       } else {
         // This is the first time we've seen this capability.
         ExportId exportId;
         auto& exp = exports.next(exportId);
-        exportsByCap[inner] = exportId;
+        exportsByCap.insert(inner, exportId);
         exp.refcount = 1;
         exp.clientHook = inner->addRef();
 
@@ -1171,7 +1180,7 @@ private:
       // export table is still live because when it is destroyed the asynchronous resolution task
       // (i.e. this code) is canceled.
       auto& exp = KJ_ASSERT_NONNULL(exports.find(exportId));
-      exportsByCap.erase(exp.clientHook);
+      exportsByCap.erase(exp.clientHook.get());
       exp.clientHook = kj::mv(resolution);
 
       if (exp.clientHook->getBrand() != this) {
@@ -1183,9 +1192,13 @@ private:
           // be able to just reuse the existing export table entry to represent the new promise --
           // unless it already has an entry.  Let's check.
 
-          auto insertResult = exportsByCap.insert(std::make_pair(exp.clientHook.get(), exportId));
+          bool inserted = false;
+          exportsByCap.findOrCreate(exp.clientHook.get(), [&]() {
+            inserted = true;
+            return kj::HashMap<ClientHook*, ExportId>::Entry { exp.clientHook.get(), exportId };
+          });
 
-          if (insertResult.second) {
+          if (inserted) {
             // The new promise was not already in the table, therefore the existing export table
             // entry has now been repurposed to represent it.  There is no need to send a resolve
             // message at all.  We do, however, have to start resolving the next promise.
@@ -2654,7 +2667,7 @@ private:
 
       exp->refcount -= refcount;
       if (exp->refcount == 0) {
-        exportsByCap.erase(exp->clientHook);
+        exportsByCap.erase(exp->clientHook.get());
         exports.erase(id, *exp);
       }
     } else {
@@ -25,6 +25,7 @@
 #include <kj/compat/gtest.h>
 #include "test-util.h"
 #include <kj/debug.h>
+#include <kj/thread.h>
 
 namespace capnp {
 namespace _ {  // private
@@ -389,6 +390,50 @@ TEST(SchemaLoader, Generics) {
   }
 }
 
+TEST(SchemaLoader, ConcurrentGet) {
+  // Readers look up schemas without locking while a writer keeps loading new ones, forcing the
+  // lock-free index to grow several times underneath them.
+
+  SchemaLoader loader;
+  constexpr uint64_t BASE_ID = 0xa000000000000000ull;
+  constexpr uint COUNT = 1000;
+
+  auto loadStruct = [&](uint i) {
+    MallocMessageBuilder builder;
+    auto node = builder.initRoot<schema::Node>();
+    node.setId(BASE_ID + i);
+    node.setDisplayName(kj::str("foo.capnp:Struct", i));
+    node.setDisplayNamePrefixLength(11);
+    node.initStruct();
+    loader.load(node.asReader());
+  };
+
+  loadStruct(0);
+
+  {
+    auto readers = kj::heapArrayBuilder<kj::Own<kj::Thread>>(4);
+    for (uint t = 0; t < 4; t++) {
+      readers.add(kj::heap<kj::Thread>([&]() {
+        for (uint i = 0; i < COUNT * 10; i++) {
+          auto id = BASE_ID + i % COUNT;
+          KJ_IF_MAYBE(schema, loader.tryGet(id)) {
+            KJ_ASSERT(schema->getProto().getId() == id);
+          }
+          KJ_ASSERT(loader.get(BASE_ID).getProto().getId() == BASE_ID);
+        }
+      }));
+    }
+
+    for (uint i = 1; i < COUNT; i++) {
+      loadStruct(i);
+    }
+  }
+
+  for (uint i = 0; i < COUNT; i++) {
+    EXPECT_EQ(BASE_ID + i, loader.get(BASE_ID + i).getProto().getId());
+  }
+}
+
 }  // namespace
 }  // namespace _ (private)
 }  // namespace capnp
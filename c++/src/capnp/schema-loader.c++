@@ -21,8 +21,6 @@
 
 #define CAPNP_PRIVATE
 #include "schema-loader.h"
-#include <unordered_map>
-#include <unordered_set>
 #include <map>
 #include "message.h"
 #include "arena.h"
@@ -30,6 +28,7 @@
 #include <kj/exception.h>
 #include <kj/arena.h>
 #include <kj/vector.h>
+#include <kj/map.h>
 #include <algorithm>
 
 #if _MSC_VER
@@ -40,23 +39,11 @@ namespace capnp {
 
 namespace {
 
-struct ByteArrayHash {
-  size_t operator()(kj::ArrayPtr<const byte> bytes) const {
-    // FNV hash. Probably sucks, but the code is simple.
-    //
-    // TODO(perf): Add CityHash or something to KJ and use it here.
+struct ByteArrayCallbacks {
+  // Compares byte arrays by content rather than by identity.
 
-    uint64_t hash = 0xcbf29ce484222325ull;
-    for (byte b: bytes) {
-      hash = hash * 0x100000001b3ull;
-      hash ^= b;
-    }
-    return hash;
-  }
-};
-
-struct ByteArrayEq {
-  bool operator()(kj::ArrayPtr<const byte> a, kj::ArrayPtr<const byte> b) const {
+  inline uint hashCode(kj::ArrayPtr<const byte> bytes) const { return kj::hashCode(bytes); }
+  inline bool matches(kj::ArrayPtr<const byte> a, kj::ArrayPtr<const byte> b) const {
     return a.size() == b.size() && memcmp(a.begin(), b.begin(), a.size()) == 0;
   }
 };
@@ -68,12 +55,112 @@ struct SchemaBindingsPair {
   inline bool operator==(const SchemaBindingsPair& other) const {
     return schema == other.schema && scopeBindings == other.scopeBindings;
   }
+  inline uint hashCode() const {
+    return kj::hashCode(schema, scopeBindings);
+  }
 };
 
-struct SchemaBindingsPairHash {
-  size_t operator()(SchemaBindingsPair pair) const {
-    return 31 * reinterpret_cast<uintptr_t>(pair.schema) +
-                reinterpret_cast<uintptr_t>(pair.scopeBindings);
+template <typename T>
+inline T loadAcquire(const T& ref) {
+#if __GNUC__
+  return __atomic_load_n(&ref, __ATOMIC_ACQUIRE);
+#elif _MSC_VER
+  T result = *static_cast<const volatile T*>(&ref);
+  std::atomic_thread_fence(std::memory_order_acquire);
+  return result;
+#else
+#error "Platform not supported"
+#endif
+}
+
+template <typename T>
+inline void storeRelease(T& ref, T value) {
+#if __GNUC__
+  __atomic_store_n(&ref, value, __ATOMIC_RELEASE);
+#elif _MSC_VER
+  std::atomic_thread_fence(std::memory_order_release);
+  *static_cast<volatile T*>(&ref) = value;
+#else
+#error "Platform not supported"
+#endif
+}
+
+inline size_t hashKey(uint64_t key) {
+  // Type IDs are already random, but mix anyway in case someone hand-picked sequential ones.
+  key *= 0x9e3779b97f4a7c15ull;
+  return key ^ (key >> 32);
+}
+
+inline size_t hashKey(const void* key) {
+  return hashKey(static_cast<uint64_t>(reinterpret_cast<uintptr_t>(key)));
+}
+
+template <typename T, typename Key, Key T::*key>
+class LockFreeIndex {
+  // An insert-only hash index from `Key` to `T*`, where the key is a member of `T`. Inserts must
+  // be made under the loader's exclusive lock, but lookups need no lock at all.
+  //
+  // Each slot is a single pointer, published with a release-store only once the pointee is fully
+  // initialized, and the key is read back from the pointee, so readers never see a half-written
+  // entry. When the table fills up, a larger copy is published and the old one is left in the
+  // arena so that concurrent readers can finish probing it. Such a reader may miss an entry added
+  // after the switch; callers treat a miss as "maybe not loaded" and fall back to the locked path.
+
+public:
+  explicit LockFreeIndex(kj::Arena& arena): arena(arena) {}
+
+  T* find(Key k) const {
+    const Table* table = loadAcquire(current);
+    if (table == nullptr) return nullptr;
+
+    for (size_t i = hashKey(k) & table->mask;; i = (i + 1) & table->mask) {
+      T* entry = loadAcquire(table->slots[i]);
+      if (entry == nullptr) return nullptr;
+      if (entry->*key == k) return entry;
+    }
+  }
+
+  void insert(T* entry) {
+    if (current == nullptr || (count + 1) * 2 > current->mask + 1) {
+      // Keep the load factor under 1/2 so that probe sequences stay short.
+      Table* newTable = &allocateTable(current == nullptr ? 64 : (current->mask + 1) * 2);
+      if (current != nullptr) {
+        for (size_t i = 0; i <= current->mask; i++) {
+          if (current->slots[i] != nullptr) insertInto(*newTable, current->slots[i]);
+        }
+      }
+      storeRelease(current, newTable);
+    }
+
+    insertInto(*current, entry);
+    ++count;
+  }
+
+private:
+  struct Table {
+    size_t mask;
+    T** slots;
+  };
+
+  kj::Arena& arena;
+  Table* current = nullptr;
+  size_t count = 0;
+
+  Table& allocateTable(size_t capacity) {
+    auto& table = arena.allocate<Table>();
+    table.mask = capacity - 1;
+    table.slots = arena.allocateArray<T*>(capacity).begin();
+    memset(table.slots, 0, capacity * sizeof(T*));
+    return table;
+  }
+
+  static void insertInto(Table& table, T* entry) {
+    for (size_t i = hashKey(entry->*key) & table.mask;; i = (i + 1) & table.mask) {
+      if (table.slots[i] == nullptr) {
+        storeRelease(table.slots[i], entry);
+        return;
+      }
+    }
   }
 };
 
@@ -113,9 +200,11 @@ private:
 class SchemaLoader::Impl {
 public:
   inline explicit Impl(const SchemaLoader& loader)
-      : initializer(loader), brandedInitializer(loader) {}
+      : schemasIndex(arena), unboundBrandsIndex(arena),
+        initializer(loader), brandedInitializer(loader) {}
   inline Impl(const SchemaLoader& loader, const LazyLoadCallback& callback)
-      : initializer(loader, callback), brandedInitializer(loader) {}
+      : schemasIndex(arena), unboundBrandsIndex(arena),
+        initializer(loader, callback), brandedInitializer(loader) {}
 
   _::RawSchema* load(const schema::Node::Reader& reader, bool isPlaceholder);
 
@@ -136,8 +225,24 @@ public:
 
   TryGetResult tryGet(uint64_t typeId) const;
 
+  const _::RawSchema* tryGetWithoutLock(uint64_t typeId) const;
+  // Like tryGet(), but may be called without holding any lock. Returns null if the schema is not
+  // loaded or is still a placeholder -- or, rarely, if it was loaded very recently -- in which
+  // case the caller should fall back to tryGet() under lock.
+
   const _::RawBrandedSchema* getUnbound(const _::RawSchema* schema);
 
+  const _::RawBrandedSchema* tryGetUnboundWithoutLock(const _::RawSchema* schema) const;
+  // Like getUnbound(), but may be called without holding any lock. Returns null if the unbound
+  // brand hasn't been created yet, in which case the caller should fall back to getUnbound()
+  // under exclusive lock.
+
+  void publish();
+  // Make schemas created since the last call visible to tryGetWithoutLock() and
+  // tryGetUnboundWithoutLock(). Must be called with the exclusive lock held, at the end of every
+  // operation that may have created schemas. (We can't publish as we go, because a schema
+  // created during a recursive load may point at others that are still under construction.)
+
   kj::Array<Schema> getAllLoaded() const;
 
   void requireStructSize(uint64_t id, uint dataWordCount, uint pointerCount);
@@ -148,21 +253,31 @@ public:
   // its fields can't possibly write outside of the allocated space.
 
   kj::Arena arena;
+  // Note: Must be declared before the indexes below, which allocate from it.
 
 private:
-  std::unordered_set<kj::ArrayPtr<const byte>, ByteArrayHash, ByteArrayEq> dedupTable;
+  kj::HashSet<kj::ArrayPtr<const byte>, ByteArrayCallbacks> dedupTable;
   // Records raw segments of memory in the arena against which we my want to de-dupe later
   // additions. Specifically, RawBrandedSchema binding tables are de-duped.
 
-  std::unordered_map<uint64_t, _::RawSchema*> schemas;
-  std::unordered_map<SchemaBindingsPair, _::RawBrandedSchema*, SchemaBindingsPairHash> brands;
-  std::unordered_map<const _::RawSchema*, _::RawBrandedSchema*> unboundBrands;
+  kj::HashMap<uint64_t, _::RawSchema*> schemas;
+  kj::HashMap<SchemaBindingsPair, _::RawBrandedSchema*> brands;
+  kj::HashMap<const _::RawSchema*, _::RawBrandedSchema*> unboundBrands;
+
+  LockFreeIndex<_::RawSchema, uint64_t, &_::RawSchema::id> schemasIndex;
+  LockFreeIndex<_::RawBrandedSchema, const _::RawSchema*, &_::RawBrandedSchema::generic>
+      unboundBrandsIndex;
+  // Lock-free mirrors of `schemas` and `unboundBrands`, so that the common case of looking up an
+  // already-loaded schema doesn't contend on the loader's mutex. See publish().
+
+  kj::Vector<_::RawSchema*> unpublishedSchemas;
+  kj::Vector<_::RawBrandedSchema*> unpublishedUnboundBrands;
 
   struct RequiredSize {
     uint16_t dataWordCount;
     uint16_t pointerCount;
   };
-  std::unordered_map<uint64_t, RequiredSize> structSizeRequirements;
+  kj::HashMap<uint64_t, RequiredSize> structSizeRequirements;
 
   InitializerImpl initializer;
   BrandedInitializerImpl brandedInitializer;
@@ -1262,13 +1377,19 @@ _::RawSchema* SchemaLoader::Impl::load(const schema::Node::Reader& reader, bool
                      false);
   }
 
-  // Check if we already have a schema for this ID.
-  _::RawSchema*& slot = schemas[validatedReader.getId()];
+  // Check if we already have a schema for this ID.  (We copy out the pointer rather than holding
+  // a reference into the map, since the recursive calls below may insert into it.)
+  _::RawSchema* slot = nullptr;
+  KJ_IF_MAYBE(existing, schemas.find(validatedReader.getId())) {
+    slot = *existing;
+  }
   bool shouldReplace;
   bool shouldClearInitializer;
   if (slot == nullptr) {
     // Nope, allocate a new RawSchema.
     slot = &arena.allocate<_::RawSchema>();
+    schemas.insert(validatedReader.getId(), slot);
+    unpublishedSchemas.add(slot);
     memset(&slot->defaultBrand, 0, sizeof(slot->defaultBrand));
     slot->id = validatedReader.getId();
     slot->canCastTo = nullptr;
@@ -1329,11 +1450,16 @@ _::RawSchema* SchemaLoader::Impl::load(const schema::Node::Reader& reader, bool
 }
 
 _::RawSchema* SchemaLoader::Impl::loadNative(const _::RawSchema* nativeSchema) {
-  _::RawSchema*& slot = schemas[nativeSchema->id];
+  _::RawSchema* slot = nullptr;
+  KJ_IF_MAYBE(existing, schemas.find(nativeSchema->id)) {
+    slot = *existing;
+  }
   bool shouldReplace;
   bool shouldClearInitializer;
   if (slot == nullptr) {
     slot = &arena.allocate<_::RawSchema>();
+    schemas.insert(nativeSchema->id, slot);
+    unpublishedSchemas.add(slot);
     memset(&slot->defaultBrand, 0, sizeof(slot->defaultBrand));
     slot->defaultBrand.generic = slot;
     slot->lazyInitializer = nullptr;
@@ -1357,10 +1483,6 @@ _::RawSchema* SchemaLoader::Impl::loadNative(const _::RawSchema* nativeSchema) {
     shouldClearInitializer = slot->lazyInitializer != nullptr;
   }
 
-  // Since we recurse below, the slot in the hash map could move around.  Copy out the pointer
-  // for subsequent use.
-  // TODO(cleanup): Above comment is actually not true of unordered_map. Leaving here to explain
-  //   code pattern below.
   _::RawSchema* result = slot;
 
   if (shouldReplace) {
@@ -1390,10 +1512,9 @@ _::RawSchema* SchemaLoader::Impl::loadNative(const _::RawSchema* nativeSchema) {
     slot->defaultBrand.dependencyCount = deps.size();
 
     // If there is a struct size requirement, we need to make sure that it is satisfied.
-    auto reqIter = structSizeRequirements.find(nativeSchema->id);
-    if (reqIter != structSizeRequirements.end()) {
-      applyStructSizeRequirement(result, reqIter->second.dataWordCount,
-                                 reqIter->second.pointerCount);
+    KJ_IF_MAYBE(requirement, structSizeRequirements.find(nativeSchema->id)) {
+      applyStructSizeRequirement(result, requirement->dataWordCount,
+                                 requirement->pointerCount);
     }
   } else {
     // The existing schema is newer.
@@ -1539,20 +1660,17 @@ const _::RawBrandedSchema* SchemaLoader::Impl::makeBranded(
     return &schema->defaultBrand;
   }
 
-  auto& slot = brands[SchemaBindingsPair { schema, bindings.begin() }];
-
-  if (slot == nullptr) {
+  SchemaBindingsPair key { schema, bindings.begin() };
+  return brands.findOrCreate(key, [&]() {
     auto& brand = arena.allocate<_::RawBrandedSchema>();
     memset(&brand, 0, sizeof(brand));
-    slot = &brand;
 
     brand.generic = schema;
     brand.scopes = bindings.begin();
     brand.scopeCount = bindings.size();
     brand.lazyInitializer = &brandedInitializer;
-  }
-
-  return slot;
+    return kj::HashMap<SchemaBindingsPair, _::RawBrandedSchema*>::Entry { key, &brand };
+  });
 }
 
 kj::ArrayPtr<const _::RawBrandedSchema::Dependency>
@@ -1783,16 +1901,15 @@ kj::ArrayPtr<const T> SchemaLoader::Impl::copyDeduped(kj::ArrayPtr<const T> valu
 
   auto bytes = values.asBytes();
 
-  auto iter = dedupTable.find(bytes);
-  if (iter != dedupTable.end()) {
-    return kj::arrayPtr(reinterpret_cast<const T*>(iter->begin()), values.size());
+  KJ_IF_MAYBE(existing, dedupTable.find(bytes)) {
+    return kj::arrayPtr(reinterpret_cast<const T*>(existing->begin()), values.size());
   }
 
   // Need to make a new copy.
   auto copy = arena.allocateArray<T>(values.size());
   memcpy(copy.begin(), values.begin(), values.size() * sizeof(T));
 
-  KJ_ASSERT(dedupTable.insert(copy.asBytes()).second);
+  dedupTable.insert(copy.asBytes());
 
   return copy;
 }
@@ -1803,12 +1920,39 @@ kj::ArrayPtr<const T> SchemaLoader::Impl::copyDeduped(kj::ArrayPtr<T> values) {
 }
 
 SchemaLoader::Impl::TryGetResult SchemaLoader::Impl::tryGet(uint64_t typeId) const {
-  auto iter = schemas.find(typeId);
-  if (iter == schemas.end()) {
-    return {nullptr, initializer.getCallback()};
+  KJ_IF_MAYBE(schema, schemas.find(typeId)) {
+    return {*schema, initializer.getCallback()};
   } else {
-    return {iter->second, initializer.getCallback()};
+    return {nullptr, initializer.getCallback()};
+  }
+}
+
+const _::RawSchema* SchemaLoader::Impl::tryGetWithoutLock(uint64_t typeId) const {
+  const _::RawSchema* result = schemasIndex.find(typeId);
+  if (result == nullptr || loadAcquire(result->lazyInitializer) != nullptr) {
+    return nullptr;
   }
+  return result;
+}
+
+const _::RawBrandedSchema* SchemaLoader::Impl::tryGetUnboundWithoutLock(
+    const _::RawSchema* schema) const {
+  if (!readMessageUnchecked<schema::Node>(schema->encodedNode).getIsGeneric()) {
+    return &schema->defaultBrand;
+  }
+  return unboundBrandsIndex.find(schema);
+}
+
+void SchemaLoader::Impl::publish() {
+  for (auto schema: unpublishedSchemas) {
+    schemasIndex.insert(schema);
+  }
+  unpublishedSchemas.clear();
+
+  for (auto brand: unpublishedUnboundBrands) {
+    unboundBrandsIndex.insert(brand);
+  }
+  unpublishedUnboundBrands.clear();
 }
 
 const _::RawBrandedSchema* SchemaLoader::Impl::getUnbound(const _::RawSchema* schema) {
@@ -1817,14 +1961,19 @@ const _::RawBrandedSchema* SchemaLoader::Impl::getUnbound(const _::RawSchema* sc
     return &schema->defaultBrand;
   }
 
-  auto& slot = unboundBrands[schema];
+  _::RawBrandedSchema* slot = nullptr;
+  KJ_IF_MAYBE(existing, unboundBrands.find(schema)) {
+    slot = *existing;
+  }
   if (slot == nullptr) {
     slot = &arena.allocate<_::RawBrandedSchema>();
     memset(slot, 0, sizeof(*slot));
     slot->generic = schema;
+    unboundBrands.insert(schema, slot);
     auto deps = makeBrandedDependencies(schema, nullptr);
     slot->dependencies = deps.begin();
     slot->dependencyCount = deps.size();
+    unpublishedUnboundBrands.add(slot);
   }
 
   return slot;
@@ -1833,27 +1982,28 @@ const _::RawBrandedSchema* SchemaLoader::Impl::getUnbound(const _::RawSchema* sc
 kj::Array<Schema> SchemaLoader::Impl::getAllLoaded() const {
   size_t count = 0;
   for (auto& schema: schemas) {
-    if (schema.second->lazyInitializer == nullptr) ++count;
+    if (schema.value->lazyInitializer == nullptr) ++count;
   }
 
   kj::Array<Schema> result = kj::heapArray<Schema>(count);
   size_t i = 0;
   for (auto& schema: schemas) {
-    if (schema.second->lazyInitializer == nullptr) {
-      result[i++] = Schema(&schema.second->defaultBrand);
+    if (schema.value->lazyInitializer == nullptr) {
+      result[i++] = Schema(&schema.value->defaultBrand);
     }
   }
   return result;
 }
 
 void SchemaLoader::Impl::requireStructSize(uint64_t id, uint dataWordCount, uint pointerCount) {
-  auto& slot = structSizeRequirements[id];
+  auto& slot = structSizeRequirements.findOrCreate(id, [&]() {
+    return kj::HashMap<uint64_t, RequiredSize>::Entry { id, { 0, 0 } };
+  });
   slot.dataWordCount = kj::max(slot.dataWordCount, dataWordCount);
   slot.pointerCount = kj::max(slot.pointerCount, pointerCount);
 
-  auto iter = schemas.find(id);
-  if (iter != schemas.end()) {
-    applyStructSizeRequirement(iter->second, dataWordCount, pointerCount);
+  KJ_IF_MAYBE(schema, schemas.find(id)) {
+    applyStructSizeRequirement(*schema, dataWordCount, pointerCount);
   }
 }
 
@@ -1868,9 +2018,8 @@ kj::ArrayPtr<word> SchemaLoader::Impl::makeUncheckedNode(schema::Node::Reader no
 kj::ArrayPtr<word> SchemaLoader::Impl::makeUncheckedNodeEnforcingSizeRequirements(
     schema::Node::Reader node) {
   if (node.isStruct()) {
-    auto iter = structSizeRequirements.find(node.getId());
-    if (iter != structSizeRequirements.end()) {
-      auto requirement = iter->second;
+    KJ_IF_MAYBE(found, structSizeRequirements.find(node.getId())) {
+      auto requirement = *found;
       auto structNode = node.getStruct();
       if (structNode.getDataWordCount() < requirement.dataWordCount ||
           structNode.getPointerCount() < requirement.pointerCount) {
@@ -1958,10 +2107,8 @@ void SchemaLoader::BrandedInitializerImpl::init(const _::RawBrandedSchema* schem
   }
 
   // Get the mutable version.
-  auto iter = lock->get()->brands.find(SchemaBindingsPair { schema->generic, schema->scopes });
-  KJ_ASSERT(iter != lock->get()->brands.end());
-
-  _::RawBrandedSchema* mutableSchema = iter->second;
+  _::RawBrandedSchema* mutableSchema = KJ_ASSERT_NONNULL(
+      lock->get()->brands.find(SchemaBindingsPair { schema->generic, schema->scopes }));
   KJ_ASSERT(mutableSchema == schema);
 
   // Construct its dependency map.
@@ -1969,6 +2116,7 @@ void SchemaLoader::BrandedInitializerImpl::init(const _::RawBrandedSchema* schem
       kj::arrayPtr(mutableSchema->scopes, mutableSchema->scopeCount));
   mutableSchema->dependencies = deps.begin();
   mutableSchema->dependencyCount = deps.size();
+  lock->get()->publish();
 
   // It's initialized now, so disable the initializer.
 #if __GNUC__
@@ -1984,9 +2132,13 @@ void SchemaLoader::BrandedInitializerImpl::init(const _::RawBrandedSchema* schem
 
 // =======================================================================================
 
-SchemaLoader::SchemaLoader(): impl(kj::heap<Impl>(*this)) {}
+SchemaLoader::SchemaLoader(): impl(kj::heap<Impl>(*this)) {
+  impl.setProfilingName("capnp::SchemaLoader");
+}
 SchemaLoader::SchemaLoader(const LazyLoadCallback& callback)
-    : impl(kj::heap<Impl>(*this, callback)) {}
+    : impl(kj::heap<Impl>(*this, callback)) {
+  impl.setProfilingName("capnp::SchemaLoader");
+}
 SchemaLoader::~SchemaLoader() noexcept(false) {}
 
 Schema SchemaLoader::get(uint64_t id, schema::Brand::Reader brand, Schema scope) const {
@@ -1999,32 +2151,49 @@ Schema SchemaLoader::get(uint64_t id, schema::Brand::Reader brand, Schema scope)
 
 kj::Maybe<Schema> SchemaLoader::tryGet(
     uint64_t id, schema::Brand::Reader brand, Schema scope) const {
-  auto getResult = impl.lockShared()->get()->tryGet(id);
-  if (getResult.schema == nullptr || getResult.schema->lazyInitializer != nullptr) {
-    // This schema couldn't be found or has yet to be lazily loaded. If we have a lazy loader
-    // callback, invoke it now to try to get it to load this schema.
-    KJ_IF_MAYBE(c, getResult.callback) {
-      c->load(*this, id);
-    }
-    getResult = impl.lockShared()->get()->tryGet(id);
-  }
-  if (getResult.schema != nullptr && getResult.schema->lazyInitializer == nullptr) {
-    if (brand.getScopes().size() > 0) {
-      auto brandedSchema = impl.lockExclusive()->get()->makeBranded(
-          getResult.schema, brand, kj::arrayPtr(scope.raw->scopes, scope.raw->scopeCount));
-      brandedSchema->ensureInitialized();
-      return Schema(brandedSchema);
-    } else {
-      return Schema(&getResult.schema->defaultBrand);
+  // Fast path: Already-loaded schemas can be found without taking the lock.
+  const _::RawSchema* schema = impl.getWithoutLock()->tryGetWithoutLock(id);
+
+  if (schema == nullptr) {
+    auto getResult = impl.lockShared()->get()->tryGet(id);
+    if (getResult.schema == nullptr || getResult.schema->lazyInitializer != nullptr) {
+      // This schema couldn't be found or has yet to be lazily loaded. If we have a lazy loader
+      // callback, invoke it now to try to get it to load this schema.
+      KJ_IF_MAYBE(c, getResult.callback) {
+        c->load(*this, id);
+      }
+      getResult = impl.lockShared()->get()->tryGet(id);
+    }
+    if (getResult.schema == nullptr || getResult.schema->lazyInitializer != nullptr) {
+      return nullptr;
+    }
+    schema = getResult.schema;
+  }
+
+  if (brand.getScopes().size() > 0) {
+    const _::RawBrandedSchema* brandedSchema;
+    {
+      auto locked = impl.lockExclusive();
+      brandedSchema = locked->get()->makeBranded(
+          schema, brand, kj::arrayPtr(scope.raw->scopes, scope.raw->scopeCount));
+      locked->get()->publish();
     }
+    brandedSchema->ensureInitialized();
+    return Schema(brandedSchema);
   } else {
-    return nullptr;
+    return Schema(&schema->defaultBrand);
   }
 }
 
 Schema SchemaLoader::getUnbound(uint64_t id) const {
   auto schema = get(id);
-  return Schema(impl.lockExclusive()->get()->getUnbound(schema.raw->generic));
+  auto unbound = impl.getWithoutLock()->tryGetUnboundWithoutLock(schema.raw->generic);
+  if (unbound == nullptr) {
+    auto locked = impl.lockExclusive();
+    unbound = locked->get()->getUnbound(schema.raw->generic);
+    locked->get()->publish();
+  }
+  return Schema(unbound);
 }
 
 Type SchemaLoader::getType(schema::Type::Reader proto, Schema scope) const {
@@ -2086,7 +2255,10 @@ Type SchemaLoader::getType(schema::Type::Reader proto, Schema scope) const {
 }
 
 Schema SchemaLoader::load(const schema::Node::Reader& reader) {
-  return Schema(&impl.lockExclusive()->get()->load(reader, false)->defaultBrand);
+  auto locked = impl.lockExclusive();
+  auto result = locked->get()->load(reader, false);
+  locked->get()->publish();
+  return Schema(&result->defaultBrand);
 }
 
 Schema SchemaLoader::loadOnce(const schema::Node::Reader& reader) const {
@@ -2095,7 +2267,9 @@ Schema SchemaLoader::loadOnce(const schema::Node::Reader& reader) const {
   if (getResult.schema == nullptr || getResult.schema->lazyInitializer != nullptr) {
     // Doesn't exist yet, or the existing schema is a placeholder and therefore has not yet been
     // seen publicly.  Go ahead and load the incoming reader.
-    return Schema(&locked->get()->load(reader, false)->defaultBrand);
+    auto result = locked->get()->load(reader, false);
+    locked->get()->publish();
+    return Schema(&result->defaultBrand);
   } else {
     return Schema(&getResult.schema->defaultBrand);
   }
@@ -2106,7 +2280,9 @@ kj::Array<Schema> SchemaLoader::getAllLoaded() const {
 }
 
 void SchemaLoader::loadNative(const _::RawSchema* nativeSchema) {
-  impl.lockExclusive()->get()->loadNative(nativeSchema);
+  auto locked = impl.lockExclusive();
+  locked->get()->loadNative(nativeSchema);
+  locked->get()->publish();
 }
 
 }  // namespace capnp
@@ -41,6 +41,10 @@ class SchemaLoader {
   // SchemaLoader or by the dynamic API when the schemas are subsequently used.  If you enable and
   // properly catch exceptions, you should be OK -- assuming no bugs in the Cap'n Proto
   // implementation, of course.
+  //
+  // SchemaLoader is thread-safe. Looking up a schema that has already been loaded, via `get()` or
+  // `tryGet()` without a brand, or via `getUnbound()`, does not take any lock, so it can be done
+  // frequently from many threads without contention.
 
 public:
   class LazyLoadCallback {
@@ -264,5 +264,46 @@ TEST(SchemaParser, SourceInfo) {
   expectSourceInfo(thud.getSourceInfo(), 0xcca9972702b730b4, "post-comment\n", {});
 }
 
+TEST(SchemaParser, ParseCache) {
+  auto dir = kj::newInMemoryDirectory(kj::nullClock());
+  auto cacheDir = kj::newInMemoryDirectory(kj::nullClock());
+
+  dir->openFile(kj::Path::parse("foo.capnp"), kj::WriteMode::CREATE)
+      ->writeAll("@0x8123456789abcdef;\n"
+                 "struct Foo {\n"
+                 "  bar @0 :import \"bar.capnp\".Bar;\n"
+                 "}\n");
+  dir->openFile(kj::Path::parse("bar.capnp"), kj::WriteMode::CREATE)
+      ->writeAll("@0x823456789abcdef1;\n"
+                 "struct Bar { baz @0 :Text = \"qux\"; }\n");
+
+  {
+    SchemaParser parser;
+    parser.setCacheDirectory(*cacheDir);
+    auto foo = parser.parseFromDirectory(*dir, kj::Path::parse("foo.capnp"), nullptr);
+    EXPECT_EQ(0x8123456789abcdefull, foo.getProto().getId());
+  }
+
+  // One entry per file.
+  auto names = cacheDir->listNames();
+  ASSERT_EQ(2u, names.size());
+
+  // Mangle one entry. It should be ignored and rewritten.
+  cacheDir->openFile(kj::Path(names[0]), kj::WriteMode::MODIFY)->truncate(3);
+
+  {
+    SchemaParser parser;
+    parser.setCacheDirectory(*cacheDir);
+    auto foo = parser.parseFromDirectory(*dir, kj::Path::parse("foo.capnp"), nullptr);
+    EXPECT_EQ(0x8123456789abcdefull, foo.getProto().getId());
+    auto bar = foo.getNested("Foo").asStruct().getFieldByName("bar").getType().asStruct();
+    EXPECT_EQ(0x823456789abcdef1ull, bar.getProto().getScopeId());
+    EXPECT_EQ("qux", bar.getFieldByName("baz").getProto().getSlot().getDefaultValue().getText());
+  }
+
+  EXPECT_EQ(2u, cacheDir->listNames().size());
+  EXPECT_NE(3u, cacheDir->openFile(kj::Path(names[0]))->stat().size);
+}
+
 }  // namespace
 }  // namespace capnp
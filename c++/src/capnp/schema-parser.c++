@@ -22,10 +22,8 @@
 #include "schema-parser.h"
 #include "message.h"
 #include <capnp/compiler/compiler.h>
-#include <capnp/compiler/lexer.capnp.h>
-#include <capnp/compiler/lexer.h>
 #include <capnp/compiler/grammar.capnp.h>
-#include <capnp/compiler/parser.h>
+#include <capnp/compiler/parse-cache.h>
 #include <unordered_map>
 #include <kj/mutex.h>
 #include <kj/vector.h>
@@ -83,13 +81,11 @@ public:
       return vec;
     });
 
-    MallocMessageBuilder lexedBuilder;
-    auto statements = lexedBuilder.initRoot<compiler::LexedStatements>();
-    compiler::lex(content, statements, *this);
-
-    auto parsed = orphanage.newOrphan<compiler::ParsedFile>();
-    compiler::parseFile(statements.getStatements(), parsed.get(), *this);
-    return parsed;
+    KJ_IF_MAYBE(cache, parser.getParseCache()) {
+      return cache->lexAndParse(content, orphanage, *this);
+    } else {
+      return compiler::lexAndParse(content, orphanage, *this);
+    }
   }
 
   kj::Maybe<Module&> importRelative(kj::StringPtr importPath) override {
@@ -189,6 +185,8 @@ struct SchemaParser::Impl {
   compiler::Compiler compiler;
 
   kj::MutexGuarded<kj::Maybe<DiskFileCompat>> compat;
+
+  kj::Maybe<compiler::ParseCache> parseCache;
 };
 
 SchemaParser::SchemaParser(): impl(kj::heap<Impl>()) {}
@@ -285,6 +283,10 @@ void SchemaParser::setDiskFilesystem(kj::Filesystem& fs) {
   lock->emplace(fs);
 }
 
+void SchemaParser::setCacheDirectory(const kj::Directory& dir) {
+  impl->parseCache.emplace(dir);
+}
+
 ParsedSchema SchemaParser::parseFile(kj::Own<SchemaFile>&& file) const {
   KJ_DEFER(impl->compiler.clearWorkspace());
   uint64_t id = impl->compiler.add(getModuleImpl(kj::mv(file)));
@@ -309,6 +311,14 @@ SchemaParser::ModuleImpl& SchemaParser::getModuleImpl(kj::Own<SchemaFile>&& file
   return *insertResult.first->second;
 }
 
+kj::Maybe<const compiler::ParseCache&> SchemaParser::getParseCache() const {
+  KJ_IF_MAYBE(cache, impl->parseCache) {
+    return *cache;
+  } else {
+    return nullptr;
+  }
+}
+
 SchemaLoader& SchemaParser::getLoader() {
   return impl->compiler.getLoader();
 }
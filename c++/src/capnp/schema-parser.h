@@ -31,6 +31,8 @@
 
 namespace capnp {
 
+namespace compiler { class ParseCache; }
+
 class ParsedSchema;
 class SchemaFile;
 
@@ -120,6 +122,16 @@ public:
   // If parseDiskFile() is called without having called setDiskFilesystem(), then
   // kj::newDiskFilesystem() will be used instead.
 
+  void setCacheDirectory(const kj::Directory& dir);
+  // Cache the results of lexing and parsing schema files in `dir`, which must remain valid until
+  // the `SchemaParser` is destroyed. Later runs (of this or any other program) that use the same
+  // directory will skip lexing and parsing of any file whose content has not changed. The cache is
+  // keyed by file content and compiler version, so it may safely be shared between processes and
+  // between unrelated source trees. Failures to read or write the cache are logged and otherwise
+  // ignored.
+  //
+  // Call before parsing any files. `capnp compile --cache-dir` uses the same cache format.
+
   ParsedSchema parseFile(kj::Own<SchemaFile>&& file) const;
   // Advanced interface for parsing a file that may or may not be located in any global namespace.
   // Most users will prefer `parseFromDirectory()`.
@@ -151,6 +163,7 @@ private:
   mutable bool hadErrors = false;
 
   ModuleImpl& getModuleImpl(kj::Own<SchemaFile>&& file) const;
+  kj::Maybe<const compiler::ParseCache&> getParseCache() const;
   SchemaLoader& getLoader();
 
   friend class ParsedSchema;
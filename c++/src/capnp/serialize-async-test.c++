@@ -339,6 +339,38 @@ TEST(SerializeAsyncTest, WriteAsyncEvenSegmentCount) {
   writeMessage(*output, message).wait(ioContext.waitScope);
 }
 
+TEST(SerializeAsyncTest, WriteMessagesAsync) {
+  PipeWithSmallBuffer fds;
+  auto ioContext = kj::setupAsyncIo();
+  auto output = ioContext.lowLevelProvider->wrapOutputFd(fds[1]);
+
+  // Mix odd and even segment counts so that both padding cases appear within one batch.
+  TestMessageBuilder message1(1);
+  TestMessageBuilder message2(7);
+  TestMessageBuilder message3(10);
+  MessageBuilder* messages[3] = { &message1, &message2, &message3 };
+  for (auto message: messages) {
+    auto list = message->getRoot<TestAllTypes>().initStructList(16);
+    for (auto element: list) {
+      initTestMessage(element);
+    }
+  }
+
+  kj::Thread thread([&]() {
+    SocketInputStream input(fds[0]);
+    for (uint i = 0; i < 3; i++) {
+      InputStreamMessageReader reader(input);
+      auto listReader = reader.getRoot<TestAllTypes>().getStructList();
+      EXPECT_EQ(16u, listReader.size());
+      for (auto element: listReader) {
+        checkTestMessage(element);
+      }
+    }
+  });
+
+  writeMessages(*output, kj::arrayPtr(messages, 3)).wait(ioContext.waitScope);
+}
+
 }  // namespace
 }  // namespace _ (private)
 }  // namespace capnp
@@ -217,4 +217,59 @@ kj::Promise<void> writeMessage(kj::AsyncOutputStream& output,
   return promise.then(kj::mvCapture(arrays, [](WriteArrays&&) {}));
 }
 
+kj::Promise<void> writeMessages(
+    kj::AsyncOutputStream& output,
+    kj::ArrayPtr<kj::ArrayPtr<const kj::ArrayPtr<const word>>> messages) {
+  KJ_REQUIRE(messages.size() > 0, "Tried to serialize zero messages.");
+
+  // All segment tables go into one array, and all pieces into another, so that the whole batch
+  // goes out in a single vectored write.
+  size_t tableSize = 0;
+  size_t pieceCount = 0;
+  for (auto& segments: messages) {
+    KJ_REQUIRE(segments.size() > 0, "Tried to serialize uninitialized message.");
+    tableSize += (segments.size() + 2) & ~size_t(1);
+    pieceCount += segments.size() + 1;
+  }
+
+  WriteArrays arrays;
+  arrays.table = kj::heapArray<_::WireValue<uint32_t>>(tableSize);
+  arrays.pieces = kj::heapArray<kj::ArrayPtr<const byte>>(pieceCount);
+
+  size_t tablePos = 0;
+  size_t piecePos = 0;
+  for (auto& segments: messages) {
+    auto table = arrays.table.slice(tablePos, tablePos + ((segments.size() + 2) & ~size_t(1)));
+    tablePos += table.size();
+
+    table[0].set(segments.size() - 1);
+    for (uint i = 0; i < segments.size(); i++) {
+      table[i + 1].set(segments[i].size());
+    }
+    if (segments.size() % 2 == 0) {
+      // Set padding byte.
+      table[segments.size() + 1].set(0);
+    }
+
+    arrays.pieces[piecePos++] = table.asBytes();
+    for (auto& segment: segments) {
+      arrays.pieces[piecePos++] = segment.asBytes();
+    }
+  }
+
+  auto promise = output.write(arrays.pieces);
+
+  // Make sure the arrays aren't freed until the write completes.
+  return promise.then(kj::mvCapture(arrays, [](WriteArrays&&) {}));
+}
+
+kj::Promise<void> writeMessages(kj::AsyncOutputStream& output,
+                                kj::ArrayPtr<MessageBuilder*> builders) {
+  auto messages = kj::heapArray<kj::ArrayPtr<const kj::ArrayPtr<const word>>>(builders.size());
+  for (auto i: kj::indices(builders)) {
+    messages[i] = builders[i]->getSegmentsForOutput();
+  }
+  return writeMessages(output, messages).attach(kj::mv(messages));
+}
+
 }  // namespace capnp
@@ -51,6 +51,17 @@ kj::Promise<void> writeMessage(kj::AsyncOutputStream& output, MessageBuilder& bu
     KJ_WARN_UNUSED_RESULT;
 // Write asynchronously.  The parameters must remain valid until the returned promise resolves.
 
+kj::Promise<void> writeMessages(
+    kj::AsyncOutputStream& output,
+    kj::ArrayPtr<kj::ArrayPtr<const kj::ArrayPtr<const word>>> messages)
+    KJ_WARN_UNUSED_RESULT;
+kj::Promise<void> writeMessages(kj::AsyncOutputStream& output,
+                                kj::ArrayPtr<MessageBuilder*> builders)
+    KJ_WARN_UNUSED_RESULT;
+// Write several messages back-to-back using a single (vectored) write.  The result on the wire
+// is identical to calling writeMessage() on each in sequence, but costs one system call instead
+// of one per message.  The parameters must remain valid until the returned promise resolves.
+
 // =======================================================================================
 // inline implementation details
 
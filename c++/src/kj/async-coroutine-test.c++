@@ -0,0 +1,166 @@
+// Copyright (c) 2017 Sandstorm Development Group, Inc. and contributors
+// Licensed under the MIT License:
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+#include "async.h"
+#include "debug.h"
+#include <kj/compat/gtest.h>
+
+#if KJ_HAS_COROUTINE
+
+namespace kj {
+namespace {
+
+Promise<int> addLater(Promise<int> a, Promise<int> b) {
+  int x = co_await a;
+  int y = co_await b;
+  co_return x + y;
+}
+
+TEST(AsyncCoroutine, Basic) {
+  EventLoop loop;
+  WaitScope waitScope(loop);
+
+  auto paf = newPromiseAndFulfiller<int>();
+  auto promise = addLater(kj::mv(paf.promise), evalLater([]() { return 321; }));
+
+  EXPECT_FALSE(promise.poll(waitScope));
+  paf.fulfiller->fulfill(123);
+  EXPECT_EQ(444, promise.wait(waitScope));
+}
+
+TEST(AsyncCoroutine, RunsEagerly) {
+  EventLoop loop;
+  WaitScope waitScope(loop);
+
+  bool started = false;
+  bool finished = false;
+  auto coroutine = [&]() -> Promise<void> {
+    started = true;
+    co_await evalLater([]() {});
+    finished = true;
+  };
+
+  auto promise = coroutine();
+  EXPECT_TRUE(started);
+  EXPECT_FALSE(finished);
+  promise.wait(waitScope);
+  EXPECT_TRUE(finished);
+}
+
+TEST(AsyncCoroutine, Loop) {
+  EventLoop loop;
+  WaitScope waitScope(loop);
+
+  // Many awaits in one frame; also exercises awaiting already-resolved promises.
+  auto coroutine = []() -> Promise<uint> {
+    uint total = 0;
+    for (uint i = 0; i < 1000; i++) {
+      total += co_await Promise<uint>(i);
+    }
+    co_return total;
+  };
+
+  EXPECT_EQ(999u * 1000 / 2, coroutine().wait(waitScope));
+}
+
+TEST(AsyncCoroutine, Exceptions) {
+  EventLoop loop;
+  WaitScope waitScope(loop);
+
+  auto thrower = []() -> Promise<int> {
+    co_await evalLater([]() {});
+    KJ_FAIL_ASSERT("thrown from coroutine");
+    co_return 0;
+  };
+
+  auto catcher = [&]() -> Promise<kj::String> {
+    try {
+      co_await thrower();
+    } catch (const kj::Exception& e) {
+      co_return kj::str(e.getDescription());
+    }
+    co_return kj::str("not thrown");
+  };
+
+  EXPECT_EQ("thrown from coroutine", catcher().wait(waitScope));
+
+  auto broken = [&]() -> Promise<void> {
+    co_await Promise<void>(KJ_EXCEPTION(FAILED, "broken promise"));
+  };
+  KJ_EXPECT_THROW_MESSAGE("broken promise", broken().wait(waitScope));
+}
+
+class DestructorDetector {
+public:
+  DestructorDetector(bool& setTrue): setTrue(setTrue) {}
+  ~DestructorDetector() { setTrue = true; }
+
+private:
+  bool& setTrue;
+};
+
+TEST(AsyncCoroutine, Cancellation) {
+  EventLoop loop;
+  WaitScope waitScope(loop);
+
+  bool frameDestroyed = false;
+  bool awaitedDestroyed = false;
+  bool resumed = false;
+
+  auto paf = newPromiseAndFulfiller<void>();
+  auto coroutine = [&](Promise<void> awaited) -> Promise<void> {
+    DestructorDetector detector(frameDestroyed);
+    co_await awaited;
+    resumed = true;
+  };
+
+  auto promise = coroutine(paf.promise.attach(kj::heap<DestructorDetector>(awaitedDestroyed)));
+  EXPECT_FALSE(frameDestroyed);
+  EXPECT_FALSE(awaitedDestroyed);
+
+  // Dropping the promise destroys the frame, which drops what it was awaiting.
+  promise = nullptr;
+  EXPECT_TRUE(frameDestroyed);
+  EXPECT_TRUE(awaitedDestroyed);
+  EXPECT_FALSE(paf.fulfiller->isWaiting());
+
+  evalLater([]() {}).wait(waitScope);
+  EXPECT_FALSE(resumed);
+}
+
+TEST(AsyncCoroutine, Then) {
+  EventLoop loop;
+  WaitScope waitScope(loop);
+
+  auto coroutine = []() -> Promise<kj::String> {
+    co_await evalLater([]() {});
+    co_return kj::str("foo");
+  };
+
+  // Coroutine promises compose with the rest of the API.
+  auto promise = coroutine().then([](kj::String s) { return kj::str(s, "bar"); });
+  EXPECT_EQ("foobar", promise.wait(waitScope));
+}
+
+}  // namespace
+}  // namespace kj
+
+#endif  // KJ_HAS_COROUTINE
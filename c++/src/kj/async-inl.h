@@ -35,6 +35,10 @@
 #include "async.h"  // help IDE parse this file
 #endif
 
+#if KJ_HAS_COROUTINE
+#include <coroutine>
+#endif
+
 namespace kj {
 namespace _ {  // private
 
@@ -101,6 +105,9 @@ public:
   // breadth-first.)
   //
   // To use breadth-first scheduling instead, use `armBreadthFirst()`.
+  //
+  // Either way, the event goes on the queue for its priority class, which it takes from the
+  // loop's current priority at construction time.  See `EventLoop::Priority`.
 
   void armBreadthFirst();
   // Like `armDepthFirst()` except that the event is placed at the end of the queue.
@@ -124,6 +131,7 @@ private:
   Event* next;
   Event** prev;
   bool firing = false;
+  uint8_t priority;
 };
 
 class PromiseNode {
@@ -173,6 +181,43 @@ protected:
   };
 };
 
+// -------------------------------------------------------------------
+// PromiseNode allocation
+//
+// Nearly every Promise operation allocates a node, and nodes are short-lived, so they come from a
+// small free list kept by the current thread's EventLoop rather than straight from operator new.
+// Blocks are grouped into size classes, so a node of one type can reuse a block freed by a node of
+// another.  When no EventLoop is current (or the node is too big to be worth caching) this
+// degrades to plain operator new / delete.
+
+template <typename T>
+class PromiseNodeDisposer final: public Disposer {
+public:
+  void disposeImpl(void* pointer) const override {
+    reinterpret_cast<T*>(pointer)->~T();
+    freePromiseNodeSpace(pointer, sizeof(T));
+  }
+
+  static const PromiseNodeDisposer instance;
+};
+
+template <typename T>
+const PromiseNodeDisposer<T> PromiseNodeDisposer<T>::instance = PromiseNodeDisposer<T>();
+
+template <typename T, typename... Params>
+Own<T> heapPromiseNode(Params&&... params) {
+  // Like kj::heap<T>(), but allocates from the PromiseNode free list.  Use for all PromiseNodes
+  // (and other short-lived per-promise objects) which are not refcounted.
+
+  void* space = allocPromiseNodeSpace(sizeof(T));
+  bool constructed = false;
+  KJ_DEFER(if (!constructed) freePromiseNodeSpace(space, sizeof(T)));
+  T* node = reinterpret_cast<T*>(space);
+  ctor(*node, kj::fwd<Params>(params)...);
+  constructed = true;
+  return Own<T>(node, PromiseNodeDisposer<T>::instance);
+}
+
 // -------------------------------------------------------------------
 
 class ImmediatePromiseNodeBase: public PromiseNode {
@@ -508,7 +553,7 @@ public:
   ForkHub(Own<PromiseNode>&& inner): ForkHubBase(kj::mv(inner), result) {}
 
   Promise<_::UnfixVoid<T>> addBranch() {
-    return Promise<_::UnfixVoid<T>>(false, kj::heap<ForkBranch<T>>(addRef(*this)));
+    return Promise<_::UnfixVoid<T>>(false, heapPromiseNode<ForkBranch<T>>(addRef(*this)));
   }
 
   _::SplitTuplePromise<T> split() {
@@ -526,7 +571,7 @@ private:
   template <size_t index>
   Promise<JoinPromises<typename SplitBranch<T, index>::Element>> addSplit() {
     return Promise<JoinPromises<typename SplitBranch<T, index>::Element>>(
-        false, maybeChain(kj::heap<SplitBranch<T, index>>(addRef(*this)),
+        false, maybeChain(heapPromiseNode<SplitBranch<T, index>>(addRef(*this)),
                           implicitCast<typename SplitBranch<T, index>::Element*>(nullptr)));
   }
 };
@@ -572,7 +617,7 @@ private:
 
 template <typename T>
 Own<PromiseNode> maybeChain(Own<PromiseNode>&& node, Promise<T>*) {
-  return heap<ChainPromiseNode>(kj::mv(node));
+  return heapPromiseNode<ChainPromiseNode>(kj::mv(node));
 }
 
 template <typename T>
@@ -730,7 +775,7 @@ template <typename T>
 Own<PromiseNode> spark(Own<PromiseNode>&& node) {
   // Forces evaluation of the given node to begin as soon as possible, even if no one is waiting
   // on it.
-  return heap<EagerPromiseNode<T>>(kj::mv(node));
+  return heapPromiseNode<EagerPromiseNode<T>>(kj::mv(node));
 }
 
 // -------------------------------------------------------------------
@@ -795,11 +840,11 @@ private:
 
 template <typename T>
 Promise<T>::Promise(_::FixVoid<T> value)
-    : PromiseBase(heap<_::ImmediatePromiseNode<_::FixVoid<T>>>(kj::mv(value))) {}
+    : PromiseBase(_::heapPromiseNode<_::ImmediatePromiseNode<_::FixVoid<T>>>(kj::mv(value))) {}
 
 template <typename T>
 Promise<T>::Promise(kj::Exception&& exception)
-    : PromiseBase(heap<_::ImmediateBrokenPromiseNode>(kj::mv(exception))) {}
+    : PromiseBase(_::heapPromiseNode<_::ImmediateBrokenPromiseNode>(kj::mv(exception))) {}
 
 template <typename T>
 template <typename Func, typename ErrorFunc>
@@ -807,7 +852,7 @@ PromiseForResult<Func, T> Promise<T>::then(Func&& func, ErrorFunc&& errorHandler
   typedef _::FixVoid<_::ReturnType<Func, T>> ResultT;
 
   Own<_::PromiseNode> intermediate =
-      heap<_::TransformPromiseNode<ResultT, _::FixVoid<T>, Func, ErrorFunc>>(
+      _::heapPromiseNode<_::TransformPromiseNode<ResultT, _::FixVoid<T>, Func, ErrorFunc>>(
           kj::mv(node), kj::fwd<Func>(func), kj::fwd<ErrorFunc>(errorHandler));
   return PromiseForResult<Func, T>(false,
       _::maybeChain(kj::mv(intermediate), implicitCast<ResultT*>(nullptr)));
@@ -913,13 +958,14 @@ _::SplitTuplePromise<T> Promise<T>::split() {
 
 template <typename T>
 Promise<T> Promise<T>::exclusiveJoin(Promise<T>&& other) {
-  return Promise(false, heap<_::ExclusiveJoinPromiseNode>(kj::mv(node), kj::mv(other.node)));
+  return Promise(false, _::heapPromiseNode<_::ExclusiveJoinPromiseNode>(
+      kj::mv(node), kj::mv(other.node)));
 }
 
 template <typename T>
 template <typename... Attachments>
 Promise<T> Promise<T>::attach(Attachments&&... attachments) {
-  return Promise(false, kj::heap<_::AttachmentPromiseNode<Tuple<Attachments...>>>(
+  return Promise(false, _::heapPromiseNode<_::AttachmentPromiseNode<Tuple<Attachments...>>>(
       kj::mv(node), kj::tuple(kj::fwd<Attachments>(attachments)...)));
 }
 
@@ -972,7 +1018,7 @@ void Promise<void>::detach(ErrorFunc&& errorHandler) {
 
 template <typename T>
 Promise<Array<T>> joinPromises(Array<Promise<T>>&& promises) {
-  return Promise<Array<T>>(false, kj::heap<_::ArrayJoinPromiseNode<T>>(
+  return Promise<Array<T>>(false, _::heapPromiseNode<_::ArrayJoinPromiseNode<T>>(
       KJ_MAP(p, promises) { return kj::mv(p.node); },
       heapArray<_::ExceptionOr<T>>(promises.size())));
 }
@@ -1098,7 +1144,7 @@ bool PromiseFulfiller<void>::rejectIfThrows(Func&& func) {
 
 template <typename T, typename Adapter, typename... Params>
 Promise<T> newAdaptedPromise(Params&&... adapterConstructorParams) {
-  return Promise<T>(false, heap<_::AdapterPromiseNode<_::FixVoid<T>, Adapter>>(
+  return Promise<T>(false, _::heapPromiseNode<_::AdapterPromiseNode<_::FixVoid<T>, Adapter>>(
       kj::fwd<Params>(adapterConstructorParams)...));
 }
 
@@ -1106,12 +1152,299 @@ template <typename T>
 PromiseFulfillerPair<T> newPromiseAndFulfiller() {
   auto wrapper = _::WeakFulfiller<T>::make();
 
-  Own<_::PromiseNode> intermediate(
-      heap<_::AdapterPromiseNode<_::FixVoid<T>, _::PromiseAndFulfillerAdapter<T>>>(*wrapper));
+  Own<_::PromiseNode> intermediate(_::heapPromiseNode<
+      _::AdapterPromiseNode<_::FixVoid<T>, _::PromiseAndFulfillerAdapter<T>>>(*wrapper));
   Promise<_::JoinPromises<T>> promise(false,
       _::maybeChain(kj::mv(intermediate), implicitCast<T*>(nullptr)));
 
   return PromiseFulfillerPair<T> { kj::mv(promise), kj::mv(wrapper) };
 }
 
+// -------------------------------------------------------------------
+
+namespace _ {  // private
+
+class CrossThreadEventBase: public AtomicRefcounted {
+  // Something which another thread posts to an EventLoop, to be delivered on the loop's own thread.
+
+public:
+  CrossThreadEventBase();
+  // Targets the current thread's EventLoop.
+
+  ~CrossThreadEventBase() noexcept(false);
+
+  void post();
+  // Queue this event for delivery and wake the loop.  May be called from any thread, at most once.
+
+  virtual void deliver() = 0;
+  // Called on the loop's thread.
+
+private:
+  Own<const CrossThreadQueue> queue;
+};
+
+template <typename T>
+class CrossThreadPromiseState final: public CrossThreadEventBase {
+  // State shared between a promise on some EventLoop and its cross-thread fulfiller.
+
+public:
+  explicit CrossThreadPromiseState(Own<PromiseFulfiller<T>> local): local(kj::mv(local)) {}
+
+  bool complete(ExceptionOr<FixVoid<T>>&& value) {
+    // Records the result and posts it to the loop.  Returns false if already completed.
+    {
+      auto lock = result.lockExclusive();
+      if (*lock != nullptr) return false;
+      *lock = kj::mv(value);
+    }
+    post();
+    return true;
+  }
+
+  void deliver() override {
+    Own<PromiseFulfiller<T>> fulfiller = kj::mv(local);
+    KJ_IF_MAYBE(r, *result.lockExclusive()) {
+      KJ_IF_MAYBE(exception, r->exception) {
+        fulfiller->reject(kj::mv(*exception));
+      } else KJ_IF_MAYBE(value, r->value) {
+        fulfiller->fulfill(kj::mv(*value));
+      }
+    }
+  }
+
+private:
+  MutexGuarded<Maybe<ExceptionOr<FixVoid<T>>>> result;
+
+  Own<PromiseFulfiller<T>> local;
+  // Fulfiller for the promise on the loop.  Only touched on the loop's thread.
+};
+
+template <typename T>
+class CrossThreadFulfiller final: public PromiseFulfiller<T> {
+public:
+  explicit CrossThreadFulfiller(Own<CrossThreadPromiseState<T>> state): state(kj::mv(state)) {}
+  KJ_DISALLOW_COPY(CrossThreadFulfiller);
+
+  ~CrossThreadFulfiller() noexcept(false) {
+    if (!completed) {
+      state->complete(ExceptionOr<FixVoid<T>>(false, kj::Exception(kj::Exception::Type::FAILED,
+          __FILE__, __LINE__, kj::heapString(
+              "PromiseFulfiller was destroyed without fulfilling the promise."))));
+    }
+  }
+
+  void fulfill(FixVoid<T>&& value) override {
+    completed = true;
+    state->complete(ExceptionOr<FixVoid<T>>(kj::mv(value)));
+  }
+
+  void reject(Exception&& exception) override {
+    completed = true;
+    state->complete(ExceptionOr<FixVoid<T>>(false, kj::mv(exception)));
+  }
+
+  bool isWaiting() override {
+    return !completed;
+  }
+
+private:
+  Own<CrossThreadPromiseState<T>> state;
+  bool completed = false;
+  // Only the thread holding this fulfiller can complete the state, so it need not be shared.
+};
+
+}  // namespace _ (private)
+
+template <typename T>
+PromiseFulfillerPair<T> newCrossThreadPromiseAndFulfiller() {
+  auto local = newPromiseAndFulfiller<T>();
+  auto state = kj::atomicRefcounted<_::CrossThreadPromiseState<T>>(kj::mv(local.fulfiller));
+  return PromiseFulfillerPair<T> {
+    kj::mv(local.promise), kj::heap<_::CrossThreadFulfiller<T>>(kj::mv(state))
+  };
+}
+
+// =======================================================================================
+// Coroutines
+
+#if KJ_HAS_COROUTINE
+
+namespace _ {  // private
+
+template <typename T>
+class PromiseAwaiter;
+
+class CoroutineBase: public PromiseNode, public Event, private Disposer {
+  // The promise_type of a coroutine returning Promise<T>.  It lives inside the coroutine frame and
+  // is the PromiseNode for the returned promise, so the frame is the only allocation.  The Own
+  // handed to the Promise uses this object as its disposer, which destroys the whole frame.
+  //
+  // As an Event, it is armed by whichever promise the coroutine is currently awaiting, and firing
+  // it resumes the coroutine.
+
+public:
+  CoroutineBase(std::coroutine_handle<> coroutine, ExceptionOrValue& resultRef)
+      : coroutine(coroutine), resultRef(resultRef) {}
+  KJ_DISALLOW_COPY(CoroutineBase);
+
+  std::suspend_never initial_suspend() { return {}; }
+  std::suspend_always final_suspend() noexcept { return {}; }
+  // Start running immediately, like evalNow().  At the end, stay suspended so that the result
+  // remains available until the Promise is consumed or dropped.
+
+  void unhandled_exception() {
+    KJ_IF_MAYBE(exception, kj::runCatchingExceptions([]() { throw; })) {
+      resultRef.addException(kj::mv(*exception));
+    }
+    onReadyEvent.arm();
+  }
+
+  template <typename U>
+  PromiseAwaiter<U> await_transform(Promise<U>&& promise);
+  template <typename U>
+  PromiseAwaiter<U> await_transform(Promise<U>& promise);
+
+  static void* operator new(size_t size) { return allocPromiseNodeSpace(size); }
+  static void operator delete(void* pointer, size_t size) { freePromiseNodeSpace(pointer, size); }
+  // Small frames are recycled like other promise nodes.
+
+  // implements PromiseNode ----------------------------------------------------
+  void onReady(Event* event) noexcept override { onReadyEvent.init(event); }
+  PromiseNode* getInnerForTrace() override { return awaiting; }
+
+protected:
+  Own<PromiseNode> asPromiseNode() {
+    return Own<PromiseNode>(this, static_cast<const Disposer&>(*this));
+  }
+
+  void fulfilled() { onReadyEvent.arm(); }
+
+private:
+  std::coroutine_handle<> coroutine;
+  ExceptionOrValue& resultRef;
+  OnReadyEvent onReadyEvent;
+  PromiseNode* awaiting = nullptr;
+  // The node the coroutine is currently suspended on, for trace().
+
+  Maybe<Own<Event>> fire() override {
+    coroutine.resume();
+    return nullptr;
+  }
+
+  void disposeImpl(void* pointer) const override {
+    coroutine.destroy();
+  }
+
+  template <typename>
+  friend class PromiseAwaiter;
+};
+
+template <typename Self, typename T>
+class CoroutineReturn {
+public:
+  template <typename U = T>
+  void return_value(U&& value) {
+    static_cast<Self*>(this)->fulfill(T(kj::fwd<U>(value)));
+  }
+};
+
+template <typename Self>
+class CoroutineReturn<Self, void> {
+public:
+  void return_void() {
+    static_cast<Self*>(this)->fulfill(Void());
+  }
+};
+
+template <typename T>
+class Coroutine final: public CoroutineBase, public CoroutineReturn<Coroutine<T>, T> {
+public:
+  Coroutine(): CoroutineBase(std::coroutine_handle<Coroutine>::from_promise(*this), result) {}
+
+  Promise<T> get_return_object() {
+    return Promise<T>(false, asPromiseNode());
+  }
+
+  void fulfill(FixVoid<T>&& value) {
+    result.value = kj::mv(value);
+    fulfilled();
+  }
+
+  void get(ExceptionOrValue& output) noexcept override {
+    output.as<FixVoid<T>>() = kj::mv(result);
+  }
+
+private:
+  ExceptionOr<FixVoid<T>> result;
+};
+
+template <typename T>
+class PromiseAwaiter {
+  // Result of `co_await`ing a Promise<T> inside a coroutine.  Holds the awaited node in the
+  // coroutine frame; if the frame is destroyed while suspended, the node is dropped, canceling it.
+
+public:
+  PromiseAwaiter(CoroutineBase& coroutine, Own<PromiseNode>&& node)
+      : coroutine(coroutine), node(kj::mv(node)) {}
+  KJ_DISALLOW_COPY(PromiseAwaiter);
+
+  bool await_ready() { return false; }
+
+  void await_suspend(std::coroutine_handle<>) {
+    node->setSelfPointer(&node);
+    node->onReady(&coroutine);
+    coroutine.awaiting = node.get();
+  }
+
+  T await_resume() {
+    coroutine.awaiting = nullptr;
+
+    ExceptionOr<FixVoid<T>> result;
+    node->get(result);
+    node = nullptr;
+
+    KJ_IF_MAYBE(value, result.value) {
+      KJ_IF_MAYBE(exception, result.exception) {
+        throwRecoverableException(kj::mv(*exception));
+      }
+      return returnMaybeVoid(kj::mv(*value));
+    } else KJ_IF_MAYBE(exception, result.exception) {
+      throwFatalException(kj::mv(*exception));
+    } else {
+      // Result contained neither a value nor an exception?
+      KJ_UNREACHABLE;
+    }
+  }
+
+private:
+  CoroutineBase& coroutine;
+  Own<PromiseNode> node;
+};
+
+template <typename U>
+PromiseAwaiter<U> CoroutineBase::await_transform(Promise<U>&& promise) {
+  return PromiseAwaiter<U>(*this, kj::mv(static_cast<PromiseBase&>(promise).node));
+}
+
+template <typename U>
+PromiseAwaiter<U> CoroutineBase::await_transform(Promise<U>& promise) {
+  // Like then(), co_await consumes the promise.
+  return PromiseAwaiter<U>(*this, kj::mv(static_cast<PromiseBase&>(promise).node));
+}
+
+}  // namespace _ (private)
+
+#endif  // KJ_HAS_COROUTINE
+
 }  // namespace kj
+
+#if KJ_HAS_COROUTINE
+namespace std {
+
+template <typename T, typename... Args>
+struct coroutine_traits<kj::Promise<T>, Args...> {
+  using promise_type = kj::_::Coroutine<T>;
+};
+
+}  // namespace std
+#endif  // KJ_HAS_COROUTINE
@@ -40,6 +40,14 @@ kj::ArrayPtr<const char> safeUnixPath(const struct sockaddr_un* addr, uint addrl
 // paths MUST be read using this function.
 #endif
 
+Promise<uint64_t> unoptimizedPumpTo(
+    AsyncInputStream& input, AsyncOutputStream& output, uint64_t amount,
+    uint64_t completedSoFar = 0);
+// Copies through a userspace buffer, without trying output.tryPumpFrom(). For tryPumpFrom()
+// implementations that find they can't do better after all, e.g. because a kernel fast path
+// turned out to be unsupported for the fds involved. `completedSoFar` bytes were already pumped
+// by other means; they count toward `amount` and are included in the result.
+
 class CidrRange {
 public:
   CidrRange(StringPtr pattern);
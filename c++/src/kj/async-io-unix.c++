@@ -46,6 +46,11 @@
 #include <poll.h>
 #include <limits.h>
 #include <sys/ioctl.h>
+#include <sys/stat.h>
+
+#if __linux__
+#include <sys/sendfile.h>
+#endif
 
 namespace kj {
 
@@ -122,6 +127,44 @@ private:
 
 // =======================================================================================
 
+class AsyncFileInputFd: public OwnedFileDescriptor, public AsyncInputStream {
+  // Reads a regular file from its current position. Regular files are always "ready" (epoll
+  // refuses to watch them at all), so reads are simply synchronous; this exists mainly so that
+  // pumping a file to a socket can use sendfile().
+
+public:
+  AsyncFileInputFd(int fd, uint flags): OwnedFileDescriptor(fd, flags) {}
+
+  Promise<size_t> tryRead(void* buffer, size_t minBytes, size_t maxBytes) override {
+    // Report errors through the promise, like any other stream.
+    return kj::evalNow([&]() {
+      size_t total = 0;
+      while (total < minBytes) {
+        ssize_t n;
+        KJ_SYSCALL(n = ::read(fd, reinterpret_cast<byte*>(buffer) + total, maxBytes - total));
+        if (n == 0) break;
+        total += n;
+      }
+      return total;
+    });
+  }
+
+  Maybe<uint64_t> tryGetLength() override {
+    struct stat stats;
+    KJ_SYSCALL(fstat(fd, &stats));
+    off_t position;
+    KJ_SYSCALL(position = lseek(fd, 0, SEEK_CUR));
+    if (stats.st_size == 0) {
+      // Could be empty, or could be a procfs-style file whose size isn't known in advance.
+      return nullptr;
+    }
+    return stats.st_size > position ? uint64_t(stats.st_size - position) : uint64_t(0);
+  }
+
+private:
+  friend class AsyncStreamFd;
+};
+
 class AsyncStreamFd: public OwnedFileDescriptor, public AsyncCapabilityStream {
 public:
   AsyncStreamFd(UnixEventPort& eventPort, int fd, uint flags)
@@ -175,6 +218,25 @@ public:
     }
   }
 
+  Maybe<Promise<uint64_t>> tryPumpFrom(AsyncInputStream& input, uint64_t amount) override {
+#if __linux__
+    // Let the kernel move the bytes, rather than copying them through userspace.
+    KJ_IF_MAYBE(file, kj::dynamicDowncastIfAvailable<AsyncFileInputFd>(input)) {
+      if (isFdType(fd, S_IFSOCK)) {
+        return kj::evalNow([&]() { return sendfilePumpFrom(*file, amount, 0); });
+      }
+    } else KJ_IF_MAYBE(stream, kj::dynamicDowncastIfAvailable<AsyncStreamFd>(input)) {
+      // splice() works on sockets and pipes on both ends; other fds might not support it.
+      if (&stream->eventPort == &eventPort &&
+          (isFdType(fd, S_IFSOCK) || isFdType(fd, S_IFIFO)) &&
+          (isFdType(stream->fd, S_IFSOCK) || isFdType(stream->fd, S_IFIFO))) {
+        return kj::evalNow([&]() { return splicePumpFrom(*stream, amount); });
+      }
+    }
+#endif
+    return nullptr;
+  }
+
   void shutdownWrite() override {
     // There's no legitimate way to get an AsyncStreamFd that isn't a socket through the
     // UnixAsyncIoProvider interface.
@@ -209,6 +271,14 @@ public:
     *length = socklen;
   }
 
+  Maybe<int> getFd() const override {
+    return fd;
+  }
+
+  Promise<void> whenWritable() override {
+    return observer.whenBecomesWritable();
+  }
+
   kj::Promise<Maybe<Own<AsyncCapabilityStream>>> tryReceiveStream() override {
     return tryReceiveFdImpl<Own<AsyncCapabilityStream>>();
   }
@@ -287,6 +357,148 @@ private:
   UnixEventPort& eventPort;
   UnixEventPort::FdObserver observer;
 
+#if __linux__
+  static bool isFdType(int fd, mode_t type) {
+    struct stat stats;
+    KJ_SYSCALL(fstat(fd, &stats));
+    return (stats.st_mode & S_IFMT) == type;
+  }
+
+  Promise<uint64_t> sendfilePumpFrom(AsyncFileInputFd& input, uint64_t amount, uint64_t done) {
+    while (done < amount) {
+      ssize_t n = sendfile(fd, input.fd, nullptr, kj::min(amount - done, uint64_t(MAX_SENDFILE)));
+      if (n < 0) {
+        int error = errno;
+        if (error == EINTR) continue;
+        if (error == EAGAIN || error == EWOULDBLOCK) {
+          return observer.whenBecomesWritable().then([this,&input,amount,done]() {
+            return sendfilePumpFrom(input, amount, done);
+          });
+        }
+        if ((error == EINVAL || error == ENOSYS) && done == 0) {
+          // The file doesn't support it (e.g. some special filesystems). Nothing has moved yet.
+          return _::unoptimizedPumpTo(input, *this, amount);
+        }
+        KJ_FAIL_SYSCALL("sendfile", error);
+      }
+      if (n == 0) break;  // EOF
+      done += n;
+    }
+    return done;
+  }
+
+  struct SplicePipe {
+    // Intermediate pipe for splice(), which requires one end of each transfer to be a pipe.
+
+    AutoCloseFd readEnd;
+    AutoCloseFd writeEnd;
+    size_t buffered = 0;
+    // Bytes spliced into the pipe and not yet out of it.
+  };
+
+  Promise<uint64_t> splicePumpFrom(AsyncStreamFd& input, uint64_t amount) {
+    int fds[2];
+    KJ_SYSCALL(pipe2(fds, O_NONBLOCK | O_CLOEXEC));
+    auto pipe = kj::heap<SplicePipe>();
+    pipe->readEnd = AutoCloseFd(fds[0]);
+    pipe->writeEnd = AutoCloseFd(fds[1]);
+
+    // A bigger pipe means fewer round trips; this may fail past /proc/sys/fs/pipe-max-size, in
+    // which case the default 64 KiB will do.
+    fcntl(fds[1], F_SETPIPE_SZ, SPLICE_PIPE_SIZE);
+
+    auto promise = splicePumpLoop(input, *pipe, amount, 0);
+    return promise.attach(kj::mv(pipe));
+  }
+
+  static ssize_t trySplice(int from, int to, size_t size, bool& unsupported) {
+    // Returns the number of bytes moved, or -1 if either end would block.  If the kernel can't
+    // splice between these fds at all (EINVAL or ENOSYS, e.g. a socket type without splice
+    // support), returns -1 with `unsupported` set instead of throwing, so the caller can fall
+    // back to copying.
+
+    for (;;) {
+      ssize_t n = splice(from, nullptr, to, nullptr, size, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+      if (n >= 0) return n;
+
+      int error = errno;
+      if (error == EINTR) continue;
+      if (error == EAGAIN || error == EWOULDBLOCK) return -1;
+      if (error == EINVAL || error == ENOSYS) {
+        unsupported = true;
+        return -1;
+      }
+      KJ_FAIL_SYSCALL("splice", error);
+    }
+  }
+
+  Promise<uint64_t> splicePumpLoop(AsyncStreamFd& input, SplicePipe& pipe,
+                                   uint64_t amount, uint64_t done) {
+    // `done` counts bytes taken from `input`, some of which may still be in the pipe. We only
+    // refill the pipe once it's empty, so an EAGAIN can only mean that the socket on the other
+    // side of a transfer isn't ready, which is what the edge-triggered observers require.
+
+    bool unsupported = false;
+    for (;;) {
+      while (pipe.buffered > 0) {
+        ssize_t n = trySplice(pipe.readEnd, fd, pipe.buffered, unsupported);
+        if (unsupported) {
+          return spliceFallback(input, pipe, amount, done);
+        }
+        if (n < 0) {
+          return observer.whenBecomesWritable().then([this,&input,&pipe,amount,done]() {
+            return splicePumpLoop(input, pipe, amount, done);
+          });
+        }
+        pipe.buffered -= n;
+      }
+
+      if (done == amount) return done;
+
+      ssize_t n = trySplice(input.fd, pipe.writeEnd,
+                            kj::min(amount - done, uint64_t(SPLICE_PIPE_SIZE)), unsupported);
+      if (unsupported) {
+        return spliceFallback(input, pipe, amount, done);
+      }
+      if (n < 0) {
+        return input.observer.whenBecomesReadable().then([this,&input,&pipe,amount,done]() {
+          return splicePumpLoop(input, pipe, amount, done);
+        });
+      }
+      if (n == 0) return done;  // EOF
+      pipe.buffered = n;
+      done += n;
+    }
+  }
+
+  Promise<uint64_t> spliceFallback(AsyncStreamFd& input, SplicePipe& pipe,
+                                   uint64_t amount, uint64_t done) {
+    // splice() isn't supported between these fds after all. Write out whatever is stuck in the
+    // pipe, then copy the rest through userspace.
+
+    auto promise = kj::Promise<void>(kj::READY_NOW);
+    if (pipe.buffered > 0) {
+      auto buffer = kj::heapArray<byte>(pipe.buffered);
+      size_t pos = 0;
+      while (pos < buffer.size()) {
+        ssize_t n;
+        KJ_SYSCALL(n = ::read(pipe.readEnd, buffer.begin() + pos, buffer.size() - pos));
+        KJ_ASSERT(n > 0, "splice pipe ended early");
+        pos += n;
+      }
+      pipe.buffered = 0;
+      promise = write(buffer.begin(), buffer.size()).attach(kj::mv(buffer));
+    }
+
+    return promise.then([this,&input,amount,done]() {
+      return _::unoptimizedPumpTo(input, *this, amount, done);
+    });
+  }
+
+  static constexpr uint64_t MAX_SENDFILE = 1 << 30;
+  static constexpr int SPLICE_PIPE_SIZE = 1 << 20;
+#endif
+
   Promise<size_t> tryReadInternal(void* buffer, size_t minBytes, size_t maxBytes,
                                   size_t alreadyRead) {
     // `alreadyRead` is the number of bytes we have already received via previous reads -- minBytes,
@@ -1074,6 +1286,11 @@ public:
   inline WaitScope& getWaitScope() { return waitScope; }
 
   Own<AsyncInputStream> wrapInputFd(int fd, uint flags = 0) override {
+    struct stat stats;
+    KJ_SYSCALL(fstat(fd, &stats));
+    if (S_ISREG(stats.st_mode)) {
+      return heap<AsyncFileInputFd>(fd, flags);
+    }
     return heap<AsyncStreamFd>(eventPort, fd, flags);
   }
   Own<AsyncOutputStream> wrapOutputFd(int fd, uint flags = 0) override {
@@ -70,8 +70,9 @@ namespace {
 
 class AsyncPump {
 public:
-  AsyncPump(AsyncInputStream& input, AsyncOutputStream& output, uint64_t limit)
-      : input(input), output(output), limit(limit) {}
+  AsyncPump(AsyncInputStream& input, AsyncOutputStream& output, uint64_t limit,
+            uint64_t doneSoFar = 0)
+      : input(input), output(output), limit(limit), doneSoFar(doneSoFar) {}
 
   Promise<uint64_t> pump() {
     // TODO(perf): This could be more efficient by reading half a buffer at a time and then
@@ -95,12 +96,24 @@ private:
   AsyncInputStream& input;
   AsyncOutputStream& output;
   uint64_t limit;
-  uint64_t doneSoFar = 0;
+  uint64_t doneSoFar;
   byte buffer[4096];
 };
 
 }  // namespace
 
+namespace _ {  // private
+
+Promise<uint64_t> unoptimizedPumpTo(
+    AsyncInputStream& input, AsyncOutputStream& output, uint64_t amount,
+    uint64_t completedSoFar) {
+  auto pump = heap<AsyncPump>(input, output, amount, completedSoFar);
+  auto promise = pump->pump();
+  return promise.attach(kj::mv(pump));
+}
+
+}  // namespace _ (private)
+
 Promise<uint64_t> AsyncInputStream::pumpTo(
     AsyncOutputStream& output, uint64_t amount) {
   // See if output wants to dispatch on us.
@@ -109,9 +122,7 @@ Promise<uint64_t> AsyncInputStream::pumpTo(
   }
 
   // OK, fall back to naive approach.
-  auto pump = heap<AsyncPump>(*this, output, amount);
-  auto promise = pump->pump();
-  return promise.attach(kj::mv(pump));
+  return _::unoptimizedPumpTo(*this, output, amount);
 }
 
 namespace {
@@ -225,6 +236,9 @@ void AsyncIoStream::getsockname(struct sockaddr* addr, uint* length) {
 void AsyncIoStream::getpeername(struct sockaddr* addr, uint* length) {
   KJ_UNIMPLEMENTED("Not a socket.");
 }
+Promise<void> AsyncIoStream::whenWritable() {
+  KJ_UNIMPLEMENTED("Not a file descriptor.");
+}
 void ConnectionReceiver::getsockopt(int level, int option, void* value, uint* length) {
   KJ_UNIMPLEMENTED("Not a socket.");
 }
@@ -130,6 +130,15 @@ public:
   // Note that we don't provide methods that return NetworkAddress because it usually wouldn't
   // be useful. You can't connect() to or listen() on these addresses, obviously, because they are
   // ephemeral addresses for a single connection.
+
+  virtual Maybe<int> getFd() const { return nullptr; }
+  // Get the underlying Unix file descriptor, if any. Returns nullptr if this object actually
+  // isn't wrapping a file descriptor. Meant for applying socket features that KJ doesn't wrap;
+  // reading or writing the fd directly bypasses any buffering the stream does.
+
+  virtual Promise<void> whenWritable();
+  // For a caller writing to getFd() directly: after such a write fails with EAGAIN, resolves once
+  // the fd can take more data. The default implementation throws "unimplemented".
 };
 
 class AsyncCapabilityStream: public AsyncIoStream {
@@ -561,6 +570,9 @@ public:
   // Create an AsyncInputStream wrapping a file descriptor.
   //
   // `flags` is a bitwise-OR of the values of the `Flags` enum.
+  //
+  // On Unix, `fd` may be a regular file, in which case reading starts at its current position
+  // and pumping it to a socket uses sendfile() where available.
 
   virtual Own<AsyncOutputStream> wrapOutputFd(Fd fd, uint flags = 0) = 0;
   // Create an AsyncOutputStream wrapping a file descriptor.
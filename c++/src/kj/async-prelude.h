@@ -31,6 +31,17 @@
 #include "exception.h"
 #include "tuple.h"
 
+#if !KJ_NO_EXCEPTIONS && defined(__cpp_impl_coroutine) && __cpp_impl_coroutine >= 201902L && \
+    !(defined(__GNUC__) && !defined(__clang__) && __GNUC__ < 13)
+// (GCC 12 and earlier hit an internal compiler error on coroutines whose return type has a
+// noexcept(false) destructor, which kj::Own does.)
+#define KJ_HAS_COROUTINE 1
+// kj::Promise<T> can be used as a C++20 coroutine return type, and can be co_awaited inside such
+// coroutines.  See the comment on Promise in async.h.
+#else
+#define KJ_HAS_COROUTINE 0
+#endif
+
 namespace kj {
 
 class EventLoop;
@@ -173,6 +184,12 @@ template <typename T>
 class ForkHub;
 
 class Event;
+class CrossThreadQueue;
+class CrossThreadEventBase;
+
+class CoroutineBase;
+template <typename T>
+class Coroutine;
 
 class PromiseBase {
 public:
@@ -187,6 +204,7 @@ private:
 
   friend class kj::EventLoop;
   friend class ChainPromiseNode;
+  friend class CoroutineBase;
   template <typename>
   friend class kj::Promise;
   friend class kj::TaskSet;
@@ -200,6 +218,8 @@ void waitImpl(Own<_::PromiseNode>&& node, _::ExceptionOrValue& result, WaitScope
 bool pollImpl(_::PromiseNode& node, WaitScope& waitScope);
 Promise<void> yield();
 Own<PromiseNode> neverDone();
+void* allocPromiseNodeSpace(size_t size);
+void freePromiseNodeSpace(void* space, size_t size) noexcept;
 
 class NeverDone {
 public:
@@ -23,6 +23,8 @@
 #include "debug.h"
 #include "vector.h"
 #include "threadlocal.h"
+#include <chrono>
+#include <atomic>
 
 #if KJ_USE_FUTEX
 #include <unistd.h>
@@ -148,7 +150,7 @@ private:
 };
 
 void TaskSet::add(Promise<void>&& promise) {
-  auto task = heap<Task>(*this, kj::mv(promise.node));
+  auto task = _::heapPromiseNode<Task>(*this, kj::mv(promise.node));
   KJ_IF_MAYBE(head, tasks) {
     head->get()->prev = &task->next;
     task->next = kj::mv(tasks);
@@ -228,32 +230,128 @@ void EventPort::wake() const {
       "cross-thread wake() not implemented by this EventPort implementation"));
 }
 
+static TimePoint monotonicNow() {
+  return origin<TimePoint>() + std::chrono::duration_cast<std::chrono::nanoseconds>(
+      std::chrono::steady_clock::now().time_since_epoch()).count() * NANOSECONDS;
+}
+
+struct EventLoop::Instrumentation {
+  Stats stats;
+  SlowEventHandler* slowEventHandler = nullptr;
+  Duration slowEventThreshold = 0 * NANOSECONDS;
+
+  void eventFired(_::Event& event, Duration runTime) {
+    ++stats.eventsFired;
+    stats.timeInEvents += runTime;
+
+    uint64_t micros = runTime / MICROSECONDS;
+    uint bucket = 0;
+    while (micros > 0 && bucket < Stats::HISTOGRAM_BUCKETS - 1) {
+      micros >>= 1;
+      ++bucket;
+    }
+    ++stats.eventRunTimeHistogram[bucket];
+
+    if (slowEventHandler != nullptr && runTime >= slowEventThreshold) {
+      slowEventHandler->slowEvent(runTime, event.trace());
+    }
+  }
+};
+
+namespace _ {  // private
+
+class CrossThreadQueue final: public AtomicRefcounted {
+  // Inbox through which other threads post events to an EventLoop.  See
+  // newCrossThreadPromiseAndFulfiller().
+
+public:
+  explicit CrossThreadQueue(const EventPort& port): port(port) {}
+
+  void post(Own<CrossThreadEventBase> event) const {
+    auto lock = state.lockExclusive();
+    if (lock->closed) return;
+
+    lock->events.add(kj::mv(event));
+    pending.store(true, std::memory_order_release);
+
+    // Still under lock, so that the loop (and its port) can't be destroyed concurrently.
+    port.wake();
+  }
+
+  bool hasPending() const { return pending.load(std::memory_order_acquire); }
+
+  Vector<Own<CrossThreadEventBase>> take() const {
+    auto lock = state.lockExclusive();
+    pending.store(false, std::memory_order_relaxed);
+    return kj::mv(lock->events);
+  }
+
+  Vector<Own<CrossThreadEventBase>> close() const {
+    // Called when the loop is destroyed.  Later posts are discarded.
+    auto lock = state.lockExclusive();
+    lock->closed = true;
+    return kj::mv(lock->events);
+  }
+
+private:
+  const EventPort& port;
+
+  struct State {
+    Vector<Own<CrossThreadEventBase>> events;
+    bool closed = false;
+  };
+  MutexGuarded<State> state;
+
+  mutable std::atomic<bool> pending { false };
+  // Lets the loop check for events without taking the lock.
+};
+
+CrossThreadEventBase::CrossThreadEventBase()
+    : queue(kj::atomicAddRef(*currentEventLoop().crossThreadQueue)) {}
+
+CrossThreadEventBase::~CrossThreadEventBase() noexcept(false) {}
+
+void CrossThreadEventBase::post() {
+  queue->post(kj::atomicAddRef(*this));
+}
+
+}  // namespace _ (private)
+
 EventLoop::EventLoop()
     : port(_::NullEventPort::instance),
+      crossThreadQueue(kj::atomicRefcounted<_::CrossThreadQueue>(port)),
       daemons(kj::heap<TaskSet>(_::LoggingErrorHandler::instance)) {}
 
 EventLoop::EventLoop(EventPort& port)
     : port(port),
+      crossThreadQueue(kj::atomicRefcounted<_::CrossThreadQueue>(port)),
       daemons(kj::heap<TaskSet>(_::LoggingErrorHandler::instance)) {}
 
 EventLoop::~EventLoop() noexcept(false) {
+  // Stop accepting cross-thread events, and drop any that haven't been delivered (on this thread,
+  // since they hold fulfillers for promises on this loop).
+  crossThreadQueue->close();
+
   // Destroy all "daemon" tasks, noting that their destructors might try to access the EventLoop
   // some more.
   daemons = nullptr;
 
   // The application _should_ destroy everything using the EventLoop before destroying the
   // EventLoop itself, so if there are events on the loop, this indicates a memory leak.
-  KJ_REQUIRE(head == nullptr, "EventLoop destroyed with events still in the queue.  Memory leak?",
-             head->trace()) {
-    // Unlink all the events and hope that no one ever fires them...
-    _::Event* event = head;
-    while (event != nullptr) {
-      _::Event* next = event->next;
-      event->next = nullptr;
-      event->prev = nullptr;
-      event = next;
+  for (auto& queue: queues) {
+    KJ_REQUIRE(queue.head == nullptr,
+               "EventLoop destroyed with events still in the queue.  Memory leak?",
+               queue.head->trace()) {
+      // Unlink all the events and hope that no one ever fires them...
+      _::Event* event = queue.head;
+      while (event != nullptr) {
+        _::Event* next = event->next;
+        event->next = nullptr;
+        event->prev = nullptr;
+        event = next;
+      }
+      break;
     }
-    break;
   }
 
   KJ_REQUIRE(threadLocalEventLoop != this,
@@ -261,6 +359,14 @@ EventLoop::~EventLoop() noexcept(false) {
     threadLocalEventLoop = nullptr;
     break;
   }
+
+  for (auto& head: freePromiseNodes) {
+    while (head != nullptr) {
+      FreePromiseNode* next = head->next;
+      operator delete(head);
+      head = next;
+    }
+  }
 }
 
 void EventLoop::run(uint maxTurnCount) {
@@ -277,39 +383,147 @@ void EventLoop::run(uint maxTurnCount) {
 }
 
 bool EventLoop::turn() {
-  _::Event* event = head;
+  // Pick the highest-priority non-empty queue, unless some queue has been starved for too long.
+  Queue* queue = nullptr;
+  for (auto& candidate: queues) {
+    if (candidate.head != nullptr) {
+      if (queue == nullptr) {
+        queue = &candidate;
+      } else if (candidate.starvedTurns >= STARVATION_LIMIT) {
+        queue = &candidate;
+        break;
+      }
+    }
+  }
 
-  if (event == nullptr) {
+  if (queue == nullptr) {
     // No events in the queue.
     return false;
   } else {
-    head = event->next;
-    if (head != nullptr) {
-      head->prev = &head;
+    for (auto& other: queues) {
+      if (other.head == nullptr || &other == queue) {
+        other.starvedTurns = 0;
+      } else {
+        ++other.starvedTurns;
+      }
+    }
+
+    _::Event* event = queue->head;
+    queue->head = event->next;
+    if (queue->head != nullptr) {
+      queue->head->prev = &queue->head;
     }
 
-    depthFirstInsertPoint = &head;
-    if (tail == &event->next) {
-      tail = &head;
+    if (queue->tail == &event->next) {
+      queue->tail = &queue->head;
     }
+    resetDepthFirstInsertPoints();
 
     event->next = nullptr;
     event->prev = nullptr;
 
+    bool timed = instrumentation.get() != nullptr;
+    TimePoint start = origin<TimePoint>();
+    if (timed) {
+      auto& stats = instrumentation->stats;
+      stats.maxQueueLength = kj::max(stats.maxQueueLength, queueLength);
+      start = monotonicNow();
+    }
+    --queueLength;
+
     Maybe<Own<_::Event>> eventToDestroy;
     {
       event->firing = true;
-      KJ_DEFER(event->firing = false);
+      Priority savedPriority = currentPriority;
+      currentPriority = static_cast<Priority>(event->priority);
+      KJ_DEFER(event->firing = false; currentPriority = savedPriority);
       eventToDestroy = event->fire();
     }
 
-    depthFirstInsertPoint = &head;
+    if (timed && instrumentation.get() != nullptr) {
+      // (The callback may have disabled stats, so we check again.)
+      instrumentation->eventFired(*event, monotonicNow() - start);
+    }
+
+    resetDepthFirstInsertPoints();
     return true;
   }
 }
 
+void EventLoop::resetDepthFirstInsertPoints() {
+  for (auto& queue: queues) {
+    queue.depthFirstInsertPoint = &queue.head;
+  }
+}
+
+EventLoop::PriorityScope::PriorityScope(Priority priority)
+    : loop(currentEventLoop()), savedPriority(loop.currentPriority) {
+  loop.currentPriority = priority;
+}
+
+EventLoop::PriorityScope::~PriorityScope() noexcept(false) {
+  loop.currentPriority = savedPriority;
+}
+
+bool EventLoop::portWait() {
+  bool result;
+  if (instrumentation.get() == nullptr) {
+    result = port.wait();
+  } else {
+    TimePoint start = monotonicNow();
+    result = port.wait();
+    instrumentation->stats.timeWaiting += monotonicNow() - start;
+  }
+  if (crossThreadQueue->hasPending()) deliverCrossThreadEvents();
+  return result;
+}
+
+bool EventLoop::portPoll() {
+  bool result;
+  if (instrumentation.get() == nullptr) {
+    result = port.poll();
+  } else {
+    TimePoint start = monotonicNow();
+    result = port.poll();
+    instrumentation->stats.timeWaiting += monotonicNow() - start;
+  }
+  if (crossThreadQueue->hasPending()) deliverCrossThreadEvents();
+  return result;
+}
+
+void EventLoop::deliverCrossThreadEvents() {
+  for (auto& event: crossThreadQueue->take()) {
+    event->deliver();
+  }
+}
+
+void EventLoop::enableStats() {
+  if (instrumentation.get() == nullptr) {
+    instrumentation = kj::heap<Instrumentation>();
+  }
+}
+
+void EventLoop::disableStats() {
+  instrumentation = nullptr;
+}
+
+EventLoop::Stats EventLoop::getStats() {
+  Stats result;
+  if (instrumentation.get() != nullptr) {
+    result = instrumentation->stats;
+  }
+  result.queueLength = queueLength;
+  return result;
+}
+
+void EventLoop::setSlowEventHandler(SlowEventHandler& handler, Duration threshold) {
+  enableStats();
+  instrumentation->slowEventHandler = &handler;
+  instrumentation->slowEventThreshold = threshold;
+}
+
 bool EventLoop::isRunnable() {
-  return head != nullptr;
+  return queueLength > 0;
 }
 
 void EventLoop::setRunnable(bool runnable) {
@@ -342,7 +556,7 @@ void WaitScope::poll() {
   for (;;) {
     if (!loop.turn()) {
       // No events in the queue.  Poll for I/O.
-      loop.port.poll();
+      loop.portPoll();
 
       if (!loop.isRunnable()) {
         // Still no events in the queue. We're done.
@@ -369,7 +583,7 @@ void waitImpl(Own<_::PromiseNode>&& node, _::ExceptionOrValue& result, WaitScope
   while (!doneEvent.fired) {
     if (!loop.turn()) {
       // No events in the queue.  Wait for callback.
-      loop.port.wait();
+      loop.portWait();
     }
   }
 
@@ -397,7 +611,7 @@ bool pollImpl(_::PromiseNode& node, WaitScope& waitScope) {
   while (!doneEvent.fired) {
     if (!loop.turn()) {
       // No events in the queue.  Poll for I/O.
-      loop.port.poll();
+      loop.portPoll();
 
       if (!doneEvent.fired && !loop.isRunnable()) {
         // No progress. Give up.
@@ -413,11 +627,62 @@ bool pollImpl(_::PromiseNode& node, WaitScope& waitScope) {
 }
 
 Promise<void> yield() {
-  return Promise<void>(false, kj::heap<YieldPromiseNode>());
+  return Promise<void>(false, heapPromiseNode<YieldPromiseNode>());
 }
 
 Own<PromiseNode> neverDone() {
-  return kj::heap<NeverDonePromiseNode>();
+  return heapPromiseNode<NeverDonePromiseNode>();
+}
+
+#if defined(__SANITIZE_ADDRESS__)
+// Recycling blocks would hide use-after-free bugs from ASAN.
+#define KJ_PROMISE_NODE_FREELIST 0
+#else
+#define KJ_PROMISE_NODE_FREELIST 1
+#endif
+
+static constexpr size_t PROMISE_NODE_SIZE_GRANULARITY = 16;
+
+void* allocPromiseNodeSpace(size_t size) {
+  size_t sizeClass = (size - 1) / PROMISE_NODE_SIZE_GRANULARITY;
+  if (sizeClass >= EventLoop::PROMISE_NODE_SIZE_CLASSES) {
+    return operator new(size);
+  }
+
+#if KJ_PROMISE_NODE_FREELIST
+  EventLoop* loop = threadLocalEventLoop;
+  if (loop != nullptr) {
+    EventLoop::FreePromiseNode*& head = loop->freePromiseNodes[sizeClass];
+    if (head != nullptr) {
+      EventLoop::FreePromiseNode* result = head;
+      head = result->next;
+      --loop->freePromiseNodeCounts[sizeClass];
+      return result;
+    }
+  }
+#endif
+
+  // Always allocate the full size class so that the block can be reused by any node in the class.
+  return operator new((sizeClass + 1) * PROMISE_NODE_SIZE_GRANULARITY);
+}
+
+void freePromiseNodeSpace(void* space, size_t size) noexcept {
+#if KJ_PROMISE_NODE_FREELIST
+  size_t sizeClass = (size - 1) / PROMISE_NODE_SIZE_GRANULARITY;
+  EventLoop* loop = threadLocalEventLoop;
+  if (loop != nullptr && sizeClass < EventLoop::PROMISE_NODE_SIZE_CLASSES &&
+      loop->freePromiseNodeCounts[sizeClass] < EventLoop::MAX_FREE_PROMISE_NODES_PER_CLASS) {
+    // Note that the block may have been allocated under a different EventLoop (or none); that's
+    // fine since all blocks in a size class are interchangeable.
+    auto node = reinterpret_cast<EventLoop::FreePromiseNode*>(space);
+    node->next = loop->freePromiseNodes[sizeClass];
+    loop->freePromiseNodes[sizeClass] = node;
+    ++loop->freePromiseNodeCounts[sizeClass];
+    return;
+  }
+#endif
+
+  operator delete(space);
 }
 
 void NeverDone::wait(WaitScope& waitScope) const {
@@ -433,15 +698,18 @@ void detach(kj::Promise<void>&& promise) {
 }
 
 Event::Event()
-    : loop(currentEventLoop()), next(nullptr), prev(nullptr) {}
+    : loop(currentEventLoop()), next(nullptr), prev(nullptr),
+      priority(static_cast<uint8_t>(loop.currentPriority)) {}
 
 Event::~Event() noexcept(false) {
   if (prev != nullptr) {
-    if (loop.tail == &next) {
-      loop.tail = prev;
+    auto& queue = loop.queues[priority];
+    --loop.queueLength;
+    if (queue.tail == &next) {
+      queue.tail = prev;
     }
-    if (loop.depthFirstInsertPoint == &next) {
-      loop.depthFirstInsertPoint = prev;
+    if (queue.depthFirstInsertPoint == &next) {
+      queue.depthFirstInsertPoint = prev;
     }
 
     *prev = next;
@@ -461,17 +729,19 @@ void Event::armDepthFirst() {
              "the thread-safe work queue to queue events cross-thread.");
 
   if (prev == nullptr) {
-    next = *loop.depthFirstInsertPoint;
-    prev = loop.depthFirstInsertPoint;
+    auto& queue = loop.queues[priority];
+    next = *queue.depthFirstInsertPoint;
+    prev = queue.depthFirstInsertPoint;
     *prev = this;
     if (next != nullptr) {
       next->prev = &next;
     }
 
-    loop.depthFirstInsertPoint = &next;
+    queue.depthFirstInsertPoint = &next;
+    ++loop.queueLength;
 
-    if (loop.tail == prev) {
-      loop.tail = &next;
+    if (queue.tail == prev) {
+      queue.tail = &next;
     }
 
     loop.setRunnable(true);
@@ -484,14 +754,16 @@ void Event::armBreadthFirst() {
              "the thread-safe work queue to queue events cross-thread.");
 
   if (prev == nullptr) {
-    next = *loop.tail;
-    prev = loop.tail;
+    auto& queue = loop.queues[priority];
+    next = *queue.tail;
+    prev = queue.tail;
     *prev = this;
     if (next != nullptr) {
       next->prev = &next;
     }
 
-    loop.tail = &next;
+    queue.tail = &next;
+    ++loop.queueLength;
 
     loop.setRunnable(true);
   }
@@ -794,7 +1066,7 @@ Maybe<Own<Event>> ChainPromiseNode::fire() {
     // There is an exception.  If there is also a value, delete it.
     kj::runCatchingExceptions([&]() { intermediate.value = nullptr; });
     // Now set step2 to a rejected promise.
-    inner = heap<ImmediateBrokenPromiseNode>(kj::mv(*exception));
+    inner = heapPromiseNode<ImmediateBrokenPromiseNode>(kj::mv(*exception));
   } else KJ_IF_MAYBE(value, intermediate.value) {
     // There is a value and no exception.  The value is itself a promise.  Adopt it as our
     // step2.
@@ -965,7 +1237,7 @@ void ArrayJoinPromiseNode<void>::getNoError(ExceptionOrValue& output) noexcept {
 }  // namespace _ (private)
 
 Promise<void> joinPromises(Array<Promise<void>>&& promises) {
-  return Promise<void>(false, kj::heap<_::ArrayJoinPromiseNode<void>>(
+  return Promise<void>(false, _::heapPromiseNode<_::ArrayJoinPromiseNode<void>>(
       KJ_MAP(p, promises) { return kj::mv(p.node); },
       heapArray<_::ExceptionOr<_::Void>>(promises.size())));
 }
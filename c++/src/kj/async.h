@@ -28,6 +28,8 @@
 #include "async-prelude.h"
 #include "exception.h"
 #include "refcount.h"
+#include "mutex.h"
+#include "time.h"
 
 namespace kj {
 
@@ -103,6 +105,27 @@ class Promise: protected _::PromiseBase {
   //
   // To adapt a non-Promise-based asynchronous API to promises, use `newAdaptedPromise()`.
   //
+  // When compiled as C++20 (see KJ_HAS_COROUTINE), a function returning Promise<T> may instead be
+  // written as a coroutine, using `co_await` on other promises and `co_return` for the result:
+  //
+  //     Promise<uint> countLines(Promise<Own<File>> filePromise) {
+  //       auto file = co_await filePromise;
+  //       String text = co_await file->readAll();
+  //       uint count = 0;
+  //       for (char c: text) count += (c == '\n');
+  //       co_return count;
+  //     }
+  //
+  // The coroutine runs synchronously up to its first `co_await`.  Each time it is suspended, it
+  // is resumed from the event loop as an ordinary event once the awaited promise resolves, so it
+  // never runs concurrently with other callbacks on the thread.  A broken promise causes
+  // `co_await` to throw, and an exception escaping the coroutine breaks the returned promise.
+  // Destroying the returned promise destroys the coroutine frame, canceling whatever it was
+  // awaiting, just like dropping a `then()` chain.  All of the coroutine's state lives in its
+  // frame, so a sequence of `co_await`s costs one allocation rather than one or more per step.
+  //
+  // Only Promises may be co_awaited in such a coroutine.
+  //
   // Systems using promises should consider supporting the concept of "pipelining".  Pipelining
   // means allowing a caller to start issuing method calls against a promised object before the
   // promise has actually been fulfilled.  This is particularly useful if the promise is for a
@@ -319,6 +342,9 @@ private:
   friend class TaskSet;
   friend Promise<void> _::yield();
   friend class _::NeverDone;
+  friend class _::CoroutineBase;
+  template <typename>
+  friend class _::Coroutine;
   template <typename U>
   friend Promise<Array<U>> joinPromises(Array<Promise<U>>&& promises);
   friend Promise<void> joinPromises(Array<Promise<void>>&& promises);
@@ -500,6 +526,16 @@ PromiseFulfillerPair<T> newPromiseAndFulfiller();
 // fulfiller will be of type `PromiseFulfiller<Promise<U>>`.  Thus you pass a `Promise<U>` to the
 // `fulfill()` callback, and the promises are chained.
 
+template <typename T>
+PromiseFulfillerPair<T> newCrossThreadPromiseAndFulfiller();
+// Like `newPromiseAndFulfiller()`, but the fulfiller may be used -- and destroyed -- from any
+// thread.  The promise belongs to the calling thread's EventLoop.  Fulfilling it from another
+// thread queues the result for that loop and wakes the loop with `EventPort::wake()`, so the
+// loop's port must implement `wake()` (`UnixEventPort` does).  The loop picks up the result the
+// next time it checks its port, i.e. once it runs out of other events.
+//
+// If the EventLoop has been destroyed by the time the fulfiller is used, the result is discarded.
+
 // =======================================================================================
 // TaskSet
 
@@ -650,6 +686,101 @@ public:
   bool isRunnable();
   // Returns true if run() would currently do anything, or false if the queue is empty.
 
+  // ---------------------------------------------------------------------------
+  // Priorities
+  //
+  // Each event belongs to a priority class and the loop keeps one queue per class, so that a
+  // source that floods the loop with ready events (say, a pipelining RPC client) cannot add
+  // latency to more important work on the same thread (say, health checks).
+  //
+  // An event takes its priority from the loop's current priority at the time the event is
+  // constructed, which in practice is when the promise chain it belongs to is built.  While an
+  // event is firing, the current priority is that event's priority, so continuations built by a
+  // callback inherit the priority of the callback.  Use `PriorityScope` to start a chain at a
+  // different priority, e.g. around `tasks.add(handleHealthCheck())`.
+  //
+  // Each turn runs the first event of the highest-priority non-empty queue, except that a queue
+  // which has been passed over for `STARVATION_LIMIT` consecutive turns gets the next turn.  Thus
+  // lower-priority work can delay a higher-priority event by at most one turn out of every
+  // `STARVATION_LIMIT`, and cannot be starved outright either.
+
+  enum class Priority: uint8_t {
+    HIGH,
+    NORMAL,
+    LOW
+  };
+  static constexpr uint PRIORITY_COUNT = 3;
+  static constexpr uint STARVATION_LIMIT = 64;
+
+  class PriorityScope {
+    // Sets the current priority of the thread's EventLoop for the lifetime of the scope.
+
+  public:
+    explicit PriorityScope(Priority priority);
+    ~PriorityScope() noexcept(false);
+    KJ_DISALLOW_COPY(PriorityScope);
+
+  private:
+    EventLoop& loop;
+    Priority savedPriority;
+  };
+
+  inline Priority getCurrentPriority() { return currentPriority; }
+
+  // ---------------------------------------------------------------------------
+  // Instrumentation
+  //
+  // By default the loop keeps no timing information, so that an uninstrumented loop pays only a
+  // null check per turn.  Call `enableStats()` to start measuring where the thread's time goes.
+
+  struct Stats {
+    uint64_t eventsFired = 0;
+    // Number of event callbacks run.
+
+    size_t queueLength = 0;
+    // Number of events currently queued (always tracked, even with stats disabled).
+
+    size_t maxQueueLength = 0;
+    // Longest the queue has been at the start of a turn.
+
+    Duration timeInEvents = 0 * NANOSECONDS;
+    // Total time spent running event callbacks.
+
+    Duration timeWaiting = 0 * NANOSECONDS;
+    // Total time spent inside the EventPort's `wait()` and `poll()`, i.e. sleeping in (or
+    // polling) the OS's event notification mechanism.  For UnixEventPort this is essentially the
+    // time spent in epoll_wait().
+
+    static constexpr uint HISTOGRAM_BUCKETS = 20;
+    uint64_t eventRunTimeHistogram[HISTOGRAM_BUCKETS] = {};
+    // Distribution of per-event run time.  Bucket 0 counts events that took less than 1us, bucket
+    // `i` counts events that took [2^(i-1), 2^i) microseconds, and the last bucket also counts
+    // everything slower than that.
+  };
+
+  class SlowEventHandler {
+  public:
+    virtual void slowEvent(Duration runTime, StringPtr trace) = 0;
+    // Called after an event callback ran for at least the configured threshold.  `trace` is the
+    // same as `Promise::trace()` would give for the event: the demangled type of the event and of
+    // each node in the chain it belongs to, which includes the lambda types that identify the
+    // code responsible.  The trace is only computed for slow events.
+  };
+
+  void enableStats();
+  // Start collecting `Stats`.  Counters start from zero.  Does nothing if already enabled.
+
+  void disableStats();
+  // Stop collecting stats and remove any `SlowEventHandler`.
+
+  Stats getStats();
+  // Get a snapshot of the counters collected since `enableStats()`.  If stats are disabled, only
+  // `queueLength` is filled in.
+
+  void setSlowEventHandler(SlowEventHandler& handler, Duration threshold);
+  // Report each event that runs for at least `threshold` to `handler`.  Enables stats if not
+  // already enabled.  The handler must outlive the loop or a call to `disableStats()`.
+
 private:
   EventPort& port;
 
@@ -659,13 +790,44 @@ private:
   bool lastRunnableState = false;
   // What did we last pass to port.setRunnable()?
 
-  _::Event* head = nullptr;
-  _::Event** tail = &head;
-  _::Event** depthFirstInsertPoint = &head;
+  struct Queue {
+    _::Event* head = nullptr;
+    _::Event** tail = &head;
+    _::Event** depthFirstInsertPoint = &head;
+
+    uint starvedTurns = 0;
+    // Consecutive turns on which this queue was non-empty but another queue was run.
+  };
+  Queue queues[PRIORITY_COUNT];
+  size_t queueLength = 0;
+  // Total across all queues.
+
+  Priority currentPriority = Priority::NORMAL;
+
+  struct Instrumentation;
+  Own<Instrumentation> instrumentation;
+  // Null unless stats are enabled.
+
+  Own<_::CrossThreadQueue> crossThreadQueue;
+  // Events posted to this loop by other threads; see newCrossThreadPromiseAndFulfiller().  Shared
+  // (atomically refcounted) with pending posters, which may outlive the loop.
 
   Own<TaskSet> daemons;
 
+  struct FreePromiseNode {
+    FreePromiseNode* next;
+  };
+  static constexpr size_t PROMISE_NODE_SIZE_CLASSES = 32;
+  static constexpr size_t MAX_FREE_PROMISE_NODES_PER_CLASS = 256;
+  FreePromiseNode* freePromiseNodes[PROMISE_NODE_SIZE_CLASSES] = {};
+  uint freePromiseNodeCounts[PROMISE_NODE_SIZE_CLASSES] = {};
+  // Free lists of PromiseNode-sized blocks, indexed by size class.  See allocPromiseNodeSpace().
+
   bool turn();
+  void resetDepthFirstInsertPoints();
+  bool portWait();
+  bool portPoll();
+  void deliverCrossThreadEvents();
   void setRunnable(bool runnable);
   void enterScope();
   void leaveScope();
@@ -675,7 +837,10 @@ private:
                           WaitScope& waitScope);
   friend bool _::pollImpl(_::PromiseNode& node, WaitScope& waitScope);
   friend class _::Event;
+  friend class _::CrossThreadEventBase;
   friend class WaitScope;
+  friend void* _::allocPromiseNodeSpace(size_t size);
+  friend void _::freePromiseNodeSpace(void* space, size_t size) noexcept;
 };
 
 class WaitScope {
@@ -0,0 +1,217 @@
+// Copyright (c) 2017 Cloudflare, Inc. and contributors
+// Licensed under the MIT License:
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+#include "compression.h"
+#include <kj/test.h>
+#include <kj/debug.h>
+#include <kj/vector.h>
+
+namespace kj {
+namespace {
+
+// A toy run-length coding, enough to exercise the adapters: each run is encoded as a count
+// (1-255) followed by the byte, and a zero count ends a frame.
+
+class RleCompressor final: public Compressor {
+public:
+  bool compress(ArrayPtr<const byte>& input, ArrayPtr<byte>& output, Flush flush) override {
+    while (input.size() > 0) {
+      if (runLength > 0 && (input[0] != runByte || runLength == 255)) {
+        if (!emitRun(output)) return false;
+      }
+      runByte = input[0];
+      ++runLength;
+      input = input.slice(1, input.size());
+    }
+
+    if (flush != Flush::NONE && runLength > 0 && !emitRun(output)) return false;
+
+    if (flush == Flush::FINISH && !ended) {
+      if (output.size() == 0) return false;
+      output[0] = 0;
+      output = output.slice(1, output.size());
+      ended = true;
+    }
+    return true;
+  }
+
+private:
+  byte runByte = 0;
+  uint runLength = 0;
+  bool ended = false;
+
+  bool emitRun(ArrayPtr<byte>& output) {
+    if (output.size() < 2) return false;
+    output[0] = runLength;
+    output[1] = runByte;
+    output = output.slice(2, output.size());
+    runLength = 0;
+    return true;
+  }
+};
+
+class RleDecompressor final: public Decompressor {
+public:
+  bool decompress(ArrayPtr<const byte>& input, ArrayPtr<byte>& output) override {
+    for (;;) {
+      while (remaining > 0 && output.size() > 0) {
+        output[0] = value;
+        output = output.slice(1, output.size());
+        --remaining;
+      }
+      if (remaining > 0 || input.size() == 0) break;
+
+      if (count == 0) {
+        count = input[0];
+        atFrameEnd = count == 0;
+      } else {
+        value = input[0];
+        remaining = count;
+        count = 0;
+      }
+      input = input.slice(1, input.size());
+    }
+    return atFrameEnd;
+  }
+
+private:
+  uint count = 0;
+  uint remaining = 0;
+  byte value = 0;
+  bool atFrameEnd = false;
+};
+
+class MockInputStream: public AsyncInputStream {
+public:
+  MockInputStream(kj::ArrayPtr<const byte> bytes, size_t blockSize)
+      : bytes(bytes), blockSize(blockSize) {}
+
+  Promise<size_t> tryRead(void* buffer, size_t minBytes, size_t maxBytes) override {
+    size_t n = kj::min(bytes.size(), kj::max(minBytes, kj::min(blockSize, maxBytes)));
+    memcpy(buffer, bytes.begin(), n);
+    bytes = bytes.slice(n, bytes.size());
+    return n;
+  }
+
+private:
+  kj::ArrayPtr<const byte> bytes;
+  size_t blockSize;
+};
+
+class MockOutputStream: public AsyncOutputStream {
+public:
+  kj::Vector<byte> bytes;
+
+  Promise<void> write(const void* buffer, size_t size) override {
+    bytes.addAll(arrayPtr(reinterpret_cast<const byte*>(buffer), size));
+    return kj::READY_NOW;
+  }
+  Promise<void> write(ArrayPtr<const ArrayPtr<const byte>> pieces) override {
+    for (auto& piece: pieces) {
+      bytes.addAll(piece);
+    }
+    return kj::READY_NOW;
+  }
+};
+
+KJ_TEST("compressing stream adapters") {
+  auto io = setupAsyncIo();
+
+  // Long runs, so that one compressed byte pair decodes to much more than a small read wants.
+  kj::Vector<byte> text;
+  for (uint i = 0; i < 5000; i++) {
+    text.add("aaaaaaaaaabbbbbbbbbbbbbbbbbbbbcd"[i % 32]);
+  }
+
+  MockOutputStream rawOutput;
+  CompressingAsyncOutputStream out(rawOutput, heap<RleCompressor>());
+  out.write(text.begin(), 1000).wait(io.waitScope);
+  ArrayPtr<const byte> pieces[] = {
+    text.asPtr().slice(1000, 3000),
+    text.asPtr().slice(3000, 5000)
+  };
+  out.write(pieces).wait(io.waitScope);
+  out.end().wait(io.waitScope);
+
+  KJ_EXPECT(rawOutput.bytes.size() < text.size() / 2);
+  KJ_EXPECT(rawOutput.bytes.back() == 0);
+
+  for (size_t blockSize: {size_t(1), size_t(7), size_t(kj::maxValue)}) {
+    MockInputStream rawInput(rawOutput.bytes, blockSize);
+    DecompressingAsyncInputStream in(rawInput, heap<RleDecompressor>(), "rle");
+
+    kj::Vector<byte> result;
+    byte buffer[3];
+    for (;;) {
+      size_t n = in.tryRead(buffer, 1, sizeof(buffer)).wait(io.waitScope);
+      if (n == 0) break;
+      result.addAll(arrayPtr(buffer, n));
+    }
+    KJ_EXPECT(result.asPtr() == text.asPtr());
+  }
+}
+
+KJ_TEST("compressing stream adapters: flush, truncation, concatenation") {
+  auto io = setupAsyncIo();
+
+  MockOutputStream rawOutput;
+  {
+    CompressingAsyncOutputStream out(rawOutput, heap<RleCompressor>());
+    out.write("zzz", 3).wait(io.waitScope);
+    KJ_EXPECT(rawOutput.bytes.size() == 0);  // The last run is held back...
+    out.flush().wait(io.waitScope);
+    KJ_EXPECT(rawOutput.bytes.size() == 2);  // ...until flushed.
+  }
+
+  {
+    // Everything up to the flush is readable, but the stream hasn't ended.
+    MockInputStream rawInput(rawOutput.bytes, kj::maxValue);
+    DecompressingAsyncInputStream in(rawInput, heap<RleDecompressor>(), "rle");
+    char text[3];
+    KJ_EXPECT(in.tryRead(text, 3, 3).wait(io.waitScope) == 3);
+    KJ_EXPECT(heapString(text, 3) == "zzz");
+    KJ_EXPECT_THROW_MESSAGE("rle compressed stream ended prematurely",
+        in.tryRead(text, 1, 1).wait(io.waitScope));
+  }
+
+  // Two complete frames back to back decode as one stream.
+  rawOutput.bytes.clear();
+  for (auto part: {"foo", "bar"}) {
+    CompressingAsyncOutputStream out(rawOutput, heap<RleCompressor>());
+    out.write(part, 3).wait(io.waitScope);
+    out.end().wait(io.waitScope);
+  }
+  MockInputStream rawInput(rawOutput.bytes, kj::maxValue);
+  DecompressingAsyncInputStream in(rawInput, heap<RleDecompressor>(), "rle");
+  KJ_EXPECT(in.readAllText().wait(io.waitScope) == "foobar");
+}
+
+KJ_TEST("Compressor::compressAll") {
+  RleCompressor compressor;
+  auto input = kj::heapArray<byte>(100000);
+  memset(input.begin(), 'x', input.size());
+
+  auto output = compressor.compressAll(input, Compressor::Flush::FINISH);
+  KJ_EXPECT(output.size() == (100000 / 255 + 1) * 2 + 1);
+}
+
+}  // namespace
+}  // namespace kj
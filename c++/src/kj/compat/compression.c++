@@ -0,0 +1,152 @@
+// Copyright (c) 2017 Cloudflare, Inc. and contributors
+// Licensed under the MIT License:
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+#include "compression.h"
+#include <kj/debug.h>
+#include <kj/vector.h>
+
+namespace kj {
+
+Compressor::~Compressor() noexcept(false) {}
+Decompressor::~Decompressor() noexcept(false) {}
+
+Array<byte> Compressor::compressAll(ArrayPtr<const byte> input, Flush flush) {
+  Vector<byte> result;
+  result.resize(kj::max(input.size() / 2, size_t(256)));
+  size_t used = 0;
+
+  for (;;) {
+    ArrayPtr<byte> output = result.asPtr().slice(used, result.size());
+    bool done = compress(input, output, flush);
+    used = result.size() - output.size();
+    if (done) break;
+    result.resize(result.size() * 2);
+  }
+
+  result.resize(used);
+  return result.releaseAsArray();
+}
+
+// =======================================================================================
+
+DecompressingAsyncInputStream::DecompressingAsyncInputStream(
+    AsyncInputStream& inner, Own<Decompressor> decompressor, StringPtr formatName)
+    : inner(inner), decompressor(kj::mv(decompressor)), formatName(formatName) {}
+
+DecompressingAsyncInputStream::~DecompressingAsyncInputStream() noexcept(false) {}
+
+Promise<size_t> DecompressingAsyncInputStream::tryRead(
+    void* out, size_t minBytes, size_t maxBytes) {
+  if (maxBytes == 0) return size_t(0);
+
+  return readImpl(reinterpret_cast<byte*>(out), minBytes, maxBytes, 0);
+}
+
+Promise<size_t> DecompressingAsyncInputStream::readImpl(
+    byte* out, size_t minBytes, size_t maxBytes, size_t alreadyRead) {
+  if (pending.size() == 0 && !outputWasFull) {
+    return inner.tryRead(buffer, 1, sizeof(buffer))
+        .then([this,out,minBytes,maxBytes,alreadyRead](size_t amount) -> Promise<size_t> {
+      if (amount == 0) {
+        if (!atValidEndpoint) {
+          return KJ_EXCEPTION(DISCONNECTED,
+              kj::str(formatName, " compressed stream ended prematurely"));
+        }
+        return alreadyRead;
+      } else {
+        pending = arrayPtr(buffer, amount);
+        return readImpl(out, minBytes, maxBytes, alreadyRead);
+      }
+    });
+  }
+
+  // If the last call filled its output buffer, the decompressor may be holding more output even
+  // with no further input, so we call it again before reading more.
+  ArrayPtr<byte> output = arrayPtr(out, maxBytes);
+  size_t pendingBefore = pending.size();
+  bool atEndpoint = decompressor->decompress(pending, output);
+  outputWasFull = output.size() == 0;
+
+  size_t n = maxBytes - output.size();
+  if (n > 0 || pending.size() < pendingBefore) {
+    atValidEndpoint = atEndpoint;
+  }
+
+  if (n >= minBytes) {
+    return n + alreadyRead;
+  } else {
+    return readImpl(out + n, minBytes - n, maxBytes - n, alreadyRead + n);
+  }
+}
+
+// =======================================================================================
+
+CompressingAsyncOutputStream::CompressingAsyncOutputStream(
+    AsyncOutputStream& inner, Own<Compressor> compressor)
+    : inner(inner), compressor(kj::mv(compressor)) {}
+
+CompressingAsyncOutputStream::~CompressingAsyncOutputStream() noexcept(false) {}
+
+Promise<void> CompressingAsyncOutputStream::write(const void* in, size_t size) {
+  KJ_REQUIRE(!ended, "already ended");
+
+  return pump(arrayPtr(reinterpret_cast<const byte*>(in), size), Compressor::Flush::NONE);
+}
+
+Promise<void> CompressingAsyncOutputStream::write(ArrayPtr<const ArrayPtr<const byte>> pieces) {
+  KJ_REQUIRE(!ended, "already ended");
+
+  if (pieces.size() == 0) return kj::READY_NOW;
+  return write(pieces[0].begin(), pieces[0].size())
+      .then([this,pieces]() {
+    return write(pieces.slice(1, pieces.size()));
+  });
+}
+
+Promise<void> CompressingAsyncOutputStream::flush() {
+  KJ_REQUIRE(!ended, "already ended");
+
+  return pump(nullptr, Compressor::Flush::SYNC);
+}
+
+Promise<void> CompressingAsyncOutputStream::end() {
+  KJ_REQUIRE(!ended, "already ended");
+
+  ended = true;
+  return pump(nullptr, Compressor::Flush::FINISH);
+}
+
+Promise<void> CompressingAsyncOutputStream::pump(
+    ArrayPtr<const byte> input, Compressor::Flush flush) {
+  ArrayPtr<byte> output = buffer;
+  bool done = compressor->compress(input, output, flush);
+
+  size_t n = sizeof(buffer) - output.size();
+  if (done) {
+    if (n == 0) return kj::READY_NOW;
+    return inner.write(buffer, n);
+  } else {
+    return inner.write(buffer, n)
+        .then([this,input,flush]() { return pump(input, flush); });
+  }
+}
+
+}  // namespace kj
@@ -0,0 +1,153 @@
+// Copyright (c) 2017 Cloudflare, Inc. and contributors
+// Licensed under the MIT License:
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+#pragma once
+
+#include <kj/async-io.h>
+
+namespace kj {
+
+// =======================================================================================
+// Compression engines
+//
+// A compression format (gzip, zstd, ...) is implemented as a pair of synchronous, incremental
+// engines -- a Compressor and a Decompressor -- which transform bytes between caller-provided
+// buffers.  The async stream adapters below, and the HTTP library's content-coding support, are
+// written once in terms of these, so a new format only needs to implement the engines.
+
+class Compressor {
+  // Compresses one stream.
+
+public:
+  virtual ~Compressor() noexcept(false);
+
+  enum class Flush {
+    NONE,
+    // Compress as much input as possible, but keep whatever the format needs to buffer.
+
+    SYNC,
+    // Also emit everything buffered so far, such that a decompressor which has received all output
+    // can produce all input written so far.  Costs some compression ratio.
+
+    FINISH
+    // Also end the stream.  The compressor can't be used again afterwards.
+  };
+
+  virtual bool compress(ArrayPtr<const byte>& input, ArrayPtr<byte>& output, Flush flush) = 0;
+  // Consumes bytes from the front of `input` and writes compressed bytes to the front of
+  // `output`, advancing both past what was consumed and produced.  Returns true once all of
+  // `input` has been consumed and the requested flush is complete; returns false if it ran out of
+  // room in `output`, in which case the caller should make room and call again with the
+  // remaining input and the same `flush`.  Throws if the underlying library fails.
+
+  Array<byte> compressAll(ArrayPtr<const byte> input, Flush flush);
+  // Convenience wrapper which compresses all of `input` and returns everything produced, which
+  // may be empty.
+};
+
+class Decompressor {
+  // Decompresses one stream, which may consist of several concatenated frames.
+
+public:
+  virtual ~Decompressor() noexcept(false);
+
+  virtual bool decompress(ArrayPtr<const byte>& input, ArrayPtr<byte>& output) = 0;
+  // Consumes bytes from the front of `input` and writes decompressed bytes to the front of
+  // `output`, advancing both.  Stops when either runs out.  Returns true if the input consumed so
+  // far ends exactly at the end of a frame, i.e. it would be valid for the compressed stream to
+  // end here.  Throws if the input is corrupt.
+};
+
+class CompressionCodec {
+  // A compression format, able to make compressors and decompressors.  The same objects are used
+  // as HTTP content codings; see `HttpServerSettings::compressionCodecs`.
+  //
+  // Implementations typically pool their library contexts so that starting a stream is cheap, and
+  // are not thread-safe.  The codec must outlive every engine it returns.
+
+public:
+  virtual StringPtr getName() const = 0;
+  // The format's name as used in HTTP's Content-Encoding header, e.g. "gzip".
+
+  virtual Own<Compressor> newCompressor() = 0;
+  virtual Own<Decompressor> newDecompressor() = 0;
+};
+
+// =======================================================================================
+// Async stream adapters
+
+class DecompressingAsyncInputStream: public AsyncInputStream {
+  // Reads compressed data from `inner` and returns it decompressed.
+
+public:
+  DecompressingAsyncInputStream(AsyncInputStream& inner, Own<Decompressor> decompressor,
+                                StringPtr formatName);
+  // `formatName` is used in error messages.
+
+  ~DecompressingAsyncInputStream() noexcept(false);
+  KJ_DISALLOW_COPY(DecompressingAsyncInputStream);
+
+  Promise<size_t> tryRead(void* buffer, size_t minBytes, size_t maxBytes) override;
+
+private:
+  AsyncInputStream& inner;
+  Own<Decompressor> decompressor;
+  StringPtr formatName;
+  bool atValidEndpoint = false;
+  bool outputWasFull = false;
+
+  ArrayPtr<const byte> pending;
+  // Compressed bytes read from `inner` but not yet consumed; points into `buffer`.
+
+  byte buffer[4096];
+
+  Promise<size_t> readImpl(byte* buffer, size_t minBytes, size_t maxBytes, size_t alreadyRead);
+};
+
+class CompressingAsyncOutputStream: public AsyncOutputStream {
+  // Compresses everything written to it and writes the result to `inner`.
+
+public:
+  CompressingAsyncOutputStream(AsyncOutputStream& inner, Own<Compressor> compressor);
+  ~CompressingAsyncOutputStream() noexcept(false);
+  KJ_DISALLOW_COPY(CompressingAsyncOutputStream);
+
+  Promise<void> write(const void* buffer, size_t size) override;
+  Promise<void> write(ArrayPtr<const ArrayPtr<const byte>> pieces) override;
+
+  Promise<void> flush();
+  // Writes out everything written so far, so that the reader can decompress it without waiting
+  // for more.  Only needed for interactive streams; it costs some compression ratio.
+
+  Promise<void> end();
+  // Must call to finish the stream, since some data may be buffered.
+
+private:
+  AsyncOutputStream& inner;
+  Own<Compressor> compressor;
+  bool ended = false;
+
+  byte buffer[4096];
+
+  Promise<void> pump(ArrayPtr<const byte> input, Compressor::Flush flush);
+};
+
+}  // namespace kj
@@ -26,157 +26,250 @@
 
 namespace kj {
 
-GzipAsyncInputStream::GzipAsyncInputStream(AsyncInputStream& inner)
-    : inner(inner) {
-  memset(&ctx, 0, sizeof(ctx));
-  ctx.next_in = nullptr;
-  ctx.avail_in = 0;
-  ctx.next_out = nullptr;
-  ctx.avail_out = 0;
-
-  // windowBits = 15 (maximum) + magic value 16 to ask for gzip.
-  KJ_ASSERT(inflateInit2(&ctx, 15 + 16) == Z_OK);
-}
+namespace {
+
+// zlib's windowBits for gzip: 15 (maximum) + magic value 16 to ask for the gzip wrapper. Raw
+// DEFLATE is asked for with a negative value instead.
+constexpr int GZIP_WINDOW_BITS = 15 + 16;
 
-GzipAsyncInputStream::~GzipAsyncInputStream() noexcept(false) {
-  inflateEnd(&ctx);
+z_stream* newDeflater(int compressionLevel, int windowBits = GZIP_WINDOW_BITS) {
+  auto ctx = new z_stream;
+  memset(ctx, 0, sizeof(*ctx));
+
+  int initResult =
+      deflateInit2(ctx, compressionLevel, Z_DEFLATED,
+                   windowBits,
+                   8,        // memLevel = 8 (the default)
+                   Z_DEFAULT_STRATEGY);
+  if (initResult != Z_OK) {
+    delete ctx;
+    KJ_FAIL_ASSERT("deflateInit2() failed", initResult);
+  }
+  return ctx;
 }
 
-Promise<size_t> GzipAsyncInputStream::tryRead(void* out, size_t minBytes, size_t maxBytes) {
-  if (maxBytes == 0) return size_t(0);
+z_stream* newInflater(int windowBits = GZIP_WINDOW_BITS) {
+  auto ctx = new z_stream;
+  memset(ctx, 0, sizeof(*ctx));
 
-  return readImpl(reinterpret_cast<byte*>(out), minBytes, maxBytes, 0);
+  int initResult = inflateInit2(ctx, windowBits);
+  if (initResult != Z_OK) {
+    delete ctx;
+    KJ_FAIL_ASSERT("inflateInit2() failed", initResult);
+  }
+  return ctx;
 }
 
-Promise<size_t> GzipAsyncInputStream::readImpl(
-    byte* out, size_t minBytes, size_t maxBytes, size_t alreadyRead) {
-  if (ctx.avail_in == 0) {
-    return inner.tryRead(buffer, 1, sizeof(buffer))
-        .then([this,out,minBytes,maxBytes,alreadyRead](size_t amount) -> Promise<size_t> {
-      if (amount == 0) {
-        if (!atValidEndpoint) {
-          return KJ_EXCEPTION(DISCONNECTED, "gzip compressed stream ended prematurely");
-        }
-        return alreadyRead;
+// zlib counts in uInt, so feed it at most this much at a time.
+constexpr size_t MAX_ZLIB_CHUNK = 1u << 30;
+
+class GzipCompressor final: public Compressor {
+public:
+  GzipCompressor(z_stream* ctx, Vector<z_stream*>* pool, uint maxIdle)
+      : ctx(ctx), pool(pool), maxIdle(maxIdle) {}
+  KJ_DISALLOW_COPY(GzipCompressor);
+
+  ~GzipCompressor() noexcept(false) {
+    if (pool != nullptr && pool->size() < maxIdle && deflateReset(ctx) == Z_OK) {
+      pool->add(ctx);
+    } else {
+      deflateEnd(ctx);
+      delete ctx;
+    }
+  }
+
+  bool compress(ArrayPtr<const byte>& input, ArrayPtr<byte>& output, Flush flush) override {
+    size_t inSize = kj::min(input.size(), MAX_ZLIB_CHUNK);
+    size_t outSize = kj::min(output.size(), MAX_ZLIB_CHUNK);
+    ctx->next_in = const_cast<byte*>(input.begin());
+    ctx->avail_in = inSize;
+    ctx->next_out = output.begin();
+    ctx->avail_out = outSize;
+
+    bool lastChunk = inSize == input.size();
+    int mode = !lastChunk || flush == Flush::NONE ? Z_NO_FLUSH
+             : flush == Flush::SYNC ? Z_SYNC_FLUSH : Z_FINISH;
+    auto deflateResult = deflate(ctx, mode);
+
+    input = input.slice(inSize - ctx->avail_in, input.size());
+    output = output.slice(outSize - ctx->avail_out, output.size());
+
+    if (deflateResult != Z_OK && deflateResult != Z_STREAM_END &&
+        deflateResult != Z_BUF_ERROR) {  // Z_BUF_ERROR just means no progress was possible.
+      if (ctx->msg == nullptr) {
+        KJ_FAIL_REQUIRE("gzip compression failed", deflateResult);
       } else {
-        ctx.next_in = buffer;
-        ctx.avail_in = amount;
-        return readImpl(out, minBytes, maxBytes, alreadyRead);
+        KJ_FAIL_REQUIRE("gzip compression failed", ctx->msg);
       }
-    });
+    }
+
+    switch (mode) {
+      case Z_NO_FLUSH:
+        return input.size() == 0 && flush == Flush::NONE;
+      case Z_SYNC_FLUSH:
+        return input.size() == 0 && ctx->avail_out > 0;
+      default:
+        return deflateResult == Z_STREAM_END;
+    }
   }
 
-  ctx.next_out = reinterpret_cast<byte*>(out);
-  ctx.avail_out = maxBytes;
+private:
+  z_stream* ctx;
+  Vector<z_stream*>* pool;
+  uint maxIdle;
+};
 
-  auto inflateResult = inflate(&ctx, Z_NO_FLUSH);
-  atValidEndpoint = inflateResult == Z_STREAM_END;
-  if (inflateResult == Z_OK || inflateResult == Z_STREAM_END) {
-    if (atValidEndpoint && ctx.avail_in > 0) {
-      // There's more data available. Assume start of new content.
-      KJ_ASSERT(inflateReset(&ctx) == Z_OK);
-    }
+class GzipDecompressor final: public Decompressor {
+public:
+  GzipDecompressor(z_stream* ctx, Vector<z_stream*>* pool, uint maxIdle)
+      : ctx(ctx), pool(pool), maxIdle(maxIdle) {}
+  KJ_DISALLOW_COPY(GzipDecompressor);
 
-    size_t n = maxBytes - ctx.avail_out;
-    if (n >= minBytes) {
-      return n + alreadyRead;
+  ~GzipDecompressor() noexcept(false) {
+    if (pool != nullptr && pool->size() < maxIdle && inflateReset(ctx) == Z_OK) {
+      pool->add(ctx);
     } else {
-      return readImpl(out + n, minBytes - n, maxBytes - n, alreadyRead + n);
+      inflateEnd(ctx);
+      delete ctx;
     }
-  } else {
-    if (ctx.msg == nullptr) {
-      KJ_FAIL_REQUIRE("gzip decompression failed", inflateResult);
-    } else {
-      KJ_FAIL_REQUIRE("gzip decompression failed", ctx.msg);
+  }
+
+  bool decompress(ArrayPtr<const byte>& input, ArrayPtr<byte>& output) override {
+    for (;;) {
+      size_t inSize = kj::min(input.size(), MAX_ZLIB_CHUNK);
+      size_t outSize = kj::min(output.size(), MAX_ZLIB_CHUNK);
+      ctx->next_in = const_cast<byte*>(input.begin());
+      ctx->avail_in = inSize;
+      ctx->next_out = output.begin();
+      ctx->avail_out = outSize;
+
+      auto inflateResult = inflate(ctx, Z_NO_FLUSH);
+
+      input = input.slice(inSize - ctx->avail_in, input.size());
+      output = output.slice(outSize - ctx->avail_out, output.size());
+
+      if (inflateResult == Z_STREAM_END) {
+        if (input.size() > 0) {
+          // There's more data available. Assume start of new content.
+          KJ_ASSERT(inflateReset(ctx) == Z_OK);
+          if (output.size() > 0) continue;
+        }
+        return true;
+      } else if (inflateResult == Z_OK || inflateResult == Z_BUF_ERROR) {
+        if (input.size() > 0 && output.size() > 0) continue;  // more than MAX_ZLIB_CHUNK
+        return false;
+      } else {
+        if (ctx->msg == nullptr) {
+          KJ_FAIL_REQUIRE("gzip decompression failed", inflateResult);
+        } else {
+          KJ_FAIL_REQUIRE("gzip decompression failed", ctx->msg);
+        }
+      }
     }
   }
+
+private:
+  z_stream* ctx;
+  Vector<z_stream*>* pool;
+  uint maxIdle;
+};
+
+template <typename Create>
+z_stream* takeContext(Vector<z_stream*>& pool, GzipCodec::Stats& stats, Create&& create) {
+  if (pool.empty()) {
+    ++stats.contextsCreated;
+    return create();
+  } else {
+    auto ctx = pool.back();
+    pool.removeLast();
+    ++stats.contextsReused;
+    return ctx;
+  }
 }
 
-// =======================================================================================
+void freeContexts(Vector<z_stream*>& deflaters, Vector<z_stream*>& inflaters) {
+  for (auto ctx: deflaters) {
+    deflateEnd(ctx);
+    delete ctx;
+  }
+  for (auto ctx: inflaters) {
+    inflateEnd(ctx);
+    delete ctx;
+  }
+}
 
-GzipAsyncOutputStream::GzipAsyncOutputStream(AsyncOutputStream& inner, int compressionLevel)
-    : inner(inner) {
-  memset(&ctx, 0, sizeof(ctx));
-  ctx.next_in = nullptr;
-  ctx.avail_in = 0;
-  ctx.next_out = nullptr;
-  ctx.avail_out = 0;
+}  // namespace
 
-  int initResult =
-      deflateInit2(&ctx, compressionLevel, Z_DEFLATED,
-                   15 + 16,  // windowBits = 15 (maximum) + magic value 16 to ask for gzip.
-                   8,        // memLevel = 8 (the default)
-                   Z_DEFAULT_STRATEGY);
-  KJ_ASSERT(initResult == Z_OK, initResult);
+GzipCodec::GzipCodec(int compressionLevel, uint maxIdleContexts)
+    : compressionLevel(compressionLevel), maxIdleContexts(maxIdleContexts) {}
+
+GzipCodec::~GzipCodec() noexcept(false) {
+  freeContexts(idleDeflaters, idleInflaters);
 }
 
-GzipAsyncOutputStream::~GzipAsyncOutputStream() noexcept(false) {
-  deflateEnd(&ctx);
+StringPtr GzipCodec::getName() const {
+  return "gzip";
 }
 
-Promise<void> GzipAsyncOutputStream::write(const void* in, size_t size) {
-  ctx.next_in = const_cast<byte*>(reinterpret_cast<const byte*>(in));
-  ctx.avail_in = size;
-  return pump();
+Own<Compressor> GzipCodec::newCompressor() {
+  auto ctx = takeContext(idleDeflaters, stats, [&]() { return newDeflater(compressionLevel); });
+  return kj::heap<GzipCompressor>(ctx, &idleDeflaters, maxIdleContexts);
 }
 
-Promise<void> GzipAsyncOutputStream::write(ArrayPtr<const ArrayPtr<const byte>> pieces) {
-  KJ_REQUIRE(!ended, "already ended");
+Own<Decompressor> GzipCodec::newDecompressor() {
+  auto ctx = takeContext(idleInflaters, stats, [&]() { return newInflater(); });
+  return kj::heap<GzipDecompressor>(ctx, &idleInflaters, maxIdleContexts);
+}
 
-  if (pieces.size() == 0) return kj::READY_NOW;
-  return write(pieces[0].begin(), pieces[0].size())
-      .then([this,pieces]() {
-    return write(pieces.slice(1, pieces.size()));
-  });
+DeflateCodec::DeflateCodec(int compressionLevel, int windowBits, uint maxIdleContexts)
+    : compressionLevel(compressionLevel), windowBits(windowBits),
+      maxIdleContexts(maxIdleContexts) {
+  // zlib can't produce raw DEFLATE with an 8-bit window.
+  KJ_REQUIRE(windowBits >= 9 && windowBits <= 15, "invalid DEFLATE window size", windowBits);
 }
 
-Promise<void> GzipAsyncOutputStream::end() {
-  KJ_REQUIRE(!ended, "already ended");
+DeflateCodec::~DeflateCodec() noexcept(false) {
+  freeContexts(idleDeflaters, idleInflaters);
+}
 
-  ctx.next_out = buffer;
-  ctx.avail_out = sizeof(buffer);
+StringPtr DeflateCodec::getName() const {
+  return "deflate-raw";
+}
 
-  auto deflateResult = deflate(&ctx, Z_FINISH);
-  if (deflateResult == Z_OK || deflateResult == Z_STREAM_END) {
-    size_t n = sizeof(buffer) - ctx.avail_out;
-    auto promise = inner.write(buffer, n);
-    if (deflateResult == Z_OK) {
-      return promise.then([this]() { return end(); });
-    } else {
-      ended = true;
-      return promise;
-    }
-  } else {
-    if (ctx.msg == nullptr) {
-      KJ_FAIL_REQUIRE("gzip compression failed", deflateResult);
-    } else {
-      KJ_FAIL_REQUIRE("gzip compression failed", ctx.msg);
-    }
-  }
+Own<Compressor> DeflateCodec::newCompressor() {
+  auto ctx = takeContext(idleDeflaters, stats, [&]() {
+    return newDeflater(compressionLevel, -windowBits);
+  });
+  return kj::heap<GzipCompressor>(ctx, &idleDeflaters, maxIdleContexts);
 }
 
-kj::Promise<void> GzipAsyncOutputStream::pump() {
-  if (ctx.avail_in == 0) {
-    return kj::READY_NOW;
-  }
+Own<Decompressor> DeflateCodec::newDecompressor() {
+  auto ctx = takeContext(idleInflaters, stats, [&]() { return newInflater(-windowBits); });
+  return kj::heap<GzipDecompressor>(ctx, &idleInflaters, maxIdleContexts);
+}
 
-  ctx.next_out = buffer;
-  ctx.avail_out = sizeof(buffer);
+Own<Compressor> newGzipCompressor(int compressionLevel) {
+  return kj::heap<GzipCompressor>(newDeflater(compressionLevel), nullptr, 0);
+}
 
-  auto deflateResult = deflate(&ctx, Z_NO_FLUSH);
-  if (deflateResult == Z_OK) {
-    size_t n = sizeof(buffer) - ctx.avail_out;
-    return inner.write(buffer, n)
-        .then([this]() { return pump(); });
-  } else {
-    if (ctx.msg == nullptr) {
-      KJ_FAIL_REQUIRE("gzip compression failed", deflateResult);
-    } else {
-      KJ_FAIL_REQUIRE("gzip compression failed", ctx.msg);
-    }
-  }
+Own<Decompressor> newGzipDecompressor() {
+  return kj::heap<GzipDecompressor>(newInflater(), nullptr, 0);
 }
 
+// =======================================================================================
+
+GzipAsyncInputStream::GzipAsyncInputStream(AsyncInputStream& inner)
+    : DecompressingAsyncInputStream(inner, newGzipDecompressor(), "gzip") {}
+
+GzipAsyncInputStream::GzipAsyncInputStream(AsyncInputStream& inner, GzipCodec& codec)
+    : DecompressingAsyncInputStream(inner, codec.newDecompressor(), "gzip") {}
+
+GzipAsyncOutputStream::GzipAsyncOutputStream(AsyncOutputStream& inner, int compressionLevel)
+    : CompressingAsyncOutputStream(inner, newGzipCompressor(compressionLevel)) {}
+
+GzipAsyncOutputStream::GzipAsyncOutputStream(AsyncOutputStream& inner, GzipCodec& codec)
+    : CompressingAsyncOutputStream(inner, codec.newCompressor()) {}
+
 }  // namespace kj
 
 #endif  // KJ_HAS_ZLIB
@@ -21,51 +21,90 @@
 
 #pragma once
 
-#include <kj/async-io.h>
+#include "compression.h"
+#include <kj/vector.h>
 #include <zlib.h>
 
 namespace kj {
 
-class GzipAsyncInputStream final: public AsyncInputStream {
-public:
-  GzipAsyncInputStream(AsyncInputStream& inner);
-  ~GzipAsyncInputStream() noexcept(false);
-  KJ_DISALLOW_COPY(GzipAsyncInputStream);
+class GzipCodec final: public CompressionCodec {
+  // The gzip format, via zlib.
+  //
+  // Setting up a zlib context costs far more than compressing a typical HTTP body: deflate
+  // allocates and initializes a few hundred kilobytes of window and hash tables.  So rather than
+  // tearing contexts down when a stream finishes, the codec keeps up to `maxIdleContexts` of each
+  // kind and resets one for the next stream.  Not thread-safe.
 
-  Promise<size_t> tryRead(void* buffer, size_t minBytes, size_t maxBytes) override;
+public:
+  explicit GzipCodec(int compressionLevel = Z_DEFAULT_COMPRESSION, uint maxIdleContexts = 8);
+  ~GzipCodec() noexcept(false);
+  KJ_DISALLOW_COPY(GzipCodec);
 
-private:
-  AsyncInputStream& inner;
-  z_stream ctx;
-  bool atValidEndpoint = false;
+  StringPtr getName() const override;
+  Own<Compressor> newCompressor() override;
+  Own<Decompressor> newDecompressor() override;
 
-  byte buffer[4096];
+  struct Stats {
+    uint64_t contextsCreated;
+    uint64_t contextsReused;
+  };
+  Stats getStats() const { return stats; }
 
-  Promise<size_t> readImpl(byte* buffer, size_t minBytes, size_t maxBytes, size_t alreadyRead);
+private:
+  int compressionLevel;
+  uint maxIdleContexts;
+  Vector<z_stream*> idleDeflaters;
+  Vector<z_stream*> idleInflaters;
+  Stats stats = { 0, 0 };
 };
 
-class GzipAsyncOutputStream final: public AsyncOutputStream {
+class DeflateCodec final: public CompressionCodec {
+  // Raw DEFLATE (RFC 1951), without the gzip or zlib wrapper, as used by WebSocket's
+  // permessage-deflate extension (see kj::WebSocketCompressionSettings in kj/compat/http.h).
+  // Not an HTTP content coding: HTTP's "deflate" is zlib-wrapped. Pools contexts like GzipCodec.
+
 public:
-  GzipAsyncOutputStream(AsyncOutputStream& inner, int compressionLevel = Z_DEFAULT_COMPRESSION);
-  ~GzipAsyncOutputStream() noexcept(false);
-  KJ_DISALLOW_COPY(GzipAsyncOutputStream);
+  explicit DeflateCodec(int compressionLevel = Z_DEFAULT_COMPRESSION, int windowBits = 15,
+                        uint maxIdleContexts = 8);
+  // `windowBits` is the base-two logarithm of the LZ77 window, 9 to 15. Compressors use that
+  // window; decompressors accept anything up to it.
+  ~DeflateCodec() noexcept(false);
+  KJ_DISALLOW_COPY(DeflateCodec);
 
-  Promise<void> write(const void* buffer, size_t size) override;
-  Promise<void> write(ArrayPtr<const ArrayPtr<const byte>> pieces) override;
+  StringPtr getName() const override;
+  Own<Compressor> newCompressor() override;
+  Own<Decompressor> newDecompressor() override;
 
-  Promise<void> end();
-  // Must call to flush the stream, since some data may be buffered.
-  //
-  // TODO(cleanup): This should be a virtual method on AsyncOutputStream.
+  int getWindowBits() const { return windowBits; }
+
+  typedef GzipCodec::Stats Stats;
+  Stats getStats() const { return stats; }
 
 private:
-  AsyncOutputStream& inner;
-  bool ended = false;
-  z_stream ctx;
+  int compressionLevel;
+  int windowBits;
+  uint maxIdleContexts;
+  Vector<z_stream*> idleDeflaters;
+  Vector<z_stream*> idleInflaters;
+  Stats stats = { 0, 0 };
+};
 
-  byte buffer[4096];
+Own<Compressor> newGzipCompressor(int compressionLevel = Z_DEFAULT_COMPRESSION);
+Own<Decompressor> newGzipDecompressor();
+// Engines with their own, unpooled, context.
+
+class GzipAsyncInputStream final: public DecompressingAsyncInputStream {
+public:
+  GzipAsyncInputStream(AsyncInputStream& inner);
+  GzipAsyncInputStream(AsyncInputStream& inner, GzipCodec& codec);
+  // The second form takes its zlib context from `codec`'s pool, and returns it there when done.
+};
 
-  kj::Promise<void> pump();
+class GzipAsyncOutputStream final: public CompressingAsyncOutputStream {
+public:
+  GzipAsyncOutputStream(AsyncOutputStream& inner, int compressionLevel = Z_DEFAULT_COMPRESSION);
+  GzipAsyncOutputStream(AsyncOutputStream& inner, GzipCodec& codec);
+  // The second form uses `codec`'s compression level and context pool.
 };
 
 }  // namespace kj
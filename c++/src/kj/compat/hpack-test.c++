@@ -0,0 +1,207 @@
+// Copyright (c) 2017 Cloudflare, Inc. and contributors
+// Licensed under the MIT License:
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+#include "hpack.h"
+#include <kj/debug.h>
+#include <kj/encoding.h>
+#include <kj/test.h>
+
+namespace kj {
+namespace {
+
+Array<byte> hex(StringPtr text) {
+  // Decodes hex, ignoring spaces, as the RFC's examples are formatted.
+  Vector<char> digits;
+  for (char c: text) {
+    if (c != ' ') digits.add(c);
+  }
+  auto result = decodeHex(digits);
+  KJ_ASSERT(!result.hadErrors, text);
+  return kj::mv(result);
+}
+
+String render(ArrayPtr<const HpackDecoder::Header> headers) {
+  return strArray(KJ_MAP(h, headers) { return str(h.name, ": ", h.value); }, "\n");
+}
+
+KJ_TEST("HPACK request examples without Huffman coding (RFC 7541 C.3)") {
+  HpackDecoder decoder;
+
+  KJ_EXPECT(render(decoder.decode(hex(
+      "8286 8441 0f77 7777 2e65 7861 6d70 6c65 2e63 6f6d"))) ==
+      ":method: GET\n:scheme: http\n:path: /\n:authority: www.example.com");
+  KJ_EXPECT(decoder.getTableSize() == 57);
+
+  KJ_EXPECT(render(decoder.decode(hex(
+      "8286 84be 5808 6e6f 2d63 6163 6865"))) ==
+      ":method: GET\n:scheme: http\n:path: /\n:authority: www.example.com\n"
+      "cache-control: no-cache");
+  KJ_EXPECT(decoder.getTableSize() == 110);
+
+  KJ_EXPECT(render(decoder.decode(hex(
+      "8287 85bf 400a 6375 7374 6f6d 2d6b 6579 0c63 7573 746f 6d2d 7661 6c75 65"))) ==
+      ":method: GET\n:scheme: https\n:path: /index.html\n:authority: www.example.com\n"
+      "custom-key: custom-value");
+  KJ_EXPECT(decoder.getTableSize() == 164);
+}
+
+KJ_TEST("HPACK request examples with Huffman coding (RFC 7541 C.4)") {
+  HpackDecoder decoder;
+
+  KJ_EXPECT(render(decoder.decode(hex(
+      "8286 8441 8cf1 e3c2 e5f2 3a6b a0ab 90f4 ff"))) ==
+      ":method: GET\n:scheme: http\n:path: /\n:authority: www.example.com");
+  KJ_EXPECT(decoder.getTableSize() == 57);
+
+  KJ_EXPECT(render(decoder.decode(hex(
+      "8286 84be 5886 a8eb 1064 9cbf"))) ==
+      ":method: GET\n:scheme: http\n:path: /\n:authority: www.example.com\n"
+      "cache-control: no-cache");
+  KJ_EXPECT(decoder.getTableSize() == 110);
+
+  KJ_EXPECT(render(decoder.decode(hex(
+      "8287 85bf 4088 25a8 49e9 5ba9 7d7f 8925 a849 e95b b8e8 b4bf"))) ==
+      ":method: GET\n:scheme: https\n:path: /index.html\n:authority: www.example.com\n"
+      "custom-key: custom-value");
+  KJ_EXPECT(decoder.getTableSize() == 164);
+}
+
+KJ_TEST("HPACK response examples with eviction (RFC 7541 C.5)") {
+  HpackDecoder decoder(256);
+
+  KJ_EXPECT(render(decoder.decode(hex(
+      "4803 3330 3258 0770 7269 7661 7465 611d 4d6f 6e2c 2032 3120 4f63 7420 3230 3133 "
+      "2032 303a 3133 3a32 3120 474d 546e 1768 7474 7073 3a2f 2f77 7777 2e65 7861 6d70 "
+      "6c65 2e63 6f6d"))) ==
+      ":status: 302\ncache-control: private\ndate: Mon, 21 Oct 2013 20:13:21 GMT\n"
+      "location: https://www.example.com");
+  KJ_EXPECT(decoder.getTableSize() == 222);
+
+  // Adding ":status: 307" evicts ":status: 302".
+  KJ_EXPECT(render(decoder.decode(hex("4803 3330 37c1 c0bf"))) ==
+      ":status: 307\ncache-control: private\ndate: Mon, 21 Oct 2013 20:13:21 GMT\n"
+      "location: https://www.example.com");
+  KJ_EXPECT(decoder.getTableSize() == 222);
+}
+
+KJ_TEST("HPACK decoder rejects malformed blocks") {
+  {
+    HpackDecoder decoder;
+    KJ_EXPECT_THROW_MESSAGE("invalid HPACK index", decoder.decode(hex("80")));
+  }
+  {
+    HpackDecoder decoder;
+    KJ_EXPECT_THROW_MESSAGE("invalid HPACK index", decoder.decode(hex("be")));
+  }
+  {
+    HpackDecoder decoder;
+    KJ_EXPECT_THROW_MESSAGE("truncated HPACK block", decoder.decode(hex("4108 6e6f")));
+  }
+  {
+    // Padding longer than seven bits.
+    HpackDecoder decoder;
+    KJ_EXPECT_THROW_MESSAGE("invalid HPACK Huffman padding", decoder.decode(hex("0082 0fff 00")));
+  }
+  {
+    HpackDecoder decoder(100);
+    KJ_EXPECT_THROW_MESSAGE("exceeds limit", decoder.decode(hex("3f66")));
+  }
+  {
+    HpackDecoder decoder;
+    KJ_EXPECT_THROW_MESSAGE("header list too large", decoder.decode(hex("8286 84"), 64));
+  }
+}
+
+KJ_TEST("HPACK encoder round trip") {
+  HpackEncoder encoder;
+  HpackDecoder decoder;
+
+  auto check = [&](ArrayPtr<const StringPtr> fields) {
+    Vector<byte> block;
+    encoder.beginBlock(block);
+    for (size_t i = 0; i < fields.size(); i += 2) {
+      encoder.add(block, fields[i], fields[i + 1]);
+    }
+    auto headers = decoder.decode(block);
+    KJ_ASSERT(headers.size() * 2 == fields.size());
+    for (auto i: kj::indices(headers)) {
+      KJ_EXPECT(headers[i].name == fields[i * 2]);
+      KJ_EXPECT(headers[i].value == fields[i * 2 + 1]);
+    }
+    KJ_EXPECT(encoder.getTableSize() == decoder.getTableSize());
+    return block.size();
+  };
+
+  StringPtr first[] = {
+    ":method", "GET", ":scheme", "https", ":path", "/index.html",
+    ":authority", "www.example.com", "custom-key", "custom-value",
+    "authorization", "secret", "user-agent", "\x01\xff binary \x7f",
+  };
+  size_t firstSize = check(first);
+
+  // Everything but the path and the credentials is now in the dynamic table.
+  StringPtr second[] = {
+    ":method", "GET", ":scheme", "https", ":path", "/other.html",
+    ":authority", "www.example.com", "custom-key", "custom-value",
+    "authorization", "secret", "user-agent", "\x01\xff binary \x7f",
+  };
+  KJ_EXPECT(check(second) < firstSize / 2);
+
+  // Shrinking the table evicts entries; the decoder follows via the size update.
+  encoder.setMaxTableSize(64);
+  decoder.setMaxTableSize(64);
+  check(second);
+  KJ_EXPECT(encoder.getTableSize() <= 64);
+
+  // Growing it back lets entries be indexed again.
+  encoder.setMaxTableSize(4096);
+  decoder.setMaxTableSize(4096);
+  check(first);
+  KJ_EXPECT(check(second) < firstSize / 2);
+}
+
+KJ_TEST("HPACK dynamic table churn") {
+  // Enough insertions and evictions that the tables' ring buffers wrap around and grow, with
+  // each block referring back to entries added by earlier ones.
+  HpackEncoder encoder(512);
+  HpackDecoder decoder(512);
+
+  for (uint i = 0; i < 300; i++) {
+    auto newName = kj::str("x-header-", i % 41);
+    auto newValue = kj::str("value-", i);
+    auto oldName = kj::str("x-header-", (i + 40) % 41);
+    auto oldValue = kj::str("value-", i == 0 ? 0 : i - 1);
+
+    Vector<byte> block;
+    encoder.beginBlock(block);
+    encoder.add(block, newName, newValue);
+    encoder.add(block, oldName, oldValue);
+    auto headers = decoder.decode(block);
+    KJ_ASSERT(headers.size() == 2);
+    KJ_EXPECT(headers[0].name == newName && headers[0].value == newValue);
+    KJ_EXPECT(headers[1].name == oldName && headers[1].value == oldValue);
+    KJ_EXPECT(encoder.getTableSize() == decoder.getTableSize());
+    KJ_EXPECT(encoder.getTableSize() <= 512);
+  }
+}
+
+}  // namespace
+}  // namespace kj
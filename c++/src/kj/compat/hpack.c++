@@ -0,0 +1,546 @@
+// Copyright (c) 2017 Sandstorm Development Group, Inc. and contributors
+// Licensed under the MIT License:
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+
+#include "hpack.h"
+#include <kj/debug.h>
+#include <string.h>
+
+namespace kj {
+
+namespace {
+
+// =======================================================================================
+// Static table (RFC 7541 appendix A)
+
+struct StaticEntry {
+  StringPtr name;
+  StringPtr value;
+};
+
+const StaticEntry STATIC_TABLE[] = {
+  { ":authority", "" },
+  { ":method", "GET" },
+  { ":method", "POST" },
+  { ":path", "/" },
+  { ":path", "/index.html" },
+  { ":scheme", "http" },
+  { ":scheme", "https" },
+  { ":status", "200" },
+  { ":status", "204" },
+  { ":status", "206" },
+  { ":status", "304" },
+  { ":status", "400" },
+  { ":status", "404" },
+  { ":status", "500" },
+  { "accept-charset", "" },
+  { "accept-encoding", "gzip, deflate" },
+  { "accept-language", "" },
+  { "accept-ranges", "" },
+  { "accept", "" },
+  { "access-control-allow-origin", "" },
+  { "age", "" },
+  { "allow", "" },
+  { "authorization", "" },
+  { "cache-control", "" },
+  { "content-disposition", "" },
+  { "content-encoding", "" },
+  { "content-language", "" },
+  { "content-length", "" },
+  { "content-location", "" },
+  { "content-range", "" },
+  { "content-type", "" },
+  { "cookie", "" },
+  { "date", "" },
+  { "etag", "" },
+  { "expect", "" },
+  { "expires", "" },
+  { "from", "" },
+  { "host", "" },
+  { "if-match", "" },
+  { "if-modified-since", "" },
+  { "if-none-match", "" },
+  { "if-range", "" },
+  { "if-unmodified-since", "" },
+  { "last-modified", "" },
+  { "link", "" },
+  { "location", "" },
+  { "max-forwards", "" },
+  { "proxy-authenticate", "" },
+  { "proxy-authorization", "" },
+  { "range", "" },
+  { "referer", "" },
+  { "refresh", "" },
+  { "retry-after", "" },
+  { "server", "" },
+  { "set-cookie", "" },
+  { "strict-transport-security", "" },
+  { "transfer-encoding", "" },
+  { "user-agent", "" },
+  { "vary", "" },
+  { "via", "" },
+  { "www-authenticate", "" },
+};
+
+constexpr uint64_t STATIC_TABLE_SIZE = kj::size(STATIC_TABLE);
+constexpr size_t ENTRY_OVERHEAD = 32;
+// Per RFC 7541 section 4.1, an entry's size is its name and value lengths plus 32.
+
+typedef HashMap<String, uint64_t, _::HpackKeyCallbacks> FieldMap;
+// Keyed by "name\0value" or by name alone.
+
+ArrayPtr<const char> fieldKey(Vector<char>& scratch, StringPtr name, StringPtr value) {
+  scratch.clear();
+  scratch.addAll(name);
+  scratch.add('\0');
+  scratch.addAll(value);
+  return scratch.asPtr();
+}
+
+struct StaticIndex {
+  FieldMap byNameValue;
+  FieldMap byName;
+  // Map to the lowest static index with that name/value or name.
+
+  StaticIndex() {
+    for (uint64_t i = STATIC_TABLE_SIZE; i > 0; i--) {
+      auto& entry = STATIC_TABLE[i - 1];
+      byName.upsert(heapString(entry.name), i);
+      if (entry.value.size() > 0) {
+        byNameValue.upsert(str(entry.name, '\0', entry.value), i);
+      }
+    }
+  }
+};
+
+const StaticIndex& getStaticIndex() {
+  static const StaticIndex index;
+  return index;
+}
+
+// =======================================================================================
+// Huffman code (RFC 7541 appendix B)
+//
+// The code is canonical, so the code lengths alone determine it.
+
+const uint8_t HUFFMAN_LENGTHS[257] = {
+  13, 23, 28, 28, 28, 28, 28, 28, 28, 24, 30, 28, 28, 30, 28, 28,
+  28, 28, 28, 28, 28, 28, 30, 28, 28, 28, 28, 28, 28, 28, 28, 28,
+  6, 10, 10, 12, 13, 6, 8, 11, 10, 10, 8, 11, 8, 6, 6, 6,
+  5, 5, 5, 6, 6, 6, 6, 6, 6, 6, 7, 8, 15, 6, 12, 10,
+  13, 6, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7,
+  7, 7, 7, 7, 7, 7, 7, 7, 8, 7, 8, 13, 19, 13, 14, 6,
+  15, 5, 6, 5, 6, 5, 6, 6, 6, 5, 7, 7, 6, 6, 6, 5,
+  6, 7, 6, 5, 5, 6, 7, 7, 7, 7, 7, 15, 11, 14, 13, 28,
+  20, 22, 20, 20, 22, 22, 22, 23, 22, 23, 23, 23, 23, 23, 24, 23,
+  24, 24, 22, 23, 24, 23, 23, 23, 23, 21, 22, 23, 22, 23, 23, 24,
+  22, 21, 20, 22, 22, 23, 23, 21, 23, 22, 22, 24, 21, 22, 23, 23,
+  21, 21, 22, 21, 23, 22, 23, 23, 20, 22, 22, 22, 23, 22, 22, 23,
+  26, 26, 20, 19, 22, 23, 22, 25, 26, 26, 26, 27, 27, 26, 24, 25,
+  19, 21, 26, 27, 27, 26, 27, 24, 21, 21, 26, 26, 28, 27, 27, 27,
+  20, 24, 20, 21, 22, 21, 21, 23, 22, 22, 25, 25, 24, 24, 26, 23,
+  26, 27, 26, 26, 27, 27, 27, 27, 27, 28, 27, 27, 27, 27, 27, 26,
+  30,
+};
+
+constexpr uint HUFFMAN_EOS = 256;
+constexpr uint HUFFMAN_MAX_LENGTH = 30;
+
+struct HuffmanTables {
+  uint32_t codes[257];
+
+  uint32_t firstCode[HUFFMAN_MAX_LENGTH + 1];
+  uint16_t count[HUFFMAN_MAX_LENGTH + 1];
+  uint16_t offset[HUFFMAN_MAX_LENGTH + 1];
+  uint16_t symbols[257];
+  // For each code length: the first code of that length, how many there are, and where their
+  // symbols start in `symbols`, which is sorted by code.
+
+  HuffmanTables() {
+    memset(count, 0, sizeof(count));
+    for (auto length: HUFFMAN_LENGTHS) {
+      ++count[length];
+    }
+
+    uint32_t code = 0;
+    uint16_t position = 0;
+    uint16_t next[HUFFMAN_MAX_LENGTH + 1];
+    for (uint length = 0; length <= HUFFMAN_MAX_LENGTH; length++) {
+      firstCode[length] = code;
+      offset[length] = next[length] = position;
+      position += count[length];
+      code = (code + count[length]) << 1;
+    }
+
+    for (uint symbol = 0; symbol < kj::size(HUFFMAN_LENGTHS); symbol++) {
+      uint length = HUFFMAN_LENGTHS[symbol];
+      codes[symbol] = firstCode[length] + (next[length] - offset[length]);
+      symbols[next[length]++] = symbol;
+    }
+  }
+};
+
+const HuffmanTables& getHuffmanTables() {
+  static const HuffmanTables tables;
+  return tables;
+}
+
+String huffmanDecode(ArrayPtr<const byte> input) {
+  auto& tables = getHuffmanTables();
+
+  // The shortest code is five bits.
+  Vector<char> result(input.size() * 8 / 5 + 1);
+
+  uint32_t code = 0;
+  uint length = 0;
+  for (byte b: input) {
+    for (int bit = 7; bit >= 0; bit--) {
+      code = (code << 1) | ((b >> bit) & 1);
+      ++length;
+      KJ_REQUIRE(length <= HUFFMAN_MAX_LENGTH, "invalid HPACK Huffman code");
+
+      uint32_t index = code - tables.firstCode[length];
+      if (index < tables.count[length]) {
+        uint symbol = tables.symbols[tables.offset[length] + index];
+        KJ_REQUIRE(symbol != HUFFMAN_EOS, "HPACK Huffman string contains EOS");
+        result.add(symbol);
+        code = 0;
+        length = 0;
+      }
+    }
+  }
+
+  // Leftover bits must be a prefix of EOS (i.e. all ones) and shorter than a byte.
+  KJ_REQUIRE(length < 8 && code == (1u << length) - 1, "invalid HPACK Huffman padding");
+
+  result.add('\0');
+  return String(result.releaseAsArray());
+}
+
+size_t huffmanEncodedSize(StringPtr text) {
+  size_t bits = 0;
+  for (char c: text) {
+    bits += HUFFMAN_LENGTHS[static_cast<byte>(c)];
+  }
+  return (bits + 7) / 8;
+}
+
+void huffmanEncode(Vector<byte>& output, StringPtr text) {
+  auto& tables = getHuffmanTables();
+
+  uint64_t buffer = 0;
+  uint bits = 0;
+  for (char c: text) {
+    byte symbol = c;
+    buffer = (buffer << HUFFMAN_LENGTHS[symbol]) | tables.codes[symbol];
+    bits += HUFFMAN_LENGTHS[symbol];
+    while (bits >= 8) {
+      bits -= 8;
+      output.add(buffer >> bits);
+    }
+  }
+
+  if (bits > 0) {
+    // Pad with the most significant bits of EOS, which are all ones.
+    output.add((buffer << (8 - bits)) | (0xff >> bits));
+  }
+}
+
+// =======================================================================================
+// Primitive representations (RFC 7541 section 5)
+
+void encodeInteger(Vector<byte>& output, byte flags, uint prefixBits, uint64_t value) {
+  uint64_t prefixMax = (1u << prefixBits) - 1;
+  if (value < prefixMax) {
+    output.add(flags | value);
+    return;
+  }
+
+  output.add(flags | prefixMax);
+  value -= prefixMax;
+  while (value >= 128) {
+    output.add(0x80 | (value & 0x7f));
+    value >>= 7;
+  }
+  output.add(value);
+}
+
+uint64_t decodeInteger(ArrayPtr<const byte>& input, uint prefixBits) {
+  KJ_REQUIRE(input.size() > 0, "truncated HPACK block");
+
+  uint64_t prefixMax = (1u << prefixBits) - 1;
+  uint64_t value = input[0] & prefixMax;
+  input = input.slice(1, input.size());
+  if (value < prefixMax) return value;
+
+  for (uint shift = 0;; shift += 7) {
+    KJ_REQUIRE(input.size() > 0, "truncated HPACK block");
+    KJ_REQUIRE(shift <= 28, "HPACK integer too large");
+
+    byte b = input[0];
+    input = input.slice(1, input.size());
+    value += uint64_t(b & 0x7f) << shift;
+    if ((b & 0x80) == 0) return value;
+  }
+}
+
+void encodeString(Vector<byte>& output, StringPtr text) {
+  size_t huffmanSize = huffmanEncodedSize(text);
+  if (huffmanSize < text.size()) {
+    encodeInteger(output, 0x80, 7, huffmanSize);
+    huffmanEncode(output, text);
+  } else {
+    encodeInteger(output, 0, 7, text.size());
+    output.addAll(text.asBytes());
+  }
+}
+
+String decodeString(ArrayPtr<const byte>& input) {
+  KJ_REQUIRE(input.size() > 0, "truncated HPACK block");
+  bool huffman = input[0] & 0x80;
+  uint64_t size = decodeInteger(input, 7);
+  KJ_REQUIRE(size <= input.size(), "truncated HPACK block");
+
+  auto bytes = input.slice(0, size);
+  input = input.slice(size, input.size());
+  if (huffman) {
+    return huffmanDecode(bytes);
+  } else {
+    return heapString(reinterpret_cast<const char*>(bytes.begin()), bytes.size());
+  }
+}
+
+bool shouldIndex(StringPtr name) {
+  // Headers whose values are rarely repeated aren't worth evicting other entries for.
+  return name != ":path" &&
+         name != "content-length" &&
+         name != "content-range" &&
+         name != "date" &&
+         name != "etag" &&
+         name != "expires" &&
+         name != "if-modified-since" &&
+         name != "if-none-match" &&
+         name != "last-modified" &&
+         name != "location" &&
+         name != "set-cookie";
+}
+
+bool isSensitive(StringPtr name, StringPtr value) {
+  // Credentials are sent as never-indexed literals so that intermediaries don't index them either,
+  // and so that they can't be probed for via the compression ratio (RFC 7541 section 7.1).
+  return name == "authorization" ||
+         name == "proxy-authorization" ||
+         (name == "cookie" && value.size() < 20);
+}
+
+}  // namespace
+
+bool _::HpackKeyCallbacks::matches(ArrayPtr<const char> stored, ArrayPtr<const char> key) const {
+  return stored.size() == key.size() && memcmp(stored.begin(), key.begin(), key.size()) == 0;
+}
+
+// =======================================================================================
+// HpackDecoder
+
+HpackDecoder::HpackDecoder(size_t maxTableSize)
+    : maxTableSize(maxTableSize), currentMaxSize(maxTableSize) {}
+
+void HpackDecoder::setMaxTableSize(size_t size) {
+  maxTableSize = size;
+}
+
+Array<HpackDecoder::Header> HpackDecoder::decode(
+    ArrayPtr<const byte> block, size_t maxHeaderListSize) {
+  Vector<Header> headers;
+  size_t listSize = 0;
+
+  while (block.size() > 0) {
+    byte first = block[0];
+    String name;
+    String value;
+
+    if (first & 0x80) {
+      // Indexed header field.
+      uint64_t index = decodeInteger(block, 7);
+      name = heapString(nameAt(index));
+      value = heapString(valueAt(index));
+    } else if ((first & 0xe0) == 0x20) {
+      // Dynamic table size update. Only allowed before the first header field.
+      KJ_REQUIRE(headers.empty(), "HPACK table size update after header field");
+      uint64_t size = decodeInteger(block, 5);
+      KJ_REQUIRE(size <= maxTableSize, "HPACK table size update exceeds limit");
+      currentMaxSize = size;
+      evictTo(size);
+      continue;
+    } else {
+      // Literal header field: with incremental indexing (01), never indexed (0001), or without
+      // indexing (0000).
+      bool indexing = first & 0x40;
+      uint64_t nameIndex = decodeInteger(block, indexing ? 6 : 4);
+      name = nameIndex == 0 ? decodeString(block) : heapString(nameAt(nameIndex));
+      value = decodeString(block);
+      if (indexing) {
+        insert(heapString(name), heapString(value));
+      }
+    }
+
+    listSize += name.size() + value.size() + ENTRY_OVERHEAD;
+    KJ_REQUIRE(listSize <= maxHeaderListSize, "HTTP/2 header list too large");
+    headers.add(Header { kj::mv(name), kj::mv(value) });
+  }
+
+  return headers.releaseAsArray();
+}
+
+void HpackDecoder::insert(String name, String value) {
+  size_t size = name.size() + value.size() + ENTRY_OVERHEAD;
+  if (size > currentMaxSize) {
+    // Inserting an entry larger than the table just empties it.
+    evictTo(0);
+    return;
+  }
+
+  evictTo(currentMaxSize - size);
+  entries.pushBack(Entry { kj::mv(name), kj::mv(value) });
+  tableSize += size;
+}
+
+void HpackDecoder::evictTo(size_t size) {
+  while (tableSize > size) {
+    auto entry = entries.popFront();
+    tableSize -= entry.name.size() + entry.value.size() + ENTRY_OVERHEAD;
+  }
+}
+
+StringPtr HpackDecoder::nameAt(uint64_t index) const {
+  KJ_REQUIRE(index > 0, "invalid HPACK index");
+  if (index <= STATIC_TABLE_SIZE) return STATIC_TABLE[index - 1].name;
+  KJ_REQUIRE(index - STATIC_TABLE_SIZE <= entries.size(), "invalid HPACK index");
+  return entries[entries.size() - (index - STATIC_TABLE_SIZE)].name;
+}
+
+StringPtr HpackDecoder::valueAt(uint64_t index) const {
+  KJ_REQUIRE(index > 0, "invalid HPACK index");
+  if (index <= STATIC_TABLE_SIZE) return STATIC_TABLE[index - 1].value;
+  KJ_REQUIRE(index - STATIC_TABLE_SIZE <= entries.size(), "invalid HPACK index");
+  return entries[entries.size() - (index - STATIC_TABLE_SIZE)].value;
+}
+
+// =======================================================================================
+// HpackEncoder
+
+HpackEncoder::HpackEncoder(size_t maxTableSize)
+    : maxTableSize(maxTableSize), currentMaxSize(kj::min(maxTableSize, size_t(4096))) {
+  // The peer's decoder starts out at the protocol default of 4096.
+  if (currentMaxSize != 4096) {
+    smallestPendingSize = currentMaxSize;
+  }
+}
+
+void HpackEncoder::setMaxTableSize(size_t size) {
+  size = kj::min(size, maxTableSize);
+  if (size == currentMaxSize) return;
+
+  KJ_IF_MAYBE(smallest, smallestPendingSize) {
+    *smallest = kj::min(*smallest, size);
+  } else {
+    smallestPendingSize = size;
+  }
+  currentMaxSize = size;
+  evictTo(size);
+}
+
+void HpackEncoder::beginBlock(Vector<byte>& out) {
+  KJ_IF_MAYBE(smallest, smallestPendingSize) {
+    // If the size went down and back up since the last block, the decoder must see the low point
+    // so that it evicts the same entries we did.
+    encodeInteger(out, 0x20, 5, *smallest);
+    if (*smallest != currentMaxSize) {
+      encodeInteger(out, 0x20, 5, currentMaxSize);
+    }
+    smallestPendingSize = nullptr;
+  }
+}
+
+void HpackEncoder::add(Vector<byte>& out, StringPtr name, StringPtr value) {
+  auto& statics = getStaticIndex();
+  auto key = fieldKey(scratch, name, value);
+
+  KJ_IF_MAYBE(index, statics.byNameValue.find(key)) {
+    encodeInteger(out, 0x80, 7, *index);
+    return;
+  }
+  KJ_IF_MAYBE(number, byNameValue.find(key)) {
+    encodeInteger(out, 0x80, 7, STATIC_TABLE_SIZE + insertCount - *number);
+    return;
+  }
+
+  uint64_t nameIndex = 0;
+  KJ_IF_MAYBE(index, statics.byName.find(name.asArray())) {
+    nameIndex = *index;
+  } else KJ_IF_MAYBE(number, byName.find(name.asArray())) {
+    nameIndex = STATIC_TABLE_SIZE + insertCount - *number;
+  }
+
+  size_t size = name.size() + value.size() + ENTRY_OVERHEAD;
+  bool indexing = false;
+  if (isSensitive(name, value)) {
+    encodeInteger(out, 0x10, 4, nameIndex);
+  } else if (shouldIndex(name) && size <= currentMaxSize) {
+    encodeInteger(out, 0x40, 6, nameIndex);
+    indexing = true;
+  } else {
+    encodeInteger(out, 0x00, 4, nameIndex);
+  }
+
+  if (nameIndex == 0) {
+    encodeString(out, name);
+  }
+  encodeString(out, value);
+
+  if (indexing) {
+    evictTo(currentMaxSize - size);
+    uint64_t number = insertCount++;
+    byNameValue.upsert(heapString(key), number);
+    byName.upsert(heapString(name), number);
+    entries.pushBack(Entry { heapString(key), name.size(), number });
+    tableSize += size;
+  }
+}
+
+void HpackEncoder::evictTo(size_t size) {
+  while (tableSize > size) {
+    auto entry = entries.popFront();
+    auto key = entry.nameValue.asArray();
+    tableSize -= key.size() - 1 + ENTRY_OVERHEAD;
+
+    // The maps only point at the newest entry with each key, which may not be this one.
+    KJ_IF_MAYBE(number, byNameValue.find(key)) {
+      if (*number == entry.number) byNameValue.erase(key);
+    }
+    auto name = key.slice(0, entry.nameSize);
+    KJ_IF_MAYBE(number, byName.find(name)) {
+      if (*number == entry.number) byName.erase(name);
+    }
+  }
+}
+
+}  // namespace kj
@@ -0,0 +1,181 @@
+// Copyright (c) 2017 Sandstorm Development Group, Inc. and contributors
+// Licensed under the MIT License:
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+
+#pragma once
+// HPACK (RFC 7541), the header compression format used by HTTP/2.
+//
+// This is an implementation detail of the HTTP/2 support in http.h, exposed separately because it
+// is self-contained and independently testable.
+
+#include <kj/string.h>
+#include <kj/vector.h>
+#include <kj/map.h>
+
+namespace kj {
+
+namespace _ {  // private
+
+struct HpackKeyCallbacks {
+  // Lets maps keyed by String be searched with a borrowed key, so that lookups don't allocate.
+
+  inline uint hashCode(ArrayPtr<const char> key) const { return kj::hashCode(key); }
+  bool matches(ArrayPtr<const char> stored, ArrayPtr<const char> key) const;
+};
+
+template <typename T>
+class RingBuffer {
+  // A FIFO queue stored in a Vector used circularly: the HPACK dynamic tables, and HTTP/2's
+  // per-stream and per-connection queues. Grows by doubling and never shrinks. Popped slots are
+  // left holding moved-from values until reused.
+
+public:
+  size_t size() const { return count; }
+  bool empty() const { return count == 0; }
+
+  T& front() { return slots[head]; }
+  T& operator[](size_t i) { return slots[(head + i) % slots.size()]; }
+  const T& operator[](size_t i) const { return slots[(head + i) % slots.size()]; }
+  // Element `i`, counting from the oldest.
+
+  void pushBack(T&& value) {
+    if (count == slots.size()) grow();
+    slots[(head + count) % slots.size()] = kj::mv(value);
+    ++count;
+  }
+
+  T popFront() {
+    T result = kj::mv(slots[head]);
+    head = (head + 1) % slots.size();
+    --count;
+    return result;
+  }
+
+private:
+  Vector<T> slots;
+  size_t head = 0;
+  size_t count = 0;
+
+  void grow() {
+    Vector<T> newSlots(kj::max(slots.size() * 2, size_t(8)));
+    for (size_t i = 0; i < count; i++) {
+      newSlots.add(kj::mv((*this)[i]));
+    }
+    newSlots.resize(newSlots.capacity());
+    slots = kj::mv(newSlots);
+    head = 0;
+  }
+};
+
+}  // namespace _ (private)
+
+class HpackDecoder {
+  // Decodes header blocks. One decoder must see every block sent by the peer's encoder, in order,
+  // since blocks may refer to entries that earlier blocks added to the dynamic table.
+
+public:
+  explicit HpackDecoder(size_t maxTableSize = 4096);
+  KJ_DISALLOW_COPY(HpackDecoder);
+
+  void setMaxTableSize(size_t size);
+  // Sets the largest dynamic table the encoder may ask for, i.e. the SETTINGS_HEADER_TABLE_SIZE
+  // we advertised.
+
+  struct Header {
+    String name;
+    String value;
+  };
+
+  Array<Header> decode(ArrayPtr<const byte> block, size_t maxHeaderListSize = kj::maxValue);
+  // Decodes a complete header block (all HEADERS and CONTINUATION fragments concatenated). Throws
+  // if the block is malformed or if its headers exceed `maxHeaderListSize` as measured by HTTP/2's
+  // SETTINGS_MAX_HEADER_LIST_SIZE rules. After a throw the decoder's state is unspecified; the
+  // connection must be torn down with COMPRESSION_ERROR.
+
+  size_t getTableSize() const { return tableSize; }
+
+private:
+  struct Entry {
+    String name;
+    String value;
+  };
+
+  size_t maxTableSize;
+  size_t currentMaxSize;
+  size_t tableSize = 0;
+  _::RingBuffer<Entry> entries;
+  // Oldest entry first. HPACK numbers them from the newest.
+
+  void insert(String name, String value);
+  void evictTo(size_t size);
+  StringPtr nameAt(uint64_t index) const;
+  StringPtr valueAt(uint64_t index) const;
+};
+
+class HpackEncoder {
+  // Encodes header blocks. Chooses between indexed and literal representations on its own; names
+  // must already be lowercase, as HTTP/2 requires.
+
+public:
+  explicit HpackEncoder(size_t maxTableSize = 4096);
+  KJ_DISALLOW_COPY(HpackEncoder);
+
+  void setMaxTableSize(size_t size);
+  // Applies the peer's SETTINGS_HEADER_TABLE_SIZE (clamped to the size given to the constructor).
+  // The change is signalled at the start of the next block.
+
+  void beginBlock(Vector<byte>& out);
+  // Must be called at the start of each header block.
+
+  void add(Vector<byte>& out, StringPtr name, StringPtr value);
+  // Appends one header field to the block.
+
+  size_t getTableSize() const { return tableSize; }
+
+private:
+  struct Entry {
+    String nameValue;
+    // Name and value separated by a NUL, which is also the key in `byNameValue`.
+
+    size_t nameSize;
+    uint64_t number;
+  };
+
+  size_t maxTableSize;
+  size_t currentMaxSize;
+  kj::Maybe<size_t> smallestPendingSize;
+  size_t tableSize = 0;
+  uint64_t insertCount = 0;
+  _::RingBuffer<Entry> entries;
+  // Oldest entry first.
+
+  HashMap<String, uint64_t, _::HpackKeyCallbacks> byNameValue;
+  HashMap<String, uint64_t, _::HpackKeyCallbacks> byName;
+  // Maps to the `number` of the newest entry with that name/value or name. Entry number n is at
+  // HPACK index 62 + insertCount - 1 - n.
+
+  Vector<char> scratch;
+  // Reused buffer for building lookup keys.
+
+  void evictTo(size_t size);
+};
+
+}  // namespace kj
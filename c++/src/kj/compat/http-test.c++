@@ -1197,6 +1197,396 @@ KJ_TEST("HttpClient <-> HttpServer") {
 
 // -----------------------------------------------------------------------------
 
+class FlipCaseCodec final: public CompressionCodec {
+  // A toy content coding which swaps the case of ASCII letters, so that encoded bodies are still
+  // readable in test expectations. Like a real compressor, it holds output back until flushed.
+
+public:
+  explicit FlipCaseCodec(kj::StringPtr name): name(name) {}
+
+  StringPtr getName() const override { return name; }
+  Own<Compressor> newCompressor() override { return kj::heap<Engine>(); }
+  Own<Decompressor> newDecompressor() override { return kj::heap<Engine>(); }
+
+private:
+  kj::StringPtr name;
+
+  class Engine final: public Compressor, public Decompressor {
+  public:
+    bool compress(ArrayPtr<const byte>& input, ArrayPtr<byte>& output, Flush flush) override {
+      size_t offset = held.size();
+      held.resize(offset + input.size());
+      auto heldOutput = held.asPtr().slice(offset, held.size());
+      transform(input, heldOutput);
+      if (flush == Flush::NONE) return true;
+
+      size_t n = kj::min(held.size(), output.size());
+      memcpy(output.begin(), held.begin(), n);
+      output = output.slice(n, output.size());
+      kj::Vector<byte> rest;
+      rest.addAll(held.asPtr().slice(n, held.size()));
+      held = kj::mv(rest);
+      return held.size() == 0;
+    }
+    bool decompress(ArrayPtr<const byte>& input, ArrayPtr<byte>& output) override {
+      transform(input, output);
+      return true;
+    }
+
+  private:
+    kj::Vector<byte> held;
+
+    static void transform(ArrayPtr<const byte>& input, ArrayPtr<byte>& output) {
+      size_t n = kj::min(input.size(), output.size());
+      for (size_t i = 0; i < n; i++) {
+        byte c = input[i];
+        output[i] = ('a' <= c && c <= 'z') || ('A' <= c && c <= 'Z') ? c ^ 0x20 : c;
+      }
+      input = input.slice(n, input.size());
+      output = output.slice(n, output.size());
+    }
+  };
+};
+
+class CompressibleResponseService final: public HttpService {
+public:
+  CompressibleResponseService(HttpHeaderTable& table): table(table) {}
+
+  kj::Promise<void> request(
+      HttpMethod method, kj::StringPtr url, const HttpHeaders& headers,
+      kj::AsyncInputStream& requestBody, Response& response) override {
+    lastAcceptEncoding = kj::str(headers.get(HttpHeaderId::ACCEPT_ENCODING).orDefault("(none)"));
+
+    HttpHeaders responseHeaders(table);
+    kj::StringPtr body = "Hello, World!";
+    if (url == "/already-encoded") {
+      responseHeaders.set(HttpHeaderId::CONTENT_ENCODING, "identity");
+    } else if (url == "/vary") {
+      responseHeaders.set(HttpHeaderId::VARY, "Cookie");
+    } else if (url == "/small") {
+      body = "Hi!";
+    } else if (url == "/image") {
+      responseHeaders.set(HttpHeaderId::CONTENT_TYPE, "IMAGE/PNG");
+    } else if (url == "/svg") {
+      responseHeaders.set(HttpHeaderId::CONTENT_TYPE, "image/svg+xml; charset=utf-8");
+    } else if (url == "/stream") {
+      // Sends the body in two writes, the second once `resumeStream` is fulfilled.
+      auto stream = response.send(200, "OK", responseHeaders);
+      auto& streamRef = *stream;
+      auto paf = kj::newPromiseAndFulfiller<void>();
+      resumeStream = kj::mv(paf.fulfiller);
+      return kj::joinPromises(kj::arr(streamRef.write("Hello", 5), kj::mv(paf.promise)))
+          .then([&streamRef]() { return streamRef.write(", World!", 8); })
+          .attach(kj::mv(stream));
+    }
+    auto stream = response.send(200, "OK", responseHeaders, body.size());
+    auto promise = stream->write(body.begin(), body.size());
+    return promise.attach(kj::mv(stream));
+  }
+
+  kj::String lastAcceptEncoding;
+  kj::Own<kj::PromiseFulfiller<void>> resumeStream;
+
+private:
+  HttpHeaderTable& table;
+};
+
+KJ_TEST("HttpServer content-encoding negotiation") {
+  auto io = kj::setupAsyncIo();
+
+  HttpHeaderTable table;
+  CompressibleResponseService service(table);
+  FlipCaseCodec x("x-flip"), y("x-flop");
+  CompressionCodec* codecs[] = { &x, &y };
+  HttpServerSettings settings;
+  settings.compressionCodecs = codecs;
+  settings.compressionMinBytes = 5;
+
+  auto fetch = [&](kj::StringPtr request) {
+    auto pipe = io.provider->newTwoWayPipe();
+    HttpServer server(io.provider->getTimer(), table, service, settings);
+    auto listenTask = server.listenHttp(kj::mv(pipe.ends[0]));
+    pipe.ends[1]->write(request.begin(), request.size()).wait(io.waitScope);
+    pipe.ends[1]->shutdownWrite();
+    auto text = pipe.ends[1]->readAllText().wait(io.waitScope);
+    listenTask.wait(io.waitScope);
+    return text;
+  };
+
+  // The client's preference wins...
+  KJ_EXPECT(fetch("GET / HTTP/1.1\r\nAccept-Encoding: gzip, x-flop, x-flip;q=0.5\r\n\r\n") ==
+      "HTTP/1.1 200 OK\r\n"
+      "Transfer-Encoding: chunked\r\n"
+      "Content-Encoding: x-flop\r\n"
+      "Vary: Accept-Encoding\r\n"
+      "\r\n"
+      "d\r\nhELLO, wORLD!\r\n0\r\n\r\n");
+
+  // ...but ties go to the server's.
+  KJ_EXPECT(fetch("GET / HTTP/1.1\r\nAccept-Encoding: X-FLOP, *\r\n\r\n") ==
+      "HTTP/1.1 200 OK\r\n"
+      "Transfer-Encoding: chunked\r\n"
+      "Content-Encoding: x-flip\r\n"
+      "Vary: Accept-Encoding\r\n"
+      "\r\n"
+      "d\r\nhELLO, wORLD!\r\n0\r\n\r\n");
+
+  KJ_EXPECT(fetch("GET /vary HTTP/1.1\r\nAccept-Encoding: x-flip\r\n\r\n") ==
+      "HTTP/1.1 200 OK\r\n"
+      "Transfer-Encoding: chunked\r\n"
+      "Content-Encoding: x-flip\r\n"
+      "Vary: Cookie, Accept-Encoding\r\n"
+      "\r\n"
+      "d\r\nhELLO, wORLD!\r\n0\r\n\r\n");
+
+  // Not encoded: nothing acceptable offered, already encoded, too small, or HEAD.
+  KJ_EXPECT(fetch("GET / HTTP/1.1\r\nAccept-Encoding: gzip, x-flip;q=0\r\n\r\n") ==
+      "HTTP/1.1 200 OK\r\n"
+      "Content-Length: 13\r\n"
+      "\r\n"
+      "Hello, World!");
+  KJ_EXPECT(fetch("GET / HTTP/1.1\r\n\r\n") ==
+      "HTTP/1.1 200 OK\r\n"
+      "Content-Length: 13\r\n"
+      "\r\n"
+      "Hello, World!");
+  KJ_EXPECT(fetch("GET /already-encoded HTTP/1.1\r\nAccept-Encoding: x-flip\r\n\r\n") ==
+      "HTTP/1.1 200 OK\r\n"
+      "Content-Length: 13\r\n"
+      "Content-Encoding: identity\r\n"
+      "\r\n"
+      "Hello, World!");
+  KJ_EXPECT(fetch("GET /small HTTP/1.1\r\nAccept-Encoding: x-flip\r\n\r\n") ==
+      "HTTP/1.1 200 OK\r\n"
+      "Content-Length: 3\r\n"
+      "\r\n"
+      "Hi!");
+  KJ_EXPECT(fetch("HEAD / HTTP/1.1\r\nAccept-Encoding: x-flip\r\n\r\n") ==
+      "HTTP/1.1 200 OK\r\n"
+      "Content-Length: 13\r\n"
+      "\r\n");
+
+  // Nor are media types that are already compressed, though SVG is text.
+  KJ_EXPECT(fetch("GET /image HTTP/1.1\r\nAccept-Encoding: x-flip\r\n\r\n") ==
+      "HTTP/1.1 200 OK\r\n"
+      "Content-Length: 13\r\n"
+      "Content-Type: IMAGE/PNG\r\n"
+      "\r\n"
+      "Hello, World!");
+  KJ_EXPECT(fetch("GET /svg HTTP/1.1\r\nAccept-Encoding: x-flip\r\n\r\n") ==
+      "HTTP/1.1 200 OK\r\n"
+      "Transfer-Encoding: chunked\r\n"
+      "Content-Type: image/svg+xml; charset=utf-8\r\n"
+      "Content-Encoding: x-flip\r\n"
+      "Vary: Accept-Encoding\r\n"
+      "\r\n"
+      "d\r\nhELLO, wORLD!\r\n0\r\n\r\n");
+}
+
+KJ_TEST("HttpServer flushes each write to a compressed response") {
+  auto io = kj::setupAsyncIo();
+  auto pipe = io.provider->newTwoWayPipe();
+
+  HttpHeaderTable table;
+  CompressibleResponseService service(table);
+  FlipCaseCodec codec("x-flip");
+  CompressionCodec* codecs[] = { &codec };
+  HttpServerSettings settings;
+  settings.compressionCodecs = codecs;
+  HttpServer server(io.provider->getTimer(), table, service, settings);
+  auto listenTask = server.listenHttp(kj::mv(pipe.ends[0]));
+
+  kj::StringPtr request = "GET /stream HTTP/1.1\r\nAccept-Encoding: x-flip\r\n\r\n";
+  pipe.ends[1]->write(request.begin(), request.size()).wait(io.waitScope);
+
+  // The first write arrives while the service is still waiting to send the second.
+  kj::StringPtr expected =
+      "HTTP/1.1 200 OK\r\n"
+      "Transfer-Encoding: chunked\r\n"
+      "Content-Encoding: x-flip\r\n"
+      "Vary: Accept-Encoding\r\n"
+      "\r\n"
+      "5\r\nhELLO\r\n";
+  auto buffer = kj::heapArray<char>(expected.size());
+  auto readPromise = pipe.ends[1]->read(buffer.begin(), buffer.size());
+  KJ_ASSERT(readPromise.poll(io.waitScope));
+  readPromise.wait(io.waitScope);
+  KJ_EXPECT(kj::heapString(buffer) == expected, buffer);
+
+  service.resumeStream->fulfill();
+  pipe.ends[1]->shutdownWrite();
+  KJ_EXPECT(pipe.ends[1]->readAllText().wait(io.waitScope) == "8\r\n, wORLD!\r\n0\r\n\r\n");
+  listenTask.wait(io.waitScope);
+}
+
+class PreparedResponseService final: public HttpService {
+public:
+  PreparedResponseService(HttpHeaderTable& table)
+      : table(table), prepared(200, "OK", makeHeaders(table)) {}
+
+  kj::Promise<void> request(
+      HttpMethod method, kj::StringPtr url, const HttpHeaders& headers,
+      kj::AsyncInputStream& requestBody, Response& response) override {
+    kj::StringPtr body = "Hello, World!";
+    kj::Own<kj::AsyncOutputStream> stream;
+    if (url == "/chunked") {
+      stream = response.sendPrepared(prepared);
+    } else if (url == "/unprepared") {
+      stream = response.send(200, "OK", HttpHeaders(table), body.size());
+    } else if (url == "/own-date") {
+      HttpHeaders responseHeaders(table);
+      responseHeaders.set(HttpHeaderId::DATE, "Thu, 01 Jan 1970 00:00:00 GMT");
+      stream = response.send(200, "OK", responseHeaders, body.size());
+    } else {
+      stream = response.sendPrepared(prepared, body.size());
+    }
+    auto promise = stream->write(body.begin(), body.size());
+    return promise.attach(kj::mv(stream));
+  }
+
+private:
+  HttpHeaderTable& table;
+  HttpPreparedHeaders prepared;
+
+  static HttpHeaders makeHeaders(HttpHeaderTable& table) {
+    HttpHeaders headers(table);
+    headers.set(HttpHeaderId::CONTENT_TYPE, "text/plain");
+    headers.set(HttpHeaderId::CONTENT_LENGTH, "999");  // ignored
+    return headers;
+  }
+};
+
+class FakeClock final: public kj::Clock {
+public:
+  kj::Date now() const override { return time; }
+
+  kj::Date time = kj::UNIX_EPOCH;
+};
+
+KJ_TEST("HttpServer prepared headers and Date") {
+  auto io = kj::setupAsyncIo();
+
+  HttpHeaderTable table;
+  PreparedResponseService service(table);
+  FlipCaseCodec codec("x-flip");
+  CompressionCodec* codecs[] = { &codec };
+  FakeClock clock;
+  clock.time = kj::UNIX_EPOCH + 784111777 * kj::SECONDS;
+  HttpServerSettings settings;
+  settings.compressionCodecs = codecs;
+  settings.compressionMinBytes = 5;
+  settings.sendDate = true;
+  settings.clock = &clock;
+
+  auto fetch = [&](kj::StringPtr request) {
+    auto pipe = io.provider->newTwoWayPipe();
+    HttpServer server(io.provider->getTimer(), table, service, settings);
+    auto listenTask = server.listenHttp(kj::mv(pipe.ends[0]));
+    pipe.ends[1]->write(request.begin(), request.size()).wait(io.waitScope);
+    pipe.ends[1]->shutdownWrite();
+    auto text = pipe.ends[1]->readAllText().wait(io.waitScope);
+    listenTask.wait(io.waitScope);
+    return text;
+  };
+
+  // The prepared block is followed by the per-response headers.
+  KJ_EXPECT(fetch("GET / HTTP/1.1\r\n\r\n") ==
+      "HTTP/1.1 200 OK\r\n"
+      "Content-Type: text/plain\r\n"
+      "Content-Length: 13\r\n"
+      "Date: Sun, 06 Nov 1994 08:49:37 GMT\r\n"
+      "\r\n"
+      "Hello, World!");
+  KJ_EXPECT(fetch("GET /chunked HTTP/1.1\r\n\r\n") ==
+      "HTTP/1.1 200 OK\r\n"
+      "Content-Type: text/plain\r\n"
+      "Transfer-Encoding: chunked\r\n"
+      "Date: Sun, 06 Nov 1994 08:49:37 GMT\r\n"
+      "\r\n"
+      "d\r\nHello, World!\r\n0\r\n\r\n");
+  KJ_EXPECT(fetch("HEAD / HTTP/1.1\r\n\r\n") ==
+      "HTTP/1.1 200 OK\r\n"
+      "Content-Type: text/plain\r\n"
+      "Content-Length: 13\r\n"
+      "Date: Sun, 06 Nov 1994 08:49:37 GMT\r\n"
+      "\r\n");
+
+  // Compression needs different headers, so the prepared block isn't used.
+  KJ_EXPECT(fetch("GET / HTTP/1.1\r\nAccept-Encoding: x-flip\r\n\r\n") ==
+      "HTTP/1.1 200 OK\r\n"
+      "Transfer-Encoding: chunked\r\n"
+      "Date: Sun, 06 Nov 1994 08:49:37 GMT\r\n"
+      "Content-Type: text/plain\r\n"
+      "Content-Encoding: x-flip\r\n"
+      "Vary: Accept-Encoding\r\n"
+      "\r\n"
+      "d\r\nhELLO, wORLD!\r\n0\r\n\r\n");
+
+  // The Date changes with the clock, and applies to ordinary responses too.
+  clock.time = kj::UNIX_EPOCH + 951782400 * kj::SECONDS;
+  KJ_EXPECT(fetch("GET /unprepared HTTP/1.1\r\n\r\n") ==
+      "HTTP/1.1 200 OK\r\n"
+      "Content-Length: 13\r\n"
+      "Date: Tue, 29 Feb 2000 00:00:00 GMT\r\n"
+      "\r\n"
+      "Hello, World!");
+
+  // A Date set by the service is kept.
+  KJ_EXPECT(fetch("GET /own-date HTTP/1.1\r\n\r\n") ==
+      "HTTP/1.1 200 OK\r\n"
+      "Content-Length: 13\r\n"
+      "Date: Thu, 01 Jan 1970 00:00:00 GMT\r\n"
+      "\r\n"
+      "Hello, World!");
+}
+
+KJ_TEST("HttpClient <-> HttpServer content-encoding") {
+  auto io = kj::setupAsyncIo();
+  auto pipe = io.provider->newTwoWayPipe();
+
+  HttpHeaderTable table;
+  CompressibleResponseService service(table);
+  FlipCaseCodec codec("x-flip");
+  CompressionCodec* codecs[] = { &codec };
+
+  HttpServerSettings serverSettings;
+  serverSettings.compressionCodecs = codecs;
+  serverSettings.compressionMinBytes = 0;
+  HttpServer server(io.provider->getTimer(), table, service, serverSettings);
+  auto listenTask = server.listenHttp(kj::mv(pipe.ends[1]));
+
+  HttpClientSettings clientSettings;
+  clientSettings.compressionCodecs = codecs;
+  auto client = newHttpClient(table, *pipe.ends[0], clientSettings);
+
+  {
+    // The client offers its codecs and transparently decodes the response.
+    HttpHeaders headers(table);
+    auto response = client->request(HttpMethod::GET, "/", headers).response.wait(io.waitScope);
+    KJ_EXPECT(service.lastAcceptEncoding == "x-flip");
+    KJ_EXPECT(response.headers->get(HttpHeaderId::CONTENT_ENCODING) == nullptr);
+    KJ_EXPECT(response.headers->get(HttpHeaderId::VARY).orDefault(nullptr) == "Accept-Encoding");
+    auto text = response.body->readAllText().wait(io.waitScope);
+    KJ_EXPECT(text == "Hello, World!", text);
+  }
+
+  {
+    // An explicit Accept-Encoding is sent as-is.
+    HttpHeaders headers(table);
+    headers.set(HttpHeaderId::ACCEPT_ENCODING, "identity");
+    auto response = client->request(HttpMethod::GET, "/", headers).response.wait(io.waitScope);
+    KJ_EXPECT(service.lastAcceptEncoding == "identity");
+    KJ_EXPECT(response.headers->get(HttpHeaderId::VARY) == nullptr);
+    KJ_EXPECT(response.body->readAllText().wait(io.waitScope) == "Hello, World!");
+  }
+
+  client = nullptr;
+  pipe.ends[0]->shutdownWrite();
+  listenTask.wait(io.waitScope);
+}
+
+// -----------------------------------------------------------------------------
+
 KJ_TEST("WebSocket core protocol") {
   auto io = kj::setupAsyncIo();
   auto pipe = io.provider->newTwoWayPipe();
@@ -1683,6 +2073,126 @@ KJ_TEST("WebSocket ping received during pong send") {
   clientTask.wait(io.waitScope);
 }
 
+KJ_TEST("WebSocket receiveInto") {
+  auto io = kj::setupAsyncIo();
+  auto pipe = io.provider->newTwoWayPipe();
+
+  auto client = kj::mv(pipe.ends[0]);
+  auto server = newWebSocket(kj::mv(pipe.ends[1]), nullptr);
+
+  byte DATA[] = {
+    0x01, 0x06, 'h', 'e', 'l', 'l', 'o', ' ',
+
+    0x89, 0x03, 'f', 'o', 'o',
+
+    0x80, 0x85, 12, 34, 56, 78, 'w' ^ 12, 'o' ^ 34, 'r' ^ 56, 'l' ^ 78, 'd' ^ 12,
+
+    0x82, 0x03, 1, 2, 3,
+
+    0x88, 0x04, 0x04, 0xd2, 'o', 'k',
+
+    0x81, 0x11, '0', '1', '2', '3', '4', '5', '6', '7', '8', '9', '0', '1', '2', '3', '4', '5', '6',
+  };
+
+  auto clientTask = client->write(DATA, sizeof(DATA));
+
+  byte buffer[16];
+
+  {
+    auto message = server->receiveInto(buffer).wait(io.waitScope);
+    KJ_ASSERT(message.is<kj::ArrayPtr<char>>());
+    auto text = message.get<kj::ArrayPtr<char>>();
+    KJ_EXPECT(text.begin() == reinterpret_cast<char*>(buffer));
+    KJ_EXPECT(kj::heapString(text) == "hello world");
+  }
+
+  {
+    auto message = server->receiveInto(buffer).wait(io.waitScope);
+    KJ_ASSERT(message.is<kj::ArrayPtr<byte>>());
+    auto data = message.get<kj::ArrayPtr<byte>>();
+    KJ_ASSERT(data.size() == 3);
+    KJ_EXPECT(data[0] == 1 && data[1] == 2 && data[2] == 3);
+  }
+
+  {
+    auto message = server->receiveInto(buffer).wait(io.waitScope);
+    KJ_ASSERT(message.is<WebSocket::Close>());
+    KJ_EXPECT(message.get<WebSocket::Close>().code == 1234);
+    KJ_EXPECT(message.get<WebSocket::Close>().reason == "ok");
+  }
+
+  KJ_EXPECT_THROW_MESSAGE("larger than the receive buffer",
+      server->receiveInto(buffer).wait(io.waitScope));
+
+  byte EXPECTED[] = { 0x8A, 0x03, 'f', 'o', 'o' };
+  expectRead(*client, EXPECTED).wait(io.waitScope);
+
+  clientTask.wait(io.waitScope);
+}
+
+KJ_TEST("WebSocket pumpTo forwards frames") {
+  auto io = kj::setupAsyncIo();
+  auto frontPipe = io.provider->newTwoWayPipe();
+  auto backPipe = io.provider->newTwoWayPipe();
+  FakeEntropySource maskGenerator;
+
+  // A server-side WebSocket receiving from `frontClient`, pumped into a client-side WebSocket
+  // sending to `backServer`, as in a proxy.
+  auto frontClient = kj::mv(frontPipe.ends[0]);
+  auto front = newWebSocket(kj::mv(frontPipe.ends[1]), nullptr);
+  auto back = newWebSocket(kj::mv(backPipe.ends[0]), maskGenerator);
+  auto backServer = kj::mv(backPipe.ends[1]);
+
+  auto pumpTask = front->pumpTo(*back);
+
+  // Fragmentation is preserved, and a masked frame is re-masked with the back end's key.
+  byte DATA[] = {
+    0x01, 0x03, 'h', 'e', 'l',
+
+    0x89, 0x03, 'f', 'o', 'o',
+
+    0x80, 0x82, 1, 2, 3, 4, 'l' ^ 1, 'o' ^ 2,
+  };
+  frontClient->write(DATA, sizeof(DATA)).wait(io.waitScope);
+
+  byte EXPECTED[] = {
+    0x01, 0x83, 12, 34, 56, 78, 'h' ^ 12, 'e' ^ 34, 'l' ^ 56,
+
+    0x80, 0x82, 12, 34, 56, 78, 'l' ^ 12, 'o' ^ 34,
+  };
+  expectRead(*backServer, EXPECTED).wait(io.waitScope);
+
+  // The ping was answered by the front end, not forwarded.
+  byte PONG[] = { 0x8A, 0x03, 'f', 'o', 'o' };
+  expectRead(*frontClient, PONG).wait(io.waitScope);
+
+  // A frame larger than the receive buffer streams through.
+  auto bigString = kj::strArray(kj::repeat(kj::StringPtr("123456789"), 10000), "");
+  byte PREFIX[] = { 0x82, 0x7f, 0, 0, 0, 0, 0, 0x01, 0x5f, 0x90 };  // 90000 bytes
+  byte CLOSE[] = { 0x88, 0x04, 0x04, 0xd2, 'o', 'k' };
+  kj::ArrayPtr<const byte> parts[] = { PREFIX, bigString.asBytes(), CLOSE };
+  auto writeTask = frontClient->write(parts);
+
+  auto backWs = newWebSocket(kj::mv(backServer), nullptr);
+  {
+    auto message = backWs->receive().wait(io.waitScope);
+    KJ_ASSERT(message.is<kj::Array<byte>>());
+    KJ_EXPECT(kj::heapString(message.get<kj::Array<byte>>().asChars()) == bigString);
+  }
+  {
+    auto message = backWs->receive().wait(io.waitScope);
+    KJ_ASSERT(message.is<WebSocket::Close>());
+    KJ_EXPECT(message.get<WebSocket::Close>().code == 1234);
+    KJ_EXPECT(message.get<WebSocket::Close>().reason == "ok");
+  }
+
+  // EOF propagates as a disconnect.
+  writeTask.wait(io.waitScope);
+  frontClient->shutdownWrite();
+  pumpTask.wait(io.waitScope);
+  KJ_EXPECT_THROW_MESSAGE("disconnected", backWs->receive().wait(io.waitScope));
+}
+
 class TestWebSocketService final: public HttpService, private kj::TaskSet::ErrorHandler {
 public:
   TestWebSocketService(HttpHeaderTable& headerTable, HttpHeaderId hMyHeader)
@@ -1928,29 +2438,347 @@ KJ_TEST("HttpServer WebSocket handshake error") {
   listenTask.wait(io.waitScope);
 }
 
-// -----------------------------------------------------------------------------
+class StoredDeflateCodec final: public CompressionCodec {
+  // A DEFLATE "compressor" that only emits stored (uncompressed) blocks, so that permessage-deflate
+  // framing can be checked byte-for-byte without zlib. A sync flush emits an empty stored block,
+  // 00 00 00 ff ff, as zlib does.
 
-KJ_TEST("HttpServer request timeout") {
-  auto PIPELINE_TESTS = pipelineTestCases();
+public:
+  StringPtr getName() const override { return "deflate-raw"; }
+  Own<Compressor> newCompressor() override { ++compressorCount; return kj::heap<Encoder>(); }
+  Own<Decompressor> newDecompressor() override { ++decompressorCount; return kj::heap<Decoder>(); }
 
-  auto io = kj::setupAsyncIo();
-  auto pipe = io.provider->newTwoWayPipe();
+  uint compressorCount = 0;
+  uint decompressorCount = 0;
 
-  HttpHeaderTable table;
-  TestHttpService service(PIPELINE_TESTS, table);
-  HttpServerSettings settings;
-  settings.headerTimeout = 1 * kj::MILLISECONDS;
-  HttpServer server(io.provider->getTimer(), table, service, settings);
+private:
+  class Encoder final: public Compressor {
+  public:
+    bool compress(ArrayPtr<const byte>& input, ArrayPtr<byte>& output, Flush flush) override {
+      while (input.size() > 0) {
+        auto chunk = input.slice(0, kj::min(input.size(), size_t(65535)));
+        addBlock(false, chunk);
+        input = input.slice(chunk.size(), input.size());
+      }
+      if (flush != Flush::NONE && !flushQueued) {
+        addBlock(flush == Flush::FINISH, nullptr);
+        flushQueued = true;
+      }
 
-  // Shouldn't hang! Should time out.
-  server.listenHttp(kj::mv(pipe.ends[0])).wait(io.waitScope);
+      size_t n = kj::min(pending.size() - drained, output.size());
+      memcpy(output.begin(), pending.begin() + drained, n);
+      output = output.slice(n, output.size());
+      drained += n;
+      if (drained < pending.size()) return false;
 
-  // Closes the connection without sending anything.
-  KJ_EXPECT(pipe.ends[1]->readAllText().wait(io.waitScope) == "");
-}
+      pending.clear();
+      drained = 0;
+      flushQueued = false;
+      return true;
+    }
 
-KJ_TEST("HttpServer pipeline timeout") {
-  auto PIPELINE_TESTS = pipelineTestCases();
+  private:
+    kj::Vector<byte> pending;
+    size_t drained = 0;
+    bool flushQueued = false;
+
+    void addBlock(bool final, ArrayPtr<const byte> data) {
+      uint len = data.size();
+      pending.add(final);
+      pending.add(len);
+      pending.add(len >> 8);
+      pending.add(~len);
+      pending.add(~len >> 8);
+      pending.addAll(data);
+    }
+  };
+
+  class Decoder final: public Decompressor {
+  public:
+    bool decompress(ArrayPtr<const byte>& input, ArrayPtr<byte>& output) override {
+      for (;;) {
+        if (remaining == 0) {
+          while (headerSize < 5 && input.size() > 0) {
+            header[headerSize++] = input[0];
+            input = input.slice(1, input.size());
+          }
+          if (headerSize < 5) return headerSize == 0;
+          KJ_REQUIRE(header[0] <= 1, "not a stored block");
+          remaining = header[1] | (header[2] << 8);
+          KJ_REQUIRE((remaining ^ (header[3] | (header[4] << 8))) == 0xffff, "bad block length");
+          headerSize = 0;
+          continue;
+        }
+
+        size_t n = kj::min(remaining, kj::min(input.size(), output.size()));
+        if (n == 0) return false;
+        memcpy(output.begin(), input.begin(), n);
+        input = input.slice(n, input.size());
+        output = output.slice(n, output.size());
+        remaining -= n;
+      }
+    }
+
+  private:
+    byte header[5];
+    uint headerSize = 0;
+    size_t remaining = 0;
+  };
+};
+
+KJ_TEST("HttpServer WebSocket permessage-deflate") {
+  auto io = kj::setupAsyncIo();
+  auto pipe = io.provider->newTwoWayPipe();
+
+  HttpHeaderTable::Builder tableBuilder;
+  HttpHeaderId hMyHeader = tableBuilder.add("My-Header");
+  auto headerTable = tableBuilder.build();
+  TestWebSocketService service(*headerTable, hMyHeader);
+  StoredDeflateCodec codec;
+  HttpServerSettings settings;
+  settings.webSocketCompression.codec = &codec;
+  HttpServer server(io.provider->getTimer(), *headerTable, service, settings);
+
+  auto listenTask = server.listenHttp(kj::mv(pipe.ends[0]));
+
+  auto request = kj::str(
+      "GET /ws-inline HTTP/1.1\r\n"
+      "Connection: Upgrade\r\n"
+      "Upgrade: websocket\r\n"
+      "Sec-WebSocket-Key: DCI4TgwiOE4MIjhODCI4Tg==\r\n"
+      "Sec-WebSocket-Version: 13\r\n"
+      "Sec-WebSocket-Extensions: x-unknown, permessage-deflate; client_max_window_bits\r\n"
+      "\r\n");
+  pipe.ends[1]->write({request.asBytes()}).wait(io.waitScope);
+  expectRead(*pipe.ends[1],
+      "HTTP/1.1 101 Switching Protocols\r\n"
+      "Connection: Upgrade\r\n"
+      "Upgrade: websocket\r\n"
+      "Sec-WebSocket-Accept: pShtIFKT0s8RYZvnWY/CrjQD8CM=\r\n"
+      "Sec-WebSocket-Extensions: permessage-deflate\r\n"
+      "\r\n").wait(io.waitScope);
+
+  // RSV1 is set and the trailing 00 00 ff ff of the sync flush is stripped.
+  const byte FIRST_MESSAGE[] = {
+    0xc1, 0x12, 0x00, 0x0c, 0x00, 0xf3, 0xff,
+    's','t','a','r','t','-','i','n','l','i','n','e', 0x00
+  };
+  expectRead(*pipe.ends[1], FIRST_MESSAGE).wait(io.waitScope);
+
+  // The example from RFC 7692 section 7.2.3.3: "Hello" in a stored block.
+  const byte HELLO[] = { 0xc1, 0x0b, 0x00, 0x05, 0x00, 0xfa, 0xff, 'H','e','l','l','o', 0x00 };
+  const byte REPLY[] = {
+    0xc1, 0x11, 0x00, 0x0b, 0x00, 0xf4, 0xff, 'r','e','p','l','y',':','H','e','l','l','o', 0x00
+  };
+  pipe.ends[1]->write(HELLO, sizeof(HELLO)).wait(io.waitScope);
+  expectRead(*pipe.ends[1], REPLY).wait(io.waitScope);
+
+  // Fragmented, with RSV1 on the first frame only.
+  const byte FRAGMENTED_HELLO[] = {
+    0x41, 0x03, 0x00, 0x05, 0x00,
+    0x80, 0x08, 0xfa, 0xff, 'H','e','l','l','o', 0x00
+  };
+  pipe.ends[1]->write(FRAGMENTED_HELLO, sizeof(FRAGMENTED_HELLO)).wait(io.waitScope);
+  expectRead(*pipe.ends[1], REPLY).wait(io.waitScope);
+
+  // Control frames are never compressed.
+  pipe.ends[1]->write({WEBSOCKET_SEND_CLOSE}).wait(io.waitScope);
+  expectRead(*pipe.ends[1], WEBSOCKET_REPLY_CLOSE).wait(io.waitScope);
+
+  listenTask.wait(io.waitScope);
+
+  // Context takeover is the default, so one context served every message.
+  KJ_EXPECT(codec.compressorCount == 1);
+  KJ_EXPECT(codec.decompressorCount == 1);
+}
+
+KJ_TEST("HttpServer WebSocket permessage-deflate inflation limit") {
+  auto io = kj::setupAsyncIo();
+  auto pipe = io.provider->newTwoWayPipe();
+
+  HttpHeaderTable::Builder tableBuilder;
+  HttpHeaderId hMyHeader = tableBuilder.add("My-Header");
+  auto headerTable = tableBuilder.build();
+  TestWebSocketService service(*headerTable, hMyHeader);
+  StoredDeflateCodec codec;
+  HttpServerSettings settings;
+  settings.webSocketCompression.codec = &codec;
+  settings.webSocketCompression.maxInflatedMessageSize = 8;
+  HttpServer server(io.provider->getTimer(), *headerTable, service, settings);
+
+  auto listenTask = server.listenHttp(kj::mv(pipe.ends[0]));
+
+  auto request = kj::str(
+      "GET /ws-inline HTTP/1.1\r\n"
+      "Connection: Upgrade\r\n"
+      "Upgrade: websocket\r\n"
+      "Sec-WebSocket-Key: DCI4TgwiOE4MIjhODCI4Tg==\r\n"
+      "Sec-WebSocket-Version: 13\r\n"
+      "Sec-WebSocket-Extensions: permessage-deflate\r\n"
+      "\r\n");
+  pipe.ends[1]->write({request.asBytes()}).wait(io.waitScope);
+  expectRead(*pipe.ends[1],
+      "HTTP/1.1 101 Switching Protocols\r\n"
+      "Connection: Upgrade\r\n"
+      "Upgrade: websocket\r\n"
+      "Sec-WebSocket-Accept: pShtIFKT0s8RYZvnWY/CrjQD8CM=\r\n"
+      "Sec-WebSocket-Extensions: permessage-deflate\r\n"
+      "\r\n").wait(io.waitScope);
+  const byte FIRST_MESSAGE[] = {
+    0xc1, 0x12, 0x00, 0x0c, 0x00, 0xf3, 0xff,
+    's','t','a','r','t','-','i','n','l','i','n','e', 0x00
+  };
+  expectRead(*pipe.ends[1], FIRST_MESSAGE).wait(io.waitScope);
+
+  // A message exactly at the limit is fine.
+  const byte EIGHT[] = {
+    0xc1, 0x0e, 0x00, 0x08, 0x00, 0xf7, 0xff, 'H','e','l','l','o','!','!','!', 0x00
+  };
+  const byte EIGHT_REPLY[] = {
+    0xc1, 0x14, 0x00, 0x0e, 0x00, 0xf1, 0xff,
+    'r','e','p','l','y',':','H','e','l','l','o','!','!','!', 0x00
+  };
+  pipe.ends[1]->write(EIGHT, sizeof(EIGHT)).wait(io.waitScope);
+  expectRead(*pipe.ends[1], EIGHT_REPLY).wait(io.waitScope);
+
+  // "Hello, world" is 12 bytes inflated, over the limit of 8, even though its frame is small.
+  const byte HELLO_WORLD[] = {
+    0xc1, 0x12, 0x00, 0x0c, 0x00, 0xf3, 0xff,
+    'H','e','l','l','o',',',' ','w','o','r','l','d', 0x00
+  };
+  pipe.ends[1]->write(HELLO_WORLD, sizeof(HELLO_WORLD)).wait(io.waitScope);
+
+  const byte CLOSE_TOO_BIG[] = {
+    0x88, 0x11, 0x03, 0xf1, 'M','e','s','s','a','g','e',' ','T','o','o',' ','B','i','g'
+  };
+  expectRead(*pipe.ends[1], CLOSE_TOO_BIG).wait(io.waitScope);
+}
+
+KJ_TEST("HttpServer WebSocket permessage-deflate declined") {
+  auto io = kj::setupAsyncIo();
+  auto pipe = io.provider->newTwoWayPipe();
+
+  HttpHeaderTable::Builder tableBuilder;
+  HttpHeaderId hMyHeader = tableBuilder.add("My-Header");
+  auto headerTable = tableBuilder.build();
+  TestWebSocketService service(*headerTable, hMyHeader);
+  StoredDeflateCodec codec;
+  HttpServerSettings settings;
+  settings.webSocketCompression.codec = &codec;
+  HttpServer server(io.provider->getTimer(), *headerTable, service, settings);
+
+  auto listenTask = server.listenHttp(kj::mv(pipe.ends[0]));
+
+  // Our codec can't shrink its window, and the other offer has an unknown parameter.
+  auto request = kj::str(
+      "GET /ws-inline HTTP/1.1\r\n"
+      "Connection: Upgrade\r\n"
+      "Upgrade: websocket\r\n"
+      "Sec-WebSocket-Key: DCI4TgwiOE4MIjhODCI4Tg==\r\n"
+      "Sec-WebSocket-Version: 13\r\n"
+      "Sec-WebSocket-Extensions: permessage-deflate; server_max_window_bits=10, "
+          "permessage-deflate; x-unknown\r\n"
+      "My-Header: foo\r\n"
+      "\r\n");
+  pipe.ends[1]->write({request.asBytes()}).wait(io.waitScope);
+  expectRead(*pipe.ends[1], WEBSOCKET_RESPONSE_HANDSHAKE).wait(io.waitScope);
+  expectRead(*pipe.ends[1], WEBSOCKET_FIRST_MESSAGE_INLINE).wait(io.waitScope);
+
+  pipe.ends[1]->write({WEBSOCKET_SEND_MESSAGE}).wait(io.waitScope);
+  expectRead(*pipe.ends[1], WEBSOCKET_REPLY_MESSAGE).wait(io.waitScope);
+  pipe.ends[1]->write({WEBSOCKET_SEND_CLOSE}).wait(io.waitScope);
+  expectRead(*pipe.ends[1], WEBSOCKET_REPLY_CLOSE).wait(io.waitScope);
+
+  listenTask.wait(io.waitScope);
+  KJ_EXPECT(codec.compressorCount == 0);
+
+  // Without negotiation, RSV1 is a protocol error.
+  auto rawPipe = io.provider->newTwoWayPipe();
+  auto ws = newWebSocket(kj::mv(rawPipe.ends[0]), nullptr);
+  const byte COMPRESSED[] = { 0xc1, 0x01, 0x00 };
+  rawPipe.ends[1]->write(COMPRESSED, sizeof(COMPRESSED)).wait(io.waitScope);
+  KJ_EXPECT_THROW_MESSAGE("compression wasn't negotiated", ws->receive().wait(io.waitScope));
+}
+
+KJ_TEST("HttpClient WebSocket permessage-deflate") {
+  auto io = kj::setupAsyncIo();
+  auto pipe = io.provider->newTwoWayPipe();
+
+  HttpHeaderTable::Builder tableBuilder;
+  HttpHeaderId hMyHeader = tableBuilder.add("My-Header");
+  auto headerTable = tableBuilder.build();
+
+  TestWebSocketService service(*headerTable, hMyHeader);
+  StoredDeflateCodec serverCodec;
+  HttpServerSettings serverSettings;
+  serverSettings.webSocketCompression.codec = &serverCodec;
+  HttpServer server(io.provider->getTimer(), *headerTable, service, serverSettings);
+  auto listenTask = server.listenHttp(kj::mv(pipe.ends[0]));
+
+  FakeEntropySource entropySource;
+  StoredDeflateCodec clientCodec;
+  HttpClientSettings clientSettings;
+  clientSettings.entropySource = entropySource;
+  clientSettings.webSocketCompression.codec = &clientCodec;
+  clientSettings.webSocketCompression.contextTakeover = false;
+  auto client = newHttpClient(*headerTable, *pipe.ends[1], clientSettings);
+
+  kj::HttpHeaders headers(*headerTable);
+  auto response = client->openWebSocket("/ws-inline", headers).wait(io.waitScope);
+  KJ_EXPECT(response.statusCode == 101);
+  KJ_EXPECT(KJ_ASSERT_NONNULL(response.headers->get(HttpHeaderId::SEC_WEBSOCKET_EXTENSIONS)) ==
+            "permessage-deflate; client_no_context_takeover");
+  auto ws = kj::mv(response.webSocketOrBody.get<kj::Own<WebSocket>>());
+
+  byte buffer[32];
+  {
+    auto message = ws->receiveInto(buffer).wait(io.waitScope);
+    KJ_ASSERT(message.is<kj::ArrayPtr<char>>());
+    KJ_EXPECT(kj::heapString(message.get<kj::ArrayPtr<char>>()) == "start-inline");
+  }
+
+  for (auto i: kj::zeroTo(3)) {
+    (void)i;
+    ws->send(kj::StringPtr("bar")).wait(io.waitScope);
+    auto message = ws->receive().wait(io.waitScope);
+    KJ_ASSERT(message.is<kj::String>());
+    KJ_EXPECT(message.get<kj::String>() == "reply:bar");
+  }
+
+  // A compressed message is checked against the buffer once inflated.
+  ws->send(kj::StringPtr("0123456789012345678901234567")).wait(io.waitScope);
+  KJ_EXPECT_THROW_MESSAGE("larger than the receive buffer",
+      ws->receiveInto(buffer).wait(io.waitScope));
+
+  // We asked not to keep context, so each message got a fresh compressor.
+  KJ_EXPECT(clientCodec.compressorCount == 4);
+  KJ_EXPECT(clientCodec.decompressorCount == 1);
+  KJ_EXPECT(serverCodec.decompressorCount == 4);
+}
+
+// -----------------------------------------------------------------------------
+
+KJ_TEST("HttpServer request timeout") {
+  auto PIPELINE_TESTS = pipelineTestCases();
+
+  auto io = kj::setupAsyncIo();
+  auto pipe = io.provider->newTwoWayPipe();
+
+  HttpHeaderTable table;
+  TestHttpService service(PIPELINE_TESTS, table);
+  HttpServerSettings settings;
+  settings.headerTimeout = 1 * kj::MILLISECONDS;
+  HttpServer server(io.provider->getTimer(), table, service, settings);
+
+  // Shouldn't hang! Should time out.
+  server.listenHttp(kj::mv(pipe.ends[0])).wait(io.waitScope);
+
+  // Closes the connection without sending anything.
+  KJ_EXPECT(pipe.ends[1]->readAllText().wait(io.waitScope) == "");
+}
+
+KJ_TEST("HttpServer pipeline timeout") {
+  auto PIPELINE_TESTS = pipelineTestCases();
 
   auto io = kj::setupAsyncIo();
   auto pipe = io.provider->newTwoWayPipe();
@@ -1975,6 +2803,260 @@ KJ_TEST("HttpServer pipeline timeout") {
   KJ_EXPECT(pipe.ends[1]->readAllText().wait(io.waitScope) == "");
 }
 
+KJ_TEST("HttpServer releases idle buffers") {
+  auto PIPELINE_TESTS = pipelineTestCases();
+
+  auto io = kj::setupAsyncIo();
+  auto pipe = io.provider->newTwoWayPipe();
+
+  HttpHeaderTable table;
+  TestHttpService service(PIPELINE_TESTS, table);
+  HttpServerSettings settings;
+  settings.releaseIdleBuffers = true;
+  HttpServer server(io.provider->getTimer(), table, service, settings);
+
+  auto listenTask = server.listenHttp(kj::mv(pipe.ends[0]));
+
+  // No buffer until the first request arrives.
+  io.waitScope.poll();
+  KJ_EXPECT(server.getBufferStats().bytesAllocated == 0);
+
+  for (auto& testCase: PIPELINE_TESTS) {
+    pipe.ends[1]->write(testCase.request.raw.begin(), testCase.request.raw.size())
+        .wait(io.waitScope);
+    expectRead(*pipe.ends[1], testCase.response.raw).wait(io.waitScope);
+
+    // Between requests, the one buffer sits in the pool.
+    io.waitScope.poll();
+    auto stats = server.getBufferStats();
+    KJ_EXPECT(stats.buffersInUse == 0, stats.buffersInUse);
+    KJ_EXPECT(stats.buffersPooled == 1, stats.buffersPooled);
+  }
+
+  // Pipelined requests are read out of the buffer without giving it back in between.
+  auto allRequestText =
+      kj::strArray(KJ_MAP(testCase, PIPELINE_TESTS) { return testCase.request.raw; }, "");
+  auto allResponseText =
+      kj::strArray(KJ_MAP(testCase, PIPELINE_TESTS) { return testCase.response.raw; }, "");
+  pipe.ends[1]->write(allRequestText.begin(), allRequestText.size()).wait(io.waitScope);
+  pipe.ends[1]->shutdownWrite();
+
+  listenTask.wait(io.waitScope);
+
+  auto text = pipe.ends[1]->readAllText().wait(io.waitScope);
+  KJ_EXPECT(text == allResponseText, text);
+
+  auto stats = server.getBufferStats();
+  KJ_EXPECT(stats.buffersInUse == 0, stats.buffersInUse);
+  KJ_EXPECT(stats.peakBytesAllocated == 4096, stats.peakBytesAllocated);
+  KJ_EXPECT(stats.idleReleases >= PIPELINE_TESTS.size(), stats.idleReleases);
+}
+
+KJ_TEST("HttpServer buffer memory budget") {
+  auto PIPELINE_TESTS = pipelineTestCases();
+
+  auto io = kj::setupAsyncIo();
+
+  HttpHeaderTable table;
+  TestHttpService service(PIPELINE_TESTS[0].request, PIPELINE_TESTS[0].response, table);
+  HttpServerSettings settings;
+  settings.bufferMemoryBudget = 4096;
+  HttpServer server(io.provider->getTimer(), table, service, settings);
+
+  auto& request = PIPELINE_TESTS[0].request.raw;
+
+  // The first connection takes the whole budget, and keeps it while idle.
+  auto pipe1 = io.provider->newTwoWayPipe();
+  auto listenTask1 = server.listenHttp(kj::mv(pipe1.ends[0]));
+  pipe1.ends[1]->write(request.begin(), request.size()).wait(io.waitScope);
+  expectRead(*pipe1.ends[1], PIPELINE_TESTS[0].response.raw).wait(io.waitScope);
+
+  // The second is turned away.
+  {
+    auto pipe2 = io.provider->newTwoWayPipe();
+    auto listenTask2 = server.listenHttp(kj::mv(pipe2.ends[0]));
+    pipe2.ends[1]->write(request.begin(), request.size()).wait(io.waitScope);
+    listenTask2.wait(io.waitScope);
+
+    // Only the start of the request was read, so the close may be reported as a reset once the
+    // response has been received.
+    expectRead(*pipe2.ends[1], "HTTP/1.1 503 Service Unavailable\r\nConnection: close\r\n")
+        .wait(io.waitScope);
+  }
+  KJ_EXPECT(server.getBufferStats().connectionsShed == 1);
+
+  // Once the first closes, its buffer can be reused.
+  pipe1.ends[1]->shutdownWrite();
+  listenTask1.wait(io.waitScope);
+
+  auto pipe3 = io.provider->newTwoWayPipe();
+  auto listenTask3 = server.listenHttp(kj::mv(pipe3.ends[0]));
+  pipe3.ends[1]->write(request.begin(), request.size()).wait(io.waitScope);
+  pipe3.ends[1]->shutdownWrite();
+  listenTask3.wait(io.waitScope);
+  KJ_EXPECT(pipe3.ends[1]->readAllText().wait(io.waitScope) == PIPELINE_TESTS[0].response.raw);
+
+  auto stats = server.getBufferStats();
+  KJ_EXPECT(stats.connectionsShed == 1, stats.connectionsShed);
+  KJ_EXPECT(stats.peakBytesAllocated == 4096, stats.peakBytesAllocated);
+}
+
+class SlowHttpService final: public HttpService {
+  // Reads the request body, waits 3ms before responding, then 2ms after writing the response.
+public:
+  SlowHttpService(kj::Timer& timer, HttpHeaderTable& table): timer(timer), table(table) {}
+
+  kj::Promise<void> request(
+      HttpMethod method, kj::StringPtr url, const HttpHeaders& headers,
+      kj::AsyncInputStream& requestBody, Response& response) override {
+    return requestBody.readAllBytes().then([this](kj::Array<byte>&&) {
+      return timer.afterDelay(3 * kj::MILLISECONDS);
+    }).then([this,&response]() {
+      auto stream = response.send(200, "OK", HttpHeaders(table), 2);
+      auto promise = stream->write("ok", 2);
+      return promise.attach(kj::mv(stream));
+    }).then([this]() {
+      return timer.afterDelay(2 * kj::MILLISECONDS);
+    });
+  }
+
+private:
+  kj::Timer& timer;
+  HttpHeaderTable& table;
+};
+
+class RecordingObserver final: public HttpServerObserver {
+public:
+  kj::Vector<kj::String> events;
+
+  void connectionAccepted(kj::TimePoint time) override {
+    events.add(kj::str("accepted ", ms(time)));
+  }
+
+  kj::Own<Request> requestStarted(
+      HttpMethod method, kj::StringPtr url, const HttpHeaders& headers,
+      kj::TimePoint firstByteTime, kj::TimePoint headersTime) override {
+    events.add(kj::str("request ", method, " ", url, " ", ms(firstByteTime), " ",
+                       ms(headersTime)));
+    return kj::heap<RecordingRequest>(*this);
+  }
+
+private:
+  class RecordingRequest final: public Request {
+  public:
+    explicit RecordingRequest(RecordingObserver& parent): parent(parent) {}
+    ~RecordingRequest() noexcept(false) { parent.events.add(kj::str("dropped")); }
+
+    void handlerStarted(kj::TimePoint time) override {
+      parent.events.add(kj::str("handler ", ms(time)));
+    }
+    void requestBodyRead(size_t bytes) override {
+      parent.events.add(kj::str("read ", bytes));
+    }
+    void responseStarted(uint statusCode, kj::TimePoint time) override {
+      parent.events.add(kj::str("response ", statusCode, " ", ms(time)));
+    }
+    void responseBodyWritten(size_t bytes, kj::Duration blocked) override {
+      parent.events.add(kj::str("written ", bytes));
+    }
+    void handlerReturned(kj::TimePoint time) override {
+      parent.events.add(kj::str("returned ", ms(time)));
+    }
+    void responseCompleted(kj::TimePoint time) override {
+      parent.events.add(kj::str("completed ", ms(time)));
+    }
+
+  private:
+    RecordingObserver& parent;
+  };
+
+  static int64_t ms(kj::TimePoint time) {
+    return (time - kj::origin<kj::TimePoint>()) / kj::MILLISECONDS;
+  }
+};
+
+KJ_TEST("HttpServer observer") {
+  auto io = kj::setupAsyncIo();
+
+  kj::TimerImpl timer(kj::origin<kj::TimePoint>());
+  HttpHeaderTable table;
+  SlowHttpService service(timer, table);
+
+  auto serve = [&](HttpServerObserver& observer) {
+    HttpServerSettings settings;
+    settings.observer = &observer;
+    HttpServer server(timer, table, service, settings);
+
+    auto pipe = io.provider->newTwoWayPipe();
+    auto listenTask = server.listenHttp(kj::mv(pipe.ends[0]));
+
+    timer.advanceTo(timer.now() + 1 * kj::MILLISECONDS);
+    kj::StringPtr request = "POST / HTTP/1.1\r\nContent-Length: 3\r\n\r\nabc";
+    pipe.ends[1]->write(request.begin(), request.size()).wait(io.waitScope);
+    pipe.ends[1]->shutdownWrite();
+
+    io.waitScope.poll();
+    timer.advanceTo(timer.now() + 3 * kj::MILLISECONDS);
+    io.waitScope.poll();
+    timer.advanceTo(timer.now() + 2 * kj::MILLISECONDS);
+    listenTask.wait(io.waitScope);
+
+    KJ_EXPECT(pipe.ends[1]->readAllText().wait(io.waitScope) ==
+        "HTTP/1.1 200 OK\r\nContent-Length: 2\r\n\r\nok");
+  };
+
+  {
+    RecordingObserver observer;
+    serve(observer);
+    KJ_EXPECT(kj::strArray(observer.events, ", ") ==
+        "accepted 0, request POST / 1 1, handler 1, read 3, response 200 4, written 2, "
+        "returned 6, completed 6, dropped", kj::strArray(observer.events, ", "));
+  }
+
+  {
+    HttpServerHistogramObserver observer;
+    serve(observer);
+    serve(observer);
+
+    KJ_EXPECT(observer.getConnectionCount() == 2);
+    KJ_EXPECT(observer.getRequestCount() == 2);
+    KJ_EXPECT(observer.getRequestBodyBytes() == 6);
+    KJ_EXPECT(observer.getResponseBodyBytes() == 4);
+    KJ_EXPECT(observer.getHeaderTimes().getSum() == 0 * kj::MILLISECONDS);
+    KJ_EXPECT(observer.getHandlerTimes().getSum() == 6 * kj::MILLISECONDS);
+    KJ_EXPECT(observer.getBodyTimes().getSum() == 4 * kj::MILLISECONDS);
+    KJ_EXPECT(observer.getFlushTimes().getSum() == 0 * kj::MILLISECONDS);
+    KJ_EXPECT(observer.getTotalTimes().getSum() == 10 * kj::MILLISECONDS);
+    KJ_EXPECT(observer.getTotalTimes().getMax() == 5 * kj::MILLISECONDS);
+
+    // 5ms falls in the bucket for [4096us, 8192us).
+    KJ_EXPECT(observer.getTotalTimes().getBuckets()[13] == 2);
+  }
+
+  {
+    HttpServerHistogramObserver::Histogram histogram;
+    KJ_EXPECT(histogram.getPercentile(0.5) == 0 * kj::NANOSECONDS);
+
+    histogram.add(0 * kj::MICROSECONDS);
+    histogram.add(1 * kj::MICROSECONDS);
+    histogram.add(3 * kj::MICROSECONDS);
+    histogram.add(1000 * kj::MICROSECONDS);
+
+    auto buckets = histogram.getBuckets();
+    KJ_EXPECT(buckets[0] == 1);
+    KJ_EXPECT(buckets[1] == 1);
+    KJ_EXPECT(buckets[2] == 1);
+    KJ_EXPECT(buckets[10] == 1);
+    KJ_EXPECT(histogram.getPercentile(0.5) == 2 * kj::MICROSECONDS);
+    KJ_EXPECT(histogram.getPercentile(0.75) == 4 * kj::MICROSECONDS);
+    KJ_EXPECT(histogram.getPercentile(1) == 1000 * kj::MICROSECONDS);
+
+    histogram.add(1 * kj::DAYS);
+    auto lastBucket = HttpServerHistogramObserver::Histogram::BUCKET_COUNT - 1;
+    KJ_EXPECT(histogram.getBuckets()[lastBucket] == 1);
+  }
+}
+
 class BrokenHttpService final: public HttpService {
   // HttpService that doesn't send a response.
 public:
@@ -2264,6 +3346,72 @@ KJ_TEST("newHttpService from HttpClient") {
   writeResponsesPromise.wait(io.waitScope);
 }
 
+class PumpEchoService final: public HttpService {
+  // Echoes the request body by pumping it straight into the response body.
+
+public:
+  PumpEchoService(HttpHeaderTable& headerTable): headerTable(headerTable) {}
+
+  kj::Promise<void> request(
+      HttpMethod method, kj::StringPtr url, const HttpHeaders& headers,
+      kj::AsyncInputStream& requestBody, Response& response) override {
+    HttpHeaders responseHeaders(headerTable);
+    auto body = response.send(200, "OK", responseHeaders, requestBody.tryGetLength());
+    auto promise = requestBody.pumpTo(*body);
+    return promise.ignoreResult().attach(kj::mv(body));
+  }
+
+private:
+  HttpHeaderTable& headerTable;
+};
+
+KJ_TEST("newHttpService from HttpClient pumps large bodies") {
+  // Bodies much larger than the connection's read buffer go client -> proxy -> backend and back,
+  // which on Linux lets the proxy and backend splice() between sockets. Both fixed-length and
+  // chunked framing must survive that.
+
+  auto io = kj::setupAsyncIo();
+  auto frontPipe = io.provider->newTwoWayPipe();
+  auto backPipe = io.provider->newTwoWayPipe();
+
+  HttpHeaderTable table;
+  PumpEchoService backService(table);
+  HttpServer backServer(io.provider->getTimer(), table, backService);
+  auto backListenTask = backServer.listenHttp(kj::mv(backPipe.ends[1]));
+
+  auto backClient = newHttpClient(table, *backPipe.ends[0]);
+  auto frontService = newHttpService(*backClient);
+  HttpServer frontServer(io.provider->getTimer(), table, *frontService);
+  auto frontListenTask = frontServer.listenHttp(kj::mv(frontPipe.ends[1]));
+
+  auto client = newHttpClient(table, *frontPipe.ends[0]);
+
+  constexpr size_t SIZE = 1 << 21;
+  auto data = kj::heapArray<byte>(SIZE);
+  for (size_t i = 0; i < SIZE; i++) {
+    data[i] = i * 7 + i / 1000;
+  }
+
+  for (bool chunked: {false, true}) {
+    KJ_CONTEXT(chunked);
+    HttpHeaders headers(table);
+    auto request = client->request(HttpMethod::POST, "/", headers,
+        chunked ? kj::Maybe<uint64_t>(nullptr) : kj::Maybe<uint64_t>(SIZE));
+    auto writePromise = request.body->write(data.begin(), data.size())
+        .attach(kj::mv(request.body)).eagerlyEvaluate(nullptr);
+
+    auto response = request.response.wait(io.waitScope);
+    KJ_EXPECT(response.statusCode == 200);
+    if (!chunked) {
+      KJ_EXPECT(KJ_ASSERT_NONNULL(response.body->tryGetLength()) == SIZE);
+    }
+    auto received = response.body->readAllBytes().wait(io.waitScope);
+    writePromise.wait(io.waitScope);
+    KJ_EXPECT(received.size() == SIZE);
+    KJ_EXPECT(received == data);
+  }
+}
+
 KJ_TEST("newHttpService from HttpClient WebSockets") {
   auto io = kj::setupAsyncIo();
   auto frontPipe = io.provider->newTwoWayPipe();
@@ -2620,6 +3768,168 @@ KJ_TEST("HttpClient connection management") {
   KJ_EXPECT(count == 1);
 }
 
+KJ_TEST("HttpClient connection pool limits") {
+  auto io = kj::setupAsyncIo();
+
+  kj::TimerImpl serverTimer(kj::origin<kj::TimePoint>());
+  kj::TimerImpl clientTimer(kj::origin<kj::TimePoint>());
+  HttpHeaderTable headerTable;
+
+  auto listener = io.provider->getNetwork().parseAddress("localhost", 0)
+      .wait(io.waitScope)->listen();
+  DummyService service(headerTable);
+  HttpServer server(serverTimer, headerTable, service);
+  auto listenTask = server.listenHttp(*listener);
+
+  auto addr = io.provider->getNetwork().parseAddress("localhost", listener->getPort())
+      .wait(io.waitScope);
+  uint count = 0;
+  CountingNetworkAddress countingAddr(*addr, count);
+
+  HttpClientPoolStats stats;
+  HttpClientSettings clientSettings;
+  clientSettings.maxConnections = 2;
+  clientSettings.maxPendingRequests = 2;
+  clientSettings.poolStats = stats;
+  auto client = newHttpClient(clientTimer, headerTable, countingAddr, clientSettings);
+
+  auto get = [&](kj::StringPtr url) {
+    return client->request(HttpMethod::GET, url, HttpHeaders(headerTable)).response;
+  };
+  auto readBody = [&](HttpClient::Response response) {
+    return response.body->readAllText().wait(io.waitScope);
+  };
+
+  // Hold two connections busy by not reading their response bodies.
+  auto resp1 = get("/1").wait(io.waitScope);
+  auto resp2 = get("/2").wait(io.waitScope);
+  KJ_EXPECT(count == 2);
+  KJ_EXPECT(stats.activeConnections == 2);
+  KJ_EXPECT(stats.connectionsOpened == 2);
+
+  // Further requests queue, in order, and a POST's body can be written while it waits.
+  auto req3 = client->request(
+      HttpMethod::POST, "/3", HttpHeaders(headerTable), size_t(3));
+  auto writePromise = req3.body->write("foo", 3);
+  auto promise4 = get("/4");
+  io.waitScope.poll();
+  KJ_EXPECT(stats.queuedRequests == 2);
+  KJ_EXPECT(!req3.response.poll(io.waitScope));
+
+  // The queue is full.
+  KJ_EXPECT_THROW_MESSAGE("too many HTTP requests waiting", get("/5"));
+  KJ_EXPECT(stats.requestsRejected == 1);
+
+  // Releasing a connection hands it to the first waiter, without connecting again.
+  KJ_EXPECT(readBody(kj::mv(resp1)) == "null:/1");
+  writePromise.wait(io.waitScope);
+  req3.body = nullptr;
+  KJ_EXPECT(readBody(req3.response.wait(io.waitScope)) == "null:/3");
+  KJ_EXPECT(stats.queuedRequests == 0);
+  KJ_EXPECT(readBody(promise4.wait(io.waitScope)) == "null:/4");
+  KJ_EXPECT(count == 2);
+  KJ_EXPECT(stats.connectionsOpened == 2);
+
+  // A canceled waiter leaves the queue.
+  auto resp6 = get("/6").wait(io.waitScope);
+  {
+    auto canceled = get("/canceled");
+    io.waitScope.poll();
+    KJ_EXPECT(stats.queuedRequests == 1);
+  }
+  KJ_EXPECT(stats.queuedRequests == 0);
+  KJ_EXPECT(readBody(kj::mv(resp6)) == "null:/6");
+  KJ_EXPECT(readBody(kj::mv(resp2)) == "null:/2");
+
+  io.waitScope.poll();
+  KJ_EXPECT(stats.activeConnections == 0);
+  KJ_EXPECT(stats.idleConnections == 2);
+  KJ_EXPECT(stats.connectFailures == 0);
+  KJ_EXPECT(stats.maxConnectTime <= stats.totalConnectTime);
+
+  client = nullptr;
+  KJ_EXPECT(stats.idleConnections == 0);
+}
+
+KJ_TEST("HttpClient connection pool rejects waiters on destruction") {
+  auto io = kj::setupAsyncIo();
+
+  kj::TimerImpl clientTimer(kj::origin<kj::TimePoint>());
+  HttpHeaderTable headerTable;
+
+  auto addr = io.provider->getNetwork().parseAddress("localhost", 1).wait(io.waitScope);
+
+  HttpClientPoolStats stats;
+  HttpClientSettings clientSettings;
+  clientSettings.maxConnections = 0;
+  clientSettings.poolStats = stats;
+  auto client = newHttpClient(clientTimer, headerTable, *addr, clientSettings);
+
+  // With no connections allowed, every request waits in line.
+  auto promise1 = client->request(HttpMethod::GET, "/1", HttpHeaders(headerTable)).response;
+  auto promise2 = client->openWebSocket("/2", HttpHeaders(headerTable));
+  io.waitScope.poll();
+  KJ_EXPECT(stats.queuedRequests == 2);
+
+  client = nullptr;
+  KJ_EXPECT(stats.queuedRequests == 0);
+  KJ_EXPECT_THROW_MESSAGE("destroyed while request was waiting", promise1.wait(io.waitScope));
+  KJ_EXPECT_THROW_MESSAGE("destroyed while request was waiting", promise2.wait(io.waitScope));
+  KJ_EXPECT(stats.activeConnections == 0);
+}
+
+KJ_TEST("HttpClient connection pool pipelining") {
+  auto io = kj::setupAsyncIo();
+
+  kj::TimerImpl serverTimer(kj::origin<kj::TimePoint>());
+  kj::TimerImpl clientTimer(kj::origin<kj::TimePoint>());
+  HttpHeaderTable headerTable;
+
+  auto listener = io.provider->getNetwork().parseAddress("localhost", 0)
+      .wait(io.waitScope)->listen();
+  DummyService service(headerTable);
+  HttpServer server(serverTimer, headerTable, service);
+  auto listenTask = server.listenHttp(*listener);
+
+  auto addr = io.provider->getNetwork().parseAddress("localhost", listener->getPort())
+      .wait(io.waitScope);
+  uint count = 0;
+  CountingNetworkAddress countingAddr(*addr, count);
+
+  HttpClientPoolStats stats;
+  HttpClientSettings clientSettings;
+  clientSettings.maxConnections = 1;
+  clientSettings.maxPipelineDepth = 2;
+  clientSettings.poolStats = stats;
+  auto client = newHttpClient(clientTimer, headerTable, countingAddr, clientSettings);
+
+  auto resp1 = client->request(HttpMethod::GET, "/1", HttpHeaders(headerTable)).response
+      .wait(io.waitScope);
+
+  // A second GET is pipelined onto the busy connection rather than queued.
+  auto promise2 = client->request(HttpMethod::GET, "/2", HttpHeaders(headerTable)).response;
+  KJ_EXPECT(stats.pipelinedRequests == 1);
+  KJ_EXPECT(stats.queuedRequests == 0);
+
+  // The pipeline is now full, and POSTs are never pipelined, so these queue.
+  auto promise3 = client->request(HttpMethod::GET, "/3", HttpHeaders(headerTable)).response;
+  auto req4 = client->request(HttpMethod::POST, "/4", HttpHeaders(headerTable), size_t(0));
+  KJ_EXPECT(stats.queuedRequests == 2);
+
+  KJ_EXPECT(resp1.body->readAllText().wait(io.waitScope) == "null:/1");
+  resp1.body = nullptr;
+  auto resp2 = promise2.wait(io.waitScope);
+  KJ_EXPECT(resp2.body->readAllText().wait(io.waitScope) == "null:/2");
+  resp2.body = nullptr;
+  KJ_EXPECT(promise3.wait(io.waitScope).body->readAllText().wait(io.waitScope) == "null:/3");
+  KJ_EXPECT(req4.response.wait(io.waitScope).body->readAllText().wait(io.waitScope)
+      == "null:/4");
+
+  KJ_EXPECT(count == 1);
+  KJ_EXPECT(stats.connectionsOpened == 1);
+  KJ_EXPECT(stats.queuedRequests == 0);
+}
+
 KJ_TEST("HttpClient multi host") {
   auto io = kj::setupAsyncIo();
 
@@ -23,11 +23,10 @@
 #include "url.h"
 #include <kj/debug.h>
 #include <kj/parse/char.h>
-#include <unordered_map>
+#include <kj/map.h>
 #include <stdlib.h>
 #include <kj/encoding.h>
 #include <deque>
-#include <map>
 
 namespace kj {
 
@@ -511,8 +510,8 @@ kj::StringPtr HttpHeaderId::toString() const {
 namespace {
 
 struct HeaderNameHash {
-  size_t operator()(kj::StringPtr s) const {
-    size_t result = 5381;
+  uint hashCode(kj::StringPtr s) const {
+    uint result = 5381;
     for (byte b: s.asBytes()) {
       // Masking bit 0x20 makes our hash case-insensitive while conveniently avoiding any
       // collisions that would matter for header names.
@@ -521,7 +520,7 @@ struct HeaderNameHash {
     return result;
   }
 
-  bool operator()(kj::StringPtr a, kj::StringPtr b) const {
+  bool matches(kj::StringPtr a, kj::StringPtr b) const {
     // TODO(perf): I wonder if we can beat strcasecmp() by masking bit 0x20 from each byte. We'd
     //   need to prohibit one of the technically-legal characters '^' or '~' from header names
     //   since they'd otherwise be ambiguous, but otherwise there is no ambiguity.
@@ -539,7 +538,7 @@ struct HttpHeaderTable::IdsByNameMap {
   // TODO(perf): If we were cool we could maybe use a perfect hash here, since our hashtable is
   //   static once built.
 
-  std::unordered_map<kj::StringPtr, uint, HeaderNameHash, HeaderNameHash> map;
+  kj::HashMap<kj::StringPtr, uint, HeaderNameHash> map;
 };
 
 HttpHeaderTable::Builder::Builder()
@@ -548,29 +547,29 @@ HttpHeaderTable::Builder::Builder()
 HttpHeaderId HttpHeaderTable::Builder::add(kj::StringPtr name) {
   requireValidHeaderName(name);
 
-  auto insertResult = table->idsByName->map.insert(std::make_pair(name, table->namesById.size()));
-  if (insertResult.second) {
+  uint id = table->idsByName->map.findOrCreate(name, [&]() {
+    uint newId = table->namesById.size();
     table->namesById.add(name);
-  }
-  return HttpHeaderId(table, insertResult.first->second);
+    return decltype(table->idsByName->map)::Entry { name, newId };
+  });
+  return HttpHeaderId(table, id);
 }
 
 HttpHeaderTable::HttpHeaderTable()
     : idsByName(kj::heap<IdsByNameMap>()) {
 #define ADD_HEADER(id, name) \
   namesById.add(name); \
-  idsByName->map.insert(std::make_pair(name, BuiltinHeaderIndices::id));
+  idsByName->map.insert(name, BuiltinHeaderIndices::id);
   KJ_HTTP_FOR_EACH_BUILTIN_HEADER(ADD_HEADER);
 #undef ADD_HEADER
 }
 HttpHeaderTable::~HttpHeaderTable() noexcept(false) {}
 
 kj::Maybe<HttpHeaderId> HttpHeaderTable::stringToId(kj::StringPtr name) const {
-  auto iter = idsByName->map.find(name);
-  if (iter == idsByName->map.end()) {
-    return nullptr;
+  KJ_IF_MAYBE(id, idsByName->map.find(name)) {
+    return HttpHeaderId(this, *id);
   } else {
-    return HttpHeaderId(this, iter->second);
+    return nullptr;
   }
 }
 
@@ -991,6 +990,14 @@ kj::String HttpHeaders::toString() const {
   return serialize(nullptr, nullptr, nullptr, nullptr);
 }
 
+HttpPreparedHeaders::HttpPreparedHeaders(
+    uint statusCode, kj::StringPtr statusText, const HttpHeaders& headers)
+    : statusCode(statusCode), statusText(kj::heapString(statusText)), headers(headers.clone()) {
+  // Null connection headers override any the application set, just as in send().
+  kj::StringPtr noConnectionHeaders[CONNECTION_HEADERS_COUNT];
+  serialized = this->headers.serializeResponse(statusCode, this->statusText, noConnectionHeaders);
+}
+
 // =======================================================================================
 
 namespace {
@@ -999,16 +1006,45 @@ static constexpr size_t MIN_BUFFER = 4096;
 static constexpr size_t MAX_BUFFER = 65536;
 static constexpr size_t MAX_CHUNK_HEADER_SIZE = 32;
 
+class HeaderBufferPool {
+  // Source of header buffers for a server-side HttpInputStream. Implemented by
+  // HttpServer::BufferPool.
+
+public:
+  virtual kj::Maybe<kj::Array<char>> tryAllocate(size_t size) = 0;
+  // Returns a buffer of `size` bytes, or null if it would exceed the memory budget. The buffer goes
+  // back to the pool when dropped.
+
+  virtual bool shouldReleaseIdle() = 0;
+  // Whether a connection waiting for its next message should give its buffer back meanwhile.
+
+  virtual void noteIdleRelease() = 0;
+};
+
 class HttpInputStream {
 public:
-  explicit HttpInputStream(AsyncIoStream& inner, HttpHeaderTable& table)
-      : inner(inner), headerBuffer(kj::heapArray<char>(MIN_BUFFER)), headers(table) {
+  explicit HttpInputStream(AsyncIoStream& inner, HttpHeaderTable& table,
+                           kj::Maybe<HeaderBufferPool&> bufferPool = nullptr)
+      : inner(inner), bufferPool(bufferPool), headers(table) {
+    if (bufferPool == nullptr) {
+      headerBuffer = kj::heapArray<char>(MIN_BUFFER);
+    }
+    // Otherwise, we get a buffer from the pool once there's something to read.
   }
 
   bool canReuse() {
     return !broken && pendingMessageCount == 0;
   }
 
+  bool canPipeline() {
+    // Like canReuse() but permits reads that are still queued.
+    return !broken;
+  }
+
+  uint getPendingMessageCount() {
+    return pendingMessageCount;
+  }
+
   // ---------------------------------------------------------------------------
   // Stream locking: While an entity-body is being read, the body stream "locks" the underlying
   // HTTP stream. Once the entity-body is complete, we can read the next pipelined message.
@@ -1041,8 +1077,8 @@ public:
     // Used on the client to detect when idle connections are closed from the server end. (In this
     // case, the promise always returns false or is canceled.)
 
-    if (onMessageDone != nullptr) {
-      // We're still working on reading the previous body.
+    if (onMessageDone != nullptr || (pendingMessageCount > 0 && !broken)) {
+      // We're still working on reading the previous body, or a pipelined message is queued.
       auto fork = messageReadQueue.fork();
       messageReadQueue = fork.addBranch();
       return fork.addBranch().then([this]() {
@@ -1068,6 +1104,40 @@ public:
       return true;
     }
 
+    if (hasIdleByte) {
+      return true;
+    }
+
+    KJ_IF_MAYBE(pool, bufferPool) {
+      if (headerBuffer != nullptr && pool->shouldReleaseIdle()) {
+        // Nothing is buffered, and we may wait a long time for the next message, so give the
+        // buffer back. The parsed headers point into it.
+        headerBuffer = nullptr;
+        headers.clear();
+        pool->noteIdleRelease();
+      }
+
+      if (headerBuffer == nullptr) {
+        // Wait for one byte only; the buffer is acquired by tryAcquireBuffer() once it arrives.
+        return inner.tryRead(&idleByte, 1, 1).then([this](size_t amount) -> kj::Promise<bool> {
+          if (amount == 0) {
+            return false;
+          }
+          if (lineBreakBeforeNextHeader) {
+            if (idleByte == '\r') {
+              return awaitNextMessage();
+            } else if (idleByte == '\n') {
+              lineBreakBeforeNextHeader = false;
+              return awaitNextMessage();
+            }
+            lineBreakBeforeNextHeader = false;
+          }
+          hasIdleByte = true;
+          return true;
+        });
+      }
+    }
+
     return inner.tryRead(headerBuffer.begin(), 1, headerBuffer.size())
         .then([this](size_t amount) -> kj::Promise<bool> {
       if (amount > 0) {
@@ -1086,6 +1156,10 @@ public:
     auto promise = messageReadQueue
         .then(kj::mvCapture(paf.fulfiller, [this](kj::Own<kj::PromiseFulfiller<void>> fulfiller) {
       onMessageDone = kj::mv(fulfiller);
+      if (!tryAcquireBuffer()) {
+        return kj::Promise<kj::ArrayPtr<char>>(
+            KJ_EXCEPTION(OVERLOADED, "HTTP server buffer memory budget exhausted"));
+      }
       return readHeader(HeaderType::MESSAGE, 0, 0);
     }));
 
@@ -1138,6 +1212,7 @@ public:
   }
 
   inline const HttpHeaders& getHeaders() const { return headers; }
+  inline HttpHeaders& getHeaders() { return headers; }
 
   Promise<size_t> tryRead(void* buffer, size_t minBytes, size_t maxBytes) {
     // Read message body data.
@@ -1169,6 +1244,26 @@ public:
     }
   }
 
+  Promise<uint64_t> pumpBodyTo(AsyncOutputStream& output, uint64_t amount) {
+    // Pump message body data. Whatever we've already buffered goes first; after that, the inner
+    // stream pumps directly, so that e.g. socket-to-socket transfers can use the kernel's
+    // zero-copy paths.
+
+    KJ_REQUIRE(onMessageDone != nullptr);
+
+    if (leftover == nullptr) {
+      return inner.pumpTo(output, amount);
+    }
+
+    auto chunk = leftover.slice(0, kj::min(leftover.size(), amount));
+    leftover = leftover.slice(chunk.size(), leftover.size());
+    uint64_t n = chunk.size();
+    return output.write(chunk.begin(), n).then([this,&output,amount,n]() -> Promise<uint64_t> {
+      if (n == amount) return n;
+      return inner.pumpTo(output, amount - n).then([n](uint64_t actual) { return actual + n; });
+    });
+  }
+
   enum RequestOrResponse {
     REQUEST,
     RESPONSE
@@ -1187,9 +1282,36 @@ public:
     return { headerBuffer.releaseAsBytes(), leftover.asBytes() };
   }
 
+  bool tryAcquireBuffer() {
+    // Makes sure we have a header buffer to read the next message into, taking one from the pool
+    // if we gave ours back while idle. Returns false if the pool's budget doesn't allow it.
+
+    if (headerBuffer == nullptr) {
+      KJ_IF_MAYBE(buffer, KJ_ASSERT_NONNULL(bufferPool).tryAllocate(MIN_BUFFER)) {
+        headerBuffer = kj::mv(*buffer);
+      } else {
+        return false;
+      }
+    }
+
+    if (hasIdleByte) {
+      headerBuffer[0] = idleByte;
+      leftover = headerBuffer.slice(0, 1);
+      hasIdleByte = false;
+    }
+
+    return true;
+  }
+
 private:
   AsyncIoStream& inner;
+  kj::Maybe<HeaderBufferPool&> bufferPool;
   kj::Array<char> headerBuffer;
+  // Null while a pooled stream is idle.
+
+  char idleByte = 0;
+  bool hasIdleByte = false;
+  // The first byte of the next message, if it arrived while we had no buffer.
 
   size_t messageHeaderEnd = 0;
   // Position in headerBuffer where the message headers end -- further buffer space can
@@ -1223,6 +1345,23 @@ private:
     CHUNK
   };
 
+  void growBuffer() {
+    size_t size = headerBuffer.size() * 2;
+    kj::Array<char> newBuffer;
+    KJ_IF_MAYBE(pool, bufferPool) {
+      KJ_IF_MAYBE(buffer, pool->tryAllocate(size)) {
+        newBuffer = kj::mv(*buffer);
+      } else {
+        kj::throwFatalException(
+            KJ_EXCEPTION(OVERLOADED, "HTTP server buffer memory budget exhausted"));
+      }
+    } else {
+      newBuffer = kj::heapArray<char>(size);
+    }
+    memcpy(newBuffer.begin(), headerBuffer.begin(), headerBuffer.size());
+    headerBuffer = kj::mv(newBuffer);
+  }
+
   kj::Promise<kj::ArrayPtr<char>> readHeader(
       HeaderType type, size_t bufferStart, size_t bufferEnd) {
     // Reads the HTTP message header or a chunk header (as in transfer-encoding chunked) and
@@ -1269,9 +1408,7 @@ private:
             return KJ_EXCEPTION(FAILED, "invalid HTTP chunk size");
           }
           KJ_REQUIRE(headerBuffer.size() < MAX_BUFFER, "request headers too large");
-          auto newBuffer = kj::heapArray<char>(headerBuffer.size() * 2);
-          memcpy(newBuffer.begin(), headerBuffer.begin(), headerBuffer.size());
-          headerBuffer = kj::mv(newBuffer);
+          growBuffer();
         }
       }
 
@@ -1342,9 +1479,7 @@ private:
           if (type == HeaderType::MESSAGE) {
             if (headerBuffer.size() - newEnd < MAX_CHUNK_HEADER_SIZE) {
               // Ugh, there's not enough space for the secondary await buffer. Grow once more.
-              auto newBuffer = kj::heapArray<char>(headerBuffer.size() * 2);
-              memcpy(newBuffer.begin(), headerBuffer.begin(), headerBuffer.size());
-              headerBuffer = kj::mv(newBuffer);
+              growBuffer();
             }
             messageHeaderEnd = endIndex;
           } else {
@@ -1431,6 +1566,20 @@ public:
       return amount;
     });
   }
+
+  Promise<uint64_t> pumpTo(AsyncOutputStream& output, uint64_t amount) override {
+    if (alreadyDone()) return uint64_t(0);
+    KJ_IF_MAYBE(result, output.tryPumpFrom(*this, amount)) {
+      return kj::mv(*result);
+    }
+
+    return inner.pumpBodyTo(output, amount).then([=](uint64_t actual) {
+      if (actual < amount) {
+        doneReading();
+      }
+      return actual;
+    });
+  }
 };
 
 class HttpFixedLengthEntityReader final: public HttpEntityBodyReader {
@@ -1462,6 +1611,27 @@ public:
     });
   }
 
+  Promise<uint64_t> pumpTo(AsyncOutputStream& output, uint64_t amount) override {
+    if (length == 0) return uint64_t(0);
+    KJ_IF_MAYBE(result, output.tryPumpFrom(*this, amount)) {
+      // e.g. HttpFixedLengthEntityWriter, which checks our length against its own and then calls
+      // back here with the raw output stream.
+      return kj::mv(*result);
+    }
+
+    uint64_t requested = kj::min(amount, length);
+    return inner.pumpBodyTo(output, requested).then([=](uint64_t actual) {
+      length -= actual;
+      if (length > 0 && actual < requested) {
+        kj::throwRecoverableException(KJ_EXCEPTION(DISCONNECTED,
+            "premature EOF in HTTP entity body; did not reach Content-Length"));
+      } else if (length == 0) {
+        doneReading();
+      }
+      return actual;
+    });
+  }
+
 private:
   size_t length;
 };
@@ -1618,6 +1788,21 @@ public:
     queueWrite(kj::mv(content));
   }
 
+  void writeHeaders(kj::ArrayPtr<const char> prepared, kj::String tail) {
+    // Like writeHeaders(String), but most of the header block was serialized ahead of time.
+    // `prepared` must remain valid until written; it goes out together with `tail` in one write.
+
+    KJ_REQUIRE(!inBody, "previous HTTP message body incomplete; can't write more messages");
+    inBody = true;
+
+    writeQueue = writeQueue.then(kj::mvCapture(tail, [this,prepared](kj::String&& tail) {
+      headerPieces[0] = prepared.asBytes();
+      headerPieces[1] = tail.asBytes();
+      auto promise = inner.write(headerPieces);
+      return promise.attach(kj::mv(tail));
+    }));
+  }
+
   void writeBodyData(kj::String content) {
     KJ_REQUIRE(inBody) { return; }
 
@@ -1688,6 +1873,10 @@ private:
   bool inBody = false;
   bool broken = false;
 
+  kj::ArrayPtr<const byte> headerPieces[2];
+  // Used by writeHeaders() with a prepared block. Header writes are queued, so only one uses this
+  // at a time.
+
   void queueWrite(kj::String content) {
     writeQueue = writeQueue.then(kj::mvCapture(content, [this](kj::String&& content) {
       auto promise = inner.write(content.begin(), content.size());
@@ -1877,6 +2066,345 @@ private:
   HttpOutputStream& inner;
 };
 
+class HttpCompressingEntityWriter final: public kj::AsyncOutputStream {
+  // Applies a content coding to a chunked entity-body. Data is compressed synchronously as it is
+  // written, and each write is flushed through the compressor so that a response streamed in
+  // pieces reaches the client as it's produced. The tail of the compressed stream is queued on
+  // destruction, ahead of the terminating chunk.
+
+public:
+  HttpCompressingEntityWriter(HttpOutputStream& inner, kj::Own<Compressor> compressor)
+      : inner(inner), compressor(kj::mv(compressor)), chunked(inner) {}
+  ~HttpCompressingEntityWriter() noexcept(false) {
+    auto tail = compressor->compressAll(nullptr, Compressor::Flush::FINISH);
+    if (tail.size() > 0) {
+      auto header = kj::str(kj::hex(tail.size()), "\r\n");
+      auto chunk = kj::heapString(header.size() + tail.size() + 2);
+      memcpy(chunk.begin(), header.begin(), header.size());
+      memcpy(chunk.begin() + header.size(), tail.begin(), tail.size());
+      memcpy(chunk.begin() + header.size() + tail.size(), "\r\n", 2);
+      inner.writeBodyData(kj::mv(chunk));
+    }
+    // `chunked`'s destructor writes the terminating chunk.
+  }
+
+  Promise<void> write(const void* buffer, size_t size) override {
+    auto compressed = compressor->compressAll(
+        kj::arrayPtr(reinterpret_cast<const byte*>(buffer), size), Compressor::Flush::SYNC);
+    auto promise = chunked.write(compressed.begin(), compressed.size());
+    return promise.attach(kj::mv(compressed));
+  }
+
+  Promise<void> write(ArrayPtr<const ArrayPtr<const byte>> pieces) override {
+    kj::Vector<byte> compressed;
+    for (auto i: kj::indices(pieces)) {
+      auto flush = i + 1 == pieces.size() ? Compressor::Flush::SYNC : Compressor::Flush::NONE;
+      compressed.addAll(compressor->compressAll(pieces[i], flush));
+    }
+    auto promise = chunked.write(compressed.begin(), compressed.size());
+    return promise.attach(kj::mv(compressed));
+  }
+
+private:
+  HttpOutputStream& inner;
+  kj::Own<Compressor> compressor;
+  HttpChunkedEntityWriter chunked;
+};
+
+static bool equalsIgnoreCase(kj::ArrayPtr<const char> a, kj::StringPtr b) {
+  if (a.size() != b.size()) return false;
+  for (size_t i = 0; i < a.size(); i++) {
+    char x = a[i], y = b[i];
+    if ('A' <= x && x <= 'Z') x += 'a' - 'A';
+    if ('A' <= y && y <= 'Z') y += 'a' - 'A';
+    if (x != y) return false;
+  }
+  return true;
+}
+
+static double acceptEncodingQuality(kj::StringPtr acceptEncoding, kj::StringPtr coding) {
+  // Returns the q-value that an Accept-Encoding header assigns to `coding`, falling back to that
+  // of "*", or zero if neither is listed.
+
+  kj::Maybe<double> exact;
+  kj::Maybe<double> wildcard;
+
+  const char* p = acceptEncoding.cStr();
+  for (;;) {
+    while (*p == ' ' || *p == '\t' || *p == ',') ++p;
+    if (*p == '\0') break;
+
+    const char* name = p;
+    while (*p != '\0' && *p != ',' && *p != ';' && *p != ' ' && *p != '\t') ++p;
+    auto token = kj::arrayPtr(name, p);
+
+    double q = 1;
+    while (*p != '\0' && *p != ',') {
+      if (*p++ == ';') {
+        while (*p == ' ' || *p == '\t') ++p;
+        if ((*p == 'q' || *p == 'Q') && p[1] == '=') {
+          q = strtod(p + 2, nullptr);
+        }
+      }
+    }
+
+    if (equalsIgnoreCase(token, coding)) {
+      exact = q;
+    } else if (token.size() == 1 && token[0] == '*') {
+      wildcard = q;
+    }
+  }
+
+  KJ_IF_MAYBE(q, exact) {
+    return *q;
+  } else {
+    return wildcard.orDefault(0);
+  }
+}
+
+static bool isCompressedContentType(kj::StringPtr contentType) {
+  // Returns true for media types whose data is already compressed, so a content coding would only
+  // cost CPU time.
+
+  static constexpr const char* COMPRESSED_TYPES[] = {
+    "application/gzip", "application/x-gzip", "application/zip", "application/zstd",
+    "application/x-bzip2", "application/x-xz", "application/x-7z-compressed",
+    "application/x-rar-compressed", "font/woff", "font/woff2",
+  };
+  static constexpr const char* COMPRESSED_TOP_LEVEL_TYPES[] = { "image/", "audio/", "video/" };
+
+  const char* end = contentType.cStr();
+  while (*end != '\0' && *end != ';' && *end != ' ' && *end != '\t') ++end;
+  auto mediaType = kj::arrayPtr(contentType.cStr(), end);
+
+  // SVG is text.
+  if (equalsIgnoreCase(mediaType, "image/svg+xml")) return false;
+
+  for (kj::StringPtr prefix: COMPRESSED_TOP_LEVEL_TYPES) {
+    if (mediaType.size() > prefix.size() &&
+        equalsIgnoreCase(mediaType.slice(0, prefix.size()), prefix)) {
+      return true;
+    }
+  }
+  for (kj::StringPtr type: COMPRESSED_TYPES) {
+    if (equalsIgnoreCase(mediaType, type)) return true;
+  }
+  return false;
+}
+
+static kj::Maybe<CompressionCodec&> chooseContentEncoding(
+    kj::StringPtr acceptEncoding, kj::ArrayPtr<CompressionCodec* const> codecs) {
+  // Picks the codec the client rates highest, preferring earlier codecs on ties.
+
+  kj::Maybe<CompressionCodec&> result;
+  double bestQuality = 0;
+  for (auto codec: codecs) {
+    double q = acceptEncodingQuality(acceptEncoding, codec->getName());
+    if (q > bestQuality) {
+      result = *codec;
+      bestQuality = q;
+    }
+  }
+  return result;
+}
+
+// =======================================================================================
+// permessage-deflate negotiation (RFC 7692)
+
+struct WebSocketDeflateConfig {
+  // What was agreed for one connection.
+
+  CompressionCodec& codec;
+  bool contextTakeover;
+  // Our compressor keeps its history between messages.
+  bool peerContextTakeover;
+  // The peer's compressor does, so our decompressor must too.
+  size_t maxInflatedMessageSize;
+};
+
+struct DeflateParameters {
+  bool serverNoContextTakeover = false;
+  bool clientNoContextTakeover = false;
+  uint serverMaxWindowBits = 0;
+  // 0 if absent.
+  bool hasClientMaxWindowBits = false;
+  uint clientMaxWindowBits = 0;
+  // 0 if absent or given without a value, which is allowed in offers.
+};
+
+static const byte DEFLATE_TAIL[4] = { 0x00, 0x00, 0xff, 0xff };
+// The empty stored block that ends a sync-flushed DEFLATE stream. permessage-deflate leaves it off
+// the wire.
+
+static kj::ArrayPtr<const char> trimSpace(kj::ArrayPtr<const char> text) {
+  while (text.size() > 0 && (text.front() == ' ' || text.front() == '\t')) {
+    text = text.slice(1, text.size());
+  }
+  while (text.size() > 0 && (text.back() == ' ' || text.back() == '\t')) {
+    text = text.slice(0, text.size() - 1);
+  }
+  return text;
+}
+
+static kj::Vector<kj::ArrayPtr<const char>> splitUnquoted(
+    kj::ArrayPtr<const char> text, char delim) {
+  // Splits `text` at each `delim` that isn't inside a quoted-string, trimming the pieces.
+
+  kj::Vector<kj::ArrayPtr<const char>> result;
+  bool quoted = false;
+  size_t start = 0;
+  for (size_t i = 0; i < text.size(); i++) {
+    if (text[i] == '"') {
+      quoted = !quoted;
+    } else if (text[i] == delim && !quoted) {
+      result.add(trimSpace(text.slice(start, i)));
+      start = i + 1;
+    }
+  }
+  result.add(trimSpace(text.slice(start, text.size())));
+  return result;
+}
+
+static kj::Maybe<DeflateParameters> parseDeflateParameters(
+    kj::ArrayPtr<const kj::ArrayPtr<const char>> params) {
+  // Parses the parameters following "permessage-deflate" in a Sec-WebSocket-Extensions element.
+  // Returns null if any is unknown, repeated, or invalid, in which case RFC 7692 says to decline
+  // the offer (server) or fail the connection (client).
+
+  DeflateParameters result;
+  bool hasServerNoContextTakeover = false;
+  bool hasClientNoContextTakeover = false;
+  for (auto param: params) {
+    kj::ArrayPtr<const char> key = param;
+    kj::Maybe<uint> bits;
+    for (size_t i = 0; i < param.size(); i++) {
+      if (param[i] == '=') {
+        key = trimSpace(param.slice(0, i));
+        auto value = trimSpace(param.slice(i + 1, param.size()));
+        if (value.size() >= 2 && value.front() == '"' && value.back() == '"') {
+          value = value.slice(1, value.size() - 1);
+        }
+        if (value.size() == 0 || value.size() > 2) return nullptr;
+        uint n = 0;
+        for (char c: value) {
+          if (c < '0' || c > '9') return nullptr;
+          n = n * 10 + (c - '0');
+        }
+        if (n < 8 || n > 15) return nullptr;
+        bits = n;
+        break;
+      }
+    }
+
+    if (equalsIgnoreCase(key, "server_no_context_takeover")) {
+      if (hasServerNoContextTakeover || bits != nullptr) return nullptr;
+      hasServerNoContextTakeover = result.serverNoContextTakeover = true;
+    } else if (equalsIgnoreCase(key, "client_no_context_takeover")) {
+      if (hasClientNoContextTakeover || bits != nullptr) return nullptr;
+      hasClientNoContextTakeover = result.clientNoContextTakeover = true;
+    } else if (equalsIgnoreCase(key, "server_max_window_bits")) {
+      if (result.serverMaxWindowBits != 0) return nullptr;
+      KJ_IF_MAYBE(b, bits) {
+        result.serverMaxWindowBits = *b;
+      } else {
+        return nullptr;
+      }
+    } else if (equalsIgnoreCase(key, "client_max_window_bits")) {
+      if (result.hasClientMaxWindowBits) return nullptr;
+      result.hasClientMaxWindowBits = true;
+      result.clientMaxWindowBits = bits.orDefault(0);
+    } else {
+      return nullptr;
+    }
+  }
+  return result;
+}
+
+static void requireValidWindowBits(const WebSocketCompressionSettings& settings) {
+  KJ_REQUIRE(settings.windowBits >= 9 && settings.windowBits <= 15,
+      "invalid WebSocketCompressionSettings::windowBits", settings.windowBits);
+}
+
+static kj::String makeDeflateOffer(const WebSocketCompressionSettings& settings) {
+  // Builds the client's Sec-WebSocket-Extensions header.
+
+  requireValidWindowBits(settings);
+  kj::Vector<kj::String> parts;
+  parts.add(kj::str("permessage-deflate"));
+  if (!settings.contextTakeover) parts.add(kj::str("client_no_context_takeover"));
+  if (!settings.peerContextTakeover) parts.add(kj::str("server_no_context_takeover"));
+  if (settings.windowBits < 15) {
+    parts.add(kj::str("server_max_window_bits=", settings.windowBits));
+    parts.add(kj::str("client_max_window_bits=", settings.windowBits));
+  }
+  return kj::strArray(parts, "; ");
+}
+
+static kj::Maybe<WebSocketDeflateConfig> acceptDeflateOffer(
+    kj::StringPtr offers, const WebSocketCompressionSettings& settings, kj::String& response) {
+  // Picks the first permessage-deflate offer in the client's Sec-WebSocket-Extensions header that
+  // we can honor, and sets `response` to the server's reply.
+
+  requireValidWindowBits(settings);
+  uint bits = settings.windowBits;
+  for (auto element: splitUnquoted(offers, ',')) {
+    auto params = splitUnquoted(element, ';');
+    if (!equalsIgnoreCase(params[0], "permessage-deflate")) continue;
+
+    KJ_IF_MAYBE(offer, parseDeflateParameters(params.slice(1, params.size()))) {
+      // Our codec can't compress with a smaller window than it was made with, and if ours is
+      // smaller than the maximum, the client must let us say so.
+      if (offer->serverMaxWindowBits != 0 && offer->serverMaxWindowBits < bits) continue;
+      if (bits < 15 && !offer->hasClientMaxWindowBits) continue;
+
+      bool contextTakeover = settings.contextTakeover && !offer->serverNoContextTakeover;
+      bool peerContextTakeover = settings.peerContextTakeover && !offer->clientNoContextTakeover;
+
+      kj::Vector<kj::String> parts;
+      parts.add(kj::str("permessage-deflate"));
+      if (!contextTakeover) parts.add(kj::str("server_no_context_takeover"));
+      if (!peerContextTakeover) parts.add(kj::str("client_no_context_takeover"));
+      if (offer->serverMaxWindowBits != 0 || bits < 15) {
+        parts.add(kj::str("server_max_window_bits=", bits));
+      }
+      if (bits < 15 && (offer->clientMaxWindowBits == 0 || offer->clientMaxWindowBits > bits)) {
+        parts.add(kj::str("client_max_window_bits=", bits));
+      }
+      response = kj::strArray(parts, "; ");
+      return WebSocketDeflateConfig {
+        *settings.codec, contextTakeover, peerContextTakeover, settings.maxInflatedMessageSize
+      };
+    }
+  }
+  return nullptr;
+}
+
+static WebSocketDeflateConfig acceptDeflateResponse(
+    kj::StringPtr header, const WebSocketCompressionSettings& settings) {
+  // Checks the server's Sec-WebSocket-Extensions reply to makeDeflateOffer().
+
+  auto elements = splitUnquoted(header, ',');
+  auto params = splitUnquoted(elements[0], ';');
+  KJ_REQUIRE(elements.size() == 1 && equalsIgnoreCase(params[0], "permessage-deflate"),
+      "server accepted a WebSocket extension we didn't offer", header);
+  auto response = KJ_REQUIRE_NONNULL(parseDeflateParameters(params.slice(1, params.size())),
+      "invalid permessage-deflate parameters from server", header);
+
+  uint bits = settings.windowBits;
+  KJ_REQUIRE(!response.hasClientMaxWindowBits ||
+             (response.clientMaxWindowBits != 0 && response.clientMaxWindowBits >= bits),
+      "server requires a smaller permessage-deflate window than we can compress with", header);
+  KJ_REQUIRE(response.serverMaxWindowBits <= bits,
+      "server's permessage-deflate window is larger than we asked for", header);
+
+  return WebSocketDeflateConfig {
+    *settings.codec,
+    settings.contextTakeover && !response.clientNoContextTakeover,
+    !response.serverNoContextTakeover,
+    settings.maxInflatedMessageSize
+  };
+}
+
 // =======================================================================================
 
 class WebSocketImpl final: public WebSocket {
@@ -1885,9 +2413,10 @@ public:
                 kj::Maybe<EntropySource&> maskKeyGenerator,
                 kj::Array<byte> buffer = kj::heapArray<byte>(4096),
                 kj::ArrayPtr<byte> leftover = nullptr,
-                kj::Maybe<kj::Promise<void>> waitBeforeSend = nullptr)
+                kj::Maybe<kj::Promise<void>> waitBeforeSend = nullptr,
+                kj::Maybe<WebSocketDeflateConfig> deflate = nullptr)
       : stream(kj::mv(stream)), maskKeyGenerator(maskKeyGenerator),
-        sendingPong(kj::mv(waitBeforeSend)),
+        deflate(kj::mv(deflate)), sendingPong(kj::mv(waitBeforeSend)),
         recvBuffer(kj::mv(buffer)), recvData(leftover) {}
 
   kj::Promise<void> send(kj::ArrayPtr<const byte> message) override {
@@ -1941,29 +2470,7 @@ public:
     size_t headerSize = Header::headerSize(recvData.begin(), recvData.size());
 
     if (headerSize > recvData.size()) {
-      if (recvData.begin() != recvBuffer.begin()) {
-        // Move existing data to front of buffer.
-        if (recvData.size() > 0) {
-          memmove(recvBuffer.begin(), recvData.begin(), recvData.size());
-        }
-        recvData = recvBuffer.slice(0, recvData.size());
-      }
-
-      return stream->tryRead(recvData.end(), 1, recvBuffer.end() - recvData.end())
-          .then([this](size_t actual) -> kj::Promise<Message> {
-        if (actual == 0) {
-          if (recvData.size() > 0) {
-            return KJ_EXCEPTION(DISCONNECTED, "WebSocket EOF in frame header");
-          } else {
-            // It's incorrect for the WebSocket to disconnect without sending `Close`.
-            return KJ_EXCEPTION(DISCONNECTED,
-                "WebSocket disconnected between frames without sending `Close`.");
-          }
-        }
-
-        recvData = recvBuffer.slice(0, recvData.size() + actual);
-        return receive();
-      });
+      return readMoreHeader().then([this]() { return receive(); });
     }
 
     auto& recvHeader = *reinterpret_cast<Header*>(recvData.begin());
@@ -1974,12 +2481,10 @@ public:
 
     auto opcode = recvHeader.getOpcode();
     bool isData = opcode < OPCODE_FIRST_CONTROL;
-    if (opcode == OPCODE_CONTINUATION) {
-      KJ_REQUIRE(!fragments.empty(), "unexpected continuation frame in WebSocket");
-
-      opcode = fragmentOpcode;
-    } else if (isData) {
-      KJ_REQUIRE(fragments.empty(), "expected continuation frame in WebSocket");
+    if (isData) {
+      opcode = receiveDataHeader(recvHeader);
+    } else {
+      KJ_REQUIRE(!recvHeader.hasRsv(), "WebSocket control frame has reserved bits set");
     }
 
     bool isFin = recvHeader.isFin();
@@ -2004,7 +2509,6 @@ public:
         payloadTarget = message.begin() + offset;
 
         fragments.clear();
-        fragmentOpcode = 0;
       } else {
         // Single-frame message.
         message = kj::heapArray<byte>(amountToAllocate);
@@ -2016,10 +2520,6 @@ public:
 
       message = kj::heapArray<byte>(payloadLen);
       payloadTarget = message.begin();
-      if (fragments.empty()) {
-        // This is the first fragment, so set the opcode.
-        fragmentOpcode = opcode;
-      }
     }
 
     Mask mask = recvHeader.getMask();
@@ -2037,6 +2537,15 @@ public:
         return receive();
       }
 
+      if (recvCompressed && opcode < OPCODE_FIRST_CONTROL) {
+        bool isText = opcode == OPCODE_TEXT;
+        KJ_IF_MAYBE(inflated, inflateMessage(message.slice(0, message.size() - isText), isText)) {
+          message = kj::mv(*inflated);
+        } else {
+          return failMessageTooBig();
+        }
+      }
+
       switch (opcode) {
         case OPCODE_CONTINUATION:
           // Shouldn't get here; handled above.
@@ -2047,15 +2556,7 @@ public:
         case OPCODE_BINARY:
           return Message(message.releaseAsBytes());
         case OPCODE_CLOSE:
-          if (message.size() < 2) {
-            return Message(Close { 1005, nullptr });
-          } else {
-            uint16_t status = (static_cast<uint16_t>(message[0]) << 8)
-                            | (static_cast<uint16_t>(message[1])     );
-            return Message(Close {
-              status, kj::heapString(message.slice(2, message.size()).asChars())
-            });
-          }
+          return Message(parseClose(message));
         case OPCODE_PING:
           // Send back a pong.
           queuePong(kj::mv(message));
@@ -2068,23 +2569,25 @@ public:
       }
     });
 
-    if (payloadLen <= recvData.size()) {
-      // All data already received.
-      memcpy(payloadTarget, recvData.begin(), payloadLen);
-      recvData = recvData.slice(payloadLen, recvData.size());
+    KJ_IF_MAYBE(promise, readPayload(kj::arrayPtr(payloadTarget, payloadLen))) {
+      return promise->then(kj::mv(handleMessage));
+    } else {
       return handleMessage();
+    }
+  }
+
+  kj::Promise<MessageView> receiveInto(kj::ArrayPtr<byte> buffer) override {
+    return receiveInto(buffer, 0);
+  }
+
+  kj::Maybe<kj::Promise<void>> tryPumpFrom(WebSocket& other) override {
+    KJ_IF_MAYBE(from, kj::dynamicDowncastIfAvailable<WebSocketImpl>(other)) {
+      // Compressed frames can't be forwarded as-is: their meaning depends on the compression
+      // context of the connection they arrived on.
+      if (deflate != nullptr || from->deflate != nullptr) return nullptr;
+      return from->pumpFramesTo(*this);
     } else {
-      // Need to read more data.
-      memcpy(payloadTarget, recvData.begin(), recvData.size());
-      size_t remaining = payloadLen - recvData.size();
-      auto promise = stream->tryRead(payloadTarget + recvData.size(), remaining, remaining)
-          .then([remaining](size_t amount) {
-        if (amount < remaining) {
-          kj::throwRecoverableException(KJ_EXCEPTION(DISCONNECTED, "WebSocket EOF in message"));
-        }
-      });
-      recvData = nullptr;
-      return promise.then(kj::mv(handleMessage));
+      return nullptr;
     }
   }
 
@@ -2102,8 +2605,19 @@ private:
       }
     }
 
-    void apply(kj::ArrayPtr<byte> bytes) const {
-      apply(bytes.begin(), bytes.size());
+    void apply(kj::ArrayPtr<byte> bytes, uint64_t offset = 0) const {
+      // `offset` is the position of `bytes` within the frame payload.
+      apply(bytes.begin(), bytes.size(), offset % 4);
+    }
+
+    Mask operator^(const Mask& other) const {
+      // Applying the result is equivalent to applying both masks, i.e. unmasking with one and
+      // re-masking with the other.
+      Mask result;
+      for (uint i = 0; i < 4; i++) {
+        result.maskBytes[i] = maskBytes[i] ^ other.maskBytes[i];
+      }
+      return result;
     }
 
     void copyTo(byte* output) const {
@@ -2117,17 +2631,18 @@ private:
   private:
     byte maskBytes[4];
 
-    void apply(byte* __restrict__ bytes, size_t size) const {
+    void apply(byte* __restrict__ bytes, size_t size, uint offset) const {
       for (size_t i = 0; i < size; i++) {
-        bytes[i] ^= maskBytes[i % 4];
+        bytes[i] ^= maskBytes[(i + offset) % 4];
       }
     }
   };
 
   class Header {
   public:
-    kj::ArrayPtr<const byte> compose(bool fin, byte opcode, uint64_t payloadLen, Mask mask) {
-      bytes[0] = (fin ? FIN_MASK : 0) | opcode;
+    kj::ArrayPtr<const byte> compose(bool fin, byte opcode, uint64_t payloadLen, Mask mask,
+                                     bool compressed = false) {
+      bytes[0] = (fin ? FIN_MASK : 0) | (compressed ? RSV1_MASK : 0) | opcode;
       bool hasMask = !mask.isZero();
 
       size_t fill;
@@ -2179,6 +2694,11 @@ private:
       return bytes[0] & RSV_MASK;
     }
 
+    bool isCompressed() const {
+      // RSV1 marks the first frame of a permessage-deflate message.
+      return bytes[0] & RSV1_MASK;
+    }
+
     byte getOpcode() const {
       return bytes[0] & OPCODE_MASK;
     }
@@ -2241,6 +2761,7 @@ private:
 
     static constexpr byte FIN_MASK = 0x80;
     static constexpr byte RSV_MASK = 0x70;
+    static constexpr byte RSV1_MASK = 0x40;
     static constexpr byte OPCODE_MASK = 0x0f;
 
     static constexpr byte USE_MASK_MASK = 0x80;
@@ -2261,6 +2782,20 @@ private:
   kj::Own<kj::AsyncIoStream> stream;
   kj::Maybe<EntropySource&> maskKeyGenerator;
 
+  kj::Maybe<WebSocketDeflateConfig> deflate;
+  // Non-null if permessage-deflate was negotiated.
+
+  kj::Own<Compressor> compressor;
+  kj::Own<Decompressor> decompressor;
+  // Kept between messages when the respective side uses context takeover; otherwise each message
+  // gets a fresh context from the codec's pool.
+
+  bool recvCompressed = false;
+  // Whether the data message currently being received had RSV1 set on its first frame.
+
+  kj::Vector<byte> compressedMessage;
+  // receiveInto() gathers a compressed message here before inflating it into the caller's buffer.
+
   bool sendClosed = false;
   bool currentlySending = false;
   Header sendHeader;
@@ -2287,39 +2822,464 @@ private:
   kj::Array<byte> recvBuffer;
   kj::ArrayPtr<byte> recvData;
 
-  kj::Promise<void> sendImpl(byte opcode, kj::ArrayPtr<const byte> message) {
-    KJ_REQUIRE(!sendClosed, "WebSocket already closed");
-    KJ_REQUIRE(!currentlySending, "another message send is already in progress");
-
-    currentlySending = true;
+  kj::Promise<void> readMoreHeader() {
+    // Reads at least one more byte into `recvData`, which holds an incomplete frame header.
 
-    KJ_IF_MAYBE(p, sendingPong) {
-      // We recently sent a pong, make sure it's finished before proceeding.
-      auto promise = p->then([this, opcode, message]() {
-        currentlySending = false;
-        return sendImpl(opcode, message);
-      });
-      sendingPong = nullptr;
-      return promise;
+    if (recvData.begin() != recvBuffer.begin()) {
+      // Move existing data to front of buffer.
+      if (recvData.size() > 0) {
+        memmove(recvBuffer.begin(), recvData.begin(), recvData.size());
+      }
+      recvData = recvBuffer.slice(0, recvData.size());
     }
 
-    sendClosed = opcode == OPCODE_CLOSE;
+    return stream->tryRead(recvData.end(), 1, recvBuffer.end() - recvData.end())
+        .then([this](size_t actual) -> kj::Promise<void> {
+      if (actual == 0) {
+        if (recvData.size() > 0) {
+          return KJ_EXCEPTION(DISCONNECTED, "WebSocket EOF in frame header");
+        } else {
+          // It's incorrect for the WebSocket to disconnect without sending `Close`.
+          return KJ_EXCEPTION(DISCONNECTED,
+              "WebSocket disconnected between frames without sending `Close`.");
+        }
+      }
 
-    Mask mask(maskKeyGenerator);
+      recvData = recvBuffer.slice(0, recvData.size() + actual);
+      return kj::READY_NOW;
+    });
+  }
 
-    kj::Array<byte> ownMessage;
-    if (!mask.isZero()) {
-      // Sadness, we have to make a copy to apply the mask.
-      ownMessage = kj::heapArray(message);
-      mask.apply(ownMessage);
-      message = ownMessage;
-    }
+  kj::Maybe<kj::Promise<void>> readPayload(kj::ArrayPtr<byte> target) {
+    // Fills `target` with the next payload bytes. Returns null if they were already buffered.
 
-    sendParts[0] = sendHeader.compose(true, opcode, message.size(), mask);
-    sendParts[1] = message;
+    if (target.size() <= recvData.size()) {
+      memcpy(target.begin(), recvData.begin(), target.size());
+      recvData = recvData.slice(target.size(), recvData.size());
+      return nullptr;
+    }
 
-    auto promise = stream->write(sendParts);
+    memcpy(target.begin(), recvData.begin(), recvData.size());
+    size_t remaining = target.size() - recvData.size();
+    auto promise = stream->tryRead(target.end() - remaining, remaining, remaining)
+        .then([remaining](size_t amount) {
+      if (amount < remaining) {
+        kj::throwRecoverableException(KJ_EXCEPTION(DISCONNECTED, "WebSocket EOF in message"));
+      }
+    });
+    recvData = nullptr;
+    return kj::mv(promise);
+  }
+
+  static Close parseClose(kj::ArrayPtr<const byte> payload) {
+    if (payload.size() < 2) {
+      return Close { 1005, nullptr };
+    } else {
+      uint16_t status = (static_cast<uint16_t>(payload[0]) << 8)
+                      | (static_cast<uint16_t>(payload[1])     );
+      return Close { status, kj::heapString(payload.slice(2, payload.size()).asChars()) };
+    }
+  }
+
+  kj::Maybe<kj::Promise<kj::Maybe<Close>>> receiveControl(
+      const Header& header, size_t payloadLen) {
+    // Handles a control frame whose header has just been consumed. Returns the Close message if
+    // it was one, or null if the caller should go on to the next frame. The returned promise is
+    // itself null if the frame was handled without waiting.
+
+    KJ_REQUIRE(header.isFin(), "WebSocket control frame cannot be fragmented");
+    KJ_REQUIRE(!header.hasRsv(), "WebSocket control frame has reserved bits set");
+
+    // Control frames are small (at most 125 bytes) and rare, so just allocate.
+    auto payload = kj::heapArray<byte>(payloadLen);
+    auto opcode = header.getOpcode();
+    auto mask = header.getMask();
+    auto handle = [this,opcode,mask](kj::Array<byte>&& payload) -> kj::Maybe<Close> {
+      mask.apply(payload);
+      switch (opcode) {
+        case OPCODE_CLOSE:
+          return parseClose(payload);
+        case OPCODE_PING:
+          queuePong(kj::mv(payload));
+          return nullptr;
+        case OPCODE_PONG:
+          return nullptr;
+        default:
+          KJ_FAIL_REQUIRE("unknown WebSocket opcode", opcode);
+      }
+    };
+
+    KJ_IF_MAYBE(promise, readPayload(payload)) {
+      return promise->then(kj::mvCapture(payload, kj::mv(handle)));
+    } else {
+      auto close = handle(kj::mv(payload));
+      if (close == nullptr) {
+        return nullptr;
+      } else {
+        return kj::Promise<kj::Maybe<Close>>(kj::mv(close));
+      }
+    }
+  }
+
+  byte receiveDataHeader(const Header& header) {
+    // Checks the fragment sequence and reserved bits for a data frame whose header has just been
+    // consumed, and returns the message's opcode.
+
+    auto opcode = header.getOpcode();
+    if (opcode == OPCODE_CONTINUATION) {
+      KJ_REQUIRE(fragmentOpcode != 0, "unexpected continuation frame in WebSocket");
+      KJ_REQUIRE(!header.isCompressed(), "WebSocket continuation frame has RSV1 set");
+      opcode = fragmentOpcode;
+    } else {
+      KJ_REQUIRE(fragmentOpcode == 0, "expected continuation frame in WebSocket");
+      recvCompressed = header.isCompressed();
+      KJ_REQUIRE(!recvCompressed || deflate != nullptr,
+          "received compressed WebSocket message, but compression wasn't negotiated");
+    }
+    KJ_REQUIRE(!header.hasRsv() || header.isCompressed(),
+        "WebSocket frame has reserved bits set");
+    fragmentOpcode = header.isFin() ? 0 : opcode;
+    return opcode;
+  }
+
+  kj::Promise<MessageView> receiveInto(kj::ArrayPtr<byte> buffer, size_t offset) {
+    // `offset` is how much of a fragmented message has already been received into `buffer`.
+
+    size_t headerSize = Header::headerSize(recvData.begin(), recvData.size());
+    if (headerSize > recvData.size()) {
+      return readMoreHeader().then([this,buffer,offset]() mutable {
+        return receiveInto(buffer, offset);
+      });
+    }
+
+    auto& recvHeader = *reinterpret_cast<Header*>(recvData.begin());
+    recvData = recvData.slice(headerSize, recvData.size());
+    uint64_t payloadLen = recvHeader.getPayloadLen();
+
+    if (recvHeader.getOpcode() >= OPCODE_FIRST_CONTROL) {
+      KJ_IF_MAYBE(promise, receiveControl(recvHeader, payloadLen)) {
+        return promise->then([this,buffer,offset](kj::Maybe<Close>&& close) mutable
+            -> kj::Promise<MessageView> {
+          KJ_IF_MAYBE(c, close) {
+            return MessageView(kj::mv(*c));
+          } else {
+            return receiveInto(buffer, offset);
+          }
+        });
+      } else {
+        return receiveInto(buffer, offset);
+      }
+    }
+
+    bool isFin = recvHeader.isFin();
+    auto opcode = receiveDataHeader(recvHeader);
+
+    kj::ArrayPtr<byte> target;
+    if (recvCompressed) {
+      // `offset` counts compressed bytes in `compressedMessage`. Compressed data is never much
+      // larger than what it encodes, so anything past this bound can't fit after inflating.
+      size_t maxCompressed = buffer.size() + buffer.size() / 1024 + 64;
+      KJ_REQUIRE(payloadLen <= maxCompressed - offset,
+          "WebSocket message is larger than the receive buffer", offset + payloadLen,
+          buffer.size());
+      compressedMessage.resize(offset + payloadLen);
+      target = compressedMessage.asPtr().slice(offset, offset + payloadLen);
+    } else {
+      KJ_REQUIRE(payloadLen <= buffer.size() - offset,
+          "WebSocket message is larger than the receive buffer", offset + payloadLen,
+          buffer.size());
+      target = buffer.slice(offset, offset + payloadLen);
+    }
+
+    Mask mask = recvHeader.getMask();
+    auto handleFrame = [this,buffer,offset,target,mask,isFin,opcode]() mutable
+        -> kj::Promise<MessageView> {
+      if (!mask.isZero()) {
+        mask.apply(target);
+      }
+      size_t size = offset + target.size();
+      if (!isFin) {
+        return receiveInto(buffer, size);
+      }
+
+      if (recvCompressed) {
+        size = inflateInto(compressedMessage.asPtr(), buffer);
+        compressedMessage.clear();
+      }
+      if (opcode == OPCODE_TEXT) {
+        return MessageView(buffer.slice(0, size).asChars());
+      } else {
+        return MessageView(buffer.slice(0, size));
+      }
+    };
+
+    KJ_IF_MAYBE(promise, readPayload(target)) {
+      return promise->then(kj::mv(handleFrame));
+    } else {
+      return handleFrame();
+    }
+  }
+
+  // ---------------------------------------------------------------------------
+  // permessage-deflate. Each message is compressed and then sync-flushed, which ends the output
+  // with an empty stored block, 00 00 ff ff. The sender strips those four bytes and the receiver
+  // puts them back before inflating.
+
+  kj::Array<byte> deflateMessage(kj::ArrayPtr<const byte> message) {
+    // Returns the compressed message, still ending with DEFLATE_TAIL.
+
+    auto& config = KJ_ASSERT_NONNULL(deflate);
+    kj::Own<Compressor> temporary;
+    auto& context = config.contextTakeover ? compressor : temporary;
+    if (context.get() == nullptr) {
+      context = config.codec.newCompressor();
+    }
+
+    auto result = context->compressAll(message, Compressor::Flush::SYNC);
+    KJ_ASSERT(result.size() >= sizeof(DEFLATE_TAIL) &&
+              memcmp(result.end() - sizeof(DEFLATE_TAIL), DEFLATE_TAIL,
+                     sizeof(DEFLATE_TAIL)) == 0,
+        "compression codec didn't end the message with a sync flush");
+    return result;
+  }
+
+  Decompressor& getDecompressor(kj::Own<Decompressor>& temporary) {
+    auto& config = KJ_ASSERT_NONNULL(deflate);
+    auto& context = config.peerContextTakeover ? decompressor : temporary;
+    if (context.get() == nullptr) {
+      context = config.codec.newDecompressor();
+    }
+    return *context;
+  }
+
+  kj::Maybe<kj::Array<byte>> inflateMessage(kj::ArrayPtr<const byte> payload,
+                                            bool nulTerminate) {
+    // Inflates a complete message. If `nulTerminate`, the result has one extra byte at the end for
+    // the caller to fill in. Returns null if the message would inflate past
+    // maxInflatedMessageSize, without ever allocating much more than that.
+
+    kj::Own<Decompressor> temporary;
+    auto& context = getDecompressor(temporary);
+
+    // The buffer never grows past one byte over the limit, which is how we notice a message that
+    // exceeds it.
+    size_t limit = KJ_ASSERT_NONNULL(deflate).maxInflatedMessageSize;
+    size_t capacity = limit == size_t(kj::maxValue) ? limit : limit + 1;
+
+    kj::Vector<byte> result;
+    result.resize(kj::min(kj::max(payload.size() * 4, size_t(256)), capacity));
+    size_t used = 0;
+    kj::ArrayPtr<const byte> inputs[2] = { payload, DEFLATE_TAIL };
+    for (auto& input: inputs) {
+      for (;;) {
+        auto output = result.asPtr().slice(used, result.size());
+        context.decompress(input, output);
+        used = result.size() - output.size();
+        if (used > limit) return nullptr;
+        if (output.size() > 0) break;
+        result.resize(kj::min(result.size() * 2, capacity));
+      }
+    }
+
+    result.resize(used + nulTerminate);
+    return result.releaseAsArray();
+  }
+
+  kj::Promise<Message> failMessageTooBig() {
+    // Tells the peer why we're giving up (1009 is "Message Too Big") if we can, then fails the
+    // receive. The decompressor's state is now unknown, so the WebSocket is unusable either way.
+
+    auto exception = KJ_EXCEPTION(FAILED, "compressed WebSocket message inflates past the limit",
+        KJ_ASSERT_NONNULL(deflate).maxInflatedMessageSize);
+    if (sendClosed || currentlySending) {
+      return kj::mv(exception);
+    }
+    return close(1009, "Message Too Big").then(kj::mvCapture(exception,
+        [](kj::Exception&& exception) -> kj::Promise<Message> {
+      return kj::mv(exception);
+    }));
+  }
+
+  size_t inflateInto(kj::ArrayPtr<const byte> payload, kj::ArrayPtr<byte> buffer) {
+    // Inflates a complete message into `buffer`, returning its size.
+
+    kj::Own<Decompressor> temporary;
+    auto& context = getDecompressor(temporary);
+
+    auto output = buffer;
+    kj::ArrayPtr<const byte> inputs[2] = { payload, DEFLATE_TAIL };
+    for (auto& input: inputs) {
+      context.decompress(input, output);
+      KJ_REQUIRE(input.size() == 0, "WebSocket message is larger than the receive buffer",
+          buffer.size());
+    }
+    if (output.size() == 0) {
+      // The buffer is exactly full; make sure the decompressor has nothing more to give.
+      byte probe;
+      kj::ArrayPtr<const byte> noInput;
+      auto probeOutput = kj::arrayPtr(&probe, 1);
+      context.decompress(noInput, probeOutput);
+      KJ_REQUIRE(probeOutput.size() > 0, "WebSocket message is larger than the receive buffer",
+          buffer.size());
+    }
+    return buffer.size() - output.size();
+  }
+
+  // ---------------------------------------------------------------------------
+  // Frame forwarding, used by tryPumpFrom(). The source WebSocket parses frame headers and answers
+  // pings; data frames are copied to the target a buffer at a time, keeping their boundaries. The
+  // payload only needs to be touched if the two ends use different masks, in which case one XOR
+  // pass both unmasks and re-masks it.
+
+  kj::Promise<void> pumpFramesTo(WebSocketImpl& to) {
+    size_t headerSize = Header::headerSize(recvData.begin(), recvData.size());
+    if (headerSize > recvData.size()) {
+      return readMoreHeader().then([this,&to]() { return pumpFramesTo(to); });
+    }
+
+    auto& recvHeader = *reinterpret_cast<Header*>(recvData.begin());
+    recvData = recvData.slice(headerSize, recvData.size());
+    uint64_t payloadLen = recvHeader.getPayloadLen();
+
+    if (recvHeader.getOpcode() >= OPCODE_FIRST_CONTROL) {
+      auto handleClose = [this,&to](kj::Maybe<Close>&& close) -> kj::Promise<void> {
+        KJ_IF_MAYBE(c, close) {
+          auto promise = to.close(c->code, c->reason);
+          return promise.attach(kj::mv(*c)).then([this,&to]() { return pumpFramesTo(to); });
+        } else {
+          return pumpFramesTo(to);
+        }
+      };
+      KJ_IF_MAYBE(promise, receiveControl(recvHeader, payloadLen)) {
+        return promise->then(kj::mv(handleClose));
+      } else {
+        return pumpFramesTo(to);
+      }
+    }
+
+    bool isFin = recvHeader.isFin();
+    byte opcode = recvHeader.getOpcode();
+    receiveDataHeader(recvHeader);
+
+    return to.forwardFrame(*this, isFin, opcode, payloadLen, recvHeader.getMask())
+        .then([this,&to]() { return pumpFramesTo(to); });
+  }
+
+  kj::Promise<void> forwardFrame(WebSocketImpl& from, bool fin, byte opcode,
+                                 uint64_t payloadLen, Mask fromMask) {
+    // Sends a data frame whose payload is still to be read from `from`.
+
+    KJ_REQUIRE(!sendClosed, "WebSocket already closed");
+    KJ_REQUIRE(!currentlySending, "another message send is already in progress");
+
+    currentlySending = true;
+
+    KJ_IF_MAYBE(p, sendingPong) {
+      // We recently sent a pong, make sure it's finished before proceeding.
+      auto promise = p->then([this,&from,fin,opcode,payloadLen,fromMask]() {
+        currentlySending = false;
+        return forwardFrame(from, fin, opcode, payloadLen, fromMask);
+      });
+      sendingPong = nullptr;
+      return promise;
+    }
+
+    Mask mask(maskKeyGenerator);
+    sendParts[0] = sendHeader.compose(fin, opcode, payloadLen, mask);
+    return forwardPayload(from, payloadLen, fromMask ^ mask, 0).then([this]() {
+      currentlySending = false;
+
+      // Send queued pong if needed.
+      KJ_IF_MAYBE(q, queuedPong) {
+        kj::Array<byte> payload = kj::mv(*q);
+        queuedPong = nullptr;
+        queuePong(kj::mv(payload));
+      }
+    });
+  }
+
+  kj::Promise<void> forwardPayload(WebSocketImpl& from, uint64_t remaining, Mask mask,
+                                   uint64_t offset) {
+    // Copies the next `remaining` bytes of payload from `from`. If `offset` is zero, the frame
+    // header in sendParts[0] has not been written yet and goes out with the first chunk.
+
+    if (remaining > 0 && from.recvData.size() == 0) {
+      // Read as much as is available, which may include following frames.
+      return from.stream->tryRead(from.recvBuffer.begin(), 1, from.recvBuffer.size())
+          .then([this,&from,remaining,mask,offset](size_t amount) {
+        if (amount == 0) {
+          kj::throwRecoverableException(KJ_EXCEPTION(DISCONNECTED, "WebSocket EOF in message"));
+        }
+        from.recvData = from.recvBuffer.slice(0, amount);
+        return forwardPayload(from, remaining, mask, offset);
+      });
+    }
+
+    auto chunk = from.recvData.slice(0, kj::min(remaining, from.recvData.size()));
+    from.recvData = from.recvData.slice(chunk.size(), from.recvData.size());
     if (!mask.isZero()) {
+      mask.apply(chunk, offset);
+    }
+
+    kj::Promise<void> promise = nullptr;
+    if (offset == 0) {
+      sendParts[1] = chunk;
+      promise = stream->write(sendParts);
+    } else {
+      promise = stream->write(chunk.begin(), chunk.size());
+    }
+
+    if (remaining == chunk.size()) {
+      return kj::mv(promise);
+    } else {
+      return promise.then([this,&from,remaining,mask,offset,chunk]() {
+        return forwardPayload(from, remaining - chunk.size(), mask, offset + chunk.size());
+      });
+    }
+  }
+
+  kj::Promise<void> sendImpl(byte opcode, kj::ArrayPtr<const byte> message) {
+    KJ_REQUIRE(!sendClosed, "WebSocket already closed");
+    KJ_REQUIRE(!currentlySending, "another message send is already in progress");
+
+    currentlySending = true;
+
+    KJ_IF_MAYBE(p, sendingPong) {
+      // We recently sent a pong, make sure it's finished before proceeding.
+      auto promise = p->then([this, opcode, message]() {
+        currentlySending = false;
+        return sendImpl(opcode, message);
+      });
+      sendingPong = nullptr;
+      return promise;
+    }
+
+    sendClosed = opcode == OPCODE_CLOSE;
+
+    Mask mask(maskKeyGenerator);
+
+    kj::Array<byte> ownMessage;
+    bool compressed = deflate != nullptr && opcode < OPCODE_FIRST_CONTROL;
+    if (compressed) {
+      // Compressing produces a fresh array, which we can then mask in place.
+      ownMessage = deflateMessage(message);
+      auto payload = ownMessage.slice(0, ownMessage.size() - sizeof(DEFLATE_TAIL));
+      if (!mask.isZero()) {
+        mask.apply(payload);
+      }
+      message = payload;
+    } else if (!mask.isZero()) {
+      // Sadness, we have to make a copy to apply the mask.
+      ownMessage = kj::heapArray(message);
+      mask.apply(ownMessage);
+      message = ownMessage;
+    }
+
+    sendParts[0] = sendHeader.compose(true, opcode, message.size(), mask, compressed);
+    sendParts[1] = message;
+
+    auto promise = stream->write(sendParts);
+    if (ownMessage != nullptr) {
       promise = promise.attach(kj::mv(ownMessage));
     }
     return promise.then([this]() {
@@ -2366,12 +3326,13 @@ private:
 
 kj::Own<WebSocket> upgradeToWebSocket(
     kj::Own<kj::AsyncIoStream> stream, HttpInputStream& httpInput, HttpOutputStream& httpOutput,
-    kj::Maybe<EntropySource&> maskKeyGenerator) {
+    kj::Maybe<EntropySource&> maskKeyGenerator,
+    kj::Maybe<WebSocketDeflateConfig> deflate = nullptr) {
   // Create a WebSocket upgraded from an HTTP stream.
   auto releasedBuffer = httpInput.releaseBuffer();
   return kj::heap<WebSocketImpl>(kj::mv(stream), maskKeyGenerator,
                                  kj::mv(releasedBuffer.buffer), releasedBuffer.leftover,
-                                 httpOutput.flush());
+                                 httpOutput.flush(), kj::mv(deflate));
 }
 
 }  // namespace
@@ -2381,6 +3342,33 @@ kj::Own<WebSocket> newWebSocket(kj::Own<kj::AsyncIoStream> stream,
   return kj::heap<WebSocketImpl>(kj::mv(stream), maskKeyGenerator);
 }
 
+kj::Promise<WebSocket::MessageView> WebSocket::receiveInto(kj::ArrayPtr<byte> buffer) {
+  return receive().then([buffer](Message&& message) mutable -> MessageView {
+    KJ_SWITCH_ONEOF(message) {
+      KJ_CASE_ONEOF(text, kj::String) {
+        KJ_REQUIRE(text.size() <= buffer.size(),
+            "WebSocket message is larger than the receive buffer", text.size(), buffer.size());
+        memcpy(buffer.begin(), text.begin(), text.size());
+        return buffer.slice(0, text.size()).asChars();
+      }
+      KJ_CASE_ONEOF(data, kj::Array<byte>) {
+        KJ_REQUIRE(data.size() <= buffer.size(),
+            "WebSocket message is larger than the receive buffer", data.size(), buffer.size());
+        memcpy(buffer.begin(), data.begin(), data.size());
+        return buffer.slice(0, data.size());
+      }
+      KJ_CASE_ONEOF(close, Close) {
+        return kj::mv(close);
+      }
+    }
+    KJ_UNREACHABLE;
+  });
+}
+
+kj::Maybe<kj::Promise<void>> WebSocket::tryPumpFrom(WebSocket& other) {
+  return nullptr;
+}
+
 static kj::Promise<void> pumpWebSocketLoop(WebSocket& from, WebSocket& to) {
   return from.receive().then([&from,&to](WebSocket::Message&& message) {
     KJ_SWITCH_ONEOF(message) {
@@ -2406,6 +3394,9 @@ static kj::Promise<void> pumpWebSocketLoop(WebSocket& from, WebSocket& to) {
 
 kj::Promise<void> WebSocket::pumpTo(WebSocket& other) {
   return kj::evalNow([&]() {
+    KJ_IF_MAYBE(promise, other.tryPumpFrom(*this)) {
+      return kj::mv(*promise);
+    }
     return pumpWebSocketLoop(*this, other);
   }).catch_([&other](kj::Exception&& e) -> kj::Promise<void> {
     if (e.getType() == kj::Exception::Type::DISCONNECTED) {
@@ -2428,7 +3419,10 @@ public:
       : httpInput(*rawStream, responseHeaderTable),
         httpOutput(*rawStream),
         ownStream(kj::mv(rawStream)),
-        settings(kj::mv(settings)) {}
+        settings(kj::mv(settings)),
+        acceptEncoding(kj::strArray(
+            KJ_MAP(codec, this->settings.compressionCodecs) { return codec->getName(); },
+            ", ")) {}
 
   bool canReuse() {
     // Returns true if we can immediately reuse this HttpClient for another message (so all
@@ -2437,6 +3431,17 @@ public:
     return !upgraded && !closed && httpInput.canReuse() && httpOutput.canReuse();
   }
 
+  bool canPipeline() {
+    // Returns true if another request can be written to this connection now, although responses
+    // to earlier requests may still be outstanding.
+
+    return !upgraded && !closed && httpInput.canPipeline() && httpOutput.canReuse();
+  }
+
+  uint getPendingResponseCount() {
+    return httpInput.getPendingMessageCount();
+  }
+
   Request request(HttpMethod method, kj::StringPtr url, const HttpHeaders& headers,
                   kj::Maybe<uint64_t> expectedBodySize = nullptr) override {
     KJ_REQUIRE(!upgraded,
@@ -2460,7 +3465,15 @@ public:
       connectionHeaders[BuiltinHeaderIndices::TRANSFER_ENCODING] = "chunked";
     }
 
-    httpOutput.writeHeaders(headers.serializeRequest(method, url, connectionHeaders));
+    const HttpHeaders* requestHeaders = &headers;
+    kj::Maybe<HttpHeaders> encodedHeaders;
+    if (acceptEncoding.size() > 0 && headers.get(HttpHeaderId::ACCEPT_ENCODING) == nullptr) {
+      auto& newHeaders = encodedHeaders.emplace(headers.cloneShallow());
+      newHeaders.set(HttpHeaderId::ACCEPT_ENCODING, acceptEncoding);
+      requestHeaders = &newHeaders;
+    }
+
+    httpOutput.writeHeaders(requestHeaders->serializeRequest(method, url, connectionHeaders));
 
     kj::Own<kj::AsyncOutputStream> bodyStream;
     if (method == HttpMethod::GET || method == HttpMethod::HEAD) {
@@ -2477,11 +3490,13 @@ public:
         .then([this,method](kj::Maybe<HttpHeaders::Response>&& response) -> HttpClient::Response {
       KJ_IF_MAYBE(r, response) {
         auto& headers = httpInput.getHeaders();
+        auto body = httpInput.getEntityBody(
+            HttpInputStream::RESPONSE, method, r->statusCode, headers);
         HttpClient::Response result {
           r->statusCode,
           r->statusText,
           &headers,
-          httpInput.getEntityBody(HttpInputStream::RESPONSE, method, r->statusCode, headers)
+          decodeContent(method, r->statusCode, kj::mv(body))
         };
 
         if (fastCaseCmp<'c', 'l', 'o', 's', 'e'>(
@@ -2526,6 +3541,12 @@ public:
     connectionHeaders[BuiltinHeaderIndices::SEC_WEBSOCKET_VERSION] = "13";
     connectionHeaders[BuiltinHeaderIndices::SEC_WEBSOCKET_KEY] = keyBase64;
 
+    kj::String extensionOffer;
+    if (settings.webSocketCompression.codec != nullptr) {
+      extensionOffer = makeDeflateOffer(settings.webSocketCompression);
+      connectionHeaders[BuiltinHeaderIndices::SEC_WEBSOCKET_EXTENSIONS] = extensionOffer;
+    }
+
     httpOutput.writeHeaders(headers.serializeRequest(HttpMethod::GET, url, connectionHeaders));
 
     // No entity-body.
@@ -2556,11 +3577,19 @@ public:
             return HttpClient::WebSocketResponse();
           }
 
+          kj::Maybe<WebSocketDeflateConfig> deflate;
+          if (settings.webSocketCompression.codec != nullptr) {
+            KJ_IF_MAYBE(extensions, headers.get(HttpHeaderId::SEC_WEBSOCKET_EXTENSIONS)) {
+              deflate = acceptDeflateResponse(*extensions, settings.webSocketCompression);
+            }
+          }
+
           return {
             r->statusCode,
             r->statusText,
             &httpInput.getHeaders(),
-            upgradeToWebSocket(kj::mv(ownStream), httpInput, httpOutput, settings.entropySource),
+            upgradeToWebSocket(kj::mv(ownStream), httpInput, httpOutput, settings.entropySource,
+                               kj::mv(deflate)),
           };
         } else {
           upgraded = false;
@@ -2591,6 +3620,9 @@ private:
   HttpOutputStream httpOutput;
   kj::Own<AsyncIoStream> ownStream;
   HttpClientSettings settings;
+  kj::String acceptEncoding;
+  // Precomputed Accept-Encoding value offering `settings.compressionCodecs`.
+
   kj::Maybe<kj::Promise<void>> closeWatcherTask;
   bool upgraded = false;
   bool closed = false;
@@ -2613,6 +3645,36 @@ private:
       }
     }).eagerlyEvaluate(nullptr);
   }
+
+  kj::Own<kj::AsyncInputStream> decodeContent(
+      HttpMethod method, uint statusCode, kj::Own<kj::AsyncInputStream> body) {
+    // If the response's Content-Encoding is one we offered, wraps `body` to decode it and strips
+    // the headers that describe the encoded form.
+
+    if (settings.compressionCodecs.size() == 0 || method == HttpMethod::HEAD ||
+        statusCode == 204 || statusCode == 304) {
+      return kj::mv(body);
+    }
+    KJ_IF_MAYBE(length, body->tryGetLength()) {
+      // An empty body isn't a valid compressed stream, but is what we get for, e.g., a redirect
+      // which carried over the Content-Encoding.
+      if (*length == 0) return kj::mv(body);
+    }
+
+    auto& headers = httpInput.getHeaders();
+    KJ_IF_MAYBE(encoding, headers.get(HttpHeaderId::CONTENT_ENCODING)) {
+      for (auto codec: settings.compressionCodecs) {
+        if (equalsIgnoreCase(*encoding, codec->getName())) {
+          headers.unset(HttpHeaderId::CONTENT_ENCODING);
+          headers.unset(HttpHeaderId::CONTENT_LENGTH);
+          auto decoded = kj::heap<DecompressingAsyncInputStream>(
+              *body, codec->newDecompressor(), codec->getName());
+          return decoded.attach(kj::mv(body));
+        }
+      }
+    }
+    return kj::mv(body);
+  }
 };
 
 }  // namespace
@@ -2818,21 +3880,163 @@ public:
         address(kj::mv(address)),
         settings(kj::mv(settings)) {}
 
-  bool isDrained() {
-    // Returns true if there are no open connections.
-    return activeConnectionCount == 0 && availableClients.empty();
-  }
+  ~NetworkAddressHttpClient() noexcept(false) {
+    // Requests still waiting for a connection must not outlive us.
+    while (true) {
+      KJ_IF_MAYBE(waiter, popWaiter()) {
+        waiter->fulfiller.reject(KJ_EXCEPTION(DISCONNECTED,
+            "HttpClient destroyed while request was waiting for a connection"));
+      } else {
+        break;
+      }
+    }
+    updateStats([&](HttpClientPoolStats& stats) {
+      stats.idleConnections -= availableClients.size();
+    });
+  }
+
+  bool isDrained() {
+    // Returns true if there are no open connections.
+    return activeConnectionCount == 0 && availableClients.empty() && waiters.empty();
+  }
+
+  kj::Promise<void> onDrained() {
+    // Returns a promise which resolves the next time isDrained() transitions from false to true.
+    auto paf = kj::newPromiseAndFulfiller<void>();
+    drainedFulfiller = kj::mv(paf.fulfiller);
+    return kj::mv(paf.promise);
+  }
+
+  Request request(HttpMethod method, kj::StringPtr url, const HttpHeaders& headers,
+                  kj::Maybe<uint64_t> expectedBodySize = nullptr) override {
+    bool pipelinable = method == HttpMethod::GET || method == HttpMethod::HEAD;
+    KJ_IF_MAYBE(refcounted, tryGetClient(pipelinable)) {
+      return requestOn(kj::mv(*refcounted), method, url, headers, expectedBodySize);
+    }
+
+    // All connections are busy. Queue up. As in PromiseNetworkAddressHttpClient, this means
+    // returning a body stream that buffers calls until the connection is ours.
+    auto urlCopy = kj::str(url);
+    auto headersCopy = headers.clone();
+    auto combined = waitForClient().then(kj::mvCapture(urlCopy, kj::mvCapture(headersCopy,
+        [this,method,expectedBodySize](HttpHeaders&& headers, kj::String&& url,
+                                       kj::Own<RefcountedClient>&& refcounted)
+        -> kj::Tuple<kj::Own<kj::AsyncOutputStream>, kj::Promise<Response>> {
+      auto req = requestOn(kj::mv(refcounted), method, url, headers, expectedBodySize);
+      return kj::tuple(kj::mv(req.body), kj::mv(req.response));
+    })));
+
+    auto split = combined.split();
+    return {
+      kj::heap<PromiseOutputStream>(kj::mv(kj::get<0>(split))),
+      kj::mv(kj::get<1>(split))
+    };
+  }
+
+  kj::Promise<WebSocketResponse> openWebSocket(
+      kj::StringPtr url, const HttpHeaders& headers) override {
+    KJ_IF_MAYBE(refcounted, tryGetClient(false)) {
+      return openWebSocketOn(kj::mv(*refcounted), url, headers);
+    }
+
+    auto urlCopy = kj::str(url);
+    auto headersCopy = headers.clone();
+    return waitForClient().then(kj::mvCapture(urlCopy, kj::mvCapture(headersCopy,
+        [this](HttpHeaders&& headers, kj::String&& url, kj::Own<RefcountedClient>&& refcounted) {
+      return openWebSocketOn(kj::mv(refcounted), url, headers);
+    })));
+  }
+
+private:
+  kj::Timer& timer;
+  HttpHeaderTable& responseHeaderTable;
+  kj::Own<kj::NetworkAddress> address;
+  HttpClientSettings settings;
+
+  kj::Maybe<kj::Own<kj::PromiseFulfiller<void>>> drainedFulfiller;
+  uint activeConnectionCount = 0;
+
+  bool timeoutsScheduled = false;
+  kj::Promise<void> timeoutTask = nullptr;
+
+  struct AvailableClient {
+    kj::Own<HttpClientImpl> client;
+    kj::TimePoint expires;
+  };
+
+  std::deque<AvailableClient> availableClients;
+
+  struct RefcountedClient final: public kj::Refcounted {
+    RefcountedClient(NetworkAddressHttpClient& parent, kj::Own<HttpClientImpl> client)
+        : parent(parent), client(kj::mv(client)) {
+      ++parent.activeConnectionCount;
+      parent.busyClients.add(this);
+      parent.updateStats([](HttpClientPoolStats& stats) { ++stats.activeConnections; });
+    }
+    ~RefcountedClient() noexcept(false) {
+      --parent.activeConnectionCount;
+      for (auto& busy: parent.busyClients) {
+        if (busy == this) {
+          busy = parent.busyClients.back();
+          parent.busyClients.removeLast();
+          break;
+        }
+      }
+      parent.updateStats([](HttpClientPoolStats& stats) { --stats.activeConnections; });
+      KJ_IF_MAYBE(exception, kj::runCatchingExceptions([&]() {
+        parent.returnClientToAvailable(kj::mv(client));
+      })) {
+        KJ_LOG(ERROR, *exception);
+      }
+    }
+
+    NetworkAddressHttpClient& parent;
+    kj::Own<HttpClientImpl> client;
+  };
+
+  kj::Vector<RefcountedClient*> busyClients;
+  // Connections currently in use, candidates for pipelining.
+
+  class Waiter {
+    // A request waiting in line for a connection. Its promise owns it, so a canceled request
+    // leaves the queue on its own.
+
+  public:
+    Waiter(kj::PromiseFulfiller<kj::Own<RefcountedClient>>& fulfiller,
+           NetworkAddressHttpClient& parent)
+        : fulfiller(fulfiller), parent(parent) {
+      parent.waiters.push_back(this);
+      parent.updateStats([](HttpClientPoolStats& stats) { ++stats.queuedRequests; });
+    }
+    ~Waiter() noexcept(false) {
+      KJ_IF_MAYBE(p, parent) {
+        auto& queue = p->waiters;
+        for (auto iter = queue.begin(); iter != queue.end(); ++iter) {
+          if (*iter == this) {
+            queue.erase(iter);
+            p->updateStats([](HttpClientPoolStats& stats) { --stats.queuedRequests; });
+            break;
+          }
+        }
+      }
+    }
+
+    kj::PromiseFulfiller<kj::Own<RefcountedClient>>& fulfiller;
+    kj::Maybe<NetworkAddressHttpClient&> parent;
+    // Null once the waiter has been removed from the queue.
+  };
 
-  kj::Promise<void> onDrained() {
-    // Returns a promise which resolves the next time isDrained() transitions from false to true.
-    auto paf = kj::newPromiseAndFulfiller<void>();
-    drainedFulfiller = kj::mv(paf.fulfiller);
-    return kj::mv(paf.promise);
+  std::deque<Waiter*> waiters;
+
+  template <typename Func>
+  void updateStats(Func&& func) {
+    KJ_IF_MAYBE(stats, settings.poolStats) {
+      func(*stats);
+    }
   }
 
-  Request request(HttpMethod method, kj::StringPtr url, const HttpHeaders& headers,
-                  kj::Maybe<uint64_t> expectedBodySize = nullptr) override {
-    auto refcounted = getClient();
+  Request requestOn(kj::Own<RefcountedClient> refcounted, HttpMethod method, kj::StringPtr url,
+                    const HttpHeaders& headers, kj::Maybe<uint64_t> expectedBodySize) {
     auto result = refcounted->client->request(method, url, headers, expectedBodySize);
     result.body = result.body.attach(kj::addRef(*refcounted));
     result.response = result.response.then(kj::mvCapture(refcounted,
@@ -2843,9 +4047,8 @@ public:
     return result;
   }
 
-  kj::Promise<WebSocketResponse> openWebSocket(
-      kj::StringPtr url, const HttpHeaders& headers) override {
-    auto refcounted = getClient();
+  kj::Promise<WebSocketResponse> openWebSocketOn(kj::Own<RefcountedClient> refcounted,
+                                                 kj::StringPtr url, const HttpHeaders& headers) {
     auto result = refcounted->client->openWebSocket(url, headers);
     return result.then(kj::mvCapture(refcounted,
         [](kj::Own<RefcountedClient>&& refcounted, WebSocketResponse&& response) {
@@ -2866,66 +4069,115 @@ public:
     }));
   }
 
-private:
-  kj::Timer& timer;
-  HttpHeaderTable& responseHeaderTable;
-  kj::Own<kj::NetworkAddress> address;
-  HttpClientSettings settings;
+  kj::Maybe<kj::Own<RefcountedClient>> tryGetClient(bool pipelinable) {
+    // Returns a connection for a new request, preferring an idle one, then a new one, then (if
+    // permitted) the least-loaded busy one. Returns null if the request has to wait.
 
-  kj::Maybe<kj::Own<kj::PromiseFulfiller<void>>> drainedFulfiller;
-  uint activeConnectionCount = 0;
+    // Don't jump the queue.
+    if (waiters.empty()) {
+      KJ_IF_MAYBE(idle, tryGetIdleClient()) {
+        return kj::mv(*idle);
+      }
 
-  bool timeoutsScheduled = false;
-  kj::Promise<void> timeoutTask = nullptr;
+      if (activeConnectionCount < settings.maxConnections) {
+        return newClient();
+      }
+    }
 
-  struct AvailableClient {
-    kj::Own<HttpClientImpl> client;
-    kj::TimePoint expires;
-  };
+    if (pipelinable && settings.maxPipelineDepth > 1) {
+      RefcountedClient* best = nullptr;
+      uint bestDepth = settings.maxPipelineDepth;
+      for (auto busy: busyClients) {
+        if (busy->client->canPipeline()) {
+          uint depth = busy->client->getPendingResponseCount();
+          if (depth < bestDepth) {
+            best = busy;
+            bestDepth = depth;
+          }
+        }
+      }
+      if (best != nullptr) {
+        updateStats([](HttpClientPoolStats& stats) { ++stats.pipelinedRequests; });
+        return kj::addRef(*best);
+      }
+    }
 
-  std::deque<AvailableClient> availableClients;
+    return nullptr;
+  }
 
-  struct RefcountedClient final: public kj::Refcounted {
-    RefcountedClient(NetworkAddressHttpClient& parent, kj::Own<HttpClientImpl> client)
-        : parent(parent), client(kj::mv(client)) {
-      ++parent.activeConnectionCount;
-    }
-    ~RefcountedClient() noexcept(false) {
-      --parent.activeConnectionCount;
-      KJ_IF_MAYBE(exception, kj::runCatchingExceptions([&]() {
-        parent.returnClientToAvailable(kj::mv(client));
-      })) {
-        KJ_LOG(ERROR, *exception);
+  kj::Maybe<kj::Own<RefcountedClient>> tryGetIdleClient() {
+    while (!availableClients.empty()) {
+      auto client = kj::mv(availableClients.back().client);
+      availableClients.pop_back();
+      updateStats([](HttpClientPoolStats& stats) { --stats.idleConnections; });
+      if (client->canReuse()) {
+        return kj::refcounted<RefcountedClient>(*this, kj::mv(client));
       }
+      // Whoops, this client's connection was closed by the server at some point. Discard.
     }
+    return nullptr;
+  }
 
-    NetworkAddressHttpClient& parent;
-    kj::Own<HttpClientImpl> client;
-  };
+  kj::Own<RefcountedClient> newClient() {
+    auto startTime = timer.now();
+    auto connectPromise = address->connect()
+        .then([this,startTime](kj::Own<kj::AsyncIoStream>&& connection) {
+      auto connectTime = timer.now() - startTime;
+      updateStats([&](HttpClientPoolStats& stats) {
+        ++stats.connectionsOpened;
+        stats.totalConnectTime += connectTime;
+        if (connectTime > stats.maxConnectTime) stats.maxConnectTime = connectTime;
+      });
+      return kj::mv(connection);
+    }, [this](kj::Exception&& e) -> kj::Own<kj::AsyncIoStream> {
+      updateStats([](HttpClientPoolStats& stats) { ++stats.connectFailures; });
+      kj::throwFatalException(kj::mv(e));
+    });
 
-  kj::Own<RefcountedClient> getClient() {
-    for (;;) {
-      if (availableClients.empty()) {
-        auto stream = kj::heap<PromiseIoStream>(address->connect());
-        return kj::refcounted<RefcountedClient>(*this,
-          kj::heap<HttpClientImpl>(responseHeaderTable, kj::mv(stream), settings));
-      } else {
-        auto client = kj::mv(availableClients.back().client);
-        availableClients.pop_back();
-        if (client->canReuse()) {
-          return kj::refcounted<RefcountedClient>(*this, kj::mv(client));
-        }
-        // Whoops, this client's connection was closed by the server at some point. Discard.
-      }
+    auto stream = kj::heap<PromiseIoStream>(kj::mv(connectPromise));
+    return kj::refcounted<RefcountedClient>(*this,
+      kj::heap<HttpClientImpl>(responseHeaderTable, kj::mv(stream), settings));
+  }
+
+  kj::Promise<kj::Own<RefcountedClient>> waitForClient() {
+    if (waiters.size() >= settings.maxPendingRequests) {
+      updateStats([](HttpClientPoolStats& stats) { ++stats.requestsRejected; });
+      kj::throwFatalException(KJ_EXCEPTION(OVERLOADED,
+          "too many HTTP requests waiting for a connection", waiters.size()));
     }
+    return kj::newAdaptedPromise<kj::Own<RefcountedClient>, Waiter>(*this);
+  }
+
+  kj::Maybe<Waiter&> popWaiter() {
+    // Every path that takes a waiter out of the queue, other than cancellation, goes through here
+    // so that `queuedRequests` stays accurate.
+    if (waiters.empty()) return nullptr;
+    auto& waiter = *waiters.front();
+    waiters.pop_front();
+    waiter.parent = nullptr;
+    updateStats([](HttpClientPoolStats& stats) { --stats.queuedRequests; });
+    return waiter;
   }
 
   void returnClientToAvailable(kj::Own<HttpClientImpl> client) {
     // Only return the connection to the pool if it is reusable.
     if (client->canReuse()) {
+      KJ_IF_MAYBE(waiter, popWaiter()) {
+        // Hand it straight to the next request in line.
+        waiter->fulfiller.fulfill(kj::refcounted<RefcountedClient>(*this, kj::mv(client)));
+        return;
+      }
+
       availableClients.push_back(AvailableClient {
         kj::mv(client), timer.now() + settings.idleTimout
       });
+      updateStats([](HttpClientPoolStats& stats) { ++stats.idleConnections; });
+    } else if (activeConnectionCount < settings.maxConnections) {
+      // The connection is gone, which frees a slot for the next request in line.
+      KJ_IF_MAYBE(waiter, popWaiter()) {
+        waiter->fulfiller.fulfill(newClient());
+        return;
+      }
     }
 
     // Call this either way because it also signals onDrained().
@@ -2950,6 +4202,7 @@ private:
       return timer.atTime(time).then([this,time]() {
         while (!availableClients.empty() && availableClients.front().expires <= time) {
           availableClients.pop_front();
+          updateStats([](HttpClientPoolStats& stats) { --stats.idleConnections; });
         }
         return applyTimeouts();
       });
@@ -3074,8 +4327,8 @@ private:
     kj::Own<PromiseNetworkAddressHttpClient> client;
   };
 
-  std::map<kj::StringPtr, Host> httpHosts;
-  std::map<kj::StringPtr, Host> httpsHosts;
+  kj::HashMap<kj::StringPtr, Host> httpHosts;
+  kj::HashMap<kj::StringPtr, Host> httpsHosts;
 
   struct RequestInfo {
     HttpMethod method;
@@ -3102,9 +4355,9 @@ private:
     //   - Correctly handling TLS would be tricky: we'd need to verify that the new hostname is
     //     on the certificate. When SNI is in use we might have to request an additional
     //     certificate (is that possible?).
-    auto iter = hosts.find(parsed.host);
-
-    if (iter == hosts.end()) {
+    KJ_IF_MAYBE(host, hosts.find(parsed.host)) {
+      return *host->client;
+    } else {
       // Need to open a new connection.
       kj::Network* networkToUse = &network;
       if (isHttps) {
@@ -3117,32 +4370,32 @@ private:
             timer, responseHeaderTable, kj::mv(addr), settings);
       });
 
-      Host host {
+      Host newHost {
         kj::mv(parsed.host),
         kj::heap<PromiseNetworkAddressHttpClient>(kj::mv(promise))
       };
-      kj::StringPtr nameRef = host.name;
+      kj::StringPtr nameRef = newHost.name;
+      auto& client = *newHost.client;
 
-      auto insertResult = hosts.insert(std::make_pair(nameRef, kj::mv(host)));
-      KJ_ASSERT(insertResult.second);
-      iter = insertResult.first;
+      hosts.insert(nameRef, kj::mv(newHost));
 
-      tasks.add(handleCleanup(hosts, iter));
+      tasks.add(handleCleanup(hosts, nameRef));
+      return client;
     }
-
-    return *iter->second.client;
   }
 
-  kj::Promise<void> handleCleanup(std::map<kj::StringPtr, Host>& hosts,
-                                  std::map<kj::StringPtr, Host>::iterator iter) {
-    return iter->second.client->onDrained()
-        .then([this,&hosts,iter]() -> kj::Promise<void> {
+  kj::Promise<void> handleCleanup(kj::HashMap<kj::StringPtr, Host>& hosts, kj::StringPtr name) {
+    // `name` points into the Host's own `name`, which is heap-allocated, so it stays valid even
+    // as the map moves the Host around.
+    auto& client = *KJ_ASSERT_NONNULL(hosts.find(name)).client;
+    return client.onDrained()
+        .then([this,&hosts,&client,name]() -> kj::Promise<void> {
       // Double-check that it's really drained to avoid race conditions.
-      if (iter->second.client->isDrained()) {
-        hosts.erase(iter);
+      if (client.isDrained()) {
+        hosts.erase(name);
         return kj::READY_NOW;
       } else {
-        return handleCleanup(hosts, iter);
+        return handleCleanup(hosts, name);
       }
     });
   }
@@ -3237,6 +4490,12 @@ kj::Own<HttpService> newHttpService(HttpClient& client) {
 
 // =======================================================================================
 
+kj::Own<kj::AsyncOutputStream> HttpService::Response::sendPrepared(
+    const HttpPreparedHeaders& prepared, kj::Maybe<uint64_t> expectedBodySize) {
+  return send(prepared.getStatusCode(), prepared.getStatusText(), prepared.getHeaders(),
+              expectedBodySize);
+}
+
 kj::Promise<void> HttpService::Response::sendError(
     uint statusCode, kj::StringPtr statusText, const HttpHeaders& headers) {
   auto stream = send(statusCode, statusText, headers, statusText.size());
@@ -3253,6 +4512,75 @@ kj::Promise<kj::Own<kj::AsyncIoStream>> HttpService::connect(kj::StringPtr host)
   KJ_UNIMPLEMENTED("CONNECT is not implemented by this HttpService");
 }
 
+class HttpServer::BufferPool final: public HeaderBufferPool, public kj::ArrayDisposer {
+  // Header buffers for all of the server's HTTP/1 connections. Freed MIN_BUFFER-sized buffers are
+  // kept for reuse (up to a limit); bigger ones go back to the heap. Buffers handed to a WebSocket
+  // by an upgrade still come back here when it is destroyed.
+
+public:
+  explicit BufferPool(const HttpServerSettings& settings): settings(settings) {}
+  ~BufferPool() noexcept(false) {
+    for (char* buffer: freeList) {
+      operator delete(buffer);
+    }
+  }
+
+  HttpServerBufferStats getStats() const {
+    HttpServerBufferStats result = stats;
+    result.buffersPooled = freeList.size();
+    return result;
+  }
+
+  void noteShed() { ++stats.connectionsShed; }
+
+  kj::Maybe<kj::Array<char>> tryAllocate(size_t size) override {
+    char* buffer;
+    if (size == MIN_BUFFER && !freeList.empty()) {
+      buffer = freeList.back();
+      freeList.removeLast();
+    } else {
+      // Drop pooled buffers before refusing for lack of budget.
+      while (size > settings.bufferMemoryBudget - stats.bytesAllocated && !freeList.empty()) {
+        operator delete(freeList.back());
+        freeList.removeLast();
+        stats.bytesAllocated -= MIN_BUFFER;
+      }
+      if (size > settings.bufferMemoryBudget - stats.bytesAllocated) {
+        return nullptr;
+      }
+      buffer = reinterpret_cast<char*>(operator new(size));
+      stats.bytesAllocated += size;
+      stats.peakBytesAllocated = kj::max(stats.peakBytesAllocated, stats.bytesAllocated);
+    }
+    ++stats.buffersInUse;
+    return kj::Array<char>(buffer, size, *this);
+  }
+
+  bool shouldReleaseIdle() override { return settings.releaseIdleBuffers; }
+  void noteIdleRelease() override { ++stats.idleReleases; }
+
+protected:
+  void disposeImpl(void* firstElement, size_t elementSize, size_t elementCount,
+                   size_t capacity, void (*destroyElement)(void*)) const override {
+    // ArrayDisposer's interface is const, but returning a buffer changes our state.
+    auto& self = const_cast<BufferPool&>(*this);
+    --self.stats.buffersInUse;
+    if (capacity == MIN_BUFFER && freeList.size() < MAX_POOLED_BUFFERS) {
+      self.freeList.add(reinterpret_cast<char*>(firstElement));
+    } else {
+      operator delete(firstElement);
+      self.stats.bytesAllocated -= capacity;
+    }
+  }
+
+private:
+  static constexpr size_t MAX_POOLED_BUFFERS = 256;
+
+  const HttpServerSettings& settings;
+  kj::Vector<char*> freeList;
+  HttpServerBufferStats stats;
+};
+
 class HttpServer::Connection final: private HttpService::Response {
 public:
   Connection(HttpServer& server, kj::AsyncIoStream& stream,
@@ -3260,9 +4588,12 @@ public:
       : server(server),
         stream(stream),
         service(service),
-        httpInput(stream, server.requestHeaderTable),
+        httpInput(stream, server.requestHeaderTable, *server.bufferPool),
         httpOutput(stream) {
     ++server.connectionCount;
+    if (server.settings.observer != nullptr) {
+      server.settings.observer->connectionAccepted(server.timer.now());
+    }
   }
   ~Connection() noexcept(false) {
     if (--server.connectionCount == 0) {
@@ -3290,6 +4621,17 @@ public:
     auto receivedHeaders = firstByte
         .then([this,firstRequest](bool hasData)-> kj::Promise<kj::Maybe<HttpHeaders::Request>> {
       if (hasData) {
+        if (server.settings.observer != nullptr) {
+          firstByteTime = server.timer.now();
+        }
+
+        if (!httpInput.tryAcquireBuffer()) {
+          // No buffer memory to read the request with. Turn the client away.
+          shed = true;
+          server.bufferPool->noteShed();
+          return kj::Maybe<HttpHeaders::Request>(nullptr);
+        }
+
         auto readHeaders = httpInput.readRequestHeaders();
         if (!firstRequest) {
           // On requests other than the first, the header timeout starts ticking when we receive
@@ -3323,6 +4665,9 @@ public:
 
     return receivedHeaders
         .then([this](kj::Maybe<HttpHeaders::Request>&& request) -> kj::Promise<bool> {
+      // The previous request, if any, is done.
+      requestObserver = nullptr;
+
       if (closed) {
         // Client closed connection. Close our end too.
         return httpOutput.flush().then([]() { return false; });
@@ -3344,6 +4689,10 @@ public:
 
         return httpOutput.flush().then([this]() { return server.draining; });
       }
+      if (shed) {
+        return sendError(503, "Service Unavailable", kj::str(
+            "ERROR: The server is out of memory for new requests. Try again later."));
+      }
 
       KJ_IF_MAYBE(req, request) {
         auto& headers = httpInput.getHeaders();
@@ -3352,6 +4701,16 @@ public:
         auto body = httpInput.getEntityBody(
             HttpInputStream::REQUEST, req->method, 0, headers);
 
+        if (server.settings.observer != nullptr) {
+          auto now = server.timer.now();
+          requestObserver = server.settings.observer->requestStarted(
+              req->method, req->url, headers, firstByteTime, now);
+          KJ_IF_MAYBE(o, requestObserver) {
+            body = kj::heap<ObservedInputStream>(kj::mv(body), **o);
+            o->get()->handlerStarted(now);
+          }
+        }
+
         // TODO(perf): If the client disconnects, should we cancel the response? Probably, to
         //   prevent permanent deadlock. It's slightly weird in that arguably the client should
         //   be able to shutdown the upstream but still wait on the downstream, but I believe many
@@ -3363,6 +4722,10 @@ public:
             [this](kj::Own<kj::AsyncInputStream> body) -> kj::Promise<bool> {
           // Response done. Await next request.
 
+          KJ_IF_MAYBE(o, requestObserver) {
+            o->get()->handlerReturned(server.timer.now());
+          }
+
           KJ_IF_MAYBE(p, webSocketError) {
             // sendWebSocketError() was called. Finish sending and close the connection.
             auto promise = kj::mv(*p);
@@ -3390,6 +4753,10 @@ public:
 
           return httpOutput.flush().then(kj::mvCapture(body,
               [this](kj::Own<kj::AsyncInputStream> body) -> kj::Promise<bool> {
+            KJ_IF_MAYBE(o, requestObserver) {
+              o->get()->responseCompleted(server.timer.now());
+            }
+
             if (httpInput.canReuse()) {
               // Things look clean. Go ahead and accept the next request.
 
@@ -3499,16 +4866,136 @@ private:
   kj::Maybe<HttpMethod> currentMethod;
   bool timedOut = false;
   bool closed = false;
+  bool shed = false;
   bool upgraded = false;
   bool webSocketClosed = false;
   kj::Maybe<kj::Promise<bool>> webSocketError;
 
+  kj::TimePoint firstByteTime = kj::origin<kj::TimePoint>();
+  kj::Maybe<kj::Own<HttpServerObserver::Request>> requestObserver;
+  // Only used with HttpServerSettings::observer.
+
+  class ObservedInputStream final: public kj::AsyncInputStream {
+    // Reports request body reads to the request's observer.
+
+  public:
+    ObservedInputStream(kj::Own<kj::AsyncInputStream> inner,
+                        HttpServerObserver::Request& observer)
+        : inner(kj::mv(inner)), observer(observer) {}
+
+    kj::Promise<size_t> tryRead(void* buffer, size_t minBytes, size_t maxBytes) override {
+      return inner->tryRead(buffer, minBytes, maxBytes).then([this](size_t amount) {
+        observer.requestBodyRead(amount);
+        return amount;
+      });
+    }
+
+    kj::Maybe<uint64_t> tryGetLength() override {
+      return inner->tryGetLength();
+    }
+
+    kj::Promise<uint64_t> pumpTo(kj::AsyncOutputStream& output, uint64_t amount) override {
+      return inner->pumpTo(output, amount).then([this](uint64_t actual) {
+        observer.requestBodyRead(actual);
+        return actual;
+      });
+    }
+
+  private:
+    kj::Own<kj::AsyncInputStream> inner;
+    HttpServerObserver::Request& observer;
+  };
+
+  class ObservedOutputStream final: public kj::AsyncOutputStream {
+    // Reports response body writes, and how long they waited, to the request's observer.
+
+  public:
+    ObservedOutputStream(kj::Own<kj::AsyncOutputStream> inner,
+                         HttpServerObserver::Request& observer, kj::Timer& timer)
+        : inner(kj::mv(inner)), observer(observer), timer(timer) {}
+
+    kj::Promise<void> write(const void* buffer, size_t size) override {
+      auto start = timer.now();
+      return inner->write(buffer, size).then([this,size,start]() {
+        observer.responseBodyWritten(size, timer.now() - start);
+      });
+    }
+
+    kj::Promise<void> write(kj::ArrayPtr<const kj::ArrayPtr<const byte>> pieces) override {
+      size_t size = 0;
+      for (auto& piece: pieces) size += piece.size();
+      auto start = timer.now();
+      return inner->write(pieces).then([this,size,start]() {
+        observer.responseBodyWritten(size, timer.now() - start);
+      });
+    }
+
+    kj::Maybe<kj::Promise<uint64_t>> tryPumpFrom(
+        kj::AsyncInputStream& input, uint64_t amount) override {
+      KJ_IF_MAYBE(pump, inner->tryPumpFrom(input, amount)) {
+        auto start = timer.now();
+        return pump->then([this,start](uint64_t actual) {
+          observer.responseBodyWritten(actual, timer.now() - start);
+          return actual;
+        });
+      } else {
+        // The default pump will call write().
+        return nullptr;
+      }
+    }
+
+  private:
+    kj::Own<kj::AsyncOutputStream> inner;
+    HttpServerObserver::Request& observer;
+    kj::Timer& timer;
+  };
+
+  kj::Own<kj::AsyncOutputStream> observeResponse(uint statusCode,
+                                                 kj::Own<kj::AsyncOutputStream> body) {
+    KJ_IF_MAYBE(o, requestObserver) {
+      o->get()->responseStarted(statusCode, server.timer.now());
+      return kj::heap<ObservedOutputStream>(kj::mv(body), **o, server.timer);
+    } else {
+      return kj::mv(body);
+    }
+  }
+
   kj::Own<kj::AsyncOutputStream> send(
       uint statusCode, kj::StringPtr statusText, const HttpHeaders& headers,
       kj::Maybe<uint64_t> expectedBodySize) override {
     auto method = KJ_REQUIRE_NONNULL(currentMethod, "already called send()");
     currentMethod = nullptr;
 
+    auto contentCodec = chooseContentCodec(method, statusCode, headers, expectedBodySize);
+
+    const HttpHeaders* responseHeaders = &headers;
+    kj::Maybe<HttpHeaders> modifiedHeaders;
+    auto modifyHeaders = [&]() -> HttpHeaders& {
+      KJ_IF_MAYBE(h, modifiedHeaders) {
+        return *h;
+      }
+      auto& newHeaders = modifiedHeaders.emplace(headers.cloneShallow());
+      responseHeaders = &newHeaders;
+      return newHeaders;
+    };
+
+    KJ_IF_MAYBE(codec, contentCodec) {
+      // The compressed length isn't known in advance.
+      expectedBodySize = nullptr;
+
+      auto& newHeaders = modifyHeaders();
+      newHeaders.set(HttpHeaderId::CONTENT_ENCODING, codec->getName());
+      KJ_IF_MAYBE(vary, headers.get(HttpHeaderId::VARY)) {
+        newHeaders.set(HttpHeaderId::VARY, kj::str(*vary, ", Accept-Encoding"));
+      } else {
+        newHeaders.set(HttpHeaderId::VARY, "Accept-Encoding");
+      }
+    }
+
+    KJ_IF_MAYBE(date, server.getDate(headers)) {
+      modifyHeaders().set(HttpHeaderId::DATE, *date);
+    }
+
     kj::StringPtr connectionHeaders[CONNECTION_HEADERS_COUNT];
     kj::String lengthStr;
 
@@ -3521,9 +5008,70 @@ private:
       connectionHeaders[BuiltinHeaderIndices::TRANSFER_ENCODING] = "chunked";
     }
 
-    httpOutput.writeHeaders(headers.serializeResponse(statusCode, statusText, connectionHeaders));
+    httpOutput.writeHeaders(
+        responseHeaders->serializeResponse(statusCode, statusText, connectionHeaders));
+
+    return observeResponse(statusCode,
+        startBody(method, statusCode, contentCodec, expectedBodySize));
+  }
+
+  kj::Own<kj::AsyncOutputStream> sendPrepared(
+      const HttpPreparedHeaders& prepared, kj::Maybe<uint64_t> expectedBodySize) override {
+    auto method = KJ_REQUIRE_NONNULL(currentMethod, "already called send()");
+    uint statusCode = prepared.getStatusCode();
+    auto& headers = prepared.getHeaders();
+
+    auto contentCodec = chooseContentCodec(method, statusCode, headers, expectedBodySize);
+    if (contentCodec != nullptr) {
+      // Compressing rewrites the headers, so the prepared block can't be used.
+      return send(statusCode, prepared.getStatusText(), headers, expectedBodySize);
+    }
+    currentMethod = nullptr;
+
+    // Write out what send() would pass as connection headers, plus Date, after the prepared block.
+    // At most 77 bytes.
+    char tail[128];
+    char* pos = tail;
+    if (statusCode == 204 || statusCode == 205 || statusCode == 304) {
+      // No entity-body.
+    } else KJ_IF_MAYBE(s, expectedBodySize) {
+      pos = kj::_::fill(pos, kj::StringPtr("Content-Length: "), kj::toCharSequence(*s),
+                        kj::StringPtr("\r\n"));
+    } else {
+      pos = kj::_::fill(pos, kj::StringPtr("Transfer-Encoding: chunked\r\n"));
+    }
+    KJ_IF_MAYBE(date, server.getDate(headers)) {
+      pos = kj::_::fill(pos, kj::StringPtr("Date: "), *date, kj::StringPtr("\r\n"));
+    }
+    pos = kj::_::fill(pos, kj::StringPtr("\r\n"));
+
+    httpOutput.writeHeaders(prepared.getSerialized(), kj::heapString(tail, pos - tail));
+
+    return observeResponse(statusCode, startBody(method, statusCode, nullptr, expectedBodySize));
+  }
+
+  kj::Maybe<CompressionCodec&> chooseContentCodec(
+      HttpMethod method, uint statusCode, const HttpHeaders& headers,
+      kj::Maybe<uint64_t> expectedBodySize) {
+    // Picks the content coding to apply to a response, per HttpServerSettings::compressionCodecs.
+
+    if (server.settings.compressionCodecs.size() > 0 && method != HttpMethod::HEAD &&
+        statusCode != 204 && statusCode != 205 && statusCode != 206 && statusCode != 304 &&
+        headers.get(HttpHeaderId::CONTENT_ENCODING) == nullptr &&
+        !isCompressedContentType(headers.get(HttpHeaderId::CONTENT_TYPE).orDefault("")) &&
+        expectedBodySize.orDefault(kj::maxValue) >= server.settings.compressionMinBytes) {
+      KJ_IF_MAYBE(acceptEncoding, httpInput.getHeaders().get(HttpHeaderId::ACCEPT_ENCODING)) {
+        return chooseContentEncoding(*acceptEncoding, server.settings.compressionCodecs);
+      }
+    }
+    return nullptr;
+  }
+
+  kj::Own<kj::AsyncOutputStream> startBody(
+      HttpMethod method, uint statusCode, kj::Maybe<CompressionCodec&> contentCodec,
+      kj::Maybe<uint64_t> expectedBodySize) {
+    // Returns the stream for the body of a response whose headers have just been written.
 
-    kj::Own<kj::AsyncOutputStream> bodyStream;
     if (method == HttpMethod::HEAD) {
       // Ignore entity-body.
       httpOutput.finishBody();
@@ -3532,6 +5080,8 @@ private:
       // No entity-body.
       httpOutput.finishBody();
       return heap<HttpNullEntityWriter>();
+    } else KJ_IF_MAYBE(codec, contentCodec) {
+      return heap<HttpCompressingEntityWriter>(httpOutput, codec->newCompressor());
     } else KJ_IF_MAYBE(s, expectedBodySize) {
       return heap<HttpFixedLengthEntityWriter>(httpOutput, *s);
     } else {
@@ -3572,8 +5122,23 @@ private:
     connectionHeaders[BuiltinHeaderIndices::UPGRADE] = "websocket";
     connectionHeaders[BuiltinHeaderIndices::CONNECTION] = "Upgrade";
 
+    kj::Maybe<WebSocketDeflateConfig> deflate;
+    kj::String extensionResponse;
+    auto& compression = server.settings.webSocketCompression;
+    if (compression.codec != nullptr) {
+      KJ_IF_MAYBE(offers, requestHeaders.get(HttpHeaderId::SEC_WEBSOCKET_EXTENSIONS)) {
+        deflate = acceptDeflateOffer(*offers, compression, extensionResponse);
+        if (deflate != nullptr) {
+          connectionHeaders[BuiltinHeaderIndices::SEC_WEBSOCKET_EXTENSIONS] = extensionResponse;
+        }
+      }
+    }
+
     httpOutput.writeHeaders(headers.serializeResponse(
         101, "Switching Protocols", connectionHeaders));
+    KJ_IF_MAYBE(o, requestObserver) {
+      o->get()->responseStarted(101, server.timer.now());
+    }
 
     upgraded = true;
     // We need to give the WebSocket an Own<AsyncIoStream>, but we only have a reference. This is
@@ -3583,7 +5148,7 @@ private:
     auto deferNoteClosed = kj::defer([this]() { webSocketClosed = true; });
     kj::Own<kj::AsyncIoStream> ownStream(&stream, kj::NullDisposer::instance);
     return upgradeToWebSocket(ownStream.attach(kj::mv(deferNoteClosed)),
-                              httpInput, httpOutput, nullptr);
+                              httpInput, httpOutput, nullptr, kj::mv(deflate));
   }
 
   kj::Promise<bool> sendError(uint statusCode, kj::StringPtr statusText, kj::String body) {
@@ -3592,10 +5157,24 @@ private:
     failed.set(HttpHeaderId::CONTENT_LENGTH, kj::str(body.size()));
 
     failed.set(HttpHeaderId::CONTENT_TYPE, "text/plain");
+    KJ_IF_MAYBE(date, server.getDate(failed)) {
+      failed.set(HttpHeaderId::DATE, *date);
+    }
 
     httpOutput.writeHeaders(failed.serializeResponse(statusCode, statusText));
     httpOutput.writeBodyData(kj::mv(body));
     httpOutput.finishBody();
+
+    KJ_IF_MAYBE(o, requestObserver) {
+      o->get()->responseStarted(statusCode, server.timer.now());
+      return httpOutput.flush().then([this]() {
+        KJ_IF_MAYBE(o, requestObserver) {
+          o->get()->responseCompleted(server.timer.now());
+        }
+        return false;
+      });
+    }
+
     return httpOutput.flush().then([]() { return false; });  // loop ends after flush
   }
 
@@ -3651,7 +5230,15 @@ HttpServer::HttpServer(kj::Timer& timer, HttpHeaderTable& requestHeaderTable,
                        Settings settings, kj::PromiseFulfillerPair<void> paf)
     : timer(timer), requestHeaderTable(requestHeaderTable), service(kj::mv(service)),
       settings(settings), onDrain(paf.promise.fork()), drainFulfiller(kj::mv(paf.fulfiller)),
-      tasks(*this) {}
+      bufferPool(kj::heap<BufferPool>(this->settings)), tasks(*this) {}
+
+HttpServer::~HttpServer() noexcept(false) {}
+
+HttpServerObserver::Request::~Request() noexcept(false) {}
+
+HttpServerBufferStats HttpServer::getBufferStats() const {
+  return bufferPool->getStats();
+}
 
 kj::Promise<void> HttpServer::drain() {
   KJ_REQUIRE(!draining, "you can only call drain() once");
@@ -3686,6 +5273,10 @@ kj::Promise<void> HttpServer::listenLoop(kj::ConnectionReceiver& port) {
 }
 
 kj::Promise<void> HttpServer::listenHttp(kj::Own<kj::AsyncIoStream> connection) {
+  if (settings.detectHttp2Preface) {
+    return listenHttpOrHttp2(kj::mv(connection));
+  }
+
   auto promise = listenHttpCleanDrain(*connection).ignoreResult();
 
   // eagerlyEvaluate() to maintain historical guarantee that this method eagerly closes the
@@ -3714,8 +5305,168 @@ kj::Promise<bool> HttpServer::listenHttpCleanDrain(kj::AsyncIoStream& connection
   return promise.attach(kj::mv(obj)).eagerlyEvaluate(nullptr);
 }
 
+namespace {
+
+static char* formatTwoDigits(char* out, uint value) {
+  *out++ = '0' + value / 10;
+  *out++ = '0' + value % 10;
+  return out;
+}
+
+static void formatHttpDate(int64_t seconds, char* out) {
+  // Writes `seconds` since the Unix epoch as an IMF-fixdate (RFC 7231 section 7.1.1.1), e.g.
+  // "Sun, 06 Nov 1994 08:49:37 GMT", followed by a NUL: 30 bytes in all.
+
+  static const char WEEKDAYS[7][4] = { "Thu", "Fri", "Sat", "Sun", "Mon", "Tue", "Wed" };
+  static const char MONTHS[12][4] = {
+    "Jan", "Feb", "Mar", "Apr", "May", "Jun", "Jul", "Aug", "Sep", "Oct", "Nov", "Dec"
+  };
+
+  int64_t days = seconds / 86400;
+  int64_t secondOfDay = seconds % 86400;
+  if (secondOfDay < 0) {
+    secondOfDay += 86400;
+    --days;
+  }
+  uint weekday = (days % 7 + 7) % 7;  // The epoch was a Thursday.
+
+  // Convert the day number to a proleptic Gregorian date, counting in 400-year eras that start on
+  // March 1 so that leap days fall at the end of each year.
+  int64_t shifted = days + 719468;
+  int64_t era = (shifted >= 0 ? shifted : shifted - 146096) / 146097;
+  uint dayOfEra = shifted - era * 146097;
+  uint yearOfEra = (dayOfEra - dayOfEra / 1460 + dayOfEra / 36524 - dayOfEra / 146096) / 365;
+  uint dayOfYear = dayOfEra - (365 * yearOfEra + yearOfEra / 4 - yearOfEra / 100);
+  uint shiftedMonth = (5 * dayOfYear + 2) / 153;
+  uint day = dayOfYear - (153 * shiftedMonth + 2) / 5 + 1;
+  uint month = shiftedMonth < 10 ? shiftedMonth + 3 : shiftedMonth - 9;
+  uint year = yearOfEra + era * 400 + (month <= 2);
+
+  out = kj::_::fill(out, kj::StringPtr(WEEKDAYS[weekday]), kj::StringPtr(", "));
+  out = formatTwoDigits(out, day);
+  out = kj::_::fill(out, kj::StringPtr(" "), kj::StringPtr(MONTHS[month - 1]),
+                    kj::StringPtr(" "));
+  out = formatTwoDigits(out, year / 100 % 100);
+  out = formatTwoDigits(out, year % 100);
+  *out++ = ' ';
+  out = formatTwoDigits(out, secondOfDay / 3600);
+  *out++ = ':';
+  out = formatTwoDigits(out, secondOfDay / 60 % 60);
+  *out++ = ':';
+  out = formatTwoDigits(out, secondOfDay % 60);
+  out = kj::_::fill(out, kj::StringPtr(" GMT"));
+  *out = '\0';
+}
+
+}  // namespace
+
+kj::Maybe<kj::StringPtr> HttpServer::getDate(const HttpHeaders& responseHeaders) {
+  if (!settings.sendDate || responseHeaders.get(HttpHeaderId::DATE) != nullptr) {
+    return nullptr;
+  }
+
+  auto& clock = settings.clock == nullptr ? kj::systemCoarseCalendarClock() : *settings.clock;
+  int64_t second = (clock.now() - kj::UNIX_EPOCH) / kj::SECONDS;
+  if (second != dateSecond) {
+    formatHttpDate(second, date);
+    dateSecond = second;
+  }
+  return kj::StringPtr(date, sizeof(date) - 1);
+}
+
 void HttpServer::taskFailed(kj::Exception&& exception) {
   KJ_LOG(ERROR, "unhandled exception in HTTP server", exception);
 }
 
+// =======================================================================================
+
+constexpr uint HttpServerHistogramObserver::Histogram::BUCKET_COUNT;
+
+void HttpServerHistogramObserver::Histogram::add(kj::Duration duration) {
+  uint64_t micros = kj::max(duration / kj::MICROSECONDS, 0);
+  uint bucket = 0;
+  while (micros > 0 && bucket < BUCKET_COUNT - 1) {
+    micros >>= 1;
+    ++bucket;
+  }
+  ++buckets[bucket];
+  ++count;
+  sum += duration;
+  max = kj::max(max, duration);
+}
+
+kj::Duration HttpServerHistogramObserver::Histogram::getBucketLimit(uint bucket) {
+  if (bucket >= BUCKET_COUNT - 1) {
+    return kj::maxValue;
+  } else {
+    return (int64_t(1) << bucket) * kj::MICROSECONDS;
+  }
+}
+
+kj::Duration HttpServerHistogramObserver::Histogram::getPercentile(double fraction) const {
+  if (count == 0) return 0 * kj::NANOSECONDS;
+
+  uint64_t rank = kj::max(uint64_t(fraction * count + 0.5), uint64_t(1));
+  uint64_t seen = 0;
+  for (uint i = 0; i < BUCKET_COUNT; i++) {
+    seen += buckets[i];
+    if (seen >= rank) {
+      return kj::min(getBucketLimit(i), max);
+    }
+  }
+  return max;
+}
+
+class HttpServerHistogramObserver::RequestTimer final: public HttpServerObserver::Request {
+public:
+  RequestTimer(HttpServerHistogramObserver& parent,
+               kj::TimePoint firstByteTime, kj::TimePoint headersTime)
+      : parent(parent), firstByteTime(firstByteTime), headersTime(headersTime) {}
+
+  void handlerStarted(kj::TimePoint time) override { handlerStartTime = time; }
+  void requestBodyRead(size_t bytes) override { parent.requestBodyBytes += bytes; }
+  void responseStarted(uint statusCode, kj::TimePoint time) override { responseTime = time; }
+
+  void responseBodyWritten(size_t bytes, kj::Duration blocked) override {
+    parent.responseBodyBytes += bytes;
+    writeBlocked += blocked;
+  }
+
+  void handlerReturned(kj::TimePoint time) override { handlerReturnTime = time; }
+
+  void responseCompleted(kj::TimePoint time) override {
+    parent.headerTimes.add(headersTime - firstByteTime);
+    KJ_IF_MAYBE(response, responseTime) {
+      parent.handlerTimes.add(*response - handlerStartTime.orDefault(headersTime));
+      KJ_IF_MAYBE(handlerReturn, handlerReturnTime) {
+        parent.bodyTimes.add(*handlerReturn - *response);
+      }
+    }
+    KJ_IF_MAYBE(handlerReturn, handlerReturnTime) {
+      parent.flushTimes.add(time - *handlerReturn);
+    }
+    parent.totalTimes.add(time - firstByteTime);
+    parent.writeBlockedTimes.add(writeBlocked);
+  }
+
+private:
+  HttpServerHistogramObserver& parent;
+  kj::TimePoint firstByteTime;
+  kj::TimePoint headersTime;
+  kj::Maybe<kj::TimePoint> handlerStartTime;
+  kj::Maybe<kj::TimePoint> responseTime;
+  kj::Maybe<kj::TimePoint> handlerReturnTime;
+  kj::Duration writeBlocked = 0 * kj::NANOSECONDS;
+};
+
+void HttpServerHistogramObserver::connectionAccepted(kj::TimePoint time) {
+  ++connectionCount;
+}
+
+kj::Own<HttpServerObserver::Request> HttpServerHistogramObserver::requestStarted(
+    HttpMethod method, kj::StringPtr url, const HttpHeaders& headers,
+    kj::TimePoint firstByteTime, kj::TimePoint headersTime) {
+  return kj::heap<RequestTimer>(*this, firstByteTime, headersTime);
+}
+
 } // namespace kj
@@ -39,6 +39,7 @@
 #include <kj/memory.h>
 #include <kj/one-of.h>
 #include <kj/async-io.h>
+#include "compression.h"
 
 namespace kj {
 
@@ -145,7 +146,10 @@ public:
   MACRO(HOST, "Host") \
   MACRO(DATE, "Date") \
   MACRO(LOCATION, "Location") \
-  MACRO(CONTENT_TYPE, "Content-Type")
+  MACRO(CONTENT_TYPE, "Content-Type") \
+  MACRO(ACCEPT_ENCODING, "Accept-Encoding") \
+  MACRO(CONTENT_ENCODING, "Content-Encoding") \
+  MACRO(VARY, "Vary")
   // For convenience, these headers are valid for all HttpHeaderTables. You can refer to them like:
   //
   //     HttpHeaderId::HOST
@@ -373,6 +377,40 @@ private:
   //   also add direct accessors for those headers.
 };
 
+class HttpPreparedHeaders {
+  // A response status line and header set serialized once, to be sent with many responses through
+  // HttpService::Response::sendPrepared(). Build one up front for each kind of response a handler
+  // gives repeatedly (e.g. `200 OK` with `Content-Type: application/json`). Each response then
+  // writes the prepared block and the few headers that vary per response -- Content-Length or
+  // Transfer-Encoding, and Date if enabled -- in a single gather write, rather than serializing
+  // every header again.
+
+public:
+  HttpPreparedHeaders(uint statusCode, kj::StringPtr statusText, const HttpHeaders& headers);
+  // Copies `statusText` and `headers`. Connection-level headers in `headers`, such as
+  // Content-Length and Transfer-Encoding, are ignored, as they are by send().
+
+  KJ_DISALLOW_COPY(HttpPreparedHeaders);
+
+  uint getStatusCode() const { return statusCode; }
+  kj::StringPtr getStatusText() const { return statusText; }
+  const HttpHeaders& getHeaders() const { return headers; }
+  // For implementations of sendPrepared() that can't use the serialized form.
+
+  kj::ArrayPtr<const char> getSerialized() const {
+    return serialized.slice(0, serialized.size() - 2);
+  }
+  // The status line and headers, each ending with "\r\n", but without the blank line that ends
+  // the header block.
+
+private:
+  uint statusCode;
+  kj::String statusText;
+  HttpHeaders headers;
+  kj::String serialized;
+  // The complete header block as serializeResponse() would write it, minus connection headers.
+};
+
 class EntropySource {
   // Interface for an object that generates entropy. Typically, cryptographically-random entropy
   // is expected.
@@ -422,6 +460,17 @@ public:
   // Read one message from the WebSocket and return it. Can only call once at a time. Do not call
   // again after Close is received.
 
+  typedef kj::OneOf<kj::ArrayPtr<char>, kj::ArrayPtr<byte>, Close> MessageView;
+
+  virtual kj::Promise<MessageView> receiveInto(kj::ArrayPtr<byte> buffer);
+  // Like receive(), but reassembles a text or binary message directly into `buffer` and returns
+  // the prefix of `buffer` holding it, so that no allocation is needed per message. Text is not
+  // NUL-terminated. A message larger than `buffer` is a protocol error: the promise is rejected
+  // and the WebSocket cannot be used further, so `buffer` effectively doubles as the maximum
+  // message size. `buffer` must remain valid until the promise resolves.
+  //
+  // The default implementation calls receive() and copies.
+
   kj::Promise<void> pumpTo(WebSocket& other);
   // Continuously receives messages from this WebSocket and send them to `other`.
   //
@@ -430,6 +479,12 @@ public:
   // On other read errors, calls other.close() with the error, then resolves.
   //
   // On write error, rejects with the error.
+
+  virtual kj::Maybe<kj::Promise<void>> tryPumpFrom(WebSocket& other);
+  // Implements pumpTo() from the target side, like AsyncOutputStream::tryPumpFrom(). Returns
+  // null if no optimized implementation applies, in which case pumpTo() falls back to receiving
+  // and re-sending whole messages. The WebSockets returned by this library forward frames between
+  // each other as they arrive, without reassembling fragmented messages.
 };
 
 class HttpClient {
@@ -520,6 +575,16 @@ public:
     // `statusText` and `headers` need only remain valid until send() returns (they can be
     // stack-allocated).
 
+    virtual kj::Own<kj::AsyncOutputStream> sendPrepared(
+        const HttpPreparedHeaders& prepared, kj::Maybe<uint64_t> expectedBodySize = nullptr);
+    // Like send(), but with the status and headers serialized ahead of time. Unlike send()'s
+    // arguments, `prepared` is not copied: it must remain valid until the response has been
+    // written, so in practice it should live as long as the service.
+    //
+    // The default implementation calls send() with prepared.getHeaders(), so Response wrappers
+    // that don't override it still work. HttpServer's HTTP/1.1 implementation writes the prepared
+    // block directly unless it needs to rewrite the headers to compress the response.
+
     virtual kj::Own<WebSocket> acceptWebSocket(const HttpHeaders& headers) = 0;
     // If headers.isWebSocket() is true then you can call acceptWebSocket() instead of send().
 
@@ -551,6 +616,95 @@ public:
   // UNIMPLEMENTED.
 };
 
+struct Http2Settings {
+  // Parameters for HTTP/2 connections, advertised to the peer in our SETTINGS frame (except where
+  // noted).
+
+  uint32_t maxConcurrentStreams = 100;
+  // Most streams the peer may have open at once. Further streams are refused with REFUSED_STREAM,
+  // which clients retry. Only meaningful for servers.
+
+  uint32_t initialWindowSize = 65535;
+  // Per-stream flow control window: how much of a request or response body the peer may send
+  // before we've consumed it. Larger values help throughput on high-latency links, at the cost of
+  // buffering up to this much per stream when the application reads slowly.
+
+  uint32_t connectionWindowSize = 1 << 20;
+  // Connection-wide flow control window, granted in a WINDOW_UPDATE right after SETTINGS. Bytes
+  // are credited back as they arrive, so this only bounds how far the peer can get ahead of our
+  // reads of the socket; per-stream windows provide the back-pressure.
+
+  uint32_t maxFrameSize = 16384;
+  // Largest frame payload the peer may send us, between 16384 and 16777215.
+
+  uint32_t headerTableSize = 4096;
+  // Size of the HPACK dynamic table, in both directions. (We only advertise it for the decoder;
+  // for the encoder it caps whatever the peer allows.)
+
+  uint32_t maxHeaderListSize = 65536;
+  // Largest decoded header block we accept, measured per RFC 7540 section 6.5.2.
+};
+
+struct WebSocketCompressionSettings {
+  // Configures the permessage-deflate WebSocket extension (RFC 7692), which compresses each text
+  // or binary message. Negotiated during the handshake by HttpClient::openWebSocket() and
+  // HttpService::Response::acceptWebSocket(); used only if both ends agree.
+
+  CompressionCodec* codec = nullptr;
+  // Null disables compression. Otherwise, must produce raw DEFLATE with a window of at most
+  // 2^`windowBits` bytes, and decompress anything within that window: normally a kj::DeflateCodec
+  // from kj/compat/gzip.h constructed with the same `windowBits`. Because that codec pools its
+  // contexts, connections and messages that don't need to keep compression state reuse zlib
+  // contexts rather than allocating new ones. The codec must outlive all WebSockets using it and
+  // is only used from its thread.
+
+  uint windowBits = 15;
+  // Base-two logarithm of the LZ77 window, 9 to 15, in both directions: the peer is asked not to
+  // compress with a larger window than ours, and a peer asking for a smaller one than ours is
+  // refused (by the server declining the extension, or by the client failing the handshake).
+  // Smaller windows save memory per connection at some cost in compression ratio.
+
+  bool contextTakeover = true;
+  // Whether our compressor keeps its history from one message to the next. Turning this off
+  // costs compression ratio, particularly for small, similar messages, but then a compressor is
+  // taken from the codec only for the duration of each send and connections hold none in between.
+
+  bool peerContextTakeover = true;
+  // Likewise for the peer's compressor: if false, the peer is asked not to keep history, and our
+  // decompressor is only held while receiving a message.
+
+  size_t maxInflatedMessageSize = 1u << 24;
+  // Largest message, after decompression, that receive() accepts. A few kilobytes of DEFLATE can
+  // expand to gigabytes, so this is enforced while inflating: a message that exceeds it is
+  // answered with close code 1009 (Message Too Big) and the receive fails. receiveInto() is
+  // bounded by its buffer instead.
+};
+
+struct HttpClientPoolStats {
+  // Counters describing a client's connection pool. See HttpClientSettings::poolStats.
+
+  uint activeConnections = 0;
+  // Connections currently carrying a request (or an upgraded WebSocket).
+
+  uint idleConnections = 0;
+  // Connections kept open for reuse.
+
+  uint queuedRequests = 0;
+  // Requests waiting for a connection to become available.
+
+  uint64_t connectionsOpened = 0;
+  uint64_t connectFailures = 0;
+  uint64_t requestsRejected = 0;
+  // Requests refused because the queue was full.
+
+  uint64_t pipelinedRequests = 0;
+
+  kj::Duration totalConnectTime = 0 * kj::SECONDS;
+  kj::Duration maxConnectTime = 0 * kj::SECONDS;
+  // Time spent establishing successful connections; divide the total by `connectionsOpened` for
+  // the mean.
+};
+
 struct HttpClientSettings {
   kj::Duration idleTimout = 5 * kj::SECONDS;
   // For clients which automatically create new connections, any connection idle for at least this
@@ -564,6 +718,41 @@ struct HttpClientSettings {
   // or vulnerable proxies between you and the server, you can provide a dummy entropy source that
   // doesn't generate real entropy (e.g. returning the same value every time). Otherwise, you must
   // provide a cryptographically-random entropy source.
+
+  kj::ArrayPtr<CompressionCodec* const> compressionCodecs = nullptr;
+  // Content codings to offer in Accept-Encoding, most preferred first. A response whose
+  // Content-Encoding matches one of these is decompressed transparently: the caller sees the
+  // decoded body, and Content-Encoding and Content-Length are removed from the response headers.
+  // If the request already carries an Accept-Encoding header, it is sent as-is, but matching
+  // responses are still decoded. The codecs must outlive the client and are only used from its
+  // thread.
+
+  Http2Settings http2;
+  // Used by newHttp2Client().
+
+  WebSocketCompressionSettings webSocketCompression;
+  // If `webSocketCompression.codec` is set, openWebSocket() offers permessage-deflate.
+
+  uint maxConnections = kj::maxValue;
+  // For clients which automatically create new connections, the maximum number of connections
+  // that may be open to any one host at once. When the limit is reached, further requests wait
+  // in a first-come, first-served queue until a connection is released.
+
+  uint maxPendingRequests = kj::maxValue;
+  // Maximum number of requests that may wait for a connection to one host. Beyond this, request()
+  // and openWebSocket() throw an OVERLOADED exception (which HttpServer reports as 503 if it
+  // propagates from a proxying service).
+
+  uint maxPipelineDepth = 1;
+  // When greater than 1 and every connection to a host is busy, GET and HEAD requests may be
+  // pipelined onto an existing connection that has fewer than this many responses outstanding,
+  // rather than waiting in the queue. Responses on a connection are delivered in order, so a
+  // slow response delays those behind it, and if the server closes the connection the pipelined
+  // requests fail and must be retried by the caller. Other methods are never pipelined.
+
+  kj::Maybe<HttpClientPoolStats&> poolStats = nullptr;
+  // If provided, updated as connections are opened, reused, and released. One stats object may
+  // be shared by several clients (or all hosts of one client) to aggregate them.
 };
 
 kj::Own<HttpClient> newHttpClient(kj::Timer& timer, HttpHeaderTable& responseHeaderTable,
@@ -588,7 +777,9 @@ kj::Own<HttpClient> newHttpClient(kj::Timer& timer, HttpHeaderTable& responseHea
 // Creates an HttpClient that always connects to the given address no matter what URL is requested.
 // The client will open and close connections as needed. It will attempt to reuse connections for
 // multiple requests but will not send a new request before the previous response on the same
-// connection has completed, as doing so can result in head-of-line blocking issues. The client may
+// connection has completed, as doing so can result in head-of-line blocking issues (unless
+// `settings.maxPipelineDepth` permits it). Connection count and queueing are bounded by
+// `settings.maxConnections` and `settings.maxPendingRequests`. The client may
 // be used as a proxy client or a host client depending on whether the peer is operating as
 // a proxy. (Hint: This is the best kind of client to use when routing traffic through an HTTP
 // proxy. `addr` should be the address of the proxy, and the proxy itself will resolve remote hosts
@@ -608,6 +799,21 @@ kj::Own<HttpClient> newHttpClient(HttpHeaderTable& responseHeaderTable, kj::Asyn
 // subsequent requests will fail. If a response takes a long time, it blocks subsequent responses.
 // If a WebSocket is opened successfully, all subsequent requests fail.
 
+kj::Own<HttpClient> newHttp2Client(HttpHeaderTable& responseHeaderTable, kj::AsyncIoStream& stream,
+                                   HttpClientSettings settings = HttpClientSettings());
+// Creates an HttpClient that speaks HTTP/2 over the given pre-established connection, which must
+// already be known to talk HTTP/2: either negotiated by ALPN (see `getTlsAlpnProtocol()` in
+// kj/compat/tls.h) or by prior knowledge (cleartext "h2c"). Unlike the HTTP/1.1 client, requests
+// are multiplexed: any number may be in flight at once without blocking each other, up to the
+// server's SETTINGS_MAX_CONCURRENT_STREAMS, past which further requests wait for a free stream.
+//
+// The request URL may be a path, in which case the `Host` header supplies `:authority` and the
+// scheme is taken to be "http", or an absolute URL. WebSockets and CONNECT are not supported, and
+// content codings (`compressionCodecs`) are not applied.
+//
+// If the server closes the connection or sends GOAWAY, requests it did not process fail with a
+// DISCONNECTED exception and are safe to retry on a new connection.
+
 kj::Own<HttpClient> newHttpClient(
     HttpHeaderTable& responseHeaderTable, kj::AsyncIoStream& stream,
     kj::Maybe<EntropySource&> entropySource) KJ_DEPRECATED("use HttpClientSettings");
@@ -632,6 +838,124 @@ kj::Own<WebSocket> newWebSocket(kj::Own<kj::AsyncIoStream> stream,
 // like HTTP requests" in a message as being actual HTTP requests, which could result in cache
 // poisoning. See RFC6455 section 10.3.
 
+class HttpServerObserver {
+  // Hooks for measuring an HttpServer, installed with HttpServerSettings::observer. Times are read
+  // from the server's kj::Timer. Only HTTP/1 connections are observed. When no observer is
+  // installed, the server does none of this work.
+
+public:
+  class Request {
+    // Events of one request, in the order they happen. The server drops this object when the next
+    // request on the connection arrives or the connection ends.
+
+  public:
+    virtual ~Request() noexcept(false);
+
+    virtual void handlerStarted(kj::TimePoint time) {}
+    // The HttpService's request() is about to be called.
+
+    virtual void requestBodyRead(size_t bytes) {}
+    // The service (or the server, draining an unread body) read this much of the request body.
+
+    virtual void responseStarted(uint statusCode, kj::TimePoint time) {}
+    // The response headers were queued, by the service or by the server reporting an error.
+
+    virtual void responseBodyWritten(size_t bytes, kj::Duration blocked) {}
+    // A write of the response body completed after waiting `blocked` for the connection.
+
+    virtual void handlerReturned(kj::TimePoint time) {}
+    // The promise returned by request() resolved. Not called if it threw.
+
+    virtual void responseCompleted(kj::TimePoint time) {}
+    // The response was completely written to the connection. Not called if writing it failed.
+  };
+
+  virtual void connectionAccepted(kj::TimePoint time) {}
+
+  virtual kj::Own<Request> requestStarted(
+      HttpMethod method, kj::StringPtr url, const HttpHeaders& headers,
+      kj::TimePoint firstByteTime, kj::TimePoint headersTime) = 0;
+  // Called when a request's headers have been parsed. `firstByteTime` is when the request's first
+  // byte arrived. Returns the object receiving the rest of the request's events, or null to not
+  // follow this request.
+};
+
+class HttpServerHistogramObserver final: public HttpServerObserver {
+  // An HttpServerObserver that aggregates request timings into histograms, e.g. to export them
+  // as metrics. A request is counted when its response completes. Like the server, it must only be
+  // used from one thread.
+
+public:
+  class Histogram {
+    // Counts durations in power-of-two buckets: bucket 0 counts durations under 1us, bucket i
+    // durations in [2^(i-1), 2^i) us, and the last bucket everything longer.
+
+  public:
+    static constexpr uint BUCKET_COUNT = 32;
+
+    void add(kj::Duration duration);
+
+    inline uint64_t getCount() const { return count; }
+    inline kj::Duration getSum() const { return sum; }
+    inline kj::Duration getMax() const { return max; }
+    inline kj::ArrayPtr<const uint64_t> getBuckets() const { return buckets; }
+
+    static kj::Duration getBucketLimit(uint bucket);
+    // Upper bound of the bucket (exclusive), or kj::maxValue for the last one.
+
+    kj::Duration getPercentile(double fraction) const;
+    // Upper bound of the bucket holding the given fraction (0 to 1) of samples, capped at the
+    // longest duration seen. Zero if there are no samples.
+
+  private:
+    uint64_t buckets[BUCKET_COUNT] = {};
+    uint64_t count = 0;
+    kj::Duration sum = 0 * kj::NANOSECONDS;
+    kj::Duration max = 0 * kj::NANOSECONDS;
+  };
+
+  const Histogram& getHeaderTimes() const { return headerTimes; }
+  // From a request's first byte to its headers being parsed.
+
+  const Histogram& getHandlerTimes() const { return handlerTimes; }
+  // From calling the service to it starting the response.
+
+  const Histogram& getBodyTimes() const { return bodyTimes; }
+  // From the response starting to the service's request() returning.
+
+  const Histogram& getFlushTimes() const { return flushTimes; }
+  // From request() returning to the response being completely written.
+
+  const Histogram& getTotalTimes() const { return totalTimes; }
+  // From a request's first byte to its response being completely written.
+
+  const Histogram& getWriteBlockedTimes() const { return writeBlockedTimes; }
+  // Per request, the total time response body writes waited for the connection.
+
+  uint64_t getConnectionCount() const { return connectionCount; }
+  uint64_t getRequestCount() const { return totalTimes.getCount(); }
+  uint64_t getRequestBodyBytes() const { return requestBodyBytes; }
+  uint64_t getResponseBodyBytes() const { return responseBodyBytes; }
+
+  void connectionAccepted(kj::TimePoint time) override;
+  kj::Own<Request> requestStarted(
+      HttpMethod method, kj::StringPtr url, const HttpHeaders& headers,
+      kj::TimePoint firstByteTime, kj::TimePoint headersTime) override;
+
+private:
+  class RequestTimer;
+
+  Histogram headerTimes;
+  Histogram handlerTimes;
+  Histogram bodyTimes;
+  Histogram flushTimes;
+  Histogram totalTimes;
+  Histogram writeBlockedTimes;
+  uint64_t connectionCount = 0;
+  uint64_t requestBodyBytes = 0;
+  uint64_t responseBodyBytes = 0;
+};
+
 struct HttpServerSettings {
   kj::Duration headerTimeout = 15 * kj::SECONDS;
   // After initial connection open, or after receiving the first byte of a pipelined request,
@@ -648,6 +972,69 @@ struct HttpServerSettings {
   // request so that it can pipeline the next one. We'll give them a grace period defined by the
   // above two values -- if they hit either one, we'll close the socket, but if the request
   // completes, we'll let the connection stay open to handle more requests.
+
+  kj::ArrayPtr<CompressionCodec* const> compressionCodecs = nullptr;
+  size_t compressionMinBytes = 1024;
+  // Content codings the server may apply to responses, most preferred first. A codec is chosen by
+  // the request's Accept-Encoding header (honoring q-values; ties go to the earlier codec here).
+  // Responses are left alone if they already have a Content-Encoding, have no body, are partial
+  // (206), have an already-compressed Content-Type (images, audio, video, archives, fonts), or
+  // declare an expected body size smaller than `compressionMinBytes`. Compressed responses always
+  // use chunked transfer encoding and get `Vary: Accept-Encoding`, and each write to the body is
+  // flushed through the compressor.
+  // The codecs must outlive the server and are only used from its thread. Only HTTP/1.1
+  // responses are compressed.
+
+  bool detectHttp2Preface = false;
+  // If true, listenHttp() peeks at each connection and serves it as HTTP/2 if it starts with the
+  // HTTP/2 connection preface (i.e. the client uses prior knowledge), otherwise as HTTP/1.1. Leave
+  // it false if HTTP/2 is negotiated by ALPN instead; in that case, call listenHttp2() directly.
+
+  Http2Settings http2;
+
+  WebSocketCompressionSettings webSocketCompression;
+  // If `webSocketCompression.codec` is set, acceptWebSocket() accepts a client's offer of
+  // permessage-deflate if its parameters are compatible.
+
+  bool sendDate = false;
+  // If true, each response other than a protocol upgrade gets a Date header (RFC 7231 section
+  // 7.1.1.2) unless the service set one itself. The value is formatted at most once per second
+  // and shared between responses.
+
+  const kj::Clock* clock = nullptr;
+  // Source of the current time for the Date header. Null means kj::systemCoarseCalendarClock().
+
+  bool releaseIdleBuffers = false;
+  // If true, an HTTP/1 connection waiting for its next request gives its header buffer (4 KiB or
+  // more) back to a pool shared by the server's connections, and takes one again when the request
+  // starts to arrive. This makes idle keep-alive connections cost almost no buffer memory, at the
+  // price of an extra one-byte read per request that doesn't arrive pipelined.
+
+  size_t bufferMemoryBudget = kj::maxValue;
+  // Upper bound on header buffer memory across all of the server's HTTP/1 connections, counting
+  // buffers kept in the pool. A request that arrives when no buffer fits in the budget is answered
+  // with 503 Service Unavailable and its connection closed; a request whose headers need the
+  // buffer to grow past the budget gets its connection closed.
+
+  HttpServerObserver* observer = nullptr;
+  // If set, receives timing events for each connection and request. Must outlive the server.
+};
+
+struct HttpServerBufferStats {
+  // See HttpServer::getBufferStats().
+
+  size_t bytesAllocated = 0;
+  // Header buffer memory currently allocated, whether in use or pooled.
+
+  size_t peakBytesAllocated = 0;
+  uint buffersInUse = 0;
+  uint buffersPooled = 0;
+
+  uint64_t idleReleases = 0;
+  // Times a connection gave its buffer back while waiting for a request.
+
+  uint64_t connectionsShed = 0;
+  // Connections turned away because of `HttpServerSettings::bufferMemoryBudget`.
 };
 
 class HttpServer: private kj::TaskSet::ErrorHandler {
@@ -669,6 +1056,8 @@ public:
   // connection, based on the connection object. This is particularly useful for capturing the
   // client's IP address and injecting it as a header.
 
+  ~HttpServer() noexcept(false);
+
   kj::Promise<void> drain();
   // Stop accepting new connections or new requests on existing connections. Finish any requests
   // that are already executing, then close the connections. Returns once no more requests are
@@ -688,6 +1077,12 @@ public:
   // The promise throws if an unparseable request is received or if some I/O error occurs. Dropping
   // the returned promise will cancel all I/O on the connection and cancel any in-flight requests.
 
+  kj::Promise<void> listenHttp2(kj::Own<kj::AsyncIoStream> connection);
+  // Like listenHttp(), but speaks HTTP/2, for connections where the client is known to. Requests
+  // are served concurrently, each on its own stream, so the service may see many in flight on
+  // one connection. drain() sends GOAWAY and lets in-flight requests finish. acceptWebSocket()
+  // and CONNECT are not supported over HTTP/2.
+
   kj::Promise<bool> listenHttpCleanDrain(kj::AsyncIoStream& connection);
   // Like listenHttp(), but allows you to potentially drain the server without closing connections.
   // The returned promise resolves to `true` if the connection has been left in a state where a
@@ -696,8 +1091,13 @@ public:
   // caller should close it without any further reads/writes. Note this only ever returns `true`
   // if you called `drain()` -- otherwise this server would keep handling the connection.
 
+  HttpServerBufferStats getBufferStats() const;
+  // Current header buffer memory use of the server's HTTP/1 connections.
+
 private:
+  class BufferPool;
   class Connection;
+  class Http2Connection;
 
   kj::Timer& timer;
   HttpHeaderTable& requestHeaderTable;
@@ -711,13 +1111,25 @@ private:
   uint connectionCount = 0;
   kj::Maybe<kj::Own<kj::PromiseFulfiller<void>>> zeroConnectionsFulfiller;
 
+  int64_t dateSecond = kj::minValue;
+  char date[30];
+  // The Date header value for the second `dateSecond` after the Unix epoch, NUL-terminated.
+
+  kj::Own<BufferPool> bufferPool;
+  // Must outlive the connections in `tasks`.
+
   kj::TaskSet tasks;
 
   HttpServer(kj::Timer& timer, HttpHeaderTable& requestHeaderTable,
              kj::OneOf<HttpService*, HttpServiceFactory> service,
              Settings settings, kj::PromiseFulfillerPair<void> paf);
 
+  kj::Maybe<kj::StringPtr> getDate(const HttpHeaders& responseHeaders);
+  // The Date header to add to a response with the given headers, or null if none should be added.
+
   kj::Promise<void> listenLoop(kj::ConnectionReceiver& port);
+  kj::Promise<void> listenHttpOrHttp2(kj::Own<kj::AsyncIoStream> connection);
+  kj::Promise<void> serveHttp2(kj::Own<kj::AsyncIoStream> connection, bool prefaceConsumed);
 
   void taskFailed(kj::Exception&& exception) override;
 };
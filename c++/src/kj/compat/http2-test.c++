@@ -0,0 +1,467 @@
+// Copyright (c) 2017 Cloudflare, Inc. and contributors
+// Licensed under the MIT License:
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+#include "http.h"
+#include <kj/debug.h>
+#include <kj/test.h>
+#include <string.h>
+
+namespace kj {
+namespace {
+
+bool contains(kj::StringPtr haystack, kj::StringPtr needle) {
+  return strstr(haystack.cStr(), needle.cStr()) != nullptr;
+}
+
+class Http2TestService final: public HttpService {
+public:
+  Http2TestService(HttpHeaderTable& table): table(table) {}
+
+  uint requestCount = 0;
+  uint inFlight = 0;
+  uint maxInFlight = 0;
+  kj::Vector<kj::Own<kj::PromiseFulfiller<void>>> held;
+  // Requests to "/hold" wait here until the test fulfills them.
+
+  kj::Promise<void> request(
+      HttpMethod method, kj::StringPtr url, const HttpHeaders& headers,
+      kj::AsyncInputStream& requestBody, Response& response) override {
+    ++requestCount;
+
+    if (url == "/hello") {
+      HttpHeaders responseHeaders(table);
+      responseHeaders.set(HttpHeaderId::CONTENT_TYPE, "text/plain");
+      responseHeaders.add("X-Host", headers.get(HttpHeaderId::HOST).orDefault("(none)"));
+      responseHeaders.add("X-Method", kj::str(method));
+      auto body = response.send(200, "OK", responseHeaders, 11);
+      auto promise = body->write("hello world", 11);
+      return promise.attach(kj::mv(body));
+    } else if (url == "/echo") {
+      return requestBody.readAllBytes().then([this,&response](kj::Array<byte> data) {
+        HttpHeaders responseHeaders(table);
+        auto body = response.send(200, "OK", responseHeaders, data.size());
+        auto promise = body->write(data.begin(), data.size());
+        return promise.attach(kj::mv(body), kj::mv(data));
+      });
+    } else if (url == "/chunked") {
+      HttpHeaders responseHeaders(table);
+      auto body = response.send(200, "OK", responseHeaders);
+      auto promise = body->write("foo", 3);
+      return promise.then([&body = *body]() {
+        return body.write("bar", 3);
+      }).attach(kj::mv(body));
+    } else if (url == "/hold") {
+      ++inFlight;
+      maxInFlight = kj::max(maxInFlight, inFlight);
+      auto paf = kj::newPromiseAndFulfiller<void>();
+      held.add(kj::mv(paf.fulfiller));
+      return paf.promise.then([this,&response]() {
+        --inFlight;
+        return response.sendError(200, "OK", table);
+      });
+    } else if (url == "/none") {
+      return kj::READY_NOW;
+    } else if (url == "/throw") {
+      KJ_FAIL_ASSERT("oops");
+    } else {
+      return response.sendError(404, "Not Found", table);
+    }
+  }
+
+  void release() {
+    auto all = kj::mv(held);
+    for (auto& fulfiller: all) {
+      fulfiller->fulfill();
+    }
+  }
+
+private:
+  HttpHeaderTable& table;
+};
+
+struct Http2TestSetup {
+  // A server and client talking HTTP/2 over an in-process pipe.
+
+  Http2TestSetup(HttpServerSettings serverSettings = HttpServerSettings(),
+                 HttpClientSettings clientSettings = HttpClientSettings())
+      : io(kj::setupAsyncIo()),
+        pipe(io.provider->newTwoWayPipe()),
+        service(table),
+        server(io.provider->getTimer(), table, service, serverSettings),
+        listenTask(server.listenHttp2(kj::mv(pipe.ends[0])).fork()),
+        client(newHttp2Client(table, *pipe.ends[1], clientSettings)) {}
+
+  kj::AsyncIoContext io;
+  kj::TwoWayPipe pipe;
+  HttpHeaderTable table;
+  Http2TestService service;
+  HttpServer server;
+  kj::ForkedPromise<void> listenTask;
+  kj::Own<HttpClient> client;
+
+  HttpClient::Response get(kj::StringPtr url) {
+    HttpHeaders headers(table);
+    headers.set(HttpHeaderId::HOST, "example.com");
+    auto request = client->request(HttpMethod::GET, url, headers);
+    return request.response.wait(io.waitScope);
+  }
+};
+
+KJ_TEST("HTTP/2 client <-> server") {
+  Http2TestSetup setup;
+  auto& waitScope = setup.io.waitScope;
+
+  {
+    auto response = setup.get("/hello");
+    KJ_EXPECT(response.statusCode == 200);
+    KJ_EXPECT(response.statusText == "OK");
+    KJ_EXPECT(response.headers->get(HttpHeaderId::CONTENT_TYPE).orDefault(nullptr) == "text/plain");
+    KJ_EXPECT(response.body->tryGetLength().orDefault(0) == 11);
+    KJ_EXPECT(response.body->readAllText().wait(waitScope) == "hello world");
+
+    auto headers = response.headers->toString();
+    KJ_EXPECT(contains(headers, "x-host: example.com"), headers);
+    KJ_EXPECT(contains(headers, "x-method: GET"), headers);
+  }
+
+  {
+    // HEAD gets the headers of a GET, but no body.
+    HttpHeaders headers(setup.table);
+    headers.set(HttpHeaderId::HOST, "example.com");
+    auto response = setup.client->request(HttpMethod::HEAD, "/hello", headers)
+        .response.wait(waitScope);
+    KJ_EXPECT(response.statusCode == 200);
+    KJ_EXPECT(response.headers->get(HttpHeaderId::CONTENT_LENGTH).orDefault(nullptr) == "11");
+    KJ_EXPECT(response.body->readAllText().wait(waitScope) == "");
+  }
+
+  {
+    // Absolute URLs supply :authority.
+    auto response = setup.client->request(HttpMethod::GET, "http://example.org/hello",
+                                          HttpHeaders(setup.table)).response.wait(waitScope);
+    response.body->readAllText().wait(waitScope);
+    KJ_EXPECT(contains(response.headers->toString(), "x-host: example.org"));
+  }
+
+  {
+    HttpHeaders headers(setup.table);
+    auto request = setup.client->request(HttpMethod::POST, "/echo", headers, 9);
+    request.body->write("foobarbaz", 9).wait(waitScope);
+    request.body = nullptr;
+    auto response = request.response.wait(waitScope);
+    KJ_EXPECT(response.statusCode == 200);
+    KJ_EXPECT(response.body->readAllText().wait(waitScope) == "foobarbaz");
+  }
+
+  {
+    // Unknown body size, in both directions.
+    HttpHeaders headers(setup.table);
+    auto request = setup.client->request(HttpMethod::POST, "/echo", headers);
+    request.body->write("abc", 3).wait(waitScope);
+    request.body->write("def", 3).wait(waitScope);
+    request.body = nullptr;
+    KJ_EXPECT(request.response.wait(waitScope).body->readAllText().wait(waitScope) == "abcdef");
+
+    auto response = setup.get("/chunked");
+    KJ_EXPECT(response.body->tryGetLength() == nullptr);
+    KJ_EXPECT(response.body->readAllText().wait(waitScope) == "foobar");
+  }
+
+  {
+    auto response = setup.get("/nonexistent");
+    KJ_EXPECT(response.statusCode == 404);
+    KJ_EXPECT(response.statusText == "Not Found");
+    KJ_EXPECT(response.body->readAllText().wait(waitScope) == "Not Found");
+  }
+
+  KJ_EXPECT(setup.service.requestCount == 7);
+}
+
+KJ_TEST("HTTP/2 server reports missing responses and exceptions") {
+  Http2TestSetup setup;
+  auto& waitScope = setup.io.waitScope;
+
+  {
+    auto response = setup.get("/none");
+    KJ_EXPECT(response.statusCode == 500);
+    KJ_EXPECT(response.body->readAllText().wait(waitScope) ==
+              "ERROR: The HttpService did not generate a response.");
+  }
+
+  {
+    auto response = setup.get("/throw");
+    KJ_EXPECT(response.statusCode == 500);
+    KJ_EXPECT(response.body->readAllText().wait(waitScope).startsWith(
+        "ERROR: The server threw an exception."));
+  }
+
+  // The connection survives both.
+  KJ_EXPECT(setup.get("/hello").body->readAllText().wait(waitScope) == "hello world");
+}
+
+KJ_TEST("HTTP/2 multiplexes large bodies under flow control") {
+  // Each body is several times the stream window, and together they exceed the connection
+  // window, so this only completes if WINDOW_UPDATEs flow as the bodies are consumed.
+  HttpClientSettings clientSettings;
+  clientSettings.http2.connectionWindowSize = 65535;
+  Http2TestSetup setup(HttpServerSettings(), clientSettings);
+  auto& waitScope = setup.io.waitScope;
+
+  constexpr size_t BODY_SIZE = 300000;
+  constexpr uint COUNT = 8;
+
+  kj::Vector<kj::Promise<void>> promises;
+  for (uint i = 0; i < COUNT; i++) {
+    auto data = kj::heapArray<byte>(BODY_SIZE);
+    for (size_t j = 0; j < data.size(); j++) {
+      data[j] = (i * 7 + j) % 251;
+    }
+
+    HttpHeaders headers(setup.table);
+    auto request = setup.client->request(HttpMethod::POST, "/echo", headers, BODY_SIZE);
+    auto write = request.body->write(data.begin(), data.size()).attach(kj::mv(request.body));
+    auto check = request.response.then([](HttpClient::Response&& response) {
+      KJ_EXPECT(response.statusCode == 200);
+      return response.body->readAllBytes().attach(kj::mv(response.body));
+    }).then([i,&data = *data.begin()](kj::Array<byte> received) {
+      KJ_ASSERT(received.size() == BODY_SIZE);
+      for (size_t j = 0; j < received.size(); j++) {
+        if (received[j] != (i * 7 + j) % 251) {
+          KJ_FAIL_EXPECT("body mismatch", i, j);
+          break;
+        }
+      }
+    });
+    promises.add(write.attach(kj::mv(data)));
+    promises.add(kj::mv(check));
+  }
+
+  kj::joinPromises(promises.releaseAsArray()).wait(waitScope);
+  KJ_EXPECT(setup.service.requestCount == COUNT);
+}
+
+KJ_TEST("HTTP/2 client respects the server's concurrent stream limit") {
+  HttpServerSettings serverSettings;
+  serverSettings.http2.maxConcurrentStreams = 2;
+  Http2TestSetup setup(serverSettings);
+  auto& waitScope = setup.io.waitScope;
+
+  // Complete one round trip first so that the client has seen the server's SETTINGS.
+  setup.get("/hello").body->readAllText().wait(waitScope);
+
+  kj::Vector<kj::Promise<HttpClient::Response>> responses;
+  for (uint i = 0; i < 5; i++) {
+    HttpHeaders headers(setup.table);
+    responses.add(setup.client->request(HttpMethod::GET, "/hold", headers).response);
+  }
+
+  uint completed = 0;
+  while (completed < 5) {
+    // Let everything that can reach the service do so.
+    while (setup.service.held.size() < kj::min(2u, 5 - completed)) {
+      waitScope.poll();
+    }
+    KJ_EXPECT(setup.service.inFlight <= 2);
+    completed += setup.service.held.size();
+    setup.service.release();
+  }
+
+  for (auto& response: responses) {
+    auto r = response.wait(waitScope);
+    KJ_EXPECT(r.statusCode == 200);
+    r.body->readAllText().wait(waitScope);
+  }
+  KJ_EXPECT(setup.service.maxInFlight == 2);
+}
+
+KJ_TEST("HTTP/2 client applies window changes to requests waiting for a stream") {
+  // A hand-rolled server limits the client to one stream, then shrinks the initial window while
+  // a second request is queued behind the first.
+  auto io = kj::setupAsyncIo();
+  auto pipe = io.provider->newTwoWayPipe();
+  auto& server = *pipe.ends[0];
+  HttpHeaderTable table;
+  auto client = newHttp2Client(table, *pipe.ends[1]);
+
+  auto sendFrame = [&](byte type, uint32_t streamId, kj::ArrayPtr<const byte> payload) {
+    kj::Vector<byte> frame;
+    frame.add(payload.size() >> 16);
+    frame.add(payload.size() >> 8);
+    frame.add(payload.size());
+    frame.add(type);
+    frame.add(0);
+    frame.add(streamId >> 24);
+    frame.add(streamId >> 16);
+    frame.add(streamId >> 8);
+    frame.add(streamId);
+    frame.addAll(payload);
+    server.write(frame.begin(), frame.size()).wait(io.waitScope);
+  };
+
+  kj::Vector<byte> received;
+  auto readAvailable = [&]() {
+    byte buffer[4096];
+    for (;;) {
+      auto promise = server.tryRead(buffer, 1, sizeof(buffer));
+      if (!promise.poll(io.waitScope)) break;
+      size_t n = promise.wait(io.waitScope);
+      if (n == 0) break;
+      received.addAll(buffer, buffer + n);
+    }
+  };
+
+  const byte oneStream[] = { 0, 3, 0, 0, 0, 1 };  // SETTINGS_MAX_CONCURRENT_STREAMS = 1
+  sendFrame(4, 0, oneStream);
+  io.waitScope.poll();
+
+  auto response1 = client->request(HttpMethod::GET, "/1", HttpHeaders(table)).response;
+  auto request2 = client->request(HttpMethod::POST, "/2", HttpHeaders(table), size_t(1000));
+  auto body = kj::heapArray<byte>(1000);
+  memset(body.begin(), 'x', body.size());
+  auto write = request2.body->write(body.begin(), body.size());
+  io.waitScope.poll();
+
+  const byte smallWindow[] = { 0, 4, 0, 0, 0, 100 };  // SETTINGS_INITIAL_WINDOW_SIZE = 100
+  sendFrame(4, 0, smallWindow);
+  const byte cancel[] = { 0, 0, 0, 8 };
+  sendFrame(3, 1, cancel);  // RST_STREAM, freeing the slot for the queued request
+  io.waitScope.poll();
+  readAvailable();
+
+  // Skip the client preface, then total up the DATA sent on the second stream.
+  KJ_ASSERT(received.size() >= 24);
+  size_t dataSent = 0;
+  for (size_t offset = 24; offset + 9 <= received.size();) {
+    size_t length = (received[offset] << 16) | (received[offset + 1] << 8) | received[offset + 2];
+    uint32_t streamId = (uint32_t(received[offset + 5] & 0x7f) << 24) |
+        (received[offset + 6] << 16) | (received[offset + 7] << 8) | received[offset + 8];
+    if (received[offset + 3] == 0 && streamId == 3) {
+      dataSent += length;
+    }
+    offset += 9 + length;
+  }
+  KJ_EXPECT(dataSent == 100, dataSent);
+  KJ_EXPECT(!write.poll(io.waitScope));
+  KJ_EXPECT_THROW(DISCONNECTED, response1.wait(io.waitScope));
+}
+
+KJ_TEST("HTTP/2 drain sends GOAWAY and finishes in-flight requests") {
+  Http2TestSetup setup;
+  auto& waitScope = setup.io.waitScope;
+
+  HttpHeaders headers(setup.table);
+  auto held = setup.client->request(HttpMethod::GET, "/hold", headers).response;
+  while (setup.service.held.size() == 0) {
+    waitScope.poll();
+  }
+
+  auto drained = setup.server.drain();
+  waitScope.poll();
+  KJ_EXPECT(!drained.poll(waitScope));
+
+  setup.service.release();
+  auto response = held.wait(waitScope);
+  KJ_EXPECT(response.statusCode == 200);
+  KJ_EXPECT(response.body->readAllText().wait(waitScope) == "OK");
+
+  drained.wait(waitScope);
+  setup.listenTask.addBranch().wait(waitScope);
+
+  // Once the connection is gone, new requests fail with DISCONNECTED, i.e. they can be retried.
+  HttpHeaders headers2(setup.table);
+  KJ_EXPECT_THROW(DISCONNECTED,
+      setup.client->request(HttpMethod::GET, "/hello", headers2).response.wait(waitScope));
+}
+
+KJ_TEST("HTTP/2 server closes the connection on protocol errors") {
+  auto io = kj::setupAsyncIo();
+  auto pipe = io.provider->newTwoWayPipe();
+
+  HttpHeaderTable table;
+  Http2TestService service(table);
+  HttpServer server(io.provider->getTimer(), table, service);
+  auto listenTask = server.listenHttp2(kj::mv(pipe.ends[0]));
+
+  kj::StringPtr garbage = "GET / HTTP/1.1\r\nHost: example.com\r\n\r\n";
+  pipe.ends[1]->write(garbage.begin(), garbage.size()).wait(io.waitScope);
+
+  // The server replies with its SETTINGS and a GOAWAY (PROTOCOL_ERROR), then hangs up.
+  listenTask.wait(io.waitScope);
+  auto reply = pipe.ends[1]->readAllBytes().wait(io.waitScope);
+
+  kj::Vector<byte> types;
+  kj::Maybe<uint32_t> goAwayCode;
+  for (size_t offset = 0; offset + 9 <= reply.size();) {
+    size_t length = (reply[offset] << 16) | (reply[offset + 1] << 8) | reply[offset + 2];
+    types.add(reply[offset + 3]);
+    if (reply[offset + 3] == 7) {
+      goAwayCode = reply[offset + 16];
+    }
+    offset += 9 + length;
+  }
+  KJ_ASSERT(types.size() > 0);
+  KJ_EXPECT(types[0] == 4);  // SETTINGS
+  KJ_EXPECT(types.back() == 7);  // GOAWAY
+  KJ_EXPECT(goAwayCode.orDefault(0) == 1);  // PROTOCOL_ERROR
+  KJ_EXPECT(service.requestCount == 0);
+}
+
+KJ_TEST("HttpServer detects the HTTP/2 preface") {
+  auto io = kj::setupAsyncIo();
+
+  HttpHeaderTable table;
+  Http2TestService service(table);
+  HttpServerSettings settings;
+  settings.detectHttp2Preface = true;
+  HttpServer server(io.provider->getTimer(), table, service, settings);
+
+  {
+    auto pipe = io.provider->newTwoWayPipe();
+    auto listenTask = server.listenHttp(kj::mv(pipe.ends[0]));
+    auto client = newHttp2Client(table, *pipe.ends[1]);
+
+    HttpHeaders headers(table);
+    headers.set(HttpHeaderId::HOST, "example.com");
+    auto response = client->request(HttpMethod::GET, "/hello", headers).response
+        .wait(io.waitScope);
+    KJ_EXPECT(response.body->readAllText().wait(io.waitScope) == "hello world");
+  }
+
+  {
+    auto pipe = io.provider->newTwoWayPipe();
+    auto listenTask = server.listenHttp(kj::mv(pipe.ends[0]));
+
+    // Shares its first byte with the preface, so it takes the sniffer two reads to rule it out.
+    kj::StringPtr request = "PUT /hello HTTP/1.1\r\nHost: example.com\r\nContent-Length: 0\r\n\r\n";
+    pipe.ends[1]->write(request.begin(), request.size()).wait(io.waitScope);
+    pipe.ends[1]->shutdownWrite();
+
+    auto response = pipe.ends[1]->readAllText().wait(io.waitScope);
+    KJ_EXPECT(response.startsWith("HTTP/1.1 200 OK\r\n"), response);
+    KJ_EXPECT(response.endsWith("hello world"), response);
+    listenTask.wait(io.waitScope);
+  }
+
+  KJ_EXPECT(service.requestCount == 2);
+}
+
+}  // namespace
+}  // namespace kj
@@ -0,0 +1,1964 @@
+// Copyright (c) 2017 Sandstorm Development Group, Inc. and contributors
+// Licensed under the MIT License:
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+// HTTP/2 (RFC 7540) behind the same HttpService / HttpClient interfaces as HTTP/1.1 in http.c++.
+// Each connection is an Http2Session which owns the framing, HPACK state, and flow control, and
+// multiplexes any number of Http2Streams; the server and client subclasses only differ in what
+// they do with header blocks.
+
+#include "http.h"
+#include "hpack.h"
+#include "url.h"
+#include <kj/debug.h>
+#include <kj/map.h>
+#include <string.h>
+
+namespace kj {
+
+namespace {
+
+static constexpr byte CONNECTION_PREFACE[] = {
+  'P', 'R', 'I', ' ', '*', ' ', 'H', 'T', 'T', 'P', '/', '2', '.', '0', '\r', '\n',
+  '\r', '\n', 'S', 'M', '\r', '\n', '\r', '\n'
+};
+
+static constexpr size_t FRAME_HEADER_SIZE = 9;
+static constexpr uint32_t DEFAULT_WINDOW_SIZE = 65535;
+static constexpr uint32_t DEFAULT_MAX_FRAME_SIZE = 16384;
+static constexpr int64_t MAX_WINDOW_SIZE = 0x7fffffff;
+static constexpr size_t MAX_BUFFERED_WRITE = 65536;
+// Once this much output is queued, writers wait for it to reach the socket.
+
+enum class FrameType: byte {
+  DATA = 0,
+  HEADERS = 1,
+  PRIORITY = 2,
+  RST_STREAM = 3,
+  SETTINGS = 4,
+  PUSH_PROMISE = 5,
+  PING = 6,
+  GOAWAY = 7,
+  WINDOW_UPDATE = 8,
+  CONTINUATION = 9,
+};
+
+namespace FrameFlags {
+  static constexpr byte END_STREAM = 0x01;
+  static constexpr byte ACK = 0x01;
+  static constexpr byte END_HEADERS = 0x04;
+  static constexpr byte PADDED = 0x08;
+  static constexpr byte PRIORITY = 0x20;
+}
+
+enum class Http2Error: uint32_t {
+  NO_ERROR = 0,
+  PROTOCOL_ERROR = 1,
+  INTERNAL_ERROR = 2,
+  FLOW_CONTROL_ERROR = 3,
+  SETTINGS_TIMEOUT = 4,
+  STREAM_CLOSED = 5,
+  FRAME_SIZE_ERROR = 6,
+  REFUSED_STREAM = 7,
+  CANCEL = 8,
+  COMPRESSION_ERROR = 9,
+  CONNECT_ERROR = 10,
+  ENHANCE_YOUR_CALM = 11,
+  INADEQUATE_SECURITY = 12,
+  HTTP_1_1_REQUIRED = 13,
+};
+
+enum class SettingId: uint16_t {
+  HEADER_TABLE_SIZE = 1,
+  ENABLE_PUSH = 2,
+  MAX_CONCURRENT_STREAMS = 3,
+  INITIAL_WINDOW_SIZE = 4,
+  MAX_FRAME_SIZE = 5,
+  MAX_HEADER_LIST_SIZE = 6,
+};
+
+inline uint32_t readUint32(const byte* ptr) {
+  return (uint32_t(ptr[0]) << 24) | (uint32_t(ptr[1]) << 16) | (uint32_t(ptr[2]) << 8) | ptr[3];
+}
+
+inline void addUint16(kj::Vector<byte>& out, uint16_t value) {
+  out.add(value >> 8);
+  out.add(value);
+}
+
+inline void addUint32(kj::Vector<byte>& out, uint32_t value) {
+  out.add(value >> 24);
+  out.add(value >> 16);
+  out.add(value >> 8);
+  out.add(value);
+}
+
+bool isConnectionSpecificHeader(kj::StringPtr lowercaseName) {
+  // HTTP/2 forbids the hop-by-hop headers of HTTP/1.1 (RFC 7540 section 8.1.2.2).
+  return lowercaseName == "connection" ||
+         lowercaseName == "keep-alive" ||
+         lowercaseName == "proxy-connection" ||
+         lowercaseName == "transfer-encoding" ||
+         lowercaseName == "upgrade";
+}
+
+kj::StringPtr defaultStatusText(uint statusCode) {
+  // HTTP/2 has no reason phrase, but HttpClient::Response has a place for one.
+  switch (statusCode) {
+    case 200: return "OK";
+    case 201: return "Created";
+    case 202: return "Accepted";
+    case 204: return "No Content";
+    case 206: return "Partial Content";
+    case 301: return "Moved Permanently";
+    case 302: return "Found";
+    case 303: return "See Other";
+    case 304: return "Not Modified";
+    case 307: return "Temporary Redirect";
+    case 308: return "Permanent Redirect";
+    case 400: return "Bad Request";
+    case 401: return "Unauthorized";
+    case 403: return "Forbidden";
+    case 404: return "Not Found";
+    case 405: return "Method Not Allowed";
+    case 409: return "Conflict";
+    case 410: return "Gone";
+    case 413: return "Payload Too Large";
+    case 429: return "Too Many Requests";
+    case 500: return "Internal Server Error";
+    case 501: return "Not Implemented";
+    case 502: return "Bad Gateway";
+    case 503: return "Service Unavailable";
+    case 504: return "Gateway Timeout";
+    default: return "";
+  }
+}
+
+kj::Maybe<uint64_t> parseContentLength(kj::StringPtr text) {
+  if (text.size() == 0) return nullptr;
+  uint64_t result = 0;
+  for (char c: text) {
+    if (c < '0' || c > '9' || result > (uint64_t(kj::maxValue) - 9) / 10) return nullptr;
+    result = result * 10 + (c - '0');
+  }
+  return result;
+}
+
+kj::Exception streamResetException(Http2Error code) {
+  if (code == Http2Error::REFUSED_STREAM) {
+    // The request was not processed at all, so it's safe to retry.
+    return KJ_EXCEPTION(DISCONNECTED, "HTTP/2 stream refused by peer");
+  } else {
+    return KJ_EXCEPTION(DISCONNECTED, "HTTP/2 stream reset by peer", static_cast<uint32_t>(code));
+  }
+}
+
+// =======================================================================================
+// Sessions and streams
+
+class Http2Session;
+
+class Http2Stream: public kj::Refcounted {
+  // State of one stream. The session keeps a reference while the stream is open; the body streams
+  // handed to the application keep their own, so a stream can outlive its session (after which
+  // `session` is null and `error` says why).
+
+public:
+  Http2Stream(Http2Session& session, int64_t sendWindow, int64_t recvWindow)
+      : session(session), sendWindow(sendWindow), recvWindow(recvWindow) {}
+  virtual ~Http2Stream() noexcept(false) {}
+
+  kj::Maybe<Http2Session&> session;
+  uint32_t id = 0;
+  // Zero until the stream is opened (client streams may have to wait for a free slot).
+
+  int64_t sendWindow;
+  // May go negative if the peer shrinks SETTINGS_INITIAL_WINDOW_SIZE.
+
+  int64_t recvWindow;
+  uint32_t unackedConsumed = 0;
+  // Bytes the application has read but which we haven't yet credited back with WINDOW_UPDATE.
+
+  bool localClosed = false;
+  bool remoteClosed = false;
+  kj::Maybe<kj::Exception> error;
+
+  _::RingBuffer<kj::Array<byte>> inbound;
+  size_t inboundOffset = 0;
+  uint64_t receivedBytes = 0;
+  kj::Maybe<uint64_t> expectedLength;
+  // From content-length; a mismatch makes the stream malformed.
+
+  kj::Maybe<kj::Own<kj::PromiseFulfiller<void>>> readWaiter;
+  kj::Maybe<kj::Own<kj::PromiseFulfiller<void>>> openWaiter;
+
+  kj::Promise<void> whenReadable() {
+    auto paf = kj::newPromiseAndFulfiller<void>();
+    readWaiter = kj::mv(paf.fulfiller);
+    return kj::mv(paf.promise);
+  }
+
+  kj::Promise<void> whenOpened() {
+    if (id != 0) return kj::READY_NOW;
+    auto paf = kj::newPromiseAndFulfiller<void>();
+    openWaiter = kj::mv(paf.fulfiller);
+    return kj::mv(paf.promise);
+  }
+
+  void wakeReader() {
+    KJ_IF_MAYBE(waiter, readWaiter) {
+      waiter->get()->fulfill();
+      readWaiter = nullptr;
+    }
+  }
+
+  void fail(kj::Exception&& exception) {
+    // Records the error and wakes everything waiting on this stream so that it can see it.
+    KJ_IF_MAYBE(waiter, readWaiter) {
+      waiter->get()->reject(kj::cp(exception));
+      readWaiter = nullptr;
+    }
+    KJ_IF_MAYBE(waiter, openWaiter) {
+      waiter->get()->reject(kj::cp(exception));
+      openWaiter = nullptr;
+    }
+    if (error == nullptr) error = kj::mv(exception);
+  }
+};
+
+class Http2Session: private kj::TaskSet::ErrorHandler {
+  // Framing, HPACK, flow control, and stream bookkeeping shared by the server and client.
+
+public:
+  Http2Session(kj::AsyncIoStream& stream, const Http2Settings& settings, bool isServer)
+      : stream(stream),
+        settings(settings),
+        isServer(isServer),
+        nextStreamId(isServer ? 2 : 1),
+        decoder(kj::max(settings.headerTableSize, uint32_t(4096))),
+        encoder(settings.headerTableSize),
+        readBuffer(kj::heapArray<byte>(FRAME_HEADER_SIZE + settings.maxFrameSize)),
+        connectionRecvWindow(settings.connectionWindowSize),
+        tasks(*this) {
+    KJ_REQUIRE(settings.maxFrameSize >= DEFAULT_MAX_FRAME_SIZE &&
+               settings.maxFrameSize < (1u << 24), "invalid HTTP/2 maxFrameSize");
+    KJ_REQUIRE(settings.initialWindowSize <= MAX_WINDOW_SIZE &&
+               settings.connectionWindowSize <= MAX_WINDOW_SIZE &&
+               settings.connectionWindowSize >= DEFAULT_WINDOW_SIZE,
+               "invalid HTTP/2 window size");
+  }
+
+  virtual ~Http2Session() noexcept(false) {
+    // Any streams still referenced by the application must not point back at us.
+    detachAll(KJ_EXCEPTION(DISCONNECTED, "HTTP/2 connection was destroyed"));
+  }
+
+  kj::Promise<void> run(bool prefaceConsumed) {
+    // Starts the connection and returns a promise which resolves once it has shut down cleanly,
+    // or rejects on I/O errors. Protocol errors by the peer end the connection with GOAWAY but
+    // are not reported as failures.
+
+    if (!isServer) {
+      pending.addAll(kj::ArrayPtr<const byte>(CONNECTION_PREFACE));
+    }
+    sendSettings();
+    if (settings.connectionWindowSize > DEFAULT_WINDOW_SIZE) {
+      sendWindowUpdate(0, settings.connectionWindowSize - DEFAULT_WINDOW_SIZE);
+    }
+
+    kj::Promise<void> preface = nullptr;
+    if (isServer && !prefaceConsumed) {
+      preface = readPreface();
+    } else {
+      preface = kj::READY_NOW;
+    }
+    tasks.add(preface.then([this]() { return readLoop(); }));
+
+    auto paf = kj::newPromiseAndFulfiller<void>();
+    doneFulfiller = kj::mv(paf.fulfiller);
+    return kj::mv(paf.promise);
+  }
+
+  // ---------------------------------------------------------------------------
+  // Called by body streams.
+
+  void consumed(Http2Stream& s, size_t amount) {
+    // The application read `amount` bytes of `s`'s body; let the peer send more.
+    if (s.remoteClosed || s.error != nullptr) return;
+    s.unackedConsumed += amount;
+    if (s.unackedConsumed >= settings.initialWindowSize / 2) {
+      sendWindowUpdate(s.id, s.unackedConsumed);
+      s.recvWindow += s.unackedConsumed;
+      s.unackedConsumed = 0;
+    }
+  }
+
+  kj::Promise<void> sendData(Http2Stream& s, kj::ArrayPtr<const byte> data, bool end = false) {
+    // Sends `data` on `s` as DATA frames, as the flow control windows allow, setting END_STREAM
+    // on the last one if `end` is true. `data` must remain valid until the promise resolves.
+    //
+    // Ending the stream here, rather than in a continuation of the returned promise, matters:
+    // the caller may be part of a joinPromises() whose continuations don't run until every
+    // branch is ready, and the peer may not respond until it sees END_STREAM.
+
+    for (;;) {
+      throwIfUnusable(s);
+      if (s.id == 0) {
+        return s.whenOpened().then([this,&s,data,end]() { return sendData(s, data, end); });
+      }
+
+      int64_t window = kj::min(s.sendWindow, connectionSendWindow);
+      if (window <= 0 && data.size() > 0) {
+        return whenWindowAvailable().then([this,&s,data,end]() { return sendData(s, data, end); });
+      }
+
+      size_t n = kj::min(data.size(), kj::min(size_t(kj::max(window, int64_t(0))),
+                                              size_t(peerMaxFrameSize)));
+      if (n == data.size()) {
+        if (end) {
+          queueFrame(FrameType::DATA, FrameFlags::END_STREAM, s.id, data);
+          s.localClosed = true;
+        } else if (n > 0) {
+          queueFrame(FrameType::DATA, 0, s.id, data);
+        }
+        s.sendWindow -= n;
+        connectionSendWindow -= n;
+        if (s.localClosed && s.remoteClosed) retire(s);
+        break;
+      }
+
+      queueFrame(FrameType::DATA, 0, s.id, data.slice(0, n));
+      s.sendWindow -= n;
+      connectionSendWindow -= n;
+      data = data.slice(n, data.size());
+    }
+
+    if (pending.size() >= MAX_BUFFERED_WRITE) {
+      return whenFlushed();
+    }
+    return kj::READY_NOW;
+  }
+
+  void endStream(Http2Stream& s) {
+    // Ends our side of `s`. A client stream that hasn't been opened yet gets END_STREAM on its
+    // HEADERS frame instead.
+    if (s.localClosed || s.error != nullptr) return;
+    s.localClosed = true;
+    if (s.id == 0) return;
+
+    queueFrame(FrameType::DATA, FrameFlags::END_STREAM, s.id, nullptr);
+    if (s.remoteClosed) retire(s);
+  }
+
+  void resetStream(Http2Stream& s, Http2Error code) {
+    if (s.error != nullptr) return;
+    if (s.id != 0) {
+      sendRstStream(s.id, code);
+    }
+    s.localClosed = true;
+    failStream(s, KJ_EXCEPTION(DISCONNECTED, "HTTP/2 stream was canceled"));
+  }
+
+  void throwIfUnusable(Http2Stream& s) {
+    KJ_IF_MAYBE(e, s.error) {
+      kj::throwFatalException(kj::cp(*e));
+    }
+    KJ_REQUIRE(!s.localClosed, "HTTP/2 stream already ended");
+  }
+
+protected:
+  kj::AsyncIoStream& stream;
+  Http2Settings settings;
+  bool isServer;
+
+  kj::HashMap<uint32_t, kj::Own<Http2Stream>> streams;
+  // Open streams.
+
+  uint32_t lastPeerStreamId = 0;
+  uint32_t nextStreamId;
+  uint32_t peerMaxConcurrentStreams = kj::maxValue;
+  int64_t peerInitialWindowSize = DEFAULT_WINDOW_SIZE;
+
+  bool goingAway = false;
+  // We sent GOAWAY.
+  bool peerGoingAway = false;
+  // We received GOAWAY.
+  bool finished = false;
+
+  virtual void onHeaders(uint32_t streamId, kj::Array<HpackDecoder::Header> fields,
+                         bool endStream) = 0;
+  // A complete header block arrived. HPACK state has already been updated.
+
+  virtual void onStreamFailed(Http2Stream& s, const kj::Exception& exception) {}
+  // `s` was reset or the connection failed; `s.error` has been set.
+
+  virtual void onStreamRetired() {}
+  // A stream was removed from `streams`.
+
+  virtual void onPeerSettings() {}
+  // The peer's settings changed, possibly allowing more concurrent streams.
+
+  virtual void onPeerGoAway(uint32_t lastStreamId) {}
+
+  template <typename Func>
+  void sendHeaders(uint32_t streamId, bool endStream, Func&& fill) {
+    // Encodes a header block with `fill(encoder, block)` and queues it as HEADERS plus as many
+    // CONTINUATION frames as it takes. The frames are queued contiguously, as required.
+
+    headerBlock.clear();
+    encoder.beginBlock(headerBlock);
+    fill(encoder, headerBlock);
+
+    auto block = headerBlock.asPtr();
+    auto fragment = block.slice(0, kj::min(block.size(), size_t(peerMaxFrameSize)));
+    block = block.slice(fragment.size(), block.size());
+    byte flags = block.size() == 0 ? FrameFlags::END_HEADERS : 0;
+    if (endStream) flags |= FrameFlags::END_STREAM;
+    queueFrame(FrameType::HEADERS, flags, streamId, fragment);
+    while (block.size() > 0) {
+      fragment = block.slice(0, kj::min(block.size(), size_t(peerMaxFrameSize)));
+      block = block.slice(fragment.size(), block.size());
+      queueFrame(FrameType::CONTINUATION, block.size() == 0 ? FrameFlags::END_HEADERS : 0,
+                 streamId, fragment);
+    }
+  }
+
+  void addHeaders(HpackEncoder& encoder, kj::Vector<byte>& block, const HttpHeaders& headers,
+                  bool forRequest) {
+    // Adds application headers to a block, lowercasing names and dropping the ones HTTP/2 doesn't
+    // allow or that are sent as pseudo-headers (Host) or computed by us (Content-Length).
+
+    headers.forEach([&](kj::StringPtr name, kj::StringPtr value) {
+      lowercaseScratch.clear();
+      for (char c: name) {
+        lowercaseScratch.add('A' <= c && c <= 'Z' ? c + ('a' - 'A') : c);
+      }
+      lowercaseScratch.add('\0');
+      kj::StringPtr lower(lowercaseScratch.begin(), lowercaseScratch.size() - 1);
+
+      if (isConnectionSpecificHeader(lower) || lower == "content-length") return;
+      if (forRequest) {
+        if (lower == "host") return;
+        if (lower == "te" && value != "trailers") return;
+      }
+      encoder.add(block, lower, value);
+    });
+  }
+
+  kj::Maybe<Http2Stream&> findStream(uint32_t id) {
+    KJ_IF_MAYBE(s, streams.find(id)) {
+      return **s;
+    }
+    return nullptr;
+  }
+
+  void openStream(Http2Stream& s) {
+    s.id = nextStreamId;
+    nextStreamId += 2;
+    streams.insert(s.id, kj::addRef(s));
+  }
+
+  void remoteEnd(Http2Stream& s) {
+    // The peer ended its side of `s`.
+    s.remoteClosed = true;
+    KJ_IF_MAYBE(expected, s.expectedLength) {
+      if (*expected != s.receivedBytes) {
+        resetStream(s, Http2Error::PROTOCOL_ERROR);
+        return;
+      }
+    }
+    s.wakeReader();
+    if (s.localClosed) retire(s);
+  }
+
+  void retire(Http2Stream& s) {
+    // Removes a fully-closed (or reset) stream. `s` may be destroyed as a result.
+    s.session = nullptr;
+    if (s.id != 0) {
+      auto id = s.id;
+      KJ_IF_MAYBE(own, streams.find(id)) {
+        auto ownStream = kj::mv(*own);
+        streams.erase(id);
+        onStreamRetired();
+      }
+    }
+    maybeFinish();
+  }
+
+  void failStream(Http2Stream& s, kj::Exception&& exception) {
+    auto ownStream = kj::addRef(s);
+    onStreamFailed(s, exception);
+    s.fail(kj::mv(exception));
+    retire(s);
+  }
+
+  void sendRstStream(uint32_t id, Http2Error code) {
+    kj::Vector<byte> payload(4);
+    addUint32(payload, static_cast<uint32_t>(code));
+    queueFrame(FrameType::RST_STREAM, 0, id, payload);
+  }
+
+  void goAway(Http2Error code, kj::StringPtr debugData = nullptr) {
+    // Tells the peer we won't accept new streams. Streams already open continue.
+    if (goingAway) return;
+    goingAway = true;
+    kj::Vector<byte> payload(8 + debugData.size());
+    addUint32(payload, lastPeerStreamId);
+    addUint32(payload, static_cast<uint32_t>(code));
+    payload.addAll(debugData.asBytes());
+    queueFrame(FrameType::GOAWAY, 0, 0, payload);
+    maybeFinish();
+  }
+
+  void maybeFinish() {
+    // The connection is done once nothing more will happen on it: either side has said goodbye,
+    // no streams remain, and our output has been written.
+    if (finished || streams.size() > 0) return;
+    if (!(goingAway || peerGoingAway || readDone)) return;
+    if (writing || pending.size() > 0) return;
+
+    finished = true;
+    KJ_IF_MAYBE(f, doneFulfiller) {
+      f->get()->fulfill();
+    }
+  }
+
+  void fail(kj::Exception&& exception, kj::Maybe<Http2Error> code) {
+    // Ends the connection abruptly, failing all streams. If `code` is given, GOAWAY is sent first
+    // (best-effort).
+
+    if (finished) return;
+    if (exception.getType() != kj::Exception::Type::DISCONNECTED) {
+      // Streams see a retriable error regardless of what went wrong with the connection.
+      detachAll(KJ_EXCEPTION(DISCONNECTED, "HTTP/2 connection failed", exception.getDescription()));
+    } else {
+      detachAll(kj::cp(exception));
+    }
+
+    KJ_IF_MAYBE(c, code) {
+      if (!writeFailed) {
+        goingAway = false;
+        goAway(*c, exception.getDescription());
+        // maybeFinish() completes once GOAWAY is flushed; a protocol error is the peer's problem,
+        // so the connection just ends.
+        return;
+      }
+    }
+
+    finished = true;
+    KJ_IF_MAYBE(f, doneFulfiller) {
+      if (exception.getType() == kj::Exception::Type::DISCONNECTED) {
+        f->get()->fulfill();
+      } else {
+        f->get()->reject(kj::mv(exception));
+      }
+    }
+  }
+
+  void detachAll(kj::Exception&& exception) {
+    // Fails and detaches every open stream. Subclasses call this from their destructors, while
+    // onStreamFailed() still reaches them.
+    kj::Vector<kj::Own<Http2Stream>> all(streams.size());
+    for (auto& entry: streams) {
+      all.add(kj::mv(entry.value));
+    }
+    streams.clear();
+    for (auto& s: all) {
+      onStreamFailed(*s, exception);
+      s->fail(kj::cp(exception));
+      s->session = nullptr;
+    }
+
+    for (auto& waiter: windowWaiters) {
+      waiter->reject(kj::cp(exception));
+    }
+    windowWaiters.clear();
+    if (!writing) {
+      for (auto& waiter: flushWaiters) {
+        waiter->reject(kj::cp(exception));
+      }
+      flushWaiters.clear();
+    }
+  }
+
+private:
+  HpackDecoder decoder;
+  HpackEncoder encoder;
+
+  kj::Array<byte> readBuffer;
+  size_t readStart = 0;
+  size_t readEnd = 0;
+  bool readDone = false;
+  bool gotSettings = false;
+
+  kj::Vector<byte> headerBlock;
+  kj::Vector<char> lowercaseScratch;
+
+  kj::Vector<byte> incomingHeaderBlock;
+  uint32_t incomingHeaderStream = 0;
+  // While nonzero, we're in the middle of a header block on this stream and only CONTINUATION
+  // frames may arrive.
+  bool incomingHeaderEndStream = false;
+
+  int64_t connectionSendWindow = DEFAULT_WINDOW_SIZE;
+  int64_t connectionRecvWindow;
+  uint32_t connectionUnacked = 0;
+  uint32_t peerMaxFrameSize = DEFAULT_MAX_FRAME_SIZE;
+
+  kj::Vector<byte> pending;
+  kj::Vector<byte> inFlight;
+  // Frames are appended to `pending` and written in batches, at most one write at a time.
+  bool writing = false;
+  bool writeFailed = false;
+
+  kj::Vector<kj::Own<kj::PromiseFulfiller<void>>> flushWaiters;
+  kj::Vector<kj::Own<kj::PromiseFulfiller<void>>> windowWaiters;
+
+  kj::Maybe<kj::Own<kj::PromiseFulfiller<void>>> doneFulfiller;
+  kj::Maybe<Http2Error> pendingError;
+
+protected:
+  kj::TaskSet tasks;
+  // Declared last so that in-flight tasks are destroyed before the state they use.
+
+private:
+  void taskFailed(kj::Exception&& exception) override {
+    fail(kj::mv(exception), pendingError.orDefault(Http2Error::INTERNAL_ERROR));
+  }
+
+  [[noreturn]] void protocolError(Http2Error code, kj::StringPtr message) {
+    pendingError = code;
+    kj::throwFatalException(KJ_EXCEPTION(FAILED, "HTTP/2 protocol error", message));
+  }
+
+  // ---------------------------------------------------------------------------
+  // Output
+
+  void queueFrame(FrameType type, byte flags, uint32_t streamId,
+                  kj::ArrayPtr<const byte> payload) {
+    if (finished) return;
+    pending.add(payload.size() >> 16);
+    pending.add(payload.size() >> 8);
+    pending.add(payload.size());
+    pending.add(static_cast<byte>(type));
+    pending.add(flags);
+    addUint32(pending, streamId & 0x7fffffff);
+    pending.addAll(payload);
+
+    if (!writing) {
+      // Defer the write until the end of this turn of the event loop so that frames queued
+      // together go out in one write.
+      writing = true;
+      tasks.add(kj::evalLater([this]() { return flushLoop(); }));
+    }
+  }
+
+  kj::Promise<void> flushLoop() {
+    if (pending.size() == 0) {
+      writing = false;
+      for (auto& waiter: flushWaiters) {
+        waiter->fulfill();
+      }
+      flushWaiters.clear();
+      maybeFinish();
+      return kj::READY_NOW;
+    }
+
+    auto empty = kj::mv(inFlight);
+    inFlight = kj::mv(pending);
+    pending = kj::mv(empty);
+    return stream.write(inFlight.begin(), inFlight.size())
+        .then([this]() {
+      inFlight.clear();
+      return flushLoop();
+    }, [this](kj::Exception&& e) {
+      writeFailed = true;
+      writing = false;
+      pending.clear();
+      for (auto& waiter: flushWaiters) {
+        waiter->reject(kj::cp(e));
+      }
+      flushWaiters.clear();
+      fail(kj::mv(e), nullptr);
+    });
+  }
+
+  kj::Promise<void> whenFlushed() {
+    if (!writing) return kj::READY_NOW;
+    auto paf = kj::newPromiseAndFulfiller<void>();
+    flushWaiters.add(kj::mv(paf.fulfiller));
+    return kj::mv(paf.promise);
+  }
+
+  kj::Promise<void> whenWindowAvailable() {
+    auto paf = kj::newPromiseAndFulfiller<void>();
+    windowWaiters.add(kj::mv(paf.fulfiller));
+    return kj::mv(paf.promise);
+  }
+
+  void wakeWindowWaiters() {
+    // Every blocked writer rechecks its windows; there are rarely many.
+    auto waiters = kj::mv(windowWaiters);
+    for (auto& waiter: waiters) {
+      waiter->fulfill();
+    }
+  }
+
+  void sendSettings() {
+    kj::Vector<byte> payload(36);
+    auto add = [&](SettingId id, uint32_t value) {
+      addUint16(payload, static_cast<uint16_t>(id));
+      addUint32(payload, value);
+    };
+    if (settings.headerTableSize != 4096) {
+      add(SettingId::HEADER_TABLE_SIZE, settings.headerTableSize);
+    }
+    if (isServer) {
+      add(SettingId::MAX_CONCURRENT_STREAMS, settings.maxConcurrentStreams);
+    } else {
+      add(SettingId::ENABLE_PUSH, 0);
+    }
+    if (settings.initialWindowSize != DEFAULT_WINDOW_SIZE) {
+      add(SettingId::INITIAL_WINDOW_SIZE, settings.initialWindowSize);
+    }
+    if (settings.maxFrameSize != DEFAULT_MAX_FRAME_SIZE) {
+      add(SettingId::MAX_FRAME_SIZE, settings.maxFrameSize);
+    }
+    add(SettingId::MAX_HEADER_LIST_SIZE, settings.maxHeaderListSize);
+    queueFrame(FrameType::SETTINGS, 0, 0, payload);
+  }
+
+  void sendWindowUpdate(uint32_t streamId, uint32_t increment) {
+    kj::Vector<byte> payload(4);
+    addUint32(payload, increment);
+    queueFrame(FrameType::WINDOW_UPDATE, 0, streamId, payload);
+  }
+
+  // ---------------------------------------------------------------------------
+  // Input
+
+  kj::Promise<void> readPreface() {
+    return ensureBuffered(sizeof(CONNECTION_PREFACE)).then([this](bool ok) {
+      if (!ok || memcmp(readBuffer.begin() + readStart, CONNECTION_PREFACE,
+                        sizeof(CONNECTION_PREFACE)) != 0) {
+        protocolError(Http2Error::PROTOCOL_ERROR, "invalid HTTP/2 connection preface");
+      }
+      readStart += sizeof(CONNECTION_PREFACE);
+    });
+  }
+
+  kj::Promise<bool> ensureBuffered(size_t size) {
+    // Makes sure at least `size` bytes are available at readStart. Returns false on EOF.
+
+    size_t available = readEnd - readStart;
+    if (available >= size) return true;
+
+    if (readStart + size > readBuffer.size()) {
+      memmove(readBuffer.begin(), readBuffer.begin() + readStart, available);
+      readStart = 0;
+      readEnd = available;
+    }
+
+    return stream.tryRead(readBuffer.begin() + readEnd, size - available,
+                          readBuffer.size() - readEnd)
+        .then([this,size](size_t amount) -> kj::Promise<bool> {
+      readEnd += amount;
+      if (readEnd - readStart >= size) return true;
+      if (amount == 0) {
+        KJ_REQUIRE(readEnd == readStart, "HTTP/2 connection ended mid-frame") { break; }
+        return false;
+      }
+      return ensureBuffered(size);
+    });
+  }
+
+  kj::Promise<void> readLoop() {
+    return ensureBuffered(FRAME_HEADER_SIZE).then([this](bool ok) -> kj::Promise<void> {
+      if (!ok) {
+        readDone = true;
+        if (streams.size() > 0 || incomingHeaderStream != 0) {
+          fail(KJ_EXCEPTION(DISCONNECTED, "HTTP/2 peer disconnected"), nullptr);
+        } else {
+          maybeFinish();
+        }
+        return kj::READY_NOW;
+      }
+
+      const byte* header = readBuffer.begin() + readStart;
+      size_t length = (size_t(header[0]) << 16) | (size_t(header[1]) << 8) | header[2];
+      if (length > settings.maxFrameSize) {
+        protocolError(Http2Error::FRAME_SIZE_ERROR, "HTTP/2 frame too large");
+      }
+
+      return ensureBuffered(FRAME_HEADER_SIZE + length)
+          .then([this,length](bool ok) -> kj::Promise<void> {
+        if (!ok) {
+          readDone = true;
+          fail(KJ_EXCEPTION(DISCONNECTED, "HTTP/2 peer disconnected"), nullptr);
+          return kj::READY_NOW;
+        }
+
+        const byte* header = readBuffer.begin() + readStart;
+        auto type = static_cast<FrameType>(header[3]);
+        byte flags = header[4];
+        uint32_t streamId = readUint32(header + 5) & 0x7fffffff;
+        auto payload = kj::arrayPtr(header + FRAME_HEADER_SIZE, length);
+        readStart += FRAME_HEADER_SIZE + length;
+
+        handleFrame(type, flags, streamId, payload);
+        if (finished) return kj::READY_NOW;
+        return readLoop();
+      });
+    });
+  }
+
+  bool isIdle(uint32_t streamId) {
+    // Has this stream never been opened?
+    if ((streamId & 1) == (isServer ? 1 : 0)) {
+      return streamId > lastPeerStreamId;
+    } else {
+      return streamId >= nextStreamId;
+    }
+  }
+
+  kj::ArrayPtr<const byte> removePadding(byte flags, kj::ArrayPtr<const byte> payload) {
+    if (flags & FrameFlags::PADDED) {
+      if (payload.size() < 1 || payload[0] >= payload.size()) {
+        protocolError(Http2Error::PROTOCOL_ERROR, "invalid HTTP/2 padding");
+      }
+      return payload.slice(1, payload.size() - payload[0]);
+    }
+    return payload;
+  }
+
+  void handleFrame(FrameType type, byte flags, uint32_t streamId,
+                   kj::ArrayPtr<const byte> payload) {
+    if (incomingHeaderStream != 0 &&
+        (type != FrameType::CONTINUATION || streamId != incomingHeaderStream)) {
+      protocolError(Http2Error::PROTOCOL_ERROR, "expected CONTINUATION frame");
+    }
+    if (!gotSettings && type != FrameType::SETTINGS) {
+      protocolError(Http2Error::PROTOCOL_ERROR, "expected SETTINGS frame");
+    }
+
+    switch (type) {
+      case FrameType::DATA:
+        handleData(flags, streamId, payload);
+        break;
+
+      case FrameType::HEADERS: {
+        if (streamId == 0) {
+          protocolError(Http2Error::PROTOCOL_ERROR, "HEADERS on stream 0");
+        }
+        auto fragment = removePadding(flags, payload);
+        if (flags & FrameFlags::PRIORITY) {
+          if (fragment.size() < 5) {
+            protocolError(Http2Error::FRAME_SIZE_ERROR, "HEADERS frame too short");
+          }
+          if ((readUint32(fragment.begin()) & 0x7fffffff) == streamId) {
+            protocolError(Http2Error::PROTOCOL_ERROR, "stream depends on itself");
+          }
+          fragment = fragment.slice(5, fragment.size());
+        }
+        incomingHeaderBlock.clear();
+        incomingHeaderEndStream = flags & FrameFlags::END_STREAM;
+        appendHeaderFragment(streamId, flags, fragment);
+        break;
+      }
+
+      case FrameType::CONTINUATION:
+        if (incomingHeaderStream == 0) {
+          protocolError(Http2Error::PROTOCOL_ERROR, "unexpected CONTINUATION frame");
+        }
+        appendHeaderFragment(streamId, flags, payload);
+        break;
+
+      case FrameType::PRIORITY:
+        // We don't prioritize; streams are served in the order their data becomes available.
+        if (streamId == 0) {
+          protocolError(Http2Error::PROTOCOL_ERROR, "PRIORITY on stream 0");
+        }
+        if (payload.size() != 5) {
+          protocolError(Http2Error::FRAME_SIZE_ERROR, "PRIORITY frame has wrong size");
+        }
+        break;
+
+      case FrameType::RST_STREAM: {
+        if (streamId == 0 || isIdle(streamId)) {
+          protocolError(Http2Error::PROTOCOL_ERROR, "RST_STREAM on idle stream");
+        }
+        if (payload.size() != 4) {
+          protocolError(Http2Error::FRAME_SIZE_ERROR, "RST_STREAM frame has wrong size");
+        }
+        auto code = static_cast<Http2Error>(readUint32(payload.begin()));
+        KJ_IF_MAYBE(s, findStream(streamId)) {
+          s->localClosed = true;
+          if (code == Http2Error::NO_ERROR && s->remoteClosed) {
+            // The peer has what it needs and just wants us to stop sending (RFC 7540 section
+            // 8.1). The response it sent remains readable.
+            retire(*s);
+          } else {
+            failStream(*s, streamResetException(code));
+          }
+        }
+        break;
+      }
+
+      case FrameType::SETTINGS:
+        handleSettings(flags, streamId, payload);
+        break;
+
+      case FrameType::PUSH_PROMISE:
+        // We never enable push, and clients can't push at all.
+        protocolError(Http2Error::PROTOCOL_ERROR, "unexpected PUSH_PROMISE");
+
+      case FrameType::PING:
+        if (streamId != 0) {
+          protocolError(Http2Error::PROTOCOL_ERROR, "PING on nonzero stream");
+        }
+        if (payload.size() != 8) {
+          protocolError(Http2Error::FRAME_SIZE_ERROR, "PING frame has wrong size");
+        }
+        if (!(flags & FrameFlags::ACK)) {
+          queueFrame(FrameType::PING, FrameFlags::ACK, 0, payload);
+        }
+        break;
+
+      case FrameType::GOAWAY: {
+        if (streamId != 0) {
+          protocolError(Http2Error::PROTOCOL_ERROR, "GOAWAY on nonzero stream");
+        }
+        if (payload.size() < 8) {
+          protocolError(Http2Error::FRAME_SIZE_ERROR, "GOAWAY frame too short");
+        }
+        uint32_t lastStreamId = readUint32(payload.begin()) & 0x7fffffff;
+        peerGoingAway = true;
+
+        // Streams we opened that the peer won't process fail, safe to retry.
+        kj::Vector<kj::Own<Http2Stream>> unprocessed;
+        for (auto& entry: streams) {
+          if ((entry.key & 1) == (isServer ? 0 : 1) && entry.key > lastStreamId) {
+            unprocessed.add(kj::addRef(*entry.value));
+          }
+        }
+        for (auto& s: unprocessed) {
+          failStream(*s, KJ_EXCEPTION(DISCONNECTED, "HTTP/2 peer sent GOAWAY"));
+        }
+        onPeerGoAway(lastStreamId);
+        maybeFinish();
+        break;
+      }
+
+      case FrameType::WINDOW_UPDATE: {
+        if (payload.size() != 4) {
+          protocolError(Http2Error::FRAME_SIZE_ERROR, "WINDOW_UPDATE frame has wrong size");
+        }
+        uint32_t increment = readUint32(payload.begin()) & 0x7fffffff;
+        if (streamId == 0) {
+          if (increment == 0) {
+            protocolError(Http2Error::PROTOCOL_ERROR, "zero WINDOW_UPDATE");
+          }
+          connectionSendWindow += increment;
+          if (connectionSendWindow > MAX_WINDOW_SIZE) {
+            protocolError(Http2Error::FLOW_CONTROL_ERROR, "connection window overflow");
+          }
+        } else KJ_IF_MAYBE(s, findStream(streamId)) {
+          if (increment == 0) {
+            sendRstStream(streamId, Http2Error::PROTOCOL_ERROR);
+            failStream(*s, KJ_EXCEPTION(FAILED, "HTTP/2 peer sent zero WINDOW_UPDATE"));
+            break;
+          }
+          s->sendWindow += increment;
+          if (s->sendWindow > MAX_WINDOW_SIZE) {
+            sendRstStream(streamId, Http2Error::FLOW_CONTROL_ERROR);
+            failStream(*s, KJ_EXCEPTION(FAILED, "HTTP/2 stream window overflow"));
+            break;
+          }
+        } else if (isIdle(streamId)) {
+          protocolError(Http2Error::PROTOCOL_ERROR, "WINDOW_UPDATE on idle stream");
+        }
+        wakeWindowWaiters();
+        break;
+      }
+
+      default:
+        // Unknown frame types must be ignored.
+        break;
+    }
+  }
+
+  void handleData(byte flags, uint32_t streamId, kj::ArrayPtr<const byte> payload) {
+    if (streamId == 0) {
+      protocolError(Http2Error::PROTOCOL_ERROR, "DATA on stream 0");
+    }
+    if (isIdle(streamId)) {
+      protocolError(Http2Error::PROTOCOL_ERROR, "DATA on idle stream");
+    }
+
+    // The connection window counts the whole payload, padding included. We credit it back as
+    // soon as it arrives; the stream windows are what bound buffering.
+    connectionRecvWindow -= payload.size();
+    if (connectionRecvWindow < 0) {
+      protocolError(Http2Error::FLOW_CONTROL_ERROR, "connection window exceeded");
+    }
+    connectionUnacked += payload.size();
+    if (connectionUnacked >= settings.connectionWindowSize / 2) {
+      sendWindowUpdate(0, connectionUnacked);
+      connectionRecvWindow += connectionUnacked;
+      connectionUnacked = 0;
+    }
+
+    auto data = removePadding(flags, payload);
+
+    KJ_IF_MAYBE(s, findStream(streamId)) {
+      if (s->remoteClosed) {
+        sendRstStream(streamId, Http2Error::STREAM_CLOSED);
+        failStream(*s, KJ_EXCEPTION(FAILED, "HTTP/2 peer sent DATA after END_STREAM"));
+        return;
+      }
+
+      s->recvWindow -= payload.size();
+      if (s->recvWindow < 0) {
+        sendRstStream(streamId, Http2Error::FLOW_CONTROL_ERROR);
+        failStream(*s, KJ_EXCEPTION(FAILED, "HTTP/2 stream window exceeded"));
+        return;
+      }
+      // Padding is never read by the application, so count it as consumed right away.
+      consumed(*s, payload.size() - data.size());
+
+      if (data.size() > 0) {
+        s->receivedBytes += data.size();
+        s->inbound.pushBack(kj::heapArray(data));
+        s->wakeReader();
+      }
+      if (flags & FrameFlags::END_STREAM) {
+        remoteEnd(*s);
+      }
+    }
+    // Otherwise the stream was closed or reset already; the data is discarded.
+  }
+
+  void appendHeaderFragment(uint32_t streamId, byte flags, kj::ArrayPtr<const byte> fragment) {
+    incomingHeaderBlock.addAll(fragment);
+    if (incomingHeaderBlock.size() > size_t(settings.maxHeaderListSize) + settings.maxFrameSize) {
+      // Don't buffer unbounded CONTINUATION floods. (A block this big would fail decoding anyway.)
+      protocolError(Http2Error::ENHANCE_YOUR_CALM, "HTTP/2 header block too large");
+    }
+
+    if (!(flags & FrameFlags::END_HEADERS)) {
+      incomingHeaderStream = streamId;
+      return;
+    }
+    incomingHeaderStream = 0;
+
+    // Decode even if we'll ignore the stream, to keep the HPACK state in sync.
+    kj::Array<HpackDecoder::Header> fields;
+    KJ_IF_MAYBE(e, kj::runCatchingExceptions([&]() {
+      fields = decoder.decode(incomingHeaderBlock, settings.maxHeaderListSize);
+    })) {
+      protocolError(Http2Error::COMPRESSION_ERROR, e->getDescription());
+    }
+
+    onHeaders(streamId, kj::mv(fields), incomingHeaderEndStream);
+  }
+
+  void handleSettings(byte flags, uint32_t streamId, kj::ArrayPtr<const byte> payload) {
+    if (streamId != 0) {
+      protocolError(Http2Error::PROTOCOL_ERROR, "SETTINGS on nonzero stream");
+    }
+
+    if (flags & FrameFlags::ACK) {
+      if (payload.size() != 0) {
+        protocolError(Http2Error::FRAME_SIZE_ERROR, "SETTINGS ACK with payload");
+      }
+      // The peer's encoder now knows our table size.
+      decoder.setMaxTableSize(settings.headerTableSize);
+      return;
+    }
+
+    if (payload.size() % 6 != 0) {
+      protocolError(Http2Error::FRAME_SIZE_ERROR, "SETTINGS frame has wrong size");
+    }
+    gotSettings = true;
+
+    for (size_t i = 0; i < payload.size(); i += 6) {
+      auto id = static_cast<SettingId>((uint16_t(payload[i]) << 8) | payload[i + 1]);
+      uint32_t value = readUint32(payload.begin() + i + 2);
+      switch (id) {
+        case SettingId::HEADER_TABLE_SIZE:
+          encoder.setMaxTableSize(value);
+          break;
+        case SettingId::ENABLE_PUSH:
+          if (value > 1) {
+            protocolError(Http2Error::PROTOCOL_ERROR, "invalid SETTINGS_ENABLE_PUSH");
+          }
+          break;
+        case SettingId::MAX_CONCURRENT_STREAMS:
+          peerMaxConcurrentStreams = value;
+          break;
+        case SettingId::INITIAL_WINDOW_SIZE: {
+          if (value > MAX_WINDOW_SIZE) {
+            protocolError(Http2Error::FLOW_CONTROL_ERROR, "invalid SETTINGS_INITIAL_WINDOW_SIZE");
+          }
+          // The change applies retroactively to every open stream.
+          int64_t delta = int64_t(value) - peerInitialWindowSize;
+          peerInitialWindowSize = value;
+          for (auto& entry: streams) {
+            entry.value->sendWindow += delta;
+            if (entry.value->sendWindow > MAX_WINDOW_SIZE) {
+              protocolError(Http2Error::FLOW_CONTROL_ERROR, "stream window overflow");
+            }
+          }
+          break;
+        }
+        case SettingId::MAX_FRAME_SIZE:
+          if (value < DEFAULT_MAX_FRAME_SIZE || value >= (1u << 24)) {
+            protocolError(Http2Error::PROTOCOL_ERROR, "invalid SETTINGS_MAX_FRAME_SIZE");
+          }
+          peerMaxFrameSize = value;
+          break;
+        default:
+          // Including MAX_HEADER_LIST_SIZE, which is advisory. Unknown settings must be ignored.
+          break;
+      }
+    }
+
+    queueFrame(FrameType::SETTINGS, FrameFlags::ACK, 0, nullptr);
+    wakeWindowWaiters();
+    onPeerSettings();
+  }
+};
+
+// =======================================================================================
+// Body streams
+
+class Http2InputStream final: public kj::AsyncInputStream {
+  // Reads the body of a request (server side) or response (client side).
+
+public:
+  Http2InputStream(kj::Own<Http2Stream> stream, bool cancelOnDrop)
+      : stream(kj::mv(stream)), cancelOnDrop(cancelOnDrop) {}
+  ~Http2InputStream() noexcept(false) {
+    if (cancelOnDrop && !stream->remoteClosed) {
+      // The response wasn't fully read; tell the server to stop sending it.
+      KJ_IF_MAYBE(session, stream->session) {
+        session->resetStream(*stream, Http2Error::CANCEL);
+      }
+    }
+  }
+
+  kj::Promise<size_t> tryRead(void* buffer, size_t minBytes, size_t maxBytes) override {
+    return tryReadInternal(reinterpret_cast<byte*>(buffer), minBytes, maxBytes, 0);
+  }
+
+  kj::Maybe<uint64_t> tryGetLength() override {
+    KJ_IF_MAYBE(expected, stream->expectedLength) {
+      return *expected - bytesRead;
+    } else if (stream->remoteClosed) {
+      return stream->receivedBytes - bytesRead;
+    } else {
+      return nullptr;
+    }
+  }
+
+private:
+  kj::Own<Http2Stream> stream;
+  bool cancelOnDrop;
+  uint64_t bytesRead = 0;
+
+  kj::Promise<size_t> tryReadInternal(byte* buffer, size_t minBytes, size_t maxBytes,
+                                      size_t alreadyRead) {
+    auto& s = *stream;
+    size_t n = 0;
+    while (n < maxBytes && !s.inbound.empty()) {
+      auto& chunk = s.inbound.front();
+      size_t amount = kj::min(maxBytes - n, chunk.size() - s.inboundOffset);
+      memcpy(buffer + n, chunk.begin() + s.inboundOffset, amount);
+      n += amount;
+      s.inboundOffset += amount;
+      if (s.inboundOffset == chunk.size()) {
+        s.inbound.popFront();
+        s.inboundOffset = 0;
+      }
+    }
+
+    if (n > 0) {
+      bytesRead += n;
+      KJ_IF_MAYBE(session, s.session) {
+        session->consumed(s, n);
+      }
+    }
+
+    alreadyRead += n;
+    if (n >= minBytes || (s.remoteClosed && s.inbound.empty())) {
+      // Note that a stream reset after the peer finished sending is still readable.
+      return alreadyRead;
+    }
+    KJ_IF_MAYBE(e, s.error) {
+      return kj::cp(*e);
+    }
+
+    return s.whenReadable().then([this,buffer,minBytes,maxBytes,n,alreadyRead]() {
+      return tryReadInternal(buffer + n, minBytes - n, maxBytes - n, alreadyRead);
+    });
+  }
+};
+
+class Http2OutputStream final: public kj::AsyncOutputStream {
+  // Writes the body of a request (client side) or response (server side).
+
+public:
+  Http2OutputStream(kj::Own<Http2Stream> stream, kj::Maybe<uint64_t> expectedBodySize)
+      : stream(kj::mv(stream)), remaining(expectedBodySize) {}
+  ~Http2OutputStream() noexcept(false) {
+    if (stream->localClosed) return;
+    KJ_IF_MAYBE(session, stream->session) {
+      if (remaining.orDefault(0) > 0) {
+        // Ended before the promised Content-Length; the peer must not take this as complete.
+        session->resetStream(*stream, Http2Error::CANCEL);
+      } else {
+        session->endStream(*stream);
+      }
+    }
+  }
+
+  kj::Promise<void> write(const void* buffer, size_t size) override {
+    if (size == 0) return kj::READY_NOW;
+    KJ_IF_MAYBE(r, remaining) {
+      KJ_REQUIRE(size <= *r, "overwrote Content-Length");
+      *r -= size;
+    }
+    return getSession().sendData(
+        *stream, kj::arrayPtr(reinterpret_cast<const byte*>(buffer), size),
+        remaining.orDefault(1) == 0);
+  }
+
+  kj::Promise<void> write(kj::ArrayPtr<const kj::ArrayPtr<const byte>> pieces) override {
+    if (pieces.size() == 0) return kj::READY_NOW;
+    return write(pieces[0].begin(), pieces[0].size())
+        .then([this,pieces]() { return write(pieces.slice(1, pieces.size())); });
+  }
+
+private:
+  kj::Own<Http2Stream> stream;
+  kj::Maybe<uint64_t> remaining;
+  // Once this reaches zero, the write that got it there ends the stream.
+
+  Http2Session& getSession() {
+    KJ_IF_MAYBE(session, stream->session) {
+      return *session;
+    }
+    KJ_IF_MAYBE(e, stream->error) {
+      kj::throwFatalException(kj::cp(*e));
+    }
+    KJ_FAIL_REQUIRE("HTTP/2 stream already ended");
+  }
+};
+
+class Http2NullOutputStream final: public kj::AsyncOutputStream {
+  // For messages that have no body (e.g. HEAD requests). Writes are ignored if `discard` is true,
+  // otherwise they're an error.
+
+public:
+  explicit Http2NullOutputStream(bool discard): discard(discard) {}
+
+  kj::Promise<void> write(const void* buffer, size_t size) override {
+    KJ_REQUIRE(discard || size == 0, "this message has no body");
+    return kj::READY_NOW;
+  }
+  kj::Promise<void> write(kj::ArrayPtr<const kj::ArrayPtr<const byte>> pieces) override {
+    for (auto& piece: pieces) {
+      KJ_REQUIRE(discard || piece.size() == 0, "this message has no body");
+    }
+    return kj::READY_NOW;
+  }
+
+private:
+  bool discard;
+};
+
+// =======================================================================================
+// Client
+
+class Http2ClientImpl final: public HttpClient, private Http2Session {
+public:
+  Http2ClientImpl(HttpHeaderTable& responseHeaderTable, kj::AsyncIoStream& stream,
+                  HttpClientSettings settings)
+      : Http2Session(stream, settings.http2, false),
+        responseHeaderTable(responseHeaderTable),
+        settings(kj::mv(settings)),
+        runTask(run(false).then([this]() {
+          failWaitingStreams(KJ_EXCEPTION(DISCONNECTED, "HTTP/2 connection is closed"));
+        }, [this](kj::Exception&& e) {
+          failWaitingStreams(e);
+          failure = kj::mv(e);
+        }).eagerlyEvaluate(nullptr)) {}
+  ~Http2ClientImpl() noexcept(false) {
+    auto exception = KJ_EXCEPTION(DISCONNECTED, "HTTP/2 client was destroyed");
+    failWaitingStreams(exception);
+    detachAll(kj::mv(exception));
+  }
+
+  Request request(HttpMethod method, kj::StringPtr url, const HttpHeaders& headers,
+                  kj::Maybe<uint64_t> expectedBodySize = nullptr) override {
+    KJ_IF_MAYBE(e, failure) {
+      kj::throwFatalException(kj::cp(*e));
+    }
+    if (finished || peerGoingAway) {
+      kj::throwFatalException(KJ_EXCEPTION(DISCONNECTED, "HTTP/2 connection is closed"));
+    }
+
+    bool hasBody = method != HttpMethod::GET && method != HttpMethod::HEAD &&
+                   expectedBodySize.orDefault(1) > 0;
+
+    auto paf = kj::newPromiseAndFulfiller<Response>();
+    auto s = kj::refcounted<ClientStream>(static_cast<Http2Session&>(*this), peerInitialWindowSize,
+                                          Http2Session::settings.initialWindowSize,
+                                          kj::mv(paf.fulfiller), method);
+    if (!hasBody) s->localClosed = true;
+
+    // Work out the pseudo-headers.
+    if (url.startsWith("/") || url == "*") {
+      s->scheme = kj::str("http");
+      s->path = kj::str(url);
+      s->authority = kj::str(headers.get(HttpHeaderId::HOST).orDefault(nullptr));
+    } else {
+      auto parsed = Url::parse(url, Url::HTTP_PROXY_REQUEST);
+      s->scheme = kj::mv(parsed.scheme);
+      s->authority = kj::mv(parsed.host);
+      s->path = parsed.toString(Url::HTTP_REQUEST);
+    }
+    if (hasBody) {
+      KJ_IF_MAYBE(size, expectedBodySize) {
+        s->contentLength = kj::str(*size);
+      }
+    }
+
+    if (streams.size() < peerMaxConcurrentStreams && waiting.empty()) {
+      startStream(*s, headers);
+    } else {
+      // Wait for a free stream; the headers must be copied since the caller's go away.
+      s->deferredHeaders = headers.clone();
+      waiting.pushBack(kj::addRef(*s));
+    }
+
+    kj::Own<kj::AsyncOutputStream> body;
+    if (hasBody) {
+      body = kj::heap<Http2OutputStream>(kj::addRef(*s), expectedBodySize);
+    } else {
+      body = kj::heap<Http2NullOutputStream>(false);
+    }
+    return { kj::mv(body), kj::mv(paf.promise) };
+  }
+
+private:
+  struct ClientStream final: public Http2Stream {
+    ClientStream(Http2Session& session, int64_t sendWindow, int64_t recvWindow,
+                 kj::Own<kj::PromiseFulfiller<Response>> responseFulfiller, HttpMethod method)
+        : Http2Stream(session, sendWindow, recvWindow),
+          responseFulfiller(kj::mv(responseFulfiller)), method(method) {}
+
+    kj::Own<kj::PromiseFulfiller<Response>> responseFulfiller;
+    HttpMethod method;
+    kj::String scheme;
+    kj::String authority;
+    kj::String path;
+    kj::String contentLength;
+    kj::Maybe<HttpHeaders> deferredHeaders;
+
+    kj::Maybe<HttpHeaders> responseHeaders;
+    // Owned here so that it lives as long as the response body, which holds a reference to us.
+  };
+
+  HttpHeaderTable& responseHeaderTable;
+  HttpClientSettings settings;
+  _::RingBuffer<kj::Own<ClientStream>> waiting;
+  // Requests waiting for the server to allow another concurrent stream.
+
+  kj::Maybe<kj::Exception> failure;
+  kj::Promise<void> runTask;
+
+  void startStream(ClientStream& s, const HttpHeaders& headers) {
+    // A queued stream has sent nothing, so its window is whatever the peer's current setting is,
+    // which may have changed since the request was made.
+    s.sendWindow = peerInitialWindowSize;
+    openStream(s);
+    sendHeaders(s.id, s.localClosed, [&](HpackEncoder& encoder, kj::Vector<byte>& block) {
+      encoder.add(block, ":method", kj::str(s.method));
+      encoder.add(block, ":scheme", s.scheme);
+      encoder.add(block, ":authority", s.authority);
+      encoder.add(block, ":path", s.path);
+      addHeaders(encoder, block, headers, true);
+      if (s.contentLength != nullptr) {
+        encoder.add(block, "content-length", s.contentLength);
+      }
+    });
+    KJ_IF_MAYBE(waiter, s.openWaiter) {
+      waiter->get()->fulfill();
+      s.openWaiter = nullptr;
+    }
+  }
+
+  void startWaitingStreams() {
+    while (!waiting.empty() && streams.size() < peerMaxConcurrentStreams && !finished &&
+           !peerGoingAway) {
+      auto s = waiting.popFront();
+      if (s->error != nullptr) continue;
+      startStream(*s, KJ_ASSERT_NONNULL(s->deferredHeaders));
+      s->deferredHeaders = nullptr;
+    }
+  }
+
+  void failWaitingStreams(const kj::Exception& exception) {
+    while (!waiting.empty()) {
+      auto s = waiting.popFront();
+      onStreamFailed(*s, exception);
+      s->fail(kj::cp(exception));
+      s->session = nullptr;
+    }
+  }
+
+  void onHeaders(uint32_t streamId, kj::Array<HpackDecoder::Header> fields,
+                 bool endStream) override {
+    if (streamId % 2 == 0) {
+      // Servers can only start streams with PUSH_PROMISE, which we disabled.
+      fail(KJ_EXCEPTION(FAILED, "HTTP/2 protocol error", "server opened a stream"),
+           Http2Error::PROTOCOL_ERROR);
+      return;
+    }
+
+    Http2Stream* found;
+    KJ_IF_MAYBE(s, findStream(streamId)) {
+      found = s;
+    } else {
+      // Probably a stream we reset.
+      return;
+    }
+    auto& s = kj::downcast<ClientStream>(*found);
+    auto ownStream = kj::addRef(s);
+    // remoteEnd() may retire the stream.
+
+    if (s.responseHeaders != nullptr) {
+      // Trailers. We have nowhere to put them.
+      if (endStream) {
+        remoteEnd(s);
+      } else {
+        resetStream(s, Http2Error::PROTOCOL_ERROR);
+      }
+      return;
+    }
+
+    kj::Maybe<uint> status;
+    HttpHeaders headers(responseHeaderTable);
+    bool malformed = false;
+    for (auto& field: fields) {
+      if (field.name.startsWith(":")) {
+        if (field.name == ":status" && status == nullptr) {
+          status = parseContentLength(field.value).map([](uint64_t v) { return uint(v); });
+        }
+        if (status == nullptr || field.name != ":status") malformed = true;
+      } else if (isConnectionSpecificHeader(field.name)) {
+        malformed = true;
+      } else {
+        if (field.name == "content-length") {
+          s.expectedLength = parseContentLength(field.value);
+        }
+        KJ_IF_MAYBE(e, kj::runCatchingExceptions([&]() {
+          headers.add(kj::mv(field.name), kj::mv(field.value));
+        })) {
+          malformed = true;
+        }
+      }
+    }
+
+    uint statusCode;
+    KJ_IF_MAYBE(sc, status) {
+      statusCode = *sc;
+    } else {
+      malformed = true;
+    }
+    if (malformed) {
+      resetStream(s, Http2Error::PROTOCOL_ERROR);
+      return;
+    }
+
+    if (statusCode < 200) {
+      // Informational; the real response follows.
+      if (endStream) resetStream(s, Http2Error::PROTOCOL_ERROR);
+      return;
+    }
+
+    if (s.method == HttpMethod::HEAD || statusCode == 204 || statusCode == 304) {
+      // Content-Length describes a body that isn't sent.
+      s.expectedLength = uint64_t(0);
+    }
+
+    auto& responseHeaders = s.responseHeaders.emplace(kj::mv(headers));
+    if (endStream) {
+      remoteEnd(s);
+      if (s.error != nullptr) return;
+    }
+
+    if (!s.responseFulfiller->isWaiting()) {
+      resetStream(s, Http2Error::CANCEL);
+      return;
+    }
+    s.responseFulfiller->fulfill(Response {
+      statusCode, defaultStatusText(statusCode), &responseHeaders,
+      kj::heap<Http2InputStream>(kj::addRef(s), true)
+    });
+  }
+
+  void onStreamFailed(Http2Stream& s, const kj::Exception& exception) override {
+    auto& cs = kj::downcast<ClientStream>(s);
+    if (cs.responseFulfiller->isWaiting()) {
+      cs.responseFulfiller->reject(kj::cp(exception));
+    }
+  }
+
+  void onStreamRetired() override {
+    startWaitingStreams();
+  }
+
+  void onPeerSettings() override {
+    startWaitingStreams();
+  }
+
+  void onPeerGoAway(uint32_t lastStreamId) override {
+    failWaitingStreams(KJ_EXCEPTION(DISCONNECTED, "HTTP/2 server sent GOAWAY"));
+  }
+};
+
+// =======================================================================================
+// Preface detection
+
+class PrefixedAsyncIoStream final: public kj::AsyncIoStream {
+  // Replays bytes that were read while sniffing the protocol, then continues with the underlying
+  // stream.
+
+public:
+  PrefixedAsyncIoStream(kj::Own<kj::AsyncIoStream> inner, kj::Array<byte> prefix)
+      : inner(kj::mv(inner)), prefix(kj::mv(prefix)) {}
+
+  kj::Promise<size_t> tryRead(void* buffer, size_t minBytes, size_t maxBytes) override {
+    if (offset == prefix.size()) {
+      return inner->tryRead(buffer, minBytes, maxBytes);
+    }
+
+    size_t n = kj::min(maxBytes, prefix.size() - offset);
+    memcpy(buffer, prefix.begin() + offset, n);
+    offset += n;
+    if (n >= minBytes) return n;
+    return inner->tryRead(reinterpret_cast<byte*>(buffer) + n, minBytes - n, maxBytes - n)
+        .then([n](size_t amount) { return n + amount; });
+  }
+
+  kj::Promise<void> write(const void* buffer, size_t size) override {
+    return inner->write(buffer, size);
+  }
+  kj::Promise<void> write(kj::ArrayPtr<const kj::ArrayPtr<const byte>> pieces) override {
+    return inner->write(pieces);
+  }
+  void shutdownWrite() override { inner->shutdownWrite(); }
+  void abortRead() override { inner->abortRead(); }
+  void getsockopt(int level, int option, void* value, uint* length) override {
+    inner->getsockopt(level, option, value, length);
+  }
+  void setsockopt(int level, int option, const void* value, uint length) override {
+    inner->setsockopt(level, option, value, length);
+  }
+  void getsockname(struct sockaddr* addr, uint* length) override {
+    inner->getsockname(addr, length);
+  }
+  void getpeername(struct sockaddr* addr, uint* length) override {
+    inner->getpeername(addr, length);
+  }
+
+private:
+  kj::Own<kj::AsyncIoStream> inner;
+  kj::Array<byte> prefix;
+  size_t offset = 0;
+};
+
+}  // namespace
+
+kj::Own<HttpClient> newHttp2Client(HttpHeaderTable& responseHeaderTable, kj::AsyncIoStream& stream,
+                                   HttpClientSettings settings) {
+  return kj::heap<Http2ClientImpl>(responseHeaderTable, stream, kj::mv(settings));
+}
+
+// =======================================================================================
+// Server
+
+class HttpServer::Http2Connection final: public Http2Session {
+public:
+  Http2Connection(HttpServer& server, kj::AsyncIoStream& stream, HttpService& service)
+      : Http2Session(stream, server.settings.http2, true),
+        server(server),
+        service(service) {
+    ++server.connectionCount;
+  }
+  ~Http2Connection() noexcept(false) {
+    if (--server.connectionCount == 0) {
+      KJ_IF_MAYBE(f, server.zeroConnectionsFulfiller) {
+        f->get()->fulfill();
+      }
+    }
+  }
+
+  kj::Promise<void> serve(bool prefaceConsumed) {
+    auto done = run(prefaceConsumed);
+    armIdleTimeout(server.settings.headerTimeout);
+
+    drainTask = server.onDrain.addBranch().then([this]() {
+      goAway(Http2Error::NO_ERROR);
+    }).eagerlyEvaluate(nullptr);
+
+    return kj::mv(done);
+  }
+
+private:
+  HttpServer& server;
+  HttpService& service;
+  kj::Promise<void> idleTimeout = nullptr;
+  kj::Promise<void> drainTask = nullptr;
+
+  struct ServerStream final: public Http2Stream, public HttpService::Response {
+    ServerStream(Http2Connection& connection, int64_t sendWindow, int64_t recvWindow)
+        : Http2Stream(connection, sendWindow, recvWindow),
+          headers(connection.server.requestHeaderTable) {}
+
+    kj::Maybe<HttpMethod> method;
+    kj::String url;
+    HttpHeaders headers;
+    bool responded = false;
+
+    kj::Own<kj::AsyncOutputStream> send(
+        uint statusCode, kj::StringPtr statusText, const HttpHeaders& responseHeaders,
+        kj::Maybe<uint64_t> expectedBodySize) override {
+      KJ_REQUIRE(!responded, "already called send()");
+      responded = true;
+
+      auto& session = KJ_REQUIRE_NONNULL(this->session, "HTTP/2 stream already ended");
+      auto& connection = kj::downcast<Http2Connection>(session);
+      session.throwIfUnusable(*this);
+
+      bool isHead = false;
+      KJ_IF_MAYBE(m, method) {
+        isHead = *m == HttpMethod::HEAD;
+      }
+      bool noContent = statusCode == 204 || statusCode == 205 || statusCode == 304;
+      bool endStream = isHead || noContent || expectedBodySize.orDefault(1) == 0;
+
+      connection.sendHeaders(id, endStream, [&](HpackEncoder& encoder, kj::Vector<byte>& block) {
+        encoder.add(block, ":status", kj::str(statusCode));
+        connection.addHeaders(encoder, block, responseHeaders, false);
+        KJ_IF_MAYBE(date, connection.server.getDate(responseHeaders)) {
+          encoder.add(block, "date", *date);
+        }
+        if (!noContent) {
+          KJ_IF_MAYBE(size, expectedBodySize) {
+            encoder.add(block, "content-length", kj::str(*size));
+          }
+        }
+      });
+
+      if (endStream) {
+        localClosed = true;
+        if (remoteClosed) connection.retire(*this);
+        return kj::heap<Http2NullOutputStream>(isHead);
+      }
+      return kj::heap<Http2OutputStream>(kj::addRef(*this), expectedBodySize);
+    }
+
+    kj::Own<WebSocket> acceptWebSocket(const HttpHeaders& headers) override {
+      KJ_UNIMPLEMENTED("WebSockets are not supported over HTTP/2");
+    }
+  };
+
+  void armIdleTimeout(kj::Duration timeout) {
+    idleTimeout = server.timer.afterDelay(timeout).then([this]() {
+      goAway(Http2Error::NO_ERROR);
+    }).eagerlyEvaluate(nullptr);
+  }
+
+  void onStreamRetired() override {
+    if (streams.size() == 0 && !goingAway) {
+      armIdleTimeout(server.settings.pipelineTimeout);
+    }
+  }
+
+  void onHeaders(uint32_t streamId, kj::Array<HpackDecoder::Header> fields,
+                 bool endStream) override {
+    KJ_IF_MAYBE(s, findStream(streamId)) {
+      // Trailers. The service has no way to see them, so they're dropped.
+      if (endStream) {
+        remoteEnd(*s);
+      } else {
+        resetStream(*s, Http2Error::PROTOCOL_ERROR);
+      }
+      return;
+    }
+
+    if (streamId % 2 == 0 || streamId <= lastPeerStreamId) {
+      fail(KJ_EXCEPTION(FAILED, "HTTP/2 protocol error", "HEADERS on closed stream"),
+           Http2Error::PROTOCOL_ERROR);
+      return;
+    }
+    lastPeerStreamId = streamId;
+
+    if (goingAway) {
+      // Arrived after our GOAWAY; the client will retry it elsewhere.
+      return;
+    }
+    if (streams.size() >= settings.maxConcurrentStreams) {
+      sendRstStream(streamId, Http2Error::REFUSED_STREAM);
+      return;
+    }
+
+    auto s = kj::refcounted<ServerStream>(*this, peerInitialWindowSize,
+                                          settings.initialWindowSize);
+    s->id = streamId;
+
+    kj::Maybe<kj::StringPtr> methodName;
+    kj::Maybe<kj::StringPtr> path;
+    kj::Maybe<kj::StringPtr> authority;
+    bool hasScheme = false;
+    bool malformed = false;
+    bool seenRegular = false;
+    kj::Vector<kj::String> cookies;
+
+    for (auto& field: fields) {
+      if (field.name.startsWith(":")) {
+        kj::Maybe<kj::StringPtr>* slot = nullptr;
+        if (field.name == ":method") {
+          slot = &methodName;
+        } else if (field.name == ":path") {
+          slot = &path;
+        } else if (field.name == ":authority") {
+          slot = &authority;
+        } else if (field.name == ":scheme" && !hasScheme) {
+          hasScheme = true;
+          continue;
+        }
+        if (slot == nullptr || *slot != nullptr || seenRegular) {
+          malformed = true;
+          break;
+        }
+        *slot = kj::StringPtr(field.value);
+      } else {
+        seenRegular = true;
+        if (isConnectionSpecificHeader(field.name) ||
+            (field.name == "te" && field.value != "trailers")) {
+          malformed = true;
+          break;
+        }
+        if (field.name == "cookie") {
+          // Cookies may arrive split into crumbs, which are joined with "; " rather than ", "
+          // (RFC 7540 section 8.1.2.5).
+          cookies.add(kj::mv(field.value));
+          continue;
+        }
+        if (field.name == "content-length") {
+          s->expectedLength = parseContentLength(field.value);
+          if (s->expectedLength == nullptr) {
+            malformed = true;
+            break;
+          }
+        }
+        KJ_IF_MAYBE(e, kj::runCatchingExceptions([&]() {
+          s->headers.add(kj::mv(field.name), kj::mv(field.value));
+        })) {
+          malformed = true;
+          break;
+        }
+      }
+    }
+
+    if (malformed || methodName == nullptr || path == nullptr || !hasScheme) {
+      sendRstStream(streamId, Http2Error::PROTOCOL_ERROR);
+      return;
+    }
+
+    if (cookies.size() > 0) {
+      s->headers.add("cookie", kj::strArray(cookies, "; "));
+    }
+    KJ_IF_MAYBE(a, authority) {
+      if (s->headers.get(HttpHeaderId::HOST) == nullptr) {
+        s->headers.set(HttpHeaderId::HOST, kj::str(*a));
+      }
+    }
+    s->method = tryParseHttpMethod(KJ_ASSERT_NONNULL(methodName));
+    s->url = kj::str(KJ_ASSERT_NONNULL(path));
+
+    idleTimeout = nullptr;
+    streams.insert(streamId, kj::addRef(*s));
+    if (endStream) remoteEnd(*s);
+
+    tasks.add(handleRequest(kj::mv(s)));
+  }
+
+  kj::Promise<void> handleRequest(kj::Own<ServerStream> ownStream) {
+    auto& s = *ownStream;
+    auto body = kj::heap<Http2InputStream>(kj::addRef(s), false);
+
+    kj::Promise<void> promise = nullptr;
+    KJ_IF_MAYBE(method, s.method) {
+      promise = kj::evalNow([&]() {
+        return service.request(*method, s.url, s.headers, *body, s);
+      });
+    } else {
+      promise = sendError(s, 501, "Not Implemented", kj::str(
+          "ERROR: The server does not implement this method."));
+    }
+
+    return promise.then([this,&s]() -> kj::Promise<void> {
+      if (!s.responded) {
+        return sendError(s, 500, "Internal Server Error", kj::str(
+            "ERROR: The HttpService did not generate a response."));
+      }
+      return kj::READY_NOW;
+    }, [this,&s](kj::Exception&& e) -> kj::Promise<void> {
+      if (s.responded) {
+        // Already sent a partial response; all we can do is abort the stream.
+        if (e.getType() != kj::Exception::Type::DISCONNECTED) {
+          KJ_LOG(ERROR, "HttpService threw exception after generating a partial response",
+                        "too late to report error to client", e);
+        }
+        KJ_IF_MAYBE(session, s.session) {
+          session->resetStream(s, Http2Error::INTERNAL_ERROR);
+        }
+        return kj::READY_NOW;
+      }
+
+      if (e.getType() == kj::Exception::Type::OVERLOADED) {
+        return sendError(s, 503, "Service Unavailable", kj::str(
+            "ERROR: The server is temporarily unable to handle your request. Details:\n\n", e));
+      } else if (e.getType() == kj::Exception::Type::UNIMPLEMENTED) {
+        return sendError(s, 501, "Not Implemented", kj::str(
+            "ERROR: The server does not implement this operation. Details:\n\n", e));
+      } else if (e.getType() == kj::Exception::Type::DISCONNECTED) {
+        // As with HTTP/1.1, make it look like the connection dropped, which here means resetting
+        // just this stream.
+        KJ_IF_MAYBE(session, s.session) {
+          session->resetStream(s, Http2Error::CANCEL);
+        }
+        return kj::READY_NOW;
+      } else {
+        return sendError(s, 500, "Internal Server Error", kj::str(
+            "ERROR: The server threw an exception. Details:\n\n", e));
+      }
+    }).then([&s]() {
+      if (!s.remoteClosed && s.localClosed) {
+        // The response is complete but the request body isn't; tell the client to stop sending
+        // it (RFC 7540 section 8.1).
+        KJ_IF_MAYBE(session, s.session) {
+          session->resetStream(s, Http2Error::NO_ERROR);
+        }
+      }
+    }).attach(kj::mv(body), kj::mv(ownStream));
+  }
+
+  kj::Promise<void> sendError(ServerStream& s, uint statusCode, kj::StringPtr statusText,
+                              kj::String body) {
+    HttpHeaders headers(server.requestHeaderTable);
+    headers.set(HttpHeaderId::CONTENT_TYPE, "text/plain");
+    auto out = s.send(statusCode, statusText, headers, body.size());
+    auto promise = out->write(body.begin(), body.size());
+    return promise.attach(kj::mv(out), kj::mv(body));
+  }
+};
+
+kj::Promise<void> HttpServer::listenHttp2(kj::Own<kj::AsyncIoStream> connection) {
+  return serveHttp2(kj::mv(connection), false);
+}
+
+kj::Promise<void> HttpServer::serveHttp2(kj::Own<kj::AsyncIoStream> connection,
+                                         bool prefaceConsumed) {
+  kj::Own<Http2Connection> obj;
+
+  KJ_SWITCH_ONEOF(service) {
+    KJ_CASE_ONEOF(ptr, HttpService*) {
+      obj = heap<Http2Connection>(*this, *connection, *ptr);
+    }
+    KJ_CASE_ONEOF(func, HttpServiceFactory) {
+      auto srv = func(*connection);
+      obj = heap<Http2Connection>(*this, *connection, *srv);
+      obj = obj.attach(kj::mv(srv));
+    }
+  }
+
+  auto promise = obj->serve(prefaceConsumed);
+  return promise.attach(kj::mv(obj), kj::mv(connection)).eagerlyEvaluate(nullptr);
+}
+
+namespace {
+
+struct PrefaceSniffer {
+  // Reads just enough of a new connection to tell whether it starts with the HTTP/2 preface.
+
+  explicit PrefaceSniffer(kj::AsyncIoStream& stream): stream(stream) {}
+
+  kj::AsyncIoStream& stream;
+  byte buffer[sizeof(CONNECTION_PREFACE)];
+  size_t size = 0;
+
+  kj::Promise<bool> sniff() {
+    // Resolves to true if the full preface was read.
+    return stream.tryRead(buffer + size, 1, sizeof(buffer) - size)
+        .then([this](size_t amount) -> kj::Promise<bool> {
+      size += amount;
+      if (amount == 0 || memcmp(buffer, CONNECTION_PREFACE, size) != 0) return false;
+      if (size == sizeof(buffer)) return true;
+      return sniff();
+    });
+  }
+};
+
+}  // namespace
+
+kj::Promise<void> HttpServer::listenHttpOrHttp2(kj::Own<kj::AsyncIoStream> connection) {
+  auto sniffer = kj::heap<PrefaceSniffer>(*connection);
+  auto promise = sniffer->sniff();
+
+  // The sniff counts against the header timeout, like the first request would.
+  auto timeout = timer.afterDelay(settings.headerTimeout).then([]() -> bool {
+    kj::throwFatalException(KJ_EXCEPTION(DISCONNECTED, "timed out waiting for HTTP request"));
+  });
+
+  return promise.exclusiveJoin(kj::mv(timeout))
+      .then([this,connection=kj::mv(connection),sniffer=kj::mv(sniffer)](bool isHttp2) mutable
+            -> kj::Promise<void> {
+    if (isHttp2) {
+      return serveHttp2(kj::mv(connection), true);
+    }
+
+    auto wrapped = kj::heap<PrefixedAsyncIoStream>(kj::mv(connection),
+        kj::heapArray<byte>(sniffer->buffer, sniffer->size));
+    auto promise = listenHttpCleanDrain(*wrapped).ignoreResult();
+    return promise.attach(kj::mv(wrapped)).eagerlyEvaluate(nullptr);
+  }, [](kj::Exception&& e) {
+    if (e.getType() != kj::Exception::Type::DISCONNECTED) {
+      kj::throwFatalException(kj::mv(e));
+    }
+  });
+}
+
+}  // namespace kj
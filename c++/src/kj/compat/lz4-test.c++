@@ -0,0 +1,192 @@
+// Copyright (c) 2017 Cloudflare, Inc. and contributors
+// Licensed under the MIT License:
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+#if KJ_HAS_LZ4
+
+#include "lz4.h"
+#include <kj/test.h>
+#include <kj/debug.h>
+#include <stdlib.h>
+
+namespace kj {
+namespace {
+
+class MockInputStream: public AsyncInputStream {
+public:
+  MockInputStream(kj::ArrayPtr<const byte> bytes, size_t blockSize)
+      : bytes(bytes), blockSize(blockSize) {}
+
+  Promise<size_t> tryRead(void* buffer, size_t minBytes, size_t maxBytes) override {
+    size_t n = kj::min(bytes.size(), kj::max(minBytes, kj::min(blockSize, maxBytes)));
+    memcpy(buffer, bytes.begin(), n);
+    bytes = bytes.slice(n, bytes.size());
+    return n;
+  }
+
+private:
+  kj::ArrayPtr<const byte> bytes;
+  size_t blockSize;
+};
+
+class MockOutputStream: public AsyncOutputStream {
+public:
+  kj::Vector<byte> bytes;
+
+  Promise<void> write(const void* buffer, size_t size) override {
+    bytes.addAll(arrayPtr(reinterpret_cast<const byte*>(buffer), size));
+    return kj::READY_NOW;
+  }
+  Promise<void> write(ArrayPtr<const ArrayPtr<const byte>> pieces) override {
+    for (auto& piece: pieces) {
+      bytes.addAll(piece);
+    }
+    return kj::READY_NOW;
+  }
+};
+
+KJ_TEST("lz4 round trip") {
+  auto io = setupAsyncIo();
+
+  auto bytes = heapArray<byte>(300 * 1024);
+  for (auto& b: bytes) {
+    b = "abcdefgh"[rand() % 8];
+  }
+
+  Lz4Codec codec;
+  for (uint i = 0; i < 2; i++) {
+    MockOutputStream rawOutput;
+    Lz4AsyncOutputStream out(rawOutput, codec);
+    out.write(bytes.begin(), bytes.size()).wait(io.waitScope);
+    out.end().wait(io.waitScope);
+
+    KJ_EXPECT(rawOutput.bytes.size() < bytes.size());
+
+    // Feed the decompressor in awkward small blocks.
+    MockInputStream rawInput(rawOutput.bytes, 97);
+    Lz4AsyncInputStream in(rawInput, codec);
+    auto decompressed = in.readAllBytes().wait(io.waitScope);
+    KJ_ASSERT(decompressed == bytes);
+  }
+}
+
+KJ_TEST("lz4 flush and truncation") {
+  auto io = setupAsyncIo();
+
+  Lz4Codec codec;
+  MockOutputStream rawOutput;
+  Lz4AsyncOutputStream out(rawOutput, codec);
+  out.write("foobar", 6).wait(io.waitScope);
+  out.flush().wait(io.waitScope);
+
+  // Everything written before the flush can be read back, but EOF here is premature.
+  {
+    MockInputStream rawInput(rawOutput.bytes, kj::maxValue);
+    Lz4AsyncInputStream in(rawInput, codec);
+    char text[6];
+    KJ_EXPECT(in.tryRead(text, sizeof(text), sizeof(text)).wait(io.waitScope) == 6);
+    KJ_EXPECT(heapString(text, 6) == "foobar");
+    KJ_EXPECT_THROW_MESSAGE("lz4 compressed stream ended prematurely",
+        in.tryRead(text, 1, 1).wait(io.waitScope));
+  }
+
+  out.end().wait(io.waitScope);
+  MockInputStream rawInput(rawOutput.bytes, kj::maxValue);
+  Lz4AsyncInputStream in(rawInput, codec);
+  KJ_EXPECT(in.readAllText().wait(io.waitScope) == "foobar");
+}
+
+KJ_TEST("lz4 frames interoperate with liblz4's one-shot API") {
+  auto io = setupAsyncIo();
+
+  auto bytes = heapArray<byte>(100 * 1024);
+  for (auto& b: bytes) {
+    b = "abcdefgh"[rand() % 8];
+  }
+
+  Lz4Codec codec;
+
+  {
+    // Our streamed output, including a flush mid-frame, decodes with a plain LZ4F context.
+    MockOutputStream rawOutput;
+    Lz4AsyncOutputStream out(rawOutput, codec);
+    out.write(bytes.begin(), 1000).wait(io.waitScope);
+    out.flush().wait(io.waitScope);
+    out.write(bytes.begin() + 1000, bytes.size() - 1000).wait(io.waitScope);
+    out.end().wait(io.waitScope);
+
+    LZ4F_dctx* ctx;
+    KJ_ASSERT(!LZ4F_isError(LZ4F_createDecompressionContext(&ctx, LZ4F_VERSION)));
+    KJ_DEFER(LZ4F_freeDecompressionContext(ctx));
+
+    auto decompressed = heapArray<byte>(bytes.size() + 1);
+    size_t inPos = 0;
+    size_t outPos = 0;
+    size_t hint = 1;
+    while (hint != 0 && inPos < rawOutput.bytes.size()) {
+      size_t inSize = rawOutput.bytes.size() - inPos;
+      size_t outSize = decompressed.size() - outPos;
+      hint = LZ4F_decompress(ctx, decompressed.begin() + outPos, &outSize,
+                             rawOutput.bytes.begin() + inPos, &inSize, nullptr);
+      KJ_ASSERT(!LZ4F_isError(hint), LZ4F_getErrorName(hint));
+      inPos += inSize;
+      outPos += outSize;
+    }
+    KJ_EXPECT(hint == 0);
+    KJ_EXPECT(inPos == rawOutput.bytes.size());
+    KJ_EXPECT(decompressed.slice(0, outPos) == bytes);
+  }
+
+  // Two frames from the one-shot API, back to back, read as one stream.
+  kj::Vector<byte> frames;
+  for (auto part: { bytes.slice(0, 5000), bytes.slice(5000, bytes.size()) }) {
+    auto frame = heapArray<byte>(LZ4F_compressFrameBound(part.size(), nullptr));
+    size_t n = LZ4F_compressFrame(frame.begin(), frame.size(), part.begin(), part.size(), nullptr);
+    KJ_ASSERT(!LZ4F_isError(n), LZ4F_getErrorName(n));
+    frames.addAll(frame.slice(0, n));
+  }
+  {
+    MockInputStream rawInput(frames, 61);
+    Lz4AsyncInputStream in(rawInput, codec);
+    KJ_EXPECT(in.readAllBytes().wait(io.waitScope) == bytes);
+  }
+
+  // Cut off partway through the second frame.
+  {
+    MockInputStream rawInput(frames.asPtr().slice(0, frames.size() - 10), kj::maxValue);
+    Lz4AsyncInputStream in(rawInput, codec);
+    KJ_EXPECT_THROW_MESSAGE("lz4 compressed stream ended prematurely",
+        in.readAllBytes().wait(io.waitScope));
+  }
+
+  // Not LZ4 at all.
+  {
+    auto garbage = heapArray<byte>(64);
+    for (auto i: kj::indices(garbage)) garbage[i] = i;
+    MockInputStream rawInput(garbage, kj::maxValue);
+    Lz4AsyncInputStream in(rawInput, codec);
+    KJ_EXPECT_THROW_MESSAGE("lz4 decompression failed", in.readAllBytes().wait(io.waitScope));
+  }
+}
+
+}  // namespace
+}  // namespace kj
+
+#endif  // KJ_HAS_LZ4
@@ -0,0 +1,208 @@
+// Copyright (c) 2017 Cloudflare, Inc. and contributors
+// Licensed under the MIT License:
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+#if KJ_HAS_LZ4
+
+#include "lz4.h"
+#include <kj/debug.h>
+#include <string.h>
+
+namespace kj {
+
+namespace {
+
+constexpr size_t LZ4_BLOCK_SIZE = 64 * 1024;
+// Input is fed to LZ4F_compressUpdate() at most this much at a time, matching the frame's block
+// size.
+
+LZ4F_preferences_t lz4Preferences(int compressionLevel) {
+  LZ4F_preferences_t prefs;
+  memset(&prefs, 0, sizeof(prefs));
+  prefs.frameInfo.blockSizeID = LZ4F_max64KB;
+  prefs.compressionLevel = compressionLevel;
+  return prefs;
+}
+
+class Lz4Compressor final: public Compressor {
+  // LZ4F's streaming API, unlike zlib's and zstd's, needs room in the output buffer for the worst
+  // case of each call, so we compress into a staging buffer and copy out from there.
+
+public:
+  Lz4Compressor(LZ4F_cctx* ctx, Vector<LZ4F_cctx*>& pool, uint maxIdle, int compressionLevel)
+      : ctx(ctx), pool(pool), maxIdle(maxIdle), prefs(lz4Preferences(compressionLevel)),
+        staging(heapArray<byte>(LZ4F_compressBound(LZ4_BLOCK_SIZE, &prefs))) {}
+  KJ_DISALLOW_COPY(Lz4Compressor);
+
+  ~Lz4Compressor() noexcept(false) {
+    // LZ4F_compressBegin() resets the context, so it can be reused as-is.
+    if (pool.size() < maxIdle) {
+      pool.add(ctx);
+    } else {
+      LZ4F_freeCompressionContext(ctx);
+    }
+  }
+
+  bool compress(ArrayPtr<const byte>& input, ArrayPtr<byte>& output, Flush flush) override {
+    for (;;) {
+      if (staged.size() > 0) {
+        size_t n = kj::min(staged.size(), output.size());
+        memcpy(output.begin(), staged.begin(), n);
+        staged = staged.slice(n, staged.size());
+        output = output.slice(n, output.size());
+        if (staged.size() > 0) return false;
+      }
+
+      if (!begun) {
+        stage(LZ4F_compressBegin(ctx, staging.begin(), staging.size(), &prefs));
+        begun = true;
+      } else if (input.size() > 0) {
+        size_t n = kj::min(input.size(), LZ4_BLOCK_SIZE);
+        stage(LZ4F_compressUpdate(ctx, staging.begin(), staging.size(),
+                                  input.begin(), n, nullptr));
+        input = input.slice(n, input.size());
+      } else if (flush == Flush::NONE) {
+        return true;
+      } else if (!flushIssued) {
+        stage(flush == Flush::SYNC
+            ? LZ4F_flush(ctx, staging.begin(), staging.size(), nullptr)
+            : LZ4F_compressEnd(ctx, staging.begin(), staging.size(), nullptr));
+        flushIssued = true;
+      } else {
+        // Flush complete and copied out.
+        flushIssued = false;
+        return true;
+      }
+    }
+  }
+
+private:
+  LZ4F_cctx* ctx;
+  Vector<LZ4F_cctx*>& pool;
+  uint maxIdle;
+  LZ4F_preferences_t prefs;
+
+  Array<byte> staging;
+  ArrayPtr<const byte> staged;
+  // Compressed bytes in `staging` not yet copied to the caller.
+
+  bool begun = false;
+  bool flushIssued = false;
+
+  void stage(size_t result) {
+    if (LZ4F_isError(result)) {
+      KJ_FAIL_REQUIRE("lz4 compression failed", LZ4F_getErrorName(result));
+    }
+    staged = staging.slice(0, result);
+  }
+};
+
+class Lz4Decompressor final: public Decompressor {
+public:
+  Lz4Decompressor(LZ4F_dctx* ctx, Vector<LZ4F_dctx*>& pool, uint maxIdle)
+      : ctx(ctx), pool(pool), maxIdle(maxIdle) {}
+  KJ_DISALLOW_COPY(Lz4Decompressor);
+
+  ~Lz4Decompressor() noexcept(false) {
+    if (pool.size() < maxIdle) {
+      LZ4F_resetDecompressionContext(ctx);
+      pool.add(ctx);
+    } else {
+      LZ4F_freeDecompressionContext(ctx);
+    }
+  }
+
+  bool decompress(ArrayPtr<const byte>& input, ArrayPtr<byte>& output) override {
+    while (output.size() > 0) {
+      size_t inSize = input.size();
+      size_t outSize = output.size();
+
+      size_t hint = LZ4F_decompress(ctx, output.begin(), &outSize, input.begin(), &inSize, nullptr);
+
+      input = input.slice(inSize, input.size());
+      output = output.slice(outSize, output.size());
+
+      if (LZ4F_isError(hint)) {
+        KJ_FAIL_REQUIRE("lz4 decompression failed", LZ4F_getErrorName(hint));
+      }
+
+      if (inSize == 0 && outSize == 0) break;
+
+      // Zero means a frame was completely decoded; any further input starts another.
+      atFrameEnd = hint == 0;
+      if (input.size() == 0) break;
+    }
+    return atFrameEnd;
+  }
+
+private:
+  LZ4F_dctx* ctx;
+  Vector<LZ4F_dctx*>& pool;
+  uint maxIdle;
+  bool atFrameEnd = false;
+};
+
+}  // namespace
+
+Lz4Codec::Lz4Codec(int compressionLevel, uint maxIdleContexts)
+    : compressionLevel(compressionLevel), maxIdleContexts(maxIdleContexts) {}
+
+Lz4Codec::~Lz4Codec() noexcept(false) {
+  for (auto ctx: idleCompressors) LZ4F_freeCompressionContext(ctx);
+  for (auto ctx: idleDecompressors) LZ4F_freeDecompressionContext(ctx);
+}
+
+StringPtr Lz4Codec::getName() const {
+  return "lz4";
+}
+
+Own<Compressor> Lz4Codec::newCompressor() {
+  LZ4F_cctx* ctx;
+  if (idleCompressors.empty()) {
+    auto result = LZ4F_createCompressionContext(&ctx, LZ4F_VERSION);
+    KJ_ASSERT(!LZ4F_isError(result), LZ4F_getErrorName(result));
+  } else {
+    ctx = idleCompressors.back();
+    idleCompressors.removeLast();
+  }
+  return kj::heap<Lz4Compressor>(ctx, idleCompressors, maxIdleContexts, compressionLevel);
+}
+
+Own<Decompressor> Lz4Codec::newDecompressor() {
+  LZ4F_dctx* ctx;
+  if (idleDecompressors.empty()) {
+    auto result = LZ4F_createDecompressionContext(&ctx, LZ4F_VERSION);
+    KJ_ASSERT(!LZ4F_isError(result), LZ4F_getErrorName(result));
+  } else {
+    ctx = idleDecompressors.back();
+    idleDecompressors.removeLast();
+  }
+  return kj::heap<Lz4Decompressor>(ctx, idleDecompressors, maxIdleContexts);
+}
+
+Lz4AsyncInputStream::Lz4AsyncInputStream(AsyncInputStream& inner, Lz4Codec& codec)
+    : DecompressingAsyncInputStream(inner, codec.newDecompressor(), "lz4") {}
+
+Lz4AsyncOutputStream::Lz4AsyncOutputStream(AsyncOutputStream& inner, Lz4Codec& codec)
+    : CompressingAsyncOutputStream(inner, codec.newCompressor()) {}
+
+}  // namespace kj
+
+#endif  // KJ_HAS_LZ4
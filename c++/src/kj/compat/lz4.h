@@ -0,0 +1,65 @@
+// Copyright (c) 2017 Cloudflare, Inc. and contributors
+// Licensed under the MIT License:
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+#pragma once
+
+#include "compression.h"
+#include <kj/vector.h>
+#include <lz4frame.h>
+
+namespace kj {
+
+class Lz4Codec final: public CompressionCodec {
+  // The LZ4 frame format, via liblz4.  Compresses less than zstd or gzip but is the fastest of the
+  // three in both directions, which suits links where CPU, not bandwidth, is the bottleneck.
+  //
+  // "lz4" isn't a registered HTTP content coding, so only use this codec with HTTP peers known to
+  // support it.  Like GzipCodec, keeps idle contexts for reuse.  Not thread-safe.
+
+public:
+  explicit Lz4Codec(int compressionLevel = 0, uint maxIdleContexts = 8);
+  // `compressionLevel` as for LZ4F_preferences_t: 0 is the fast default, 3 and up select LZ4HC.
+
+  ~Lz4Codec() noexcept(false);
+  KJ_DISALLOW_COPY(Lz4Codec);
+
+  StringPtr getName() const override;
+  Own<Compressor> newCompressor() override;
+  Own<Decompressor> newDecompressor() override;
+
+private:
+  int compressionLevel;
+  uint maxIdleContexts;
+  Vector<LZ4F_cctx*> idleCompressors;
+  Vector<LZ4F_dctx*> idleDecompressors;
+};
+
+class Lz4AsyncInputStream final: public DecompressingAsyncInputStream {
+public:
+  Lz4AsyncInputStream(AsyncInputStream& inner, Lz4Codec& codec);
+};
+
+class Lz4AsyncOutputStream final: public CompressingAsyncOutputStream {
+public:
+  Lz4AsyncOutputStream(AsyncOutputStream& inner, Lz4Codec& codec);
+};
+
+}  // namespace kj
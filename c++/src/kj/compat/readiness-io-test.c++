@@ -41,6 +41,23 @@ KJ_TEST("readiness IO: write small") {
   KJ_ASSERT(kj::StringPtr(buf) == "foo");
 }
 
+KJ_TEST("readiness IO: flush") {
+  auto io = setupAsyncIo();
+  auto pipe = io.provider->newOneWayPipe();
+
+  ReadyOutputStreamWrapper out(*pipe.out);
+  out.whenFlushed().wait(io.waitScope);
+
+  KJ_ASSERT(KJ_ASSERT_NONNULL(out.write(kj::StringPtr("foo").asBytes())) == 3);
+  out.whenFlushed().wait(io.waitScope);
+
+  // Everything written so far is in the pipe, so this read needs no more help from `out`.
+  char buf[4];
+  KJ_ASSERT(pipe.in->read(buf, 3, 4).wait(io.waitScope) == 3);
+  buf[3] = '\0';
+  KJ_ASSERT(kj::StringPtr(buf) == "foo");
+}
+
 KJ_TEST("readiness IO: write many odd") {
   auto io = setupAsyncIo();
   auto pipe = io.provider->newOneWayPipe();
@@ -110,6 +110,11 @@ kj::Promise<void> ReadyOutputStreamWrapper::whenReady() {
   return pumpTask.addBranch();
 }
 
+kj::Promise<void> ReadyOutputStreamWrapper::whenFlushed() {
+  if (!isPumping) return kj::READY_NOW;
+  return pumpTask.addBranch();
+}
+
 kj::Promise<void> ReadyOutputStreamWrapper::pump() {
   uint oldFilled = filled;
   uint end = start + filled;
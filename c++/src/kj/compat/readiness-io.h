@@ -71,6 +71,10 @@ public:
   kj::Promise<void> whenReady();
   // Returns a promise that resolves when write() will return non-null.
 
+  kj::Promise<void> whenFlushed();
+  // Returns a promise that resolves once everything written so far has been passed to the
+  // underlying stream's write() and that write has completed.
+
 private:
   AsyncOutputStream& output;
   ArrayPtr<const byte> segments[2];
@@ -24,9 +24,34 @@
 #include "tls.h"
 #include <kj/test.h>
 #include <kj/async-io.h>
+#include <kj/io.h>
 #include <stdlib.h>
+#if !_WIN32
+#include <unistd.h>
+#endif
 #include <openssl/opensslv.h>
 
+#if __linux__ && OPENSSL_VERSION_NUMBER >= 0x10101000L && !defined(OPENSSL_IS_BORINGSSL) && \
+    defined(__has_include)
+#if __has_include(<linux/tls.h>)
+// Same conditions as in tls.c++.
+#define KJ_TLS_KERNEL_OFFLOAD 1
+#include <kj/thread.h>
+#include <linux/tls.h>
+#include <netinet/in.h>
+#include <openssl/evp.h>
+#include <openssl/pem.h>
+#include <openssl/ssl.h>
+#include <sys/socket.h>
+#ifndef TCP_ULP
+#define TCP_ULP 31
+#endif
+#ifndef SOL_TLS
+#define SOL_TLS 282
+#endif
+#endif
+#endif
+
 namespace kj {
 namespace {
 
@@ -472,6 +497,739 @@ KJ_TEST("TLS SNI") {
   KJ_ASSERT(callback.callCount == 1);
 }
 
+KJ_TEST("TLS ALPN") {
+  kj::StringPtr clientProtocols[] = { "http/1.1", "h2" };
+  kj::StringPtr serverProtocols[] = { "h2", "http/1.1" };
+  kj::StringPtr otherProtocols[] = { "spdy/3" };
+
+  auto negotiate = [](kj::ArrayPtr<const kj::StringPtr> clientProtos,
+                      kj::ArrayPtr<const kj::StringPtr> serverProtos) -> kj::String {
+    // Returns the negotiated protocol, or "(none)".
+    auto clientOpts = TlsTest::defaultClient();
+    clientOpts.alpnProtocols = clientProtos;
+    auto serverOpts = TlsTest::defaultServer();
+    serverOpts.alpnProtocols = serverProtos;
+    TlsTest test(kj::mv(clientOpts), kj::mv(serverOpts));
+    ErrorNexus e;
+
+    auto pipe = test.io.provider->newTwoWayPipe();
+
+    auto clientPromise = e.wrap(test.tlsClient.wrapClient(kj::mv(pipe.ends[0]), "example.com"));
+    auto serverPromise = e.wrap(test.tlsServer.wrapServer(kj::mv(pipe.ends[1])));
+
+    auto client = clientPromise.wait(test.io.waitScope);
+    auto server = serverPromise.wait(test.io.waitScope);
+
+    // Both ends agree.
+    kj::StringPtr clientResult = getTlsAlpnProtocol(*client).orDefault("(none)");
+    kj::StringPtr serverResult = getTlsAlpnProtocol(*server).orDefault("(none)");
+    KJ_EXPECT(clientResult == serverResult, clientResult, serverResult);
+    return kj::str(serverResult);
+  };
+
+  // The server's preference wins.
+  KJ_EXPECT(negotiate(clientProtocols, serverProtocols) == "h2");
+
+  // No overlap, or no ALPN on one side, means no protocol, but the handshake still succeeds.
+  KJ_EXPECT(negotiate(clientProtocols, otherProtocols) == "(none)");
+  KJ_EXPECT(negotiate(nullptr, serverProtocols) == "(none)");
+  KJ_EXPECT(negotiate(clientProtocols, nullptr) == "(none)");
+
+  // Not a TLS stream at all.
+  auto io = setupAsyncIo();
+  auto pipe = io.provider->newTwoWayPipe();
+  KJ_EXPECT(getTlsAlpnProtocol(*pipe.ends[0]) == nullptr);
+}
+
+bool connectAndCheckResumed(kj::AsyncIoContext& io, TlsContext& clientContext,
+                            TlsContext& serverContext) {
+  // Makes one connection, returning whether it resumed a session.
+
+  ErrorNexus e;
+
+  auto pipe = io.provider->newTwoWayPipe();
+
+  auto clientPromise = e.wrap(clientContext.wrapClient(kj::mv(pipe.ends[0]), "example.com"));
+  auto serverPromise = e.wrap(serverContext.wrapServer(kj::mv(pipe.ends[1])));
+
+  auto client = clientPromise.wait(io.waitScope);
+  auto server = serverPromise.wait(io.waitScope);
+
+  // With TLS 1.3, session tickets come after the handshake, so read something to receive them.
+  auto writePromise = server->write("x", 1);
+  char c;
+  client->read(&c, 1).wait(io.waitScope);
+  writePromise.wait(io.waitScope);
+
+  bool resumed = isTlsSessionResumed(*client);
+  KJ_EXPECT(isTlsSessionResumed(*server) == resumed);
+  return resumed;
+}
+
+KJ_TEST("TLS session resumption") {
+  auto io = setupAsyncIo();
+
+  auto check = [&](TlsContext::Options clientOpts, TlsContext::Options serverOpts) {
+    // Returns whether the second of two connections resumed the first's session.
+    TlsContext client(kj::mv(clientOpts));
+    TlsContext server(kj::mv(serverOpts));
+    KJ_EXPECT(!connectAndCheckResumed(io, client, server));
+    return connectAndCheckResumed(io, client, server);
+  };
+
+  // Tickets, by default.
+  KJ_EXPECT(check(TlsTest::defaultClient(), TlsTest::defaultServer()));
+
+  // The server's session cache, sharded or not.
+  {
+    auto serverOpts = TlsTest::defaultServer();
+    serverOpts.sessionTickets = false;
+    KJ_EXPECT(check(TlsTest::defaultClient(), serverOpts));
+    serverOpts.sessionCacheShards = 4;
+    KJ_EXPECT(check(TlsTest::defaultClient(), serverOpts));
+    serverOpts.sessionCacheSize = 0;
+    KJ_EXPECT(!check(TlsTest::defaultClient(), serverOpts));
+  }
+
+  // A client that doesn't remember sessions.
+  {
+    auto clientOpts = TlsTest::defaultClient();
+    clientOpts.clientSessionCacheSize = 0;
+    KJ_EXPECT(!check(clientOpts, TlsTest::defaultServer()));
+  }
+
+  // Not a TLS stream at all.
+  auto pipe = io.provider->newTwoWayPipe();
+  KJ_EXPECT(!isTlsSessionResumed(*pipe.ends[0]));
+}
+
+KJ_TEST("TLS session ticket keys") {
+  auto io = setupAsyncIo();
+
+  TlsSessionTicketKeys keys(2);
+  auto serverOpts = TlsTest::defaultServer();
+  serverOpts.sessionCacheSize = 0;
+  serverOpts.sessionTicketKeys = keys;
+
+  TlsContext client(TlsTest::defaultClient());
+  TlsContext server1(serverOpts);
+  TlsContext server2(serverOpts);
+
+  // Servers sharing keys resume each other's tickets.
+  KJ_EXPECT(!connectAndCheckResumed(io, client, server1));
+  KJ_EXPECT(connectAndCheckResumed(io, client, server2));
+
+  // A ticket made with the previous key still works...
+  keys.rotate(TlsSessionTicketKeys::generateKey());
+  KJ_EXPECT(connectAndCheckResumed(io, client, server1));
+
+  // ...and was replaced by one made with the new key, which survives another rotation.
+  keys.rotate(TlsSessionTicketKeys::generateKey());
+  KJ_EXPECT(connectAndCheckResumed(io, client, server2));
+
+  // Once its key is gone, the ticket is useless.
+  auto newKey = TlsSessionTicketKeys::generateKey();
+  kj::ArrayPtr<const byte> newKeys[] = { newKey };
+  keys.setKeys(newKeys);
+  KJ_EXPECT(!connectAndCheckResumed(io, client, server1));
+  KJ_EXPECT(connectAndCheckResumed(io, client, server2));
+
+  KJ_EXPECT_THROW_MESSAGE("80 bytes", keys.rotate(newKey.slice(0, 48)));
+}
+
+KJ_TEST("TLS session tickets don't bypass client verification") {
+  auto io = setupAsyncIo();
+
+  TlsSessionTicketKeys keys(1);
+  auto lenientOpts = TlsTest::defaultServer();
+  lenientOpts.sessionCacheSize = 0;
+  lenientOpts.sessionTicketKeys = keys;
+  auto strictOpts = lenientOpts;
+  strictOpts.verifyClients = true;
+  strictOpts.trustedCertificates = TlsTest::defaultClient().trustedCertificates;
+
+  auto clientOpts = TlsTest::defaultClient();
+  clientOpts.defaultKeypair = lenientOpts.defaultKeypair;
+  TlsContext client(clientOpts);
+  TlsContext lenient(lenientOpts);
+  TlsContext strict1(strictOpts);
+  TlsContext strict2(strictOpts);
+
+  // A ticket from a server that never saw a client certificate is no good to one that requires
+  // one, even though it can decrypt it.
+  KJ_EXPECT(!connectAndCheckResumed(io, client, lenient));
+  KJ_EXPECT(!connectAndCheckResumed(io, client, strict1));
+
+  // Servers configured alike still share tickets.
+  KJ_EXPECT(connectAndCheckResumed(io, client, strict2));
+}
+
+#if !_WIN32
+KJ_TEST("TLS kernel offload") {
+  // Whether the kernel takes over depends on it having the "tls" module, so this mostly checks
+  // that the connection works the same either way.
+
+  auto clientOpts = TlsTest::defaultClient();
+  clientOpts.kernelOffload = true;
+  auto serverOpts = TlsTest::defaultServer();
+  serverOpts.kernelOffload = true;
+  TlsTest test(kj::mv(clientOpts), kj::mv(serverOpts));
+  auto& ws = test.io.waitScope;
+
+  auto connect = [&](kj::Own<kj::AsyncIoStream> clientEnd, kj::Own<kj::AsyncIoStream> serverEnd) {
+    ErrorNexus e;
+    auto clientPromise = e.wrap(test.tlsClient.wrapClient(kj::mv(clientEnd), "example.com"));
+    auto serverPromise = e.wrap(test.tlsServer.wrapServer(kj::mv(serverEnd)));
+    auto client = clientPromise.wait(ws);
+    return kj::tuple(kj::mv(client), serverPromise.wait(ws));
+  };
+
+  // Only TCP sockets can be offloaded.
+  {
+    auto pipe = test.io.provider->newTwoWayPipe();
+    auto conn = connect(kj::mv(pipe.ends[0]), kj::mv(pipe.ends[1]));
+    KJ_EXPECT(!isTlsKernelOffloaded(*kj::get<0>(conn)));
+    KJ_EXPECT(!isTlsKernelOffloaded(*kj::get<1>(conn)));
+  }
+
+  auto& network = test.io.provider->getNetwork();
+  auto listener = network.parseAddress("127.0.0.1").wait(ws)->listen();
+  auto acceptPromise = listener->accept();
+  auto clientEnd = network.parseAddress("127.0.0.1", listener->getPort()).wait(ws)
+      ->connect().wait(ws);
+  auto conn = connect(kj::mv(clientEnd), acceptPromise.wait(ws));
+  auto& client = kj::get<0>(conn);
+  auto& server = kj::get<1>(conn);
+  KJ_EXPECT(isTlsKernelOffloaded(*client) == isTlsKernelOffloaded(*server));
+
+  char buf[8];
+  auto writePromise = server->write("hello", 5);
+  KJ_EXPECT(client->read(buf, 5, sizeof(buf)).wait(ws) == 5);
+  writePromise.wait(ws);
+  KJ_EXPECT(kj::heapString(buf, 5) == "hello");
+
+  writePromise = client->write("world", 5);
+  KJ_EXPECT(server->read(buf, 5, sizeof(buf)).wait(ws) == 5);
+  writePromise.wait(ws);
+  KJ_EXPECT(kj::heapString(buf, 5) == "world");
+
+  // When offloaded, pumping a file into the connection uses sendfile().
+  constexpr size_t SIZE = 256 * 1024;
+  auto data = kj::heapArray<byte>(SIZE);
+  for (size_t i = 0; i < SIZE; i++) {
+    data[i] = i * 31 + i / 4096;
+  }
+
+  char path[] = "/tmp/kj-tls-test.XXXXXX";
+  int fd;
+  KJ_SYSCALL(fd = mkstemp(path));
+  KJ_DEFER(unlink(path));
+  kj::FdOutputStream(fd).write(data.begin(), data.size());
+  KJ_SYSCALL(lseek(fd, 0, SEEK_SET));
+  auto file = test.io.lowLevelProvider->wrapInputFd(fd, LowLevelAsyncIoProvider::TAKE_OWNERSHIP);
+
+  auto received = kj::heapArray<byte>(SIZE);
+  auto readPromise = client->read(received.begin(), SIZE);
+  KJ_EXPECT(file->pumpTo(*server).wait(ws) == SIZE);
+  readPromise.wait(ws);
+  KJ_EXPECT(received == data);
+
+  // The peer sees a clean close_notify, not a truncated stream.
+  server->shutdownWrite();
+  KJ_EXPECT(client->tryRead(buf, 1, sizeof(buf)).wait(ws) == 0);
+}
+#endif
+
+#if KJ_TLS_KERNEL_OFFLOAD
+class FakeKernelTlsStream final: public kj::AsyncIoStream {
+  // Stands in for the kernel's "tls" module: takes the keys that TlsConnection passes to
+  // setsockopt(SOL_TLS, TLS_TX) and from then on encrypts writes with them in userspace, framing
+  // records the way the kernel does. If the key, IV, or starting sequence number is wrong, the
+  // peer fails to decrypt.
+  //
+  // Records that TlsConnection sends with sendmsg() (alerts and handshake messages) arrive on a
+  // socket of our own, which getFd() returns. They're encrypted before the next key change, and
+  // sent ahead of the next write.
+
+public:
+  explicit FakeKernelTlsStream(kj::Own<kj::AsyncIoStream> inner): inner(kj::mv(inner)) {
+    int fds[2];
+    KJ_SYSCALL(socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC, 0, fds));
+    recordsIn = kj::AutoCloseFd(fds[0]);
+    recordsOut = kj::AutoCloseFd(fds[1]);
+  }
+
+  bool hasKeys() { return cipher != nullptr; }
+  uint getKeyCount() { return keyCount; }
+
+  kj::Promise<void> forwardSentRecords() {
+    // Waits for TlsConnection to send records with sendmsg(), then passes them on without waiting
+    // for the next write.
+    return kj::evalLater([this]() -> kj::Promise<void> {
+      encryptSentRecords();
+      if (pending.size() == 0) return forwardSentRecords();
+      auto array = pending.releaseAsArray();
+      auto promise = inner->write(array.begin(), array.size());
+      return promise.attach(kj::mv(array));
+    });
+  }
+
+  kj::Promise<size_t> tryRead(void* buffer, size_t minBytes, size_t maxBytes) override {
+    return inner->tryRead(buffer, minBytes, maxBytes);
+  }
+  kj::Promise<void> write(const void* buffer, size_t size) override {
+    if (cipher == nullptr) return inner->write(buffer, size);
+
+    encryptSentRecords();
+    auto records = kj::mv(pending);
+    auto data = kj::arrayPtr(reinterpret_cast<const byte*>(buffer), size);
+    while (data.size() > 0) {
+      auto chunk = data.slice(0, kj::min(data.size(), size_t(16384)));
+      encryptRecord(SSL3_RT_APPLICATION_DATA, chunk, records);
+      data = data.slice(chunk.size(), data.size());
+    }
+    auto array = records.releaseAsArray();
+    auto promise = inner->write(array.begin(), array.size());
+    return promise.attach(kj::mv(array));
+  }
+  kj::Promise<void> write(kj::ArrayPtr<const kj::ArrayPtr<const byte>> pieces) override {
+    kj::Vector<byte> flat;
+    for (auto piece: pieces) flat.addAll(piece);
+    auto array = flat.releaseAsArray();
+    auto promise = write(array.begin(), array.size());
+    return promise.attach(kj::mv(array));
+  }
+  void shutdownWrite() override { inner->shutdownWrite(); }
+  kj::Maybe<int> getFd() const override { return recordsOut.get(); }
+
+  void setsockopt(int level, int option, const void* value, uint length) override {
+    if (level == IPPROTO_TCP && option == TCP_ULP) return;
+    KJ_ASSERT(level == SOL_TLS && option == TLS_TX);
+
+    // Whatever was sent before the key change is encrypted under the old keys.
+    if (cipher != nullptr) encryptSentRecords();
+    ++keyCount;
+
+    auto& info = *reinterpret_cast<const tls_crypto_info*>(value);
+    version = info.version;
+    switch (info.cipher_type) {
+      case TLS_CIPHER_AES_GCM_128:
+        setKeys<tls12_crypto_info_aes_gcm_128>(EVP_aes_128_gcm(), value, length);
+        break;
+      case TLS_CIPHER_AES_GCM_256:
+        setKeys<tls12_crypto_info_aes_gcm_256>(EVP_aes_256_gcm(), value, length);
+        break;
+#ifdef TLS_CIPHER_CHACHA20_POLY1305
+      case TLS_CIPHER_CHACHA20_POLY1305:
+        setKeys<tls12_crypto_info_chacha20_poly1305>(EVP_chacha20_poly1305(), value, length);
+        break;
+#endif
+      default:
+        KJ_FAIL_ASSERT("unexpected cipher", info.cipher_type);
+    }
+  }
+
+private:
+  kj::Own<kj::AsyncIoStream> inner;
+  kj::AutoCloseFd recordsIn;
+  kj::AutoCloseFd recordsOut;
+  kj::Vector<byte> pending;
+  uint keyCount = 0;
+  const EVP_CIPHER* cipher = nullptr;
+  uint16_t version = 0;
+  kj::Array<byte> key;
+  kj::Array<byte> salt;
+  kj::Array<byte> iv;
+  uint64_t sequence = 0;
+
+  template <typename Info>
+  void setKeys(const EVP_CIPHER* evpCipher, const void* value, uint length) {
+    KJ_ASSERT(length == sizeof(Info));
+    auto& info = *reinterpret_cast<const Info*>(value);
+    cipher = evpCipher;
+    key = kj::heapArray<byte>(info.key, sizeof(info.key));
+    salt = kj::heapArray<byte>(info.salt, sizeof(info.salt));
+    iv = kj::heapArray<byte>(info.iv, sizeof(info.iv));
+    sequence = 0;
+    for (byte b: info.rec_seq) sequence = (sequence << 8) | b;
+  }
+
+  void encryptSentRecords() {
+    // The real kernel learns each record's type from a control message, which a Unix socket
+    // drops. Alerts are the only two-byte messages, though.
+    byte buffer[1024];
+    for (;;) {
+      ssize_t n;
+      KJ_NONBLOCKING_SYSCALL(n = recv(recordsIn, buffer, sizeof(buffer), 0));
+      if (n < 0) break;
+      encryptRecord(n == 2 ? SSL3_RT_ALERT : SSL3_RT_HANDSHAKE, kj::arrayPtr(buffer, n), pending);
+    }
+  }
+
+  void encryptRecord(byte type, kj::ArrayPtr<const byte> data, kj::Vector<byte>& out) {
+    bool isTls13 = version == TLS_1_3_VERSION;
+    // Only TLS 1.2 AES-GCM sends part of the nonce in each record; the kernel uses its IV as a
+    // counter for that part. Otherwise the nonce is the IV XORed with the sequence number.
+    bool explicitNonce = !isTls13 && salt.size() > 0;
+
+    byte sequenceBytes[8];
+    for (uint i = 0; i < 8; i++) sequenceBytes[i] = sequence >> (8 * (7 - i));
+
+    byte nonce[12];
+    KJ_ASSERT(salt.size() + iv.size() == sizeof(nonce));
+    memcpy(nonce, salt.begin(), salt.size());
+    memcpy(nonce + salt.size(), iv.begin(), iv.size());
+    if (!explicitNonce) {
+      for (uint i = 0; i < 8; i++) nonce[4 + i] ^= sequenceBytes[i];
+    }
+
+    kj::Vector<byte> plaintext;
+    plaintext.addAll(data);
+    if (isTls13) plaintext.add(type);  // the real content type
+
+    size_t recordSize = (explicitNonce ? 8 : 0) + plaintext.size() + 16;
+    byte header[5] = {
+      isTls13 ? byte(SSL3_RT_APPLICATION_DATA) : type, 3, 3, byte(recordSize >> 8), byte(recordSize)
+    };
+    kj::Vector<byte> aad;
+    if (isTls13) {
+      aad.addAll(kj::arrayPtr(header, 5));
+    } else {
+      aad.addAll(kj::arrayPtr(sequenceBytes, 8));
+      aad.addAll(kj::arrayPtr(header, 3));
+      aad.add(data.size() >> 8);
+      aad.add(data.size());
+    }
+
+    out.addAll(kj::arrayPtr(header, 5));
+    if (explicitNonce) out.addAll(kj::arrayPtr(nonce + 4, 8));
+    size_t offset = out.size();
+    out.resize(offset + plaintext.size() + 16);
+
+    EVP_CIPHER_CTX* ctx = EVP_CIPHER_CTX_new();
+    KJ_DEFER(EVP_CIPHER_CTX_free(ctx));
+    int n;
+    KJ_ASSERT(EVP_EncryptInit_ex(ctx, cipher, nullptr, key.begin(), nonce));
+    KJ_ASSERT(EVP_EncryptUpdate(ctx, nullptr, &n, aad.begin(), aad.size()));
+    KJ_ASSERT(EVP_EncryptUpdate(ctx, out.begin() + offset, &n,
+                                plaintext.begin(), plaintext.size()));
+    KJ_ASSERT(EVP_EncryptFinal_ex(ctx, out.begin() + offset + n, &n));
+    KJ_ASSERT(EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_AEAD_GET_TAG, 16,
+                                  out.begin() + offset + plaintext.size()));
+
+    ++sequence;
+    if (explicitNonce) {
+      for (size_t i = iv.size(); i > 0 && ++iv[i - 1] == 0; i--) {}
+    }
+  }
+};
+
+struct OpenSslEchoPeer {
+  // Plain OpenSSL, limited to one protocol version and cipher, on a blocking socket: reads `size`
+  // bytes and sends them back, `rounds` times. On any failure (such as a record that doesn't
+  // decrypt) it just shuts down the socket, so the other side sees the stream end early.
+
+  int version;
+  kj::StringPtr cipher;
+  size_t size;
+  uint rounds = 1;
+
+  bool requestKeyUpdate = false;
+  // Whether to send a TLS 1.3 KeyUpdate asking the other side to update its keys too, right after
+  // the handshake.
+
+  uint keyUpdatesReceived = 0;
+  bool sawCloseNotify = false;
+  // Set by run(). Once done echoing, it waits for the other side to close, and replies to a
+  // close_notify with its own.
+
+  void run(int fd, bool isServer);
+};
+
+void OpenSslEchoPeer::run(int fd, bool isServer) {
+  KJ_DEFER(shutdown(fd, SHUT_RDWR));
+
+  SSL_CTX* ctx = SSL_CTX_new(TLS_method());
+  KJ_DEFER(SSL_CTX_free(ctx));
+  SSL_CTX_set_min_proto_version(ctx, version);
+  SSL_CTX_set_max_proto_version(ctx, version);
+  if (version == TLS1_3_VERSION) {
+    if (!SSL_CTX_set_ciphersuites(ctx, cipher.cStr())) return;
+  } else {
+    if (!SSL_CTX_set_cipher_list(ctx, cipher.cStr())) return;
+  }
+
+  if (isServer) {
+    auto readPem = [](const char* pem, auto read) {
+      BIO* bio = BIO_new_mem_buf(pem, -1);
+      KJ_DEFER(BIO_free(bio));
+      return read(bio, nullptr, nullptr, nullptr);
+    };
+    EVP_PKEY* key = readPem(HOST_KEY, PEM_read_bio_PrivateKey);
+    KJ_DEFER(EVP_PKEY_free(key));
+    X509* cert = readPem(VALID_CERT, PEM_read_bio_X509);
+    KJ_DEFER(X509_free(cert));
+    if (!SSL_CTX_use_PrivateKey(ctx, key) || !SSL_CTX_use_certificate(ctx, cert)) return;
+    // Takes ownership.
+    if (!SSL_CTX_add_extra_chain_cert(ctx, readPem(INTERMEDIATE_CERT, PEM_read_bio_X509))) return;
+  }
+
+  SSL* ssl = SSL_new(ctx);
+  KJ_DEFER(SSL_free(ssl));
+  SSL_set_fd(ssl, fd);
+  SSL_set_msg_callback(ssl, [](int isWrite, int version, int contentType, const void* buf,
+                               size_t len, SSL* ssl, void* arg) {
+    if (!isWrite && contentType == SSL3_RT_HANDSHAKE && len > 0 &&
+        *reinterpret_cast<const byte*>(buf) == SSL3_MT_KEY_UPDATE) {
+      ++reinterpret_cast<OpenSslEchoPeer*>(arg)->keyUpdatesReceived;
+    }
+  });
+  SSL_set_msg_callback_arg(ssl, this);
+  if ((isServer ? SSL_accept(ssl) : SSL_connect(ssl)) != 1) return;
+
+  if (requestKeyUpdate) {
+    if (!SSL_key_update(ssl, SSL_KEY_UPDATE_REQUESTED) || SSL_do_handshake(ssl) != 1) return;
+  }
+
+  auto buffer = kj::heapArray<byte>(size);
+  for (uint i = 0; i < rounds; i++) {
+    for (size_t pos = 0; pos < size;) {
+      int n = SSL_read(ssl, buffer.begin() + pos, size - pos);
+      if (n <= 0) return;
+      pos += n;
+    }
+    for (size_t pos = 0; pos < size;) {
+      int n = SSL_write(ssl, buffer.begin() + pos, size - pos);
+      if (n <= 0) return;
+      pos += n;
+    }
+  }
+
+  byte extra;
+  int n = SSL_read(ssl, &extra, 1);
+  if (n <= 0 && SSL_get_error(ssl, n) == SSL_ERROR_ZERO_RETURN) {
+    sawCloseNotify = true;
+    SSL_shutdown(ssl);
+  }
+}
+
+KJ_TEST("TLS kernel offload keys") {
+  // Checks what we would hand the kernel -- the keys, the IVs, and the sequence number to start
+  // from -- for each cipher it supports, by encrypting with it in userspace and having a plain
+  // OpenSSL peer decrypt. As a TLS 1.3 server we send session tickets before any data, so the
+  // sequence number doesn't start at zero.
+
+  struct Case {
+    int version;
+    kj::StringPtr cipher;
+  };
+  Case cases[] = {
+    { TLS1_2_VERSION, "ECDHE-RSA-AES128-GCM-SHA256" },
+    { TLS1_2_VERSION, "ECDHE-RSA-AES256-GCM-SHA384" },
+#ifdef TLS_CIPHER_CHACHA20_POLY1305
+    { TLS1_2_VERSION, "ECDHE-RSA-CHACHA20-POLY1305" },
+#endif
+    { TLS1_3_VERSION, "TLS_AES_128_GCM_SHA256" },
+    { TLS1_3_VERSION, "TLS_AES_256_GCM_SHA384" },
+#ifdef TLS_CIPHER_CHACHA20_POLY1305
+    { TLS1_3_VERSION, "TLS_CHACHA20_POLY1305_SHA256" },
+#endif
+  };
+
+  // Big enough to take several records each way.
+  constexpr size_t SIZE = 40000;
+  auto data = kj::heapArray<byte>(SIZE);
+  for (size_t i = 0; i < SIZE; i++) {
+    data[i] = i * 7 + i / 256;
+  }
+
+  auto io = setupAsyncIo();
+  auto& ws = io.waitScope;
+
+  for (auto& c: cases) {
+    for (bool isServer: { false, true }) {
+      KJ_CONTEXT(c.cipher, isServer);
+
+      auto options = isServer ? TlsTest::defaultServer() : TlsTest::defaultClient();
+      options.kernelOffload = true;
+      TlsContext context(kj::mv(options));
+
+      int fds[2];
+      KJ_SYSCALL(socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fds));
+      kj::AutoCloseFd peerFd(fds[1]);
+      auto fake = kj::heap<FakeKernelTlsStream>(
+          io.lowLevelProvider->wrapSocketFd(fds[0], LowLevelAsyncIoProvider::TAKE_OWNERSHIP));
+      auto& kernel = *fake;
+
+      OpenSslEchoPeer echo { c.version, c.cipher, SIZE };
+      kj::Thread peer([&]() {
+        echo.run(peerFd, !isServer);
+      });
+
+      auto conn = (isServer ? context.wrapServer(kj::mv(fake))
+                            : context.wrapClient(kj::mv(fake), "example.com")).wait(ws);
+      KJ_EXPECT(isTlsKernelOffloaded(*conn));
+      KJ_EXPECT(kernel.hasKeys());
+
+      auto received = kj::heapArray<byte>(SIZE);
+      auto readPromise = conn->read(received.begin(), SIZE);
+      conn->write(data.begin(), SIZE).wait(ws);
+      readPromise.wait(ws);
+      KJ_EXPECT(received == data);
+    }
+  }
+}
+
+KJ_TEST("TLS kernel offload key update") {
+  // A TLS 1.3 peer may ask us to update our keys too. Our KeyUpdate has to go out through the
+  // kernel, which then needs the next keys, or the peer fails to decrypt what follows.
+
+  kj::StringPtr ciphers[] = {
+    "TLS_AES_128_GCM_SHA256",
+    "TLS_AES_256_GCM_SHA384",
+#ifdef TLS_CIPHER_CHACHA20_POLY1305
+    "TLS_CHACHA20_POLY1305_SHA256",
+#endif
+  };
+
+  constexpr size_t SIZE = 20000;
+  auto data = kj::heapArray<byte>(SIZE);
+  for (size_t i = 0; i < SIZE; i++) {
+    data[i] = i * 13 + i / 256;
+  }
+
+  auto io = setupAsyncIo();
+  auto& ws = io.waitScope;
+
+  for (auto cipher: ciphers) {
+    for (bool isServer: { false, true }) {
+      KJ_CONTEXT(cipher, isServer);
+
+      auto options = isServer ? TlsTest::defaultServer() : TlsTest::defaultClient();
+      options.kernelOffload = true;
+      TlsContext context(kj::mv(options));
+
+      int fds[2];
+      KJ_SYSCALL(socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fds));
+      kj::AutoCloseFd peerFd(fds[1]);
+      OpenSslEchoPeer echo { TLS1_3_VERSION, cipher, SIZE, 2 };
+      echo.requestKeyUpdate = true;
+
+      {
+        kj::Thread peer([&]() {
+          echo.run(peerFd, !isServer);
+        });
+
+        auto fake = kj::heap<FakeKernelTlsStream>(
+            io.lowLevelProvider->wrapSocketFd(fds[0], LowLevelAsyncIoProvider::TAKE_OWNERSHIP));
+        auto& kernel = *fake;
+        auto conn = (isServer ? context.wrapServer(kj::mv(fake))
+                              : context.wrapClient(kj::mv(fake), "example.com")).wait(ws);
+        KJ_EXPECT(isTlsKernelOffloaded(*conn));
+
+        // The peer's request arrives ahead of the first echo, so the second round is written
+        // under the new keys.
+        for (uint i = 0; i < 2; i++) {
+          auto received = kj::heapArray<byte>(SIZE);
+          auto readPromise = conn->read(received.begin(), SIZE);
+          conn->write(data.begin(), SIZE).wait(ws);
+          readPromise.wait(ws);
+          KJ_EXPECT(received == data);
+        }
+        KJ_EXPECT(kernel.getKeyCount() == 2);
+
+        // close_notify goes through the kernel too.
+        conn->shutdownWrite();
+        kernel.forwardSentRecords().wait(ws);
+        char c;
+        KJ_EXPECT(conn->tryRead(&c, 1, 1).wait(ws) == 0);
+      }
+
+      KJ_EXPECT(echo.keyUpdatesReceived == 1);
+      KJ_EXPECT(echo.sawCloseNotify);
+    }
+  }
+}
+
+void tcpSocketPair(int fds[2]) {
+  // Like socketpair(), but over loopback TCP, which the kernel can offload TLS for.
+
+  int fd;
+  KJ_SYSCALL(fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0));
+  kj::AutoCloseFd listener(fd);
+  struct sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  KJ_SYSCALL(bind(listener, reinterpret_cast<struct sockaddr*>(&addr), sizeof(addr)));
+  KJ_SYSCALL(listen(listener, 1));
+  socklen_t addrLen = sizeof(addr);
+  KJ_SYSCALL(getsockname(listener, reinterpret_cast<struct sockaddr*>(&addr), &addrLen));
+
+  KJ_SYSCALL(fds[0] = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0));
+  KJ_SYSCALL(connect(fds[0], reinterpret_cast<struct sockaddr*>(&addr), sizeof(addr)));
+  KJ_SYSCALL(fds[1] = accept4(listener, nullptr, nullptr, SOCK_CLOEXEC));
+}
+
+KJ_TEST("TLS kernel offload with a plain OpenSSL peer") {
+  // Uses the kernel's "tls" module if it has one: the peer asks for a key update partway, and we
+  // finish with close_notify, both of which the kernel has to send. Without the module, this
+  // covers the fallback only.
+
+  constexpr size_t SIZE = 100000;
+  auto data = kj::heapArray<byte>(SIZE);
+  for (size_t i = 0; i < SIZE; i++) {
+    data[i] = i * 5 + i / 1024;
+  }
+
+  auto io = setupAsyncIo();
+  auto& ws = io.waitScope;
+
+  for (bool isServer: { false, true }) {
+    KJ_CONTEXT(isServer);
+
+    auto options = isServer ? TlsTest::defaultServer() : TlsTest::defaultClient();
+    options.kernelOffload = true;
+    TlsContext context(kj::mv(options));
+
+    int fds[2];
+    tcpSocketPair(fds);
+    kj::AutoCloseFd peerFd(fds[1]);
+    OpenSslEchoPeer echo { TLS1_3_VERSION, "TLS_AES_128_GCM_SHA256", SIZE, 2 };
+    echo.requestKeyUpdate = true;
+
+    {
+      kj::Thread peer([&]() {
+        echo.run(peerFd, !isServer);
+      });
+
+      auto stream =
+          io.lowLevelProvider->wrapSocketFd(fds[0], LowLevelAsyncIoProvider::TAKE_OWNERSHIP);
+      auto conn = (isServer ? context.wrapServer(kj::mv(stream))
+                            : context.wrapClient(kj::mv(stream), "example.com")).wait(ws);
+      if (!isServer && !isTlsKernelOffloaded(*conn)) {
+        KJ_LOG(WARNING, "kernel can't offload TLS; only testing the fallback");
+      }
+
+      for (uint i = 0; i < 2; i++) {
+        auto received = kj::heapArray<byte>(SIZE);
+        auto readPromise = conn->read(received.begin(), SIZE);
+        conn->write(data.begin(), SIZE).wait(ws);
+        readPromise.wait(ws);
+        KJ_EXPECT(received == data);
+      }
+
+      conn->shutdownWrite();
+      char c;
+      KJ_EXPECT(conn->tryRead(&c, 1, 1).wait(ws) == 0);
+    }
+
+    KJ_EXPECT(echo.keyUpdatesReceived == 1);
+    KJ_EXPECT(echo.sawCloseNotify);
+  }
+}
+#endif
+
 void expectInvalidCert(kj::StringPtr hostname, TlsCertificate cert, kj::StringPtr message) {
   TlsKeypair keypair = { TlsPrivateKey(HOST_KEY), kj::mv(cert) };
   TlsContext::Options serverOpts;
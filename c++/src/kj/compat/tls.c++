@@ -32,8 +32,36 @@
 #include <openssl/conf.h>
 #include <openssl/ssl.h>
 #include <openssl/tls1.h>
+#include <openssl/rand.h>
+#include <openssl/hmac.h>
+#include <openssl/sha.h>
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+#include <openssl/core_names.h>
+#endif
 #include <kj/debug.h>
 #include <kj/vector.h>
+#include <kj/map.h>
+#include <kj/encoding.h>
+
+#if __linux__ && OPENSSL_VERSION_NUMBER >= 0x10101000L && !defined(OPENSSL_IS_BORINGSSL) && \
+    defined(__has_include)
+#if __has_include(<linux/tls.h>)
+#define KJ_TLS_KERNEL_OFFLOAD 1
+#endif
+#endif
+
+#if KJ_TLS_KERNEL_OFFLOAD
+#include <linux/tls.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#ifndef TCP_ULP
+#define TCP_ULP 31
+#endif
+#ifndef SOL_TLS
+#define SOL_TLS 282
+#endif
+#endif
 
 #if OPENSSL_VERSION_NUMBER < 0x10100000L
 #define BIO_set_init(x,v)          (x->init=v)
@@ -73,6 +101,10 @@ void X509_up_ref(X509* x509) {
   CRYPTO_add(&x509->references, 1, CRYPTO_LOCK_X509);
 }
 
+void SSL_SESSION_up_ref(SSL_SESSION* session) {
+  CRYPTO_add(&session->references, 1, CRYPTO_LOCK_SSL_SESSION);
+}
+
 #endif
 
 class OpenSslInit {
@@ -90,6 +122,110 @@ void ensureOpenSslInitialized() {
   static OpenSslInit init;
 }
 
+#if KJ_TLS_KERNEL_OFFLOAD
+// =======================================================================================
+// Kernel TLS (kTLS) helpers
+//
+// OpenSSL 3 can set up kTLS itself, but only on its own socket BIOs, so we derive the record keys
+// ourselves and hand them to the kernel with setsockopt().
+
+union KernelTlsCryptoInfo {
+  // The argument to setsockopt(SOL_TLS, TLS_TX), for each cipher we offload.
+
+  struct tls_crypto_info info;
+  struct tls12_crypto_info_aes_gcm_128 aesGcm128;
+  struct tls12_crypto_info_aes_gcm_256 aesGcm256;
+#ifdef TLS_CIPHER_CHACHA20_POLY1305
+  struct tls12_crypto_info_chacha20_poly1305 chacha20Poly1305;
+#endif
+};
+
+template <typename Info>
+uint fillKernelTlsCryptoInfo(Info& info, uint16_t version, uint16_t cipherType,
+                             kj::ArrayPtr<const byte> key, kj::ArrayPtr<const byte> salt,
+                             kj::ArrayPtr<const byte> iv, uint64_t sequence) {
+  // Returns the size to pass to setsockopt().
+
+  KJ_ASSERT(key.size() == sizeof(info.key) && salt.size() == sizeof(info.salt) &&
+            iv.size() == sizeof(info.iv));
+  memset(&info, 0, sizeof(info));
+  info.info.version = version;
+  info.info.cipher_type = cipherType;
+  memcpy(info.key, key.begin(), key.size());
+  memcpy(info.salt, salt.begin(), salt.size());
+  memcpy(info.iv, iv.begin(), iv.size());
+  for (size_t i = sizeof(info.rec_seq); i > 0; i--) {
+    info.rec_seq[i - 1] = sequence & 0xff;
+    sequence >>= 8;
+  }
+  return sizeof(info);
+}
+
+kj::Array<byte> tlsHmac(const EVP_MD* md, kj::ArrayPtr<const byte> key,
+                        kj::ArrayPtr<const byte> data) {
+  auto result = kj::heapArray<byte>(EVP_MD_size(md));
+  unsigned int size;
+  if (HMAC(md, key.begin(), key.size(), data.begin(), data.size(), result.begin(), &size) ==
+      nullptr) {
+    throwOpensslError();
+  }
+  return result;
+}
+
+kj::Array<byte> tls13ExpandLabel(const EVP_MD* md, kj::ArrayPtr<const byte> secret,
+                                 kj::StringPtr label, size_t size) {
+  // HKDF-Expand-Label() from RFC 8446 section 7.1, with an empty context. We never want more than
+  // one hash's worth of output, so a single round of HKDF-Expand suffices.
+
+  KJ_ASSERT(size <= size_t(EVP_MD_size(md)));
+  kj::Vector<byte> info;
+  info.add(size >> 8);
+  info.add(size & 0xff);
+  info.add(6 + label.size());
+  info.addAll("tls13 "_kj.asBytes());
+  info.addAll(label.asBytes());
+  info.add(0);  // context length
+  info.add(1);  // HKDF-Expand block counter
+  auto block = tlsHmac(md, secret, info);
+  auto result = kj::heapArray(block.slice(0, size));
+  OPENSSL_cleanse(block.begin(), block.size());
+  return result;
+}
+
+kj::Array<byte> tls12KeyBlock(SSL* ssl, const EVP_MD* md, size_t size) {
+  // The key block from RFC 5246 section 6.3:
+  // PRF(master_secret, "key expansion", server_random + client_random).
+
+  byte master[SSL_MAX_MASTER_KEY_LENGTH];
+  auto secret = kj::arrayPtr(master,
+      SSL_SESSION_get_master_key(SSL_get_session(ssl), master, sizeof(master)));
+  KJ_DEFER(OPENSSL_cleanse(master, sizeof(master)));
+
+  kj::Vector<byte> seed;
+  seed.addAll("key expansion"_kj.asBytes());
+  byte random[SSL3_RANDOM_SIZE];
+  seed.addAll(kj::arrayPtr(random, SSL_get_server_random(ssl, random, sizeof(random))));
+  seed.addAll(kj::arrayPtr(random, SSL_get_client_random(ssl, random, sizeof(random))));
+
+  // P_hash(): HMAC(secret, A(1) + seed) + HMAC(secret, A(2) + seed) + ..., where
+  // A(i) = HMAC(secret, A(i - 1)) and A(0) = seed.
+  kj::Vector<byte> result(size + EVP_MD_size(md));
+  auto a = tlsHmac(md, secret, seed);
+  while (result.size() < size) {
+    kj::Vector<byte> input;
+    input.addAll(a);
+    input.addAll(seed);
+    auto block = tlsHmac(md, secret, input);
+    result.addAll(block);
+    OPENSSL_cleanse(block.begin(), block.size());
+    a = tlsHmac(md, secret, a);
+  }
+  result.truncate(size);
+  return result.releaseAsArray();
+}
+
+#endif  // KJ_TLS_KERNEL_OFFLOAD
+
 // =======================================================================================
 // Implementation of kj::AsyncIoStream that applies TLS on top of some other AsyncIoStream.
 //
@@ -122,9 +258,32 @@ public:
     BIO_set_data(bio, this);
     BIO_set_init(bio, 1);
     SSL_set_bio(ssl, bio, bio);
+
+    SSL_set_app_data(ssl, this);
   }
 
-  kj::Promise<void> connect(kj::StringPtr expectedServerHostname) {
+  void enableKernelOffload() {
+    // Try to hand encryption to the kernel once the handshake is done. Must be called before
+    // connect() or accept().
+
+    kernelOffloadRequested = true;
+#if KJ_TLS_KERNEL_OFFLOAD
+    SSL_set_msg_callback(ssl, &TlsConnection::onMessage);
+#ifdef SSL_OP_NO_RENEGOTIATION
+    // Renegotiating would change the write keys behind the kernel's back.
+    SSL_set_options(ssl, SSL_OP_NO_RENEGOTIATION);
+#endif
+#endif
+  }
+
+  kj::Promise<void> connect(kj::StringPtr expectedServerHostname,
+                            SSL_SESSION* resumeSession = nullptr) {
+    hostname = kj::str(expectedServerHostname);
+
+    if (resumeSession != nullptr && !SSL_set_session(ssl, resumeSession)) {
+      throwOpensslError();
+    }
+
     if (!SSL_set_tlsext_host_name(ssl, expectedServerHostname.cStr())) {
       throwOpensslError();
     }
@@ -149,16 +308,73 @@ public:
         const char* reason = X509_verify_cert_error_string(result);
         KJ_FAIL_REQUIRE("TLS peer's certificate is not trusted", reason);
       }
-    });
+    }).then([this]() { return offloadIfRequested(); });
   }
   kj::Promise<void> accept() {
     // We are the server. Set SSL options to prefer server's cipher choice.
     SSL_set_options(ssl, SSL_OP_CIPHER_SERVER_PREFERENCE);
 
-    return sslCall([this]() { return SSL_accept(ssl); }).ignoreResult();
+    return sslCall([this]() { return SSL_accept(ssl); }).ignoreResult()
+        .then([this]() { return offloadIfRequested(); });
+  }
+
+  kj::Maybe<kj::StringPtr> getAlpnProtocol() {
+    if (alpnProtocol == nullptr) {
+      const unsigned char* name;
+      unsigned int size;
+      SSL_get0_alpn_selected(ssl, &name, &size);
+      if (size == 0) return nullptr;
+      // OpenSSL's copy isn't NUL-terminated, so keep our own.
+      alpnProtocol = kj::heapString(reinterpret_cast<const char*>(name), size);
+    }
+    return alpnProtocol.map([](kj::String& name) -> kj::StringPtr { return name; });
+  }
+
+  bool isSessionResumed() {
+    return SSL_session_reused(ssl);
+  }
+
+  kj::StringPtr getHostname() {
+    // The hostname passed to connect(), if we're the client.
+    return hostname;
+  }
+
+  bool isKernelOffloaded() {
+    return kernelTx;
+  }
+
+#if KJ_TLS_KERNEL_OFFLOAD
+  static void captureTrafficSecret(const SSL* ssl, const char* line) {
+    // Keylog callback, installed by TlsContext when kernel offload is enabled. TLS 1.3 secrets are
+    // not otherwise available; we keep the one our side encrypts application data with.
+
+    auto& conn = *reinterpret_cast<TlsConnection*>(SSL_get_app_data(ssl));
+    kj::StringPtr prefix = SSL_is_server(ssl) ? "SERVER_TRAFFIC_SECRET_0 "_kj
+                                              : "CLIENT_TRAFFIC_SECRET_0 "_kj;
+    kj::StringPtr text = line;
+    if (!text.startsWith(prefix)) return;
+
+    // The line continues with the client random and then the secret, in hex.
+    text = text.slice(prefix.size());
+    KJ_IF_MAYBE(space, text.findFirst(' ')) {
+      auto secret = kj::decodeHex(text.slice(*space + 1));
+      if (!secret.hadErrors) {
+        conn.writeSecret = kj::mv(secret);
+      }
+    }
   }
+#endif
 
   ~TlsConnection() noexcept(false) {
+    if (writeSecret.size() > 0) {
+      OPENSSL_cleanse(writeSecret.begin(), writeSecret.size());
+    }
+
+    // Freeing a connection that didn't exchange close_notify makes OpenSSL discard its session,
+    // per TLS 1.2. TLS 1.3 dropped that rule, and KJ streams are usually just dropped, so pretend
+    // the shutdown happened. (Sessions of connections that failed are still discarded, because
+    // OpenSSL does that when it sends the fatal alert.)
+    SSL_set_shutdown(ssl, SSL_SENT_SHUTDOWN | SSL_RECEIVED_SHUTDOWN);
     SSL_free(ssl);
   }
 
@@ -167,13 +383,36 @@ public:
   }
 
   Promise<void> write(const void* buffer, size_t size) override {
+    if (kernelTx) {
+      KJ_REQUIRE(shutdownTask == nullptr, "already called shutdownWrite()");
+      return whenKernelRecordsSent().then([this,buffer,size]() {
+        return inner.write(buffer, size);
+      });
+    }
     return writeInternal(kj::arrayPtr(reinterpret_cast<const byte*>(buffer), size), nullptr);
   }
 
   Promise<void> write(ArrayPtr<const ArrayPtr<const byte>> pieces) override {
+    if (kernelTx) {
+      KJ_REQUIRE(shutdownTask == nullptr, "already called shutdownWrite()");
+      return whenKernelRecordsSent().then([this,pieces]() {
+        return inner.write(pieces);
+      });
+    }
     return writeInternal(pieces[0], pieces.slice(1, pieces.size()));
   }
 
+  Maybe<Promise<uint64_t>> tryPumpFrom(AsyncInputStream& input, uint64_t amount) override {
+    // Once the kernel encrypts, the socket's own fast paths (sendfile(), splice()) apply as-is.
+    if (kernelTx) {
+      KJ_REQUIRE(shutdownTask == nullptr, "already called shutdownWrite()");
+      return whenKernelRecordsSent().then([this,&input,amount]() {
+        return input.pumpTo(inner, amount);
+      });
+    }
+    return nullptr;
+  }
+
   void shutdownWrite() override {
     KJ_REQUIRE(shutdownTask == nullptr, "already called shutdownWrite()");
 
@@ -185,7 +424,10 @@ public:
       // The first SSL_shutdown() call is expected to return 0 and may flag a misleading error.
       int result = SSL_shutdown(ssl);
       return result == 0 ? 1 : result;
-    }).ignoreResult().eagerlyEvaluate([](kj::Exception&& e) {
+    }).then([this](size_t) {
+      // If the kernel encrypts, the close_notify alert went to it (see onMessage()).
+      return whenKernelRecordsSent();
+    }).eagerlyEvaluate([](kj::Exception&& e) {
       KJ_LOG(ERROR, e);
     });
   }
@@ -215,6 +457,25 @@ private:
 
   bool disconnected = false;
   kj::Maybe<kj::Promise<void>> shutdownTask;
+  kj::Maybe<kj::String> alpnProtocol;
+  kj::String hostname;
+
+  bool kernelOffloadRequested = false;
+  bool kernelTx = false;
+  // Whether the kernel encrypts what we write. If so, writes bypass OpenSSL entirely, and so do
+  // the alerts and handshake messages OpenSSL still has to send.
+
+  kj::Maybe<kj::ForkedPromise<void>> kernelRecordsSent;
+  // Resolves once the kernel has taken every message OpenSSL wrote since kernelTx was set. Our own
+  // writes wait for it so that they stay in order.
+
+  uint64_t writeSequence = 0;
+  // Number of records written under the current write keys, i.e. the next record's sequence
+  // number, which the kernel needs to carry on from.
+
+  kj::Array<byte> writeSecret;
+  // TLS 1.3 traffic secret for what we write, if kernel offload is enabled. Kept while the kernel
+  // encrypts, to derive the next one from when we send a KeyUpdate.
 
   ReadyInputStreamWrapper readBuffer;
   ReadyOutputStreamWrapper writeBuffer;
@@ -234,6 +495,280 @@ private:
     });
   }
 
+  kj::Promise<void> offloadIfRequested() {
+    if (!kernelOffloadRequested) return kj::READY_NOW;
+
+    // OpenSSL's last handshake records must be on the socket before the kernel starts encrypting.
+    return writeBuffer.whenFlushed().then([this]() {
+      kernelTx = startKernelTx();
+      if (!kernelTx && writeSecret.size() > 0) {
+        OPENSSL_cleanse(writeSecret.begin(), writeSecret.size());
+        writeSecret = nullptr;
+      }
+    });
+  }
+
+#if KJ_TLS_KERNEL_OFFLOAD
+  static void onMessage(int isWrite, int version, int contentType, const void* buf,
+                        size_t len, SSL* ssl, void* arg) {
+    // Message callback, which OpenSSL calls for each record header and each handshake or alert
+    // message, once it has been written or as it is read.
+
+    auto& conn = *reinterpret_cast<TlsConnection*>(SSL_get_app_data(ssl));
+    auto message = kj::arrayPtr(reinterpret_cast<const byte*>(buf), len);
+
+    if (conn.kernelTx) {
+      if (isWrite) {
+        // The record OpenSSL wrote went nowhere (see bioWrite()), so have the kernel send the
+        // message instead. This is how alerts get out, including close_notify.
+        if (contentType == SSL3_RT_ALERT || contentType == SSL3_RT_HANDSHAKE) {
+          conn.queueKernelRecord(contentType, message);
+        }
+      } else if (contentType == SSL3_RT_HANDSHAKE && message.size() == 5 &&
+                 message[0] == SSL3_MT_KEY_UPDATE && message[4] == SSL_KEY_UPDATE_REQUESTED) {
+        // The peer wants us to update our keys too. OpenSSL would only send its KeyUpdate with our
+        // next SSL_write(), which never comes, so send it ourselves.
+        static const byte REPLY[5] = {
+          SSL3_MT_KEY_UPDATE, 0, 0, 1, SSL_KEY_UPDATE_NOT_REQUESTED
+        };
+        conn.queueKernelRecord(SSL3_RT_HANDSHAKE, REPLY);
+      }
+      return;
+    }
+
+    if (!isWrite) return;
+
+    // Otherwise, count records. TLS 1.2 switches to the new write keys right after
+    // ChangeCipherSpec; TLS 1.3 switches to the application keys right after our Finished message,
+    // which is itself sent under the old keys.
+    bool isTls13 = SSL_version(ssl) >= TLS1_3_VERSION;
+    switch (contentType) {
+      case SSL3_RT_HEADER:
+        ++conn.writeSequence;
+        break;
+      case SSL3_RT_CHANGE_CIPHER_SPEC:
+        if (!isTls13) conn.writeSequence = 0;
+        break;
+      case SSL3_RT_HANDSHAKE:
+        if (isTls13 && len > 0 && *reinterpret_cast<const byte*>(buf) == SSL3_MT_FINISHED) {
+          conn.writeSequence = 0;
+        }
+        break;
+    }
+  }
+
+  bool startKernelTx() {
+    // Returns true if the kernel now encrypts our outgoing records. Returns false if it can't, in
+    // which case OpenSSL carries on as before. (Attaching the "tls" ULP by itself changes nothing
+    // about how the socket behaves.)
+
+    // sendKernelRecord() needs to write to the fd directly.
+    if (inner.getFd() == nullptr) return false;
+
+    KernelTlsCryptoInfo info;
+    KJ_DEFER(OPENSSL_cleanse(&info, sizeof(info)));
+    uint infoSize = fillKernelTxInfo(info);
+    if (infoSize == 0) return false;
+
+    // Goes through the stream rather than the fd so that tests can stand in for the kernel.
+    // Attaching the ULP fails with ENOENT if the kernel has no "tls" module, or with EEXIST if
+    // it's already attached; either way, TLS_TX only succeeds if the ULP is in place.
+    kj::runCatchingExceptions([&]() {
+      inner.setsockopt(IPPROTO_TCP, TCP_ULP, "tls", sizeof("tls"));
+    });
+    return kj::runCatchingExceptions([&]() {
+      inner.setsockopt(SOL_TLS, TLS_TX, &info, infoSize);
+    }) == nullptr;
+  }
+
+  void rekeyKernelTx() {
+    // Called once the kernel has sent our TLS 1.3 KeyUpdate. Everything after it is encrypted
+    // with the next traffic secret (RFC 8446 section 7.2), starting again from sequence number 0.
+
+    const EVP_MD* md = SSL_CIPHER_get_handshake_digest(SSL_get_current_cipher(ssl));
+    KJ_ASSERT(md != nullptr && writeSecret.size() > 0);
+    auto next = tls13ExpandLabel(md, writeSecret, "traffic upd", writeSecret.size());
+    OPENSSL_cleanse(writeSecret.begin(), writeSecret.size());
+    writeSecret = kj::mv(next);
+    writeSequence = 0;
+
+    KernelTlsCryptoInfo info;
+    KJ_DEFER(OPENSSL_cleanse(&info, sizeof(info)));
+    uint infoSize = fillKernelTxInfo(info);
+    KJ_ASSERT(infoSize > 0);
+
+    // Older kernels can only be given TLS_TX once, in which case we can't write any more.
+    KJ_CONTEXT("kernel refused new TLS keys after a KeyUpdate");
+    inner.setsockopt(SOL_TLS, TLS_TX, &info, infoSize);
+  }
+
+  uint fillKernelTxInfo(KernelTlsCryptoInfo& info) {
+    // Fills in the argument to setsockopt(SOL_TLS, TLS_TX) for our current write keys and
+    // sequence number, and returns its size. Returns 0 if the kernel can't handle the cipher or
+    // protocol version.
+
+    const SSL_CIPHER* cipher = SSL_get_current_cipher(ssl);
+    if (cipher == nullptr) return 0;
+    const EVP_MD* md = SSL_CIPHER_get_handshake_digest(cipher);
+    if (md == nullptr) return 0;
+
+    uint16_t cipherType;
+    size_t keySize;
+    size_t saltSize = 4;
+    // GCM's 12-byte nonce is a 4-byte salt followed by 8 bytes that vary per record.
+    switch (SSL_CIPHER_get_cipher_nid(cipher)) {
+      case NID_aes_128_gcm:
+        cipherType = TLS_CIPHER_AES_GCM_128;
+        keySize = 16;
+        break;
+      case NID_aes_256_gcm:
+        cipherType = TLS_CIPHER_AES_GCM_256;
+        keySize = 32;
+        break;
+#ifdef TLS_CIPHER_CHACHA20_POLY1305
+      case NID_chacha20_poly1305:
+        cipherType = TLS_CIPHER_CHACHA20_POLY1305;
+        keySize = 32;
+        saltSize = 0;
+        break;
+#endif
+      default:
+        return 0;
+    }
+
+    uint16_t version;
+    kj::Array<byte> key;
+    kj::Array<byte> fixedIv;
+    byte sequenceBytes[8];
+    for (uint i = 0; i < sizeof(sequenceBytes); i++) {
+      sequenceBytes[i] = writeSequence >> (8 * (sizeof(sequenceBytes) - 1 - i));
+    }
+    kj::ArrayPtr<const byte> iv;
+
+    if (SSL_version(ssl) == TLS1_3_VERSION) {
+      if (writeSecret.size() == 0) return 0;
+      version = TLS_1_3_VERSION;
+      key = tls13ExpandLabel(md, writeSecret, "key", keySize);
+      fixedIv = tls13ExpandLabel(md, writeSecret, "iv", 12);
+      iv = fixedIv.slice(saltSize, fixedIv.size());
+    } else if (SSL_version(ssl) == TLS1_2_VERSION) {
+      // The key block holds the client's key, the server's key, then their fixed IVs. With GCM
+      // the fixed IV is just the salt, and the rest of the nonce is sent in each record; like
+      // OpenSSL, we use the sequence number.
+      version = TLS_1_2_VERSION;
+      size_t fixedIvSize = saltSize > 0 ? saltSize : 12;
+      auto block = tls12KeyBlock(ssl, md, 2 * keySize + 2 * fixedIvSize);
+      KJ_DEFER(OPENSSL_cleanse(block.begin(), block.size()));
+      bool isServer = SSL_is_server(ssl);
+      size_t keyOffset = isServer ? keySize : 0;
+      size_t ivOffset = 2 * keySize + (isServer ? fixedIvSize : 0);
+      key = kj::heapArray(block.slice(keyOffset, keyOffset + keySize));
+      fixedIv = kj::heapArray(block.slice(ivOffset, ivOffset + fixedIvSize));
+      iv = saltSize > 0 ? kj::arrayPtr(sequenceBytes, sizeof(sequenceBytes)).asConst()
+                        : fixedIv.asPtr().asConst();
+    } else {
+      return 0;
+    }
+    KJ_DEFER({
+      OPENSSL_cleanse(key.begin(), key.size());
+      OPENSSL_cleanse(fixedIv.begin(), fixedIv.size());
+    });
+    auto salt = fixedIv.slice(0, saltSize);
+
+    uint infoSize;
+    switch (cipherType) {
+      case TLS_CIPHER_AES_GCM_128:
+        infoSize = fillKernelTlsCryptoInfo(info.aesGcm128, version, cipherType,
+                                           key, salt, iv, writeSequence);
+        break;
+      case TLS_CIPHER_AES_GCM_256:
+        infoSize = fillKernelTlsCryptoInfo(info.aesGcm256, version, cipherType,
+                                           key, salt, iv, writeSequence);
+        break;
+#ifdef TLS_CIPHER_CHACHA20_POLY1305
+      case TLS_CIPHER_CHACHA20_POLY1305:
+        infoSize = fillKernelTlsCryptoInfo(info.chacha20Poly1305, version, cipherType,
+                                           key, salt, iv, writeSequence);
+        break;
+#endif
+      default:
+        KJ_UNREACHABLE;
+    }
+
+    return infoSize;
+  }
+
+  void queueKernelRecord(byte contentType, kj::ArrayPtr<const byte> message) {
+    // Sends `message` in a record of its own, after any already queued. Sending a KeyUpdate
+    // (which we only do in reply to one requesting it) re-keys the kernel.
+
+    bool isKeyUpdate = contentType == SSL3_RT_HANDSHAKE && SSL_version(ssl) >= TLS1_3_VERSION &&
+                       message.size() > 0 && message[0] == SSL3_MT_KEY_UPDATE;
+    auto promise = whenKernelRecordsSent().then(kj::mvCapture(kj::heapArray(message),
+        [this,contentType,isKeyUpdate](kj::Array<byte>&& message) {
+      auto promise = sendKernelRecord(contentType, message);
+      if (isKeyUpdate) {
+        promise = promise.then([this]() { rekeyKernelTx(); });
+      }
+      return promise.attach(kj::mv(message));
+    }));
+    kernelRecordsSent = promise.fork();
+  }
+
+  kj::Promise<void> sendKernelRecord(byte contentType, kj::ArrayPtr<const byte> message) {
+    // The kernel sends application data unless told otherwise by a control message, so other
+    // records have to bypass the stream.
+
+    int fd = KJ_ASSERT_NONNULL(inner.getFd());
+    struct iovec iov;
+    iov.iov_base = const_cast<byte*>(message.begin());
+    iov.iov_len = message.size();
+
+    union {
+      struct cmsghdr cmsg;
+      char cmsgSpace[CMSG_SPACE(sizeof(byte))];
+    };
+    memset(cmsgSpace, 0, sizeof(cmsgSpace));
+    cmsg.cmsg_level = SOL_TLS;
+    cmsg.cmsg_type = TLS_SET_RECORD_TYPE;
+    cmsg.cmsg_len = CMSG_LEN(sizeof(byte));
+    *CMSG_DATA(&cmsg) = contentType;
+
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = &cmsg;
+    msg.msg_controllen = sizeof(cmsgSpace);
+
+    ssize_t n;
+    KJ_NONBLOCKING_SYSCALL(n = sendmsg(fd, &msg, 0));
+    if (n < 0) {
+      // The socket buffer is full.
+      return inner.whenWritable().then([this,contentType,message]() {
+        return sendKernelRecord(contentType, message);
+      });
+    } else if (size_t(n) < message.size()) {
+      // Only handshake messages are big enough to be split, and they may span records.
+      return sendKernelRecord(contentType, message.slice(n, message.size()));
+    }
+    return kj::READY_NOW;
+  }
+#endif
+
+  kj::Promise<void> whenKernelRecordsSent() {
+    KJ_IF_MAYBE(promise, kernelRecordsSent) {
+      return promise->addBranch();
+    }
+    return kj::READY_NOW;
+  }
+
+#if !KJ_TLS_KERNEL_OFFLOAD
+  bool startKernelTx() {
+    return false;
+  }
+#endif
+
   Promise<void> writeInternal(kj::ArrayPtr<const byte> first,
                               kj::ArrayPtr<const kj::ArrayPtr<const byte>> rest) {
     KJ_REQUIRE(shutdownTask == nullptr, "already called shutdownWrite()");
@@ -303,7 +838,13 @@ private:
 
   static int bioWrite(BIO* b, const char* in, int inl) {
     BIO_clear_retry_flags(b);
-    KJ_IF_MAYBE(n, reinterpret_cast<TlsConnection*>(BIO_get_data(b))->writeBuffer
+    auto& conn = *reinterpret_cast<TlsConnection*>(BIO_get_data(b));
+    if (conn.kernelTx) {
+      // The kernel has moved on from OpenSSL's write state, so the record is no good. onMessage()
+      // has the kernel send the message instead.
+      return inl;
+    }
+    KJ_IF_MAYBE(n, conn.writeBuffer
         .write(kj::arrayPtr(in, inl).asBytes())) {
       return *n;
     } else {
@@ -484,7 +1025,13 @@ TlsContext::Options::Options()
     : useSystemTrustStore(true),
       verifyClients(false),
       minVersion(TlsVersion::TLS_1_0),
-      cipherList("ECDHE-ECDSA-CHACHA20-POLY1305:ECDHE-RSA-CHACHA20-POLY1305:ECDHE-ECDSA-AES128-GCM-SHA256:ECDHE-RSA-AES128-GCM-SHA256:ECDHE-ECDSA-AES256-GCM-SHA384:ECDHE-RSA-AES256-GCM-SHA384:ECDHE-ECDSA-AES128-SHA256:ECDHE-RSA-AES128-SHA256:ECDHE-ECDSA-AES128-SHA:ECDHE-RSA-AES256-SHA384:ECDHE-RSA-AES128-SHA:ECDHE-ECDSA-AES256-SHA384:ECDHE-ECDSA-AES256-SHA:ECDHE-RSA-AES256-SHA:ECDHE-ECDSA-DES-CBC3-SHA:ECDHE-RSA-DES-CBC3-SHA:AES128-GCM-SHA256:AES256-GCM-SHA384:AES128-SHA256:AES256-SHA256:AES128-SHA:AES256-SHA:DES-CBC3-SHA:!DSS") {}
+      cipherList("ECDHE-ECDSA-CHACHA20-POLY1305:ECDHE-RSA-CHACHA20-POLY1305:ECDHE-ECDSA-AES128-GCM-SHA256:ECDHE-RSA-AES128-GCM-SHA256:ECDHE-ECDSA-AES256-GCM-SHA384:ECDHE-RSA-AES256-GCM-SHA384:ECDHE-ECDSA-AES128-SHA256:ECDHE-RSA-AES128-SHA256:ECDHE-ECDSA-AES128-SHA:ECDHE-RSA-AES256-SHA384:ECDHE-RSA-AES128-SHA:ECDHE-ECDSA-AES256-SHA384:ECDHE-ECDSA-AES256-SHA:ECDHE-RSA-AES256-SHA:ECDHE-ECDSA-DES-CBC3-SHA:ECDHE-RSA-DES-CBC3-SHA:AES128-GCM-SHA256:AES256-GCM-SHA384:AES128-SHA256:AES256-SHA256:AES128-SHA:AES256-SHA:DES-CBC3-SHA:!DSS"),
+      sessionTimeout(1 * kj::HOURS),
+      sessionCacheSize(20480),
+      sessionCacheShards(1),
+      sessionTickets(true),
+      clientSessionCacheSize(256),
+      kernelOffload(false) {}
 // Cipher list is Mozilla's "intermediate" list, except with classic DH removed since we don't
 // currently support setting dhparams. See:
 //     https://mozilla.github.io/server-side-tls/ssl-config-generator/
@@ -499,6 +1046,233 @@ struct TlsContext::SniCallback {
   static int callback(SSL* ssl, int* ad, void* arg);
 };
 
+struct TlsContext::AlpnCallback {
+  // Likewise for the server's ALPN selection callback.
+
+  static int callback(SSL* ssl, const unsigned char** out, unsigned char* outlen,
+                      const unsigned char* in, unsigned int inlen, void* arg);
+};
+
+class TlsContext::SessionCache {
+  // Remembers sessions for resumption: on the server, by session ID, split into shards that are
+  // locked independently; on the client, by hostname. Each holds a reference to its sessions.
+  // When full, the oldest session is dropped.
+
+public:
+  SessionCache(uint serverCapacity, uint shardCount, uint clientCapacity)
+      : clientCapacity(clientCapacity) {
+    KJ_REQUIRE(shardCount > 0, "sessionCacheShards must be at least 1");
+    shardCapacity = (serverCapacity + shardCount - 1) / shardCount;
+    auto builder = kj::heapArrayBuilder<kj::MutexGuarded<Shard>>(shardCount);
+    for (uint i = 0; i < shardCount; i++) {
+      builder.add();
+    }
+    shards = builder.finish();
+  }
+
+  ~SessionCache() noexcept(false) {
+    for (auto& shard: shards) {
+      shard.getWithoutLock().clear();
+    }
+    clientSessions.getWithoutLock().clear();
+  }
+
+  bool hasServerCache() { return shardCapacity > 0; }
+  bool hasClientCache() { return clientCapacity > 0; }
+
+  void addServerSession(SSL_SESSION* session) {
+    // Takes ownership of one reference.
+    auto id = getId(session);
+    getShard(id).lockExclusive()->put(kj::encodeHex(id), session, shardCapacity);
+  }
+
+  SSL_SESSION* getServerSession(kj::ArrayPtr<const byte> id) {
+    // Returns a new reference, or null.
+    return getShard(id).lockExclusive()->get(kj::encodeHex(id));
+  }
+
+  void removeServerSession(SSL_SESSION* session) {
+    auto id = getId(session);
+    getShard(id).lockExclusive()->erase(kj::encodeHex(id));
+  }
+
+  void setClientSession(kj::StringPtr hostname, SSL_SESSION* session) {
+    // Takes ownership of one reference.
+    clientSessions.lockExclusive()->put(kj::str(hostname), session, clientCapacity);
+  }
+
+  SSL_SESSION* getClientSession(kj::StringPtr hostname) {
+    // Returns a new reference, or null.
+    return clientSessions.lockExclusive()->get(hostname);
+  }
+
+private:
+  struct Entry {
+    SSL_SESSION* session;
+    uint64_t serial;
+  };
+
+  struct Shard {
+    kj::HashMap<kj::String, Entry> sessions;
+    kj::TreeMap<uint64_t, kj::StringPtr> byAge;
+    // Keys of `sessions`, oldest first. The keys point into `sessions`' own copies, which don't
+    // move when the table is rehashed because kj::String owns a heap buffer.
+    uint64_t nextSerial = 0;
+
+    ~Shard() noexcept(false) {
+      clear();
+    }
+
+    void put(kj::String key, SSL_SESSION* session, uint capacity) {
+      erase(key);
+      while (sessions.size() >= capacity && !byAge.empty()) {
+        erase(kj::str(byAge.begin()->value));
+      }
+      auto& entry = sessions.insert(kj::mv(key), Entry { session, nextSerial++ });
+      byAge.insert(entry.value.serial, entry.key);
+    }
+
+    SSL_SESSION* get(kj::StringPtr key) {
+      KJ_IF_MAYBE(entry, sessions.find(key)) {
+        SSL_SESSION_up_ref(entry->session);
+        return entry->session;
+      }
+      return nullptr;
+    }
+
+    void erase(kj::StringPtr key) {
+      KJ_IF_MAYBE(entry, sessions.find(key)) {
+        SSL_SESSION_free(entry->session);
+        byAge.erase(entry->serial);
+        sessions.erase(key);
+      }
+    }
+
+    void clear() {
+      for (auto& entry: sessions) {
+        SSL_SESSION_free(entry.value.session);
+      }
+      sessions.clear();
+      byAge.clear();
+    }
+  };
+
+  kj::Array<kj::MutexGuarded<Shard>> shards;
+  uint shardCapacity;
+  kj::MutexGuarded<Shard> clientSessions;
+  uint clientCapacity;
+
+  static kj::ArrayPtr<const byte> getId(SSL_SESSION* session) {
+    unsigned int length;
+    const unsigned char* id = SSL_SESSION_get_id(session, &length);
+    return kj::arrayPtr(id, length);
+  }
+
+  kj::MutexGuarded<Shard>& getShard(kj::ArrayPtr<const byte> id) {
+    return shards[kj::hashCode(id) % shards.size()];
+  }
+};
+
+struct TlsContext::SessionCallbacks {
+  // OpenSSL callbacks for session resumption, declared here since they reference OpenSSL types.
+
+  static TlsContext& getContext(SSL* ssl) {
+    return *reinterpret_cast<TlsContext*>(SSL_CTX_get_app_data(SSL_get_SSL_CTX(ssl)));
+  }
+
+  static int newSession(SSL* ssl, SSL_SESSION* session) {
+    // Returns 1 if we kept the reference to `session`.
+
+    auto& cache = *getContext(ssl).sessionCache;
+    if (SSL_is_server(ssl)) {
+      if (!cache.hasServerCache()) return 0;
+      cache.addServerSession(session);
+      return 1;
+    } else {
+      // Only remember sessions whose certificate we accepted. Resuming would skip the check.
+      if (!cache.hasClientCache() || SSL_get_verify_result(ssl) != X509_V_OK) return 0;
+#if OPENSSL_VERSION_NUMBER >= 0x10101000L
+      if (!SSL_SESSION_is_resumable(session)) return 0;
+#endif
+      auto& connection = *reinterpret_cast<TlsConnection*>(SSL_get_app_data(ssl));
+      cache.setClientSession(connection.getHostname(), session);
+      return 1;
+    }
+  }
+
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L
+  static SSL_SESSION* getSession(SSL* ssl, const unsigned char* id, int length, int* copy) {
+#else
+  static SSL_SESSION* getSession(SSL* ssl, unsigned char* id, int length, int* copy) {
+#endif
+    // We return a new reference, so OpenSSL shouldn't add one.
+    *copy = 0;
+    return getContext(ssl).sessionCache->getServerSession(kj::arrayPtr(id, length));
+  }
+
+  static void removeSession(SSL_CTX* ctx, SSL_SESSION* session) {
+    auto& context = *reinterpret_cast<TlsContext*>(SSL_CTX_get_app_data(ctx));
+    context.sessionCache->removeServerSession(session);
+  }
+
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+  static int ticketKey(SSL* ssl, unsigned char* keyName, unsigned char* iv,
+                       EVP_CIPHER_CTX* cipherCtx, EVP_MAC_CTX* macCtx, int encrypt) {
+#else
+  static int ticketKey(SSL* ssl, unsigned char* keyName, unsigned char* iv,
+                       EVP_CIPHER_CTX* cipherCtx, HMAC_CTX* macCtx, int encrypt) {
+#endif
+    // Returns -1 on error, 0 if the ticket's key is unknown (so do a full handshake), 1 on
+    // success, or 2 if the ticket was decrypted with an old key and should be renewed.
+
+    auto& keys = KJ_ASSERT_NONNULL(getContext(ssl).ticketKeys);
+    TlsSessionTicketKeys::Key key;
+    int result = 1;
+    {
+      auto lock = keys.keys.lockShared();
+      if (encrypt) {
+        key = (*lock)[0];
+        memcpy(keyName, key.name, sizeof(key.name));
+        if (RAND_bytes(iv, 16) <= 0) return -1;
+      } else {
+        bool found = false;
+        for (auto& candidate: *lock) {
+          if (memcmp(candidate.name, keyName, sizeof(candidate.name)) == 0) {
+            key = candidate;
+            found = true;
+            break;
+          }
+          // Not the newest key, so have the client get a new ticket.
+          result = 2;
+        }
+        if (!found) return 0;
+#ifdef TLS1_3_VERSION
+        // TLS 1.3 tickets are meant to be used once, and OpenSSL clients forget them after
+        // resuming, so always issue a new one.
+        if (SSL_version(ssl) >= TLS1_3_VERSION) result = 2;
+#endif
+      }
+    }
+
+    if (!EVP_CipherInit_ex(cipherCtx, EVP_aes_256_cbc(), nullptr, key.aesKey, iv, encrypt)) {
+      return -1;
+    }
+
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+    OSSL_PARAM params[] = {
+      OSSL_PARAM_construct_octet_string(OSSL_MAC_PARAM_KEY, key.hmacKey, sizeof(key.hmacKey)),
+      OSSL_PARAM_construct_utf8_string(OSSL_MAC_PARAM_DIGEST, const_cast<char*>("SHA256"), 0),
+      OSSL_PARAM_construct_end()
+    };
+    if (!EVP_MAC_CTX_set_params(macCtx, params)) return -1;
+#else
+    if (!HMAC_Init_ex(macCtx, key.hmacKey, sizeof(key.hmacKey), EVP_sha256(), nullptr)) return -1;
+#endif
+
+    return result;
+  }
+};
+
 TlsContext::TlsContext(Options options) {
   ensureOpenSslInitialized();
 
@@ -587,9 +1361,121 @@ TlsContext::TlsContext(Options options) {
     SSL_CTX_set_tlsext_servername_arg(ctx, sni);
   }
 
+  // honor options.alpnProtocols
+  if (options.alpnProtocols.size() > 0) {
+    kj::Vector<byte> wire;
+    for (auto& protocol: options.alpnProtocols) {
+      KJ_REQUIRE(protocol.size() > 0 && protocol.size() < 256,
+                 "invalid ALPN protocol name", protocol);
+      wire.add(protocol.size());
+      wire.addAll(protocol.asBytes());
+    }
+    alpnProtocols = wire.releaseAsArray();
+
+    // Used when we're the client. Note that unlike most OpenSSL functions, this returns 0 on
+    // success.
+    if (SSL_CTX_set_alpn_protos(ctx, alpnProtocols.begin(), alpnProtocols.size()) != 0) {
+      throwOpensslError();
+    }
+    // Used when we're the server.
+    SSL_CTX_set_alpn_select_cb(ctx, &AlpnCallback::callback, &alpnProtocols);
+  }
+
+  // honor session resumption options
+  SSL_CTX_set_app_data(ctx, this);
+  SSL_CTX_set_timeout(ctx, options.sessionTimeout / kj::SECONDS);
+
+  // A session only resumes on a server with the same session ID context. Deriving it from the
+  // settings that decide who gets authenticated, and how, means that a server which verifies
+  // clients won't accept a ticket minted by one that doesn't just because they share ticket keys.
+  // (The default context is empty, which makes servers that verify clients refuse to resume
+  // anything.)
+  {
+    kj::Vector<byte> policy;
+    auto addCount = [&](size_t n) {
+      policy.add(n >> 24);
+      policy.add(n >> 16);
+      policy.add(n >> 8);
+      policy.add(n);
+    };
+    auto addCertificate = [&](void* cert) {
+      byte digest[EVP_MAX_MD_SIZE];
+      unsigned int size;
+      if (!X509_digest(reinterpret_cast<X509*>(cert), EVP_sha256(), digest, &size)) {
+        throwOpensslError();
+      }
+      policy.addAll(digest, digest + size);
+    };
+
+    policy.add(options.verifyClients);
+    policy.add(options.useSystemTrustStore);
+    addCount(options.trustedCertificates.size());
+    for (auto& cert: options.trustedCertificates) {
+      addCertificate(cert.chain[0]);
+    }
+    KJ_IF_MAYBE(kp, options.defaultKeypair) {
+      addCertificate(kp->certificate.chain[0]);
+    }
+
+    byte context[SHA256_DIGEST_LENGTH];
+    static_assert(sizeof(context) <= SSL_MAX_SID_CTX_LENGTH, "session ID context too long");
+    if (!EVP_Digest(policy.begin(), policy.size(), context, nullptr, EVP_sha256(), nullptr)) {
+      throwOpensslError();
+    }
+    if (!SSL_CTX_set_session_id_context(ctx, context, sizeof(context))) {
+      throwOpensslError();
+    }
+  }
+
+  sessionCache = kj::heap<SessionCache>(
+      options.sessionCacheSize, options.sessionCacheShards, options.clientSessionCacheSize);
+  long cacheMode = SSL_SESS_CACHE_NO_INTERNAL;
+  if (sessionCache->hasServerCache()) cacheMode |= SSL_SESS_CACHE_SERVER;
+  if (sessionCache->hasClientCache()) cacheMode |= SSL_SESS_CACHE_CLIENT;
+  SSL_CTX_set_session_cache_mode(ctx, cacheMode);
+  SSL_CTX_sess_set_new_cb(ctx, &SessionCallbacks::newSession);
+  SSL_CTX_sess_set_get_cb(ctx, &SessionCallbacks::getSession);
+  SSL_CTX_sess_set_remove_cb(ctx, &SessionCallbacks::removeSession);
+
+  if (!options.sessionTickets) {
+    SSL_CTX_set_options(ctx, SSL_OP_NO_TICKET);
+  } else KJ_IF_MAYBE(keys, options.sessionTicketKeys) {
+    ticketKeys = *keys;
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+    SSL_CTX_set_tlsext_ticket_key_evp_cb(ctx, &SessionCallbacks::ticketKey);
+#else
+    SSL_CTX_set_tlsext_ticket_key_cb(ctx, &SessionCallbacks::ticketKey);
+#endif
+  }
+
+  // honor options.kernelOffload
+  kernelOffload = options.kernelOffload;
+#if KJ_TLS_KERNEL_OFFLOAD
+  if (kernelOffload) {
+    SSL_CTX_set_keylog_callback(ctx, &TlsConnection::captureTrafficSecret);
+  }
+#endif
+
   this->ctx = ctx;
 }
 
+int TlsContext::AlpnCallback::callback(SSL* ssl, const unsigned char** out, unsigned char* outlen,
+                                       const unsigned char* in, unsigned int inlen, void* arg) {
+  // The last parameter is actually type kj::Array<byte>*, holding our protocols in wire format.
+
+  auto& ours = *reinterpret_cast<kj::Array<byte>*>(arg);
+
+  // SSL_select_next_proto() prefers the order of its first list, i.e. ours.
+  unsigned char* selected;
+  if (SSL_select_next_proto(&selected, outlen, ours.begin(), ours.size(), in, inlen) !=
+      OPENSSL_NPN_NEGOTIATED) {
+    // No overlap. Carry on without a protocol, as if the client hadn't asked.
+    return SSL_TLSEXT_ERR_NOACK;
+  }
+  *out = selected;
+  return SSL_TLSEXT_ERR_OK;
+}
+
 int TlsContext::SniCallback::callback(SSL* ssl, int* ad, void* arg) {
   // The third parameter is actually type TlsSniCallback*.
 
@@ -640,7 +1526,10 @@ TlsContext::~TlsContext() noexcept(false) {
 kj::Promise<kj::Own<kj::AsyncIoStream>> TlsContext::wrapClient(
     kj::Own<kj::AsyncIoStream> stream, kj::StringPtr expectedServerHostname) {
   auto conn = kj::heap<TlsConnection>(kj::mv(stream), reinterpret_cast<SSL_CTX*>(ctx));
-  auto promise = conn->connect(expectedServerHostname);
+  if (kernelOffload) conn->enableKernelOffload();
+  SSL_SESSION* session = sessionCache->getClientSession(expectedServerHostname);
+  KJ_DEFER(if (session != nullptr) SSL_SESSION_free(session));
+  auto promise = conn->connect(expectedServerHostname, session);
   return promise.then(kj::mvCapture(conn, [](kj::Own<TlsConnection> conn)
       -> kj::Own<kj::AsyncIoStream> {
     return kj::mv(conn);
@@ -649,6 +1538,7 @@ kj::Promise<kj::Own<kj::AsyncIoStream>> TlsContext::wrapClient(
 
 kj::Promise<kj::Own<kj::AsyncIoStream>> TlsContext::wrapServer(kj::Own<kj::AsyncIoStream> stream) {
   auto conn = kj::heap<TlsConnection>(kj::mv(stream), reinterpret_cast<SSL_CTX*>(ctx));
+  if (kernelOffload) conn->enableKernelOffload();
   auto promise = conn->accept();
   return promise.then(kj::mvCapture(conn, [](kj::Own<TlsConnection> conn)
       -> kj::Own<kj::AsyncIoStream> {
@@ -664,6 +1554,77 @@ kj::Own<kj::Network> TlsContext::wrapNetwork(kj::Network& network) {
   return kj::heap<TlsNetwork>(*this, network);
 }
 
+kj::Maybe<kj::StringPtr> getTlsAlpnProtocol(kj::AsyncIoStream& stream) {
+  KJ_IF_MAYBE(conn, kj::dynamicDowncastIfAvailable<TlsConnection>(stream)) {
+    return conn->getAlpnProtocol();
+  }
+  return nullptr;
+}
+
+bool isTlsSessionResumed(kj::AsyncIoStream& stream) {
+  KJ_IF_MAYBE(conn, kj::dynamicDowncastIfAvailable<TlsConnection>(stream)) {
+    return conn->isSessionResumed();
+  }
+  return false;
+}
+
+bool isTlsKernelOffloaded(kj::AsyncIoStream& stream) {
+  KJ_IF_MAYBE(conn, kj::dynamicDowncastIfAvailable<TlsConnection>(stream)) {
+    return conn->isKernelOffloaded();
+  }
+  return false;
+}
+
+// =======================================================================================
+// class TlsSessionTicketKeys
+
+constexpr size_t TlsSessionTicketKeys::KEY_SIZE;
+
+TlsSessionTicketKeys::TlsSessionTicketKeys(uint maxKeys): maxKeys(maxKeys) {
+  KJ_REQUIRE(maxKeys > 0, "need at least one session ticket key");
+  keys.getWithoutLock().add(parseKey(generateKey()));
+}
+
+kj::Array<byte> TlsSessionTicketKeys::generateKey() {
+  ensureOpenSslInitialized();
+  auto result = kj::heapArray<byte>(KEY_SIZE);
+  if (RAND_bytes(result.begin(), result.size()) <= 0) {
+    throwOpensslError();
+  }
+  return result;
+}
+
+void TlsSessionTicketKeys::rotate(kj::ArrayPtr<const byte> key) {
+  auto newKey = parseKey(key);
+  auto lock = keys.lockExclusive();
+  kj::Vector<Key> newKeys(maxKeys);
+  newKeys.add(newKey);
+  for (auto& oldKey: *lock) {
+    if (newKeys.size() == maxKeys) break;
+    newKeys.add(oldKey);
+  }
+  *lock = kj::mv(newKeys);
+}
+
+void TlsSessionTicketKeys::setKeys(kj::ArrayPtr<const kj::ArrayPtr<const byte>> newKeys) {
+  KJ_REQUIRE(newKeys.size() > 0, "need at least one session ticket key");
+  kj::Vector<Key> parsed(kj::min(newKeys.size(), maxKeys));
+  for (auto& key: newKeys.slice(0, parsed.capacity())) {
+    parsed.add(parseKey(key));
+  }
+  *keys.lockExclusive() = kj::mv(parsed);
+}
+
+TlsSessionTicketKeys::Key TlsSessionTicketKeys::parseKey(kj::ArrayPtr<const byte> key) {
+  KJ_REQUIRE(key.size() == KEY_SIZE, "session ticket keys must be 80 bytes", key.size());
+  Key result;
+  memcpy(result.name, key.begin(), sizeof(result.name));
+  memcpy(result.hmacKey, key.begin() + sizeof(result.name), sizeof(result.hmacKey));
+  memcpy(result.aesKey, key.begin() + sizeof(result.name) + sizeof(result.hmacKey),
+         sizeof(result.aesKey));
+  return result;
+}
+
 // =======================================================================================
 // class TlsPrivateKey
 
@@ -29,6 +29,9 @@
 // and cannot be bypassed.
 
 #include <kj/async-io.h>
+#include <kj/mutex.h>
+#include <kj/time.h>
+#include <kj/vector.h>
 
 namespace kj {
 
@@ -36,6 +39,7 @@ class TlsPrivateKey;
 class TlsCertificate;
 struct TlsKeypair;
 class TlsSniCallback;
+class TlsSessionTicketKeys;
 
 enum class TlsVersion {
   SSL_3,     // avoid; cryptographically broken
@@ -90,6 +94,55 @@ public:
     kj::Maybe<TlsSniCallback&> sniCallback;
     // Callback that can be used to choose a different key/certificate based on the specific
     // hostname requested by the client.
+
+    kj::ArrayPtr<const kj::StringPtr> alpnProtocols;
+    // Application protocols to negotiate via ALPN, e.g. {"h2", "http/1.1"}, most preferred first.
+    // Clients offer these in the handshake. Servers pick the first one in this list that the
+    // client also offers; a client offering none of them connects without a protocol rather than
+    // being rejected. Use getTlsAlpnProtocol() to see the outcome. Default: none (no ALPN).
+
+    kj::Duration sessionTimeout;
+    // How long after a full handshake its session may be resumed, by session ID or ticket.
+    // Default: 1 hour.
+
+    uint sessionCacheSize;
+    // Server: how many sessions to remember so that returning clients can resume them by session
+    // ID, skipping the public-key operations of a full handshake. The oldest are dropped first.
+    // 0 disables the cache. Default: 20480.
+
+    uint sessionCacheShards;
+    // Server: split the session cache into this many independently locked shards, dividing
+    // `sessionCacheSize` between them. Worth raising when many threads accept connections through
+    // the same TlsContext. Default: 1.
+
+    bool sessionTickets;
+    // Server: whether to issue session tickets, which let clients resume without the server
+    // keeping any state. Default: true.
+
+    kj::Maybe<TlsSessionTicketKeys&> sessionTicketKeys;
+    // Server: keys to encrypt session tickets with. Servers sharing the same keys can resume each
+    // other's sessions, and rotating them limits how long a stolen key is useful. If null, each
+    // TlsContext makes up its own key, so only it can resume its tickets. Must outlive the context.
+
+    uint clientSessionCacheSize;
+    // Client: how many hostnames to remember a session for. wrapClient() offers the remembered
+    // session, if any, when connecting to the same hostname again. 0 disables this.
+    // Default: 256.
+
+    bool kernelOffload;
+    // On Linux, once a handshake completes, hand encryption of outgoing data to the kernel (kTLS)
+    // if it can take it: the connection must be a TCP socket, the kernel must have the `tls`
+    // module, and the cipher must be AES-GCM or ChaCha20-Poly1305 under TLS 1.2 or 1.3. Writes
+    // then go straight to the socket, and pumping a file or another socket into the connection
+    // uses sendfile() or splice() with no userspace copy. Otherwise the connection silently keeps
+    // encrypting in OpenSSL; isTlsKernelOffloaded() tells which happened. Decryption stays in
+    // OpenSSL either way.
+    //
+    // Once offloaded, the messages OpenSSL still sends -- alerts, including close_notify, and
+    // replies to TLS 1.3 KeyUpdate requests -- go through the kernel too. Replying to a KeyUpdate
+    // means giving the kernel new keys, which older kernels refuse; if so, writes fail from then
+    // on, though reads still work. Offloaded connections refuse TLS 1.2 renegotiation, which
+    // peers usually treat as fatal. Default: false.
   };
 
   TlsContext(Options options = Options());
@@ -124,7 +177,65 @@ public:
 private:
   void* ctx;  // actually type SSL_CTX, but we don't want to #include the OpenSSL headers here
 
+  kj::Array<byte> alpnProtocols;
+  // Options::alpnProtocols in ALPN wire format (each name prefixed by its length).
+
+  class SessionCache;
+  kj::Own<SessionCache> sessionCache;
+  // Server sessions by ID, and client sessions by hostname.
+
+  kj::Maybe<TlsSessionTicketKeys&> ticketKeys;
+
+  bool kernelOffload;
+
   struct SniCallback;
+  struct AlpnCallback;
+  struct SessionCallbacks;
+};
+
+class TlsSessionTicketKeys {
+  // A set of keys for encrypting and decrypting TLS session tickets, to be shared by the
+  // TlsContexts of servers that should be able to resume each other's sessions. New tickets are
+  // encrypted with the first key; tickets made with any of the others are still accepted, and
+  // renewed with the first. May be used from multiple threads.
+  //
+  // To rotate, periodically add a new key with rotate(), on all servers at around the same time.
+  // A ticket stops working once its key has been rotated out, so `maxKeys` times the rotation
+  // interval should be at least Options::sessionTimeout.
+
+public:
+  static constexpr size_t KEY_SIZE = 80;
+  // A key is 16 bytes of key name (sent in the clear, to find the key again), a 32-byte HMAC-SHA256
+  // key and a 32-byte AES-256 key. This is the same layout as nginx's `ssl_session_ticket_key`
+  // files.
+
+  explicit TlsSessionTicketKeys(uint maxKeys = 3);
+  // Starts with one randomly generated key. At most `maxKeys` keys are kept.
+
+  static kj::Array<byte> generateKey();
+  // Returns KEY_SIZE random bytes.
+
+  void rotate(kj::ArrayPtr<const byte> key);
+  // Makes `key` (KEY_SIZE bytes) the one used for new tickets, dropping the oldest key if there
+  // are more than `maxKeys`.
+
+  void setKeys(kj::ArrayPtr<const kj::ArrayPtr<const byte>> keys);
+  // Replaces all keys, e.g. with ones distributed by some other system. The first is used for new
+  // tickets. At most `maxKeys` are kept.
+
+private:
+  struct Key {
+    byte name[16];
+    byte hmacKey[32];
+    byte aesKey[32];
+  };
+
+  uint maxKeys;
+  kj::MutexGuarded<kj::Vector<Key>> keys;
+
+  static Key parseKey(kj::ArrayPtr<const byte> key);
+
+  friend class TlsContext;
 };
 
 class TlsPrivateKey {
@@ -229,4 +340,19 @@ public:
   // TlsContext::Options::defaultKeypair.
 };
 
+kj::Maybe<kj::StringPtr> getTlsAlpnProtocol(kj::AsyncIoStream& stream);
+// If `stream` was returned by TlsContext::wrapClient() or wrapServer() (or accepted or connected
+// through wrapPort() or wrapNetwork()) and the handshake negotiated an application protocol via
+// ALPN, returns that protocol's name. Otherwise returns null, including for non-TLS streams.
+//
+// An HTTP server might use this to decide between HttpServer::listenHttp() and listenHttp2().
+
+bool isTlsSessionResumed(kj::AsyncIoStream& stream);
+// True if `stream` is a TLS stream like those above whose handshake resumed an earlier session
+// rather than doing a full handshake.
+
+bool isTlsKernelOffloaded(kj::AsyncIoStream& stream);
+// True if `stream` is a TLS stream like those above whose outgoing data the kernel encrypts, per
+// TlsContext::Options::kernelOffload.
+
 } // namespace kj
@@ -0,0 +1,168 @@
+// Copyright (c) 2017 Cloudflare, Inc. and contributors
+// Licensed under the MIT License:
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+#if KJ_HAS_ZSTD
+
+#include "zstd.h"
+#include <kj/debug.h>
+
+namespace kj {
+
+namespace {
+
+class ZstdCompressor final: public Compressor {
+public:
+  ZstdCompressor(ZSTD_CCtx* ctx, Vector<ZSTD_CCtx*>& pool, uint maxIdle)
+      : ctx(ctx), pool(pool), maxIdle(maxIdle) {}
+  KJ_DISALLOW_COPY(ZstdCompressor);
+
+  ~ZstdCompressor() noexcept(false) {
+    if (pool.size() < maxIdle &&
+        !ZSTD_isError(ZSTD_CCtx_reset(ctx, ZSTD_reset_session_only))) {
+      pool.add(ctx);
+    } else {
+      ZSTD_freeCCtx(ctx);
+    }
+  }
+
+  bool compress(ArrayPtr<const byte>& input, ArrayPtr<byte>& output, Flush flush) override {
+    ZSTD_inBuffer in = { input.begin(), input.size(), 0 };
+    ZSTD_outBuffer out = { output.begin(), output.size(), 0 };
+    ZSTD_EndDirective mode = flush == Flush::NONE ? ZSTD_e_continue
+                           : flush == Flush::SYNC ? ZSTD_e_flush : ZSTD_e_end;
+
+    size_t remaining = ZSTD_compressStream2(ctx, &out, &in, mode);
+
+    input = input.slice(in.pos, input.size());
+    output = output.slice(out.pos, output.size());
+
+    if (ZSTD_isError(remaining)) {
+      KJ_FAIL_REQUIRE("zstd compression failed", ZSTD_getErrorName(remaining));
+    }
+
+    // For ZSTD_e_flush and ZSTD_e_end, `remaining` is what's still buffered inside the context.
+    return input.size() == 0 && (mode == ZSTD_e_continue || remaining == 0);
+  }
+
+private:
+  ZSTD_CCtx* ctx;
+  Vector<ZSTD_CCtx*>& pool;
+  uint maxIdle;
+};
+
+class ZstdDecompressor final: public Decompressor {
+public:
+  ZstdDecompressor(ZSTD_DCtx* ctx, Vector<ZSTD_DCtx*>& pool, uint maxIdle)
+      : ctx(ctx), pool(pool), maxIdle(maxIdle) {}
+  KJ_DISALLOW_COPY(ZstdDecompressor);
+
+  ~ZstdDecompressor() noexcept(false) {
+    if (pool.size() < maxIdle &&
+        !ZSTD_isError(ZSTD_DCtx_reset(ctx, ZSTD_reset_session_only))) {
+      pool.add(ctx);
+    } else {
+      ZSTD_freeDCtx(ctx);
+    }
+  }
+
+  bool decompress(ArrayPtr<const byte>& input, ArrayPtr<byte>& output) override {
+    while (output.size() > 0) {
+      ZSTD_inBuffer in = { input.begin(), input.size(), 0 };
+      ZSTD_outBuffer out = { output.begin(), output.size(), 0 };
+
+      size_t hint = ZSTD_decompressStream(ctx, &out, &in);
+
+      input = input.slice(in.pos, input.size());
+      output = output.slice(out.pos, output.size());
+
+      if (ZSTD_isError(hint)) {
+        KJ_FAIL_REQUIRE("zstd decompression failed", ZSTD_getErrorName(hint));
+      }
+
+      // Zero means a frame was completely decoded and flushed.  Any further input is the start of
+      // another frame, which the context picks up automatically.
+      if (in.pos == 0 && out.pos == 0) break;
+      atFrameEnd = hint == 0;
+      if (input.size() == 0) break;
+    }
+    return atFrameEnd;
+  }
+
+private:
+  ZSTD_DCtx* ctx;
+  Vector<ZSTD_DCtx*>& pool;
+  uint maxIdle;
+  bool atFrameEnd = false;
+};
+
+}  // namespace
+
+ZstdCodec::ZstdCodec(int compressionLevel, uint maxIdleContexts)
+    : compressionLevel(compressionLevel), maxIdleContexts(maxIdleContexts) {}
+
+ZstdCodec::~ZstdCodec() noexcept(false) {
+  for (auto ctx: idleCompressors) ZSTD_freeCCtx(ctx);
+  for (auto ctx: idleDecompressors) ZSTD_freeDCtx(ctx);
+}
+
+StringPtr ZstdCodec::getName() const {
+  return "zstd";
+}
+
+Own<Compressor> ZstdCodec::newCompressor() {
+  ZSTD_CCtx* ctx;
+  if (idleCompressors.empty()) {
+    ctx = ZSTD_createCCtx();
+    KJ_ASSERT(ctx != nullptr, "ZSTD_createCCtx() failed");
+    size_t result = ZSTD_CCtx_setParameter(ctx, ZSTD_c_compressionLevel, compressionLevel);
+    if (ZSTD_isError(result)) {
+      ZSTD_freeCCtx(ctx);
+      KJ_FAIL_REQUIRE("invalid zstd compression level", compressionLevel,
+                      ZSTD_getErrorName(result));
+    }
+  } else {
+    ctx = idleCompressors.back();
+    idleCompressors.removeLast();
+  }
+  return kj::heap<ZstdCompressor>(ctx, idleCompressors, maxIdleContexts);
+}
+
+Own<Decompressor> ZstdCodec::newDecompressor() {
+  ZSTD_DCtx* ctx;
+  if (idleDecompressors.empty()) {
+    ctx = ZSTD_createDCtx();
+    KJ_ASSERT(ctx != nullptr, "ZSTD_createDCtx() failed");
+  } else {
+    ctx = idleDecompressors.back();
+    idleDecompressors.removeLast();
+  }
+  return kj::heap<ZstdDecompressor>(ctx, idleDecompressors, maxIdleContexts);
+}
+
+ZstdAsyncInputStream::ZstdAsyncInputStream(AsyncInputStream& inner, ZstdCodec& codec)
+    : DecompressingAsyncInputStream(inner, codec.newDecompressor(), "zstd") {}
+
+ZstdAsyncOutputStream::ZstdAsyncOutputStream(AsyncOutputStream& inner, ZstdCodec& codec)
+    : CompressingAsyncOutputStream(inner, codec.newCompressor()) {}
+
+}  // namespace kj
+
+#endif  // KJ_HAS_ZSTD
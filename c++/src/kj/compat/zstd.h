@@ -0,0 +1,63 @@
+// Copyright (c) 2017 Cloudflare, Inc. and contributors
+// Licensed under the MIT License:
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+#pragma once
+
+#include "compression.h"
+#include <kj/vector.h>
+#include <zstd.h>
+
+namespace kj {
+
+class ZstdCodec final: public CompressionCodec {
+  // The Zstandard format, via libzstd.  At level 1 it compresses about as well as gzip's default
+  // level at several times the speed, and decompresses faster still, which makes it a good
+  // default where both ends support it.
+  //
+  // Like GzipCodec, keeps idle contexts for reuse.  Not thread-safe.
+
+public:
+  explicit ZstdCodec(int compressionLevel = 1, uint maxIdleContexts = 8);
+  ~ZstdCodec() noexcept(false);
+  KJ_DISALLOW_COPY(ZstdCodec);
+
+  StringPtr getName() const override;
+  Own<Compressor> newCompressor() override;
+  Own<Decompressor> newDecompressor() override;
+
+private:
+  int compressionLevel;
+  uint maxIdleContexts;
+  Vector<ZSTD_CCtx*> idleCompressors;
+  Vector<ZSTD_DCtx*> idleDecompressors;
+};
+
+class ZstdAsyncInputStream final: public DecompressingAsyncInputStream {
+public:
+  ZstdAsyncInputStream(AsyncInputStream& inner, ZstdCodec& codec);
+};
+
+class ZstdAsyncOutputStream final: public CompressingAsyncOutputStream {
+public:
+  ZstdAsyncOutputStream(AsyncOutputStream& inner, ZstdCodec& codec);
+};
+
+}  // namespace kj
@@ -319,7 +319,16 @@ static String makeDescriptionImpl(DescriptionStyle style, const char* code, int
 
 void Debug::logInternal(const char* file, int line, LogSeverity severity, const char* macroArgs,
                         ArrayPtr<String> argValues) {
-  getExceptionCallback().logMessage(severity, trimSourceFilename(file).cStr(), line, 0,
+  const char* trimmed = trimSourceFilename(file).cStr();
+
+  // If nothing on this thread could intercept the message, give the log sink a chance to take the
+  // raw arguments and do the formatting itself.
+  LogSink* sink = getDeferredLogSink();
+  if (sink != nullptr && sink->writeDeferred(severity, trimmed, line, macroArgs, argValues)) {
+    return;
+  }
+
+  getExceptionCallback().logMessage(severity, trimmed, line, 0,
       makeDescriptionImpl(LOG, nullptr, 0, nullptr, macroArgs, argValues));
 }
 
@@ -386,6 +395,14 @@ void Debug::Fault::init(
 #endif
 
 String Debug::makeDescriptionInternal(const char* macroArgs, ArrayPtr<String> argValues) {
+  if (argValues.size() == 1) {
+    // Fast path for the common `KJ_EXCEPTION(TYPE, "message")`: a lone string literal isn't
+    // prefixed with its name, so the description is just the literal itself.
+    const char* start = macroArgs;
+    while (isspace(*start)) ++start;
+    if (*start == '\"') return kj::mv(argValues[0]);
+  }
+
   return makeDescriptionImpl(LOG, nullptr, 0, nullptr, macroArgs, argValues);
 }
 
@@ -478,12 +478,15 @@ public:
   template <typename... Params>
   static String makeDescription(const char* macroArgs, Params&&... params);
 
+  static String makeDescriptionInternal(const char* macroArgs, ArrayPtr<String> argValues);
+  // Like makeDescription() but with the arguments already stringified.  Used by log sinks that
+  // format KJ_LOG() messages lazily; see LogSink::writeDeferred().
+
 private:
   static LogSeverity minSeverity;
 
   static void logInternal(const char* file, int line, LogSeverity severity, const char* macroArgs,
                           ArrayPtr<String> argValues);
-  static String makeDescriptionInternal(const char* macroArgs, ArrayPtr<String> argValues);
 
   static int getOsErrorNumber(bool nonblocking);
   // Get the error code of the last error (e.g. from errno).  Returns -1 on EINTR.
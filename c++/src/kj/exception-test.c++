@@ -22,6 +22,7 @@
 #include "exception.h"
 #include "debug.h"
 #include <kj/compat/gtest.h>
+#include <chrono>
 
 namespace kj {
 namespace _ {  // private
@@ -174,6 +175,88 @@ KJ_TEST("getStackTrace() returns correct line number, not line + 1") {
   KJ_ASSERT(strstr(trace.cStr(), wrong.cStr()) == nullptr, trace, wrong);
 }
 
+class NoTraceForDisconnected: public ExceptionCallback {
+public:
+  StackTraceMode stackTraceModeFor(Exception::Type type) override {
+    if (type == Exception::Type::DISCONNECTED) return StackTraceMode::NONE;
+    return next.stackTraceModeFor(type);
+  }
+};
+
+KJ_TEST("stackTraceModeFor() can disable trace capture per exception type") {
+  NoTraceForDisconnected callback;
+
+  KJ_IF_MAYBE(e, kj::runCatchingExceptions([]() {
+    kj::throwRecoverableException(KJ_EXCEPTION(DISCONNECTED, "peer disconnected"));
+  })) {
+    KJ_EXPECT(e->getStackTrace().size() == 0);
+    KJ_EXPECT(e->getDescription() == "peer disconnected");
+    KJ_EXPECT(e->getFile() == StringPtr("kj/exception-test.c++"));
+  } else {
+    KJ_FAIL_EXPECT("should have thrown");
+  }
+
+#if __linux__ && __GLIBC__
+  KJ_IF_MAYBE(e, kj::runCatchingExceptions([]() {
+    kj::throwRecoverableException(KJ_EXCEPTION(FAILED, "broken"));
+  })) {
+    KJ_EXPECT(e->getStackTrace().size() > 0);
+  } else {
+    KJ_FAIL_EXPECT("should have thrown");
+  }
+#endif
+}
+
+template <typename Func>
+double nsPerIteration(uint iterations, Func&& func) {
+  auto start = std::chrono::steady_clock::now();
+  for (uint i = 0; i < iterations; i++) {
+    func(i);
+  }
+  auto elapsed = std::chrono::steady_clock::now() - start;
+  return std::chrono::duration<double, std::nano>(elapsed).count() / iterations;
+}
+
+KJ_TEST("KJ_EXCEPTION benchmark") {
+  // Not a pass/fail test; logs the cost of creating and throwing exceptions. Run with --verbose
+  // to see the results.
+
+  constexpr uint ITERATIONS = 20000;
+
+  auto construct = nsPerIteration(ITERATIONS, [](uint) {
+    auto e = KJ_EXCEPTION(OVERLOADED, "operation timed out");
+  });
+  auto constructWithArgs = nsPerIteration(ITERATIONS, [](uint i) {
+    auto e = KJ_EXCEPTION(DISCONNECTED, "peer disconnected", i);
+  });
+  auto copy = nsPerIteration(ITERATIONS, [](uint) {
+    static const Exception original = KJ_EXCEPTION(FAILED, "original", 123);
+    Exception e = original;
+  });
+  auto throwAndCatch = nsPerIteration(ITERATIONS, [](uint) {
+    KJ_IF_MAYBE(e, kj::runCatchingExceptions([]() {
+      kj::throwRecoverableException(KJ_EXCEPTION(DISCONNECTED, "peer disconnected"));
+    })) {
+      KJ_ASSERT(e->getFile() != nullptr);
+    }
+  });
+
+  double throwAndCatchNoTrace;
+  {
+    NoTraceForDisconnected callback;
+    throwAndCatchNoTrace = nsPerIteration(ITERATIONS, [](uint) {
+      KJ_IF_MAYBE(e, kj::runCatchingExceptions([]() {
+        kj::throwRecoverableException(KJ_EXCEPTION(DISCONNECTED, "peer disconnected"));
+      })) {
+        KJ_ASSERT(e->getStackTrace().size() == 0);
+      }
+    });
+  }
+
+  KJ_LOG(INFO, "KJ_EXCEPTION benchmark (ns per iteration)",
+         construct, constructWithArgs, copy, throwAndCatch, throwAndCatchNoTrace);
+}
+
 }  // namespace
 }  // namespace _ (private)
 }  // namespace kj
@@ -30,6 +30,7 @@
 #include <new>
 #include <signal.h>
 #include <stdint.h>
+#include <atomic>
 #ifndef _WIN32
 #include <sys/mman.h>
 #endif
@@ -579,11 +580,10 @@ String KJ_STRINGIFY(const Exception& e) {
 }
 
 Exception::Exception(Type type, const char* file, int line, String description) noexcept
-    : file(trimSourceFilename(file).cStr()), line(line), type(type), description(mv(description)),
-      traceCount(0) {}
+    : file(file), line(line), type(type), description(mv(description)), traceCount(0) {}
 
 Exception::Exception(Type type, String file, int line, String description) noexcept
-    : ownFile(kj::mv(file)), file(trimSourceFilename(ownFile).cStr()), line(line), type(type),
+    : ownFile(kj::mv(file)), file(ownFile.cStr()), line(line), type(type),
       description(mv(description)), traceCount(0) {}
 
 Exception::Exception(const Exception& other) noexcept
@@ -603,6 +603,10 @@ Exception::Exception(const Exception& other) noexcept
 
 Exception::~Exception() noexcept {}
 
+const char* Exception::getFile() const {
+  return trimSourceFilename(file).cStr();
+}
+
 Exception::Context::Context(const Context& other) noexcept
     : file(other.file), line(other.line), description(str(other.description)) {
   KJ_IF_MAYBE(n, other.next) {
@@ -615,6 +619,10 @@ void Exception::wrapContext(const char* file, int line, String&& description) {
 }
 
 void Exception::extendTrace(uint ignoreCount) {
+  if (getExceptionCallback().stackTraceModeFor(type) == ExceptionCallback::StackTraceMode::NONE) {
+    return;
+  }
+
   KJ_STACK_ARRAY(void*, newTraceSpace, kj::size(trace) + ignoreCount + 1,
       sizeof(trace)/sizeof(trace[0]) + 8, 128);
 
@@ -732,10 +740,44 @@ ExceptionCallback::StackTraceMode ExceptionCallback::stackTraceMode() {
   return next.stackTraceMode();
 }
 
+ExceptionCallback::StackTraceMode ExceptionCallback::stackTraceModeFor(Exception::Type type) {
+  return next.stackTraceModeFor(type);
+}
+
 Function<void(Function<void()>)> ExceptionCallback::getThreadInitializer() {
   return next.getThreadInitializer();
 }
 
+namespace {
+
+std::atomic<LogSink*> globalLogSink(nullptr);
+
+}  // namespace
+
+bool LogSink::writeDeferred(LogSeverity severity, const char* file, int line,
+                            const char* macroArgs, ArrayPtr<String> argValues) {
+  return false;
+}
+
+Maybe<LogSink&> setLogSink(Maybe<LogSink&> sink) {
+  LogSink* ptr = nullptr;
+  KJ_IF_MAYBE(s, sink) {
+    ptr = s;
+  }
+
+  LogSink* previous = globalLogSink.exchange(ptr, std::memory_order_acq_rel);
+  if (previous == nullptr) {
+    return nullptr;
+  } else {
+    return *previous;
+  }
+}
+
+LogSink* _::getDeferredLogSink() {
+  if (threadLocalCallback != nullptr) return nullptr;
+  return globalLogSink.load(std::memory_order_acquire);
+}
+
 class ExceptionCallback::RootExceptionCallback: public ExceptionCallback {
 public:
   RootExceptionCallback(): ExceptionCallback(*this) {}
@@ -767,6 +809,12 @@ public:
 
   void logMessage(LogSeverity severity, const char* file, int line, int contextDepth,
                   String&& text) override {
+    LogSink* sink = globalLogSink.load(std::memory_order_acquire);
+    if (sink != nullptr) {
+      sink->write(severity, file, line, contextDepth, mv(text));
+      return;
+    }
+
     text = str(kj::repeat('_', contextDepth), file, ":", line, ": ", severity, ": ",
                mv(text), '\n');
 
@@ -790,6 +838,12 @@ public:
 #endif
   }
 
+  StackTraceMode stackTraceModeFor(Exception::Type type) override {
+    // Defer to the top of the stack, so that callbacks which only override stackTraceMode() are
+    // still respected.
+    return getExceptionCallback().stackTraceMode();
+  }
+
   Function<void(Function<void()>)> getThreadInitializer() override {
     return [](Function<void()> func) {
       // No initialization needed since RootExceptionCallback is automatically the root callback
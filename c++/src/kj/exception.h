@@ -75,7 +75,7 @@ public:
   Exception(Exception&& other) = default;
   ~Exception() noexcept;
 
-  const char* getFile() const { return file; }
+  const char* getFile() const;
   int getLine() const { return line; }
   Type getType() const { return type; }
   StringPtr getDescription() const { return description; }
@@ -109,7 +109,8 @@ public:
 
   KJ_NOINLINE void extendTrace(uint ignoreCount);
   // Append the current stack trace to the exception's trace, ignoring the first `ignoreCount`
-  // frames (see `getStackTrace()` for discussion of `ignoreCount`).
+  // frames (see `getStackTrace()` for discussion of `ignoreCount`).  Does nothing if the current
+  // ExceptionCallback's stackTraceModeFor() this exception's type is NONE.
 
   KJ_NOINLINE void truncateCommonTrace();
   // Remove the part of the stack trace which the exception shares with the caller of this method.
@@ -123,6 +124,9 @@ public:
 private:
   String ownFile;
   const char* file;
+  // Untrimmed; getFile() applies trimSourceFilename() on demand, since most exceptions are never
+  // asked for their file name.
+
   int line;
   Type type;
   String description;
@@ -216,6 +220,19 @@ public:
   virtual StackTraceMode stackTraceMode();
   // Returns the current preferred stack trace mode.
 
+  virtual StackTraceMode stackTraceModeFor(Exception::Type type);
+  // Returns the stack trace mode to use when throwing an exception of the given type.  Only
+  // NONE is treated specially: it means the trace is not captured at all.
+  //
+  // Capturing a trace means unwinding the stack, which costs several microseconds -- typically
+  // more than everything else involved in creating and throwing the exception.  Some types are
+  // raised routinely on normal control paths, e.g. DISCONNECTED whenever a peer goes away and
+  // OVERLOADED on every timeout, and the traces of these are rarely interesting.  Override this
+  // to return NONE for such types.  (Traces are only ever captured as raw addresses; symbolizing
+  // them is deferred until the exception is stringified.)
+  //
+  // The global default implementation returns the current stackTraceMode().
+
   virtual Function<void(Function<void()>)> getThreadInitializer();
   // Called just before a new thread is spawned using kj::Thread. Returns a function which should
   // be invoked inside the new thread to initialize the thread's ExceptionCallback. The initializer
@@ -236,6 +253,46 @@ private:
 ExceptionCallback& getExceptionCallback();
 // Returns the current exception callback.
 
+class LogSink {
+  // Destination for log messages that reach the root ExceptionCallback, i.e. that no
+  // ExceptionCallback installed on the logging thread intercepted.  By default such messages are
+  // written synchronously to stderr; setLogSink() redirects them.  See kj/log-sink.h for a sink
+  // which writes from a background thread.
+  //
+  // A sink may be called from any number of threads concurrently.
+
+public:
+  virtual void write(LogSeverity severity, const char* file, int line, int contextDepth,
+                     String&& text) = 0;
+  // Log a message.  `text` is the message body, without the "file:line: severity: " prefix.
+  //
+  // A FATAL message is usually followed immediately by abort(), so a sink must have written it
+  // out, not merely queued it, by the time write() returns.
+
+  virtual bool writeDeferred(LogSeverity severity, const char* file, int line,
+                             const char* macroArgs, ArrayPtr<String> argValues);
+  // Called by KJ_LOG() in place of write() when the logging thread has no ExceptionCallback of its
+  // own, before the stringified arguments have been assembled into a message.  The sink may move
+  // the strings out of `argValues` and build the message later -- possibly on another thread --
+  // with _::Debug::makeDescriptionInternal(macroArgs, argValues).  `macroArgs` is a string
+  // literal.
+  //
+  // Returns false to decline, in which case the message is assembled immediately and passed to
+  // write().  The default implementation always declines.
+};
+
+Maybe<LogSink&> setLogSink(Maybe<LogSink&> sink);
+// Installs a process-wide log sink, returning the previous one.  Pass null to go back to writing
+// to stderr.  The sink must stay alive until no thread could still be logging through it.
+
+namespace _ {  // private
+
+LogSink* getDeferredLogSink();
+// Returns the installed log sink if the calling thread has no ExceptionCallback of its own (so
+// that nothing could want to intercept the message), or null otherwise.
+
+}  // namespace _ (private)
+
 KJ_NOINLINE KJ_NORETURN(void throwFatalException(kj::Exception&& exception, uint ignoreCount = 0));
 // Invoke the exception callback to throw the given fatal exception.  If the exception callback
 // returns, abort.
@@ -0,0 +1,112 @@
+// Copyright (c) 2017 Sandstorm Development Group, Inc. and contributors
+// Licensed under the MIT License:
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+#pragma once
+
+#if defined(__GNUC__) && !KJ_HEADER_WARNINGS
+#pragma GCC system_header
+#endif
+
+#include "string.h"
+#include <stdint.h>
+
+namespace kj {
+
+// =======================================================================================
+// kj::hashCode()
+//
+// Computes a 32-bit hash code for a value, for use by kj::HashMap and kj::HashSet (see map.h).
+// Overloads are provided for integers, pointers, strings, and byte arrays.  Any class type with a
+// `hashCode()` member function can be hashed too, as can several values at once:
+//
+//     struct Point {
+//       int x, y;
+//       bool operator==(const Point& other) const { return x == other.x && y == other.y; }
+//       uint hashCode() const { return kj::hashCode(x, y); }
+//     };
+//
+// The hash codes produced for integers and pointers are deliberately cheap -- often just the
+// value itself -- so the hash table must not use them directly as a table index.  HashMap
+// scrambles them first.
+//
+// Note that `const char*` is hashed as a NUL-terminated string, not as a pointer, so that lookups
+// by string literal hash the same as StringPtr keys.
+
+namespace _ {  // private
+
+uint hashBytes(const void* bytes, size_t size);
+// MurmurHash2 of the given bytes.
+
+}  // namespace _ (private)
+
+inline uint hashCode(bool value) { return value; }
+inline uint hashCode(char value) { return value; }
+inline uint hashCode(signed char value) { return value; }
+inline uint hashCode(unsigned char value) { return value; }
+inline uint hashCode(short value) { return value; }
+inline uint hashCode(unsigned short value) { return value; }
+inline uint hashCode(int value) { return value; }
+inline uint hashCode(unsigned int value) { return value; }
+inline uint hashCode(long value) {
+  return sizeof(value) > sizeof(uint) ? uint(value ^ (value >> 32)) : uint(value);
+}
+inline uint hashCode(unsigned long value) {
+  return sizeof(value) > sizeof(uint) ? uint(value ^ (value >> 32)) : uint(value);
+}
+inline uint hashCode(long long value) { return uint(value ^ (value >> 32)); }
+inline uint hashCode(unsigned long long value) { return uint(value ^ (value >> 32)); }
+
+template <typename T>
+inline uint hashCode(T* pointer) {
+  return hashCode(reinterpret_cast<uintptr_t>(pointer));
+}
+
+inline uint hashCode(ArrayPtr<const byte> bytes) {
+  return _::hashBytes(bytes.begin(), bytes.size());
+}
+inline uint hashCode(ArrayPtr<const char> chars) {
+  return _::hashBytes(chars.begin(), chars.size());
+}
+inline uint hashCode(StringPtr string) {
+  return _::hashBytes(string.begin(), string.size());
+}
+inline uint hashCode(const String& string) {
+  return _::hashBytes(string.begin(), string.size());
+}
+inline uint hashCode(const char* string) {
+  return hashCode(StringPtr(string));
+}
+inline uint hashCode(char* string) {
+  return hashCode(StringPtr(string));
+}
+
+template <typename T>
+inline auto hashCode(const T& value) -> decltype(uint(value.hashCode())) {
+  return value.hashCode();
+}
+
+template <typename T, typename U, typename... Rest>
+inline uint hashCode(const T& first, const U& second, const Rest&... rest) {
+  // Combines the hash codes of several values.
+  return hashCode(first) * 31 + hashCode(second, rest...);
+}
+
+}  // namespace kj
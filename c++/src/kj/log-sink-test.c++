@@ -0,0 +1,179 @@
+// Copyright (c) 2017 Sandstorm Development Group, Inc. and contributors
+// Licensed under the MIT License:
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+#include "log-sink.h"
+
+#if KJ_USE_FUTEX
+
+#include "debug.h"
+#include "io.h"
+#include "thread.h"
+#include "test.h"
+#include <unistd.h>
+#include <fcntl.h>
+#include <string.h>
+
+namespace kj {
+namespace {
+
+struct Pipe {
+  AutoCloseFd readEnd;
+  AutoCloseFd writeEnd;
+
+  Pipe() {
+    int fds[2];
+    KJ_SYSCALL(pipe(fds));
+    readEnd = AutoCloseFd(fds[0]);
+    writeEnd = AutoCloseFd(fds[1]);
+    KJ_SYSCALL(fcntl(readEnd, F_SETFL, O_NONBLOCK));
+  }
+
+  String readAvailable() {
+    Vector<char> result;
+    char buffer[4096];
+    for (;;) {
+      ssize_t n = ::read(readEnd, buffer, sizeof(buffer));
+      if (n <= 0) break;
+      result.addAll(buffer, buffer + n);
+    }
+    result.add('\0');
+    return String(result.releaseAsArray());
+  }
+};
+
+bool contains(StringPtr haystack, const char* needle) {
+  return strstr(haystack.cStr(), needle) != nullptr;
+}
+
+void logFromOtherThread(uint count) {
+  // The test runner installs an ExceptionCallback on the main thread which intercepts logging,
+  // but new threads start out with only the root callback, which forwards to the sink.
+  Thread([count]() {
+    for (uint i = 0; i < count; i++) {
+      int value = 123 + i;
+      KJ_LOG(WARNING, "async log test", value);
+    }
+  });
+}
+
+KJ_TEST("AsyncLogSink writes lines from a background thread") {
+  Pipe pipe;
+
+  AsyncLogSink::Options options;
+  options.fd = pipe.writeEnd;
+
+  AsyncLogSink sink(options);
+  logFromOtherThread(3);
+  sink.flush();
+
+  auto text = pipe.readAvailable();
+  KJ_EXPECT(contains(text, "log-sink-test.c++:"), text);
+  KJ_EXPECT(contains(text, ": warning: async log test; value = 123\n"), text);
+  KJ_EXPECT(contains(text, "value = 125\n"), text);
+
+  auto stats = sink.getStats();
+  KJ_EXPECT(stats.written == 3);
+  KJ_EXPECT(stats.dropped == 0);
+  KJ_EXPECT(stats.rateLimited == 0);
+}
+
+KJ_TEST("AsyncLogSink deferred formatting") {
+  Pipe pipe;
+
+  AsyncLogSink::Options options;
+  options.fd = pipe.writeEnd;
+  options.deferFormatting = true;
+
+  AsyncLogSink sink(options);
+  logFromOtherThread(2);
+  sink.flush();
+
+  auto text = pipe.readAvailable();
+  KJ_EXPECT(contains(text, ": warning: async log test; value = 123\n"), text);
+  KJ_EXPECT(contains(text, ": warning: async log test; value = 124\n"), text);
+  KJ_EXPECT(sink.getStats().written == 2);
+}
+
+KJ_TEST("AsyncLogSink rate limiting") {
+  Pipe pipe;
+
+  AsyncLogSink::Options options;
+  options.fd = pipe.writeEnd;
+  options.maxLinesPerSecond = 3;
+
+  AsyncLogSink sink(options);
+  logFromOtherThread(10);
+  sink.flush();
+
+  auto text = pipe.readAvailable();
+  KJ_EXPECT(contains(text, "value = 125\n"), text);
+  KJ_EXPECT(!contains(text, "value = 126\n"), text);
+  KJ_EXPECT(contains(text, "dropped 0 log lines because the queue was full and 7 due to rate "
+                           "limiting"), text);
+
+  auto stats = sink.getStats();
+  KJ_EXPECT(stats.written == 3);
+  KJ_EXPECT(stats.rateLimited == 7);
+}
+
+KJ_TEST("AsyncLogSink writes errors synchronously when asked") {
+  Pipe pipe;
+
+  AsyncLogSink::Options options;
+  options.fd = pipe.writeEnd;
+  options.syncErrors = true;
+
+  AsyncLogSink sink(options);
+  Thread([]() {
+    KJ_LOG(WARNING, "queued first");
+    KJ_LOG(ERROR, "written synchronously");
+  });
+
+  // No flush(): the ERROR line, and the WARNING queued ahead of it, were written before KJ_LOG()
+  // returned.
+  auto text = pipe.readAvailable();
+  auto warning = strstr(text.cStr(), "queued first");
+  auto error = strstr(text.cStr(), ": error: written synchronously\n");
+  KJ_ASSERT(warning != nullptr, text);
+  KJ_ASSERT(error != nullptr, text);
+  KJ_EXPECT(warning < error, text);
+  KJ_EXPECT(sink.getStats().written == 2);
+}
+
+KJ_TEST("AsyncLogSink restores the previous sink") {
+  Pipe pipe;
+
+  {
+    AsyncLogSink::Options options;
+    options.fd = pipe.writeEnd;
+    AsyncLogSink sink(options);
+    logFromOtherThread(1);
+    // No flush(): the destructor writes out whatever is pending.
+  }
+
+  KJ_EXPECT(contains(pipe.readAvailable(), "value = 123\n"));
+  KJ_EXPECT(_::getDeferredLogSink() == nullptr);
+}
+
+}  // namespace
+}  // namespace kj
+
+#endif  // KJ_USE_FUTEX
@@ -0,0 +1,401 @@
+// Copyright (c) 2017 Sandstorm Development Group, Inc. and contributors
+// Licensed under the MIT License:
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+#include "log-sink.h"
+
+#if KJ_USE_FUTEX
+
+#include "debug.h"
+#include "io.h"
+#include "thread.h"
+#include "vector.h"
+#include <atomic>
+#include <chrono>
+
+namespace kj {
+
+namespace {
+
+struct Record {
+  LogSeverity severity;
+  const char* file;
+  int line;
+  int contextDepth;
+
+  String text;
+  // The message body.  Null if formatting was deferred.
+
+  const char* macroArgs;
+  Array<String> argValues;
+  // The raw KJ_LOG() arguments, if formatting was deferred.
+
+  Record(LogSeverity severity, const char* file, int line, int contextDepth, String&& text)
+      : severity(severity), file(file), line(line), contextDepth(contextDepth),
+        text(kj::mv(text)), macroArgs(nullptr) {}
+  Record(LogSeverity severity, const char* file, int line,
+         const char* macroArgs, Array<String>&& argValues)
+      : severity(severity), file(file), line(line), contextDepth(0),
+        macroArgs(macroArgs), argValues(kj::mv(argValues)) {}
+
+  String format() {
+    if (macroArgs != nullptr) {
+      text = _::Debug::makeDescriptionInternal(macroArgs, argValues);
+    }
+    return str(kj::repeat('_', contextDepth), file, ":", line, ": ", severity, ": ",
+               text, '\n');
+  }
+};
+
+struct ThreadRing {
+  // Single-producer, single-consumer queue of records.  The producer is whichever thread currently
+  // owns the ring; the consumer is the sink's writer thread.
+  //
+  // Rings are never freed.  When a thread exits its ring is marked orphaned, and the next thread
+  // that needs a ring adopts it, so the number of rings is bounded by the peak number of threads
+  // that have logged concurrently, and a ring pointer can be dereferenced at any time.
+
+  Record* slots[AsyncLogSink::RING_SIZE];
+
+  std::atomic<uint64_t> head { 0 };
+  // Index of the next slot to read.  Advanced only by the consumer.
+
+  std::atomic<uint64_t> tail { 0 };
+  // Index of the next slot to write.  Advanced only by the producer.
+
+  std::atomic<uint64_t> dropped { 0 };
+  std::atomic<uint64_t> rateLimited { 0 };
+
+  std::atomic<bool> orphaned { false };
+
+  std::chrono::steady_clock::time_point windowStart;
+  uint windowCount = 0;
+  // Rate limiting state.  Touched only by the producer.
+
+  ThreadRing* next = nullptr;
+  // Next ring in `allRings`.  Immutable once the ring has been published.
+};
+
+std::atomic<ThreadRing*> allRings(nullptr);
+
+struct RingHolder {
+  ThreadRing* ring = nullptr;
+
+  ~RingHolder() {
+    if (ring != nullptr) ring->orphaned.store(true, std::memory_order_release);
+  }
+};
+
+thread_local RingHolder threadRing;
+
+ThreadRing& getThreadRing() {
+  if (threadRing.ring != nullptr) return *threadRing.ring;
+
+  // Adopt an orphaned ring if there is one.
+  for (ThreadRing* ring = allRings.load(std::memory_order_acquire); ring != nullptr;
+       ring = ring->next) {
+    bool expected = true;
+    if (ring->orphaned.compare_exchange_strong(expected, false, std::memory_order_acq_rel)) {
+      threadRing.ring = ring;
+      return *ring;
+    }
+  }
+
+  ThreadRing* ring = new ThreadRing;
+  ring->next = allRings.load(std::memory_order_relaxed);
+  while (!allRings.compare_exchange_weak(ring->next, ring, std::memory_order_release,
+                                         std::memory_order_relaxed)) {}
+  threadRing.ring = ring;
+  return *ring;
+}
+
+std::atomic<bool> sinkExists(false);
+
+}  // namespace
+
+struct AsyncLogSink::Impl {
+  struct State {
+    uint64_t wakeups = 0;
+    // Bumped by loggers to wake the writer when it is idle.
+
+    uint64_t flushRequested = 0;
+    uint64_t flushCompleted = 0;
+
+    uint64_t written = 0;
+    bool shutdown = false;
+  };
+
+  Options options;
+  Maybe<LogSink&> previousSink;
+  MutexGuarded<State> state;
+
+  std::atomic<bool> writerIdle { false };
+  // Set by the writer before it goes to sleep, so that loggers know they must wake it.
+
+  uint64_t droppedBaseline;
+  uint64_t rateLimitedBaseline;
+  uint64_t droppedReported;
+  uint64_t rateLimitedReported;
+  // Ring counters are process-wide; this sink's stats are relative to its construction.
+
+  Own<Thread> writer;
+
+  explicit Impl(Options options): options(options) {
+    uint64_t dropped = 0, rateLimited = 0;
+    sumDropCounters(dropped, rateLimited);
+    droppedBaseline = droppedReported = dropped;
+    rateLimitedBaseline = rateLimitedReported = rateLimited;
+  }
+
+  static void sumDropCounters(uint64_t& dropped, uint64_t& rateLimited) {
+    for (ThreadRing* ring = allRings.load(std::memory_order_acquire); ring != nullptr;
+         ring = ring->next) {
+      dropped += ring->dropped.load(std::memory_order_relaxed);
+      rateLimited += ring->rateLimited.load(std::memory_order_relaxed);
+    }
+  }
+
+  bool admit(ThreadRing& ring) {
+    // Decides whether the calling thread may enqueue another line.  Called before the record is
+    // allocated so that rejected lines cost as little as possible.
+
+    if (options.maxLinesPerSecond != 0) {
+      auto now = std::chrono::steady_clock::now();
+      if (now - ring.windowStart >= std::chrono::seconds(1)) {
+        ring.windowStart = now;
+        ring.windowCount = 0;
+      }
+      if (ring.windowCount >= options.maxLinesPerSecond) {
+        ring.rateLimited.fetch_add(1, std::memory_order_relaxed);
+        return false;
+      }
+      ++ring.windowCount;
+    }
+
+    uint64_t tail = ring.tail.load(std::memory_order_relaxed);
+    if (tail - ring.head.load(std::memory_order_acquire) >= RING_SIZE) {
+      ring.dropped.fetch_add(1, std::memory_order_relaxed);
+      return false;
+    }
+
+    return true;
+  }
+
+  void push(ThreadRing& ring, Record* record) {
+    uint64_t tail = ring.tail.load(std::memory_order_relaxed);
+    ring.slots[tail % RING_SIZE] = record;
+
+    // Sequentially consistent so that either the writer sees our record before it goes idle, or
+    // we see that it went idle and wake it.
+    ring.tail.store(tail + 1, std::memory_order_seq_cst);
+    if (writerIdle.load(std::memory_order_seq_cst)) {
+      ++state.lockExclusive()->wakeups;
+    }
+  }
+
+  static bool anyPending() {
+    for (ThreadRing* ring = allRings.load(std::memory_order_acquire); ring != nullptr;
+         ring = ring->next) {
+      if (ring->head.load(std::memory_order_relaxed) !=
+          ring->tail.load(std::memory_order_seq_cst)) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  bool isSync(LogSeverity severity) {
+    return severity == LogSeverity::FATAL ||
+        (severity == LogSeverity::ERROR && options.syncErrors);
+  }
+
+  void writeSync(Record& record) {
+    // Writes `record` from the calling thread, after everything queued before it.
+
+    if (!state.lockShared()->shutdown) {
+      flush();
+    }
+
+    auto text = record.format();
+    kj::runCatchingExceptions([&]() {
+      FdOutputStream(options.fd).write(text.begin(), text.size());
+    });
+    ++state.lockExclusive()->written;
+  }
+
+  void flush() {
+    uint64_t target;
+    {
+      auto lock = state.lockExclusive();
+      target = ++lock->flushRequested;
+    }
+
+    state.when([target](const State& s) { return s.flushCompleted >= target; },
+               [](State&) {});
+  }
+
+  static constexpr size_t MAX_BATCH = 64;
+
+  void writeBatch(Vector<String>& batch) {
+    if (batch.empty()) return;
+
+    KJ_STACK_ARRAY(ArrayPtr<const byte>, pieces, batch.size(), MAX_BATCH, MAX_BATCH);
+    for (auto i: kj::indices(batch)) {
+      pieces[i] = batch[i].asBytes();
+    }
+
+    // If the fd is broken there's nowhere to report it, so just discard the batch, as the default
+    // stderr logger does.
+    kj::runCatchingExceptions([&]() {
+      FdOutputStream(options.fd).write(pieces);
+    });
+
+    batch.clear();
+  }
+
+  size_t drain() {
+    // Writes out everything currently in every ring.  Returns the number of lines written.
+
+    Vector<String> batch(MAX_BATCH);
+    size_t count = 0;
+
+    for (ThreadRing* ring = allRings.load(std::memory_order_acquire); ring != nullptr;
+         ring = ring->next) {
+      uint64_t head = ring->head.load(std::memory_order_relaxed);
+      uint64_t tail = ring->tail.load(std::memory_order_acquire);
+      while (head != tail) {
+        Record* record = ring->slots[head % RING_SIZE];
+        batch.add(record->format());
+        delete record;
+        ++head;
+        ++count;
+        ring->head.store(head, std::memory_order_release);
+
+        if (batch.size() == MAX_BATCH) writeBatch(batch);
+      }
+    }
+
+    uint64_t dropped = 0, rateLimited = 0;
+    sumDropCounters(dropped, rateLimited);
+    if (dropped != droppedReported || rateLimited != rateLimitedReported) {
+      batch.add(str(trimSourceFilename(__FILE__), ":", __LINE__, ": ", LogSeverity::WARNING,
+          ": AsyncLogSink dropped ", dropped - droppedReported, " log lines because the queue "
+          "was full and ", rateLimited - rateLimitedReported, " due to rate limiting\n"));
+      droppedReported = dropped;
+      rateLimitedReported = rateLimited;
+    }
+
+    writeBatch(batch);
+    return count;
+  }
+
+  void run() {
+    for (;;) {
+      uint64_t flushTarget;
+      uint64_t wakeups;
+      bool shutdown;
+      {
+        auto lock = state.lockShared();
+        flushTarget = lock->flushRequested;
+        wakeups = lock->wakeups;
+        shutdown = lock->shutdown;
+      }
+
+      size_t count = drain();
+
+      {
+        auto lock = state.lockExclusive();
+        lock->written += count;
+        lock->flushCompleted = flushTarget;
+      }
+
+      if (shutdown) return;
+      if (count > 0) continue;
+
+      writerIdle.store(true, std::memory_order_seq_cst);
+      if (!anyPending()) {
+        state.when([wakeups](const State& s) {
+          return s.wakeups != wakeups || s.shutdown || s.flushRequested != s.flushCompleted;
+        }, [](State&) {});
+      }
+      writerIdle.store(false, std::memory_order_relaxed);
+    }
+  }
+};
+
+AsyncLogSink::AsyncLogSink(Options options): impl(kj::heap<Impl>(options)) {
+  KJ_REQUIRE(!sinkExists.exchange(true), "only one AsyncLogSink may exist at a time");
+
+  impl->writer = kj::heap<Thread>([this]() { impl->run(); });
+  impl->previousSink = setLogSink(*this);
+}
+
+AsyncLogSink::~AsyncLogSink() noexcept(false) {
+  setLogSink(impl->previousSink);
+  impl->state.lockExclusive()->shutdown = true;
+  impl->writer = nullptr;  // joins, after a final drain
+  sinkExists.store(false);
+}
+
+void AsyncLogSink::flush() {
+  impl->flush();
+}
+
+AsyncLogSink::Stats AsyncLogSink::getStats() {
+  uint64_t dropped = 0, rateLimited = 0;
+  Impl::sumDropCounters(dropped, rateLimited);
+  return {
+    impl->state.lockShared()->written,
+    dropped - impl->droppedBaseline,
+    rateLimited - impl->rateLimitedBaseline
+  };
+}
+
+void AsyncLogSink::write(LogSeverity severity, const char* file, int line, int contextDepth,
+                         String&& text) {
+  if (impl->isSync(severity)) {
+    Record record(severity, file, line, contextDepth, kj::mv(text));
+    impl->writeSync(record);
+    return;
+  }
+
+  ThreadRing& ring = getThreadRing();
+  if (!impl->admit(ring)) return;
+  impl->push(ring, new Record(severity, file, line, contextDepth, kj::mv(text)));
+}
+
+bool AsyncLogSink::writeDeferred(LogSeverity severity, const char* file, int line,
+                                 const char* macroArgs, ArrayPtr<String> argValues) {
+  if (!impl->options.deferFormatting || impl->isSync(severity)) return false;
+
+  ThreadRing& ring = getThreadRing();
+  if (!impl->admit(ring)) return true;
+
+  auto values = heapArrayBuilder<String>(argValues.size());
+  for (auto& value: argValues) {
+    values.add(kj::mv(value));
+  }
+  impl->push(ring, new Record(severity, file, line, macroArgs, values.finish()));
+  return true;
+}
+
+}  // namespace kj
+
+#endif  // KJ_USE_FUTEX
@@ -0,0 +1,116 @@
+// Copyright (c) 2017 Sandstorm Development Group, Inc. and contributors
+// Licensed under the MIT License:
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+#pragma once
+
+#if defined(__GNUC__) && !KJ_HEADER_WARNINGS
+#pragma GCC system_header
+#endif
+
+#include "exception.h"
+#include "memory.h"
+#include "mutex.h"
+
+namespace kj {
+
+#if KJ_USE_FUTEX  // The writer sleeps in MutexGuarded::when(), which is only implemented on futex.
+
+class AsyncLogSink final: public LogSink {
+  // A LogSink which takes the cost of writing log lines -- and, optionally, of formatting them --
+  // off the logging thread, so that a burst of errors can't stall an event loop on a slow or
+  // blocked stderr.
+  //
+  // Each thread that logs gets its own lock-free, single-producer ring of pending lines, so
+  // logging normally takes no lock and makes no syscall.  A background thread drains the rings
+  // and writes the lines in batches, one writev() per batch.  If a thread's ring is full because
+  // the writer can't keep up, the line is dropped and counted rather than blocking the logger;
+  // the writer reports the number of dropped lines in the log itself once it catches up.
+  //
+  // Constructing an AsyncLogSink installs it with setLogSink(); destroying it writes out anything
+  // still pending and reinstalls whatever sink was there before.  At most one AsyncLogSink may
+  // exist at a time.
+  //
+  // Lines logged by one thread are written in order.  Lines from different threads may be
+  // interleaved arbitrarily relative to each other.
+  //
+  // FATAL lines are the exception to all of the above: they are usually followed immediately by
+  // abort(), so the logging thread waits for everything already queued to be written and then
+  // writes the line itself before returning.  They are never dropped or rate-limited.
+
+public:
+  struct Options {
+    Options() {}
+
+    int fd = 2;
+    // File descriptor to write to.  Defaults to stderr.  Not closed by the sink.
+
+    bool deferFormatting = false;
+    // If true, KJ_LOG() calls made on threads which have no ExceptionCallback of their own pass
+    // their stringified arguments to the sink as-is, and the background thread assembles the
+    // message (parsing argument names out of the macro text, concatenating, adding the prefix).
+    // The arguments themselves are still stringified on the calling thread, since they may not
+    // outlive the call.
+
+    uint maxLinesPerSecond = 0;
+    // If non-zero, each thread may enqueue at most this many lines per second; further lines in
+    // the same second are dropped and counted.  Zero means unlimited.
+
+    bool syncErrors = false;
+    // If true, ERROR lines are written synchronously in the same way as FATAL ones.
+  };
+
+  explicit AsyncLogSink(Options options = Options());
+  KJ_DISALLOW_COPY(AsyncLogSink);
+  ~AsyncLogSink() noexcept(false);
+
+  void flush();
+  // Blocks until every line enqueued before the call, by any thread, has been written.
+
+  struct Stats {
+    uint64_t written;
+    // Lines written to the file descriptor.
+
+    uint64_t dropped;
+    // Lines dropped because the logging thread's ring was full.
+
+    uint64_t rateLimited;
+    // Lines dropped because the logging thread exceeded `maxLinesPerSecond`.
+  };
+
+  Stats getStats();
+
+  static constexpr uint RING_SIZE = 1024;
+  // Capacity, in lines, of each thread's ring.
+
+  // implements LogSink ----------------------------------------------
+  void write(LogSeverity severity, const char* file, int line, int contextDepth,
+             String&& text) override;
+  bool writeDeferred(LogSeverity severity, const char* file, int line,
+                     const char* macroArgs, ArrayPtr<String> argValues) override;
+
+private:
+  struct Impl;
+  Own<Impl> impl;
+};
+
+#endif  // KJ_USE_FUTEX
+
+}  // namespace kj
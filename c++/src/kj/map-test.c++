@@ -0,0 +1,356 @@
+// Copyright (c) 2017 Sandstorm Development Group, Inc. and contributors
+// Licensed under the MIT License:
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+#include "map.h"
+#include "test.h"
+#include <map>
+#include <unordered_map>
+#include <string>
+#include <chrono>
+#include <stdlib.h>
+
+namespace kj {
+namespace {
+
+KJ_TEST("HashMap basics") {
+  HashMap<String, int> map;
+  KJ_EXPECT(map.size() == 0);
+  KJ_EXPECT(map.find("foo") == nullptr);
+
+  map.insert(kj::str("foo"), 123);
+  map.insert(kj::str("bar"), 456);
+  KJ_EXPECT(map.size() == 2);
+
+  KJ_EXPECT(KJ_ASSERT_NONNULL(map.find("foo")) == 123);
+  KJ_EXPECT(KJ_ASSERT_NONNULL(map.find(StringPtr("bar"))) == 456);
+  KJ_EXPECT(map.find("baz") == nullptr);
+
+  KJ_EXPECT_THROW_RECOVERABLE_MESSAGE("duplicate key", map.insert(kj::str("foo"), 789));
+  KJ_EXPECT(KJ_ASSERT_NONNULL(map.find("foo")) == 123);
+
+  map.upsert(kj::str("foo"), 789);
+  map.upsert(kj::str("baz"), 321);
+  KJ_EXPECT(map.size() == 3);
+  KJ_EXPECT(KJ_ASSERT_NONNULL(map.find("foo")) == 789);
+  KJ_EXPECT(KJ_ASSERT_NONNULL(map.find("baz")) == 321);
+
+  bool created = false;
+  KJ_EXPECT(map.findOrCreate("bar", [&]() {
+    created = true;
+    return HashMap<String, int>::Entry { kj::str("bar"), 0 };
+  }) == 456);
+  KJ_EXPECT(!created);
+  KJ_EXPECT(map.findOrCreate("qux", [&]() {
+    created = true;
+    return HashMap<String, int>::Entry { kj::str("qux"), 555 };
+  }) == 555);
+  KJ_EXPECT(created);
+
+  // Iteration is in insertion order until something is erased.
+  Vector<StringPtr> keys;
+  for (auto& entry: map) keys.add(entry.key);
+  KJ_EXPECT(kj::strArray(keys, ",") == "foo,bar,baz,qux");
+
+  KJ_EXPECT(map.erase("foo"));
+  KJ_EXPECT(!map.erase("foo"));
+  KJ_EXPECT(map.size() == 3);
+  KJ_EXPECT(map.find("foo") == nullptr);
+  KJ_EXPECT(KJ_ASSERT_NONNULL(map.find("qux")) == 555);
+
+  keys.clear();
+  for (auto& entry: map) keys.add(entry.key);
+  KJ_EXPECT(kj::strArray(keys, ",") == "qux,bar,baz");
+
+  map.clear();
+  KJ_EXPECT(map.size() == 0);
+  KJ_EXPECT(map.find("bar") == nullptr);
+}
+
+KJ_TEST("HashMap with custom callbacks") {
+  struct CaseInsensitive {
+    uint hashCode(StringPtr s) const {
+      uint result = 0;
+      for (char c: s) result = result * 31 + (c | 0x20);
+      return result;
+    }
+    bool matches(StringPtr a, StringPtr b) const {
+      if (a.size() != b.size()) return false;
+      for (auto i: kj::indices(a)) {
+        if ((a[i] | 0x20) != (b[i] | 0x20)) return false;
+      }
+      return true;
+    }
+  };
+
+  HashMap<StringPtr, uint, CaseInsensitive> map;
+  map.insert("Content-Type", 1);
+  map.insert("Host", 2);
+  KJ_EXPECT(KJ_ASSERT_NONNULL(map.find("content-type")) == 1);
+  KJ_EXPECT(KJ_ASSERT_NONNULL(map.find("HOST")) == 2);
+  KJ_EXPECT(map.find("hosts") == nullptr);
+}
+
+KJ_TEST("HashMap with Own values and pointer keys") {
+  int a, b;
+  HashMap<const int*, Own<int>> map;
+  map.insert(&a, heap(1));
+  map.insert(&b, heap(2));
+  KJ_EXPECT(*KJ_ASSERT_NONNULL(map.find(&b)) == 2);
+  KJ_EXPECT(map.erase(&a));
+  KJ_EXPECT(*KJ_ASSERT_NONNULL(map.find(&b)) == 2);
+}
+
+KJ_TEST("HashSet") {
+  HashSet<uint64_t> set;
+  for (uint64_t i = 0; i < 1000; i++) {
+    set.insert(i << 32);
+  }
+  KJ_EXPECT(set.size() == 1000);
+  KJ_EXPECT(set.contains(uint64_t(123) << 32));
+  KJ_EXPECT(!set.contains(uint64_t(123)));
+  KJ_EXPECT(set.upsert(uint64_t(5) << 32) == uint64_t(5) << 32);
+  KJ_EXPECT(set.size() == 1000);
+
+  for (uint64_t i = 0; i < 1000; i += 2) {
+    KJ_EXPECT(set.erase(i << 32));
+  }
+  KJ_EXPECT(set.size() == 500);
+  for (uint64_t i = 0; i < 1000; i++) {
+    KJ_EXPECT(set.contains(i << 32) == (i % 2 == 1), i);
+  }
+}
+
+KJ_TEST("HashMap randomized against std::unordered_map") {
+  HashMap<uint, uint> map;
+  std::unordered_map<uint, uint> reference;
+
+  srand(123);
+  for (uint i = 0; i < 50000; i++) {
+    uint key = rand() % 1000;
+    switch (rand() % 3) {
+      case 0:
+        map.upsert(key, i);
+        reference[key] = i;
+        break;
+      case 1:
+        KJ_ASSERT(map.erase(key) == (reference.erase(key) > 0));
+        break;
+      case 2: {
+        auto iter = reference.find(key);
+        KJ_IF_MAYBE(value, map.find(key)) {
+          KJ_ASSERT(iter != reference.end());
+          KJ_ASSERT(*value == iter->second);
+        } else {
+          KJ_ASSERT(iter == reference.end());
+        }
+        break;
+      }
+    }
+    KJ_ASSERT(map.size() == reference.size());
+  }
+
+  for (auto& entry: map) {
+    KJ_ASSERT(reference.at(entry.key) == entry.value);
+  }
+}
+
+KJ_TEST("TreeMap basics") {
+  TreeMap<String, int> map;
+  KJ_EXPECT(map.begin() == map.end());
+  KJ_EXPECT(map.find("foo") == nullptr);
+
+  map.insert(kj::str("foo"), 1);
+  map.insert(kj::str("bar"), 2);
+  map.insert(kj::str("qux"), 3);
+  map.insert(kj::str("baz"), 4);
+
+  KJ_EXPECT_THROW_RECOVERABLE_MESSAGE("duplicate key", map.insert(kj::str("bar"), 5));
+  KJ_EXPECT(map.size() == 4);
+
+  KJ_EXPECT(KJ_ASSERT_NONNULL(map.find("foo")) == 1);
+  KJ_EXPECT(KJ_ASSERT_NONNULL(map.find("baz")) == 4);
+  KJ_EXPECT(map.find("corge") == nullptr);
+
+  Vector<StringPtr> keys;
+  for (auto& entry: map) keys.add(entry.key);
+  KJ_EXPECT(kj::strArray(keys, ",") == "bar,baz,foo,qux");
+
+  KJ_EXPECT(map.lowerBound("bay")->key == "baz");
+  KJ_EXPECT(map.lowerBound("baz")->key == "baz");
+  KJ_EXPECT(map.lowerBound("zzz") == map.end());
+
+  map.upsert(kj::str("foo"), 6);
+  KJ_EXPECT(KJ_ASSERT_NONNULL(map.find("foo")) == 6);
+
+  KJ_EXPECT(map.erase("bar"));
+  KJ_EXPECT(!map.erase("bar"));
+  keys.clear();
+  for (auto& entry: map) keys.add(entry.key);
+  KJ_EXPECT(kj::strArray(keys, ",") == "baz,foo,qux");
+  KJ_EXPECT(KJ_ASSERT_NONNULL(map.find("baz")) == 4);
+}
+
+KJ_TEST("TreeMap randomized against std::map") {
+  // Enough keys for a tree several levels deep, with enough erases to empty out whole subtrees.
+
+  TreeMap<uint, uint> map;
+  std::map<uint, uint> reference;
+
+  auto check = [&]() {
+    KJ_ASSERT(map.size() == reference.size());
+    auto iter = reference.begin();
+    for (auto& entry: map) {
+      KJ_ASSERT(iter != reference.end());
+      KJ_ASSERT(entry.key == iter->first, entry.key, iter->first);
+      KJ_ASSERT(entry.value == iter->second);
+      ++iter;
+    }
+    KJ_ASSERT(iter == reference.end());
+  };
+
+  srand(321);
+  for (uint round = 0; round < 4; round++) {
+    uint keyRange = round % 2 == 0 ? 5000 : 200;
+    for (uint i = 0; i < 30000; i++) {
+      uint key = rand() % keyRange;
+      // Bias toward inserts in even rounds and erases in odd rounds.
+      uint op = rand() % 4;
+      if (round % 2 == 1 && op == 0) op = 1;
+      switch (op) {
+        case 0:
+        case 3:
+          map.upsert(key, i);
+          reference[key] = i;
+          break;
+        case 1:
+          KJ_ASSERT(map.erase(key) == (reference.erase(key) > 0));
+          break;
+        case 2: {
+          auto iter = reference.lower_bound(key);
+          auto iter2 = map.lowerBound(key);
+          if (iter == reference.end()) {
+            KJ_ASSERT(iter2 == map.end());
+          } else {
+            KJ_ASSERT(iter2 != map.end());
+            KJ_ASSERT(iter2->key == iter->first);
+          }
+          break;
+        }
+      }
+      if (i % 1000 == 0) check();
+    }
+    check();
+  }
+
+  // Erase everything.
+  while (!reference.empty()) {
+    uint key = reference.begin()->first;
+    reference.erase(reference.begin());
+    KJ_ASSERT(map.erase(key));
+  }
+  check();
+  map.insert(1, 2);
+  reference[1] = 2;
+  check();
+}
+
+// -------------------------------------------------------------------
+// Microbenchmarks.  These just log timings, for comparing against the std containers.
+
+template <typename Func>
+int64_t timeNanos(Func&& func) {
+  auto start = std::chrono::steady_clock::now();
+  func();
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+      std::chrono::steady_clock::now() - start).count();
+}
+
+KJ_TEST("HashMap/TreeMap benchmark") {
+  constexpr uint COUNT = 100000;
+
+  auto keys = heapArray<uint64_t>(COUNT);
+  srand(0);
+  for (auto& key: keys) key = (uint64_t(rand()) << 32) | rand();
+  auto stringKeys = KJ_MAP(key, keys) { return kj::str(key); };
+
+  uint64_t sum = 0;
+  auto report = [&](const char* what, int64_t kjNanos, int64_t stdNanos) {
+    KJ_LOG(INFO, what, kjNanos / COUNT, "ns/op (kj)", stdNanos / COUNT, "ns/op (std)");
+  };
+
+  {
+    HashMap<uint64_t, uint64_t> map;
+    std::unordered_map<uint64_t, uint64_t> reference;
+    auto kjInsert = timeNanos([&]() { for (auto key: keys) map.upsert(key, key); });
+    auto stdInsert = timeNanos([&]() { for (auto key: keys) reference[key] = key; });
+    report("HashMap<uint64_t> insert", kjInsert, stdInsert);
+
+    auto kjFind = timeNanos([&]() {
+      for (auto key: keys) sum += KJ_ASSERT_NONNULL(map.find(key));
+    });
+    auto stdFind = timeNanos([&]() { for (auto key: keys) sum += reference.find(key)->second; });
+    report("HashMap<uint64_t> find", kjFind, stdFind);
+  }
+
+  {
+    HashMap<StringPtr, uint> map;
+    std::unordered_map<std::string, uint> reference;
+    auto kjInsert = timeNanos([&]() { for (auto& key: stringKeys) map.upsert(key, 1); });
+    auto stdInsert = timeNanos([&]() { for (auto& key: stringKeys) reference[key.cStr()] = 1; });
+    report("HashMap<StringPtr> insert", kjInsert, stdInsert);
+
+    auto kjFind = timeNanos([&]() {
+      for (auto& key: stringKeys) sum += KJ_ASSERT_NONNULL(map.find(key));
+    });
+    auto stdFind = timeNanos([&]() {
+      for (auto& key: stringKeys) sum += reference.find(key.cStr())->second;
+    });
+    report("HashMap<StringPtr> find (std::string for std)", kjFind, stdFind);
+  }
+
+  {
+    TreeMap<uint64_t, uint64_t> map;
+    std::map<uint64_t, uint64_t> reference;
+    auto kjInsert = timeNanos([&]() { for (auto key: keys) map.upsert(key, key); });
+    auto stdInsert = timeNanos([&]() { for (auto key: keys) reference[key] = key; });
+    report("TreeMap<uint64_t> insert", kjInsert, stdInsert);
+
+    auto kjFind = timeNanos([&]() {
+      for (auto key: keys) sum += KJ_ASSERT_NONNULL(map.find(key));
+    });
+    auto stdFind = timeNanos([&]() { for (auto key: keys) sum += reference.find(key)->second; });
+    report("TreeMap<uint64_t> find", kjFind, stdFind);
+
+    auto kjIterate = timeNanos([&]() { for (auto& entry: map) sum += entry.value; });
+    auto stdIterate = timeNanos([&]() { for (auto& entry: reference) sum += entry.second; });
+    report("TreeMap<uint64_t> iterate", kjIterate, stdIterate);
+
+    auto kjErase = timeNanos([&]() { for (auto key: keys) map.erase(key); });
+    auto stdErase = timeNanos([&]() { for (auto key: keys) reference.erase(key); });
+    report("TreeMap<uint64_t> erase", kjErase, stdErase);
+    KJ_EXPECT(map.size() == 0);
+  }
+
+  KJ_EXPECT(sum != 0);
+}
+
+}  // namespace
+}  // namespace kj
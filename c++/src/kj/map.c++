@@ -0,0 +1,376 @@
+// Copyright (c) 2017 Sandstorm Development Group, Inc. and contributors
+// Licensed under the MIT License:
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+#include "map.h"
+#include <string.h>
+
+namespace kj {
+namespace _ {  // private
+
+// =======================================================================================
+// Hash tables
+
+Array<HashBucket> rehash(ArrayPtr<const HashBucket> oldBuckets, size_t targetSize, uint& shift) {
+  KJ_REQUIRE(targetSize < (1u << 30), "hash table has reached maximum size");
+
+  // Keep the load factor at or below 1/2, with a power-of-two size of at least 8.
+  size_t size = 8;
+  uint log2Size = 3;
+  while (size < targetSize * 2) {
+    size *= 2;
+    ++log2Size;
+  }
+  shift = 32 - log2Size;
+
+  auto newBuckets = heapArray<HashBucket>(size);
+  memset(newBuckets.begin(), 0, sizeof(HashBucket) * size);
+
+  size_t mask = size - 1;
+  for (auto& oldBucket: oldBuckets) {
+    if (oldBucket.isOccupied()) {
+      for (size_t i = hashIndex(oldBucket.hash, shift);; i = (i + 1) & mask) {
+        auto& newBucket = newBuckets[i];
+        if (newBucket.isEmpty()) {
+          newBucket = oldBucket;
+          break;
+        }
+      }
+    }
+  }
+
+  return newBuckets;
+}
+
+// =======================================================================================
+// B-tree
+
+constexpr uint BTreeImpl::LEAF_SIZE;
+constexpr uint BTreeImpl::PARENT_SIZE;
+constexpr uint BTreeImpl::MAX_HEIGHT;
+
+namespace {
+
+template <typename Node>
+inline uint searchNode(const Node& node, const uint* rows, const BTreeImpl::SearchKey& key) {
+  // Returns the index of the first of node.size `rows` that does not sort before `key`.
+  uint lo = 0;
+  uint hi = node.size;
+  while (lo < hi) {
+    uint mid = (lo + hi) / 2;
+    if (key.isAfter(rows[mid])) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  return lo;
+}
+
+template <typename T>
+inline void insertAt(T* array, uint size, uint pos, T value) {
+  memmove(array + pos + 1, array + pos, (size - pos) * sizeof(T));
+  array[pos] = value;
+}
+
+template <typename T>
+inline void removeAt(T* array, uint size, uint pos) {
+  memmove(array + pos, array + pos + 1, (size - pos - 1) * sizeof(T));
+}
+
+}  // namespace
+
+BTreeImpl::BTreeImpl(BTreeImpl&& other)
+    : root(other.root), height(other.height), head(other.head) {
+  other.root = nullptr;
+  other.height = 0;
+  other.head = nullptr;
+}
+
+BTreeImpl& BTreeImpl::operator=(BTreeImpl&& other) {
+  if (&other != this) {
+    clear();
+    root = other.root;
+    height = other.height;
+    head = other.head;
+    other.root = nullptr;
+    other.height = 0;
+    other.head = nullptr;
+  }
+  return *this;
+}
+
+BTreeImpl::~BTreeImpl() noexcept(false) {
+  clear();
+}
+
+void BTreeImpl::clear() {
+  if (root != nullptr) {
+    freeNode(root, height);
+    root = nullptr;
+    height = 0;
+    head = nullptr;
+  }
+}
+
+void BTreeImpl::freeNode(void* node, uint height) {
+  if (height == 0) {
+    delete static_cast<Leaf*>(node);
+  } else {
+    Parent* parent = static_cast<Parent*>(node);
+    for (uint i = 0; i <= parent->size; i++) {
+      freeNode(parent->children[i], height - 1);
+    }
+    delete parent;
+  }
+}
+
+BTreeImpl::Leaf& BTreeImpl::descend(const SearchKey& key, PathEntry* path) const {
+  void* node = root;
+  for (uint i = 0; i < height; i++) {
+    Parent* parent = static_cast<Parent*>(node);
+    uint index = searchNode(*parent, parent->keys, key);
+    path[i] = { parent, index };
+    node = parent->children[index];
+  }
+  return *static_cast<Leaf*>(node);
+}
+
+BTreeImpl::Iterator BTreeImpl::lowerBound(const SearchKey& key) const {
+  if (root == nullptr) return end();
+
+  PathEntry path[MAX_HEIGHT];
+  Leaf& leaf = descend(key, path);
+  uint pos = searchNode(leaf, leaf.rows, key);
+  if (pos < leaf.size) {
+    return Iterator(&leaf, pos);
+  } else {
+    // `key` sorts after everything in the tree.  (Otherwise descend() would have found a leaf
+    // whose greatest row is not before `key`.)
+    return end();
+  }
+}
+
+Maybe<uint> BTreeImpl::find(const SearchKey& key) const {
+  if (root == nullptr) return nullptr;
+
+  PathEntry path[MAX_HEIGHT];
+  Leaf& leaf = descend(key, path);
+  uint pos = searchNode(leaf, leaf.rows, key);
+  if (pos < leaf.size && key.matches(leaf.rows[pos])) {
+    return leaf.rows[pos];
+  } else {
+    return nullptr;
+  }
+}
+
+Maybe<uint> BTreeImpl::insert(const SearchKey& key, uint newRow) {
+  if (root == nullptr) {
+    root = head = new Leaf;
+  }
+
+  PathEntry path[MAX_HEIGHT];
+  Leaf& leaf = descend(key, path);
+  uint pos = searchNode(leaf, leaf.rows, key);
+  if (pos < leaf.size && key.matches(leaf.rows[pos])) {
+    return leaf.rows[pos];
+  }
+
+  if (leaf.size < LEAF_SIZE) {
+    insertAt(leaf.rows, leaf.size++, pos, newRow);
+    return nullptr;
+  }
+
+  // Leaf is full; split it in half.
+  constexpr uint HALF = LEAF_SIZE / 2;
+  Leaf* right = new Leaf;
+  right->size = LEAF_SIZE - HALF;
+  memcpy(right->rows, leaf.rows + HALF, right->size * sizeof(uint));
+  leaf.size = HALF;
+
+  right->next = leaf.next;
+  right->prev = &leaf;
+  if (leaf.next != nullptr) leaf.next->prev = right;
+  leaf.next = right;
+
+  if (pos <= HALF) {
+    insertAt(leaf.rows, leaf.size++, pos, newRow);
+  } else {
+    insertAt(right->rows, right->size++, pos - HALF, newRow);
+  }
+
+  insertIntoParents(path, leaf.rows[leaf.size - 1], right);
+  return nullptr;
+}
+
+void BTreeImpl::insertIntoParents(PathEntry* path, uint separator, void* newChild) {
+  // `newChild` was split off to the right of the node at the end of `path`, and `separator` is the
+  // greatest row remaining in the left half.
+
+  for (uint level = height; level-- > 0;) {
+    Parent& parent = *path[level].parent;
+    uint index = path[level].index;
+
+    if (parent.size < PARENT_SIZE) {
+      insertAt(parent.children, parent.size + 1, index + 1, newChild);
+      insertAt(parent.keys, parent.size++, index, separator);
+      return;
+    }
+
+    // Parent is full; split it.  The middle key moves up to the grandparent.
+    uint keys[PARENT_SIZE + 1];
+    void* children[PARENT_SIZE + 2];
+    memcpy(keys, parent.keys, PARENT_SIZE * sizeof(uint));
+    memcpy(children, parent.children, (PARENT_SIZE + 1) * sizeof(void*));
+    insertAt(children, PARENT_SIZE + 1, index + 1, newChild);
+    insertAt(keys, PARENT_SIZE, index, separator);
+
+    constexpr uint MID = (PARENT_SIZE + 1) / 2;
+    Parent* right = new Parent;
+    parent.size = MID;
+    memcpy(parent.keys, keys, MID * sizeof(uint));
+    memcpy(parent.children, children, (MID + 1) * sizeof(void*));
+    right->size = PARENT_SIZE - MID;
+    memcpy(right->keys, keys + MID + 1, right->size * sizeof(uint));
+    memcpy(right->children, children + MID + 1, (right->size + 1) * sizeof(void*));
+
+    separator = keys[MID];
+    newChild = right;
+  }
+
+  // The root split; grow a new root.
+  KJ_ASSERT(height + 1 < MAX_HEIGHT, "B-tree too deep");
+  Parent* newRoot = new Parent;
+  newRoot->size = 1;
+  newRoot->keys[0] = separator;
+  newRoot->children[0] = root;
+  newRoot->children[1] = newChild;
+  root = newRoot;
+  ++height;
+}
+
+Maybe<uint> BTreeImpl::erase(const SearchKey& key) {
+  if (root == nullptr) return nullptr;
+
+  PathEntry path[MAX_HEIGHT];
+  Leaf& leaf = descend(key, path);
+  uint pos = searchNode(leaf, leaf.rows, key);
+  if (pos >= leaf.size || !key.matches(leaf.rows[pos])) {
+    return nullptr;
+  }
+
+  uint row = leaf.rows[pos];
+
+  // If `row` is the greatest in some subtree, the separator for that subtree must become its
+  // predecessor.  (If there is no predecessor, the subtree only contained `row` and is about to
+  // be removed anyway.)
+  Leaf* prevLeaf = leaf.prev;
+  bool hasPredecessor = pos > 0 || prevLeaf != nullptr;
+  uint predecessor = pos > 0 ? leaf.rows[pos - 1]
+                             : prevLeaf != nullptr ? prevLeaf->rows[prevLeaf->size - 1] : 0;
+
+  if (hasPredecessor) {
+    for (uint level = 0; level < height; level++) {
+      Parent& parent = *path[level].parent;
+      uint index = path[level].index;
+      if (index < parent.size && parent.keys[index] == row) {
+        parent.keys[index] = predecessor;
+      }
+    }
+  }
+
+  removeAt(leaf.rows, leaf.size--, pos);
+
+  if (leaf.size == 0 && height > 0) {
+    removeEmptyLeaf(leaf, path);
+  }
+
+  return row;
+}
+
+void BTreeImpl::removeEmptyLeaf(Leaf& leaf, PathEntry* path) {
+  if (leaf.prev == nullptr) {
+    head = leaf.next;
+  } else {
+    leaf.prev->next = leaf.next;
+  }
+  if (leaf.next != nullptr) {
+    leaf.next->prev = leaf.prev;
+  }
+  delete &leaf;
+
+  // Remove the child from its parent, and any parents that become empty as a result.
+  uint level = height;
+  while (level-- > 0) {
+    Parent& parent = *path[level].parent;
+    uint index = path[level].index;
+
+    if (parent.size == 0) {
+      // This was the only child.
+      delete &parent;
+      continue;
+    }
+
+    // Dropping the last child means its left neighbor now extends to the end, so drop the
+    // neighbor's separator; otherwise drop the removed child's own separator.
+    removeAt(parent.keys, parent.size, kj::min(index, parent.size - 1));
+    removeAt(parent.children, parent.size + 1, index);
+    --parent.size;
+    break;
+  }
+
+  if (level == uint(-1)) {
+    // Every level was emptied.  (Can't happen with a single leaf, since we don't remove the root
+    // leaf, but a chain of single-child parents could lead here.)
+    root = nullptr;
+    head = nullptr;
+    height = 0;
+    return;
+  }
+
+  // Collapse single-child roots.
+  while (height > 0 && static_cast<Parent*>(root)->size == 0) {
+    Parent* oldRoot = static_cast<Parent*>(root);
+    root = oldRoot->children[0];
+    delete oldRoot;
+    --height;
+  }
+}
+
+void BTreeImpl::renumber(uint oldRow, uint newRow, const SearchKey& key) {
+  KJ_REQUIRE(root != nullptr);
+
+  PathEntry path[MAX_HEIGHT];
+  Leaf& leaf = descend(key, path);
+  for (uint level = 0; level < height; level++) {
+    Parent& parent = *path[level].parent;
+    uint index = path[level].index;
+    if (index < parent.size && parent.keys[index] == oldRow) {
+      parent.keys[index] = newRow;
+    }
+  }
+
+  uint pos = searchNode(leaf, leaf.rows, key);
+  KJ_ASSERT(pos < leaf.size && leaf.rows[pos] == oldRow, "B-tree corrupted");
+  leaf.rows[pos] = newRow;
+}
+
+}  // namespace _ (private)
+}  // namespace kj
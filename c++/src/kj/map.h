@@ -0,0 +1,631 @@
+// Copyright (c) 2017 Sandstorm Development Group, Inc. and contributors
+// Licensed under the MIT License:
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+#pragma once
+
+#if defined(__GNUC__) && !KJ_HEADER_WARNINGS
+#pragma GCC system_header
+#endif
+
+#include "vector.h"
+#include "hash.h"
+#include "debug.h"
+
+namespace kj {
+
+// =======================================================================================
+// Associative containers
+//
+// HashMap, HashSet, and TreeMap are KJ's replacements for std::unordered_map, std::unordered_set,
+// and std::map.  All three store their entries contiguously in a kj::Vector, in insertion order,
+// with a separate index of 32-bit row numbers on the side:
+//
+// * HashMap and HashSet use an open-addressing (linear probing) hash index.  Each bucket is 8
+//   bytes and caches the entry's hash code, so a lookup usually touches one cache line of the
+//   index and then the matching entry, with no per-entry allocation.
+// * TreeMap uses a B+-tree index, so it can be iterated in key order.  Each tree node holds
+//   several row numbers, making it much shallower and more cache-friendly than a red-black tree.
+//
+// Because entries are contiguous, iterating over a HashMap or HashSet is as fast as iterating a
+// Vector (though in no particular order).  The flip side is that *any* insert or erase may move
+// existing entries, so pointers and references to entries are invalidated by modification.  In
+// particular, erasing an entry moves the last entry into its place.
+//
+// Keys are hashed with kj::hashCode() (see hash.h) and compared with `==` (and `<` for TreeMap).
+// To use some other rule, pass a Callbacks type as the last template parameter, like
+// DefaultHashCallbacks or DefaultTreeCallbacks below.
+
+struct DefaultHashCallbacks {
+  template <typename T>
+  inline uint hashCode(const T& key) const { return kj::hashCode(key); }
+  template <typename T, typename U>
+  inline bool matches(const T& stored, const U& key) const { return stored == key; }
+};
+
+struct DefaultTreeCallbacks {
+  template <typename T, typename U>
+  inline bool isBefore(const T& stored, const U& key) const { return stored < key; }
+  template <typename T, typename U>
+  inline bool matches(const T& stored, const U& key) const { return stored == key; }
+};
+
+namespace _ {  // private
+
+struct HashBucket {
+  uint hash;
+  uint value;
+  // 0 = empty, 1 = erased, otherwise row number + 2.
+
+  inline bool isEmpty() const { return value == 0; }
+  inline bool isErased() const { return value == 1; }
+  inline bool isOccupied() const { return value >= 2; }
+  inline uint getRow() const { return value - 2; }
+  inline void set(uint newHash, uint row) { hash = newHash; value = row + 2; }
+  inline void setErased() { value = 1; }
+};
+
+Array<HashBucket> rehash(ArrayPtr<const HashBucket> oldBuckets, size_t targetSize, uint& shift);
+// Build a new bucket array big enough for `targetSize` entries and move the occupied buckets of
+// `oldBuckets` into it, dropping erased markers.  Sets `shift` for use with hashIndex().
+
+inline size_t hashIndex(uint hash, uint shift) {
+  // Fibonacci hashing: scrambles the (possibly weak) hash code and takes the top bits as the
+  // starting bucket.
+  return (hash * 0x9e3779b9u) >> shift;
+}
+
+template <typename Entry, typename GetKey, typename Callbacks>
+class HashTable {
+  // Implementation shared by HashMap and HashSet.  GetKey::get(entry) returns the entry's key.
+
+public:
+  HashTable() = default;
+  explicit HashTable(Callbacks callbacks): callbacks(kj::mv(callbacks)) {}
+  HashTable(HashTable&&) = default;
+  HashTable& operator=(HashTable&&) = default;
+  KJ_DISALLOW_COPY(HashTable);
+
+  Vector<Entry> rows;
+
+  inline void clear() {
+    rows.clear();
+    buckets = nullptr;
+    erasedCount = 0;
+  }
+
+  void reserve(size_t size) {
+    rows.reserve(size);
+    if (size * 2 > buckets.size()) {
+      buckets = _::rehash(buckets, size, shift);
+      erasedCount = 0;
+    }
+  }
+
+  template <typename KeyLike>
+  Entry* find(const KeyLike& key) const {
+    if (buckets.size() == 0) return nullptr;
+
+    uint hash = callbacks.hashCode(key);
+    size_t mask = buckets.size() - 1;
+    for (size_t i = hashIndex(hash, shift);; i = (i + 1) & mask) {
+      auto& bucket = buckets[i];
+      if (bucket.isEmpty()) {
+        return nullptr;
+      } else if (bucket.isOccupied() && bucket.hash == hash &&
+                 callbacks.matches(GetKey::get(rows[bucket.getRow()]), key)) {
+        return &rows[bucket.getRow()];
+      }
+    }
+  }
+
+  template <typename KeyLike, typename Func>
+  Entry& findOrCreate(const KeyLike& key, Func&& createEntry) {
+    // createEntry() must return an Entry whose key matches `key`, and must not touch this table.
+
+    growIfNeeded();
+
+    uint hash = callbacks.hashCode(key);
+    size_t mask = buckets.size() - 1;
+    HashBucket* erasedSlot = nullptr;
+    for (size_t i = hashIndex(hash, shift);; i = (i + 1) & mask) {
+      auto& bucket = buckets[i];
+      if (bucket.isEmpty()) {
+        HashBucket* slot = &bucket;
+        if (erasedSlot != nullptr) {
+          slot = erasedSlot;
+          --erasedCount;
+        }
+        Entry& result = rows.add(createEntry());
+        slot->set(hash, rows.size() - 1);
+        return result;
+      } else if (bucket.isErased()) {
+        if (erasedSlot == nullptr) erasedSlot = &bucket;
+      } else if (bucket.hash == hash &&
+                 callbacks.matches(GetKey::get(rows[bucket.getRow()]), key)) {
+        return rows[bucket.getRow()];
+      }
+    }
+  }
+
+  Entry& insert(Entry&& entry) {
+    bool created = false;
+    Entry& result = findOrCreate(GetKey::get(entry), [&]() -> Entry&& {
+      created = true;
+      return kj::mv(entry);
+    });
+    KJ_REQUIRE(created, "inserted duplicate key into HashMap or HashSet") { break; }
+    return result;
+  }
+
+  template <typename KeyLike>
+  bool erase(const KeyLike& key) {
+    if (buckets.size() == 0) return false;
+
+    uint hash = callbacks.hashCode(key);
+    size_t mask = buckets.size() - 1;
+    for (size_t i = hashIndex(hash, shift);; i = (i + 1) & mask) {
+      auto& bucket = buckets[i];
+      if (bucket.isEmpty()) {
+        return false;
+      } else if (bucket.isOccupied() && bucket.hash == hash &&
+                 callbacks.matches(GetKey::get(rows[bucket.getRow()]), key)) {
+        uint row = bucket.getRow();
+        bucket.setErased();
+        ++erasedCount;
+        moveLastRowTo(row);
+        return true;
+      }
+    }
+  }
+
+private:
+  Array<HashBucket> buckets;
+  uint shift = 0;
+  uint erasedCount = 0;
+  Callbacks callbacks;
+
+  inline void growIfNeeded() {
+    // Keep the load factor (counting erased markers) at or below 1/2.
+    if ((rows.size() + erasedCount + 1) * 2 > buckets.size()) {
+      buckets = _::rehash(buckets, kj::max(rows.size() + 1, rows.size() * 2), shift);
+      erasedCount = 0;
+    }
+  }
+
+  void moveLastRowTo(uint row) {
+    // Fill the hole left at `row` by moving the last row into it.
+    uint last = rows.size() - 1;
+    if (row != last) {
+      uint hash = callbacks.hashCode(GetKey::get(rows[last]));
+      size_t mask = buckets.size() - 1;
+      for (size_t i = hashIndex(hash, shift);; i = (i + 1) & mask) {
+        auto& bucket = buckets[i];
+        KJ_ASSERT(!bucket.isEmpty(), "HashMap corrupted: last row is missing from the index");
+        if (bucket.value == last + 2) {
+          bucket.value = row + 2;
+          break;
+        }
+      }
+      rows[row] = kj::mv(rows[last]);
+    }
+    rows.removeLast();
+  }
+};
+
+}  // namespace _ (private)
+
+// =======================================================================================
+
+template <typename Key, typename Value, typename Callbacks = DefaultHashCallbacks>
+class HashMap {
+  // An unordered map, implemented as a hash table with open addressing.  See the top of this
+  // file for performance characteristics and the rules on reference invalidation.
+
+public:
+  struct Entry {
+    Key key;
+    Value value;
+  };
+
+  HashMap() = default;
+  explicit HashMap(Callbacks callbacks): table(kj::mv(callbacks)) {}
+
+  inline size_t size() const { return table.rows.size(); }
+  inline bool empty() const { return table.rows.empty(); }
+  inline void clear() { table.clear(); }
+  inline void reserve(size_t size) { table.reserve(size); }
+
+  inline Entry* begin() { return table.rows.begin(); }
+  inline Entry* end() { return table.rows.end(); }
+  inline const Entry* begin() const { return table.rows.begin(); }
+  inline const Entry* end() const { return table.rows.end(); }
+  // Iterates in no particular order.
+
+  Entry& insert(Key key, Value value) {
+    // Inserts a new entry.  Throws if the key is already present.
+    return table.insert(Entry { kj::mv(key), kj::mv(value) });
+  }
+
+  Entry& upsert(Key key, Value value) {
+    // Inserts a new entry, or replaces the value of the existing entry with the same key.
+    bool created = false;
+    Entry& entry = table.findOrCreate(key, [&]() {
+      created = true;
+      return Entry { kj::mv(key), kj::mv(value) };
+    });
+    if (!created) entry.value = kj::mv(value);
+    return entry;
+  }
+
+  template <typename KeyLike>
+  Maybe<Value&> find(const KeyLike& key) {
+    Entry* entry = table.find(key);
+    if (entry == nullptr) return nullptr;
+    return entry->value;
+  }
+  template <typename KeyLike>
+  Maybe<const Value&> find(const KeyLike& key) const {
+    const Entry* entry = table.find(key);
+    if (entry == nullptr) return nullptr;
+    return entry->value;
+  }
+
+  template <typename KeyLike, typename Func>
+  Value& findOrCreate(const KeyLike& key, Func&& createEntry) {
+    // Returns the value for `key`.  If there is none, calls `createEntry()`, which must return an
+    // Entry for that key, and inserts it.  `createEntry()` must not modify the map.
+    return table.findOrCreate(key, kj::fwd<Func>(createEntry)).value;
+  }
+
+  template <typename KeyLike>
+  bool erase(const KeyLike& key) {
+    // Removes the entry for `key`, returning false if there was none.  Moves the last entry into
+    // the erased one's place.
+    return table.erase(key);
+  }
+
+private:
+  struct GetKey {
+    static inline const Key& get(const Entry& entry) { return entry.key; }
+  };
+  _::HashTable<Entry, GetKey, Callbacks> table;
+};
+
+template <typename Element, typename Callbacks = DefaultHashCallbacks>
+class HashSet {
+  // An unordered set, implemented like HashMap.
+
+public:
+  HashSet() = default;
+  explicit HashSet(Callbacks callbacks): table(kj::mv(callbacks)) {}
+
+  inline size_t size() const { return table.rows.size(); }
+  inline bool empty() const { return table.rows.empty(); }
+  inline void clear() { table.clear(); }
+  inline void reserve(size_t size) { table.reserve(size); }
+
+  inline const Element* begin() const { return table.rows.begin(); }
+  inline const Element* end() const { return table.rows.end(); }
+  // Iterates in no particular order.  Elements can't be modified in place since that could
+  // change their hash.
+
+  const Element& insert(Element element) {
+    // Inserts a new element.  Throws if an equal element is already present.
+    return table.insert(kj::mv(element));
+  }
+
+  const Element& upsert(Element element) {
+    // Inserts the element, unless an equal one is already present, in which case that one is
+    // returned.
+    return table.findOrCreate(element, [&]() { return kj::mv(element); });
+  }
+
+  template <typename KeyLike>
+  bool contains(const KeyLike& key) const { return table.find(key) != nullptr; }
+
+  template <typename KeyLike>
+  Maybe<const Element&> find(const KeyLike& key) const {
+    const Element* element = table.find(key);
+    if (element == nullptr) return nullptr;
+    return *element;
+  }
+
+  template <typename KeyLike, typename Func>
+  const Element& findOrCreate(const KeyLike& key, Func&& createElement) {
+    return table.findOrCreate(key, kj::fwd<Func>(createElement));
+  }
+
+  template <typename KeyLike>
+  bool erase(const KeyLike& key) { return table.erase(key); }
+
+private:
+  struct GetKey {
+    static inline const Element& get(const Element& element) { return element; }
+  };
+  _::HashTable<Element, GetKey, Callbacks> table;
+};
+
+// =======================================================================================
+
+namespace _ {  // private
+
+class BTreeImpl {
+  // A B+-tree of row numbers, not knowing anything about the rows themselves: all comparisons
+  // go through a SearchKey.  This keeps the tree code out of the templates.
+  //
+  // Each node's separator keys are the row numbers of the greatest row in the corresponding
+  // child subtree.  Erasing never rebalances; a node is only freed once it is empty.  For
+  // typical workloads this keeps erases cheap at little cost in density, and the tree never gets
+  // deeper than it was at its largest.
+
+public:
+  class SearchKey {
+  public:
+    virtual bool isAfter(uint row) const = 0;
+    // Returns true if the key being searched for sorts after the entry at `row`.
+
+    virtual bool matches(uint row) const = 0;
+    // Returns true if the key being searched for is equal to the entry at `row`.
+  };
+
+  static constexpr uint LEAF_SIZE = 14;
+  static constexpr uint PARENT_SIZE = 7;
+
+  struct Leaf {
+    uint size = 0;
+    uint rows[LEAF_SIZE];
+    Leaf* next = nullptr;
+    Leaf* prev = nullptr;
+  };
+
+  struct Parent {
+    uint size = 0;
+    // Number of keys.  There is always one more child than that.
+
+    uint keys[PARENT_SIZE];
+    void* children[PARENT_SIZE + 1];
+  };
+
+  class Iterator {
+  public:
+    Iterator() = default;
+    inline Iterator(const Leaf* leaf, uint pos): leaf(leaf), pos(pos) {}
+
+    inline uint operator*() const { return leaf->rows[pos]; }
+    inline Iterator& operator++() {
+      if (++pos >= leaf->size) {
+        leaf = leaf->next;
+        pos = 0;
+      }
+      return *this;
+    }
+    inline bool operator==(const Iterator& other) const {
+      return leaf == other.leaf && pos == other.pos;
+    }
+    inline bool operator!=(const Iterator& other) const { return !(*this == other); }
+
+  private:
+    const Leaf* leaf = nullptr;
+    uint pos = 0;
+  };
+
+  BTreeImpl() = default;
+  BTreeImpl(BTreeImpl&& other);
+  BTreeImpl& operator=(BTreeImpl&& other);
+  KJ_DISALLOW_COPY(BTreeImpl);
+  ~BTreeImpl() noexcept(false);
+
+  void clear();
+
+  inline Iterator begin() const {
+    return head == nullptr || head->size == 0 ? Iterator() : Iterator(head, 0);
+  }
+  inline Iterator end() const { return Iterator(); }
+
+  Iterator lowerBound(const SearchKey& key) const;
+  // Returns the first row that does not sort before `key`.
+
+  Maybe<uint> find(const SearchKey& key) const;
+
+  Maybe<uint> insert(const SearchKey& key, uint newRow);
+  // Inserts `newRow`, whose key is `key`, unless a row matching `key` is already present, in
+  // which case that row is returned instead.
+
+  Maybe<uint> erase(const SearchKey& key);
+  // Removes the row matching `key` and returns it, or returns null if there is none.
+
+  void renumber(uint oldRow, uint newRow, const SearchKey& key);
+  // Replaces `oldRow`, whose key is `key`, with `newRow`.
+
+private:
+  void* root = nullptr;
+  uint height = 0;
+  // Number of levels of Parents above the Leaves.
+
+  Leaf* head = nullptr;
+  // The leftmost leaf.
+
+  static constexpr uint MAX_HEIGHT = 32;
+  struct PathEntry {
+    Parent* parent;
+    uint index;
+  };
+
+  Leaf& descend(const SearchKey& key, PathEntry* path) const;
+  void insertIntoParents(PathEntry* path, uint separator, void* newChild);
+  void removeEmptyLeaf(Leaf& leaf, PathEntry* path);
+  static void freeNode(void* node, uint height);
+};
+
+template <typename Entry>
+class TreeMapIterator {
+public:
+  TreeMapIterator() = default;
+  inline TreeMapIterator(Entry* entries, BTreeImpl::Iterator inner)
+      : entries(entries), inner(inner) {}
+
+  inline Entry& operator*() const { return entries[*inner]; }
+  inline Entry* operator->() const { return &entries[*inner]; }
+  inline TreeMapIterator& operator++() { ++inner; return *this; }
+  inline TreeMapIterator operator++(int) { auto result = *this; ++inner; return result; }
+  inline bool operator==(const TreeMapIterator& other) const { return inner == other.inner; }
+  inline bool operator!=(const TreeMapIterator& other) const { return inner != other.inner; }
+
+private:
+  Entry* entries = nullptr;
+  BTreeImpl::Iterator inner;
+};
+
+}  // namespace _ (private)
+
+template <typename Key, typename Value, typename Callbacks = DefaultTreeCallbacks>
+class TreeMap {
+  // An ordered map, implemented as a B+-tree index over a Vector of entries.  Iteration is in key
+  // order.  See the top of this file for the rules on reference invalidation.
+
+public:
+  struct Entry {
+    Key key;
+    Value value;
+  };
+
+  typedef _::TreeMapIterator<Entry> Iterator;
+  typedef _::TreeMapIterator<const Entry> ConstIterator;
+
+  TreeMap() = default;
+  explicit TreeMap(Callbacks callbacks): callbacks(kj::mv(callbacks)) {}
+
+  inline size_t size() const { return entries.size(); }
+  inline bool empty() const { return entries.empty(); }
+  inline void clear() { tree.clear(); entries.clear(); }
+  inline void reserve(size_t size) { entries.reserve(size); }
+
+  inline Iterator begin() { return Iterator(entries.begin(), tree.begin()); }
+  inline Iterator end() { return Iterator(entries.begin(), tree.end()); }
+  inline ConstIterator begin() const { return ConstIterator(entries.begin(), tree.begin()); }
+  inline ConstIterator end() const { return ConstIterator(entries.begin(), tree.end()); }
+
+  template <typename KeyLike>
+  Iterator lowerBound(const KeyLike& key) {
+    return Iterator(entries.begin(), tree.lowerBound(SearchKeyImpl<KeyLike>(*this, key)));
+  }
+  template <typename KeyLike>
+  ConstIterator lowerBound(const KeyLike& key) const {
+    return ConstIterator(entries.begin(), tree.lowerBound(SearchKeyImpl<KeyLike>(*this, key)));
+  }
+  // Returns an iterator to the first entry whose key is not less than `key`.
+
+  Entry& insert(Key key, Value value) {
+    // Inserts a new entry.  Throws if the key is already present.
+    uint row = entries.size();
+    Entry& entry = entries.add(Entry { kj::mv(key), kj::mv(value) });
+    KJ_IF_MAYBE(existing, tree.insert(SearchKeyImpl<Key>(*this, entry.key), row)) {
+      entries.removeLast();
+      KJ_FAIL_REQUIRE("inserted duplicate key into TreeMap") { break; }
+      return entries[*existing];
+    }
+    return entry;
+  }
+
+  Entry& upsert(Key key, Value value) {
+    // Inserts a new entry, or replaces the value of the existing entry with the same key.
+    uint row = entries.size();
+    Entry& entry = entries.add(Entry { kj::mv(key), kj::mv(value) });
+    KJ_IF_MAYBE(existing, tree.insert(SearchKeyImpl<Key>(*this, entry.key), row)) {
+      entries[*existing].value = kj::mv(entry.value);
+      entries.removeLast();
+      return entries[*existing];
+    }
+    return entry;
+  }
+
+  template <typename KeyLike>
+  Maybe<Value&> find(const KeyLike& key) {
+    KJ_IF_MAYBE(row, tree.find(SearchKeyImpl<KeyLike>(*this, key))) {
+      return entries[*row].value;
+    }
+    return nullptr;
+  }
+  template <typename KeyLike>
+  Maybe<const Value&> find(const KeyLike& key) const {
+    KJ_IF_MAYBE(row, tree.find(SearchKeyImpl<KeyLike>(*this, key))) {
+      return entries[*row].value;
+    }
+    return nullptr;
+  }
+
+  template <typename KeyLike, typename Func>
+  Value& findOrCreate(const KeyLike& key, Func&& createEntry) {
+    // Returns the value for `key`.  If there is none, calls `createEntry()`, which must return an
+    // Entry for that key, and inserts it.  `createEntry()` must not modify the map.
+    KJ_IF_MAYBE(row, tree.find(SearchKeyImpl<KeyLike>(*this, key))) {
+      return entries[*row].value;
+    }
+    uint row = entries.size();
+    Entry& entry = entries.add(createEntry());
+    KJ_IF_MAYBE(existing, tree.insert(SearchKeyImpl<Key>(*this, entry.key), row)) {
+      entries.removeLast();
+      KJ_FAIL_ASSERT("createEntry() returned an entry with the wrong key") { break; }
+      return entries[*existing].value;
+    }
+    return entry.value;
+  }
+
+  template <typename KeyLike>
+  bool erase(const KeyLike& key) {
+    // Removes the entry for `key`, returning false if there was none.  Moves the last entry (in
+    // insertion order, not key order) into the erased one's place.
+    KJ_IF_MAYBE(row, tree.erase(SearchKeyImpl<KeyLike>(*this, key))) {
+      uint last = entries.size() - 1;
+      if (*row != last) {
+        tree.renumber(last, *row, SearchKeyImpl<Key>(*this, entries[last].key));
+        entries[*row] = kj::mv(entries[last]);
+      }
+      entries.removeLast();
+      return true;
+    }
+    return false;
+  }
+
+private:
+  Vector<Entry> entries;
+  _::BTreeImpl tree;
+  Callbacks callbacks;
+
+  template <typename KeyLike>
+  class SearchKeyImpl final: public _::BTreeImpl::SearchKey {
+  public:
+    inline SearchKeyImpl(const TreeMap& map, const KeyLike& key): map(map), key(key) {}
+
+    bool isAfter(uint row) const override {
+      return map.callbacks.isBefore(map.entries[row].key, key);
+    }
+    bool matches(uint row) const override {
+      return map.callbacks.matches(map.entries[row].key, key);
+    }
+
+  private:
+    const TreeMap& map;
+    const KeyLike& key;
+  };
+};
+
+}  // namespace kj
@@ -24,6 +24,7 @@
 #include "thread.h"
 #include <kj/compat/gtest.h>
 #include <stdlib.h>
+#include <string.h>
 
 #if _WIN32
 #define NOGDI  // NOGDI is needed to make EXPECT_EQ(123u, *lock) compile for some reason
@@ -172,6 +173,103 @@ TEST(Mutex, When) {
 }
 #endif
 
+TEST(Mutex, Contention) {
+  // Several threads hammering one lock, with both exclusive and shared locks, so that the spin
+  // and sleep paths all get exercised.
+  MutexGuarded<uint64_t> value(0);
+
+  {
+    auto threads = heapArrayBuilder<Own<Thread>>(4);
+    for (uint t = 0; t < threads.capacity(); t++) {
+      threads.add(heap<Thread>([&,t]() {
+        for (uint i = 0; i < 20000; i++) {
+          if (t % 2 == 0 || i % 4 == 0) {
+            ++*value.lockExclusive();
+          } else {
+            KJ_ASSERT(*value.lockShared() <= 50000);
+          }
+        }
+      }));
+    }
+  }
+
+  EXPECT_EQ(50000u, *value.lockShared());
+}
+
+#if !_WIN32  // Profiling not implemented on win32.
+TEST(Mutex, Profiling) {
+  MutexGuarded<uint> value(0);
+  value.setProfilingName("mutex-test Profiling");
+  MutexGuarded<uint> other(0);
+  static const MutexProfilingName OTHER_NAME("mutex-test Profiling");
+  other.setProfilingName(OTHER_NAME);  // aggregated with `value`
+
+  // Nothing is recorded while profiling is disabled.
+  resetMutexProfile();
+  *value.lockExclusive() = 1;
+
+  setMutexProfilingEnabled(true);
+  KJ_DEFER(setMutexProfilingEnabled(false));
+
+  *other.lockShared();
+
+  auto findEntry = [&]() {
+    MutexProfileEntry result = { nullptr, 0, 0, 0, 0, 0 };
+    for (auto& e: getMutexProfile()) {
+      if (StringPtr(e.name) == "mutex-test Profiling") {
+        EXPECT_TRUE(result.name == nullptr);
+        result = e;
+      }
+    }
+    return result;
+  };
+
+  // Hold the lock until the other thread is about to take it, and a while longer. On a loaded
+  // machine the thread may still not get there before we let go, so repeat until a contended
+  // acquisition has been recorded.
+  uint attempts = 0;
+  MutexProfileEntry entry;
+  do {
+    ++attempts;
+    {
+      auto lock = value.lockExclusive();
+      bool started = false;
+      Thread thread([&]() {
+        __atomic_store_n(&started, true, __ATOMIC_RELEASE);
+        *value.lockExclusive() = 2;
+      });
+      while (!__atomic_load_n(&started, __ATOMIC_ACQUIRE)) {
+        sched_yield();
+      }
+      delay();
+      lock.release();
+    }
+    entry = findEntry();
+  } while (entry.contended == 0 && attempts < 100);
+
+  ASSERT_TRUE(entry.name != nullptr);
+
+  // Both locks are counted each time, plus the shared lock of `other`.
+  EXPECT_EQ(1u + 2 * attempts, entry.acquisitions);
+  EXPECT_GE(entry.contended, 1u);
+  EXPECT_LE(entry.contended, attempts);
+  EXPECT_LE(entry.spun, entry.contended);
+  EXPECT_GE(entry.totalWaitNanos, entry.maxWaitNanos);
+
+  auto report = getMutexProfileReport();
+  EXPECT_TRUE(report.startsWith("mutex profile ("));
+  auto expected = kj::str("mutex-test Profiling: acquired ", entry.acquisitions,
+                          " times, contended ", entry.contended,
+                          " (", entry.spun, " resolved by spinning)");
+  KJ_EXPECT(strstr(report.cStr(), expected.cStr()) != nullptr, report);
+
+  resetMutexProfile();
+  for (auto& e: getMutexProfile()) {
+    EXPECT_EQ(0u, e.acquisitions);
+  }
+}
+#endif
+
 TEST(Mutex, Lazy) {
   Lazy<uint> lazy;
   volatile bool initStarted = false;
@@ -27,6 +27,7 @@
 
 #include "mutex.h"
 #include "debug.h"
+#include "vector.h"
 
 #if KJ_USE_FUTEX
 #include <unistd.h>
@@ -49,9 +50,116 @@
 #include <windows.h>
 #endif
 
+#if !_WIN32
+#include <time.h>
+#endif
+
+#include <string.h>
+#include <algorithm>
+
 namespace kj {
 namespace _ {  // private
 
+// =======================================================================================
+// Contention profiling
+
+struct MutexStats {
+  // Counters shared by every mutex with the same profiling name.  Never freed.
+
+  const char* name;
+  uint64_t acquisitions = 0;
+  uint64_t contended = 0;
+  uint64_t spun = 0;
+  uint64_t totalWaitNanos = 0;
+  uint64_t maxWaitNanos = 0;
+
+  MutexStats* next = nullptr;
+  // Next entry in `allMutexStats`.  Immutable once published.
+
+  explicit MutexStats(const char* name): name(name) {}
+
+  void recordAcquired() {
+    __atomic_fetch_add(&acquisitions, 1, __ATOMIC_RELAXED);
+  }
+
+  void recordContended(uint64_t waitNanos, bool spun) {
+    __atomic_fetch_add(&acquisitions, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&contended, 1, __ATOMIC_RELAXED);
+    if (spun) __atomic_fetch_add(&this->spun, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&totalWaitNanos, waitNanos, __ATOMIC_RELAXED);
+
+    uint64_t max = __atomic_load_n(&maxWaitNanos, __ATOMIC_RELAXED);
+    while (waitNanos > max &&
+           !__atomic_compare_exchange_n(&maxWaitNanos, &max, waitNanos, true,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {}
+  }
+};
+
+namespace {
+
+MutexStats* allMutexStats = nullptr;
+// Push-only list of all names ever registered.
+
+bool mutexProfilingEnabled = false;
+
+#if !_WIN32
+uint64_t monotonicNanos() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return uint64_t(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
+
+class ContentionTimer {
+  // Times one contended acquisition, if profiling.
+
+public:
+  explicit ContentionTimer(MutexStats* stats)
+      : stats(stats), start(stats == nullptr ? 0 : monotonicNanos()) {}
+
+  void acquired(bool spun) {
+    if (stats != nullptr) stats->recordContended(monotonicNanos() - start, spun);
+  }
+
+private:
+  MutexStats* stats;
+  uint64_t start;
+};
+#endif
+
+MutexStats* findMutexStats(const char* name) {
+  // Returns the entry for `name`, adding one if needed.
+
+  MutexStats* head = __atomic_load_n(&allMutexStats, __ATOMIC_ACQUIRE);
+  for (MutexStats* entry = head; entry != nullptr; entry = entry->next) {
+    if (entry->name == name) return entry;
+  }
+  for (MutexStats* entry = head; entry != nullptr; entry = entry->next) {
+    if (strcmp(entry->name, name) == 0) return entry;
+  }
+
+  // Not found.  If another thread registers the same name concurrently we end up with two entries,
+  // which getMutexProfile() merges.
+  MutexStats* entry = new MutexStats(name);
+  entry->next = head;
+  while (!__atomic_compare_exchange_n(&allMutexStats, &entry->next, entry, true,
+                                      __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {}
+  return entry;
+}
+
+}  // namespace
+
+void Mutex::setProfilingName(const char* name) {
+  stats = findMutexStats(name);
+}
+
+inline MutexStats* Mutex::profilingStats() {
+  if (KJ_LIKELY(stats == nullptr) ||
+      KJ_LIKELY(!__atomic_load_n(&mutexProfilingEnabled, __ATOMIC_RELAXED))) {
+    return nullptr;
+  }
+  return stats;
+}
+
 #if KJ_USE_FUTEX
 // =======================================================================================
 // Futex-based implementation (Linux-only)
@@ -62,47 +170,163 @@ Mutex::~Mutex() {
   KJ_ASSERT(futex == 0, "Mutex destroyed while locked.") { break; }
 }
 
-void Mutex::lock(Exclusivity exclusivity) {
-  switch (exclusivity) {
-    case EXCLUSIVE:
-      for (;;) {
-        uint state = 0;
-        if (KJ_LIKELY(__atomic_compare_exchange_n(&futex, &state, EXCLUSIVE_HELD, false,
-                                                  __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))) {
-          // Acquired.
-          break;
-        }
+namespace {
 
-        // The mutex is contended.  Set the exclusive-requested bit and wait.
-        if ((state & EXCLUSIVE_REQUESTED) == 0) {
-          if (!__atomic_compare_exchange_n(&futex, &state, state | EXCLUSIVE_REQUESTED, false,
-                                           __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
-            // Oops, the state changed before we could set the request bit.  Start over.
-            continue;
-          }
+inline void cpuRelax() {
+  // Tell the CPU we're spinning, so it can yield to a hyperthread sibling and avoid a pipeline
+  // flush when the lock word changes.
+#if defined(__i386__) || defined(__x86_64__)
+  __builtin_ia32_pause();
+#elif defined(__aarch64__) || defined(__arm__)
+  asm volatile("yield" ::: "memory");
+#endif
+}
 
-          state |= EXCLUSIVE_REQUESTED;
-        }
+constexpr uint MIN_SPINS = 16;
+constexpr uint MAX_SPINS = 128;
+// Bounds on how many times lock() polls a contended mutex before sleeping in the kernel.  A
+// futex wait plus the matching wake costs a couple of microseconds in syscalls alone, so if the
+// holder is about to release -- the common case for the short critical sections KJ code tends
+// to have -- a brief spin is much cheaper.  Within these bounds, each mutex adapts to how long
+// spinning has actually taken to succeed on it recently.
+
+const bool spinningUseful = sysconf(_SC_NPROCESSORS_ONLN) > 1;
+// On a single CPU the holder can't run while we spin, so spinning just wastes our timeslice.
 
-        syscall(SYS_futex, &futex, FUTEX_WAIT_PRIVATE, state, NULL, NULL, 0);
+}  // namespace
+
+void Mutex::lock(Exclusivity exclusivity) {
+  switch (exclusivity) {
+    case EXCLUSIVE: {
+      uint state = 0;
+      if (KJ_LIKELY(__atomic_compare_exchange_n(&futex, &state, EXCLUSIVE_HELD, false,
+                                                __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))) {
+        // Acquired.
+        KJ_IF_MAYBE(s, profilingStats()) s->recordAcquired();
+        break;
       }
+      lockExclusiveContended();
       break;
+    }
     case SHARED: {
       uint state = __atomic_add_fetch(&futex, 1, __ATOMIC_ACQUIRE);
-      for (;;) {
-        if (KJ_LIKELY((state & EXCLUSIVE_HELD) == 0)) {
-          // Acquired.
-          break;
-        }
+      if (KJ_LIKELY((state & EXCLUSIVE_HELD) == 0)) {
+        // Acquired.
+        KJ_IF_MAYBE(s, profilingStats()) s->recordAcquired();
+        break;
+      }
+      lockSharedContended(state);
+      break;
+    }
+  }
+}
+
+void Mutex::lockExclusiveContended() {
+  ContentionTimer timer(profilingStats());
 
-        // The mutex is exclusively locked by another thread.  Since we incremented the counter
-        // already, we just have to wait for it to be unlocked.
-        syscall(SYS_futex, &futex, FUTEX_WAIT_PRIVATE, state, NULL, NULL, 0);
-        state = __atomic_load_n(&futex, __ATOMIC_ACQUIRE);
+  if (spinExclusive()) {
+    timer.acquired(true);
+    return;
+  }
+
+  for (;;) {
+    uint state = 0;
+    if (__atomic_compare_exchange_n(&futex, &state, EXCLUSIVE_HELD, false,
+                                    __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+      // Acquired.
+      break;
+    }
+
+    // The mutex is contended.  Set the exclusive-requested bit and wait.
+    if ((state & EXCLUSIVE_REQUESTED) == 0) {
+      if (!__atomic_compare_exchange_n(&futex, &state, state | EXCLUSIVE_REQUESTED, false,
+                                       __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+        // Oops, the state changed before we could set the request bit.  Start over.
+        continue;
       }
+
+      state |= EXCLUSIVE_REQUESTED;
+    }
+
+    syscall(SYS_futex, &futex, FUTEX_WAIT_PRIVATE, state, NULL, NULL, 0);
+  }
+
+  timer.acquired(false);
+}
+
+void Mutex::lockSharedContended(uint state) {
+  ContentionTimer timer(profilingStats());
+
+  if (spinShared()) {
+    timer.acquired(true);
+    return;
+  }
+
+  for (;;) {
+    if ((state & EXCLUSIVE_HELD) == 0) {
+      // Acquired.
+      break;
+    }
+
+    // The mutex is exclusively locked by another thread.  Since we incremented the counter
+    // already, we just have to wait for it to be unlocked.
+    syscall(SYS_futex, &futex, FUTEX_WAIT_PRIVATE, state, NULL, NULL, 0);
+    state = __atomic_load_n(&futex, __ATOMIC_ACQUIRE);
+  }
+
+  timer.acquired(false);
+}
+
+bool Mutex::spinExclusive() {
+  // Polls for the mutex to become free, and takes it if so.  Gives up early if other threads are
+  // already asleep waiting for it, since then there's a queue and we'd only be jumping it.
+
+  if (!spinningUseful) return false;
+
+  uint estimate = __atomic_load_n(&spinEstimate, __ATOMIC_RELAXED);
+  uint limit = kj::min(estimate * 2 + MIN_SPINS, MAX_SPINS);
+
+  uint i = 0;
+  bool acquired = false;
+  for (; i < limit; i++) {
+    cpuRelax();
+    uint state = __atomic_load_n(&futex, __ATOMIC_RELAXED);
+    if (state & EXCLUSIVE_REQUESTED) break;
+    if (state == 0 && __atomic_compare_exchange_n(&futex, &state, EXCLUSIVE_HELD, false,
+                                                  __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+      acquired = true;
       break;
     }
   }
+
+  // Move the estimate an eighth of the way towards this attempt's count, as glibc's adaptive
+  // mutexes do.  A failed attempt counts as the full limit, so a mutex that is held for long
+  // stretches drifts towards the maximum and then stops growing.
+  __atomic_store_n(&spinEstimate, estimate + (int(i) - int(estimate)) / 8, __ATOMIC_RELAXED);
+  return acquired;
+}
+
+bool Mutex::spinShared() {
+  // Our reader count is already in the futex word, so the shared lock is ours as soon as the
+  // exclusive holder releases.
+
+  if (!spinningUseful) return false;
+
+  uint estimate = __atomic_load_n(&spinEstimate, __ATOMIC_RELAXED);
+  uint limit = kj::min(estimate * 2 + MIN_SPINS, MAX_SPINS);
+
+  uint i = 0;
+  bool acquired = false;
+  for (; i < limit; i++) {
+    cpuRelax();
+    if ((__atomic_load_n(&futex, __ATOMIC_ACQUIRE) & EXCLUSIVE_HELD) == 0) {
+      acquired = true;
+      break;
+    }
+  }
+
+  __atomic_store_n(&spinEstimate, estimate + (int(i) - int(estimate)) / 8, __ATOMIC_RELAXED);
+  return acquired;
 }
 
 struct Mutex::Waiter {
@@ -385,6 +609,28 @@ Mutex::~Mutex() {
 }
 
 void Mutex::lock(Exclusivity exclusivity) {
+  KJ_IF_MAYBE(s, profilingStats()) {
+    // Try first, so we can tell whether we had to wait.
+    int error = exclusivity == EXCLUSIVE ? pthread_rwlock_trywrlock(&mutex)
+                                         : pthread_rwlock_tryrdlock(&mutex);
+    if (error == 0) {
+      s->recordAcquired();
+      return;
+    }
+
+    ContentionTimer timer(s);
+    switch (exclusivity) {
+      case EXCLUSIVE:
+        KJ_PTHREAD_CALL(pthread_rwlock_wrlock(&mutex));
+        break;
+      case SHARED:
+        KJ_PTHREAD_CALL(pthread_rwlock_rdlock(&mutex));
+        break;
+    }
+    timer.acquired(false);
+    return;
+  }
+
   switch (exclusivity) {
     case EXCLUSIVE:
       KJ_PTHREAD_CALL(pthread_rwlock_wrlock(&mutex));
@@ -450,4 +696,65 @@ void Once::reset() {
 #endif
 
 }  // namespace _ (private)
+
+MutexProfilingName::MutexProfilingName(const char* name): stats(_::findMutexStats(name)) {}
+
+void setMutexProfilingEnabled(bool enabled) {
+  __atomic_store_n(&_::mutexProfilingEnabled, enabled, __ATOMIC_RELAXED);
+}
+
+Array<MutexProfileEntry> getMutexProfile() {
+  Vector<MutexProfileEntry> entries;
+  for (_::MutexStats* stats = __atomic_load_n(&_::allMutexStats, __ATOMIC_ACQUIRE);
+       stats != nullptr; stats = stats->next) {
+    MutexProfileEntry* entry = nullptr;
+    for (auto& e: entries) {
+      if (strcmp(e.name, stats->name) == 0) {
+        entry = &e;
+        break;
+      }
+    }
+    if (entry == nullptr) {
+      entry = &entries.add(MutexProfileEntry { stats->name, 0, 0, 0, 0, 0 });
+    }
+
+    entry->acquisitions += __atomic_load_n(&stats->acquisitions, __ATOMIC_RELAXED);
+    entry->contended += __atomic_load_n(&stats->contended, __ATOMIC_RELAXED);
+    entry->spun += __atomic_load_n(&stats->spun, __ATOMIC_RELAXED);
+    entry->totalWaitNanos += __atomic_load_n(&stats->totalWaitNanos, __ATOMIC_RELAXED);
+    entry->maxWaitNanos = kj::max(entry->maxWaitNanos,
+        __atomic_load_n(&stats->maxWaitNanos, __ATOMIC_RELAXED));
+  }
+
+  std::sort(entries.begin(), entries.end(),
+      [](const MutexProfileEntry& a, const MutexProfileEntry& b) {
+    return a.totalWaitNanos > b.totalWaitNanos;
+  });
+  return entries.releaseAsArray();
+}
+
+String getMutexProfileReport() {
+  auto entries = getMutexProfile();
+  Vector<String> lines(entries.size() + 1);
+  lines.add(kj::str("mutex profile (", entries.size(), " names):\n"));
+  for (auto& e: entries) {
+    lines.add(kj::str(
+        "  ", e.name, ": acquired ", e.acquisitions, " times, contended ", e.contended,
+        " (", e.spun, " resolved by spinning), waited ", e.totalWaitNanos / 1000, "us total, ",
+        e.maxWaitNanos / 1000, "us max\n"));
+  }
+  return kj::strArray(lines, "");
+}
+
+void resetMutexProfile() {
+  for (_::MutexStats* stats = __atomic_load_n(&_::allMutexStats, __ATOMIC_ACQUIRE);
+       stats != nullptr; stats = stats->next) {
+    __atomic_store_n(&stats->acquisitions, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&stats->contended, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&stats->spun, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&stats->totalWaitNanos, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&stats->maxWaitNanos, 0, __ATOMIC_RELAXED);
+  }
+}
+
 }  // namespace kj
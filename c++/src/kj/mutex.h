@@ -40,11 +40,15 @@
 
 namespace kj {
 
+class MutexProfilingName;
+
 // =======================================================================================
 // Private details -- public interfaces follow below.
 
 namespace _ {  // private
 
+struct MutexStats;
+
 class Mutex {
   // Internal implementation details.  See `MutexGuarded<T>`.
 
@@ -66,6 +70,10 @@ public:
   // non-trivial, assert that the mutex is locked (which should be good enough to catch problems
   // in unit tests).  In non-debug builds, do nothing.
 
+  void setProfilingName(const char* name);
+  inline void setProfilingName(const MutexProfilingName& name);
+  // See `MutexGuarded<T>::setProfilingName()`.
+
 #if KJ_USE_FUTEX    // TODO(soon): Implement on pthread & win32
   class Predicate {
   public:
@@ -77,6 +85,12 @@ public:
 #endif
 
 private:
+  MutexStats* stats = nullptr;
+  // Where to record contention, if this mutex has been given a profiling name.
+
+  MutexStats* profilingStats();
+  // Returns `stats` if profiling is currently enabled, else null.
+
 #if KJ_USE_FUTEX
   uint futex;
   // bit 31 (msb) = set if exclusive lock held
@@ -89,11 +103,20 @@ private:
   static constexpr uint EXCLUSIVE_REQUESTED = 1u << 30;
   static constexpr uint SHARED_COUNT_MASK = EXCLUSIVE_REQUESTED - 1;
 
+  uint spinEstimate = 0;
+  // Running average of how many spins it took to acquire this mutex under contention, used to
+  // decide how long to spin next time.  Updated racily; it's only a hint.
+
   struct Waiter;
   kj::Maybe<Waiter&> waitersHead = nullptr;
   kj::Maybe<Waiter&>* waitersTail = &waitersHead;
   // linked list of waitUntil()s; can only modify under lock
 
+  void lockExclusiveContended();
+  void lockSharedContended(uint state);
+  bool spinExclusive();
+  bool spinShared();
+
 #elif _WIN32
   uintptr_t srwLock;  // Actually an SRWLOCK, but don't want to #include <windows.h> in header.
 
@@ -263,6 +286,17 @@ public:
   inline T& getAlreadyLockedExclusive() const;
   // Like `getWithoutLock()`, but asserts that the lock is already held by the calling thread.
 
+  inline void setProfilingName(const char* name) { mutex.setProfilingName(name); }
+  // Tags this mutex for contention profiling; see `setMutexProfilingEnabled()`.  Mutexes given the
+  // same name are reported together, so every instance of some class can share one name (the
+  // class name, say).  `name` must remain valid forever -- normally it is a string literal.  Call
+  // this before the MutexGuarded is shared with other threads.
+  //
+  // Naming a mutex looks the name up in a global list.  Where mutexes are constructed on a hot
+  // path, look the name up once instead, by passing a static `MutexProfilingName`.
+
+  inline void setProfilingName(const MutexProfilingName& name) { mutex.setProfilingName(name); }
+
 #if KJ_USE_FUTEX    // TODO(soon): Implement on pthread & win32
   template <typename Cond, typename Func>
   auto when(Cond&& condition, Func&& callback) const -> decltype(callback(instance<T&>())) {
@@ -334,9 +368,74 @@ private:
   class InitImpl;
 };
 
+// =======================================================================================
+// Contention profiling
+
+class String;
+
+struct MutexProfileEntry {
+  const char* name;
+  // As passed to `MutexGuarded<T>::setProfilingName()`.
+
+  uint64_t acquisitions;
+  // Number of times a mutex with this name was locked, shared or exclusive.
+
+  uint64_t contended;
+  // Number of those acquisitions which found the mutex held and had to wait for it.
+
+  uint64_t spun;
+  // Number of contended acquisitions which got the mutex while spinning, without sleeping.
+
+  uint64_t totalWaitNanos;
+  uint64_t maxWaitNanos;
+  // Time spent waiting in contended acquisitions.
+};
+
+class MutexProfilingName {
+  // A profiling name, looked up once.  Passing this to `MutexGuarded<T>::setProfilingName()` just
+  // stores a pointer.  Typically a function-local static:
+  //
+  //     static const kj::MutexProfilingName NAME("MyClass");
+  //     mutex.setProfilingName(NAME);
+
+public:
+  explicit MutexProfilingName(const char* name);
+  // `name` must remain valid forever, as with `MutexGuarded<T>::setProfilingName()`.
+
+  KJ_DISALLOW_COPY(MutexProfilingName);
+
+private:
+  _::MutexStats* stats;
+
+  friend class _::Mutex;
+};
+
+void setMutexProfilingEnabled(bool enabled);
+// Turns contention profiling on or off for every mutex that has been given a name with
+// `MutexGuarded<T>::setProfilingName()`.  Profiling is off by default, in which case a named mutex
+// costs nothing extra.  While on, each lock of a named mutex does a few atomic increments, plus
+// two clock reads if it has to wait.
+//
+// Profiling is currently only implemented on Linux and with pthreads; on Windows the profile
+// stays empty.
+
+Array<MutexProfileEntry> getMutexProfile();
+// Returns the statistics gathered while profiling was enabled, one entry per name, sorted by total
+// wait time, worst first.
+
+String getMutexProfileReport();
+// Formats `getMutexProfile()` as a table, one line per name.
+
+void resetMutexProfile();
+// Zeroes all statistics.
+
 // =======================================================================================
 // Inline implementation details
 
+inline void _::Mutex::setProfilingName(const MutexProfilingName& name) {
+  stats = name.stats;
+}
+
 template <typename T>
 template <typename... Params>
 inline MutexGuarded<T>::MutexGuarded(Params&&... params)
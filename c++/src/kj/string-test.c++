@@ -191,6 +191,29 @@ KJ_TEST("string literals with _kj suffix") {
   KJ_EXPECT(kj::str(ARR) == "foo");
 }
 
+KJ_TEST("comparisons with C strings in either order") {
+  // Under C++20 these go through rewritten candidates rather than the free operators in string.h.
+  StringPtr ptr = "foo";
+  String str = kj::str("foo");
+
+  KJ_EXPECT("foo" == ptr);
+  KJ_EXPECT(ptr == "foo");
+  KJ_EXPECT("bar" != ptr);
+  KJ_EXPECT(ptr != "bar");
+  KJ_EXPECT(!("bar" == ptr));
+  KJ_EXPECT(!("foo" != ptr));
+
+  KJ_EXPECT("foo" == str);
+  KJ_EXPECT(str == "foo");
+  KJ_EXPECT("bar" != str);
+  KJ_EXPECT(str != "bar");
+  KJ_EXPECT(!("bar" == str));
+  KJ_EXPECT(!("foo" != str));
+
+  KJ_EXPECT(str == ptr);
+  KJ_EXPECT(ptr == str);
+}
+
 }  // namespace
 }  // namespace _ (private)
 }  // namespace kj
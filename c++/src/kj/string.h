@@ -145,8 +145,11 @@ private:
   friend constexpr kj::StringPtr (::operator "" _kj)(const char* str, size_t n);
 };
 
+#if !__cpp_impl_three_way_comparison
+// C++20 rewrites `a == b` as `b == a` itself, so these would recurse there.
 inline bool operator==(const char* a, const StringPtr& b) { return b == a; }
 inline bool operator!=(const char* a, const StringPtr& b) { return b != a; }
+#endif
 
 template <> char StringPtr::parseAs<char>() const;
 template <> signed char StringPtr::parseAs<signed char>() const;
@@ -235,8 +238,10 @@ private:
   Array<char> content;
 };
 
+#if !__cpp_impl_three_way_comparison
 inline bool operator==(const char* a, const String& b) { return b == a; }
 inline bool operator!=(const char* a, const String& b) { return b != a; }
+#endif
 
 String heapString(size_t size);
 // Allocate a String of the given size on the heap, not including NUL terminator.  The NUL
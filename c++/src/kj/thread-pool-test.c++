@@ -0,0 +1,209 @@
+// Copyright (c) 2017 Sandstorm Development Group, Inc. and contributors
+// Licensed under the MIT License:
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+#include "thread-pool.h"
+
+#if KJ_USE_FUTEX
+
+#include "async-unix.h"
+#include "debug.h"
+#include "thread.h"
+#include <kj/test.h>
+#include <atomic>
+#include <unistd.h>
+
+namespace kj {
+namespace {
+
+KJ_TEST("ThreadPool submit and wait") {
+  ThreadPool pool(4);
+  KJ_EXPECT(pool.getThreadCount() == 4);
+
+  auto future = pool.submit([]() { return 123; });
+  KJ_EXPECT(future.wait() == 123);
+
+  std::atomic<uint> counter(0);
+  auto voidFuture = pool.submit([&]() { counter.fetch_add(1); });
+  voidFuture.wait();
+  KJ_EXPECT(counter.load() == 1);
+
+  auto stringFuture = pool.submit([]() { return kj::str("foo", 123); });
+  KJ_EXPECT(stringFuture.wait() == "foo123");
+
+  auto failFuture = pool.submit([]() -> int { KJ_FAIL_ASSERT("oops"); });
+  KJ_EXPECT_THROW_MESSAGE("oops", failFuture.wait());
+}
+
+KJ_TEST("ThreadPool runs everything before shutting down") {
+  std::atomic<uint> counter(0);
+  {
+    ThreadPool pool(3);
+    for (uint i = 0; i < 1000; i++) {
+      // Dropping the Future doesn't cancel the task.
+      pool.submit([&]() { counter.fetch_add(1); });
+    }
+  }
+  KJ_EXPECT(counter.load() == 1000);
+}
+
+KJ_TEST("ThreadPool nested submissions are stolen by idle workers") {
+  ThreadPool pool(4);
+
+  // One task pushes a batch of work onto its own worker's deque, then blocks until all of it is
+  // done.  Only other workers can run that work, so this completes only if stealing works.
+  MutexGuarded<uint> done(0);
+  auto future = pool.submit([&]() {
+    for (uint i = 0; i < 100; i++) {
+      pool.submit([&]() { ++*done.lockExclusive(); });
+    }
+    done.when([](uint n) { return n == 100; }, [](uint&) {});
+  });
+  future.wait();
+  KJ_EXPECT(*done.lockShared() == 100);
+}
+
+KJ_TEST("ThreadPool parallelFor") {
+  ThreadPool pool(4);
+
+  auto items = heapArray<uint>(10000);
+  for (uint i = 0; i < items.size(); i++) items[i] = i;
+
+  pool.parallelFor(items.asPtr(), [](uint& item) { item *= 2; });
+  for (uint i = 0; i < items.size(); i++) {
+    KJ_ASSERT(items[i] == i * 2, i);
+  }
+
+  // Fewer items than threads, and none at all.
+  uint small[2] = { 1, 2 };
+  pool.parallelFor(arrayPtr(small, 2), [](uint& item) { item += 10; });
+  KJ_EXPECT(small[0] == 11);
+  KJ_EXPECT(small[1] == 12);
+  pool.parallelFor(ArrayPtr<uint>(), [](uint&) { KJ_FAIL_ASSERT("called on empty array"); });
+
+  // An exception comes out once everything else has stopped.
+  std::atomic<uint> processed(0);
+  KJ_EXPECT_THROW_MESSAGE("bad item", pool.parallelFor(items.asPtr(), [&](uint& item) {
+    if (item == 1234) KJ_FAIL_ASSERT("bad item");
+    processed.fetch_add(1);
+  }));
+  uint count = processed.load();
+  usleep(10000);
+  KJ_EXPECT(processed.load() == count);
+  KJ_EXPECT(count >= items.size() / 2);
+}
+
+KJ_TEST("ThreadPool parallelMap") {
+  ThreadPool pool(4);
+
+  auto items = heapArray<uint>(1000);
+  for (uint i = 0; i < items.size(); i++) items[i] = i;
+
+  Array<String> strings = pool.parallelMap(items.asPtr(), [](uint item) { return kj::str(item); });
+  KJ_ASSERT(strings.size() == items.size());
+  for (uint i = 0; i < items.size(); i++) {
+    KJ_ASSERT(strings[i] == kj::str(i));
+  }
+}
+
+KJ_TEST("ThreadPool nested parallelFor") {
+  // Tasks running on the pool can themselves use parallelFor() without deadlocking, even when
+  // every worker is doing so at once.
+  ThreadPool pool(2);
+
+  auto outer = heapArray<Array<uint>>(8);
+  for (auto& inner: outer) {
+    inner = heapArray<uint>(100);
+    for (auto& i: inner) i = 1;
+  }
+
+  pool.parallelFor(outer.asPtr(), [&](Array<uint>& inner) {
+    pool.parallelFor(inner.asPtr(), [](uint& i) { i += 1; });
+  });
+
+  for (auto& inner: outer) {
+    for (auto i: inner) KJ_ASSERT(i == 2);
+  }
+}
+
+KJ_TEST("ThreadPool results as promises") {
+  UnixEventPort port;
+  EventLoop loop(port);
+  WaitScope waitScope(loop);
+
+  ThreadPool pool(2);
+
+  KJ_EXPECT(pool.run([]() { return 123; }).wait(waitScope) == 123);
+
+  // Already complete by the time it is converted.
+  auto future = pool.submit([]() { return kj::str("done"); });
+  while (!future.isReady()) usleep(1000);
+  KJ_EXPECT(future.toPromise().wait(waitScope) == "done");
+
+  auto promise = pool.run([]() -> int { KJ_FAIL_ASSERT("task failed"); });
+  KJ_EXPECT_THROW_MESSAGE("task failed", promise.wait(waitScope));
+
+  // Several results coming back at once, in whatever order they finish.
+  auto builder = heapArrayBuilder<Promise<uint>>(50);
+  for (uint i = 0; i < 50; i++) {
+    builder.add(pool.run([i]() { return i * i; }));
+  }
+  auto results = joinPromises(builder.finish()).wait(waitScope);
+  for (uint i = 0; i < 50; i++) {
+    KJ_EXPECT(results[i] == i * i);
+  }
+}
+
+KJ_TEST("newCrossThreadPromiseAndFulfiller") {
+  UnixEventPort port;
+  EventLoop loop(port);
+  WaitScope waitScope(loop);
+
+  {
+    auto paf = newCrossThreadPromiseAndFulfiller<int>();
+    Thread thread([&]() {
+      usleep(10000);
+      paf.fulfiller->fulfill(123);
+    });
+    KJ_EXPECT(paf.promise.wait(waitScope) == 123);
+  }
+
+  {
+    auto paf = newCrossThreadPromiseAndFulfiller<void>();
+    Thread thread([&]() {
+      paf.fulfiller->reject(KJ_EXCEPTION(FAILED, "rejected elsewhere"));
+    });
+    KJ_EXPECT_THROW_MESSAGE("rejected elsewhere", paf.promise.wait(waitScope));
+  }
+
+  {
+    // Dropping the fulfiller on the other thread rejects the promise.
+    auto paf = newCrossThreadPromiseAndFulfiller<int>();
+    Thread thread([&]() {
+      paf.fulfiller = nullptr;
+    });
+    KJ_EXPECT_THROW_MESSAGE("without fulfilling", paf.promise.wait(waitScope));
+  }
+}
+
+}  // namespace
+}  // namespace kj
+
+#endif  // KJ_USE_FUTEX
@@ -0,0 +1,334 @@
+// Copyright (c) 2017 Sandstorm Development Group, Inc. and contributors
+// Licensed under the MIT License:
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+#include "thread-pool.h"
+
+#if KJ_USE_FUTEX
+
+#include "debug.h"
+#include "thread.h"
+#include "vector.h"
+#include <atomic>
+#include <unistd.h>
+
+namespace kj {
+
+namespace _ {  // private
+
+ThreadPoolTask::~ThreadPoolTask() noexcept(false) {}
+
+}  // namespace _ (private)
+
+namespace {
+
+struct TaskDeque {
+  // A worker's queue of tasks.  The owning worker pushes and pops at the back; other workers
+  // steal from the front.
+  //
+  // Guarded by a mutex rather than lock-free: the lock is uncontended unless the worker is being
+  // stolen from, and tasks submitted to the pool are meant to be coarse.
+
+  Vector<Own<_::ThreadPoolTask>> tasks;
+  size_t head = 0;
+  // Index of the oldest task not yet stolen.  Stolen slots are reclaimed once the deque empties,
+  // or once they make up half the vector.
+
+  void push(Own<_::ThreadPoolTask> task) {
+    tasks.add(kj::mv(task));
+  }
+
+  Maybe<Own<_::ThreadPoolTask>> popBack() {
+    if (head == tasks.size()) return nullptr;
+    Own<_::ThreadPoolTask> result = kj::mv(tasks.back());
+    tasks.removeLast();
+    if (head == tasks.size()) reset();
+    return kj::mv(result);
+  }
+
+  Maybe<Own<_::ThreadPoolTask>> popFront() {
+    if (head == tasks.size()) return nullptr;
+    Own<_::ThreadPoolTask> result = kj::mv(tasks[head++]);
+    if (head == tasks.size()) {
+      reset();
+    } else if (head >= 64 && head * 2 >= tasks.size()) {
+      compact();
+    }
+    return kj::mv(result);
+  }
+
+  void reset() {
+    tasks.clear();
+    head = 0;
+  }
+
+  void compact() {
+    size_t n = tasks.size() - head;
+    for (size_t i = 0; i < n; i++) {
+      tasks[i] = kj::mv(tasks[head + i]);
+    }
+    tasks.resize(n);
+    head = 0;
+  }
+};
+
+}  // namespace
+
+struct ThreadPool::Impl {
+  struct Worker {
+    const Impl& pool;
+    uint index;
+    MutexGuarded<TaskDeque> deque;
+
+    Worker(const Impl& pool, uint index): pool(pool), index(index) {}
+  };
+
+  struct SleepState {
+    uint wakeups = 0;
+    // Number of sleeping workers that should wake up.  Each worker that wakes consumes one, so
+    // that a single submitted task wakes a single worker.
+
+    bool shutdown = false;
+  };
+
+  Array<Own<Worker>> workers;
+  MutexGuarded<SleepState> sleep;
+
+  mutable std::atomic<size_t> queued { 0 };
+  // Number of tasks sitting in deques, across all workers.
+
+  mutable std::atomic<uint> idle { 0 };
+  // Number of workers that are asleep or about to go to sleep.
+
+  mutable std::atomic<uint> nextWorker { 0 };
+  // Round-robin counter for tasks submitted from outside the pool.
+
+  Array<Own<Thread>> threads;
+  // Declared last so that the threads are joined before anything else is torn down.
+
+  static thread_local const Worker* currentWorker;
+
+  explicit Impl(uint threadCount) {
+    auto builder = heapArrayBuilder<Own<Worker>>(threadCount);
+    for (uint i = 0; i < threadCount; i++) {
+      builder.add(kj::heap<Worker>(*this, i));
+    }
+    workers = builder.finish();
+
+    auto threadBuilder = heapArrayBuilder<Own<Thread>>(threadCount);
+    for (auto& worker: workers) {
+      Worker& w = *worker;
+      threadBuilder.add(kj::heap<Thread>([this, &w]() { workerLoop(w); }));
+    }
+    threads = threadBuilder.finish();
+  }
+
+  void submit(Own<_::ThreadPoolTask> task) const {
+    const Worker* target = currentWorker;
+    if (target == nullptr || &target->pool != this) {
+      target = workers[nextWorker.fetch_add(1, std::memory_order_relaxed) % workers.size()].get();
+    }
+    target->deque.lockExclusive()->push(kj::mv(task));
+
+    // Pairs with the idle/queued dance in workerLoop(): either we see the worker as idle and wake
+    // it, or it sees our task before going to sleep.
+    queued.fetch_add(1, std::memory_order_seq_cst);
+    if (idle.load(std::memory_order_seq_cst) > 0) {
+      auto lock = sleep.lockExclusive();
+      if (lock->wakeups < idle.load(std::memory_order_relaxed)) {
+        ++lock->wakeups;
+      }
+    }
+  }
+
+  Maybe<Own<_::ThreadPoolTask>> findTask(Maybe<const Worker&> self) const {
+    if (queued.load(std::memory_order_acquire) == 0) return nullptr;
+
+    uint start = 0;
+    KJ_IF_MAYBE(s, self) {
+      KJ_IF_MAYBE(task, s->deque.lockExclusive()->popBack()) {
+        queued.fetch_sub(1, std::memory_order_relaxed);
+        return kj::mv(*task);
+      }
+      start = s->index + 1;
+    }
+
+    for (uint i = 0; i < workers.size(); i++) {
+      const Worker& victim = *workers[(start + i) % workers.size()];
+      KJ_IF_MAYBE(task, victim.deque.lockExclusive()->popFront()) {
+        queued.fetch_sub(1, std::memory_order_relaxed);
+        return kj::mv(*task);
+      }
+    }
+
+    return nullptr;
+  }
+
+  void workerLoop(const Worker& self) const {
+    currentWorker = &self;
+
+    for (;;) {
+      KJ_IF_MAYBE(task, findTask(self)) {
+        (*task)->run();
+        continue;
+      }
+
+      idle.fetch_add(1, std::memory_order_seq_cst);
+      if (queued.load(std::memory_order_seq_cst) > 0) {
+        idle.fetch_sub(1, std::memory_order_relaxed);
+        continue;
+      }
+
+      bool shutdown = sleep.when([](const SleepState& s) { return s.wakeups > 0 || s.shutdown; },
+          [](SleepState& s) {
+        if (s.wakeups > 0) {
+          --s.wakeups;
+          return false;
+        }
+        return true;
+      });
+      idle.fetch_sub(1, std::memory_order_relaxed);
+
+      if (shutdown && queued.load(std::memory_order_acquire) == 0) break;
+    }
+
+    currentWorker = nullptr;
+  }
+};
+
+thread_local const ThreadPool::Impl::Worker* ThreadPool::Impl::currentWorker = nullptr;
+
+namespace {
+
+class ParallelJob final: public AtomicRefcounted {
+  // Shared by the caller of runParallel() and the helper tasks it submits.  Threads claim chunks
+  // until there are none left.  Helpers which start only after every chunk has been claimed touch
+  // nothing but this object -- in particular, not the body, which lives on the caller's stack --
+  // so the caller need only wait for chunks to finish, not for its helpers to be scheduled.
+
+public:
+  ParallelJob(size_t count, size_t chunkCount, _::ParallelBody& body)
+      : count(count), chunkCount(chunkCount), body(body) {
+    state.getWithoutLock().remaining = chunkCount;
+  }
+
+  bool runChunk() {
+    // Claims and runs one chunk.  Returns false if there were none left.
+
+    size_t chunk = nextChunk.fetch_add(1, std::memory_order_relaxed);
+    if (chunk >= chunkCount) return false;
+
+    size_t begin = count * chunk / chunkCount;
+    size_t end = count * (chunk + 1) / chunkCount;
+    Maybe<Exception> exception = kj::runCatchingExceptions([&]() { body.run(begin, end); });
+
+    auto lock = state.lockExclusive();
+    KJ_IF_MAYBE(e, exception) {
+      if (lock->exception == nullptr) lock->exception = kj::mv(*e);
+    }
+    --lock->remaining;
+    return true;
+  }
+
+  Maybe<Exception> wait() {
+    return state.when([](const State& s) { return s.remaining == 0; },
+                      [](State& s) { return kj::mv(s.exception); });
+  }
+
+private:
+  size_t count;
+  size_t chunkCount;
+  _::ParallelBody& body;
+
+  std::atomic<size_t> nextChunk { 0 };
+
+  struct State {
+    size_t remaining = 0;
+    // Chunks not yet finished.
+
+    Maybe<Exception> exception;
+  };
+  MutexGuarded<State> state;
+};
+
+class ParallelHelper final: public _::ThreadPoolTask {
+public:
+  explicit ParallelHelper(Own<ParallelJob> job): job(kj::mv(job)) {}
+
+  void run() override {
+    while (job->runChunk()) {}
+  }
+
+private:
+  Own<ParallelJob> job;
+};
+
+uint defaultThreadCount() {
+  long n = sysconf(_SC_NPROCESSORS_ONLN);
+  return n < 1 ? 1 : n;
+}
+
+}  // namespace
+
+ThreadPool::ThreadPool(uint threadCount)
+    : impl(kj::heap<Impl>(threadCount == 0 ? defaultThreadCount() : threadCount)) {}
+
+ThreadPool::~ThreadPool() noexcept(false) {
+  impl->sleep.lockExclusive()->shutdown = true;
+  impl = nullptr;  // joins the workers
+}
+
+uint ThreadPool::getThreadCount() const {
+  return impl->workers.size();
+}
+
+void ThreadPool::submitTask(Own<_::ThreadPoolTask> task) const {
+  impl->submit(kj::mv(task));
+}
+
+void ThreadPool::runParallel(size_t count, _::ParallelBody& body) const {
+  if (count == 0) return;
+
+  // A few chunks per thread, so that an uneven split still balances out.
+  uint threadCount = impl->workers.size();
+  size_t chunkCount = kj::min(count, size_t(threadCount) * 4);
+
+  if (chunkCount == 1) {
+    body.run(0, count);
+    return;
+  }
+
+  auto job = kj::atomicRefcounted<ParallelJob>(count, chunkCount, body);
+  size_t helpers = kj::min(chunkCount - 1, size_t(threadCount));
+  for (size_t i = 0; i < helpers; i++) {
+    impl->submit(kj::heap<ParallelHelper>(kj::atomicAddRef(*job)));
+  }
+
+  // Take our share.
+  while (job->runChunk()) {}
+
+  KJ_IF_MAYBE(exception, job->wait()) {
+    throwFatalException(kj::mv(*exception));
+  }
+}
+
+}  // namespace kj
+
+#endif  // KJ_USE_FUTEX
@@ -0,0 +1,339 @@
+// Copyright (c) 2017 Sandstorm Development Group, Inc. and contributors
+// Licensed under the MIT License:
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+#pragma once
+
+#if defined(__GNUC__) && !KJ_HEADER_WARNINGS
+#pragma GCC system_header
+#endif
+
+#include "async.h"
+#include "mutex.h"
+
+namespace kj {
+
+#if KJ_USE_FUTEX  // Workers sleep in MutexGuarded::when(), which is only implemented on futex.
+
+namespace _ {  // private
+
+class ThreadPoolTask {
+public:
+  virtual ~ThreadPoolTask() noexcept(false);
+  virtual void run() = 0;
+  // Must not throw.
+};
+
+class ParallelBody {
+public:
+  virtual void run(size_t begin, size_t end) = 0;
+  // Process items [begin, end).
+};
+
+template <typename T>
+class ThreadPoolResult;
+
+}  // namespace _ (private)
+
+class ThreadPool {
+  // A fixed set of worker threads for CPU-bound work -- canonicalizing or packing a large message,
+  // encoding JSON, compressing -- which would otherwise stall an event loop.
+  //
+  // Each worker has its own deque of tasks.  Tasks submitted from outside the pool are spread
+  // round-robin across the workers; tasks submitted by a task already running on a worker go on
+  // that worker's own deque, and are taken newest-first for cache locality.  A worker whose deque
+  // is empty steals the oldest task from another worker's deque before going to sleep.
+  //
+  // Results come back as `ThreadPool::Future`s, which can be waited on synchronously or turned
+  // into a Promise on the calling thread's EventLoop:
+  //
+  //     kj::Promise<kj::Array<capnp::word>> promise = pool.run([&message]() {
+  //       return capnp::messageToFlatArray(message);
+  //     });
+  //
+  // The pool does not copy or lock anything on the task's behalf: whatever a task references must
+  // stay alive, and unmodified by other threads, until the task completes.
+
+public:
+  explicit ThreadPool(uint threadCount = 0);
+  // Start `threadCount` workers, or one per hardware thread if zero.
+
+  KJ_DISALLOW_COPY(ThreadPool);
+  ~ThreadPool() noexcept(false);
+  // Runs every task already submitted, then joins the workers.
+
+  uint getThreadCount() const;
+
+  template <typename T>
+  class Future;
+
+  template <typename Func>
+  Future<_::ReturnType<Func, void>> submit(Func&& func) const;
+  // Runs `func()` on some worker.  Dropping the Future does not cancel the task.
+
+  template <typename Func>
+  Promise<_::ReturnType<Func, void>> run(Func&& func) const;
+  // Shorthand for `submit(func).toPromise()`.  Must be called on a thread with an EventLoop whose
+  // EventPort implements wake().  Cancelling the promise does not cancel the task.
+
+  template <typename T, typename Func>
+  void parallelFor(ArrayPtr<T> items, Func&& func) const;
+  // Calls `func(item)` for every element of `items`, spread across the pool, and returns when all
+  // calls have returned.  The calling thread takes its share of the work rather than sitting idle,
+  // so it is fine -- and efficient -- to call parallelFor() from within a task already running on
+  // the pool.  If a call throws, the items after it in the same chunk are skipped, other chunks
+  // still run, and the first exception is rethrown once they have finished.
+  //
+  // This blocks the calling thread, so an event loop should wrap it in run() instead.
+
+  template <typename T, typename Func>
+  auto parallelMap(ArrayPtr<T> items, Func&& func) const
+      -> Array<decltype(func(items[0]))>;
+  // Like parallelFor(), but collects each call's result into the corresponding element of the
+  // returned array.  The result type must be default-constructible.
+
+private:
+  struct Impl;
+  Own<Impl> impl;
+
+  void submitTask(Own<_::ThreadPoolTask> task) const;
+  void runParallel(size_t count, _::ParallelBody& body) const;
+};
+
+template <typename T>
+class ThreadPool::Future {
+  // The eventual result of a task submitted to a ThreadPool.  Call at most one of wait() or
+  // toPromise(), at most once.
+
+public:
+  Future(Future&&) = default;
+  Future& operator=(Future&&) = default;
+
+  bool isReady() const;
+  // True if the task has completed.
+
+  T wait();
+  // Blocks the calling thread until the task completes, then returns its result or rethrows its
+  // exception.  Don't call this from an event loop thread (use toPromise()), nor from a task
+  // running on the same pool (use parallelFor()), since the worker could otherwise end up waiting
+  // on a task queued behind itself.
+
+  Promise<T> toPromise();
+  // Returns a promise, on the calling thread's EventLoop, for the task's result.  The loop's
+  // EventPort is woken when the task completes.
+
+private:
+  Own<_::ThreadPoolResult<T>> result;
+
+  explicit Future(Own<_::ThreadPoolResult<T>> result): result(kj::mv(result)) {}
+  friend class ThreadPool;
+};
+
+// =======================================================================================
+// inline implementation details
+
+namespace _ {  // private
+
+template <typename T>
+class ThreadPoolResult final: public AtomicRefcounted {
+public:
+  void complete(ExceptionOr<FixVoid<T>>&& value) {
+    Own<PromiseFulfiller<T>> fulfiller;
+    {
+      auto lock = state.lockExclusive();
+      KJ_IF_MAYBE(f, lock->fulfiller) {
+        fulfiller = kj::mv(*f);
+        lock->fulfiller = nullptr;
+      } else {
+        lock->result = kj::mv(value);
+        lock->done = true;
+        return;
+      }
+      lock->done = true;
+    }
+    forward(*fulfiller, kj::mv(value));
+  }
+
+  bool isReady() const { return state.lockShared()->done; }
+
+  ExceptionOr<FixVoid<T>> wait() const {
+    return state.when([](const State& s) { return s.done; }, [](State& s) {
+      KJ_IF_MAYBE(r, s.result) {
+        auto value = kj::mv(*r);
+        s.result = nullptr;
+        return value;
+      } else {
+        return ExceptionOr<FixVoid<T>>(false, kj::Exception(kj::Exception::Type::FAILED,
+            __FILE__, __LINE__, kj::heapString("ThreadPool result was already consumed.")));
+      }
+    });
+  }
+
+  Promise<T> toPromise() const {
+    auto paf = newCrossThreadPromiseAndFulfiller<T>();
+    Maybe<ExceptionOr<FixVoid<T>>> ready;
+    {
+      auto lock = state.lockExclusive();
+      if (lock->done) {
+        ready = kj::mv(lock->result);
+        lock->result = nullptr;
+      } else {
+        lock->fulfiller = kj::mv(paf.fulfiller);
+      }
+    }
+    KJ_IF_MAYBE(r, ready) {
+      forward(*paf.fulfiller, kj::mv(*r));
+    }
+    return kj::mv(paf.promise);
+  }
+
+private:
+  struct State {
+    bool done = false;
+    Maybe<ExceptionOr<FixVoid<T>>> result;
+    Maybe<Own<PromiseFulfiller<T>>> fulfiller;
+    // Set if toPromise() was called before the task completed.
+  };
+  MutexGuarded<State> state;
+
+  static void forward(PromiseFulfiller<T>& fulfiller, ExceptionOr<FixVoid<T>>&& value) {
+    KJ_IF_MAYBE(exception, value.exception) {
+      fulfiller.reject(kj::mv(*exception));
+    } else KJ_IF_MAYBE(v, value.value) {
+      fulfiller.fulfill(kj::mv(*v));
+    }
+  }
+};
+
+template <typename Func, typename T>
+class ThreadPoolTaskImpl final: public ThreadPoolTask {
+public:
+  ThreadPoolTaskImpl(Func&& func, Own<ThreadPoolResult<T>> result)
+      : func(kj::fwd<Func>(func)), result(kj::mv(result)) {}
+
+  void run() override {
+    ExceptionOr<FixVoid<T>> output;
+    KJ_IF_MAYBE(exception, kj::runCatchingExceptions([&]() {
+      output = ExceptionOr<FixVoid<T>>(MaybeVoidCaller<Void, FixVoid<T>>::apply(func, Void()));
+    })) {
+      output.addException(kj::mv(*exception));
+    }
+    result->complete(kj::mv(output));
+  }
+
+private:
+  Decay<Func> func;
+  Own<ThreadPoolResult<T>> result;
+};
+
+template <typename T, typename Func>
+class ParallelForBody final: public ParallelBody {
+public:
+  ParallelForBody(ArrayPtr<T> items, Func& func): items(items), func(func) {}
+
+  void run(size_t begin, size_t end) override {
+    for (size_t i = begin; i < end; i++) {
+      func(items[i]);
+    }
+  }
+
+private:
+  ArrayPtr<T> items;
+  Func& func;
+};
+
+template <typename T, typename R, typename Func>
+class ParallelMapBody final: public ParallelBody {
+public:
+  ParallelMapBody(ArrayPtr<T> items, ArrayPtr<R> results, Func& func)
+      : items(items), results(results), func(func) {}
+
+  void run(size_t begin, size_t end) override {
+    for (size_t i = begin; i < end; i++) {
+      results[i] = func(items[i]);
+    }
+  }
+
+private:
+  ArrayPtr<T> items;
+  ArrayPtr<R> results;
+  Func& func;
+};
+
+}  // namespace _ (private)
+
+template <typename Func>
+ThreadPool::Future<_::ReturnType<Func, void>> ThreadPool::submit(Func&& func) const {
+  typedef _::ReturnType<Func, void> T;
+  auto result = kj::atomicRefcounted<_::ThreadPoolResult<T>>();
+  submitTask(kj::heap<_::ThreadPoolTaskImpl<Func, T>>(
+      kj::fwd<Func>(func), kj::atomicAddRef(*result)));
+  return Future<T>(kj::mv(result));
+}
+
+template <typename Func>
+Promise<_::ReturnType<Func, void>> ThreadPool::run(Func&& func) const {
+  return submit(kj::fwd<Func>(func)).toPromise();
+}
+
+template <typename T, typename Func>
+void ThreadPool::parallelFor(ArrayPtr<T> items, Func&& func) const {
+  _::ParallelForBody<T, Func> body(items, func);
+  runParallel(items.size(), body);
+}
+
+template <typename T, typename Func>
+auto ThreadPool::parallelMap(ArrayPtr<T> items, Func&& func) const
+    -> Array<decltype(func(items[0]))> {
+  typedef decltype(func(items[0])) R;
+  auto results = heapArray<R>(items.size());
+  _::ParallelMapBody<T, R, Func> body(items, results, func);
+  runParallel(items.size(), body);
+  return results;
+}
+
+template <typename T>
+bool ThreadPool::Future<T>::isReady() const {
+  return result->isReady();
+}
+
+template <typename T>
+T ThreadPool::Future<T>::wait() {
+  auto output = result->wait();
+  KJ_IF_MAYBE(value, output.value) {
+    KJ_IF_MAYBE(exception, output.exception) {
+      throwRecoverableException(kj::mv(*exception));
+    }
+    return _::returnMaybeVoid(kj::mv(*value));
+  } else KJ_IF_MAYBE(exception, output.exception) {
+    throwFatalException(kj::mv(*exception));
+  } else {
+    KJ_UNREACHABLE;
+  }
+}
+
+template <typename T>
+Promise<T> ThreadPool::Future<T>::toPromise() {
+  return result->toPromise();
+}
+
+#endif  // KJ_USE_FUTEX
+
+}  // namespace kj
@@ -24,6 +24,14 @@
 #include "debug.h"
 #include <set>
 
+#if _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#include "windows-sanity.h"
+#else
+#include <time.h>
+#endif
+
 namespace kj {
 
 const Clock& nullClock() {
@@ -35,4 +43,42 @@ const Clock& nullClock() {
   return NULL_CLOCK;
 }
 
+#if _WIN32
+
+const Clock& systemCoarseCalendarClock() {
+  class Win32Clock final: public Clock {
+  public:
+    Date now() const override {
+      // FILETIME counts 100ns intervals since Jan 1, 1601.
+      FILETIME ft;
+      GetSystemTimeAsFileTime(&ft);
+      int64_t ticks = (static_cast<int64_t>(ft.dwHighDateTime) << 32) | ft.dwLowDateTime;
+      return UNIX_EPOCH + (ticks - 116444736000000000ll) * 100 * NANOSECONDS;
+    }
+  };
+  static KJ_CONSTEXPR(const) Win32Clock CLOCK;
+  return CLOCK;
+}
+
+#else
+
+const Clock& systemCoarseCalendarClock() {
+  class PosixClock final: public Clock {
+  public:
+    Date now() const override {
+      struct timespec ts;
+#ifdef CLOCK_REALTIME_COARSE
+      KJ_SYSCALL(clock_gettime(CLOCK_REALTIME_COARSE, &ts));
+#else
+      KJ_SYSCALL(clock_gettime(CLOCK_REALTIME, &ts));
+#endif
+      return UNIX_EPOCH + ts.tv_sec * SECONDS + ts.tv_nsec * NANOSECONDS;
+    }
+  };
+  static KJ_CONSTEXPR(const) PosixClock CLOCK;
+  return CLOCK;
+}
+
+#endif
+
 }  // namespace kj
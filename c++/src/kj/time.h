@@ -69,4 +69,8 @@ const Clock& nullClock();
 // A clock which always returns UNIX_EPOCH as the current time. Useful when you don't care about
 // time.
 
+const Clock& systemCoarseCalendarClock();
+// The system's real-time clock, read in the cheapest way available. Precision may be as low as
+// the scheduler tick (a few milliseconds), which is fine for timestamps like HTTP's Date header.
+
 }  // namespace kj